@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include "ae.h"
 #include "anet.h"
 
@@ -48,6 +49,9 @@
 
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
+#ifdef HAVE_IO_URING
+#include "ae_iouring.c"
+#else
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
@@ -61,6 +65,7 @@
         #endif
     #endif
 #endif
+#endif
 
 
 aeEventLoop *aeCreateEventLoop(int setsize) {
@@ -494,6 +499,31 @@ char *aeGetApiName(void) {
     return aeApiName();
 }
 
+/* Return true if the multiplexing layer of the loop can submit many writes
+ * with a single system call, see aeWritevBatch(). */
+int aeCanWritevBatch(aeEventLoop *eventLoop) {
+#ifdef AE_HAVE_WRITEV_BATCH
+    return aeApiCanWritevBatch(eventLoop);
+#else
+    AE_NOTUSED(eventLoop);
+    return 0;
+#endif
+}
+
+/* Perform the writes in 'reqs', and store their results in the requests
+ * themselves, with as few system calls as possible. Returns AE_ERR without
+ * writing anything if aeCanWritevBatch() is false for the loop. */
+int aeWritevBatch(aeEventLoop *eventLoop, aeWritevReq *reqs, int count) {
+#ifdef AE_HAVE_WRITEV_BATCH
+    return aeApiWritevBatch(eventLoop,reqs,count);
+#else
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(reqs);
+    AE_NOTUSED(count);
+    return AE_ERR;
+#endif
+}
+
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
@@ -33,6 +33,8 @@
 #ifndef __AE_H__
 #define __AE_H__
 
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "monotonic.h"
 
 #define AE_OK 0
@@ -95,6 +97,15 @@ typedef struct aeFiredEvent {
     int mask;
 } aeFiredEvent;
 
+/* A write of aeWritevBatch() */
+typedef struct aeWritevReq {
+    int fd;
+    const struct iovec *iov;
+    int iovcnt;
+    ssize_t res;    /* Like the writev(2) return value, */
+    int err;        /* with the errno on errors. */
+} aeWritevReq;
+
 /* State of an event based program */
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
@@ -131,5 +142,7 @@ void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
+int aeCanWritevBatch(aeEventLoop *eventLoop);
+int aeWritevBatch(aeEventLoop *eventLoop, aeWritevReq *reqs, int count);
 
 #endif
@@ -0,0 +1,561 @@
+/* Linux io_uring based ae.c module.
+ *
+ * File events are io_uring poll requests. A request completes once, so the
+ * ones that fired are armed again, with the mask registered at that time, by
+ * the next aeApiPoll() call: that makes the events level triggered like with
+ * the other modules, and the new requests are submitted by the same
+ * io_uring_enter(2) call that waits for the completions. Nothing is submitted
+ * when the registered events change, except when all the events of a file
+ * are removed: the poll request holds a reference to the file, that the
+ * caller is likely going to close.
+ *
+ * The ring is also used to perform the writes to many sockets with a single
+ * system call, see aeApiWritevBatch().
+ *
+ * The completions are only processed when we wait for them in
+ * io_uring_enter(2) (IORING_SETUP_DEFER_TASKRUN): otherwise the kernel would
+ * interrupt the other blocking system calls of the thread to process them,
+ * and the reads with a timeout, like the ones of the diskless load of
+ * replicas, would fail with EINTR. This requires Linux 6.1, and the ring to
+ * be used by a single thread, the first one submitting to it.
+ *
+ * The rings are shared memory, inherited by the forked children: a child
+ * writing to them would submit requests to the ring of the parent, possibly
+ * removing its poll requests, so in any process other than the one that set
+ * up the ring the loop does nothing, see aeUringOwned().
+ *
+ * The rings are set up with the raw system calls, so no library is needed.
+ * When io_uring is not available (old kernels, or sandboxes forbidding it
+ * like the default seccomp profile of many container runtimes) the epoll
+ * module is used instead.
+ *
+ * Copyright (c) 2009-2021, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Defined by the headers of Linux 6.1 and newer. */
+#ifndef IORING_SETUP_DEFER_TASKRUN
+#define IORING_SETUP_R_DISABLED (1U << 6)
+#define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif
+
+/* The epoll module, used when io_uring is not available, with its functions
+ * renamed. */
+#define aeApiState aeEpollState
+#define aeApiCreate aeEpollCreate
+#define aeApiResize aeEpollResize
+#define aeApiFree aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll aeEpollPoll
+#define aeApiName aeEpollName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+/* Set if some loop is using epoll, for aeApiName(). */
+static int aeUringFallback = 0;
+
+/* Pid of the current process, updated in the forked children by a
+ * pthread_atfork() handler, that is cheaper than calling getpid() for
+ * every operation. */
+static pid_t aeUringPid = 0;
+
+#define AE_HAVE_WRITEV_BATCH
+
+#define AE_URING_ENTRIES 4096       /* Size of the submission queue. */
+/* The user data of the requests identifies the poll requests by file
+ * descriptor and generation, so that the completions of the requests that
+ * were removed meanwhile are ignored. */
+#define AE_URING_GEN_MASK 0x3fffffff
+#define AE_URING_BATCH (1ULL<<63)   /* A write of aeApiWritevBatch(). */
+#define AE_URING_IGNORE (1ULL<<62)  /* Nothing to do on completion. */
+#define aeUringPollData(fd,gen) (((uint64_t)(gen) << 32) | (uint32_t)(fd))
+
+typedef struct aeApiState {
+    aeEpollState *epoll;    /* Not NULL if using epoll instead of io_uring. */
+    pid_t owner;            /* Process that set up the ring. */
+    int ringfd;
+    int enabled;            /* True once the ring was enabled. */
+    /* Submission queue. */
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    /* Completion queue. */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Mappings of the rings. */
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    /* File events, indexed by file descriptor. */
+    int *armed;             /* Mask of the poll request in flight, if any. */
+    uint32_t *gen;          /* Generation of the last poll request. */
+    char *fired;            /* True if in the 'rearm' array. */
+    int *rearm;             /* Fired file events to arm again. */
+    int rearm_count;
+    int nfired;             /* Events already stored in eventLoop->fired. */
+    /* Writes of aeApiWritevBatch() in progress. */
+    aeWritevReq *batch;
+    int batch_inflight;
+} aeApiState;
+
+/* Call an epoll module function for a loop that is using it. */
+#define aeEpollCall(eventLoop,state,call) do { \
+    (eventLoop)->apidata = (state)->epoll; \
+    call; \
+    (eventLoop)->apidata = (state); \
+} while(0)
+
+/* True if the calling process is the one that set up the ring of 'state'. */
+#define aeUringOwned(state) ((state)->owner == aeUringPid)
+
+static void aeUringAtForkChild(void) {
+    aeUringPid = getpid();
+}
+
+static int aeUringSetup(aeApiState *state, int setsize) {
+    struct io_uring_params p;
+    int single_mmap;
+
+    memset(&p,0,sizeof(p));
+    /* The ring is created disabled, so that the thread that will use it,
+     * that may not be the one creating the loop, becomes its only issuer
+     * when enabling it, see aeUringEnter(). */
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_CLAMP|IORING_SETUP_R_DISABLED|
+              IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = setsize*2 > AE_URING_ENTRIES*2 ? setsize*2 : AE_URING_ENTRIES*2;
+    state->ringfd = syscall(__NR_io_uring_setup,AE_URING_ENTRIES,&p);
+    if (state->ringfd == -1) return -1;
+    anetCloexec(state->ringfd);
+
+    /* We rely on the timeout of io_uring_enter(2) (Linux 5.11), and on
+     * completions never being lost when the completion queue is full. */
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) goto err;
+
+    state->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    state->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (state->cq_ring_size > state->sq_ring_size)
+            state->sq_ring_size = state->cq_ring_size;
+        state->cq_ring_size = state->sq_ring_size;
+    }
+
+    state->sq_ring = mmap(NULL,state->sq_ring_size,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQ_RING);
+    if (state->sq_ring == MAP_FAILED) {
+        state->sq_ring = NULL;
+        goto err;
+    }
+    if (single_mmap) {
+        state->cq_ring = state->sq_ring;
+    } else {
+        state->cq_ring = mmap(NULL,state->cq_ring_size,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_CQ_RING);
+        if (state->cq_ring == MAP_FAILED) {
+            state->cq_ring = NULL;
+            goto err;
+        }
+    }
+    state->sqes = mmap(NULL,state->sqes_size,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    char *sq = state->sq_ring, *cq = state->cq_ring;
+    state->sq_entries = p.sq_entries;
+    state->sq_head = (unsigned*)(sq + p.sq_off.head);
+    state->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    state->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    state->sq_array = (unsigned*)(sq + p.sq_off.array);
+    state->cq_head = (unsigned*)(cq + p.cq_off.head);
+    state->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    state->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+err:
+    if (state->sqes) munmap(state->sqes,state->sqes_size);
+    if (state->cq_ring && state->cq_ring != state->sq_ring)
+        munmap(state->cq_ring,state->cq_ring_size);
+    if (state->sq_ring) munmap(state->sq_ring,state->sq_ring_size);
+    close(state->ringfd);
+    return -1;
+}
+
+/* Submit the queued requests and, if 'min_complete' is not zero or 'ts' is
+ * not NULL, process the completions and wait for 'min_complete' of them, or
+ * until the timeout 'ts' if not NULL. */
+static int aeUringEnter(aeApiState *state, unsigned min_complete,
+                        struct __kernel_timespec *ts)
+{
+    unsigned to_submit = *state->sq_tail -
+                         __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+    unsigned flags = (min_complete || ts) ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+
+    if (!to_submit && !flags) return 0;
+    if (!state->enabled) {
+        if (syscall(__NR_io_uring_register,state->ringfd,
+                    IORING_REGISTER_ENABLE_RINGS,NULL,0) == -1) return -1;
+        state->enabled = 1;
+    }
+    if (ts) {
+        memset(&arg,0,sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    return syscall(__NR_io_uring_enter,state->ringfd,to_submit,min_complete,
+                   flags,ts ? (void*)&arg : NULL,ts ? sizeof(arg) : 0);
+}
+
+/* Return a zeroed submission queue entry, queued for the next
+ * aeUringEnter() call. Returns NULL if the queue is full even after
+ * submitting what it contains. */
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    unsigned tail = *state->sq_tail;
+
+    if (tail - __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE) ==
+        state->sq_entries)
+    {
+        aeUringEnter(state,0,NULL);
+        if (tail - __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE) ==
+            state->sq_entries) return NULL;
+    }
+
+    /* The kernel reads the entries only when we call io_uring_enter(2), so
+     * it is fine to publish the new tail before the caller fills it. */
+    unsigned idx = tail & *state->sq_mask;
+    struct io_uring_sqe *sqe = &state->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    state->sq_array[idx] = idx;
+    __atomic_store_n(state->sq_tail,tail+1,__ATOMIC_RELEASE);
+    return sqe;
+}
+
+static int aeUringArm(aeApiState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    uint32_t events = 0;
+
+    if (!sqe) return -1;
+    if (mask & AE_READABLE) events |= POLLIN;
+    if (mask & AE_WRITABLE) events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+    state->gen[fd] = (state->gen[fd]+1) & AE_URING_GEN_MASK;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = aeUringPollData(fd,state->gen[fd]);
+    state->armed[fd] = mask;
+    return 0;
+}
+
+static int aeUringDisarm(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (state->armed[fd] == AE_NONE) return 0;
+    if ((sqe = aeUringGetSqe(state)) == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = aeUringPollData(fd,state->gen[fd]);
+    sqe->user_data = AE_URING_IGNORE;
+    state->armed[fd] = AE_NONE;
+    /* The removed request completes with -ECANCELED, or it may have fired
+     * already: either way its completion must be ignored. */
+    state->gen[fd] = (state->gen[fd]+1) & AE_URING_GEN_MASK;
+    return 0;
+}
+
+/* Process the available completions: the fired file events are stored in
+ * eventLoop->fired, for the next aeApiPoll() call to return them, and the
+ * results of the batched writes in the requests. */
+static void aeUringReap(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned head = *state->cq_head;
+    unsigned tail = __atomic_load_n(state->cq_tail,__ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+
+        head++;
+        if (data & AE_URING_BATCH) {
+            aeWritevReq *req = &state->batch[data & ~AE_URING_BATCH];
+            req->res = res < 0 ? -1 : res;
+            req->err = res < 0 ? -res : 0;
+            state->batch_inflight--;
+        } else if (!(data & AE_URING_IGNORE)) {
+            int fd = (uint32_t)data, mask = 0;
+
+            if (fd >= eventLoop->setsize || state->armed[fd] == AE_NONE ||
+                state->gen[fd] != (data >> 32)) continue;
+
+            if (res < 0 || (res & (POLLERR|POLLHUP)))
+                mask |= AE_READABLE|AE_WRITABLE;
+            if (res > 0 && (res & POLLIN)) mask |= AE_READABLE;
+            if (res > 0 && (res & POLLOUT)) mask |= AE_WRITABLE;
+            state->armed[fd] = AE_NONE;
+            /* A file may fire twice before aeApiPoll() returns, if it was
+             * armed again meanwhile. If there is no room left the event is
+             * just armed again: it will fire again since it is still ready. */
+            if (state->nfired < eventLoop->setsize) {
+                eventLoop->fired[state->nfired].fd = fd;
+                eventLoop->fired[state->nfired].mask = mask;
+                state->nfired++;
+            }
+            if (!state->fired[fd]) {
+                state->fired[fd] = 1;
+                state->rearm[state->rearm_count++] = fd;
+            }
+        }
+    }
+    __atomic_store_n(state->cq_head,head,__ATOMIC_RELEASE);
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+
+    if (!state) return -1;
+    if (aeUringPid == 0) {
+        aeUringPid = getpid();
+        pthread_atfork(NULL,NULL,aeUringAtForkChild);
+    }
+    state->owner = aeUringPid;
+    if (aeUringSetup(state,eventLoop->setsize) == -1) {
+        /* Fall back to epoll. */
+        eventLoop->apidata = NULL;
+        if (aeEpollCreate(eventLoop) == -1) {
+            zfree(state);
+            return -1;
+        }
+        state->epoll = eventLoop->apidata;
+        eventLoop->apidata = state;
+        aeUringFallback = 1;
+        return 0;
+    }
+    state->armed = zcalloc(sizeof(int)*eventLoop->setsize);
+    state->gen = zcalloc(sizeof(uint32_t)*eventLoop->setsize);
+    state->fired = zcalloc(eventLoop->setsize);
+    state->rearm = zmalloc(sizeof(int)*eventLoop->setsize);
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    int oldsize = eventLoop->setsize, retval;
+
+    if (state->epoll) {
+        aeEpollCall(eventLoop,state,retval = aeEpollResize(eventLoop,setsize));
+        return retval;
+    }
+    state->armed = zrealloc(state->armed,sizeof(int)*setsize);
+    state->gen = zrealloc(state->gen,sizeof(uint32_t)*setsize);
+    state->fired = zrealloc(state->fired,setsize);
+    state->rearm = zrealloc(state->rearm,sizeof(int)*setsize);
+    /* Resizing is only allowed if no fd above 'setsize' is in use, but
+     * when growing the new slots must be initialized. */
+    for (int j = oldsize; j < setsize; j++) {
+        state->armed[j] = AE_NONE;
+        state->gen[j] = 0;
+        state->fired[j] = 0;
+    }
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->epoll) {
+        aeEpollCall(eventLoop,state,aeEpollFree(eventLoop));
+        zfree(state);
+        return;
+    }
+    munmap(state->sqes,state->sqes_size);
+    if (state->cq_ring != state->sq_ring)
+        munmap(state->cq_ring,state->cq_ring_size);
+    munmap(state->sq_ring,state->sq_ring_size);
+    close(state->ringfd);
+    zfree(state->armed);
+    zfree(state->gen);
+    zfree(state->fired);
+    zfree(state->rearm);
+    zfree(state);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    int retval;
+
+    if (state->epoll) {
+        aeEpollCall(eventLoop,state,retval = aeEpollAddEvent(eventLoop,fd,mask));
+        return retval;
+    }
+    if (!aeUringOwned(state)) return 0;
+    mask = (mask | eventLoop->events[fd].mask) & (AE_READABLE|AE_WRITABLE);
+    if (state->armed[fd] == mask) return 0;
+    if (aeUringDisarm(state,fd) == -1) return -1;
+    return aeUringArm(state,fd,mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    int mask = eventLoop->events[fd].mask & (~delmask) &
+               (AE_READABLE|AE_WRITABLE);
+
+    if (state->epoll) {
+        aeEpollCall(eventLoop,state,aeEpollDelEvent(eventLoop,fd,delmask));
+        return;
+    }
+    if (!aeUringOwned(state)) return;
+    if (state->armed[fd] == mask) return;
+    aeUringDisarm(state,fd);
+    if (mask != AE_NONE) {
+        aeUringArm(state,fd,mask);
+    } else {
+        /* The removed request releases the file only once its completion
+         * is processed, so don't just submit the removal. */
+        struct __kernel_timespec ts = {0,0};
+        aeUringEnter(state,0,&ts);
+    }
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    struct __kernel_timespec ts;
+    int j, numevents, pending = 0;
+
+    if (state->epoll) {
+        aeEpollCall(eventLoop,state,numevents = aeEpollPoll(eventLoop,tvp));
+        return numevents;
+    }
+    if (!aeUringOwned(state)) return 0;
+
+    /* Arm again the file events that fired, unless the handlers already
+     * did it, or removed them. The ones we can't arm because the submission
+     * queue is full will be retried next time. */
+    for (j = 0; j < state->rearm_count; j++) {
+        int fd = state->rearm[j];
+        int mask = eventLoop->events[fd].mask & (AE_READABLE|AE_WRITABLE);
+
+        if (state->armed[fd] == AE_NONE && mask != AE_NONE &&
+            aeUringArm(state,fd,mask) == -1)
+        {
+            state->rearm[pending++] = fd;
+            continue;
+        }
+        state->fired[fd] = 0;
+    }
+    state->rearm_count = pending;
+
+    if (state->nfired || (tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0)) {
+        /* Don't wait: events are already available, or we were asked so. */
+        memset(&ts,0,sizeof(ts));
+        aeUringEnter(state,0,&ts);
+    } else if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        aeUringEnter(state,1,&ts);
+    } else {
+        aeUringEnter(state,1,NULL);
+    }
+    aeUringReap(eventLoop);
+
+    numevents = state->nfired;
+    state->nfired = 0;
+    return numevents;
+}
+
+/* Return true if aeApiWritevBatch() can be used by the calling process. */
+static int aeApiCanWritevBatch(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    return state->epoll == NULL && aeUringOwned(state);
+}
+
+/* Perform the writes in 'reqs' submitting them together, and wait for
+ * their completion. Returns AE_ERR if aeApiCanWritevBatch() is false. */
+static int aeApiWritevBatch(aeEventLoop *eventLoop, aeWritevReq *reqs, int count) {
+    aeApiState *state = eventLoop->apidata;
+    int j;
+
+    if (!aeApiCanWritevBatch(eventLoop)) return AE_ERR;
+    state->batch = reqs;
+    state->batch_inflight = 0;
+    for (j = 0; j < count; j++) {
+        struct io_uring_sqe *sqe = aeUringGetSqe(state);
+        if (!sqe) break;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = reqs[j].fd;
+        sqe->addr = (uint64_t)(uintptr_t)reqs[j].iov;
+        sqe->len = reqs[j].iovcnt;
+        /* Like a write on a non blocking socket: fail with EAGAIN if there
+         * is no room, instead of waiting for the socket to be writable. */
+        sqe->rw_flags = RWF_NOWAIT;
+        sqe->user_data = AE_URING_BATCH | j;
+        state->batch_inflight++;
+    }
+    /* What doesn't fit in the submission queue is written directly. */
+    for (; j < count; j++) {
+        reqs[j].res = writev(reqs[j].fd,reqs[j].iov,reqs[j].iovcnt);
+        reqs[j].err = reqs[j].res == -1 ? errno : 0;
+    }
+    /* Completions of file events may be reaped meanwhile: they are returned
+     * by the next aeApiPoll() call. */
+    while (state->batch_inflight) {
+        aeUringEnter(state,state->batch_inflight,NULL);
+        aeUringReap(eventLoop);
+    }
+    state->batch = NULL;
+    return AE_OK;
+}
+
+static char *aeApiName(void) {
+    return aeUringFallback ? aeEpollName() : "io_uring";
+}
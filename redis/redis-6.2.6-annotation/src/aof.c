@@ -32,6 +32,7 @@
 #include "rio.h"
 
 #include <signal.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -40,159 +41,586 @@
 #include <sys/wait.h>
 #include <sys/param.h>
 
-void aofUpdateCurrentSize(void);
-void aofClosePipes(void);
+ssize_t aofWrite(int fd, const char *buf, size_t len);
 
 /* ----------------------------------------------------------------------------
- * AOF rewrite buffer implementation.
+ * AOF manifest file implementation.
  *
- * The following code implement a simple buffer used in order to accumulate
- * changes while the background process is rewriting the AOF file.
+ * The AOF is made of multiple files, all stored in server.aof_dirname and
+ * named after server.aof_filename:
  *
- * We only need to append, but can't just use realloc with a large block
- * because 'huge' reallocs are not always handled as one could expect
- * (via remapping of pages at OS level) but may involve copying data.
+ * BASE: the snapshot of the dataset written by the latest successful
+ * rewrite, in RDB or AOF format. There is at most a single BASE file.
  *
- * For this reason we use a list of blocks, every block is
- * AOF_RW_BUF_BLOCK_SIZE bytes.
+ * INCR: the commands executed after the BASE was produced, possibly split
+ * in several ordered files since every rewrite starts a new one.
+ *
+ * HISTORY: the BASE and INCR files obsoleted by a rewrite, deleted as soon
+ * as the new manifest is persisted.
+ *
+ * The manifest file tracks them, with a line of key/value pairs per file:
+ *
+ *   file appendonly.aof.1.base.rdb seq 1 type b
+ *   file appendonly.aof.1.incr.aof seq 1 type i
+ *
+ * It is always written to a temporary file that is then renamed, so the
+ * set of files making the AOF changes atomically.
  * ------------------------------------------------------------------------- */
 
-#define AOF_RW_BUF_BLOCK_SIZE (1024*1024*10)    /* 10 MB per block */
+#define BASE_FILE_SUFFIX ".base"
+#define INCR_FILE_SUFFIX ".incr"
+#define RDB_FORMAT_SUFFIX ".rdb"
+#define AOF_FORMAT_SUFFIX ".aof"
+#define MANIFEST_NAME_SUFFIX ".manifest"
+#define TEMP_FILE_NAME_PREFIX "temp-"
 
-typedef struct aofrwblock {
-    unsigned long used, free;
-    char buf[AOF_RW_BUF_BLOCK_SIZE];
-} aofrwblock;
+#define AOF_MANIFEST_KEY_FILE_NAME "file"
+#define AOF_MANIFEST_KEY_FILE_SEQ "seq"
+#define AOF_MANIFEST_KEY_FILE_TYPE "type"
 
-/* This function free the old AOF rewrite buffer if needed, and initialize
- * a fresh new one. It tests for server.aof_rewrite_buf_blocks equal to NULL
- * so can be used for the first initialization as well. */
-void aofRewriteBufferReset(void) {
-    if (server.aof_rewrite_buf_blocks)
-        listRelease(server.aof_rewrite_buf_blocks);
+#define AOF_MANIFEST_MAX_LINE 1024
 
-    server.aof_rewrite_buf_blocks = listCreate();
-    listSetFreeMethod(server.aof_rewrite_buf_blocks,zfree);
+aofInfo *aofInfoCreate(void) {
+    return zcalloc(sizeof(aofInfo));
 }
 
-/* Return the current size of the AOF rewrite buffer. */
-unsigned long aofRewriteBufferSize(void) {
-    listNode *ln;
-    listIter li;
-    unsigned long size = 0;
+void aofInfoFree(aofInfo *ai) {
+    if (ai->file_name) sdsfree(ai->file_name);
+    zfree(ai);
+}
+
+aofInfo *aofInfoDup(aofInfo *orig) {
+    aofInfo *ai = aofInfoCreate();
+
+    ai->file_name = sdsdup(orig->file_name);
+    ai->file_seq = orig->file_seq;
+    ai->file_type = orig->file_type;
+    return ai;
+}
+
+/* Append the manifest line describing 'ai' to 'buf'. The file name is
+ * quoted only when it contains characters sdssplitargs() would split. */
+sds aofInfoFormat(sds buf, aofInfo *ai) {
+    size_t j, needs_repr = 0;
 
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    while((ln = listNext(&li))) {
-        aofrwblock *block = listNodeValue(ln);
-        size += block->used;
+    for (j = 0; j < sdslen(ai->file_name); j++) {
+        unsigned char c = ai->file_name[j];
+        if (!isprint(c) || isspace(c) || c == '"' || c == '\'' || c == '\\')
+            needs_repr = 1;
     }
-    return size;
+    buf = sdscat(buf,AOF_MANIFEST_KEY_FILE_NAME " ");
+    if (needs_repr)
+        buf = sdscatrepr(buf,ai->file_name,sdslen(ai->file_name));
+    else
+        buf = sdscatsds(buf,ai->file_name);
+    return sdscatprintf(buf," %s %lld %s %c\n",
+        AOF_MANIFEST_KEY_FILE_SEQ, ai->file_seq,
+        AOF_MANIFEST_KEY_FILE_TYPE, ai->file_type);
+}
+
+static void aofListFree(void *item) {
+    aofInfoFree(item);
+}
+
+static void *aofListDup(void *item) {
+    return aofInfoDup(item);
+}
+
+aofManifest *aofManifestCreate(void) {
+    aofManifest *am = zcalloc(sizeof(*am));
+
+    am->incr_aof_list = listCreate();
+    am->history_aof_list = listCreate();
+    listSetFreeMethod(am->incr_aof_list,aofListFree);
+    listSetDupMethod(am->incr_aof_list,aofListDup);
+    listSetFreeMethod(am->history_aof_list,aofListFree);
+    listSetDupMethod(am->history_aof_list,aofListDup);
+    return am;
+}
+
+void aofManifestFree(aofManifest *am) {
+    if (am->base_aof_info) aofInfoFree(am->base_aof_info);
+    listRelease(am->incr_aof_list);
+    listRelease(am->history_aof_list);
+    zfree(am);
+}
+
+aofManifest *aofManifestDup(aofManifest *orig) {
+    aofManifest *am = zcalloc(sizeof(*am));
+
+    am->curr_base_file_seq = orig->curr_base_file_seq;
+    am->curr_incr_file_seq = orig->curr_incr_file_seq;
+    if (orig->base_aof_info)
+        am->base_aof_info = aofInfoDup(orig->base_aof_info);
+    am->incr_aof_list = listDup(orig->incr_aof_list);
+    am->history_aof_list = listDup(orig->history_aof_list);
+    serverAssert(am->incr_aof_list && am->history_aof_list);
+    return am;
 }
 
-/* Event handler used to send data to the child process doing the AOF
- * rewrite. We send pieces of our AOF differences buffer so that the final
- * write when the child finishes the rewrite will be small. */
-void aofChildWriteDiffData(aeEventLoop *el, int fd, void *privdata, int mask) {
+/* Make 'am' the manifest of the server, freeing the previous one. */
+void aofManifestFreeAndUpdate(aofManifest *am) {
+    if (server.aof_manifest) aofManifestFree(server.aof_manifest);
+    server.aof_manifest = am;
+}
+
+/* Return the content of the manifest file describing 'am'. */
+sds getAofManifestAsString(aofManifest *am) {
+    sds buf = sdsempty();
     listNode *ln;
-    aofrwblock *block;
-    ssize_t nwritten;
-    UNUSED(el);
-    UNUSED(fd);
-    UNUSED(privdata);
-    UNUSED(mask);
+    listIter li;
 
-    while(1) {
-        ln = listFirst(server.aof_rewrite_buf_blocks);
-        block = ln ? ln->value : NULL;
-        if (server.aof_stop_sending_diff || !block) {
-            aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,
-                              AE_WRITABLE);
-            return;
-        }
-        if (block->used > 0) {
-            nwritten = write(server.aof_pipe_write_data_to_child,
-                             block->buf,block->used);
-            if (nwritten <= 0) return;
-            memmove(block->buf,block->buf+nwritten,block->used-nwritten);
-            block->used -= nwritten;
-            block->free += nwritten;
-        }
-        if (block->used == 0) listDelNode(server.aof_rewrite_buf_blocks,ln);
-    }
+    if (am->base_aof_info) buf = aofInfoFormat(buf,am->base_aof_info);
+    listRewind(am->history_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL)
+        buf = aofInfoFormat(buf,listNodeValue(ln));
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL)
+        buf = aofInfoFormat(buf,listNodeValue(ln));
+    return buf;
 }
 
-/* Append data to the AOF rewrite buffer, allocating new blocks if needed. */
-void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
-    listNode *ln = listLast(server.aof_rewrite_buf_blocks);
-    aofrwblock *block = ln ? ln->value : NULL;
+sds getAofManifestFileName(void) {
+    return sdscatprintf(sdsempty(),"%s%s",server.aof_filename,
+        MANIFEST_NAME_SUFFIX);
+}
 
-    while(len) {
-        /* If we already got at least an allocated block, try appending
-         * at least some piece into it. */
-        if (block) {
-            unsigned long thislen = (block->free < len) ? block->free : len;
-            if (thislen) {  /* The current block is not already full. */
-                memcpy(block->buf+block->used, s, thislen);
-                block->used += thislen;
-                block->free -= thislen;
-                s += thislen;
-                len -= thislen;
-            }
+sds getTempAofManifestFileName(void) {
+    return sdscatprintf(sdsempty(),"%s%s%s",TEMP_FILE_NAME_PREFIX,
+        server.aof_filename,MANIFEST_NAME_SUFFIX);
+}
+
+/* Name of the file the commands are appended to while AOF_WAIT_REWRITE:
+ * since the manifest has no base yet, it is only added to it once the
+ * rewrite succeeds. */
+sds getTempIncrAofName(void) {
+    return sdscatprintf(sdsempty(),"%s%s%s",TEMP_FILE_NAME_PREFIX,
+        server.aof_filename,INCR_FILE_SUFFIX);
+}
+
+/* Parse the manifest file at 'am_filepath'. Errors are fatal, since loading
+ * only part of the files would silently lose data. */
+aofManifest *aofLoadManifestFromFile(sds am_filepath) {
+    char buf[AOF_MANIFEST_MAX_LINE+1];
+    const char *err = NULL;
+    long long maxseq = 0;
+    int linenum = 0;
+    aofManifest *am;
+    FILE *fp;
+
+    if ((fp = fopen(am_filepath,"r")) == NULL) {
+        serverLog(LL_WARNING,"Fatal error: can't open the AOF manifest %s "
+            "for reading: %s",am_filepath,strerror(errno));
+        exit(1);
+    }
+
+    am = aofManifestCreate();
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        aofInfo *ai;
+        sds line, *argv;
+        int argc, j;
+
+        linenum++;
+        if (buf[0] == '#') continue; /* Skip comments. */
+        if (strchr(buf,'\n') == NULL) {
+            err = "line too long";
+            goto fmterr;
+        }
+        line = sdstrim(sdsnew(buf)," \t\r\n");
+        argv = sdssplitargs(line,&argc);
+        sdsfree(line);
+        /* Unknown keys are skipped, for forward compatibility. */
+        if (argv == NULL || argc < 6 || (argc % 2)) {
+            if (argv) sdsfreesplitres(argv,argc);
+            err = "invalid line format";
+            goto fmterr;
         }
 
-        if (len) { /* First block to allocate, or need another block. */
-            int numblocks;
-
-            block = zmalloc(sizeof(*block));
-            block->free = AOF_RW_BUF_BLOCK_SIZE;
-            block->used = 0;
-            listAddNodeTail(server.aof_rewrite_buf_blocks,block);
-
-            /* Log every time we cross more 10 or 100 blocks, respectively
-             * as a notice or warning. */
-            numblocks = listLength(server.aof_rewrite_buf_blocks);
-            if (((numblocks+1) % 10) == 0) {
-                int level = ((numblocks+1) % 100) == 0 ? LL_WARNING :
-                                                         LL_NOTICE;
-                serverLog(level,"Background AOF buffer size: %lu MB",
-                    aofRewriteBufferSize()/(1024*1024));
+        ai = aofInfoCreate();
+        for (j = 0; j < argc; j += 2) {
+            if (!strcasecmp(argv[j],AOF_MANIFEST_KEY_FILE_NAME)) {
+                if (ai->file_name) sdsfree(ai->file_name);
+                ai->file_name = sdsdup(argv[j+1]);
+            } else if (!strcasecmp(argv[j],AOF_MANIFEST_KEY_FILE_SEQ)) {
+                ai->file_seq = atoll(argv[j+1]);
+            } else if (!strcasecmp(argv[j],AOF_MANIFEST_KEY_FILE_TYPE)) {
+                ai->file_type = argv[j+1][0];
             }
         }
+        sdsfreesplitres(argv,argc);
+
+        if (!ai->file_name || ai->file_seq <= 0 || !ai->file_type) {
+            err = "missing file name, sequence or type";
+        } else if (!pathIsBaseName(ai->file_name)) {
+            err = "the file name can't be a path";
+        } else if (ai->file_type == AOF_FILE_TYPE_BASE) {
+            if (am->base_aof_info) {
+                err = "more than one base file";
+            } else {
+                am->base_aof_info = ai;
+                am->curr_base_file_seq = ai->file_seq;
+            }
+        } else if (ai->file_type == AOF_FILE_TYPE_HIST) {
+            listAddNodeTail(am->history_aof_list,ai);
+        } else if (ai->file_type == AOF_FILE_TYPE_INCR) {
+            if (ai->file_seq <= maxseq) {
+                err = "non monotonic incr file sequence";
+            } else {
+                listAddNodeTail(am->incr_aof_list,ai);
+                am->curr_incr_file_seq = maxseq = ai->file_seq;
+            }
+        } else {
+            err = "unknown file type";
+        }
+        if (err) {
+            aofInfoFree(ai);
+            goto fmterr;
+        }
+    }
+    if (ferror(fp)) {
+        serverLog(LL_WARNING,"Fatal error: can't read the AOF manifest %s: %s",
+            am_filepath,strerror(errno));
+        exit(1);
     }
+    fclose(fp);
+    return am;
 
-    /* Install a file event to send data to the rewrite child if there is
-     * not one already. */
-    if (!server.aof_stop_sending_diff &&
-        aeGetFileEvents(server.el,server.aof_pipe_write_data_to_child) == 0)
-    {
-        aeCreateFileEvent(server.el, server.aof_pipe_write_data_to_child,
-            AE_WRITABLE, aofChildWriteDiffData, NULL);
+fmterr:
+    serverLog(LL_WARNING,"Bad file format reading the AOF manifest %s "
+        "at line %d: %s",am_filepath,linenum,err);
+    exit(1);
+}
+
+/* Load the manifest of server.aof_dirname into server.aof_manifest. When
+ * there is no manifest the AOF starts empty, unless an old style single
+ * AOF file is found: see loadAppendOnlyFiles(). */
+void aofLoadManifestFromDisk(void) {
+    sds am_name, am_filepath;
+
+    aofManifestFreeAndUpdate(aofManifestCreate());
+    if (!dirExists(server.aof_dirname)) {
+        serverLog(LL_VERBOSE,"The AOF directory %s doesn't exist",
+            server.aof_dirname);
+        return;
+    }
+
+    am_name = getAofManifestFileName();
+    am_filepath = makePath(server.aof_dirname,am_name);
+    if (fileExist(am_filepath)) {
+        aofManifestFreeAndUpdate(aofLoadManifestFromFile(am_filepath));
+    } else {
+        serverLog(LL_VERBOSE,"The AOF manifest file %s doesn't exist",am_name);
+    }
+    sdsfree(am_name);
+    sdsfree(am_filepath);
+}
+
+/* Fsync the directory 'dname', so that the files created or renamed in it
+ * survive a crash. */
+static int fsyncDir(char *dname) {
+    int fd = open(dname,O_RDONLY);
+
+    if (fd == -1) return -1;
+    if (redis_fsync(fd) == -1 && errno != EINVAL) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Atomically replace the manifest file with the one describing 'am'. */
+int persistAofManifest(aofManifest *am) {
+    sds am_name = getAofManifestFileName();
+    sds am_filepath = makePath(server.aof_dirname,am_name);
+    sds tmp_am_name = getTempAofManifestFileName();
+    sds tmp_am_filepath = makePath(server.aof_dirname,tmp_am_name);
+    sds amstr = getAofManifestAsString(am);
+    int fd, ret = C_ERR;
+
+    fd = open(tmp_am_filepath,O_WRONLY|O_TRUNC|O_CREAT,0644);
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Can't open the AOF manifest file %s: %s",
+            tmp_am_name,strerror(errno));
+        goto cleanup;
+    }
+    if (aofWrite(fd,amstr,sdslen(amstr)) != (ssize_t)sdslen(amstr)) {
+        serverLog(LL_WARNING,"Error trying to write the temporary AOF "
+            "manifest file %s: %s",tmp_am_name,strerror(errno));
+        goto cleanup;
+    }
+    if (redis_fsync(fd) == -1) {
+        serverLog(LL_WARNING,"Fail to fsync the temp AOF manifest file %s: %s",
+            tmp_am_name,strerror(errno));
+        goto cleanup;
     }
+    if (rename(tmp_am_filepath,am_filepath) == -1) {
+        serverLog(LL_WARNING,"Error trying to rename the temporary AOF "
+            "manifest file %s into %s: %s",tmp_am_name,am_name,
+            strerror(errno));
+        goto cleanup;
+    }
+    /* The manifest may reference files just created in the directory. */
+    if (fsyncDir(server.aof_dirname) == -1) {
+        serverLog(LL_WARNING,"Fail to fsync the AOF directory %s: %s",
+            server.aof_dirname,strerror(errno));
+        goto cleanup;
+    }
+    ret = C_OK;
+
+cleanup:
+    if (fd != -1) close(fd);
+    sdsfree(am_name);
+    sdsfree(am_filepath);
+    sdsfree(tmp_am_name);
+    sdsfree(tmp_am_filepath);
+    sdsfree(amstr);
+    return ret;
 }
 
-/* Write the buffer (possibly composed of multiple blocks) into the specified
- * fd. If a short write or any other error happens -1 is returned,
- * otherwise the number of bytes written is returned. */
-ssize_t aofRewriteBufferWrite(int fd) {
+/* Add a new base file to 'am', turning the previous one into history, and
+ * return its name. */
+sds getNewBaseFileNameAndMarkPreAsHistory(aofManifest *am) {
+    aofInfo *ai;
+
+    if (am->base_aof_info) {
+        am->base_aof_info->file_type = AOF_FILE_TYPE_HIST;
+        listAddNodeHead(am->history_aof_list,am->base_aof_info);
+    }
+
+    ai = aofInfoCreate();
+    ai->file_seq = ++am->curr_base_file_seq;
+    ai->file_type = AOF_FILE_TYPE_BASE;
+    ai->file_name = sdscatprintf(sdsempty(),"%s.%lld%s%s",
+        server.aof_filename,ai->file_seq,BASE_FILE_SUFFIX,
+        server.aof_use_rdb_preamble ? RDB_FORMAT_SUFFIX : AOF_FORMAT_SUFFIX);
+    am->base_aof_info = ai;
+    return ai->file_name;
+}
+
+/* Add a new incr file at the end of 'am' and return its name. */
+sds getNewIncrAofName(aofManifest *am) {
+    aofInfo *ai = aofInfoCreate();
+
+    ai->file_seq = ++am->curr_incr_file_seq;
+    ai->file_type = AOF_FILE_TYPE_INCR;
+    ai->file_name = sdscatprintf(sdsempty(),"%s.%lld%s%s",
+        server.aof_filename,ai->file_seq,INCR_FILE_SUFFIX,AOF_FORMAT_SUFFIX);
+    listAddNodeTail(am->incr_aof_list,ai);
+    return ai->file_name;
+}
+
+/* Return the name of the last incr file of 'am', adding one if needed. */
+sds getLastIncrAofName(aofManifest *am) {
+    if (listLength(am->incr_aof_list) == 0) return getNewIncrAofName(am);
+    aofInfo *ai = listNodeValue(listLast(am->incr_aof_list));
+    return ai->file_name;
+}
+
+/* After a rewrite every incr file but the one currently written is part of
+ * the new base: turn them into history. When the AOF is off no incr file
+ * is being written, so all of them are. */
+void markRewrittenIncrAofAsHistory(aofManifest *am) {
     listNode *ln;
     listIter li;
-    ssize_t count = 0;
-
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    while((ln = listNext(&li))) {
-        aofrwblock *block = listNodeValue(ln);
-        ssize_t nwritten;
-
-        if (block->used) {
-            nwritten = write(fd,block->buf,block->used);
-            if (nwritten != (ssize_t)block->used) {
-                if (nwritten == 0) errno = EIO;
-                return -1;
-            }
-            count += nwritten;
-        }
+
+    listRewindTail(am->incr_aof_list,&li);
+    if (server.aof_fd != -1) listNext(&li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = listNodeValue(ln);
+
+        ai->file_type = AOF_FILE_TYPE_HIST;
+        listAddNodeHead(am->history_aof_list,aofInfoDup(ai));
+        listDelNode(am->incr_aof_list,ln);
+    }
+}
+
+/* Delete the history files in the background and drop them from the
+ * manifest. */
+int aofDelHistoryFiles(void) {
+    listNode *ln;
+    listIter li;
+
+    if (server.aof_manifest == NULL ||
+        listLength(server.aof_manifest->history_aof_list) == 0) return C_OK;
+
+    listRewind(server.aof_manifest->history_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = listNodeValue(ln);
+        sds aof_filepath = makePath(server.aof_dirname,ai->file_name);
+
+        serverLog(LL_NOTICE,"Removing the history file %s in the background",
+            ai->file_name);
+        bg_unlink(aof_filepath);
+        sdsfree(aof_filepath);
+        listDelNode(server.aof_manifest->history_aof_list,ln);
+    }
+    return persistAofManifest(server.aof_manifest);
+}
+
+/* Size of the AOF file 'aof_name', or 0 if it can't be stat(2)ed. */
+off_t getAppendOnlyFileSize(sds aof_name) {
+    sds aof_filepath = makePath(server.aof_dirname,aof_name);
+    struct redis_stat sb;
+    mstime_t latency;
+    off_t size = 0;
+
+    latencyStartMonitor(latency);
+    if (redis_stat(aof_filepath,&sb) == -1) {
+        serverLog(LL_WARNING,"Unable to obtain the AOF file %s length. "
+            "stat: %s",aof_name,strerror(errno));
+    } else {
+        size = sb.st_size;
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("aof-fstat",latency);
+    sdsfree(aof_filepath);
+    return size;
+}
+
+/* Total size of the base and incr files of 'am'. */
+off_t getBaseAndIncrAppendOnlyFilesSize(aofManifest *am) {
+    off_t size = 0;
+    listNode *ln;
+    listIter li;
+
+    if (am->base_aof_info)
+        size += getAppendOnlyFileSize(am->base_aof_info->file_name);
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = listNodeValue(ln);
+        size += getAppendOnlyFileSize(ai->file_name);
+    }
+    return size;
+}
+
+/* Called at startup when server.aof_filename exists in the working
+ * directory: unless the AOF directory already tracks some files, this is
+ * the single file AOF of an older version, that is moved to the AOF
+ * directory and used as base. The manifest is persisted before moving the
+ * file, so that a crash in between is handled by the next restart. */
+void aofUpgradePrepare(aofManifest *am) {
+    sds aof_filepath;
+
+    if (am->base_aof_info || listLength(am->incr_aof_list)) {
+        /* A previous upgrade may have persisted the manifest but not
+         * moved the file yet. */
+        if (am->base_aof_info == NULL ||
+            listLength(am->incr_aof_list) ||
+            strcmp(am->base_aof_info->file_name,server.aof_filename))
+            return;
+        aof_filepath = makePath(server.aof_dirname,server.aof_filename);
+        int moved = fileExist(aof_filepath);
+        sdsfree(aof_filepath);
+        if (moved) return;
+    }
+
+    if (dirCreateIfMissing(server.aof_dirname) == -1) {
+        serverLog(LL_WARNING,"Can't open or create append-only dir %s: %s",
+            server.aof_dirname,strerror(errno));
+        exit(1);
+    }
+
+    if (am->base_aof_info) aofInfoFree(am->base_aof_info);
+    am->base_aof_info = aofInfoCreate();
+    am->base_aof_info->file_name = sdsnew(server.aof_filename);
+    am->base_aof_info->file_seq = 1;
+    am->base_aof_info->file_type = AOF_FILE_TYPE_BASE;
+    am->curr_base_file_seq = 1;
+    if (persistAofManifest(am) != C_OK) exit(1);
+
+    aof_filepath = makePath(server.aof_dirname,server.aof_filename);
+    if (rename(server.aof_filename,aof_filepath) == -1) {
+        serverLog(LL_WARNING,"Error trying to move the old AOF file %s "
+            "into dir %s: %s",server.aof_filename,server.aof_dirname,
+            strerror(errno));
+        exit(1);
+    }
+    sdsfree(aof_filepath);
+    serverLog(LL_NOTICE,"Successfully migrated the old style AOF file %s "
+        "into dir %s",server.aof_filename,server.aof_dirname);
+}
+
+/* Open the incr file the commands are appended to at startup, creating
+ * it if needed. */
+void aofOpenIfNeededOnServerStart(void) {
+    sds aof_name, aof_filepath;
+
+    if (server.aof_state != AOF_ON) return;
+
+    if (dirCreateIfMissing(server.aof_dirname) == -1) {
+        serverLog(LL_WARNING,"Can't open or create append-only dir %s: %s",
+            server.aof_dirname,strerror(errno));
+        exit(1);
+    }
+
+    aof_name = getLastIncrAofName(server.aof_manifest);
+    aof_filepath = makePath(server.aof_dirname,aof_name);
+    server.aof_fd = open(aof_filepath,O_WRONLY|O_APPEND|O_CREAT,0644);
+    sdsfree(aof_filepath);
+    if (server.aof_fd == -1) {
+        serverLog(LL_WARNING,"Can't open the append-only file %s: %s",
+            aof_name,strerror(errno));
+        exit(1);
+    }
+    if (persistAofManifest(server.aof_manifest) != C_OK) exit(1);
+    server.aof_last_incr_size = getAppendOnlyFileSize(aof_name);
+}
+
+/* Start appending to a new incr file, called before forking a rewrite
+ * child: the commands received from now on are not part of the snapshot
+ * it writes. While AOF_WAIT_REWRITE the new file is a temporary one,
+ * added to the manifest once the rewrite succeeds. */
+int openNewIncrAofForAppend(void) {
+    aofManifest *temp_am = NULL;
+    sds new_aof_name, new_aof_filepath;
+    int newfd;
+
+    if (server.aof_state == AOF_OFF) return C_OK;
+
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        new_aof_name = getTempIncrAofName();
+    } else {
+        temp_am = aofManifestDup(server.aof_manifest);
+        new_aof_name = sdsdup(getNewIncrAofName(temp_am));
+    }
+    new_aof_filepath = makePath(server.aof_dirname,new_aof_name);
+    newfd = open(new_aof_filepath,O_WRONLY|O_TRUNC|O_CREAT,0644);
+    sdsfree(new_aof_filepath);
+    if (newfd == -1) {
+        serverLog(LL_WARNING,"Can't open the append-only file %s: %s",
+            new_aof_name,strerror(errno));
+        goto error;
+    }
+    if (temp_am && persistAofManifest(temp_am) == C_ERR) {
+        close(newfd);
+        goto error;
+    }
+    serverLog(LL_NOTICE,"Creating AOF incr file %s on background rewrite",
+        new_aof_name);
+    sdsfree(new_aof_name);
+
+    /* The old file is fsynced and closed in the background: with everysec
+     * it may hold data that is still not on disk, and with always it was
+     * already fsynced by the last flush. */
+    if (server.aof_fd != -1) {
+        long long offset = server.aof_written_offset - sdslen(server.aof_buf);
+        bioCreateFsyncAndCloseJob(server.aof_fd,offset);
+        server.aof_fsync_queued_offset = offset;
+        server.aof_fsync_offset = server.aof_current_size;
+        server.aof_last_fsync = server.unixtime;
     }
-    return count;
+    server.aof_fd = newfd;
+    server.aof_last_incr_size = 0;
+    if (temp_am) aofManifestFreeAndUpdate(temp_am);
+    return C_OK;
+
+error:
+    sdsfree(new_aof_name);
+    if (temp_am) aofManifestFree(temp_am);
+    return C_ERR;
 }
 
 /* ----------------------------------------------------------------------------
@@ -208,7 +636,100 @@ int aofFsyncInProgress(void) {
 /* Starts a background task that performs fsync() against the specified
  * file descriptor (the one of the AOF file) in another thread. */
 void aof_background_fsync(int fd) {
-    bioCreateFsyncJob(fd);
+    long long offset = server.aof_written_offset - sdslen(server.aof_buf);
+    bioCreateFsyncJob(fd,offset);
+    server.aof_fsync_queued_offset = offset;
+}
+
+/* ----------------------------------------------------------------------------
+ * Durable clients (CLIENT DURABLE ON)
+ *
+ * The reply to a command that wrote to the AOF is not sent to a client in
+ * durable mode until an fsync covering what the command wrote is done: the
+ * client is blocked (BLOCKED_AOF) with its reply held in the output buffer,
+ * and is unblocked once server.aof_fsynced_offset reaches the AOF offset it
+ * waits for. While clients are waiting, flushAppendOnlyFile() starts an
+ * fsync in the background as soon as the previous one is done, whatever the
+ * fsync policy, so that a single fsync acknowledges all the writes received
+ * in the meantime (group commit).
+ * ------------------------------------------------------------------------- */
+
+/* Block a client in durable mode after the execution of a command that
+ * wrote to the AOF, unless there is nothing to wait for. */
+void blockForAofFsync(client *c) {
+    long long fsynced;
+
+    /* With the 'always' policy the fsync is done in beforeSleep(), before
+     * the replies are written to the clients. */
+    if (server.aof_state != AOF_ON ||
+        server.aof_fsync == AOF_FSYNC_ALWAYS) return;
+    atomicGet(server.aof_fsynced_offset,fsynced);
+    if (fsynced >= server.aof_written_offset) return;
+
+    c->bpop.timeout = 0;
+    c->bpop.aofoffset = server.aof_written_offset;
+    listAddNodeTail(server.clients_waiting_aof,c);
+    blockClient(c,BLOCKED_AOF);
+}
+
+/* This is called by unblockClient() to perform the blocking op type
+ * specific cleanup. Never call it directly, call unblockClient() instead. */
+void unblockClientWaitingAofFsync(client *c) {
+    listNode *ln = listSearchKey(server.clients_waiting_aof,c);
+    serverAssert(ln != NULL);
+    listDelNode(server.clients_waiting_aof,ln);
+}
+
+/* Unblock the clients whose writes are now on disk, and send them the
+ * replies held so far. The clients are in the list in the order they
+ * blocked, so with increasing offsets. */
+void processClientsWaitingAofFsync(void) {
+    long long fsynced;
+    int fsync_status;
+
+    atomicGet(server.aof_fsynced_offset,fsynced);
+    atomicGet(server.aof_bio_fsync_status,fsync_status);
+
+    /* The last fsync failed: what it covered is queued again, so that
+     * flushAppendOnlyFile() retries it, see aofFsyncNeededByClients(). The
+     * clients keep waiting meanwhile, their replies can't be sent before
+     * the writes are on disk. */
+    if (fsync_status == C_ERR && server.aof_fsync_queued_offset > fsynced &&
+        !aofFsyncInProgress())
+    {
+        server.aof_fsync_queued_offset = fsynced;
+    }
+    while (listLength(server.clients_waiting_aof)) {
+        client *c = listNodeValue(listFirst(server.clients_waiting_aof));
+
+        if (c->bpop.aofoffset > fsynced) break;
+        unblockClient(c);
+        if (clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+    }
+}
+
+/* Readable handler of the pipe written by the fsync thread: the bytes are
+ * just consumed, the waiting clients are served in beforeSleep(). */
+void aofFsyncPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+}
+
+/* Return true if clients in durable mode wait for writes that no fsync
+ * started so far covers. After a failure the fsync is retried at most once
+ * per second, like with the everysec policy. */
+static int aofFsyncNeededByClients(void) {
+    int fsync_status;
+
+    if (!listLength(server.clients_waiting_aof) ||
+        server.aof_fsync_queued_offset >= server.aof_written_offset)
+        return 0;
+    atomicGet(server.aof_bio_fsync_status,fsync_status);
+    return fsync_status == C_OK || server.unixtime > server.aof_last_fsync;
 }
 
 /* Kills an AOFRW child process if exists */
@@ -222,13 +743,9 @@ void killAppendOnlyChild(void) {
     if (kill(server.child_pid,SIGUSR1) != -1) {
         while(waitpid(-1, &statloc, 0) != server.child_pid);
     }
-    /* Reset the buffer accumulating changes while the child saves. */
-    aofRewriteBufferReset();
     aofRemoveTempFile(server.child_pid);
     resetChildState();
     server.aof_rewrite_time_start = -1;
-    /* Close pipes used for IPC between the two processes. */
-    aofClosePipes();
 }
 
 /* Called when the user switches from "appendonly yes" to "appendonly no"
@@ -236,13 +753,31 @@ void killAppendOnlyChild(void) {
 void stopAppendOnly(void) {
     serverAssert(server.aof_state != AOF_OFF);
     flushAppendOnlyFile(1);
-    if (redis_fsync(server.aof_fd) == -1) {
-        serverLog(LL_WARNING,"Fail to fsync the AOF file: %s",strerror(errno));
-    } else {
-        server.aof_fsync_offset = server.aof_current_size;
-        server.aof_last_fsync = server.unixtime;
+    /* While AOF_WAIT_REWRITE the file may not be opened yet, if the
+     * rewrite was scheduled. */
+    if (server.aof_fd != -1) {
+        if (redis_fsync(server.aof_fd) == -1) {
+            serverLog(LL_WARNING,"Fail to fsync the AOF file: %s",strerror(errno));
+        } else {
+            server.aof_fsync_offset = server.aof_current_size;
+            server.aof_last_fsync = server.unixtime;
+        }
+        close(server.aof_fd);
+    }
+    /* Nothing is going to be fsynced anymore: release the clients in
+     * durable mode waiting for it. */
+    server.aof_fsync_queued_offset = server.aof_written_offset;
+    atomicSet(server.aof_fsynced_offset,server.aof_written_offset);
+    /* The commands appended while waiting for the first rewrite are lost
+     * with it. */
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        sds temp_incr_aof_name = getTempIncrAofName();
+        sds temp_incr_filepath = makePath(server.aof_dirname,
+                                          temp_incr_aof_name);
+        bg_unlink(temp_incr_filepath);
+        sdsfree(temp_incr_aof_name);
+        sdsfree(temp_incr_filepath);
     }
-    close(server.aof_fd);
 
     server.aof_fd = -1;
     server.aof_selected_db = -1;
@@ -256,44 +791,37 @@ void stopAppendOnly(void) {
 /* Called when the user switches from "appendonly no" to "appendonly yes"
  * at runtime using the CONFIG command. */
 int startAppendOnly(void) {
-    char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
-    int newfd;
-
-    newfd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     serverAssert(server.aof_state == AOF_OFF);
-    if (newfd == -1) {
-        char *cwdp = getcwd(cwd,MAXPATHLEN);
 
-        serverLog(LL_WARNING,
-            "Redis needs to enable the AOF but can't open the "
-            "append only file %s (in server root dir %s): %s",
-            server.aof_filename,
-            cwdp ? cwdp : "unknown",
-            strerror(errno));
-        return C_ERR;
-    }
+    /* Wait for the rewrite to be complete in order to add the file the
+     * commands are appended to in the meantime to the AOF. The state is
+     * set before starting the rewrite, so that it opens that file. */
+    server.aof_state = AOF_WAIT_REWRITE;
     if (hasActiveChildProcess() && server.child_type != CHILD_TYPE_AOF) {
         server.aof_rewrite_scheduled = 1;
         serverLog(LL_WARNING,"AOF was enabled but there is already another background operation. An AOF background was scheduled to start when possible.");
+    } else if (server.in_exec) {
+        server.aof_rewrite_scheduled = 1;
+        serverLog(LL_WARNING,"AOF was enabled during a transaction. An AOF background was scheduled to start when possible.");
     } else {
         /* If there is a pending AOF rewrite, we need to switch it off and
-         * start a new one: the old one cannot be reused because it is not
-         * accumulating the AOF buffer. */
+         * start a new one: the old one cannot be reused because its
+         * snapshot is older than the file we are going to append to. */
         if (server.child_type == CHILD_TYPE_AOF) {
             serverLog(LL_WARNING,"AOF was enabled but there is already an AOF rewriting in background. Stopping background AOF and starting a rewrite now.");
             killAppendOnlyChild();
         }
         if (rewriteAppendOnlyFileBackground() == C_ERR) {
-            close(newfd);
+            if (server.aof_fd != -1) {
+                close(server.aof_fd);
+                server.aof_fd = -1;
+            }
+            server.aof_state = AOF_OFF;
             serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
             return C_ERR;
         }
     }
-    /* We correctly switched on AOF, now wait for the rewrite to be complete
-     * in order to append data on disk. */
-    server.aof_state = AOF_WAIT_REWRITE;
     server.aof_last_fsync = server.unixtime;
-    server.aof_fd = newfd;
 
     /* If AOF fsync error in bio job, we just ignore it and log the event. */
     int aof_bio_fsync_status;
@@ -368,9 +896,10 @@ void flushAppendOnlyFile(int force) {
          * called only when aof buffer is not empty, so if users
          * stop write commands before fsync called in one second,
          * the data in page cache cannot be flushed in time. */
-        if (server.aof_fsync == AOF_FSYNC_EVERYSEC &&
-            server.aof_fsync_offset != server.aof_current_size &&
-            server.unixtime > server.aof_last_fsync &&
+        if (((server.aof_fsync == AOF_FSYNC_EVERYSEC &&
+              server.aof_fsync_offset != server.aof_current_size &&
+              server.unixtime > server.aof_last_fsync) ||
+             aofFsyncNeededByClients()) &&
             !(sync_in_progress = aofFsyncInProgress())) {
             goto try_fsync;
         } else {
@@ -378,7 +907,8 @@ void flushAppendOnlyFile(int force) {
         }
     }
 
-    if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
+    if (server.aof_fsync == AOF_FSYNC_EVERYSEC ||
+        listLength(server.clients_waiting_aof))
         sync_in_progress = aofFsyncInProgress();
 
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC && !force) {
@@ -458,7 +988,7 @@ void flushAppendOnlyFile(int force) {
                                        (long long)sdslen(server.aof_buf));
             }
 
-            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+            if (ftruncate(server.aof_fd, server.aof_last_incr_size) == -1) {
                 if (can_log) {
                     serverLog(LL_WARNING, "Could not remove short write "
                              "from the append-only file.  Redis may refuse "
@@ -492,6 +1022,7 @@ void flushAppendOnlyFile(int force) {
              * was no way to undo it with ftruncate(2). */
             if (nwritten > 0) {
                 server.aof_current_size += nwritten;
+                server.aof_last_incr_size += nwritten;
                 sdsrange(server.aof_buf,nwritten,-1);
             }
             return; /* We'll try again on the next call... */
@@ -506,6 +1037,7 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+    server.aof_last_incr_size += nwritten;
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -539,8 +1071,13 @@ try_fsync:
         latencyAddSampleIfNeeded("aof-fsync-always",latency);
         server.aof_fsync_offset = server.aof_current_size;
         server.aof_last_fsync = server.unixtime;
+        server.aof_fsync_queued_offset = server.aof_written_offset;
+        atomicSet(server.aof_fsynced_offset,server.aof_written_offset);
     } else if ((server.aof_fsync == AOF_FSYNC_EVERYSEC &&
-                server.unixtime > server.aof_last_fsync)) {
+                server.unixtime > server.aof_last_fsync) ||
+               aofFsyncNeededByClients()) {
+        /* With clients in durable mode waiting, don't wait for the next
+         * second: the writes they wait for are all covered by this fsync. */
         if (!sync_in_progress) {
             aof_background_fsync(server.aof_fd);
             server.aof_fsync_offset = server.aof_current_size;
@@ -664,16 +1201,18 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
 
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+     * positive reply about the operation performed.
+     *
+     * While waiting for the first rewrite, the commands are only needed
+     * once the child has taken its snapshot: from then on they go to the
+     * temporary incr file opened for it. */
+    if (server.aof_state == AOF_ON ||
+        (server.aof_state == AOF_WAIT_REWRITE &&
+         server.child_type == CHILD_TYPE_AOF))
+    {
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
-
-    /* If a background append only file rewriting is in progress we want to
-     * accumulate the differences between the child DB and the current one
-     * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    if (server.child_type == CHILD_TYPE_AOF)
-        aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
+        server.aof_written_offset += sdslen(buf);
+    }
 
     sdsfree(buf);
 }
@@ -692,6 +1231,7 @@ struct client *createAOFClient(void) {
     c->conn = NULL;
     c->name = NULL;
     c->querybuf = sdsempty();
+    c->qbuf_chunk = NULL;
     c->querybuf_peak = 0;
     c->argc = 0;
     c->argv = NULL;
@@ -747,12 +1287,17 @@ void freeFakeClient(struct client *c) {
     zfree(c);
 }
 
-/* Replay the append log file. On success C_OK is returned. On non fatal
- * error (the append only file is zero-length) C_ERR is returned. On
- * fatal error an error message is logged and the program exists. */
-int loadAppendOnlyFile(char *filename) {
+/* Replay the AOF file 'aof_name' of the AOF directory. 'progress_offset' is
+ * the size of the files loaded before it, used to report the loading
+ * progress. Only the 'last_file' may be truncated, since a short read in
+ * any other file means some of the commands that follow it are missing.
+ * On success C_OK is returned. On non fatal error (the file is
+ * zero-length) C_ERR is returned. On fatal error an error message is
+ * logged and the program exists. */
+int loadSingleAppendOnlyFile(sds aof_name, off_t progress_offset, int last_file) {
     struct client *fakeClient;
-    FILE *fp = fopen(filename,"r");
+    sds aof_filepath = makePath(server.aof_dirname,aof_name);
+    FILE *fp = fopen(aof_filepath,"r");
     struct redis_stat sb;
     int old_aof_state = server.aof_state;
     long loops = 0;
@@ -760,7 +1305,7 @@ int loadAppendOnlyFile(char *filename) {
     off_t valid_before_multi = 0; /* Offset before MULTI command loaded. */
 
     if (fp == NULL) {
-        serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
+        serverLog(LL_WARNING,"Fatal error: can't open the append log file %s for reading: %s",aof_name,strerror(errno));
         exit(1);
     }
 
@@ -769,9 +1314,8 @@ int loadAppendOnlyFile(char *filename) {
      * a zero length file at startup, that will remain like that if no write
      * operation is received. */
     if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
-        server.aof_current_size = 0;
-        server.aof_fsync_offset = server.aof_current_size;
         fclose(fp);
+        sdsfree(aof_filepath);
         return C_ERR;
     }
 
@@ -780,7 +1324,6 @@ int loadAppendOnlyFile(char *filename) {
     server.aof_state = AOF_OFF;
 
     fakeClient = createAOFClient();
-    startLoadingFile(fp, filename, RDBFLAGS_AOF_PREAMBLE);
 
     /* Check if this AOF file has an RDB preamble. In that case we need to
      * load the RDB file and later continue loading the AOF tail. */
@@ -795,10 +1338,13 @@ int loadAppendOnlyFile(char *filename) {
         serverLog(LL_NOTICE,"Reading RDB preamble from AOF file...");
         if (fseek(fp,0,SEEK_SET) == -1) goto readerr;
         rioInitWithFile(&rdb,fp);
+        rdbFileBeingLoaded = aof_filepath;
         if (rdbLoadRio(&rdb,RDBFLAGS_AOF_PREAMBLE,NULL) != C_OK) {
-            serverLog(LL_WARNING,"Error reading the RDB preamble of the AOF file, AOF loading aborted");
+            rdbFileBeingLoaded = NULL;
+            serverLog(LL_WARNING,"Error reading the RDB preamble of the AOF file %s, AOF loading aborted", aof_name);
             goto readerr;
         } else {
+            rdbFileBeingLoaded = NULL;
             serverLog(LL_NOTICE,"Reading the remaining AOF tail...");
         }
     }
@@ -814,7 +1360,7 @@ int loadAppendOnlyFile(char *filename) {
 
         /* Serve the clients from time to time */
         if (!(loops++ % 1000)) {
-            loadingProgress(ftello(fp));
+            loadingProgress(progress_offset+ftello(fp));
             processEventsWhileBlocked();
             processModuleLoadingProgressEvent(1);
         }
@@ -919,26 +1465,23 @@ loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
     fclose(fp);
     freeFakeClient(fakeClient);
     server.aof_state = old_aof_state;
-    stopLoading(1);
-    aofUpdateCurrentSize();
-    server.aof_rewrite_base_size = server.aof_current_size;
-    server.aof_fsync_offset = server.aof_current_size;
+    sdsfree(aof_filepath);
     return C_OK;
 
 readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     if (!feof(fp)) {
         if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
         fclose(fp);
-        serverLog(LL_WARNING,"Unrecoverable error reading the append only file: %s", strerror(errno));
+        serverLog(LL_WARNING,"Unrecoverable error reading the append only file %s: %s", aof_name, strerror(errno));
         exit(1);
     }
 
 uxeof: /* Unexpected AOF end of file. */
-    if (server.aof_load_truncated) {
-        serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file !!!");
+    if (server.aof_load_truncated && last_file) {
+        serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file %s !!!", aof_name);
         serverLog(LL_WARNING,"!!! Truncating the AOF at offset %llu !!!",
             (unsigned long long) valid_up_to);
-        if (valid_up_to == -1 || truncate(filename,valid_up_to) == -1) {
+        if (valid_up_to == -1 || truncate(aof_filepath,valid_up_to) == -1) {
             if (valid_up_to == -1) {
                 serverLog(LL_WARNING,"Last valid command offset is invalid");
             } else {
@@ -960,16 +1503,75 @@ uxeof: /* Unexpected AOF end of file. */
     }
     if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
     fclose(fp);
-    serverLog(LL_WARNING,"Unexpected end of file reading the append only file. You can: 1) Make a backup of your AOF file, then use ./redis-check-aof --fix <filename>. 2) Alternatively you can set the 'aof-load-truncated' configuration option to yes and restart the server.");
+    if (last_file) {
+        serverLog(LL_WARNING,"Unexpected end of file reading the append only file %s. You can: 1) Make a backup of your AOF file, then use ./redis-check-aof --fix <filename>. 2) Alternatively you can set the 'aof-load-truncated' configuration option to yes and restart the server.", aof_name);
+    } else {
+        serverLog(LL_WARNING,"Unexpected end of file reading the append only file %s, that is not the last file of the AOF: make a backup of your AOF directory, then use ./redis-check-aof --fix <filename>.", aof_name);
+    }
     exit(1);
 
 fmterr: /* Format error. */
     if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
     fclose(fp);
-    serverLog(LL_WARNING,"Bad file format reading the append only file: make a backup of your AOF file, then use ./redis-check-aof --fix <filename>");
+    serverLog(LL_WARNING,"Bad file format reading the append only file %s: make a backup of your AOF file, then use ./redis-check-aof --fix <filename>", aof_name);
     exit(1);
 }
 
+/* Replay the files of the AOF described by 'am', the base file first and
+ * then the incr files in order. On success C_OK is returned. If there is
+ * nothing to load (no files, or only zero-length ones) C_ERR is returned.
+ * On fatal error an error message is logged and the program exists. */
+int loadAppendOnlyFiles(aofManifest *am) {
+    off_t total_size, loaded_size = 0;
+    int loaded = 0, ret;
+    long long start;
+    listNode *ln;
+    listIter li;
+
+    if (fileExist(server.aof_filename)) aofUpgradePrepare(am);
+    if (am->base_aof_info == NULL && listLength(am->incr_aof_list) == 0)
+        return C_ERR;
+
+    total_size = getBaseAndIncrAppendOnlyFilesSize(am);
+    startLoading(total_size,RDBFLAGS_AOF_PREAMBLE);
+
+    if (am->base_aof_info) {
+        sds aof_name = am->base_aof_info->file_name;
+
+        start = ustime();
+        ret = loadSingleAppendOnlyFile(aof_name,loaded_size,
+            listLength(am->incr_aof_list) == 0);
+        if (ret == C_OK) {
+            serverLog(LL_NOTICE,"DB loaded from base file %s: %.3f seconds",
+                aof_name,(float)(ustime()-start)/1000000);
+            loaded++;
+        }
+        loaded_size += getAppendOnlyFileSize(aof_name);
+    }
+
+    listRewind(am->incr_aof_list,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = listNodeValue(ln);
+
+        start = ustime();
+        ret = loadSingleAppendOnlyFile(ai->file_name,loaded_size,
+            ln == listLast(am->incr_aof_list));
+        if (ret == C_OK) {
+            serverLog(LL_NOTICE,"DB loaded from incr file %s: %.3f seconds",
+                ai->file_name,(float)(ustime()-start)/1000000);
+            loaded++;
+        }
+        loaded_size += getAppendOnlyFileSize(ai->file_name);
+    }
+    stopLoading(1);
+
+    /* The last file may have been truncated. */
+    server.aof_current_size = getBaseAndIncrAppendOnlyFilesSize(am);
+    server.aof_rewrite_base_size = server.aof_current_size;
+    server.aof_fsync_offset = server.aof_current_size;
+    return loaded ? C_OK : C_ERR;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite
  * ------------------------------------------------------------------------- */
@@ -1057,6 +1659,55 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        roaringIter ri;
+        int64_t llval;
+
+        roaringIterInit(o->ptr,&ri);
+        while(roaringNext(&ri,&llval)) {
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (!rioWriteBulkCount(r,'*',2+cmd_items) ||
+                    !rioWriteBulkString(r,"SADD",4) ||
+                    !rioWriteBulkObject(r,key))
+                {
+                    return 0;
+                }
+            }
+            if (!rioWriteBulkLongLong(r,llval)) return 0;
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
+    } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = o->ptr;
+        unsigned char *p = lpFirst(lp);
+        unsigned char *str;
+        int64_t len;
+
+        while(p) {
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (!rioWriteBulkCount(r,'*',2+cmd_items) ||
+                    !rioWriteBulkString(r,"SADD",4) ||
+                    !rioWriteBulkObject(r,key))
+                {
+                    return 0;
+                }
+            }
+            str = lpGet(p,&len,NULL);
+            if (str) {
+                if (!rioWriteBulkString(r,(char*)str,len)) return 0;
+            } else {
+                if (!rioWriteBulkLongLong(r,len)) return 0;
+            }
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+            p = lpNext(lp,p);
+        }
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictIterator *di = dictGetIterator(o->ptr);
         dictEntry *de;
@@ -1094,7 +1745,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1102,13 +1753,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -1132,14 +1783,16 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
-    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+               o->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = o->ptr;
         dictIterator *di = dictGetIterator(zs->dict);
         dictEntry *de;
 
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
-            double *score = dictGetVal(de);
+            double score = dictGetDoubleVal(de);
 
             if (count == 0) {
                 int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
@@ -1153,7 +1806,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
                     return 0;
                 }
             }
-            if (!rioWriteBulkDouble(r,*score) ||
+            if (!rioWriteBulkDouble(r,score) ||
                 !rioWriteBulkString(r,ele,sdslen(ele)))
             {
                 dictReleaseIterator(di);
@@ -1176,12 +1829,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1433,25 +2086,9 @@ int rewriteModuleObject(rio *r, robj *key, robj *o) {
     return io.error ? 0 : 1;
 }
 
-/* This function is called by the child rewriting the AOF file to read
- * the difference accumulated from the parent into a buffer, that is
- * concatenated at the end of the rewrite. */
-ssize_t aofReadDiffFromParent(void) {
-    char buf[65536]; /* Default pipe buffer size on most Linux systems. */
-    ssize_t nread, total = 0;
-
-    while ((nread =
-            read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
-        server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
-        total += nread;
-    }
-    return total;
-}
-
 int rewriteAppendOnlyFileRio(rio *aof) {
     dictIterator *di = NULL;
     dictEntry *de;
-    size_t processed = 0;
     int j;
     long key_count = 0;
     long long updated_time = 0;
@@ -1477,7 +2114,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             o = dictGetVal(de);
             initStaticStringObject(key,keystr);
 
-            expiretime = getExpire(db,&key);
+            expiretime = dbEntryGetExpire(de);
 
             /* Save the key and associated value */
             if (o->type == OBJ_STRING) {
@@ -1509,12 +2146,6 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 if (rioWriteBulkObject(aof,&key) == 0) goto werr;
                 if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
             }
-            /* Read some diff from the parent process from time to time. */
-            if (aof->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES) {
-                processed = aof->processed_bytes;
-                aofReadDiffFromParent();
-            }
-
             /* Update info every 1 second (approximately).
              * in order to avoid calling mstime() on each iteration, we will
              * check the diff every 1024 keys */
@@ -1547,7 +2178,6 @@ int rewriteAppendOnlyFile(char *filename) {
     rio aof;
     FILE *fp = NULL;
     char tmpfile[256];
-    char byte;
 
     /* Note that we have to use a different temp name here compared to the
      * one used by rewriteAppendOnlyFileBackground() function. */
@@ -1558,7 +2188,6 @@ int rewriteAppendOnlyFile(char *filename) {
         return C_ERR;
     }
 
-    server.aof_child_diff = sdsempty();
     rioInitWithFile(&aof,fp);
 
     if (server.aof_rewrite_incremental_fsync)
@@ -1576,74 +2205,6 @@ int rewriteAppendOnlyFile(char *filename) {
         if (rewriteAppendOnlyFileRio(&aof) == C_ERR) goto werr;
     }
 
-    /* Do an initial slow fsync here while the parent is still sending
-     * data, in order to make the next final fsync faster. */
-    if (fflush(fp) == EOF) goto werr;
-    if (fsync(fileno(fp)) == -1) goto werr;
-
-    /* Read again a few times to get more data from the parent.
-     * We can't read forever (the server may receive data from clients
-     * faster than it is able to send data to the child), so we try to read
-     * some more data in a loop as soon as there is a good chance more data
-     * will come. If it looks like we are wasting time, we abort (this
-     * happens after 20 ms without new data). */
-    int nodata = 0;
-    mstime_t start = mstime();
-    while(mstime()-start < 1000 && nodata < 20) {
-        if (aeWait(server.aof_pipe_read_data_from_parent, AE_READABLE, 1) <= 0)
-        {
-            nodata++;
-            continue;
-        }
-        nodata = 0; /* Start counting from zero, we stop on N *contiguous*
-                       timeouts. */
-        aofReadDiffFromParent();
-    }
-
-    /* Ask the master to stop sending diffs. */
-    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
-    if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
-        goto werr;
-    /* We read the ACK from the server using a 5 seconds timeout. Normally
-     * it should reply ASAP, but just in case we lose its reply, we are sure
-     * the child will eventually get terminated. */
-    if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
-        byte != '!') goto werr;
-    serverLog(LL_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
-
-    /* Read the final diff if any. */
-    aofReadDiffFromParent();
-
-    /* Write the received diff to the file. */
-    serverLog(LL_NOTICE,
-        "Concatenating %.2f MB of AOF diff received from parent.",
-        (double) sdslen(server.aof_child_diff) / (1024*1024));
-
-    /* Now we write the entire AOF buffer we received from the parent
-     * via the pipe during the life of this fork child.
-     * once a second, we'll take a break and send updated COW info to the parent */
-    size_t bytes_to_write = sdslen(server.aof_child_diff);
-    const char *buf = server.aof_child_diff;
-    long long cow_updated_time = mstime();
-    long long key_count = dbTotalServerKeyCount();
-    while (bytes_to_write) {
-        /* We write the AOF buffer in chunk of 8MB so that we can check the time in between them */
-        size_t chunk_size = bytes_to_write < (8<<20) ? bytes_to_write : (8<<20);
-
-        if (rioWrite(&aof,buf,chunk_size) == 0)
-            goto werr;
-
-        bytes_to_write -= chunk_size;
-        buf += chunk_size;
-
-        /* Update COW info */
-        long long now = mstime();
-        if (now - cow_updated_time >= 1000) {
-            sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO, key_count, "AOF rewrite");
-            cow_updated_time = now;
-        }
-    }
-
     /* Make sure data will not remain on the OS's output buffers */
     if (fflush(fp)) goto werr;
     if (fsync(fileno(fp))) goto werr;
@@ -1670,80 +2231,6 @@ werr:
     return C_ERR;
 }
 
-/* ----------------------------------------------------------------------------
- * AOF rewrite pipes for IPC
- * -------------------------------------------------------------------------- */
-
-/* This event handler is called when the AOF rewriting child sends us a
- * single '!' char to signal we should stop sending buffer diffs. The
- * parent sends a '!' as well to acknowledge. */
-void aofChildPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
-    char byte;
-    UNUSED(el);
-    UNUSED(privdata);
-    UNUSED(mask);
-
-    if (read(fd,&byte,1) == 1 && byte == '!') {
-        serverLog(LL_NOTICE,"AOF rewrite child asks to stop sending diffs.");
-        server.aof_stop_sending_diff = 1;
-        if (write(server.aof_pipe_write_ack_to_child,"!",1) != 1) {
-            /* If we can't send the ack, inform the user, but don't try again
-             * since in the other side the children will use a timeout if the
-             * kernel can't buffer our write, or, the children was
-             * terminated. */
-            serverLog(LL_WARNING,"Can't send ACK to AOF child: %s",
-                strerror(errno));
-        }
-    }
-    /* Remove the handler since this can be called only one time during a
-     * rewrite. */
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-}
-
-/* Create the pipes used for parent - child process IPC during rewrite.
- * We have a data pipe used to send AOF incremental diffs to the child,
- * and two other pipes used by the children to signal it finished with
- * the rewrite so no more data should be written, and another for the
- * parent to acknowledge it understood this new condition. */
-int aofCreatePipes(void) {
-    int fds[6] = {-1, -1, -1, -1, -1, -1};
-    int j;
-
-    if (pipe(fds) == -1) goto error; /* parent -> children data. */
-    if (pipe(fds+2) == -1) goto error; /* children -> parent ack. */
-    if (pipe(fds+4) == -1) goto error; /* parent -> children ack. */
-    /* Parent -> children data is non blocking. */
-    if (anetNonBlock(NULL,fds[0]) != ANET_OK) goto error;
-    if (anetNonBlock(NULL,fds[1]) != ANET_OK) goto error;
-    if (aeCreateFileEvent(server.el, fds[2], AE_READABLE, aofChildPipeReadable, NULL) == AE_ERR) goto error;
-
-    server.aof_pipe_write_data_to_child = fds[1];
-    server.aof_pipe_read_data_from_parent = fds[0];
-    server.aof_pipe_write_ack_to_parent = fds[3];
-    server.aof_pipe_read_ack_from_child = fds[2];
-    server.aof_pipe_write_ack_to_child = fds[5];
-    server.aof_pipe_read_ack_from_parent = fds[4];
-    server.aof_stop_sending_diff = 0;
-    return C_OK;
-
-error:
-    serverLog(LL_WARNING,"Error opening /setting AOF rewrite IPC pipes: %s",
-        strerror(errno));
-    for (j = 0; j < 6; j++) if(fds[j] != -1) close(fds[j]);
-    return C_ERR;
-}
-
-void aofClosePipes(void) {
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-    aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,AE_WRITABLE);
-    close(server.aof_pipe_write_data_to_child);
-    close(server.aof_pipe_read_data_from_parent);
-    close(server.aof_pipe_write_ack_to_parent);
-    close(server.aof_pipe_read_ack_from_child);
-    close(server.aof_pipe_write_ack_to_child);
-    close(server.aof_pipe_read_ack_from_parent);
-}
-
 /* ----------------------------------------------------------------------------
  * AOF background rewrite
  * ------------------------------------------------------------------------- */
@@ -1751,20 +2238,39 @@ void aofClosePipes(void) {
 /* This is how rewriting of the append only file in background works:
  *
  * 1) The user calls BGREWRITEAOF
- * 2) Redis calls this function, that forks():
- *    2a) the child rewrite the append only file in a temp file.
- *    2b) the parent accumulates differences in server.aof_rewrite_buf.
+ * 2) Redis calls this function, that opens a new incr file the commands
+ *    are appended to from now on, and forks():
+ *    2a) the child rewrite the dataset in a temp file.
+ *    2b) the parent keeps appending the new commands to the new incr file.
  * 3) When the child finished '2a' exists.
- * 4) The parent will trap the exit code, if it's OK, will append the
- *    data accumulated into server.aof_rewrite_buf into the temp file, and
- *    finally will rename(2) the temp file in the actual file name.
- *    The the new file is reopened as the new append only file. Profit!
+ * 4) The parent will trap the exit code, if it's OK, will rename(2) the
+ *    temp file as the new base file, and persist a manifest where the
+ *    previous base and incr files are replaced by the new base. The
+ *    obsolete files are then deleted in the background. Profit!
  */
 int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
 
     if (hasActiveChildProcess()) return C_ERR;
-    if (aofCreatePipes() != C_OK) return C_ERR;
+
+    if (dirCreateIfMissing(server.aof_dirname) == -1) {
+        serverLog(LL_WARNING,"Can't open or create append-only dir %s: %s",
+            server.aof_dirname,strerror(errno));
+        server.aof_lastbgrewrite_status = C_ERR;
+        return C_ERR;
+    }
+
+    /* The commands accumulated so far belong to the snapshot the child is
+     * going to write, and must go to the current incr file. We also set
+     * aof_selected_db to -1 in order to force the next call to the
+     * feedAppendOnlyFile() to issue a SELECT command in the new one. */
+    server.aof_selected_db = -1;
+    flushAppendOnlyFile(1);
+    if (openNewIncrAofForAppend() != C_OK) {
+        server.aof_lastbgrewrite_status = C_ERR;
+        return C_ERR;
+    }
+
     if ((childpid = redisFork(CHILD_TYPE_AOF)) == 0) {
         char tmpfile[256];
 
@@ -1784,7 +2290,7 @@ int rewriteAppendOnlyFileBackground(void) {
             serverLog(LL_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
-            aofClosePipes();
+            server.aof_lastbgrewrite_status = C_ERR;
             return C_ERR;
         }
         serverLog(LL_NOTICE,
@@ -1792,11 +2298,8 @@ int rewriteAppendOnlyFileBackground(void) {
         server.aof_rewrite_scheduled = 0;
         server.aof_rewrite_time_start = time(NULL);
 
-        /* We set appendseldb to -1 in order to force the next call to the
-         * feedAppendOnlyFile() to issue a SELECT command, so the differences
-         * accumulated by the parent into server.aof_rewrite_buf will start
-         * with a SELECT statement and it will be safe to merge. */
-        server.aof_selected_db = -1;
+        /* The new incr file must not rely on the scripts loaded by the
+         * EVALSHA commands of the previous files. */
         replicationScriptCacheFlush();
         return C_OK;
     }
@@ -1806,7 +2309,10 @@ int rewriteAppendOnlyFileBackground(void) {
 void bgrewriteaofCommand(client *c) {
     if (server.child_type == CHILD_TYPE_AOF) {
         addReplyError(c,"Background append only file rewriting already in progress");
-    } else if (hasActiveChildProcess()) {
+    } else if (hasActiveChildProcess() || server.in_exec) {
+        /* Inside a transaction the MULTI may already be in the AOF buffer:
+         * the rewrite is delayed so that it is not split across two incr
+         * files. */
         server.aof_rewrite_scheduled = 1;
         addReplyStatus(c,"Background append only file rewriting scheduled");
     } else if (rewriteAppendOnlyFileBackground() == C_OK) {
@@ -1827,150 +2333,120 @@ void aofRemoveTempFile(pid_t childpid) {
     bg_unlink(tmpfile);
 }
 
-/* Update the server.aof_current_size field explicitly using stat(2)
- * to check the size of the file. This is useful after a rewrite or after
- * a restart, normally the size is updated just adding the write length
- * to the current length, that is much faster. */
-void aofUpdateCurrentSize(void) {
-    struct redis_stat sb;
-    mstime_t latency;
-
-    latencyStartMonitor(latency);
-    if (redis_fstat(server.aof_fd,&sb) == -1) {
-        serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
-            strerror(errno));
-    } else {
-        server.aof_current_size = sb.st_size;
-    }
-    latencyEndMonitor(latency);
-    latencyAddSampleIfNeeded("aof-fstat",latency);
-}
-
 /* A background append only file rewriting (BGREWRITEAOF) terminated its work.
  * Handle this. */
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     if (!bysignal && exitcode == 0) {
-        int newfd, oldfd;
         char tmpfile[256];
         long long now = ustime();
+        sds new_base_filename, new_base_filepath;
+        sds new_incr_filepath = NULL;
+        aofManifest *temp_am;
         mstime_t latency;
 
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
 
-        /* Flush the differences accumulated by the parent to the
-         * rewritten AOF. */
-        latencyStartMonitor(latency);
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
             (int)server.child_pid);
-        newfd = open(tmpfile,O_WRONLY|O_APPEND);
-        if (newfd == -1) {
-            serverLog(LL_WARNING,
-                "Unable to open the temporary AOF produced by the child: %s", strerror(errno));
-            goto cleanup;
-        }
 
-        if (aofRewriteBufferWrite(newfd) == -1) {
+        /* The manifest is modified on a copy, that replaces the current one
+         * only once persisted. */
+        temp_am = aofManifestDup(server.aof_manifest);
+        new_base_filename = getNewBaseFileNameAndMarkPreAsHistory(temp_am);
+        new_base_filepath = makePath(server.aof_dirname,new_base_filename);
+
+        /* Rename the temporary file as the new base file. Nothing references
+         * it before the manifest is persisted. */
+        latencyStartMonitor(latency);
+        if (rename(tmpfile,new_base_filepath) == -1) {
             serverLog(LL_WARNING,
-                "Error trying to flush the parent diff to the rewritten AOF: %s", strerror(errno));
-            close(newfd);
+                "Error trying to rename the temporary AOF file %s into %s: %s",
+                tmpfile,
+                new_base_filename,
+                strerror(errno));
+            aofManifestFree(temp_am);
+            sdsfree(new_base_filepath);
+            server.aof_lastbgrewrite_status = C_ERR;
             goto cleanup;
         }
         latencyEndMonitor(latency);
-        latencyAddSampleIfNeeded("aof-rewrite-diff-write",latency);
-  
-        if (server.aof_fsync == AOF_FSYNC_EVERYSEC) {
-            aof_background_fsync(newfd);
-        } else if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+        latencyAddSampleIfNeeded("aof-rename",latency);
+
+        /* While AOF_WAIT_REWRITE the commands were appended to a temporary
+         * incr file, that now becomes the first incr file. */
+        if (server.aof_state == AOF_WAIT_REWRITE) {
+            sds temp_incr_aof_name = getTempIncrAofName();
+            sds temp_incr_filepath = makePath(server.aof_dirname,
+                                              temp_incr_aof_name);
+            sds new_incr_filename = getNewIncrAofName(temp_am);
+
+            new_incr_filepath = makePath(server.aof_dirname,new_incr_filename);
             latencyStartMonitor(latency);
-            if (redis_fsync(newfd) == -1) {
+            if (rename(temp_incr_filepath,new_incr_filepath) == -1) {
                 serverLog(LL_WARNING,
-                    "Error trying to fsync the parent diff to the rewritten AOF: %s", strerror(errno));
-                close(newfd);
+                    "Error trying to rename the temporary AOF incr file %s into %s: %s",
+                    temp_incr_aof_name,
+                    new_incr_filename,
+                    strerror(errno));
+                bg_unlink(new_base_filepath);
+                aofManifestFree(temp_am);
+                sdsfree(temp_incr_aof_name);
+                sdsfree(temp_incr_filepath);
+                sdsfree(new_base_filepath);
+                sdsfree(new_incr_filepath);
+                server.aof_lastbgrewrite_status = C_ERR;
                 goto cleanup;
             }
             latencyEndMonitor(latency);
-            latencyAddSampleIfNeeded("aof-rewrite-done-fsync",latency);
+            latencyAddSampleIfNeeded("aof-rename",latency);
+            sdsfree(temp_incr_aof_name);
+            sdsfree(temp_incr_filepath);
         }
 
-        serverLog(LL_NOTICE,
-            "Residual parent diff successfully flushed to the rewritten AOF (%.2f MB)", (double) aofRewriteBufferSize() / (1024*1024));
-
-        /* The only remaining thing to do is to rename the temporary file to
-         * the configured file and switch the file descriptor used to do AOF
-         * writes. We don't want close(2) or rename(2) calls to block the
-         * server on old file deletion.
-         *
-         * There are two possible scenarios:
-         *
-         * 1) AOF is DISABLED and this was a one time rewrite. The temporary
-         * file will be renamed to the configured file. When this file already
-         * exists, it will be unlinked, which may block the server.
-         *
-         * 2) AOF is ENABLED and the rewritten AOF will immediately start
-         * receiving writes. After the temporary file is renamed to the
-         * configured file, the original AOF file descriptor will be closed.
-         * Since this will be the last reference to that file, closing it
-         * causes the underlying file to be unlinked, which may block the
-         * server.
-         *
-         * To mitigate the blocking effect of the unlink operation (either
-         * caused by rename(2) in scenario 1, or by close(2) in scenario 2), we
-         * use a background thread to take care of this. First, we
-         * make scenario 1 identical to scenario 2 by opening the target file
-         * when it exists. The unlink operation after the rename(2) will then
-         * be executed upon calling close(2) for its descriptor. Everything to
-         * guarantee atomicity for this switch has already happened by then, so
-         * we don't care what the outcome or duration of that close operation
-         * is, as long as the file descriptor is released again. */
-        if (server.aof_fd == -1) {
-            /* AOF disabled */
-
-            /* Don't care if this fails: oldfd will be -1 and we handle that.
-             * One notable case of -1 return is if the old file does
-             * not exist. */
-            oldfd = open(server.aof_filename,O_RDONLY|O_NONBLOCK);
-        } else {
-            /* AOF enabled */
-            oldfd = -1; /* We'll set this to the current AOF filedes later. */
-        }
-
-        /* Rename the temporary file. This will not unlink the target file if
-         * it exists, because we reference it with "oldfd". */
-        latencyStartMonitor(latency);
-        if (rename(tmpfile,server.aof_filename) == -1) {
-            serverLog(LL_WARNING,
-                "Error trying to rename the temporary AOF file %s into %s: %s",
-                tmpfile,
-                server.aof_filename,
-                strerror(errno));
-            close(newfd);
-            if (oldfd != -1) close(oldfd);
+        /* The incr files written before the rewrite started are now part
+         * of the new base. */
+        markRewrittenIncrAofAsHistory(temp_am);
+
+        if (persistAofManifest(temp_am) == C_ERR) {
+            bg_unlink(new_base_filepath);
+            aofManifestFree(temp_am);
+            sdsfree(new_base_filepath);
+            if (new_incr_filepath) {
+                /* Move the incr file back, it is still being written. */
+                sds temp_incr_aof_name = getTempIncrAofName();
+                sds temp_incr_filepath = makePath(server.aof_dirname,
+                                                  temp_incr_aof_name);
+                if (rename(new_incr_filepath,temp_incr_filepath) == -1)
+                    serverLog(LL_WARNING,
+                        "Error trying to rename the AOF incr file back to %s: %s",
+                        temp_incr_aof_name,strerror(errno));
+                sdsfree(temp_incr_aof_name);
+                sdsfree(temp_incr_filepath);
+                sdsfree(new_incr_filepath);
+            }
+            server.aof_lastbgrewrite_status = C_ERR;
             goto cleanup;
         }
-        latencyEndMonitor(latency);
-        latencyAddSampleIfNeeded("aof-rename",latency);
-
-        if (server.aof_fd == -1) {
-            /* AOF disabled, we don't need to set the AOF file descriptor
-             * to this new file, so we can close it. */
-            close(newfd);
-        } else {
-            /* AOF enabled, replace the old fd with the new one. */
-            oldfd = server.aof_fd;
-            server.aof_fd = newfd;
-            server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
-            aofUpdateCurrentSize();
+        sdsfree(new_base_filepath);
+        if (new_incr_filepath) sdsfree(new_incr_filepath);
+
+        aofManifestFreeAndUpdate(temp_am);
+        if (server.aof_fd != -1) {
+            /* AOF enabled: the incr file being written keeps growing from
+             * the size it has now. */
+            server.aof_current_size =
+                getAppendOnlyFileSize(server.aof_manifest->base_aof_info->file_name) +
+                server.aof_last_incr_size;
             server.aof_rewrite_base_size = server.aof_current_size;
             server.aof_fsync_offset = server.aof_current_size;
             server.aof_last_fsync = server.unixtime;
-
-            /* Clear regular AOF buffer since its contents was just written to
-             * the new AOF from the background rewrite buffer. */
-            sdsfree(server.aof_buf);
-            server.aof_buf = sdsempty();
         }
 
+        /* A failure to delete the history files is not a problem: they are
+         * retried at the next rewrite or restart. */
+        aofDelHistoryFiles();
+
         server.aof_lastbgrewrite_status = C_OK;
 
         serverLog(LL_NOTICE, "Background AOF rewrite finished successfully");
@@ -1978,9 +2454,6 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         if (server.aof_state == AOF_WAIT_REWRITE)
             server.aof_state = AOF_ON;
 
-        /* Asynchronously close the overwritten AOF. */
-        if (oldfd != -1) bioCreateCloseJob(oldfd);
-
         serverLog(LL_VERBOSE,
             "Background AOF rewrite signal handler took %lldus", ustime()-now);
     } else if (!bysignal && exitcode != 0) {
@@ -1999,8 +2472,6 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     }
 
 cleanup:
-    aofClosePipes();
-    aofRewriteBufferReset();
     aofRemoveTempFile(server.child_pid);
     server.aof_rewrite_time_last = time(NULL)-server.aof_rewrite_time_start;
     server.aof_rewrite_time_start = -1;
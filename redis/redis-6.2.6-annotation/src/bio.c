@@ -80,6 +80,8 @@ struct bio_job {
     time_t time; /* Time at which the job was created. */
     /* Job specific arguments.*/
     int fd; /* Fd for file based background jobs */
+    int close_fd; /* Close the fd once the fsync is done. */
+    long long offset; /* AOF offset covered by the fsync. */
     lazy_free_fn *free_fn; /* Function that will free the provided arguments */
     void *free_args[]; /* List of arguments to be passed to the free function */
 };
@@ -135,21 +137,39 @@ void bioSubmitJob(int type, struct bio_job *job) {
     pthread_mutex_unlock(&bio_mutex[type]);
 }
 
-void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...) {
-    va_list valist;
+static struct bio_job *bioCreateFnJob(lazy_free_fn fn, int arg_count, va_list valist) {
     /* Allocate memory for the job structure and all required
      * arguments */
     struct bio_job *job = zmalloc(sizeof(*job) + sizeof(void *) * (arg_count));
-    job->free_fn = free_fn;
+    job->free_fn = fn;
 
-    va_start(valist, arg_count);
     for (int i = 0; i < arg_count; i++) {
         job->free_args[i] = va_arg(valist, void *);
     }
+    return job;
+}
+
+void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...) {
+    va_list valist;
+
+    va_start(valist, arg_count);
+    struct bio_job *job = bioCreateFnJob(free_fn, arg_count, valist);
     va_end(valist);
     bioSubmitJob(BIO_LAZY_FREE, job);
 }
 
+/* Jobs of the forkless snapshot (see snapshot.c) call fn(args) like lazy
+ * free jobs, but in their own thread, so that writing the snapshot file
+ * never delays freeing objects, and the other way around. */
+void bioCreateSnapshotJob(lazy_free_fn fn, int arg_count, ...) {
+    va_list valist;
+
+    va_start(valist, arg_count);
+    struct bio_job *job = bioCreateFnJob(fn, arg_count, valist);
+    va_end(valist);
+    bioSubmitJob(BIO_SNAPSHOT, job);
+}
+
 void bioCreateCloseJob(int fd) {
     struct bio_job *job = zmalloc(sizeof(*job));
     job->fd = fd;
@@ -157,9 +177,26 @@ void bioCreateCloseJob(int fd) {
     bioSubmitJob(BIO_CLOSE_FILE, job);
 }
 
-void bioCreateFsyncJob(int fd) {
+/* Fsync the AOF file: once done, 'offset' (see server.aof_written_offset)
+ * is published as fsynced, and the event loop is awaken so that the clients
+ * waiting for it can be served. */
+void bioCreateFsyncJob(int fd, long long offset) {
     struct bio_job *job = zmalloc(sizeof(*job));
     job->fd = fd;
+    job->close_fd = 0;
+    job->offset = offset;
+
+    bioSubmitJob(BIO_AOF_FSYNC, job);
+}
+
+/* Fsync and then close an AOF file that is no longer written. The job is
+ * queued with the other fsync jobs, so it runs after the ones that may be
+ * pending for the same fd. */
+void bioCreateFsyncAndCloseJob(int fd, long long offset) {
+    struct bio_job *job = zmalloc(sizeof(*job));
+    job->fd = fd;
+    job->close_fd = 1;
+    job->offset = offset;
 
     bioSubmitJob(BIO_AOF_FSYNC, job);
 }
@@ -186,6 +223,9 @@ void *bioProcessBackgroundJobs(void *arg) {
     case BIO_LAZY_FREE:
         redis_set_thread_title("bio_lazy_free");
         break;
+    case BIO_SNAPSHOT:
+        redis_set_thread_title("bio_snapshot");
+        break;
     }
 
     redisSetCpuAffinity(server.bio_cpulist);
@@ -236,8 +276,17 @@ void *bioProcessBackgroundJobs(void *arg) {
                 }
             } else {
                 atomicSet(server.aof_bio_fsync_status,C_OK);
+                atomicSet(server.aof_fsynced_offset,job->offset);
+            }
+            /* Awake the event loop so that the clients in durable mode are
+             * served, or the fsync they wait for is retried on failure.
+             * Best effort: if the pipe is full the event loop is going to
+             * be awaken anyway. */
+            if (write(server.aof_fsync_pipe[1],"A",1) != 1) {
+                /* Nothing to do. */
             }
-        } else if (type == BIO_LAZY_FREE) {
+            if (job->close_fd) close(job->fd);
+        } else if (type == BIO_LAZY_FREE || type == BIO_SNAPSHOT) {
             job->free_fn(job->free_args);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
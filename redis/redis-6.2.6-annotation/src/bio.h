@@ -39,13 +39,16 @@ unsigned long long bioWaitStepOfType(int type);
 time_t bioOlderJobOfType(int type);
 void bioKillThreads(void);
 void bioCreateCloseJob(int fd);
-void bioCreateFsyncJob(int fd);
+void bioCreateFsyncJob(int fd, long long offset);
+void bioCreateFsyncAndCloseJob(int fd, long long offset);
 void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...);
+void bioCreateSnapshotJob(lazy_free_fn fn, int arg_count, ...);
 
 /* Background job opcodes */
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_SNAPSHOT      3 /* Forkless snapshot file writes. */
+#define BIO_NUM_OPS       4
 
 #endif
@@ -189,6 +189,12 @@ void unblockClient(client *c) {
     } else if (c->btype == BLOCKED_PAUSE) {
         listDelNode(server.paused_clients,c->paused_list_node);
         c->paused_list_node = NULL;
+    } else if (c->btype == BLOCKED_SHARD) {
+        /* If the client is unblocked because it is being freed, the reply
+         * of the other shard is just discarded. */
+        shardUnblockClient(c);
+    } else if (c->btype == BLOCKED_AOF) {
+        unblockClientWaitingAofFsync(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -249,7 +255,8 @@ void disconnectAllBlockedClients(void) {
              * command processing will start from scratch, and the command will
              * be either executed or rejected. (unlike LIST blocked clients for
              * which the command is already in progress in a way. */
-            if (c->btype == BLOCKED_PAUSE)
+            if (c->btype == BLOCKED_PAUSE || c->btype == BLOCKED_SHARD ||
+                c->btype == BLOCKED_AOF)
                 continue;
 
             addReplyError(c,
@@ -264,6 +271,15 @@ void disconnectAllBlockedClients(void) {
 /* Helper function for handleClientsBlockedOnKeys(). This function is called
  * when there may be clients blocked on a list key, and there may be new
  * data to fetch (the key is ready). */
+/* Called once a client blocked on keys was served and unblocked, with the AOF
+ * offset before it was served. Like after the execution of a command (see
+ * processCommand()), a client in durable mode gets its reply only once what
+ * serving it wrote to the AOF (BLMOVE, BZPOPMIN, XREADGROUP, ...) is fsynced. */
+static void blockServedClientForAofFsync(client *c, long long aof_offset) {
+    if (c->flags & CLIENT_DURABLE && server.aof_written_offset != aof_offset)
+        blockForAofFsync(c);
+}
+
 void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
     /* We serve clients in the same order they blocked for
      * this key, from the first blocked to the last. */
@@ -294,6 +310,7 @@ void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
                  * call. */
                 if (dstkey) incrRefCount(dstkey);
 
+                long long aof_offset = server.aof_written_offset;
                 monotime replyTimer;
                 elapsedStart(&replyTimer);
                 if (serveClientBlockedOnList(receiver,
@@ -306,6 +323,7 @@ void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
                 }
                 updateStatsOnUnblock(receiver, 0, elapsedUs(replyTimer));
                 unblockClient(receiver);
+                blockServedClientForAofFsync(receiver,aof_offset);
 
                 if (dstkey) decrRefCount(dstkey);
                 decrRefCount(value);
@@ -349,6 +367,7 @@ void serveClientsBlockedOnSortedSetKey(robj *o, readyList *rl) {
             int where = (receiver->lastcmd &&
                          receiver->lastcmd->proc == bzpopminCommand)
                          ? ZSET_MIN : ZSET_MAX;
+            long long aof_offset = server.aof_written_offset;
             monotime replyTimer;
             elapsedStart(&replyTimer);
             genericZpopCommand(receiver,&rl->key,1,where,1,NULL);
@@ -368,6 +387,7 @@ void serveClientsBlockedOnSortedSetKey(robj *o, readyList *rl) {
                       argv,2,PROPAGATE_AOF|PROPAGATE_REPL);
             decrRefCount(argv[0]);
             decrRefCount(argv[1]);
+            blockServedClientForAofFsync(receiver,aof_offset);
         }
     }
 }
@@ -423,6 +443,7 @@ void serveClientsBlockedOnStreamKey(robj *o, readyList *rl) {
             if (streamCompareID(&s->last_id, gt) > 0) {
                 streamID start = *gt;
                 streamIncrID(&start);
+                long long aof_offset = server.aof_written_offset;
 
                 /* Lookup the consumer for the group, if any. */
                 streamConsumer *consumer = NULL;
@@ -471,6 +492,7 @@ void serveClientsBlockedOnStreamKey(robj *o, readyList *rl) {
                  * valid, so we must do the setup above before
                  * this call. */
                 unblockClient(receiver);
+                blockServedClientForAofFsync(receiver,aof_offset);
             }
         }
     }
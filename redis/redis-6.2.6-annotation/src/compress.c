@@ -0,0 +1,289 @@
+/* Compression algorithms used for RDB strings and quicklist nodes.
+ *
+ * LZF is always available, and it is the default: files and lists
+ * compressed with it are the same as before this layer existed. LZ4 (very
+ * fast decompression, good for list-compress-depth nodes that are
+ * decompressed on access) and zstd (better ratio, good for RDB files,
+ * optionally with a trained dictionary) are linked from the system
+ * libraries when Redis is built with USE_LZ4=yes and USE_ZSTD=yes.
+ *
+ * Copyright (c) 2009-2021, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "compress.h"
+#include "lzf.h"
+#include "zmalloc.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <pthread.h>
+#include <zstd.h>
+
+/* Compression is performed by the main thread, the RDB saving and loading
+ * threads and the quicklist code, so every thread has its own contexts.
+ * The RDB threads are created for every load or save, so the contexts are
+ * freed when their thread exits, see zstdThreadInit(). */
+static __thread ZSTD_CCtx *zstd_cctx = NULL;
+static __thread ZSTD_DCtx *zstd_dctx = NULL;
+static pthread_key_t zstd_thread_key;
+static pthread_once_t zstd_thread_key_once = PTHREAD_ONCE_INIT;
+
+/* The trained dictionary, if any. It is loaded at startup and never changed
+ * later, so the threads can share it. */
+static ZSTD_CDict *zstd_cdict = NULL;
+static ZSTD_DDict *zstd_ddict = NULL;
+static unsigned zstd_dict_id = 0;
+
+#define ZSTD_LEVEL 3
+
+/* Destructor of zstd_thread_key: free the contexts of the exiting thread. */
+static void zstdThreadFree(void *unused) {
+    (void)unused;
+    ZSTD_freeCCtx(zstd_cctx);
+    ZSTD_freeDCtx(zstd_dctx);
+    zstd_cctx = NULL;
+    zstd_dctx = NULL;
+}
+
+static void zstdThreadKeyCreate(void) {
+    pthread_key_create(&zstd_thread_key,zstdThreadFree);
+}
+
+/* Called when the calling thread creates its first context: setting a non
+ * NULL value for the key makes its destructor run when the thread exits. */
+static void zstdThreadInit(void) {
+    pthread_once(&zstd_thread_key_once,zstdThreadKeyCreate);
+    pthread_setspecific(zstd_thread_key,&zstd_thread_key);
+}
+#endif
+
+int compressCodecAvailable(int codec) {
+    switch(codec) {
+    case COMPRESS_LZF: return 1;
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4: return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: return 1;
+#endif
+    default: return 0;
+    }
+}
+
+const char *compressCodecName(int codec) {
+    switch(codec) {
+    case COMPRESS_LZF: return "lzf";
+    case COMPRESS_LZ4: return "lz4";
+    case COMPRESS_ZSTD: return "zstd";
+    default: return "unknown";
+    }
+}
+
+/* Compress 'inlen' bytes from 'in' into 'out'. Returns the compressed length,
+ * or 0 if the result does not fit in 'outlen' bytes, so callers asking for
+ * a minimum gain just pass a smaller 'outlen', or if the codec is not
+ * available. */
+size_t compressData(int codec, const void *in, size_t inlen, void *out, size_t outlen) {
+    switch(codec) {
+    case COMPRESS_LZF:
+        return lzf_compress(in,inlen,out,outlen);
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4: {
+        if (inlen > LZ4_MAX_INPUT_SIZE) return 0;
+        int n = LZ4_compress_default(in,out,inlen,outlen > INT_MAX ? INT_MAX : outlen);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t n;
+        if (!zstd_cctx) {
+            if ((zstd_cctx = ZSTD_createCCtx()) == NULL) return 0;
+            zstdThreadInit();
+        }
+        if (zstd_cdict)
+            n = ZSTD_compress_usingCDict(zstd_cctx,out,outlen,in,inlen,zstd_cdict);
+        else
+            n = ZSTD_compressCCtx(zstd_cctx,out,outlen,in,inlen,ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Decompress 'inlen' bytes from 'in' into 'out', that has room for the
+ * 'outlen' bytes of the original data. Returns the decompressed length, or
+ * 0 if the data is corrupted or the codec is not available. */
+size_t decompressData(int codec, const void *in, size_t inlen, void *out, size_t outlen) {
+    switch(codec) {
+    case COMPRESS_LZF:
+        return lzf_decompress(in,inlen,out,outlen);
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4: {
+        if (inlen > INT_MAX || outlen > INT_MAX) return 0;
+        int n = LZ4_decompress_safe(in,out,inlen,outlen);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t n;
+        unsigned dict_id = ZSTD_getDictID_fromFrame(in,inlen);
+        if (!zstd_dctx) {
+            if ((zstd_dctx = ZSTD_createDCtx()) == NULL) return 0;
+            zstdThreadInit();
+        }
+        if (dict_id == 0)
+            n = ZSTD_decompressDCtx(zstd_dctx,out,outlen,in,inlen);
+        else if (zstd_ddict && dict_id == zstd_dict_id)
+            n = ZSTD_decompress_usingDDict(zstd_dctx,out,outlen,in,inlen,zstd_ddict);
+        else
+            return 0; /* Compressed with a dictionary we don't have. */
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Load a zstd dictionary (as created by "zstd --train") used to compress
+ * and decompress zstd data from now on. Data compressed with a dictionary
+ * can only be decompressed with the same dictionary. Must be called before
+ * any other thread uses this API. Returns 0 on success, otherwise -1 with
+ * an error message in 'err'. */
+int compressLoadDictionary(const char *filename, char *err, size_t errlen) {
+#ifdef HAVE_ZSTD
+    FILE *fp = fopen(filename,"r");
+    char *buf = NULL;
+    long size;
+
+    if (!fp) {
+        snprintf(err,errlen,"Can't open %s: %s",filename,strerror(errno));
+        return -1;
+    }
+    if (fseek(fp,0,SEEK_END) == -1 || (size = ftell(fp)) <= 0 ||
+        fseek(fp,0,SEEK_SET) == -1)
+    {
+        snprintf(err,errlen,"Can't read %s",filename);
+        fclose(fp);
+        return -1;
+    }
+    buf = zmalloc(size);
+    if (fread(buf,size,1,fp) != 1) {
+        snprintf(err,errlen,"Can't read %s",filename);
+        goto error;
+    }
+    zstd_dict_id = ZSTD_getDictID_fromDict(buf,size);
+    if (zstd_dict_id == 0) {
+        snprintf(err,errlen,"%s is not a zstd dictionary",filename);
+        goto error;
+    }
+    zstd_cdict = ZSTD_createCDict(buf,size,ZSTD_LEVEL);
+    zstd_ddict = ZSTD_createDDict(buf,size);
+    if (!zstd_cdict || !zstd_ddict) {
+        snprintf(err,errlen,"Invalid zstd dictionary %s",filename);
+        goto error;
+    }
+    zfree(buf);
+    fclose(fp);
+    return 0;
+
+error:
+    ZSTD_freeCDict(zstd_cdict);
+    ZSTD_freeDDict(zstd_ddict);
+    zstd_cdict = NULL;
+    zstd_ddict = NULL;
+    zstd_dict_id = 0;
+    zfree(buf);
+    fclose(fp);
+    return -1;
+#else
+    (void)filename;
+    snprintf(err,errlen,"Compression dictionaries require zstd support "
+                        "(build with USE_ZSTD=yes)");
+    return -1;
+#endif
+}
+
+#ifdef REDIS_TEST
+#include <stdlib.h>
+
+#define UNUSED(x) (void)(x)
+
+static int compress_failed = 0;
+#define compressTestCond(codec,descr,_c) do { \
+    printf("%s %s: %s\n", compressCodecName(codec), descr, \
+        (_c) ? "PASSED" : "FAILED"); \
+    if (!(_c)) compress_failed++; \
+} while(0)
+
+int compressTest(int argc, char *argv[], int accurate) {
+    size_t len = 100000, clen;
+    char *data = zmalloc(len), *c = zmalloc(len), *d = zmalloc(len);
+    UNUSED(argc);
+    UNUSED(argv);
+    UNUSED(accurate);
+
+    /* Repetitive but not trivial data, like ziplists and RDB payloads. */
+    for (size_t j = 0; j < len; j++)
+        data[j] = "redis:key:"[j%10] + (rand()%16 == 0);
+
+    for (int codec = 0; codec < COMPRESS_CODECS; codec++) {
+        if (!compressCodecAvailable(codec)) {
+            printf("%s not available, skipping\n",compressCodecName(codec));
+            continue;
+        }
+        clen = compressData(codec,data,len,c,len);
+        compressTestCond(codec,"round trip", clen > 0 && clen < len &&
+            decompressData(codec,c,clen,d,len) == len &&
+            memcmp(data,d,len) == 0);
+        compressTestCond(codec,"rejects small output buffers",
+            compressData(codec,data,len,c,16) == 0);
+        memset(c,0xff,16);
+        size_t n = decompressData(codec,c,clen,d,len);
+        compressTestCond(codec,"detects corrupted input",
+            n != len || memcmp(data,d,len) != 0);
+        printf("%s: %zu -> %zu bytes\n",compressCodecName(codec),len,clen);
+    }
+    zfree(data);
+    zfree(c);
+    zfree(d);
+    return compress_failed ? 1 : 0;
+}
+#endif
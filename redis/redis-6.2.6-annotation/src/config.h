@@ -79,6 +79,11 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* Test for futex(2), used to wake up the IO threads */
+#ifdef __linux__
+#define HAVE_FUTEX 1
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
@@ -104,6 +109,15 @@
 #define redis_unreachable abort
 #endif
 
+/* Test for the compiler support needed to build x86 SIMD code paths that
+ * are selected at runtime, according to the features of the CPU. */
+#if defined(__x86_64__) && ((defined(__GNUC__) && __GNUC__ >= 5) || \
+    (defined(__clang__) && __clang_major__ >= 4))
+#define HAVE_X86_SIMD 1
+#define ATTRIBUTE_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define ATTRIBUTE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
 #if __GNUC__ >= 3
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -178,6 +178,62 @@ static int connSocketWrite(connection *conn, const void *data, size_t data_len)
     return ret;
 }
 
+static int connSocketWritev(connection *conn, const struct iovec *iov, int iovcnt) {
+    int ret = writev(conn->fd, iov, iovcnt);
+    if (ret < 0 && errno != EAGAIN) {
+        conn->last_errno = errno;
+
+        /* Don't overwrite the state of a connection that is not already
+         * connected, not to mess with handler callbacks.
+         */
+        if (conn->state == CONN_STATE_CONNECTED)
+            conn->state = CONN_STATE_ERROR;
+    }
+
+    return ret;
+}
+
+/* Return true if connWritevBatch() can write to many sockets with a single
+ * system call, see aeWritevBatch(). */
+int connCanWritevBatch(void) {
+    return aeCanWritevBatch(server.el);
+}
+
+/* Perform the writes in 'reqs', submitting the ones to plain sockets
+ * together. Every request gets the result that connWritev() would return.
+ * Must be called only if connCanWritevBatch() is true. */
+void connWritevBatch(connWritevReq *reqs, int count) {
+    aeWritevReq *batch = zmalloc(sizeof(aeWritevReq)*count);
+    int j, n = 0;
+
+    for (j = 0; j < count; j++) {
+        if (reqs[j].conn->type != &CT_Socket) continue;
+        batch[n].fd = reqs[j].conn->fd;
+        batch[n].iov = reqs[j].iov;
+        batch[n].iovcnt = reqs[j].iovcnt;
+        n++;
+    }
+    serverAssert(aeWritevBatch(server.el,batch,n) == AE_OK);
+
+    for (j = 0, n = 0; j < count; j++) {
+        connection *conn = reqs[j].conn;
+
+        if (conn->type != &CT_Socket) {
+            reqs[j].ret = connWritev(conn,reqs[j].iov,reqs[j].iovcnt);
+            continue;
+        }
+        reqs[j].ret = batch[n].res;
+        if (batch[n].res == -1 && batch[n].err != EAGAIN) {
+            /* Same as connSocketWritev(). */
+            conn->last_errno = batch[n].err;
+            if (conn->state == CONN_STATE_CONNECTED)
+                conn->state = CONN_STATE_ERROR;
+        }
+        n++;
+    }
+    zfree(batch);
+}
+
 static int connSocketRead(connection *conn, void *buf, size_t buf_len) {
     int ret = read(conn->fd, buf, buf_len);
     if (!ret) {
@@ -349,6 +405,7 @@ ConnectionType CT_Socket = {
     .ae_handler = connSocketEventHandler,
     .close = connSocketClose,
     .write = connSocketWrite,
+    .writev = connSocketWritev,
     .read = connSocketRead,
     .accept = connSocketAccept,
     .connect = connSocketConnect,
@@ -417,6 +474,13 @@ int connRecvTimeout(connection *conn, long long ms) {
     return anetRecvTimeout(NULL, conn->fd, ms);
 }
 
+/* Shut down both directions of the connection, so that a thread blocked
+ * reading from it returns. The connection still needs to be closed. */
+int connShutdown(connection *conn) {
+    if (conn->fd == -1) return C_ERR;
+    return shutdown(conn->fd, SHUT_RDWR) == -1 ? C_ERR : C_OK;
+}
+
 int connGetState(connection *conn) {
     return conn->state;
 }
@@ -42,6 +42,88 @@ struct dbBackup {
     uint64_t slots_keys_count[CLUSTER_SLOTS];
 };
 
+/*-----------------------------------------------------------------------------
+ * Keyspace entries
+ *
+ * The entries of db->dict are allocated together with the key they refer to,
+ * so that adding a key costs a single allocation and comparing the key
+ * while looking it up doesn't need to access another cache line. Volatile
+ * keys also store their expire time in the entry, so that it can be read
+ * without a lookup in db->expires, that only stores a copy of it for the
+ * active expire cycle and the eviction of volatile keys:
+ *
+ * +-----------+----------------------------+---------------------------+
+ * | dictEntry | expire time (if volatile)  | sds header + key + '\0'   |
+ * +-----------+----------------------------+---------------------------+
+ *
+ * The key is an embedded sds (see sdsnewembed()): it is released with the
+ * entry, and it is also referenced by the db->expires entry of the key.
+ * When forkless snapshots are enabled the user bits of the key header store
+ * the snapshot epoch of the key (see snapshot.c).
+ *----------------------------------------------------------------------------*/
+
+/* True if the entry has room for an expire time, that is, if the key does
+ * not start right after the dictEntry struct. */
+#define dbEntryHasExpireField(de) \
+    ((char*)sdsAllocPtr(dictGetKey(de)) != (char*)((de)+1))
+#define dbEntryExpireField(de) ((long long*)((de)+1))
+
+/* The 'entryCreate' method of the db->dict type: allocate an entry with the
+ * key embedded and no expire field. */
+dictEntry *dbEntryCreate(void *privdata, const void *key) {
+    size_t keylen = sdslen((sds)key);
+    int userbits = server.bgsave_forkless;
+    dictEntry *de = zmalloc(sizeof(*de)+sdsEmbedSize(keylen,userbits));
+
+    UNUSED(privdata);
+    de->key = sdsnewembed(de+1,key,keylen,userbits);
+    de->next = NULL;
+    /* Keys created while a snapshot is in progress are not part of it. */
+    if (userbits) dbEntrySetSnapshotEpoch(de,server.snapshot_epoch);
+    return de;
+}
+
+/* Return the epoch of the last snapshot that saved the key of the entry,
+ * or that was in progress when the key was created. Only available if
+ * bgsave-forkless is enabled. */
+int dbEntryGetSnapshotEpoch(dictEntry *de) {
+    return sdsuserbits(dictGetKey(de));
+}
+
+void dbEntrySetSnapshotEpoch(dictEntry *de, int epoch) {
+    sdssetuserbits(dictGetKey(de),epoch);
+}
+
+/* Return the expire time stored in a db->dict entry, or -1 if the key is
+ * not volatile. */
+long long dbEntryGetExpire(dictEntry *de) {
+    return dbEntryHasExpireField(de) ? *dbEntryExpireField(de) : -1;
+}
+
+/* Store 'when' as the expire time of the db->dict entry 'de'. The first time
+ * a key gets an expire the entry is reallocated in order to make room for it:
+ * the new entry is linked in place of the old one and returned, so the old
+ * 'de' pointer must not be used after calling this function. */
+static dictEntry *dbEntrySetExpire(redisDb *db, dictEntry *de, long long when) {
+    if (!dbEntryHasExpireField(de)) {
+        sds key = dictGetKey(de);
+        size_t keyoffset = (char*)key - (char*)sdsAllocPtr(key);
+        size_t keysize = keyoffset+sdslen(key)+1;
+        /* Find where the entry is linked before moving it. The key can't be
+         * in db->expires yet, so nothing else references the entry. */
+        dictEntry **deref = dictFindEntryRefByPtrAndHash(db->dict,key,
+                                dictGetHash(db->dict,key));
+        serverAssert(deref != NULL && *deref == de);
+
+        de = zrealloc(de,sizeof(*de)+sizeof(long long)+keysize);
+        memmove((char*)(de+1)+sizeof(long long),de+1,keysize);
+        de->key = (char*)(de+1)+sizeof(long long)+keyoffset;
+        *deref = de;
+    }
+    *dbEntryExpireField(de) = when;
+    return de;
+}
+
 /*-----------------------------------------------------------------------------
  * C-level DB API
  *----------------------------------------------------------------------------*/
@@ -67,7 +149,12 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
 
         /* Update the access time for the ageing algorithm.
          * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
+         * a copy on write madness.
+         *
+         * Note that commands executed from IO threads may race updating
+         * this field: this is harmless since it is just an approximated
+         * hint for the eviction, and no other field of the object header
+         * can change while the IO threads are running. */
         if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
             if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
                 updateLFU(val);
@@ -135,14 +222,20 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
     val = lookupKey(db,key,flags);
     if (val == NULL)
         goto keymiss;
-    server.stat_keyspace_hits++;
+    if (io_thread_stats)
+        io_thread_stats->keyspace_hits++;
+    else
+        server.stat_keyspace_hits++;
     return val;
 
 keymiss:
     if (!(flags & LOOKUP_NONOTIFY)) {
         notifyKeyspaceEvent(NOTIFY_KEY_MISS, "keymiss", key, db->id);
     }
-    server.stat_keyspace_misses++;
+    if (io_thread_stats)
+        io_thread_stats->keyspace_misses++;
+    else
+        server.stat_keyspace_misses++;
     return NULL;
 }
 
@@ -158,6 +251,9 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags) {
+    /* The caller may modify the value: save it to the forkless BGSAVE in
+     * progress first. */
+    if (server.snapshot_in_progress) snapshotSaveKey(db,key);
     expireIfNeeded(db,key);
     return lookupKey(db,key,flags);
 }
@@ -191,8 +287,8 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    /* The key is copied inside the new entry, see dbEntryCreate(). */
+    int retval = dictAdd(db->dict, key->ptr, val);
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     signalKeyAsReady(db, key, val->type);
@@ -200,16 +296,15 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 }
 
 /* This is a special version of dbAdd() that is used only when loading
- * keys from the RDB file: the key is passed as an SDS string that is
- * retained by the function (and not freed by the caller).
+ * keys from the RDB file: the key is passed as an SDS string, that is
+ * copied inside the new entry, so it is always up to the caller to free it.
  *
  * Moreover this function will not abort if the key is already busy, to
  * give more control to the caller, nor will signal the key as ready
  * since it is not useful in this context.
  *
- * The function returns 1 if the key was added to the database, taking
- * ownership of the SDS string, otherwise 0 is returned, and is up to the
- * caller to free the SDS string. */
+ * The function returns 1 if the key was added to the database, otherwise
+ * 0 is returned. */
 int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
     int retval = dictAdd(db->dict, key, val);
     if (retval != DICT_OK) return 0;
@@ -313,12 +408,15 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
+    if (server.snapshot_in_progress) snapshotSaveKey(db,key);
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
     dictEntry *de = dictUnlink(db->dict,key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
+        long long when = dbEntryGetExpire(de);
+        if (when != -1) expiresIndexDel(db,dictGetKey(de),when);
         /* Tells the module that the key has been unlinked from the database. */
         moduleNotifyKeyUnlink(key,val);
         dictFreeUnlinkedEntry(db->dict,de);
@@ -400,6 +498,10 @@ long long emptyDbStructure(redisDb *dbarray, int dbnum, int async,
         } else {
             dictEmpty(dbarray[j].dict,callback);
             dictEmpty(dbarray[j].expires,callback);
+            if (dbarray[j].expires_index) {
+                raxFree(dbarray[j].expires_index);
+                dbarray[j].expires_index = raxNew();
+            }
         }
         /* Because all keys of database are removed, reset average ttl. */
         dbarray[j].avg_ttl = 0;
@@ -443,6 +545,10 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
      * there. */
     signalFlushedDb(dbnum, async);
 
+    /* Saving the flushed keys to a forkless BGSAVE would block the server
+     * just like a synchronous SAVE: stop it instead. */
+    snapshotAbort("the dataset was flushed");
+
     /* Empty redis database structure. */
     removed = emptyDbStructure(server.db, dbnum, async, callback);
 
@@ -467,12 +573,16 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
 dbBackup *backupDb(void) {
     dbBackup *backup = zmalloc(sizeof(dbBackup));
 
+    snapshotAbort("the dataset is being replaced");
+
     /* Backup main DBs. */
     backup->dbarray = zmalloc(sizeof(redisDb)*server.dbnum);
     for (int i=0; i<server.dbnum; i++) {
         backup->dbarray[i] = server.db[i];
         server.db[i].dict = dictCreate(&dbDictType,NULL);
         server.db[i].expires = dictCreate(&dbExpiresDictType,NULL);
+        if (server.db[i].expires_index)
+            server.db[i].expires_index = raxNew();
     }
 
     /* Backup cluster slots to keys map if enable cluster. */
@@ -502,6 +612,8 @@ void discardDbBackup(dbBackup *buckup, int flags, void(callback)(void*)) {
     for (int i=0; i<server.dbnum; i++) {
         dictRelease(buckup->dbarray[i].dict);
         dictRelease(buckup->dbarray[i].expires);
+        if (buckup->dbarray[i].expires_index)
+            raxFree(buckup->dbarray[i].expires_index);
     }
 
     /* Release slots to keys map backup if enable cluster. */
@@ -527,6 +639,8 @@ void restoreDbBackup(dbBackup *buckup) {
         serverAssert(dictSize(server.db[i].expires) == 0);
         dictRelease(server.db[i].dict);
         dictRelease(server.db[i].expires);
+        if (server.db[i].expires_index)
+            raxFree(server.db[i].expires_index);
         server.db[i] = buckup->dbarray[i];
     }
 
@@ -795,7 +909,7 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(dictGetDoubleVal(de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -823,6 +937,23 @@ int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor) {
     return C_OK;
 }
 
+/* Return the SSCAN cursor of a roaring encoded set whose next element to
+ * return is 'next'. These cursors have SCAN_ROARING_CURSOR set, a bit that
+ * dictScan() never returns, and the element mapped to an unsigned integer in
+ * the other bits, shifted right by one: the scan resumes from the even value
+ * below it, so when 'next' is odd, 'next-1' must not have been returned
+ * already. If the set is converted to a hash table between two calls, its
+ * scan restarts from the beginning instead. */
+uint64_t roaringScanCursor(int64_t next) {
+    return SCAN_ROARING_CURSOR | (((uint64_t)next ^ (1ULL<<63)) >> 1);
+}
+
+/* Return the element from which the scan of a roaring encoded set resumes,
+ * see roaringScanCursor(). */
+int64_t roaringScanStart(uint64_t cursor) {
+    return (int64_t)(((cursor & ~SCAN_ROARING_CURSOR) << 1) ^ (1ULL<<63));
+}
+
 /* This command implements SCAN, HSCAN and SSCAN commands.
  * If object 'o' is passed, then it must be a Hash, Set or Zset object, otherwise
  * if 'o' is NULL the command will operate on the dictionary associated with
@@ -889,7 +1020,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
@@ -901,10 +1032,13 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         ht = c->db->dict;
     } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
+        /* Converted from a roaring bitmap during the scan. */
+        if (cursor & SCAN_ROARING_CURSOR) cursor = 0;
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                                       o->encoding == OBJ_ENCODING_BTREE)) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
@@ -928,6 +1062,52 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Roaring bitmaps may be large, so they are iterated COUNT
+         * elements at a time, in order, see roaringScanCursor(). Any other
+         * cursor starts from the first element. */
+        roaringIter ri;
+        int64_t ll, last = 0;
+
+        if (cursor & SCAN_ROARING_CURSOR)
+            roaringIterSeek(o->ptr,&ri,roaringScanStart(cursor));
+        else
+            roaringIterInit(o->ptr,&ri);
+        cursor = 0;
+        while(roaringNext(&ri,&ll)) {
+            /* Unsigned long cursors of 32 bit systems can't hold them. */
+            if (listLength(keys) >= (unsigned long)count &&
+                sizeof(cursor) >= sizeof(uint64_t))
+            {
+                if (!(ll & 1) || last != ll-1) {
+                    cursor = roaringScanCursor(ll);
+                    break;
+                }
+                /* The next call would return 'last' again: leave it to
+                 * that call, unless it is the only element of the reply. */
+                if (listLength(keys) > 1) {
+                    decrRefCount(listNodeValue(listLast(keys)));
+                    listDelNode(keys,listLast(keys));
+                    cursor = roaringScanCursor(last);
+                    break;
+                }
+            }
+            listAddNodeTail(keys,createStringObjectFromLongLong(ll));
+            last = ll;
+        }
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *p = lpFirst(o->ptr);
+        unsigned char *str;
+        int64_t len;
+
+        while(p) {
+            str = lpGet(p,&len,NULL);
+            listAddNodeTail(keys,
+                (str != NULL) ? createStringObject((char*)str,len) :
+                                createStringObjectFromLongLong(len));
+            p = lpNext(o->ptr,p);
+        }
+        cursor = 0;
     } else if (o->type == OBJ_SET) {
         int pos = 0;
         int64_t ll;
@@ -936,17 +1116,17 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpSeek(o->ptr,0);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -1008,8 +1188,11 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     }
 
     /* Step 4: Reply to the client. */
+    /* Roaring set cursors don't fit a long long, see roaringScanCursor(). */
+    char buf[LONG_STR_SIZE];
+    int len = snprintf(buf,sizeof(buf),"%lu",cursor);
     addReplyArrayLen(c, 2);
-    addReplyBulkLongLong(c,cursor);
+    addReplyBulkCBuffer(c,buf,len);
 
     addReplyArrayLen(c, listLength(keys));
     while ((node = listFirst(keys)) != NULL) {
@@ -1328,6 +1511,7 @@ int dbSwapDatabases(int id1, int id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    snapshotAbort("databases were swapped");
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
@@ -1336,11 +1520,13 @@ int dbSwapDatabases(int id1, int id2) {
      * remain in the same DB they were. */
     db1->dict = db2->dict;
     db1->expires = db2->expires;
+    db1->expires_index = db2->expires_index;
     db1->avg_ttl = db2->avg_ttl;
     db1->expires_cursor = db2->expires_cursor;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
+    db2->expires_index = aux.expires_index;
     db2->avg_ttl = aux.avg_ttl;
     db2->expires_cursor = aux.expires_cursor;
 
@@ -1401,8 +1587,14 @@ void swapdbCommand(client *c) {
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    dictEntry *kde = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,kde != NULL);
+    if (dictDelete(db->expires,key->ptr) != DICT_OK) return 0;
+    expiresIndexDel(db,dictGetKey(kde),dbEntryGetExpire(kde));
+    /* The expire field of the entry is kept, so that setting an expire
+     * again doesn't need to reallocate it. */
+    *dbEntryExpireField(kde) = -1;
+    return 1;
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1412,9 +1604,14 @@ int removeExpire(redisDb *db, robj *key) {
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
 
-    /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
+    long long old = dbEntryGetExpire(kde);
+    if (old != -1) expiresIndexDel(db,dictGetKey(kde),old);
+    kde = dbEntrySetExpire(db,kde,when);
+    expiresIndexAdd(db,dictGetKey(kde),when);
+
+    /* Reuse the sds from the main dict in the expire dict */
     de = dictAddOrFind(db->expires,dictGetKey(kde));
     dictSetSignedIntegerVal(de,when);
 
@@ -1430,17 +1627,27 @@ long long getExpire(redisDb *db, robj *key) {
 
     /* No expire? return ASAP */
     if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+       (de = dictFind(db->dict,key->ptr)) == NULL) return -1;
 
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+    /* The expire time is stored in the main dict entry as well, so there
+     * is no need to access db->expires. */
+    return dbEntryGetExpire(de);
 }
 
 /* Delete the specified expired key and propagate expire. */
 void deleteExpiredKeyAndPropagate(redisDb *db, robj *keyobj) {
     mstime_t expire_latency;
+
+    /* Track how late the key is reclaimed compared to its expire time. */
+    long long when = getExpire(db,keyobj);
+    if (when != -1) {
+        long long lag = mstime()-when;
+        if (lag < 0) lag = 0;
+        server.stat_expire_reclaim_lag_sum += lag;
+        if (lag > server.stat_expire_reclaim_lag_max)
+            server.stat_expire_reclaim_lag_max = lag;
+    }
+
     latencyStartMonitor(expire_latency);
     if (server.lazyfree_lazy_expire)
         dbAsyncDelete(db,keyobj);
@@ -135,6 +135,7 @@ long dictIterDefragEntry(dictIterator *iter) {
      * to use, and require no other changes in the dict. */
     long defragged = 0;
     dictht *ht;
+    dictEntry **bucket;
     /* Handle the next entry (if there is one), and update the pointer in the
      * current entry. */
     if (iter->nextEntry) {
@@ -147,33 +148,54 @@ long dictIterDefragEntry(dictIterator *iter) {
     }
     /* handle the case of the first entry in the hash bucket. */
     ht = &iter->d->ht[iter->table];
-    if (ht->table[iter->index] == iter->entry) {
+    /* The keyspace is the only open addressing dict, and it is defragged
+     * with dictScan() instead. */
+    if (dictIsOpenAddressing(iter->d)) return defragged;
+    bucket = dictHtBucketRef(ht,iter->index);
+    if (bucket && *bucket == iter->entry) {
         dictEntry *newde = activeDefragAlloc(iter->entry);
         if (newde) {
             iter->entry = newde;
-            ht->table[iter->index] = newde;
+            *bucket = newde;
             defragged++;
         }
     }
     return defragged;
 }
 
+/* Defrag helper for the buckets of a single hash table: the bucket array,
+ * or the segments directory and every allocated segment for segmented
+ * tables. Returns a stat of how many pointers were moved. */
+long dictDefragHtBuckets(dictht *ht) {
+    long defragged = 0;
+    if (ht->segments) {
+        dictEntry ***newdir = activeDefragAlloc(ht->segments);
+        if (newdir)
+            defragged++, ht->segments = newdir;
+        unsigned long segments = (ht->size + DICT_SEGMENT_MASK) >> DICT_SEGMENT_EXP;
+        for (unsigned long j = 0; j < segments; j++) {
+            if (ht->segments[j] == NULL) continue;
+            dictEntry **newseg = activeDefragAlloc(ht->segments[j]);
+            if (newseg)
+                defragged++, ht->segments[j] = newseg;
+        }
+    } else if (ht->table) {
+        dictEntry **newtable = activeDefragAlloc(ht->table);
+        if (newtable)
+            defragged++, ht->table = newtable;
+    }
+    return defragged;
+}
+
 /* Defrag helper for dict main allocations (dict struct, and hash tables).
  * receives a pointer to the dict* and implicitly updates it when the dict
  * struct itself was moved. Returns a stat of how many pointers were moved. */
 long dictDefragTables(dict* d) {
-    dictEntry **newtable;
     long defragged = 0;
     /* handle the first hash table */
-    newtable = activeDefragAlloc(d->ht[0].table);
-    if (newtable)
-        defragged++, d->ht[0].table = newtable;
+    defragged += dictDefragHtBuckets(&d->ht[0]);
     /* handle the second hash table */
-    if (d->ht[1].table) {
-        newtable = activeDefragAlloc(d->ht[1].table);
-        if (newtable)
-            defragged++, d->ht[1].table = newtable;
-    }
+    defragged += dictDefragHtBuckets(&d->ht[1]);
     return defragged;
 }
 
@@ -237,17 +259,18 @@ double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
 }
 
 /* Defrag helper for sorted set.
- * Defrag a single dict entry key name, and corresponding skiplist struct */
+ * Defrag a single dict entry key name, and corresponding skiplist struct,
+ * or only update the element referenced by the btree, whose nodes are
+ * defragged all together by defragZsetSkiplist(). */
 long activeDefragZsetEntry(zset *zs, dictEntry *de) {
     sds newsds;
-    double* newscore;
     long defragged = 0;
     sds sdsele = dictGetKey(de);
     if ((newsds = activeDefragSds(sdsele)))
         defragged++, de->key = newsds;
-    newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
-    if (newscore) {
-        dictSetVal(zs->dict, de, newscore);
+    if (zs->zbt) {
+        if (newsds) zbtReplaceEle(zs->zbt, dictGetDoubleVal(de), sdsele, newsds);
+    } else if (zslDefrag(zs->zsl, dictGetDoubleVal(de), sdsele, newsds)) {
         defragged++;
     }
     return defragged;
@@ -417,8 +440,8 @@ long activeDefragQuickListNode(quicklist *ql, quicklistNode **node_ref) {
         *node_ref = node = newnode;
         defragged++;
     }
-    if ((newzl = activeDefragAlloc(node->zl)))
-        defragged++, node->zl = newzl;
+    if ((newzl = activeDefragAlloc(node->entry)))
+        defragged++, node->entry = newzl;
     return defragged;
 }
 
@@ -497,7 +520,8 @@ void scanLaterZsetCallback(void *privdata, const dictEntry *_de) {
 }
 
 long scanLaterZset(robj *ob, unsigned long *cursor) {
-    if (ob->type != OBJ_ZSET || ob->encoding != OBJ_ENCODING_SKIPLIST)
+    if (ob->type != OBJ_ZSET || (ob->encoding != OBJ_ENCODING_SKIPLIST &&
+                                 ob->encoding != OBJ_ENCODING_BTREE))
         return 0;
     zset *zs = (zset*)ob->ptr;
     dict *d = zs->dict;
@@ -568,13 +592,23 @@ long defragZsetSkiplist(redisDb *db, dictEntry *kde) {
     dict *newdict;
     dictEntry *de;
     struct zskiplistNode *newheader;
-    serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_SKIPLIST);
+    zbtree *newzbt;
+    serverAssert(ob->type == OBJ_ZSET && (ob->encoding == OBJ_ENCODING_SKIPLIST ||
+                                          ob->encoding == OBJ_ENCODING_BTREE));
     if ((newzs = activeDefragAlloc(zs)))
         defragged++, ob->ptr = zs = newzs;
-    if ((newzsl = activeDefragAlloc(zs->zsl)))
-        defragged++, zs->zsl = newzsl;
-    if ((newheader = activeDefragAlloc(zs->zsl->header)))
-        defragged++, zs->zsl->header = newheader;
+    if (zs->zbt) {
+        /* A node holds many entries, so there are few of them compared to
+         * the elements: they are not worth deferring. */
+        if ((newzbt = activeDefragAlloc(zs->zbt)))
+            defragged++, zs->zbt = newzbt;
+        defragged += zbtDefragNodes(zs->zbt, activeDefragAlloc);
+    } else {
+        if ((newzsl = activeDefragAlloc(zs->zsl)))
+            defragged++, zs->zsl = newzsl;
+        if ((newheader = activeDefragAlloc(zs->zsl->header)))
+            defragged++, zs->zsl->header = newheader;
+    }
     if (dictSize(zs->dict) > server.active_defrag_max_scan_fields)
         defragLater(db, kde);
     else {
@@ -813,23 +847,12 @@ long defragModule(redisDb *db, dictEntry *kde) {
  * all the various pointers it has. Returns a stat of how many pointers were
  * moved. */
 long defragKey(redisDb *db, dictEntry *de) {
-    sds keysds = dictGetKey(de);
     robj *newob, *ob;
     unsigned char *newzl;
     long defragged = 0;
-    sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds)
-        defragged++, de->key = newsds;
-    if (dictSize(db->expires)) {
-         /* Dirty code:
-          * I can't search in db->expires for that key after i already released
-          * the pointer it holds it won't be able to do the string compare */
-        uint64_t hash = dictGetHash(db->dict, de->key);
-        replaceSatelliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
-    }
+    /* The key name is embedded in the entry, that was already moved by
+     * defragKeyspaceBucketCallback(). */
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
@@ -843,9 +866,6 @@ long defragKey(redisDb *db, dictEntry *de) {
     } else if (ob->type == OBJ_LIST) {
         if (ob->encoding == OBJ_ENCODING_QUICKLIST) {
             defragged += defragQuicklist(db, de);
-        } else if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
-            if ((newzl = activeDefragAlloc(ob->ptr)))
-                defragged++, ob->ptr = newzl;
         } else {
             serverPanic("Unknown list encoding");
         }
@@ -856,20 +876,29 @@ long defragKey(redisDb *db, dictEntry *de) {
             intset *newis, *is = ob->ptr;
             if ((newis = activeDefragAlloc(is)))
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_LISTPACK) {
+            if ((newzl = activeDefragAlloc(ob->ptr)))
+                defragged++, ob->ptr = newzl;
+        } else if (ob->encoding == OBJ_ENCODING_ROARING) {
+            roaring *newr, *r = ob->ptr;
+            if ((newr = activeDefragAlloc(r)))
+                defragged++, ob->ptr = r = newr;
+            defragged += roaringDefragContainers(r, activeDefragAlloc);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
-        } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (ob->encoding == OBJ_ENCODING_SKIPLIST ||
+                   ob->encoding == OBJ_ENCODING_BTREE) {
             defragged += defragZsetSkiplist(db, de);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -911,6 +940,33 @@ void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
     }
 }
 
+/* Defrag scan callback for the buckets of the main db dictionary. Since the
+ * keys are embedded in the entries (see dbEntryCreate()), moving an entry
+ * also moves its key, so the key pointer of the entry and the one of the
+ * db->expires entry referencing it are updated as well. */
+void defragKeyspaceBucketCallback(void *privdata, dictEntry **bucketref) {
+    redisDb *db = privdata;
+    while(*bucketref) {
+        dictEntry *de = *bucketref, *newde;
+        sds oldkey = dictGetKey(de);
+        size_t keyoffset = (char*)oldkey - (char*)de;
+        if ((newde = activeDefragAlloc(de))) {
+            long defragged = 1;
+            newde->key = (char*)newde + keyoffset;
+            *bucketref = newde;
+            /* The old key pointer is dead, db->expires is searched by
+             * pointer using the hash of the new copy of the key. */
+            if (dbEntryGetExpire(newde) != -1) {
+                uint64_t hash = dictGetHash(db->dict, newde->key);
+                replaceSatelliteDictKeyPtrAndOrDefragDictEntry(db->expires,
+                    oldkey, newde->key, hash, &defragged);
+            }
+            server.stat_active_defrag_hits += defragged;
+        }
+        bucketref = &(*bucketref)->next;
+    }
+}
+
 /* Utility function to get the fragmentation ratio from jemalloc.
  * It is critical to do that by comparing only heap maps that belong to
  * jemalloc, and skip ones the jemalloc keeps as spare. Since we use this
@@ -1170,7 +1226,7 @@ void activeDefragCycle(void) {
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            cursor = dictScan(db->dict, cursor, defragScanCallback, defragKeyspaceBucketCallback, db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
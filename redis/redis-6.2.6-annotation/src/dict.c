@@ -46,6 +46,7 @@
 #include "dict.h"
 #include "zmalloc.h"
 #include "redisassert.h"
+#include "config.h"
 
 /* Using dictEnableResize() / dictDisableResize() we make possible to
  * enable/disable resizing of the hash table as needed. This is very important
@@ -66,9 +67,19 @@ static int dict_can_resize = 1;
 // ǿrehashı
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Threads performing lookups on dictionaries owned by another thread (like
+ * the IO threads executing read only commands) must never modify them, so
+ * using dictDisableRehashStep() / dictEnableRehashStep() they can prevent
+ * the rehashing step that lookups perform as a side effect. */
+// ǰ̵߳ĲҲǷ˳ִһrehash
+static __thread int dict_can_rehash_step = 1;
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
+static int _dictOaExpandIfNeeded(dict *d);
+static int _dictResize(dict *d, unsigned long size, int* malloc_failed,
+                       int rebuild);
 static unsigned long _dictNextPower(unsigned long size);
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
@@ -103,6 +114,293 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
 
 /* ----------------------------- API implementation ------------------------- */
 
+/* Return the number of segments of the segmented hash table 'ht'. */
+/* ֶhashĶ */
+static unsigned long _dictSegmentsCount(dictht *ht) {
+    return (ht->size + DICT_SEGMENT_MASK) >> DICT_SEGMENT_EXP;
+}
+
+/* Return the number of buckets of every segment of the segmented hash table
+ * 'ht': tables smaller than DICT_SEGMENT_SIZE use a single segment. */
+/* ֶhashÿεͰ */
+static unsigned long _dictSegmentLen(dictht *ht) {
+    return ht->size < DICT_SEGMENT_SIZE ? ht->size : DICT_SEGMENT_SIZE;
+}
+
+/* Like dictHtBucketRef() but allocates the segment holding the bucket if
+ * needed: used to populate a bucket. */
+/* ȡidxͰĵַͰڵĶδʱȷöΣڲڵ */
+static dictEntry **_dictHtBucketRefAlloc(dictht *ht, unsigned long idx) {
+    if (ht->segments == NULL) return &ht->table[idx];
+
+    dictEntry ***seg = &ht->segments[idx >> DICT_SEGMENT_EXP];
+    if (*seg == NULL) *seg = zcalloc(_dictSegmentLen(ht)*sizeof(dictEntry*));
+    return &(*seg)[idx & DICT_SEGMENT_MASK];
+}
+
+/* Free the buckets of the hash table, but not the entries. */
+/* ͷhashͰ飨ͷŽڵ㣩 */
+static void _dictFreeTable(dictht *ht) {
+    if (ht->segments) {
+        unsigned long j, segments = _dictSegmentsCount(ht);
+        for (j = 0; j < segments; j++) zfree(ht->segments[j]);
+        zfree(ht->segments);
+    }
+    zfree(ht->table);
+}
+
+/* Move the rehashing index to 'idx'. When the index crosses the end of a
+ * segment of a segmented table, all the buckets of that segment were already
+ * moved to the new table, so the segment is released right away: this way
+ * the old table shrinks while the new one grows and the memory used by the
+ * two tables together stays close to the size of the new one. */
+/* rehashidxֶhashѾǨĶλͷ */
+static void _dictRehashSetIndex(dict *d, unsigned long idx) {
+    dictht *ht = &d->ht[0];
+
+    d->rehashidx = idx;
+    if (ht->segments && (idx & DICT_SEGMENT_MASK) == 0) {
+        dictEntry ***seg = &ht->segments[(idx >> DICT_SEGMENT_EXP)-1];
+        zfree(*seg);
+        *seg = NULL;
+    }
+}
+
+/* ------------------------- Open addressing tables ------------------------- */
+
+/* Open addressing tables (see dictType.openAddressing) store the pointers to
+ * the entries directly inside buckets, one cache line each, holding a
+ * metadata byte, one byte of hash (the "tag") for every slot, and the
+ * pointers of DICT_OA_BUCKET_SLOTS entries. A lookup reads the home bucket of
+ * the key, compares all the tags at once, and only dereferences the entries
+ * having a matching tag, instead of following a chain of entries where
+ * every step is a cache miss.
+ *
+ * When the home bucket is full, the entry is stored in the next bucket with a
+ * free slot (linear probing). Buckets that became full are marked as "ever
+ * full", so lookups know they need to continue probing the next bucket. The
+ * mark is never cleared, not even by deletions: only rehashing to a new table
+ * gets rid of it. This also keeps dictScan() semantics: the entries having a
+ * given home bucket are always found in the "ever full" sequence of buckets
+ * starting from it, so the scan cursor still works on home buckets. Since
+ * deletions and insertions at a constant size keep marking buckets, the
+ * table is rebuilt, rehashing it to a new table of the same size, once too
+ * many of its buckets are marked.
+ *
+ * The entries still have the 'next' field, always NULL, so that iterators and
+ * the bucket callback of dictScan() work with no change.
+ *
+ * ѰַhashÿͰռһУԪݡÿλhashǩͽڵָ롣
+ * ʱһαȽͰбǩֻʱǩƥĽڵ㣻Ͱʱʹ̽⣬
+ * ͰᱻǣʱҪ̽һͰֻrehashǡ */
+
+// Ԫݵ7λʾӦλǷʹãλʾͰ
+#define DICT_OA_FULL ((1<<DICT_OA_BUCKET_SLOTS)-1)
+#define DICT_OA_EVERFULL (1<<7)
+/* Percentage of used slots triggering the expansion of the table. */
+// òλﵽDICT_OA_MAX_FILL%ʱ
+#define DICT_OA_MAX_FILL 80
+/* Percentage of used slots forcing the expansion even if resizing is
+ * disabled or not allowed, since an open addressing table can't overflow. */
+// òλﵽDICT_OA_FORCE_FILL%ʱʹresizeҲǿ
+#define DICT_OA_FORCE_FILL 95
+/* Percentage of "ever full" buckets triggering the rebuild of the table. A
+ * table just rehashed at DICT_OA_MAX_FILL has less than half of its buckets
+ * marked, so a rebuild is always followed by a long run of insertions before
+ * the next one. */
+// ""ͰıﵽDICT_OA_MAX_EVERFULL%ʱؽhash
+#define DICT_OA_MAX_EVERFULL 75
+/* Percentage of "ever full" buckets forcing the rebuild even if resizing is
+ * disabled or not allowed: past it, lookups of missing keys probe most of
+ * the table, and the marks are never cleared otherwise. */
+// ""ͰıﵽDICT_OA_FORCE_EVERFULL%ʱʹresizeҲǿؽ
+#define DICT_OA_FORCE_EVERFULL 90
+
+typedef struct dictOaBucket {
+    uint8_t meta;                                   /* Used slots + ever full. */
+    uint8_t tags[DICT_OA_BUCKET_SLOTS];             /* Top byte of the hashes. */
+    dictEntry *entries[DICT_OA_BUCKET_SLOTS];
+} dictOaBucket;
+
+/* Read only bucket returned for the segments not yet allocated. */
+static dictOaBucket dict_oa_empty_bucket;
+
+/* Return the number of slots of the open addressing table 'ht'. */
+static unsigned long _dictOaCapacity(dictht *ht) {
+    return ht->size*DICT_OA_BUCKET_SLOTS;
+}
+
+/* Return the number of buckets needed to store 'entries' entries using at
+ * most DICT_OA_MAX_FILL percent of the slots. */
+static unsigned long _dictOaBucketsFor(unsigned long entries) {
+    if (entries > LONG_MAX/100) return LONG_MAX;
+    return entries*100/(DICT_OA_BUCKET_SLOTS*DICT_OA_MAX_FILL)+1;
+}
+
+/* Return the bucket 'idx' for reading. */
+static inline dictOaBucket *_dictOaBucket(dictht *ht, unsigned long idx) {
+    if (ht->segments) {
+        dictOaBucket *seg = (dictOaBucket*)ht->segments[idx >> DICT_SEGMENT_EXP];
+        return seg ? &seg[idx & DICT_SEGMENT_MASK] : &dict_oa_empty_bucket;
+    }
+    return &((dictOaBucket*)ht->table)[idx];
+}
+
+/* Return the bucket 'idx' for writing, allocating its segment if needed. */
+static dictOaBucket *_dictOaBucketAlloc(dictht *ht, unsigned long idx) {
+    if (ht->segments == NULL) return &((dictOaBucket*)ht->table)[idx];
+
+    dictEntry ***seg = &ht->segments[idx >> DICT_SEGMENT_EXP];
+    if (*seg == NULL) *seg = zcalloc(_dictSegmentLen(ht)*sizeof(dictOaBucket));
+    return &((dictOaBucket*)*seg)[idx & DICT_SEGMENT_MASK];
+}
+
+/* Return the bitmap of the used slots of the bucket having the given tag.
+ * All the tags are compared at once loading the metadata byte and the tags
+ * as a 64 bit word (SIMD within a register). */
+/* һαȽͰбǩرǩƥʹõĲλλͼ */
+static inline unsigned int _dictOaMatch(dictOaBucket *b, uint8_t tag) {
+    uint64_t w;
+
+    memcpy(&w,b,sizeof(w));
+#if (BYTE_ORDER == BIG_ENDIAN)
+    w = __builtin_bswap64(w);
+#endif
+    w ^= 0x0101010101010101ULL*tag;
+    /* Set the high bit of the bytes that are zero, that is, matching. */
+    w = ~(((w & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | w |
+          0x7f7f7f7f7f7f7f7fULL);
+    /* Gather the high bits in the top byte, one bit per byte. Bit 0 is the
+     * metadata byte, the slots follow. */
+    unsigned int m = (unsigned int)(((w >> 7)*0x0102040810204080ULL) >> 56);
+    return (m >> 1) & b->meta & DICT_OA_FULL;
+}
+
+/* Return the tag of the given hash: the home bucket uses the low bits. */
+static inline uint8_t _dictOaTag(uint64_t hash) {
+    return hash >> 56;
+}
+
+/* Search the entry of 'key' in the open addressing table 'ht'. Returns the
+ * bucket holding it, and its slot in '*slot', or NULL if not found. */
+/* ڿѰַhashвkeyڵͰλͨslot */
+static dictOaBucket *_dictOaFind(dict *d, dictht *ht, const void *key,
+                                 uint64_t hash, int *slot)
+{
+    unsigned long idx = hash & ht->sizemask, probes = ht->size;
+    uint8_t tag = _dictOaTag(hash);
+
+    while (probes--) {
+        dictOaBucket *b = _dictOaBucket(ht,idx);
+        unsigned int m = _dictOaMatch(b,tag);
+        while (m) {
+            int j = __builtin_ctz(m);
+            dictEntry *he = b->entries[j];
+            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+                *slot = j;
+                return b;
+            }
+            m &= m-1;
+        }
+        // ͰδkeyںͰ
+        if (!(b->meta & DICT_OA_EVERFULL)) break;
+        idx = (idx+1) & ht->sizemask;
+    }
+    return NULL;
+}
+
+/* Store 'entry' in the first free slot of the probing sequence of 'hash'.
+ * The caller is responsible for updating 'used'. */
+/* ڵŵ̽еһеĲλ */
+static void _dictOaInsert(dictht *ht, dictEntry *entry, uint64_t hash) {
+    unsigned long idx = hash & ht->sizemask, probes = ht->size;
+
+    entry->next = NULL;
+    while (probes--) {
+        dictOaBucket *b = _dictOaBucket(ht,idx);
+        if ((b->meta & DICT_OA_FULL) != DICT_OA_FULL) {
+            if (b == &dict_oa_empty_bucket) b = _dictOaBucketAlloc(ht,idx);
+            int j = __builtin_ctz(~b->meta & DICT_OA_FULL);
+            b->tags[j] = _dictOaTag(hash);
+            b->entries[j] = entry;
+            b->meta |= 1<<j;
+            if (b->meta == DICT_OA_FULL) {
+                b->meta |= DICT_OA_EVERFULL;
+                ht->everfull++;
+            }
+            return;
+        }
+        idx = (idx+1) & ht->sizemask;
+    }
+    /* Tables are expanded well before they can fill up. */
+    assert(0);
+}
+
+/* Remove the entry in the given slot, the "ever full" mark is retained. */
+static void _dictOaRemove(dictOaBucket *b, int slot) {
+    b->meta &= ~(1<<slot);
+    b->entries[slot] = NULL;
+}
+
+/* Return a random used slot of the non empty bucket 'b'. */
+static dictEntry *_dictOaRandomEntry(dictOaBucket *b) {
+    unsigned int m = b->meta & DICT_OA_FULL;
+    int skip = random() % __builtin_popcount(m);
+
+    while (skip--) m &= m-1;
+    return b->entries[__builtin_ctz(m)];
+}
+
+/* Move all the entries of the bucket 'b' of ht[0] to ht[1]. */
+static void _dictOaRehashBucket(dict *d, dictOaBucket *b) {
+    unsigned int m = b->meta & DICT_OA_FULL;
+
+    while (m) {
+        int j = __builtin_ctz(m);
+        dictEntry *de = b->entries[j];
+        _dictOaInsert(&d->ht[1],de,dictHashKey(d, de->key));
+        _dictOaRemove(b,j);
+        d->ht[0].used--;
+        d->ht[1].used++;
+        m &= m-1;
+    }
+}
+
+/* Emit the entries having 'idx' as home bucket: they are all found in the
+ * "ever full" sequence of buckets starting from it. Like for chained tables
+ * every entry belongs to a single cursor position, so a full scan of a table
+ * not resized in the meantime returns every entry exactly once. */
+/* idxΪʼͰĽڵ㣬Щڵ㶼ڴidxʼ""Ͱ */
+static void _dictOaScanBucket(dict *d, dictht *ht, unsigned long idx,
+                              dictScanFunction *fn,
+                              dictScanBucketFunction *bucketfn,
+                              void *privdata)
+{
+    unsigned long home = idx, probes = ht->size;
+    /* Entries of other home buckets can only be displaced here if the
+     * previous bucket was full at some point, otherwise the hashes of the
+     * entries of the first bucket don't need to be checked. */
+    int check = (_dictOaBucket(ht,(idx-1) & ht->sizemask)->meta &
+                 DICT_OA_EVERFULL) != 0;
+
+    while (probes--) {
+        dictOaBucket *b = _dictOaBucket(ht,idx);
+        unsigned int m = b->meta & DICT_OA_FULL;
+        while (m) {
+            int j = __builtin_ctz(m);
+            m &= m-1;
+            if (check &&
+                (dictHashKey(d, b->entries[j]->key) & ht->sizemask) != home)
+                continue;
+            if (bucketfn) bucketfn(privdata, &b->entries[j]);
+            fn(privdata, b->entries[j]);
+        }
+        if (!(b->meta & DICT_OA_EVERFULL)) break;
+        idx = (idx+1) & ht->sizemask;
+        check = 1;
+    }
+}
+
 /* Reset a hash table already initialized with ht_init().
  * NOTE: This function should only be called by ht_destroy().
  * עѾ
@@ -111,9 +409,11 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
 static void _dictReset(dictht *ht)
 {
     ht->table = NULL;
+    ht->segments = NULL;
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->everfull = 0;
 }
 
 /* Create a new hash table */
@@ -160,6 +460,10 @@ int dictResize(dict *d)
 
     // ȡhashԪ
     minimal = d->ht[0].used;
+    /* Open addressing tables can't overflow: leave room for the insertions
+     * performed while the shrinking rehash is in progress. */
+    // ѰַhashΪrehash²ĽڵԤռ
+    if (dictIsOpenAddressing(d)) minimal += minimal/2;
     // ԪССʼСʹDICT_HT_INITIAL_SIZE
     if (minimal < DICT_HT_INITIAL_SIZE)
         minimal = DICT_HT_INITIAL_SIZE;
@@ -180,6 +484,15 @@ int dictResize(dict *d)
  * T = O(N)
  */
 int _dictExpand(dict *d, unsigned long size, int* malloc_failed)
+{
+    return _dictResize(d, size, malloc_failed, 0);
+}
+
+/* Like _dictExpand(), but if 'rebuild' is true the table is rehashed even
+ * when the new one has the same size, see _dictOaExpandIfNeeded(). */
+/* _dictExpand()ͬrebuildΪʱʹСҲrehashµhash */
+static int _dictResize(dict *d, unsigned long size, int* malloc_failed,
+                       int rebuild)
 {
     if (malloc_failed) *malloc_failed = 0;
 
@@ -190,26 +503,50 @@ int _dictExpand(dict *d, unsigned long size, int* malloc_failed)
         return DICT_ERR;
     
     dictht n; /* the new hash table */
-    // ҪݵΪsizeĵһ2^n
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize;
+    size_t bucketsize;
+    if (dictIsOpenAddressing(d)) {
+        // ѰַhashsizeΪڵҪͰ
+        realsize = _dictNextPower(_dictOaBucketsFor(size));
+        bucketsize = sizeof(dictOaBucket);
+    } else {
+        // ҪݵΪsizeĵһ2^n
+        realsize = _dictNextPower(size);
+        bucketsize = sizeof(dictEntry*);
+        if (realsize < size) return DICT_ERR;
+    }
 
     /* Detect overflows */
     // 
-    if (realsize < size || realsize * sizeof(dictEntry*) < realsize)
+    if (realsize > SIZE_MAX / bucketsize)
         return DICT_ERR;
 
     /* Rehashing to the same table size is not useful. */
     // Ҫݵԭһ򷵻DICT_ERR
-    if (realsize == d->ht[0].size) return DICT_ERR;
+    if (realsize == d->ht[0].size && !rebuild) return DICT_ERR;
 
     /* Allocate the new hash table and initialize all pointers to NULL */
     // µͶӦ
     n.size = realsize;
     n.sizemask = realsize-1;
+    n.table = NULL;
+    n.segments = NULL;
+    /* Segmented tables only allocate the segments directory here: segments
+     * are allocated by the first insertion in one of their buckets. */
+    // ֶhashֻĿ¼ڵһнڵʱŷ
+    if (dictIsSegmented(d)) {
+        size_t dirlen = _dictSegmentsCount(&n)*sizeof(dictEntry**);
+        if (malloc_failed) {
+            n.segments = ztrycalloc(dirlen);
+            *malloc_failed = n.segments == NULL;
+            if (*malloc_failed)
+                return DICT_ERR;
+        } else
+            n.segments = zcalloc(dirlen);
     // ѡڷʧʱֱֹ
-    if (malloc_failed) {
+    } else if (malloc_failed) {
         // Էhash
-        n.table = ztrycalloc(realsize*sizeof(dictEntry*));
+        n.table = ztrycalloc(realsize*bucketsize);
         // Ƿʧܣn.table == NULLʧ
         *malloc_failed = n.table == NULL;
         // ʧܣ򷵻ش
@@ -217,15 +554,16 @@ int _dictExpand(dict *d, unsigned long size, int* malloc_failed)
             return DICT_ERR;
     } else
         // hash飬ʧֹܾ
-        n.table = zcalloc(realsize*sizeof(dictEntry*));
+        n.table = zcalloc(realsize*bucketsize);
 
     // ýڵΪ0
     n.used = 0;
+    n.everfull = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
     // ֵhashΪNULLʾ״γʼ
-    if (d->ht[0].table == NULL) {
+    if (d->ht[0].size == 0) {
         // hashŵhashĵ0λ
         d->ht[0] = n;
         return DICT_OK;
@@ -277,14 +615,38 @@ int dictRehash(dict *d, int n) {
          * elements because ht[0].used != 0 */
         // hashͰĸ>ѾrehashͰrehashidx <= ht[0].size - 1
         assert(d->ht[0].size > (unsigned long)d->rehashidx);
-        // ҪǨƵͰΪգ׼ǨһͰⲽȥͰ
-        while(d->ht[0].table[d->rehashidx] == NULL) {
+        /* Open addressing tables keep all their buckets until the end of
+         * the rehashing, since the "ever full" marks of the buckets already
+         * rehashed are still needed to find the entries not yet moved. */
+        // ѰַhashǨͰͰ""ǣrehashǰͷŶ
+        if (dictIsOpenAddressing(d)) {
+            dictOaBucket *b;
+            while (((b = _dictOaBucket(&d->ht[0],d->rehashidx))->meta &
+                    DICT_OA_FULL) == 0)
+            {
+                if (b == &dict_oa_empty_bucket)
+                    d->rehashidx = (d->rehashidx | DICT_SEGMENT_MASK)+1;
+                else
+                    d->rehashidx++;
+                if (--empty_visits == 0) return 1;
+            }
+            _dictOaRehashBucket(d,b);
             d->rehashidx++;
+            continue;
+        }
+        // ҪǨƵͰΪգ׼ǨһͰⲽȥͰ
+        while((de = dictHtBucket(&d->ht[0],d->rehashidx)) == NULL) {
+            /* A segment that is not allocated has no entries at all, so
+             * we skip it as a single empty visit. */
+            // δĶûнڵ㣬
+            if (d->ht[0].segments &&
+                d->ht[0].segments[d->rehashidx >> DICT_SEGMENT_EXP] == NULL)
+                _dictRehashSetIndex(d,(d->rehashidx | DICT_SEGMENT_MASK)+1);
+            else
+                _dictRehashSetIndex(d,d->rehashidx+1);
             // Ѿ涨Ͱ򱾴Ǩ
             if (--empty_visits == 0) return 1;
         }
-        // ȡҪǨƵͰ׽ڵ
-        de = d->ht[0].table[d->rehashidx];
         /* Move all the keys in this bucket from the old to the new hash HT */
         // ҪǨƵͰ
         while(de) {
@@ -296,8 +658,9 @@ int dictRehash(dict *d, int n) {
             // 㵱ǰڵhashеhashֵͰidx
             h = dictHashKey(d, de->key) & d->ht[1].sizemask;
             // ǰڵǨƵhash
-            de->next = d->ht[1].table[h];
-            d->ht[1].table[h] = de;
+            dictEntry **bucket = _dictHtBucketRefAlloc(&d->ht[1],h);
+            de->next = *bucket;
+            *bucket = de;
             // hash
             d->ht[0].used--;
             // hash
@@ -306,16 +669,16 @@ int dictRehash(dict *d, int n) {
             de = nextde;
         }
         // վɽڵhashͰ
-        d->ht[0].table[d->rehashidx] = NULL;
+        *dictHtBucketRef(&d->ht[0],d->rehashidx) = NULL;
         // һҪǨƵhashͰ
-        d->rehashidx++;
+        _dictRehashSetIndex(d,d->rehashidx+1);
     }
 
     /* Check if we already rehashed the whole table... */
     // жhashǷǨ
     if (d->ht[0].used == 0) {
         // Ǩɣվhash
-        zfree(d->ht[0].table);
+        _dictFreeTable(&d->ht[0]);
         // hash滻hash
         d->ht[0] = d->ht[1];
         // ʱhash
@@ -373,7 +736,7 @@ int dictRehashMilliseconds(dict *d, int ms) {
 /* ִһincremental rehash */
 static void _dictRehashStep(dict *d) {
     // ûͣrehashִ
-    if (d->pauserehash == 0) dictRehash(d,1);
+    if (d->pauserehash == 0 && dict_can_rehash_step) dictRehash(d,1);
 }
 
 /* Add an element to the target hash table */
@@ -438,17 +801,24 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * more frequently. */
     // ȡhashrehashhashht[1]þhashht[0]
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    // dictEntryڴ
-    entry = zmalloc(sizeof(*entry));
+    // dictEntryڴ棬keyõڵ
+    if (d->type->entryCreate) {
+        entry = d->type->entryCreate(d->privdata, key);
+    } else {
+        entry = zmalloc(sizeof(*entry));
+        dictSetKey(d, entry, key);
+    }
+    if (dictIsOpenAddressing(d)) {
+        _dictOaInsert(ht,entry,dictHashKey(d,key));
+        ht->used++;
+        return entry;
+    }
     // ڵӵǰͰΪͰнڵͷ
-    entry->next = ht->table[index];
-    ht->table[index] = entry;
+    dictEntry **bucket = _dictHtBucketRefAlloc(ht,index);
+    entry->next = *bucket;
+    *bucket = entry;
     // ½ڵ
     ht->used++;
-
-    /* Set the hash entry fields. */
-    // hashֵõڵ㣨entry
-    dictSetKey(d, entry, key);
     return entry;
 }
 
@@ -529,10 +899,27 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
 
     // hash
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpenAddressing(d)) {
+            int slot;
+            dictOaBucket *b = _dictOaFind(d,&d->ht[table],key,h,&slot);
+            if (b) {
+                he = b->entries[slot];
+                _dictOaRemove(b,slot);
+                if (!nofree) {
+                    dictFreeKey(d, he);
+                    dictFreeVal(d, he);
+                    zfree(he);
+                }
+                d->ht[table].used--;
+                return he;
+            }
+            if (!dictIsRehashing(d)) break;
+            continue;
+        }
         // Ͱ
         idx = h & d->ht[table].sizemask;
         // ȡͰϵdictEntryͷ
-        he = d->ht[table].table[idx];
+        he = dictHtBucket(&d->ht[table],idx);
         prevHe = NULL;
         while(he) {
             // ҵĿڵ
@@ -542,7 +929,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
                 if (prevHe)
                     prevHe->next = he->next;
                 else
-                    d->ht[table].table[idx] = he->next;
+                    *dictHtBucketRef(&d->ht[table],idx) = he->next;
                 // nofree == 0üֵͷźͷŽڵ㱾
                 if (!nofree) {
                     dictFreeKey(d, he);
@@ -629,8 +1016,22 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
         // https://www.modb.pro/db/72930
         if (callback && (i & 65535) == 0) callback(d->privdata);
 
+        if (dictIsOpenAddressing(d)) {
+            dictOaBucket *b = _dictOaBucket(ht,i);
+            unsigned int m = b->meta & DICT_OA_FULL;
+            while (m) {
+                he = b->entries[__builtin_ctz(m)];
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+                zfree(he);
+                ht->used--;
+                m &= m-1;
+            }
+            continue;
+        }
+
         // Ͱûнڵ㣬򲻴һͰ
-        if ((he = ht->table[i]) == NULL) continue;
+        if ((he = dictHtBucket(ht,i)) == NULL) continue;
         // Ͱڴڽڵ
         while(he) {
             nextHe = he->next;
@@ -646,7 +1047,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     }
     /* Free the table and the allocated cache structure */
     // ͷhash
-    zfree(ht->table);
+    _dictFreeTable(ht);
     /* Re-initialize the table */
     // ³ʼֵ
     _dictReset(ht);
@@ -683,10 +1084,17 @@ dictEntry *dictFind(dict *d, const void *key)
     h = dictHashKey(d, key);
     // ֵвkey
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpenAddressing(d)) {
+            int slot;
+            dictOaBucket *b = _dictOaFind(d,&d->ht[table],key,h,&slot);
+            if (b) return b->entries[slot];
+            if (!dictIsRehashing(d)) return NULL;
+            continue;
+        }
         // ͨhashֵͰ
         idx = h & d->ht[table].sizemask;
         // ҵͰ׽ڵ
-        he = d->ht[table].table[idx];
+        he = dictHtBucket(&d->ht[table],idx);
         // Ͱнڵ
         while(he) {
             // ҵkey򷵻ظýڵ
@@ -723,10 +1131,11 @@ long long dictFingerprint(dict *d) {
     long long integers[6], hash = 0;
     int j;
 
-    integers[0] = (long) d->ht[0].table;
+    /* Only one of 'table' and 'segments' is ever set. */
+    integers[0] = (long) d->ht[0].table | (long) d->ht[0].segments;
     integers[1] = d->ht[0].size;
     integers[2] = d->ht[0].used;
-    integers[3] = (long) d->ht[1].table;
+    integers[3] = (long) d->ht[1].table | (long) d->ht[1].segments;
     integers[4] = d->ht[1].size;
     integers[5] = d->ht[1].used;
 
@@ -764,6 +1173,8 @@ dictIterator *dictGetIterator(dict *d)
     iter->safe = 0;
     iter->entry = NULL;
     iter->nextEntry = NULL;
+    iter->part = 0;
+    iter->numparts = 0;
     return iter;
 }
 
@@ -777,6 +1188,21 @@ dictIterator *dictGetSafeIterator(dict *d) {
     return i;
 }
 
+/* Return a non safe iterator that only visits the entries of the part
+ * 'part' (from 0 to numparts-1) of 'numparts' contiguous parts of the
+ * buckets of every table of the dictionary. Iterating all the parts visits
+ * every entry exactly once, so different threads can iterate different
+ * parts of a dictionary, as long as nobody modifies it in the meantime. */
+/* ֻhashpartֵĲȫڶ̲߳бٱ޸ĵֵ */
+dictIterator *dictGetPartIterator(dict *d, int part, int numparts) {
+    dictIterator *i = dictGetIterator(d);
+
+    assert(part >= 0 && part < numparts);
+    i->part = part;
+    i->numparts = numparts;
+    return i;
+}
+
 /* ȡһڵ
  * ɣNULL
  */
@@ -799,16 +1225,27 @@ dictEntry *dictNext(dictIterator *iter)
             // +1
             iter->index++;
 
+            /* Open addressing tables are iterated slot by slot. */
+            // ѰַhashλindexΪλ
+            long limit = dictIsOpenAddressing(iter->d) ?
+                         (long) _dictOaCapacity(ht) : (long) ht->size;
+            /* Restrict the iteration to the requested part of the table. */
+            // ֵֻ[first,limit)ڵͰ
+            if (iter->numparts) {
+                unsigned long long total = limit;
+                long first = total*iter->part/iter->numparts;
+                limit = total*(iter->part+1)/iter->numparts;
+                if (iter->index < first) iter->index = first;
+            }
             // >ǰhashĴС˵Ѿ
-            if (iter->index >= (long) ht->size) {
+            if (iter->index >= limit) {
                 // жϵǰǷrehashҵǰڱht[0]
                 if (dictIsRehashing(iter->d) && iter->table == 0) {
                     // ʶڱһhashht[1]
                     iter->table++;
-                    // hash
-                    iter->index = 0;
-                    // ȡڶhashht[1]
-                    ht = &iter->d->ht[1];
+                    // hashht[1]ĵһͰֵĵһͰʼ
+                    iter->index = -1;
+                    continue;
                 // ֵûrehashѾht[1]˳
                 } else {
                     break;
@@ -816,7 +1253,11 @@ dictEntry *dictNext(dictIterator *iter)
             }
             // ߵ˵ûе굱ǰhashht
             // ½ڵָ룬ָһͰıͷ
-            iter->entry = ht->table[iter->index];
+            if (dictIsOpenAddressing(iter->d))
+                iter->entry = _dictOaBucket(ht,iter->index/DICT_OA_BUCKET_SLOTS)->
+                              entries[iter->index%DICT_OA_BUCKET_SLOTS];
+            else
+                iter->entry = dictHtBucket(ht,iter->index);
         } else {
             // ִе˵iterΪգǰڵĳͰеڵ㣩
             // ȡһڵ
@@ -871,6 +1312,24 @@ dictEntry *dictGetRandomKey(dict *d)
     
     // rehashæ
     if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    // ѰַhashѡһǿյͰٴͰѡһڵ
+    if (dictIsOpenAddressing(d)) {
+        dictOaBucket *b;
+        unsigned long buckets = d->ht[0].size + d->ht[1].size;
+        do {
+            if (dictIsRehashing(d)) {
+                h = d->rehashidx + (randomULong() % (buckets - d->rehashidx));
+                b = (h >= d->ht[0].size) ?
+                    _dictOaBucket(&d->ht[1],h - d->ht[0].size) :
+                    _dictOaBucket(&d->ht[0],h);
+            } else {
+                h = randomULong() & d->ht[0].sizemask;
+                b = _dictOaBucket(&d->ht[0],h);
+            }
+        } while((b->meta & DICT_OA_FULL) == 0);
+        return _dictOaRandomEntry(b);
+    }
     
     // rehashҪht[0]ht[1]
     if (dictIsRehashing(d)) {
@@ -882,8 +1341,8 @@ dictEntry *dictGetRandomKey(dict *d)
             // Ҫ֤Ͱidx>=rehashidx
             h = d->rehashidx + (randomULong() % (dictSlots(d) - d->rehashidx));
             // hĴСȷȡht[1]ht[0]Ͱ
-            he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
-                                      d->ht[0].table[h];
+            he = (h >= d->ht[0].size) ? dictHtBucket(&d->ht[1],h - d->ht[0].size) :
+                                      dictHtBucket(&d->ht[0],h);
             // ֱȡһǿͰ׽ڵ
         } while(he == NULL);
     // rehashֻ迼ht[0]
@@ -892,7 +1351,7 @@ dictEntry *dictGetRandomKey(dict *d)
             // ӦͰidx
             h = randomULong() & d->ht[0].sizemask;
             // ȡͰ׽ڵ
-            he = d->ht[0].table[h];
+            he = dictHtBucket(&d->ht[0],h);
             // ֱȡһǿͰ׽ڵ
         } while(he == NULL);
     }
@@ -1004,8 +1463,29 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
             }
             // hashͰڵǰ鳤ȣ
             if (i >= d->ht[j].size) continue; /* Out of range for this table. */
+            if (dictIsOpenAddressing(d)) {
+                dictOaBucket *b = _dictOaBucket(&d->ht[j],i);
+                unsigned int m = b->meta & DICT_OA_FULL;
+                if (m == 0) {
+                    emptylen++;
+                    if (emptylen >= 5 && emptylen > count) {
+                        i = randomULong() & maxsizemask;
+                        emptylen = 0;
+                    }
+                } else {
+                    emptylen = 0;
+                    while (m) {
+                        *des = b->entries[__builtin_ctz(m)];
+                        des++;
+                        m &= m-1;
+                        stored++;
+                        if (stored == count) return stored;
+                    }
+                }
+                continue;
+            }
             // ҵͰ׽ڵ
-            dictEntry *he = d->ht[j].table[i];
+            dictEntry *he = dictHtBucket(&d->ht[j],i);
 
             /* Count contiguous empty buckets, and jump to other
              * locations if they reach 'count' (with a minimum of 5). */
@@ -1245,6 +1725,7 @@ unsigned long dictScan(dict *d,
                        void *privdata)
 {
     dictht *t0, *t1;
+    dictEntry **bucket;
     const dictEntry *de, *next;
     unsigned long m0, m1;
 
@@ -1263,15 +1744,21 @@ unsigned long dictScan(dict *d,
         m0 = t0->sizemask;
 
         /* Emit entries at cursor */
-        // Ͱɨ躯bucketfnڣbucketfnchuliҪȡͰ
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        // ȡͰ׽ڵ
-        de = t0->table[v & m0];
-        // ڵڣϵĽڵ㣬fnÿһڵ
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
+        if (dictIsOpenAddressing(d)) {
+            _dictOaScanBucket(d, t0, v & m0, fn, bucketfn, privdata);
+        } else {
+            // Ͱɨ躯bucketfnڣbucketfnchuliҪȡͰ
+            // ֶhashδĶûͰҪbucketfn
+            bucket = dictHtBucketRef(t0, v & m0);
+            if (bucketfn && bucket) bucketfn(privdata, bucket);
+            // ȡͰ׽ڵ
+            de = bucket ? *bucket : NULL;
+            // ڵڣϵĽڵ㣬fnÿһڵ
+            while (de) {
+                next = de->next;
+                fn(privdata, de);
+                de = next;
+            }
         }
 
         /* Set unmasked bits so incrementing the reversed cursor
@@ -1308,12 +1795,17 @@ unsigned long dictScan(dict *d,
 
         /* Emit entries at cursor */
         // Ա0Ԫؽдrehashһ
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
+        if (dictIsOpenAddressing(d)) {
+            _dictOaScanBucket(d, t0, v & m0, fn, bucketfn, privdata);
+        } else {
+            bucket = dictHtBucketRef(t0, v & m0);
+            if (bucketfn && bucket) bucketfn(privdata, bucket);
+            de = bucket ? *bucket : NULL;
+            while (de) {
+                next = de->next;
+                fn(privdata, de);
+                de = next;
+            }
         }
 
         /* Iterate over indices in larger table that are the expansion
@@ -1322,13 +1814,18 @@ unsigned long dictScan(dict *d,
         // Ϊm1>m0СһͰidxչе(m1+1)/(m0+1)Ͱ
         do {
             /* Emit entries at cursor */
-            if (bucketfn) bucketfn(privdata, &t1->table[v & m1]);
-            // m1 > m0˴õͰֵСһ
-            de = t1->table[v & m1];
-            while (de) {
-                next = de->next;
-                fn(privdata, de);
-                de = next;
+            if (dictIsOpenAddressing(d)) {
+                _dictOaScanBucket(d, t1, v & m1, fn, bucketfn, privdata);
+            } else {
+                bucket = dictHtBucketRef(t1, v & m1);
+                if (bucketfn && bucket) bucketfn(privdata, bucket);
+                // m1 > m0˴õͰֵСһ
+                de = bucket ? *bucket : NULL;
+                while (de) {
+                    next = de->next;
+                    fn(privdata, de);
+                    de = next;
+                }
             }
 
             /* Increment the reverse cursor not covered by the smaller mask.*/
@@ -1362,6 +1859,11 @@ unsigned long dictScan(dict *d,
 static int dictTypeExpandAllowed(dict *d) {
     // ûexpandAllowed1ʾ
     if (d->type->expandAllowed == NULL) return 1;
+    if (dictIsOpenAddressing(d))
+        return d->type->expandAllowed(
+                    _dictNextPower(_dictOaBucketsFor(d->ht[0].used + 1)) *
+                    sizeof(dictOaBucket),
+                    (double)d->ht[0].used / _dictOaCapacity(&d->ht[0]));
     // Ҫݺڴ͸жǷ
     return d->type->expandAllowed(
                     _dictNextPower(d->ht[0].used + 1) * sizeof(dictEntry*),
@@ -1372,6 +1874,8 @@ static int dictTypeExpandAllowed(dict *d) {
 /* Ҫʱչhash */
 static int _dictExpandIfNeeded(dict *d)
 {
+    if (dictIsOpenAddressing(d)) return _dictOaExpandIfNeeded(d);
+
     /* Incremental rehashing already in progress. Return. */
     // rehashDICT_OK
     if (dictIsRehashing(d)) return DICT_OK;
@@ -1395,6 +1899,49 @@ static int _dictExpandIfNeeded(dict *d)
     return DICT_OK;
 }
 
+/* Expand the open addressing table if needed: they can't hold more entries
+ * than their slots, so the expansion is forced when they are almost full. */
+/* ҪʱչѰַhash */
+static int _dictOaExpandIfNeeded(dict *d)
+{
+    /* While rehashing new entries go to ht[1]: if it fills up (this may
+     * happen shrinking) speed up the rehashing so that it can be expanded
+     * again. */
+    // rehashʱ½ڵht[1]ht[1]ʱӿrehash
+    if (dictIsRehashing(d)) {
+        dictht *ht = &d->ht[1];
+        if (ht->used*100 >= _dictOaCapacity(ht)*DICT_OA_MAX_FILL &&
+            d->pauserehash == 0)
+        {
+            dictRehash(d,100);
+        }
+        if (dictIsRehashing(d)) return DICT_OK;
+    }
+
+    if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+
+    unsigned long used = (d->ht[0].used+1)*100;
+    unsigned long capacity = _dictOaCapacity(&d->ht[0]);
+    if ((used > capacity*DICT_OA_MAX_FILL && dict_can_resize &&
+         dictTypeExpandAllowed(d)) ||
+        used > capacity*DICT_OA_FORCE_FILL)
+    {
+        return dictExpand(d, d->ht[0].used + 1);
+    }
+
+    /* Deletions don't clear the "ever full" marks: with enough churn most
+     * buckets end up marked, and lookups of missing keys probe long runs of
+     * buckets. Rebuild the table when too many buckets are marked. */
+    // ɾڵ㲻""ıǣǵͰʱؽhash
+    if ((d->ht[0].everfull*100 > d->ht[0].size*DICT_OA_MAX_EVERFULL &&
+         dict_can_resize && dictTypeExpandAllowed(d)) ||
+        d->ht[0].everfull*100 > d->ht[0].size*DICT_OA_FORCE_EVERFULL)
+    {
+        return _dictResize(d, d->ht[0].used + 1, NULL, 1);
+    }
+    return DICT_OK;
+}
+
 /* Our hash table capability is a power of two */
 /* һڵsize2^n */
 static unsigned long _dictNextPower(unsigned long size)
@@ -1433,12 +1980,27 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
     if (_dictExpandIfNeeded(d) == DICT_ERR)
         return -1;
 
+    /* The open addressing tables find the slot on insertion. */
+    // ѰַhashֻkeyǷڣʱѰҿвλ
+    if (dictIsOpenAddressing(d)) {
+        for (table = 0; table <= 1; table++) {
+            int slot;
+            dictOaBucket *b = _dictOaFind(d,&d->ht[table],key,hash,&slot);
+            if (b) {
+                if (existing) *existing = b->entries[slot];
+                return -1;
+            }
+            if (!dictIsRehashing(d)) break;
+        }
+        return 0;
+    }
+
     for (table = 0; table <= 1; table++) {
         // ֵ
         idx = hash & d->ht[table].sizemask;
         /* Search if this slot does not already contain the given key */
         // keyǷ
-        he = d->ht[table].table[idx];
+        he = dictHtBucket(&d->ht[table],idx);
         while(he) {
             // ҵkey
             if (key==he->key || dictCompareKeys(d, key, he->key)) {
@@ -1477,6 +2039,16 @@ void dictDisableResize(void) {
     dict_can_resize = 0;
 }
 
+/* ǰ߳ڲʱִrehash */
+void dictEnableRehashStep(void) {
+    dict_can_rehash_step = 1;
+}
+
+/* ֹǰ߳ڲʱִrehash */
+void dictDisableRehashStep(void) {
+    dict_can_rehash_step = 0;
+}
+
 /* ȡֵdжӦkeyhashֵ */
 uint64_t dictGetHash(dict *d, const void *key) {
     return dictHashKey(d, key);
@@ -1502,12 +2074,31 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
     // ֵΪղҪ
     if (dictSize(d) == 0) return NULL; /* dict is empty */
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpenAddressing(d)) {
+            dictht *ht = &d->ht[table];
+            unsigned long probes = ht->size;
+            uint8_t tag = _dictOaTag(hash);
+            idx = hash & ht->sizemask;
+            while (probes--) {
+                dictOaBucket *b = _dictOaBucket(ht,idx);
+                unsigned int m = _dictOaMatch(b,tag);
+                while (m) {
+                    int j = __builtin_ctz(m);
+                    if (oldptr==b->entries[j]->key) return &b->entries[j];
+                    m &= m-1;
+                }
+                if (!(b->meta & DICT_OA_EVERFULL)) break;
+                idx = (idx+1) & ht->sizemask;
+            }
+            if (!dictIsRehashing(d)) return NULL;
+            continue;
+        }
         // Ͱ
         idx = hash & d->ht[table].sizemask;
         // Ͱ׽ڵĵַ
-        heref = &d->ht[table].table[idx];
+        heref = dictHtBucketRef(&d->ht[table],idx);
         // ׽ڵ
-        he = *heref;
+        he = heref ? *heref : NULL;
         // еĽڵkeyĵַǷoldptrͬ
         while(he) {
             if (oldptr==he->key)
@@ -1540,14 +2131,13 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     for (i = 0; i < ht->size; i++) {
         dictEntry *he;
 
-        if (ht->table[i] == NULL) {
+        if ((he = dictHtBucket(ht,i)) == NULL) {
             clvector[0]++;
             continue;
         }
         slots++;
         /* For each hash entry on this slot... */
         chainlen = 0;
-        he = ht->table[i];
         while(he) {
             chainlen++;
             he = he->next;
@@ -1580,6 +2170,79 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
             i, clvector[i], ((float)clvector[i]/ht->size)*100);
     }
 
+    if (ht->segments && l < bufsize) {
+        unsigned long segments = _dictSegmentsCount(ht), allocated = 0;
+        for (i = 0; i < segments; i++)
+            if (ht->segments[i]) allocated++;
+        l += snprintf(buf+l,bufsize-l,
+            " segments allocated: %lu of %lu\n", allocated, segments);
+    }
+
+    /* Unlike snprintf(), return the number of characters actually written. */
+    if (bufsize) buf[bufsize-1] = '\0';
+    return strlen(buf);
+}
+
+size_t _dictGetStatsOaHt(char *buf, size_t bufsize, dict *d, dictht *ht, int tableid) {
+    unsigned long i, everfull = 0, probelen, maxprobelen = 0;
+    unsigned long totprobelen = 0;
+    unsigned long clvector[DICT_OA_BUCKET_SLOTS+1];
+    size_t l = 0;
+
+    if (ht->used == 0) {
+        return snprintf(buf,bufsize,
+            "No stats available for empty dictionaries\n");
+    }
+
+    /* Compute stats. The probe length of an entry is the distance between
+     * its home bucket and the bucket holding it. */
+    for (i = 0; i <= DICT_OA_BUCKET_SLOTS; i++) clvector[i] = 0;
+    for (i = 0; i < ht->size; i++) {
+        dictOaBucket *b = _dictOaBucket(ht,i);
+        unsigned int m = b->meta & DICT_OA_FULL;
+
+        if (b->meta & DICT_OA_EVERFULL) everfull++;
+        clvector[__builtin_popcount(m)]++;
+        while (m) {
+            dictEntry *he = b->entries[__builtin_ctz(m)];
+            probelen = (i - (dictHashKey(d, he->key) & ht->sizemask)) &
+                       ht->sizemask;
+            if (probelen > maxprobelen) maxprobelen = probelen;
+            totprobelen += probelen;
+            m &= m-1;
+        }
+    }
+
+    /* Generate human readable stats. */
+    l += snprintf(buf+l,bufsize-l,
+        "Hash table %d stats (%s, open addressing):\n"
+        " table size: %lu\n"
+        " number of elements: %lu\n"
+        " slots fill: %.02f%%\n"
+        " ever full buckets: %lu\n"
+        " max probe length: %lu\n"
+        " avg probe length: %.02f\n"
+        " Bucket fill distribution:\n",
+        tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+        ht->size, ht->used, (float)ht->used*100/_dictOaCapacity(ht),
+        everfull, maxprobelen, (float)totprobelen/ht->used);
+
+    for (i = 0; i <= DICT_OA_BUCKET_SLOTS; i++) {
+        if (clvector[i] == 0) continue;
+        if (l >= bufsize) break;
+        l += snprintf(buf+l,bufsize-l,
+            "   %ld: %ld (%.02f%%)\n",
+            i, clvector[i], ((float)clvector[i]/ht->size)*100);
+    }
+
+    if (ht->segments && l < bufsize) {
+        unsigned long segments = _dictSegmentsCount(ht), allocated = 0;
+        for (i = 0; i < segments; i++)
+            if (ht->segments[i]) allocated++;
+        l += snprintf(buf+l,bufsize-l,
+            " segments allocated: %lu of %lu\n", allocated, segments);
+    }
+
     /* Unlike snprintf(), return the number of characters actually written. */
     if (bufsize) buf[bufsize-1] = '\0';
     return strlen(buf);
@@ -1590,11 +2253,17 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
 
-    l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
+    if (dictIsOpenAddressing(d))
+        l = _dictGetStatsOaHt(buf,bufsize,d,&d->ht[0],0);
+    else
+        l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        if (dictIsOpenAddressing(d))
+            _dictGetStatsOaHt(buf,bufsize,d,&d->ht[1],1);
+        else
+            _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
@@ -1636,6 +2305,20 @@ char *stringFromLongLong(long long value) {
     return s;
 }
 
+/* Entry constructor embedding the key in the entry, like the keyspace does.
+ * The benchmark passes the ownership of the keys to the dict, so the key is
+ * released once copied. */
+dictEntry *embedKeyEntryCreateCallback(void *privdata, const void *key) {
+    size_t len = strlen((char*)key);
+    dictEntry *de = zmalloc(sizeof(*de)+len+1);
+    DICT_NOTUSED(privdata);
+
+    memcpy(de+1, key, len+1);
+    de->key = de+1;
+    zfree((void*)key);
+    return de;
+}
+
 dictType BenchmarkDictType = {
     hashCallback,
     NULL,
@@ -1643,7 +2326,72 @@ dictType BenchmarkDictType = {
     compareCallback,
     freeCallback,
     NULL,
-    NULL
+    NULL,
+    0,
+    0
+};
+
+dictType SegmentedBenchmarkDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    NULL,
+    1,
+    0
+};
+
+dictType OpenAddressingBenchmarkDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    NULL,
+    0,
+    1
+};
+
+dictType SegmentedOpenAddressingBenchmarkDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    NULL,
+    1,
+    1
+};
+
+dictType SegmentedEmbeddedKeyBenchmarkDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    NULL,
+    NULL,
+    NULL,
+    1,
+    0,
+    embedKeyEntryCreateCallback
+};
+
+struct {
+    char *name;
+    dictType *type;
+} BenchmarkDictTypes[] = {
+    {"Flat hash tables", &BenchmarkDictType},
+    {"Segmented hash tables", &SegmentedBenchmarkDictType},
+    {"Open addressing hash tables", &OpenAddressingBenchmarkDictType},
+    {"Segmented open addressing hash tables",
+     &SegmentedOpenAddressingBenchmarkDictType},
+    {"Segmented hash tables with embedded keys",
+     &SegmentedEmbeddedKeyBenchmarkDictType},
+    {NULL, NULL}
 };
 
 #define start_benchmark() start = timeInMilliseconds()
@@ -1652,22 +2400,68 @@ dictType BenchmarkDictType = {
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0)
 
-/* ./redis-server test dict [<count> | --accurate] */
-int dictTest(int argc, char **argv, int accurate) {
-    long j;
-    long long start, elapsed;
-    dict *dict = dictCreate(&BenchmarkDictType,NULL);
-    long count = 0;
+long long timeInMicroseconds(void) {
+    struct timeval tv;
 
-    if (argc == 4) {
-        if (accurate) {
-            count = 5000000;
-        } else {
-            count = strtol(argv[3],NULL,10);
-        }
-    } else {
-        count = 5000;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Count the elements reported by a full SCAN cycle, and check that with
+ * the iterator, or with the iterators of all the parts of the dictionary,
+ * every element is returned exactly once. */
+void dictBenchmarkCheckIteration(dict *dict, long count) {
+    dictIterator *di = dictGetSafeIterator(dict);
+    dictEntry *de;
+    long iterated = 0;
+
+    while ((de = dictNext(di)) != NULL) iterated++;
+    dictReleaseIterator(di);
+    assert(iterated == count);
+
+    iterated = 0;
+    for (int part = 0; part < 7; part++) {
+        di = dictGetPartIterator(dict,part,7);
+        while ((de = dictNext(di)) != NULL) iterated++;
+        dictReleaseIterator(di);
     }
+    assert(iterated == count);
+}
+
+void dictBenchmarkScanCallback(void *privdata, const dictEntry *de) {
+    DICT_NOTUSED(de);
+    (*(long*)privdata)++;
+}
+
+/* Fill a dictionary reporting the worst latency and the biggest memory
+ * increase caused by a single insertion: this is where the flat tables pay
+ * the allocation of the whole new bucket array at once. */
+void dictBenchmarkGrowth(dictType *type, long count) {
+    long long maxlat = 0, start = timeInMicroseconds();
+    size_t maxmem = 0;
+    dict *dict = dictCreate(type,NULL);
+
+    for (long j = 0; j < count; j++) {
+        char *key = stringFromLongLong(j);
+        size_t mem = zmalloc_used_memory();
+        long long t = timeInMicroseconds();
+        int retval = dictAdd(dict,key,(void*)j);
+        t = timeInMicroseconds()-t;
+        size_t used = zmalloc_used_memory();
+        assert(retval == DICT_OK);
+        if (t > maxlat) maxlat = t;
+        if (used > mem && used-mem > maxmem) maxmem = used-mem;
+    }
+    printf("Growth to %ld items in %lld ms: worst insert %lld us, "
+           "biggest allocation by a single insert %zu bytes\n",
+           count, (timeInMicroseconds()-start)/1000, maxlat, maxmem);
+    dictRelease(dict);
+}
+
+void dictBenchmark(dictType *type, long count) {
+    long j;
+    long long start, elapsed;
+    dict *dict = dictCreate(type,NULL);
 
     start_benchmark();
     for (j = 0; j < count; j++) {
@@ -1736,7 +2530,134 @@ int dictTest(int argc, char **argv, int accurate) {
         assert(retval == DICT_OK);
     }
     end_benchmark("Removing and adding");
+
+    dictBenchmarkCheckIteration(dict,count);
+    long scanned = 0;
+    unsigned long cursor = 0;
+    do {
+        cursor = dictScan(dict,cursor,dictBenchmarkScanCallback,NULL,&scanned);
+    } while (cursor != 0);
+    assert(scanned >= count);
+
+    /* Shrink the table and check nothing is lost while rehashing. */
+    for (j = 0; j < count/2; j++) {
+        char *key = stringFromLongLong(j);
+        key[0] += 17;
+        int retval = dictDelete(dict,key);
+        assert(retval == DICT_OK);
+        zfree(key);
+    }
+    dictResize(dict);
+    dictBenchmarkCheckIteration(dict,count-count/2);
+    while (dictIsRehashing(dict)) {
+        dictRehashMilliseconds(dict,100);
+    }
+    dictBenchmarkCheckIteration(dict,count-count/2);
+    dictRelease(dict);
+}
+
+/* Delete and add keys keeping the dictionary at a constant size, then look
+ * up missing keys: deletions don't clear the "ever full" marks of the open
+ * addressing tables, so this is where they would degrade. */
+void dictBenchmarkChurn(dictType *type, long count) {
+    long j;
+    long long start, elapsed;
+    dict *dict = dictCreate(type,NULL);
+
+    for (j = 0; j < count; j++) {
+        int retval = dictAdd(dict,stringFromLongLong(j),(void*)j);
+        assert(retval == DICT_OK);
+    }
+
+    start_benchmark();
+    for (j = 0; j < count*10; j++) {
+        char *key = stringFromLongLong(j);
+        int retval = dictDelete(dict,key);
+        assert(retval == DICT_OK);
+        zfree(key);
+        retval = dictAdd(dict,stringFromLongLong(j+count),(void*)j);
+        assert(retval == DICT_OK);
+    }
+    end_benchmark("Removing and adding at a constant size");
+    assert((long)dictSize(dict) == count);
+    while (dictIsRehashing(dict)) {
+        dictRehashMilliseconds(dict,100);
+    }
+    if (dictIsOpenAddressing(dict))
+        assert(dict->ht[0].everfull*100 <=
+               dict->ht[0].size*DICT_OA_MAX_EVERFULL + 100);
+
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        char *key = stringFromLongLong(rand() % count);
+        key[0] = 'X';
+        dictEntry *de = dictFind(dict,key);
+        assert(de == NULL);
+        zfree(key);
+    }
+    end_benchmark("Accessing missing after churn");
+    dictBenchmarkCheckIteration(dict,count);
+
+    /* Same while resizing is disabled, like when a child process is
+     * saving: the tables are still rebuilt past DICT_OA_FORCE_EVERFULL. */
+    dictDisableResize();
+    start_benchmark();
+    for (j = count*10; j < count*20; j++) {
+        char *key = stringFromLongLong(j);
+        int retval = dictDelete(dict,key);
+        assert(retval == DICT_OK);
+        zfree(key);
+        retval = dictAdd(dict,stringFromLongLong(j+count),(void*)j);
+        assert(retval == DICT_OK);
+    }
+    end_benchmark("Removing and adding with resizing disabled");
+    assert((long)dictSize(dict) == count);
+    while (dictIsRehashing(dict)) {
+        dictRehashMilliseconds(dict,100);
+    }
+    if (dictIsOpenAddressing(dict))
+        assert(dict->ht[0].everfull*100 <=
+               dict->ht[0].size*DICT_OA_FORCE_EVERFULL + 100);
+
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        char *key = stringFromLongLong(rand() % count);
+        key[0] = 'X';
+        dictEntry *de = dictFind(dict,key);
+        assert(de == NULL);
+        zfree(key);
+    }
+    end_benchmark("Accessing missing after churn with resizing disabled");
+    dictBenchmarkCheckIteration(dict,count);
+    dictEnableResize();
     dictRelease(dict);
+}
+
+/* ./redis-server test dict [<count> | --accurate] */
+int dictTest(int argc, char **argv, int accurate) {
+    long count = 0;
+
+    if (argc == 4) {
+        if (accurate) {
+            count = 5000000;
+        } else {
+            count = strtol(argv[3],NULL,10);
+        }
+    } else {
+        count = 5000;
+    }
+
+    /* The growth benchmarks run first, so that they are not affected by the
+     * allocator reorganizing the memory released by the other benchmarks. */
+    for (int i = 0; BenchmarkDictTypes[i].name; i++) {
+        printf("=== %s ===\n", BenchmarkDictTypes[i].name);
+        dictBenchmarkGrowth(BenchmarkDictTypes[i].type,count);
+    }
+    for (int i = 0; BenchmarkDictTypes[i].name; i++) {
+        printf("=== %s ===\n", BenchmarkDictTypes[i].name);
+        dictBenchmark(BenchmarkDictTypes[i].type,count);
+        dictBenchmarkChurn(BenchmarkDictTypes[i].type,count);
+    }
     return 0;
 }
 #endif
@@ -90,6 +90,26 @@ typedef struct dictType {
     void (*valDestructor)(void *privdata, void *obj);
     // ݺڴ͸жǷ
     int (*expandAllowed)(size_t moreMem, double usedRatio);
+    /* When non zero the hash tables of the dict keep their buckets in fixed
+     * size segments allocated on demand instead of a single array, so that
+     * expanding a huge dict never allocates (and zeroes) a huge bucket array
+     * in one step. */
+    // 0ʾʹ÷ֶεͰ飬ʱһԷ޴
+    int segmented;
+    /* When non zero the hash tables use open addressing: entries are stored
+     * in cache line sized buckets of DICT_OA_BUCKET_SLOTS slots together
+     * with a byte of their hash, instead of chaining. Entries of such dicts
+     * always have 'next' set to NULL. */
+    // 0ʾʹÿѰַhashڵֱָӴڻдСͰ
+    int openAddressing;
+    /* When set, new entries are allocated by this function instead of
+     * zmalloc(sizeof(dictEntry)). It must return an entry with the key
+     * already set, so that the type can store the key (or other data) in
+     * the same allocation of the entry. keyDup is not called for such dicts
+     * and entries are still released with zfree(), so keyDestructor should
+     * only be set if the key is not embedded in the entry. */
+    // NULLʱɴ˺ڵ㲢keyɽkeyǶڽڵڴ
+    dictEntry *(*entryCreate)(void *privdata, const void *key);
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
@@ -100,12 +120,20 @@ typedef struct dictType {
 typedef struct dictht {
     // hashָ,dictEntry*ʾhashڵָ룬dictEntry**ʾ׵ַ
     dictEntry **table;
+    /* Segmented tables (see dictType.segmented) have 'table' set to NULL and
+     * use instead this directory of DICT_SEGMENT_SIZE buckets segments. A
+     * NULL segment is never populated, or was already freed by rehashing. */
+    // ֶhashĶĿ¼segments[i]ΪNULLʾöεͰȫΪ
+    dictEntry ***segments;
     // hashСһΪ2^nҪͨȡģȡhashȡģ&ܲһЩ
     unsigned long size;
     // hash鳤룬һsizemask = 2^n - 1
     unsigned long sizemask;
     // hashk-vԵĸ
     unsigned long used;
+    /* Open addressing tables only: number of "ever full" buckets. */
+    // Ѱַhash""Ͱ
+    unsigned long everfull;
 } dictht;
 
 /* ֵ */
@@ -140,6 +168,10 @@ typedef struct dictIterator {
     // entry     -- ǰѷصĽڵ
     // nextEntry -- һڵ
     dictEntry *entry, *nextEntry;
+    /* When numparts is not zero only the part 'part' of the buckets of
+     * every table is iterated, see dictGetPartIterator(). */
+    // 0ʱֻÿhashĵpart֣numparts֣
+    int part, numparts;
     /* unsafe iterator fingerprint for misuse detection. */
     // ֵ䵱ǰ״̬ǩhashֵ
     long long fingerprint;
@@ -152,6 +184,17 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 /* ϣʼС */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Number of buckets of every segment of a segmented hash table (tables
+ * smaller than that use a single segment of exactly 'size' buckets). */
+/* ֶhashÿεͰ2^12Ͱÿ32KB */
+#define DICT_SEGMENT_EXP         12
+#define DICT_SEGMENT_SIZE        (1UL<<DICT_SEGMENT_EXP)
+#define DICT_SEGMENT_MASK        (DICT_SEGMENT_SIZE-1)
+
+/* Number of entries every bucket of an open addressing table can hold. */
+/* ѰַhashÿͰɴŵĽڵ */
+#define DICT_OA_BUCKET_SLOTS     7
+
 /* ------------------------------- Macros ------------------------------------*/
 // ͷŸֵڵֵ
 #define dictFreeVal(d, entry) \
@@ -209,8 +252,9 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
 // ظhashڵdouble(v.d)
 #define dictGetDoubleVal(he) ((he)->v.d)
-// ظֵĴС
-#define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
+// ظֵĴСѰַhashؿɴŽڵ
+#define dictSlots(d) (((d)->ht[0].size+(d)->ht[1].size) * \
+                      (dictIsOpenAddressing(d) ? DICT_OA_BUCKET_SLOTS : 1))
 // ֵнڵ
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 // 鿴ڵǷrehash
@@ -219,6 +263,30 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictPauseRehashing(d) (d)->pauserehash++
 // ¿ʼrehash
 #define dictResumeRehashing(d) (d)->pauserehash--
+// ֵǷʹ÷ֶhash
+#define dictIsSegmented(d) ((d)->type->segmented)
+// ֵǷʹÿѰַhash
+#define dictIsOpenAddressing(d) ((d)->type->openAddressing)
+
+/* Return a reference to the bucket 'idx' of the hash table 'ht', or NULL if
+ * the table is segmented and the segment holding the bucket is not allocated,
+ * that is, the bucket is empty. Only valid for chained (not open addressing)
+ * hash tables. */
+/* ȡhashidxͰĵַͰڵĶδʱNULL */
+static inline dictEntry **dictHtBucketRef(dictht *ht, unsigned long idx) {
+    if (ht->segments) {
+        dictEntry **seg = ht->segments[idx >> DICT_SEGMENT_EXP];
+        return seg ? &seg[idx & DICT_SEGMENT_MASK] : NULL;
+    }
+    return &ht->table[idx];
+}
+
+/* Return the first entry of the bucket 'idx' of the hash table 'ht'. */
+/* ȡhashidxͰ׽ڵ */
+static inline dictEntry *dictHtBucket(dictht *ht, unsigned long idx) {
+    dictEntry **bucket = dictHtBucketRef(ht,idx);
+    return bucket ? *bucket : NULL;
+}
 
 /* If our unsigned long type can store a 64 bit number, use a 64 bit PRNG. */
 /* unsigned longԴ64λʹ64λα */
@@ -245,6 +313,7 @@ void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
 dictIterator *dictGetSafeIterator(dict *d);
+dictIterator *dictGetPartIterator(dict *d, int part, int numparts);
 dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
@@ -256,6 +325,8 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
+void dictEnableRehashStep(void);
+void dictDisableRehashStep(void);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
 void dictSetHashFunctionSeed(uint8_t *seed);
@@ -338,11 +338,24 @@ size_t freeMemoryGetNotCountedMemory(void) {
         listRewind(server.slaves,&li);
         while((ln = listNext(&li))) {
             client *slave = listNodeValue(ln);
-            overhead += getClientOutputBufferMemoryUsage(slave);
+            overhead += getClientOutputBufferMemoryUsage(slave)-
+                        getClientReplBufferMemoryUsage(slave);
         }
     }
+
+    /* The replication buffer is shared by the slaves and the backlog, only
+     * what exceeds the backlog size is there for the slaves, or was there for
+     * slaves that are gone, until it is freed incrementally. The backlog
+     * takes a few more bytes than its size for the headers of the blocks. */
+    if ((long long)server.repl_buffer_mem > server.repl_backlog_size) {
+        size_t backlog_mem = server.repl_backlog_size +
+            (server.repl_backlog_size/PROTO_REPLY_CHUNK_BYTES+1)*
+            (sizeof(replBufBlock)+sizeof(listNode));
+        if (server.repl_buffer_mem > backlog_mem)
+            overhead += server.repl_buffer_mem-backlog_mem;
+    }
     if (server.aof_state != AOF_OFF) {
-        overhead += sdsalloc(server.aof_buf)+aofRewriteBufferSize();
+        overhead += sdsalloc(server.aof_buf);
     }
     return overhead;
 }
@@ -32,6 +32,121 @@
 
 #include "server.h"
 
+/*-----------------------------------------------------------------------------
+ * Expires index.
+ *
+ * When active-expire-index is enabled, every DB also tracks its volatile keys
+ * in a radix tree ordered by expire time, so that the active expire cycle can
+ * reclaim the expired keys in deadline order doing work proportional to the
+ * number of expired keys, instead of sampling db->expires.
+ *
+ * The elements of the radix tree are the expire time, stored as a big endian
+ * 64 bit integer with the sign bit flipped so that the memcmp() order is the
+ * numerical order, followed by the key name.
+ *----------------------------------------------------------------------------*/
+
+#define EXPIRES_INDEX_TIME_LEN 8
+#define EXPIRES_INDEX_STATIC_LEN 128 /* Index keys of up to this length are
+                                        built on the stack. */
+
+/* Build the index element for 'key' expiring at 'when' into 'buf' if it is
+ * big enough, otherwise into a new allocation. The caller should free the
+ * returned buffer if it is not 'buf'. */
+static unsigned char *expiresIndexKey(unsigned char *buf, size_t buflen,
+                                      sds key, long long when, size_t *len)
+{
+    uint64_t t = (uint64_t)when ^ (1ULL<<63);
+    *len = EXPIRES_INDEX_TIME_LEN+sdslen(key);
+    if (*len > buflen) buf = zmalloc(*len);
+    for (int j = EXPIRES_INDEX_TIME_LEN-1; j >= 0; j--) {
+        buf[j] = t & 0xff;
+        t >>= 8;
+    }
+    memcpy(buf+EXPIRES_INDEX_TIME_LEN,key,sdslen(key));
+    return buf;
+}
+
+/* Return the expire time of an element of the index. */
+static long long expiresIndexKeyTime(unsigned char *ikey) {
+    uint64_t t = 0;
+    for (int j = 0; j < EXPIRES_INDEX_TIME_LEN; j++) t = (t<<8) | ikey[j];
+    return (long long)(t ^ (1ULL<<63));
+}
+
+/* Add or remove 'key', expiring at 'when', to/from the expires index of
+ * the DB. Nothing is done if the index is not enabled. */
+static void expiresIndexUpdate(redisDb *db, sds key, long long when, int add) {
+    unsigned char buf[EXPIRES_INDEX_STATIC_LEN], *ikey;
+    size_t len;
+    int retval;
+
+    if (db->expires_index == NULL) return;
+    ikey = expiresIndexKey(buf,sizeof(buf),key,when,&len);
+    if (add)
+        retval = raxTryInsert(db->expires_index,ikey,len,NULL,NULL);
+    else
+        retval = raxRemove(db->expires_index,ikey,len,NULL);
+    serverAssert(retval == 1);
+    if (ikey != buf) zfree(ikey);
+}
+
+void expiresIndexAdd(redisDb *db, sds key, long long when) {
+    expiresIndexUpdate(db,key,when,1);
+}
+
+void expiresIndexDel(redisDb *db, sds key, long long when) {
+    expiresIndexUpdate(db,key,when,0);
+}
+
+/* Return the expire time of the key expiring first according to the index,
+ * or -1 if the index is empty or not enabled. */
+long long expiresIndexFirst(redisDb *db) {
+    raxIterator ri;
+    long long when = -1;
+
+    if (db->expires_index == NULL || raxSize(db->expires_index) == 0)
+        return -1;
+    raxStart(&ri,db->expires_index);
+    raxSeek(&ri,"^",NULL,0);
+    if (raxNext(&ri)) when = expiresIndexKeyTime(ri.key);
+    raxStop(&ri);
+    return when;
+}
+
+/* Delete the keys of the DB already expired at 'now', in expire time order,
+ * stopping once 'timelimit' microseconds passed since 'start'. Returns the
+ * number of keys deleted, and sets '*timelimit_exit' if the time limit was
+ * reached before all the expired keys were reclaimed. */
+static unsigned long activeExpireIndexedKeys(redisDb *db, long long now,
+                                             long long start,
+                                             long long timelimit,
+                                             int *timelimit_exit)
+{
+    raxIterator ri;
+    unsigned long expired = 0;
+
+    raxStart(&ri,db->expires_index);
+    while(1) {
+        /* Seek again every time since deleting a key modifies the tree. */
+        raxSeek(&ri,"^",NULL,0);
+        if (!raxNext(&ri) || now <= expiresIndexKeyTime(ri.key)) break;
+
+        robj *keyobj = createStringObject((char*)ri.key+EXPIRES_INDEX_TIME_LEN,
+                                          ri.key_len-EXPIRES_INDEX_TIME_LEN);
+        deleteExpiredKeyAndPropagate(db,keyobj);
+        decrRefCount(keyobj);
+        expired++;
+
+        if ((expired & 0xf) == 0 && ustime()-start > timelimit) {
+            *timelimit_exit = 1;
+            server.stat_expired_time_cap_reached_count++;
+            break;
+        }
+    }
+    raxStop(&ri);
+    return expired;
+}
+
 /*-----------------------------------------------------------------------------
  * Incremental collection of expired keys.
  *
@@ -193,6 +308,16 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
+        /* With the expires index there is nothing to sample: the expired
+         * keys are the first ones of the index. If they are all reclaimed
+         * before the time limit, no stale key is left, so the DB does not
+         * contribute to the stale keys estimate. */
+        if (db->expires_index) {
+            activeExpireIndexedKeys(db,mstime(),start,timelimit,
+                                    &timelimit_exit);
+            continue;
+        }
+
         /* Continue to expire if at the end of the cycle there are still
          * a big percentage of keys to expire, compared to the number of keys
          * we scanned. The percentage, stored in config_cycle_acceptable_stale
@@ -246,7 +371,7 @@ void activeExpireCycle(int type) {
 
                     unsigned long idx = db->expires_cursor;
                     idx &= db->expires->ht[table].sizemask;
-                    dictEntry *de = db->expires->ht[table].table[idx];
+                    dictEntry *de = dictHtBucket(&db->expires->ht[table],idx);
                     long long ttl;
 
                     /* Scan the current bucket of the current table. */
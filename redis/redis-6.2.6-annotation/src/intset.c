@@ -36,6 +36,10 @@
 #include "endianconv.h"
 #include "redisassert.h"
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* Note that these encodings are ordered, so:
  * INTSET_ENC_INT16 < INTSET_ENC_INT32 < INTSET_ENC_INT64. */
 /* intset的编码方式 */
@@ -137,6 +141,141 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* Lower bound kernels: return the position of the first of the 'n' sorted
+ * elements at 'p', encoded with 'enc', that is >= 'value', or 'n' if there
+ * is none. They compare a whole vector of elements at once and stop at the
+ * first vector that is not entirely smaller than 'value', so they are only
+ * used on short ranges, after a binary search narrowed them down. The value
+ * must fit in 'enc'. Only x86 (little endian) CPUs get here, so elements can
+ * be read without memrev*ifbe(). */
+typedef uint32_t intsetLowerBoundKernel(const int8_t *p, uint8_t enc,
+                                        uint32_t n, int64_t value);
+
+/* Ranges at most this many bytes long are scanned by the kernels. */
+#define INTSET_SCAN_BYTES 128
+
+#ifdef HAVE_X86_SIMD
+ATTRIBUTE_TARGET_AVX2
+static uint32_t intsetLowerBoundAVX2(const int8_t *p, uint8_t enc,
+                                     uint32_t n, int64_t value)
+{
+    uint32_t i = 0, mask;
+
+    if (enc == INTSET_ENC_INT16) {
+        const int16_t *a = (const int16_t*)p;
+        __m256i v = _mm256_set1_epi16((int16_t)value);
+        for (; i+16 <= n; i += 16) {
+            __m256i lt = _mm256_cmpgt_epi16(v,
+                _mm256_loadu_si256((const __m256i*)(a+i)));
+            /* Two bits per element. */
+            mask = _mm256_movemask_epi8(lt);
+            if (mask != 0xffffffff) return i+__builtin_ctz(~mask)/2;
+        }
+        while (i < n && a[i] < value) i++;
+    } else if (enc == INTSET_ENC_INT32) {
+        const int32_t *a = (const int32_t*)p;
+        __m256i v = _mm256_set1_epi32((int32_t)value);
+        for (; i+8 <= n; i += 8) {
+            __m256i lt = _mm256_cmpgt_epi32(v,
+                _mm256_loadu_si256((const __m256i*)(a+i)));
+            mask = _mm256_movemask_ps(_mm256_castsi256_ps(lt));
+            if (mask != 0xff) return i+__builtin_ctz(~mask);
+        }
+        while (i < n && a[i] < value) i++;
+    } else {
+        const int64_t *a = (const int64_t*)p;
+        __m256i v = _mm256_set1_epi64x(value);
+        for (; i+4 <= n; i += 4) {
+            __m256i lt = _mm256_cmpgt_epi64(v,
+                _mm256_loadu_si256((const __m256i*)(a+i)));
+            mask = _mm256_movemask_pd(_mm256_castsi256_pd(lt));
+            if (mask != 0xf) return i+__builtin_ctz(~mask);
+        }
+        while (i < n && a[i] < value) i++;
+    }
+    return i;
+}
+
+ATTRIBUTE_TARGET_SSE42
+static uint32_t intsetLowerBoundSSE42(const int8_t *p, uint8_t enc,
+                                      uint32_t n, int64_t value)
+{
+    uint32_t i = 0, mask;
+
+    if (enc == INTSET_ENC_INT16) {
+        const int16_t *a = (const int16_t*)p;
+        __m128i v = _mm_set1_epi16((int16_t)value);
+        for (; i+8 <= n; i += 8) {
+            __m128i lt = _mm_cmpgt_epi16(v,
+                _mm_loadu_si128((const __m128i*)(a+i)));
+            /* Two bits per element. */
+            mask = _mm_movemask_epi8(lt);
+            if (mask != 0xffff) return i+__builtin_ctz(~mask)/2;
+        }
+        while (i < n && a[i] < value) i++;
+    } else if (enc == INTSET_ENC_INT32) {
+        const int32_t *a = (const int32_t*)p;
+        __m128i v = _mm_set1_epi32((int32_t)value);
+        for (; i+4 <= n; i += 4) {
+            __m128i lt = _mm_cmpgt_epi32(v,
+                _mm_loadu_si128((const __m128i*)(a+i)));
+            mask = _mm_movemask_ps(_mm_castsi128_ps(lt));
+            if (mask != 0xf) return i+__builtin_ctz(~mask);
+        }
+        while (i < n && a[i] < value) i++;
+    } else {
+        const int64_t *a = (const int64_t*)p;
+        __m128i v = _mm_set1_epi64x(value);
+        for (; i+2 <= n; i += 2) {
+            __m128i lt = _mm_cmpgt_epi64(v,
+                _mm_loadu_si128((const __m128i*)(a+i)));
+            mask = _mm_movemask_pd(_mm_castsi128_pd(lt));
+            if (mask != 0x3) return i+__builtin_ctz(~mask);
+        }
+        while (i < n && a[i] < value) i++;
+    }
+    return i;
+}
+#endif
+
+/* Pick the best kernel for this CPU the first time one is needed. NULL
+ * means that there is none, and that a plain binary search is used. */
+static int intsetKernelSelected = 0;
+static intsetLowerBoundKernel *intsetKernel = NULL;
+
+static intsetLowerBoundKernel *intsetSelectKernel(void) {
+    if (likely(intsetKernelSelected)) return intsetKernel;
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        intsetKernel = intsetLowerBoundAVX2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        intsetKernel = intsetLowerBoundSSE42;
+#endif
+    intsetKernelSelected = 1;
+    return intsetKernel;
+}
+
+/* Return the position of the first element >= "value" in the range
+ * [lo, hi) of the intset, or hi if there is none. The value must fit in the
+ * encoding of the intset. */
+static uint32_t intsetLowerBound(intset *is, uint32_t lo, uint32_t hi,
+                                 int64_t value)
+{
+    uint8_t enc = intrev32ifbe(is->encoding);
+    intsetLowerBoundKernel *kernel = intsetSelectKernel();
+    uint32_t window = kernel ? INTSET_SCAN_BYTES/enc : 0;
+
+    while (hi-lo > window) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (_intsetGetEncoded(is,mid,enc) < value)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    if (lo < hi) lo += kernel(is->contents+(size_t)lo*enc,enc,hi-lo,value);
+    return lo;
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
@@ -147,13 +286,12 @@ static intset *intsetResize(intset *is, uint32_t len) {
  * T=O(logN)
  */
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
-    int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
-    int64_t cur = -1;
+    uint32_t len = intrev32ifbe(is->length), p;
 
     /* The value can never be found when the set is empty */
     // 处理不可能找到value的情况
     // is为空的情况，待插入位置为0
-    if (intrev32ifbe(is->length) == 0) {
+    if (len == 0) {
         if (pos) *pos = 0;
         return 0;
     // is不为空的情况，判断边界值与value的关系（因为有序）
@@ -161,8 +299,8 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         /* Check for the case where we know we cannot find the value,
          * but do know the insert position. */
         // 大于最大值，待插入位置为is->length
-        if (value > _intsetGet(is,max)) {
-            if (pos) *pos = intrev32ifbe(is->length);
+        if (value > _intsetGet(is,len-1)) {
+            if (pos) *pos = len;
             return 0;
         // 小于最小值，待插入位置为0
         } else if (value < _intsetGet(is,0)) {
@@ -171,28 +309,10 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         }
     }
 
-    // 二分查找
-    while(max >= min) {
-        mid = ((unsigned int)min + (unsigned int)max) >> 1;
-        cur = _intsetGet(is,mid);
-        if (value > cur) {
-            min = mid+1;
-        } else if (value < cur) {
-            max = mid-1;
-        } else {
-            break;
-        }
-    }
-
-    // 找到值
-    if (value == cur) {
-        if (pos) *pos = mid;
-        return 1;
-    // 没找到值
-    } else {
-        if (pos) *pos = min;
-        return 0;
-    }
+    // 二分查找，剩下的元素不多时用SIMD指令逐段比较
+    p = intsetLowerBound(is,0,len,value);
+    if (pos) *pos = p;
+    return p < len && _intsetGet(is,p) == value;
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -383,6 +503,76 @@ uint8_t intsetFind(intset *is, int64_t value) {
     return valenc <= intrev32ifbe(is->encoding) && intsetSearch(is,value,NULL);
 }
 
+/* Return a new intset with the elements found both in "a" and "b".
+ *
+ * Every element of the smaller set is looked up in the larger one, only
+ * moving forward: the next few elements are compared first, and when they
+ * are all smaller we gallop ahead doubling the step, then search the last
+ * step. So the cost goes from the one of a linear merge when the sets have
+ * a similar size, to a binary search per element of the smaller set when
+ * it is much smaller than the other. The result uses the smallest encoding
+ * that fits its elements, like if they were added one after the other. */
+intset *intsetIntersect(intset *a, intset *b) {
+    if (intrev32ifbe(a->length) > intrev32ifbe(b->length)) {
+        intset *tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint8_t aenc = intrev32ifbe(a->encoding), benc = intrev32ifbe(b->encoding);
+    uint32_t step0 = INTSET_SCAN_BYTES/benc, i, j = 0, len = 0;
+    intset *is = intsetNew();
+
+    /* Elements of the intersection fit the encodings of both sets. */
+    is->encoding = intrev32ifbe(aenc < benc ? aenc : benc);
+    is = intsetResize(is,alen);
+
+    for (i = 0; i < alen && j < blen; i++) {
+        int64_t value = _intsetGetEncoded(a,i,aenc);
+        uint32_t hi, step;
+
+        if (_intsetValueEncoding(value) > benc) {
+            /* Smaller or greater than every element of "b". */
+            if (value < 0) continue;
+            break;
+        }
+
+        hi = blen-j > step0 ? j+step0 : blen;
+        j = intsetLowerBound(b,j,hi,value);
+        if (j == hi && hi < blen) {
+            step = step0;
+            while (1) {
+                hi = blen-j > step ? j+step : blen;
+                if (hi == blen || _intsetGetEncoded(b,hi,benc) >= value) break;
+                j = hi+1;
+                step *= 2;
+            }
+            j = intsetLowerBound(b,j,hi,value);
+        }
+        if (j < blen && _intsetGetEncoded(b,j,benc) == value) {
+            _intsetSet(is,len++,value);
+            j++;
+        }
+    }
+
+    /* Narrow the encoding in place when the elements found allow it: the
+     * smallest and largest elements are enough to tell. */
+    uint8_t curenc = intrev32ifbe(is->encoding), newenc = INTSET_ENC_INT16;
+    if (len) {
+        uint8_t firstenc = _intsetValueEncoding(_intsetGetEncoded(is,0,curenc));
+        uint8_t lastenc = _intsetValueEncoding(_intsetGetEncoded(is,len-1,curenc));
+        newenc = firstenc > lastenc ? firstenc : lastenc;
+    }
+    if (newenc < curenc) {
+        is->encoding = intrev32ifbe(newenc);
+        for (i = 0; i < len; i++)
+            _intsetSet(is,i,_intsetGetEncoded(is,i,curenc));
+    }
+    is->length = intrev32ifbe(len);
+    return intsetResize(is,len);
+}
+
 /* Return random member */
 /* 随机返回一个元素 */
 int64_t intsetRandom(intset *is) {
@@ -501,13 +691,13 @@ static long long usec(void) {
 }
 
 static intset *createSet(int bits, int size) {
-    uint64_t mask = (1<<bits)-1;
+    uint64_t mask = (1ULL<<bits)-1;
     uint64_t value;
     intset *is = intsetNew();
 
     for (int i = 0; i < size; i++) {
         if (bits > 32) {
-            value = (rand()*rand()) & mask;
+            value = ((uint64_t)rand()*rand()) & mask;
         } else {
             value = rand() & mask;
         }
@@ -666,6 +856,109 @@ int intsetTest(int argc, char **argv, int accurate) {
         zfree(is);
     }
 
+    printf("Lower bound kernels agree with a binary search: "); {
+        intsetLowerBoundKernel *kernel = intsetSelectKernel();
+        int bits[] = {12, 24, 48};
+
+        for (int b = 0; b < 3; b++) {
+            is = createSet(bits[b],2000);
+            uint32_t len = intsetLen(is);
+            int64_t min = _intsetGet(is,0), max = _intsetGet(is,len-1);
+
+            for (i = 0; i < 20000; i++) {
+                int64_t value = min+(int64_t)((uint64_t)rand()*rand()%(max-min+1));
+                uint32_t lo = rand()%len, hi = lo+rand()%(len-lo+1), p1, p2;
+
+                intsetKernel = NULL;
+                p1 = intsetLowerBound(is,lo,hi,value);
+                intsetKernel = kernel;
+                p2 = intsetLowerBound(is,lo,hi,value);
+                assert(p1 == p2);
+            }
+            zfree(is);
+        }
+        ok();
+    }
+
+    printf("Intersection: "); {
+        int bits[] = {12, 24, 48};
+
+        for (i = 0; i < 200; i++) {
+            intset *a = createSet(bits[rand()%3],rand()%1000);
+            intset *b = createSet(bits[rand()%3],rand()%1000);
+            intset *expected = intsetNew(), *inter;
+            int64_t value;
+
+            a = intsetAdd(a,5,NULL);
+            if (i % 2) b = intsetAdd(b,5,NULL);
+            for (uint32_t k = 0; intsetGet(a,k,&value); k++)
+                if (intsetFind(b,value)) expected = intsetAdd(expected,value,NULL);
+            inter = intsetIntersect(a,b);
+            assert(intsetBlobLen(inter) == intsetBlobLen(expected));
+            assert(!memcmp(inter,expected,intsetBlobLen(expected)));
+            zfree(a);
+            zfree(b);
+            zfree(expected);
+            zfree(inter);
+        }
+        ok();
+    }
+
+    printf("Benchmark lookups and intersections:\n"); {
+        intsetLowerBoundKernel *kernel = intsetSelectKernel();
+        int bits[] = {12, 24, 48};
+        long num = accurate ? 1000000 : 100000;
+
+        printf("  lower bound kernel: %s\n", kernel ?
+#ifdef HAVE_X86_SIMD
+            (kernel == intsetLowerBoundAVX2 ? "avx2" : "sse4.2")
+#else
+            "?"
+#endif
+            : "none");
+        for (int b = 0; b < 3; b++) {
+            long long scalar = 0, simd = 0, start;
+            intset *small, *large;
+
+            is = createSet(bits[b],10000);
+            for (int k = 0; k < 2; k++) {
+                intsetKernel = k ? kernel : NULL;
+                srand(b);
+                start = usec();
+                for (i = 0; i < num; i++) intsetFind(is,rand()&((1LL<<bits[b])-1));
+                if (k) simd = usec()-start; else scalar = usec()-start;
+            }
+            printf("  %d bits, %ld lookups: binary search %lldusec, "
+                   "kernel %lldusec\n", bits[b], num, scalar, simd);
+            zfree(is);
+
+            /* Intersection against probing every element of the
+             * smaller set, for sets of a similar size and not. */
+            large = createSet(bits[b],100000);
+            for (int size = 100; size <= 100000; size *= 1000) {
+                small = createSet(bits[b],size);
+                int64_t value;
+                uint32_t found = 0;
+
+                start = usec();
+                for (uint32_t k = 0; intsetGet(small,k,&value); k++)
+                    found += intsetFind(large,value);
+                scalar = usec()-start;
+                start = usec();
+                is = intsetIntersect(small,large);
+                simd = usec()-start;
+                assert(intsetLen(is) == found);
+                printf("  %d bits, %u x %u elements: probing %lldusec, "
+                       "intersection %lldusec\n", bits[b], intsetLen(small),
+                       intsetLen(large), scalar, simd);
+                zfree(small);
+                zfree(is);
+            }
+            zfree(large);
+        }
+        intsetKernel = kernel;
+    }
+
     printf("Stress add+delete: "); {
         int i, v1, v2;
         is = intsetNew();
@@ -366,8 +366,7 @@ sds createLatencyReport(void) {
             advices += 2;
         }
 
-        if (!strcasecmp(event,"aof-rewrite-diff-write") ||
-            !strcasecmp(event,"aof-rename")) {
+        if (!strcasecmp(event,"aof-rename")) {
             advise_write_load_info = 1;
             advise_data_writeback = 1;
             advise_ssd = 1;
@@ -21,10 +21,12 @@ void lazyfreeFreeObject(void *args[]) {
 void lazyfreeFreeDatabase(void *args[]) {
     dict *ht1 = (dict *) args[0];
     dict *ht2 = (dict *) args[1];
+    rax *expires_index = (rax *) args[2];
 
     size_t numkeys = dictSize(ht1);
     dictRelease(ht1);
     dictRelease(ht2);
+    if (expires_index) raxFree(expires_index);
     atomicDecr(lazyfree_objects,numkeys);
     atomicIncr(lazyfreed_objects,numkeys);
 }
@@ -92,9 +94,13 @@ size_t lazyfreeGetFreeEffort(robj *key, robj *obj) {
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
-    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
+    } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = obj->ptr;
+        return r->count;
+    } else if (obj->type == OBJ_ZSET && (obj->encoding == OBJ_ENCODING_SKIPLIST ||
+                                         obj->encoding == OBJ_ENCODING_BTREE)) {
         zset *zs = obj->ptr;
-        return zs->zsl->length;
+        return dictSize(zs->dict);
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
@@ -144,6 +150,7 @@ size_t lazyfreeGetFreeEffort(robj *key, robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
+    if (server.snapshot_in_progress) snapshotSaveKey(db,key);
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
@@ -154,6 +161,8 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     dictEntry *de = dictUnlink(db->dict,key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
+        long long when = dbEntryGetExpire(de);
+        if (when != -1) expiresIndexDel(db,dictGetKey(de),when);
 
         /* Tells the module that the key has been unlinked from the database. */
         moduleNotifyKeyUnlink(key,val);
@@ -202,10 +211,13 @@ void freeObjAsync(robj *key, robj *obj) {
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->dict, *oldht2 = db->expires;
+    rax *oldindex = db->expires_index;
+    unshareClientsReplyObjects();
     db->dict = dictCreate(&dbDictType,NULL);
     db->expires = dictCreate(&dbExpiresDictType,NULL);
+    if (oldindex) db->expires_index = raxNew();
     atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateLazyFreeJob(lazyfreeFreeDatabase,2,oldht1,oldht2);
+    bioCreateLazyFreeJob(lazyfreeFreeDatabase,3,oldht1,oldht2,oldindex);
 }
 
 /* Release the radix tree mapping Redis Cluster keys to slots asynchronously. */
@@ -285,6 +285,59 @@ unsigned char* lpShrinkToFit(unsigned char *lp) {
     }
 }
 
+/* Store the integer encoded representation of 'v' in the 'intenc' buffer,
+ * and the number of bytes it takes in 'enclen'. */
+static inline void lpEncodeIntegerGetType(int64_t v, unsigned char *intenc, uint64_t *enclen) {
+    if (v >= 0 && v <= 127) {
+        /* Single byte 0-127 integer. */
+        intenc[0] = v;
+        *enclen = 1;
+    } else if (v >= -4096 && v <= 4095) {
+        /* 13 bit integer. */
+        if (v < 0) v = ((int64_t)1<<13)+v;
+        intenc[0] = (v>>8)|LP_ENCODING_13BIT_INT;
+        intenc[1] = v&0xff;
+        *enclen = 2;
+    } else if (v >= -32768 && v <= 32767) {
+        /* 16 bit integer. */
+        if (v < 0) v = ((int64_t)1<<16)+v;
+        intenc[0] = LP_ENCODING_16BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = v>>8;
+        *enclen = 3;
+    } else if (v >= -8388608 && v <= 8388607) {
+        /* 24 bit integer. */
+        if (v < 0) v = ((int64_t)1<<24)+v;
+        intenc[0] = LP_ENCODING_24BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = (v>>8)&0xff;
+        intenc[3] = v>>16;
+        *enclen = 4;
+    } else if (v >= -2147483648 && v <= 2147483647) {
+        /* 32 bit integer. */
+        if (v < 0) v = ((int64_t)1<<32)+v;
+        intenc[0] = LP_ENCODING_32BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = (v>>8)&0xff;
+        intenc[3] = (v>>16)&0xff;
+        intenc[4] = v>>24;
+        *enclen = 5;
+    } else {
+        /* 64 bit integer. */
+        uint64_t uv = v;
+        intenc[0] = LP_ENCODING_64BIT_INT;
+        intenc[1] = uv&0xff;
+        intenc[2] = (uv>>8)&0xff;
+        intenc[3] = (uv>>16)&0xff;
+        intenc[4] = (uv>>24)&0xff;
+        intenc[5] = (uv>>32)&0xff;
+        intenc[6] = (uv>>40)&0xff;
+        intenc[7] = (uv>>48)&0xff;
+        intenc[8] = uv>>56;
+        *enclen = 9;
+    }
+}
+
 /* Given an element 'ele' of size 'size', determine if the element can be
  * represented inside the listpack encoded as integer, and returns
  * LP_ENCODING_INT if so. Otherwise returns LP_ENCODING_STR if no integer
@@ -307,54 +360,7 @@ unsigned char* lpShrinkToFit(unsigned char *lp) {
 int lpEncodeGetType(unsigned char *ele, uint32_t size, unsigned char *intenc, uint64_t *enclen) {
     int64_t v;
     if (lpStringToInt64((const char*)ele, size, &v)) {
-        if (v >= 0 && v <= 127) {
-            /* Single byte 0-127 integer. */
-            intenc[0] = v;
-            *enclen = 1;
-        } else if (v >= -4096 && v <= 4095) {
-            /* 13 bit integer. */
-            if (v < 0) v = ((int64_t)1<<13)+v;
-            intenc[0] = (v>>8)|LP_ENCODING_13BIT_INT;
-            intenc[1] = v&0xff;
-            *enclen = 2;
-        } else if (v >= -32768 && v <= 32767) {
-            /* 16 bit integer. */
-            if (v < 0) v = ((int64_t)1<<16)+v;
-            intenc[0] = LP_ENCODING_16BIT_INT;
-            intenc[1] = v&0xff;
-            intenc[2] = v>>8;
-            *enclen = 3;
-        } else if (v >= -8388608 && v <= 8388607) {
-            /* 24 bit integer. */
-            if (v < 0) v = ((int64_t)1<<24)+v;
-            intenc[0] = LP_ENCODING_24BIT_INT;
-            intenc[1] = v&0xff;
-            intenc[2] = (v>>8)&0xff;
-            intenc[3] = v>>16;
-            *enclen = 4;
-        } else if (v >= -2147483648 && v <= 2147483647) {
-            /* 32 bit integer. */
-            if (v < 0) v = ((int64_t)1<<32)+v;
-            intenc[0] = LP_ENCODING_32BIT_INT;
-            intenc[1] = v&0xff;
-            intenc[2] = (v>>8)&0xff;
-            intenc[3] = (v>>16)&0xff;
-            intenc[4] = v>>24;
-            *enclen = 5;
-        } else {
-            /* 64 bit integer. */
-            uint64_t uv = v;
-            intenc[0] = LP_ENCODING_64BIT_INT;
-            intenc[1] = uv&0xff;
-            intenc[2] = (uv>>8)&0xff;
-            intenc[3] = (uv>>16)&0xff;
-            intenc[4] = (uv>>24)&0xff;
-            intenc[5] = (uv>>32)&0xff;
-            intenc[6] = (uv>>40)&0xff;
-            intenc[7] = (uv>>48)&0xff;
-            intenc[8] = uv>>56;
-            *enclen = 9;
-        }
+        lpEncodeIntegerGetType(v, intenc, enclen);
         return LP_ENCODING_INT;
     } else {
         if (size < 64) *enclen = 1+size;
@@ -749,6 +755,23 @@ unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf) {
     }
 }
 
+/* This is just a wrapper to lpGet() with an interface similar to
+ * ziplistGet(): for string entries the string is returned and its length is
+ * stored in 'slen', for integer entries NULL is returned and the value is
+ * stored in 'lval', without any string conversion. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    unsigned char *vstr;
+    int64_t ele_len;
+
+    vstr = lpGet(p, &ele_len, NULL);
+    if (vstr) {
+        *slen = ele_len;
+    } else {
+        *lval = ele_len;
+    }
+    return vstr;
+}
+
 /* Insert, delete or replace the specified element 'ele' of length 'len' at
  * the specified position 'p', with 'p' being a listpack element pointer
  * obtained with lpFirst(), lpLast(), lpNext(), lpPrev() or lpSeek().
@@ -786,7 +809,7 @@ unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf) {
  * NULL —— OOM或listpack长度超过最大允许的大小2^32-1
  * 指向listpack新元素的指针 —— 其他情况
  */
-unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, unsigned char *p, int where, unsigned char **newp) {
+static unsigned char *lpInsertGeneric(unsigned char *lp, unsigned char *elestr, unsigned char *eleint, uint32_t size, unsigned char *p, int where, unsigned char **newp) {
     // 存储解码后的entry的encoding与content字段
     unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
     // 存储解码后的backlen字段
@@ -798,7 +821,8 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
      * replacing the element with a zero-length element. So whatever we
      * get passed as 'where', set it to LP_REPLACE. */
     // ele == NULL表示删除p位置的数据，因此where设置为LP_REPLACE
-    if (ele == NULL) where = LP_REPLACE;
+    int delete = (elestr == NULL && eleint == NULL);
+    if (delete) where = LP_REPLACE;
 
     /* If we need to insert after the current element, we just jump to the
      * next element (that could be the EOF one) and handle the case of
@@ -829,10 +853,15 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
      * length of the encoded element. */
     int enctype;
     // ele不为空
-    if (ele) {
+    if (elestr) {
         // 获取ele的实际的encoding（int或str），并将encoding长度写入enclen
         // 如果是int写入intenc
-        enctype = lpEncodeGetType(ele,size,intenc,&enclen);
+        enctype = lpEncodeGetType(elestr,size,intenc,&enclen);
+    } else if (eleint) {
+        /* The integer was already encoded by the caller. */
+        enctype = LP_ENCODING_INT;
+        enclen = size;
+        memcpy(intenc,eleint,size);
     // ele为空
     } else {
         enctype = -1;
@@ -843,7 +872,7 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
      * and append it to the end: this allows to traverse the listpack from
      * the end to the start. */
     // 通过enclen（encoding+content长度），获取backlen的长度
-    unsigned long backlen_size = ele ? lpEncodeBacklen(backlen,enclen) : 0;
+    unsigned long backlen_size = (!delete) ? lpEncodeBacklen(backlen,enclen) : 0;
     uint64_t old_listpack_bytes = lpGetTotalBytes(lp);
     uint32_t replaced_len  = 0;
     if (where == LP_REPLACE) {
@@ -905,16 +934,16 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
         *newp = dst;
         /* In case of deletion, set 'newp' to NULL if the next element is
          * the EOF element. */
-        if (!ele && dst[0] == LP_EOF) *newp = NULL;
+        if (delete && dst[0] == LP_EOF) *newp = NULL;
     }
 
     // ele不为空，即为插入或替换的情况
-    if (ele) {
+    if (!delete) {
         // 填入ele的encoding+content
         if (enctype == LP_ENCODING_INT) {
             memcpy(dst,intenc,enclen);
         } else {
-            lpEncodeString(dst,ele,size);
+            lpEncodeString(dst,elestr,size);
         }
         dst += enclen;
         // 填入ele的backlen
@@ -924,10 +953,10 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
 
     /* Update header. */
     // 更新header：元素数量（在插入或者删除元素时需要改）
-    if (where != LP_REPLACE || ele == NULL) {
+    if (where != LP_REPLACE || delete) {
         uint32_t num_elements = lpGetNumElements(lp);
         if (num_elements != LP_HDR_NUMELE_UNKNOWN) {
-            if (ele)
+            if (!delete)
                 lpSetNumElements(lp,num_elements+1);
             else
                 lpSetNumElements(lp,num_elements-1);
@@ -958,6 +987,22 @@ unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, un
     return lp;
 }
 
+/* Insert the string 'ele' of length 'size'. Strings that look like integers
+ * are stored with an integer encoding, exactly like ziplists do. */
+unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, unsigned char *p, int where, unsigned char **newp) {
+    return lpInsertGeneric(lp,ele,NULL,size,p,where,newp);
+}
+
+/* Like lpInsert(), but for an integer value, that is encoded directly
+ * without going through its string representation. */
+unsigned char *lpInsertInteger(unsigned char *lp, long long lval, unsigned char *p, int where, unsigned char **newp) {
+    uint64_t enclen; /* The length of the encoded element. */
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+
+    lpEncodeIntegerGetType(lval,intenc,&enclen);
+    return lpInsertGeneric(lp,NULL,intenc,enclen,p,where,newp);
+}
+
 /* Append the specified element 'ele' of length 'len' at the end of the
  * listpack. It is implemented in terms of lpInsert(), so the return value is
  * the same as lpInsert(). */
@@ -967,12 +1012,201 @@ unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
     return lpInsert(lp,ele,size,eofptr,LP_BEFORE,NULL);
 }
 
+/* Append the integer 'lval' at the end of the listpack. */
+unsigned char *lpAppendInteger(unsigned char *lp, long long lval) {
+    uint64_t listpack_bytes = lpGetTotalBytes(lp);
+    unsigned char *eofptr = lp + listpack_bytes - 1;
+    return lpInsertInteger(lp,lval,eofptr,LP_BEFORE,NULL);
+}
+
+/* Insert the specified element 'ele' of length 'len' at the head of the
+ * listpack. */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *p = lpFirst(lp);
+    if (!p) return lpAppend(lp,ele,size);
+    return lpInsert(lp,ele,size,p,LP_BEFORE,NULL);
+}
+
+/* Insert the integer 'lval' at the head of the listpack. */
+unsigned char *lpPrependInteger(unsigned char *lp, long long lval) {
+    unsigned char *p = lpFirst(lp);
+    if (!p) return lpAppendInteger(lp,lval);
+    return lpInsertInteger(lp,lval,p,LP_BEFORE,NULL);
+}
+
+/* Replace the element pointed by '*p' with 'ele' of length 'len'. On return
+ * '*p' points to the new element, so that an iteration can go on. */
+unsigned char *lpReplace(unsigned char *lp, unsigned char **p, unsigned char *ele, uint32_t size) {
+    return lpInsert(lp,ele,size,*p,LP_REPLACE,p);
+}
+
+/* Like lpReplace(), but for an integer value. */
+unsigned char *lpReplaceInteger(unsigned char *lp, unsigned char **p, long long lval) {
+    return lpInsertInteger(lp,lval,*p,LP_REPLACE,p);
+}
+
 /* Remove the element pointed by 'p', and return the resulting listpack.
  * If 'newp' is not NULL, the next element pointer (to the right of the
  * deleted one) is returned by reference. If the deleted element was the
  * last one, '*newp' is set to NULL. */
 unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp) {
-    return lpInsert(lp,NULL,0,p,LP_REPLACE,newp);
+    return lpInsertGeneric(lp,NULL,NULL,0,p,LP_REPLACE,newp);
+}
+
+/* Delete 'num' consecutive entries starting at the one pointed by '*p'.
+ * Everything past them is moved with a single memmove, so deleting a range
+ * costs the same as deleting one element. On return '*p' points to the
+ * element that followed the deleted range, or is NULL if there is none. */
+unsigned char *lpDeleteRangeWithEntry(unsigned char *lp, unsigned char **p, unsigned long num) {
+    size_t bytes = lpBytes(lp);
+    unsigned long deleted = 0;
+    unsigned char *eofptr = lp + bytes - 1;
+    unsigned char *first, *tail;
+    first = tail = *p;
+
+    if (num == 0) return lp; /* Nothing to delete, return ASAP. */
+
+    /* Find the entry that follows the last one to delete. The header count
+     * may not be reliable, so 'num' is only an upper bound. */
+    while (num--) {
+        deleted++;
+        tail = lpSkip(tail);
+        if (tail[0] == LP_EOF) break;
+        lpAssertValidEntry(lp, bytes, tail);
+    }
+
+    /* Store the offset of the element 'first', so that we can obtain its
+     * address again after a reallocation. */
+    unsigned long poff = first-lp;
+
+    /* Move the tail, EOF included, where the first deleted element was. */
+    memmove(first, tail, eofptr - tail + 1);
+    lpSetTotalBytes(lp, bytes - (tail - first));
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp, numele-deleted);
+    lp = lpShrinkToFit(lp);
+
+    *p = lp+poff;
+    if ((*p)[0] == LP_EOF) *p = NULL;
+    return lp;
+}
+
+/* Delete 'num' entries starting at 'index'. Negative indexes count from the
+ * tail like in lpSeek(). */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *p;
+    uint32_t numele = lpGetNumElements(lp);
+
+    if (num == 0) return lp; /* Nothing to delete, return ASAP. */
+    if ((p = lpSeek(lp, index)) == NULL) return lp;
+
+    /* When the range is known to reach the end of the listpack we can just
+     * move the EOF marker, without visiting the deleted entries at all. */
+    if (numele != LP_HDR_NUMELE_UNKNOWN && index < 0) index = (long)numele + index;
+    if (numele != LP_HDR_NUMELE_UNKNOWN && (numele - (unsigned long)index) <= num) {
+        p[0] = LP_EOF;
+        lpSetTotalBytes(lp, p - lp + 1);
+        lpSetNumElements(lp, index);
+        lp = lpShrinkToFit(lp);
+    } else {
+        lp = lpDeleteRangeWithEntry(lp, &p, num);
+    }
+    return lp;
+}
+
+/* Merge listpacks 'first' and 'second' by appending 'second' to 'first'.
+ *
+ * NOTE: The larger listpack is reallocated to contain the new merged listpack.
+ * Either 'first' or 'second' can be used for the result. The parameter not
+ * used will be free'd and set to NULL.
+ *
+ * After calling this function, the input parameters are no longer valid since
+ * they are changed and free'd in-place.
+ *
+ * The result listpack is the contents of 'first' followed by 'second'.
+ *
+ * On failure: returns NULL if the merge is impossible.
+ * On success: returns the merged listpack (which is expanded version of either
+ * 'first' or 'second', also frees the other unused input listpack, and sets the
+ * input listpack argument equal to newly reallocated listpack return value. */
+unsigned char *lpMerge(unsigned char **first, unsigned char **second) {
+    /* If any params are null, we can't merge, so NULL. */
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+
+    /* Can't merge same list into itself. */
+    if (*first == *second)
+        return NULL;
+
+    size_t first_bytes = lpBytes(*first);
+    unsigned long first_len = lpLength(*first);
+
+    size_t second_bytes = lpBytes(*second);
+    unsigned long second_len = lpLength(*second);
+
+    int append;
+    unsigned char *source, *target;
+    size_t target_bytes, source_bytes;
+    /* Pick the largest listpack so we can resize easily in-place.
+     * We must also track if we are now appending or prepending to
+     * the target listpack. */
+    if (first_bytes >= second_bytes) {
+        /* retain first, append second to first. */
+        target = *first;
+        target_bytes = first_bytes;
+        source = *second;
+        source_bytes = second_bytes;
+        append = 1;
+    } else {
+        /* else, retain second, prepend first to second. */
+        target = *second;
+        target_bytes = second_bytes;
+        source = *first;
+        source_bytes = first_bytes;
+        append = 0;
+    }
+
+    /* Calculate final bytes (subtract one pair of metadata) */
+    unsigned long long lpbytes = (unsigned long long)first_bytes + second_bytes - LP_HDR_SIZE - 1;
+    assert(lpbytes < UINT32_MAX); /* larger values can't be stored */
+    unsigned long lplength = first_len + second_len;
+
+    /* Lengths that don't fit the header are stored as unknown. */
+    lplength = lplength < LP_HDR_NUMELE_UNKNOWN ? lplength : LP_HDR_NUMELE_UNKNOWN;
+
+    /* Extend target to new lpbytes then append or prepend source. */
+    target = lp_realloc(target, lpbytes);
+    if (append) {
+        /* Copy source after target (copying over original [END]):
+         *   [TARGET - END, SOURCE - HEADER] */
+        memcpy(target + target_bytes - 1,
+               source + LP_HDR_SIZE,
+               source_bytes - LP_HDR_SIZE);
+    } else {
+        /* Move target *contents* exactly size of (source - [END]),
+         * then copy source into vacated space (source - [END]):
+         *   [SOURCE - END, TARGET - HEADER] */
+        memmove(target + source_bytes - 1,
+                target + LP_HDR_SIZE,
+                target_bytes - LP_HDR_SIZE);
+        memcpy(target, source, source_bytes - 1);
+    }
+
+    lpSetNumElements(target, lplength);
+    lpSetTotalBytes(target, lpbytes);
+
+    /* Now free and NULL out what we didn't realloc */
+    if (append) {
+        lp_free(*second);
+        *second = NULL;
+        *first = target;
+    } else {
+        lp_free(*first);
+        *first = NULL;
+        *second = target;
+    }
+    return target;
 }
 
 /* Return the total number of bytes the listpack is composed of. */
@@ -1031,6 +1265,261 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+/* Find pointer to the entry equal to the specified entry. Skip 'skip' entries
+ * between every comparison, so that field-value pairs can be searched by
+ * field only. Returns NULL when the field could not be found.
+ *
+ * The string is converted to an integer at most once, since integers are
+ * always stored with an integer encoding and can be compared as numbers. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s,
+                      uint32_t slen, unsigned int skip)
+{
+    int skipcnt = 0;
+    int vencoding = 0; /* 0: not converted yet, 1: integer, -1: string. */
+    int64_t vll = 0;
+
+    while (p) {
+        if (skipcnt == 0) {
+            int64_t count;
+            unsigned char *value = lpGet(p, &count, NULL);
+
+            if (value) {
+                /* String entry: compare the bytes. */
+                if (count == slen && memcmp(value, s, slen) == 0) return p;
+            } else {
+                /* Integer entry: compare against the string as a number,
+                 * if it can be converted at all. */
+                if (vencoding == 0)
+                    vencoding = lpStringToInt64((const char*)s, slen, &vll) ?
+                                1 : -1;
+                if (vencoding == 1 && count == vll) return p;
+            }
+
+            /* Reset skip count */
+            skipcnt = skip;
+        } else {
+            /* Skip entry */
+            skipcnt--;
+        }
+
+        /* Move to next entry */
+        p = lpNext(lp, p);
+    }
+    return NULL;
+}
+
+/* Return 1 if the entry pointed by 'p' is equal to the string 's' of length
+ * 'slen', 0 otherwise. */
+unsigned int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char *value;
+    int64_t sz;
+
+    if (p[0] == LP_EOF) return 0;
+
+    value = lpGet(p, &sz, NULL);
+    if (value) {
+        return (slen == sz) && memcmp(value,s,slen) == 0;
+    } else {
+        /* An integer entry can only match a string that converts to the
+         * same integer. */
+        int64_t sval;
+        if (lpStringToInt64((const char*)s, slen, &sval))
+            return sz == sval;
+    }
+    return 0;
+}
+
+/* Don't let listpacks grow over 1GB in any case, don't wanna risk overflow in
+ * the total bytes header field. */
+#define LISTPACK_MAX_SAFETY_SIZE (1<<30)
+int lpSafeToAdd(unsigned char* lp, size_t add) {
+    size_t len = lp? lpGetTotalBytes(lp): 0;
+    if (len + add > LISTPACK_MAX_SAFETY_SIZE)
+        return 0;
+    return 1;
+}
+
+/* Store the value of the entry pointed by 'p' in 'dest'. */
+static inline void lpSaveValue(unsigned char *p, listpackEntry *dest) {
+    int64_t vll;
+    dest->sval = lpGet(p, &vll, NULL);
+    if (dest->sval) {
+        dest->slen = vll;
+    } else {
+        dest->lval = vll;
+    }
+}
+
+/* Randomly select a pair of key and value.
+ * total_count is a pre-computed length/2 of the listpack (to avoid calls to lpLength)
+ * 'key' and 'val' are used to store the result key value pair.
+ * 'val' can be NULL if the value is not needed. */
+void lpRandomPair(unsigned char *lp, unsigned long total_count, listpackEntry *key, listpackEntry *val) {
+    unsigned char *p;
+
+    /* Avoid div by zero on corrupt listpack */
+    assert(total_count);
+
+    /* Generate even numbers, because listpack saved K-V pair */
+    int r = (rand() % total_count) * 2;
+    assert((p = lpSeek(lp, r)));
+    lpSaveValue(p, key);
+
+    if (!val)
+        return;
+    assert((p = lpNext(lp, p)));
+    lpSaveValue(p, val);
+}
+
+/* int compare for qsort */
+static int uintCompare(const void *a, const void *b) {
+    return (*(unsigned int *) a - *(unsigned int *) b);
+}
+
+/* Randomly select count of key value pairs and store into 'keys' and
+ * 'vals' args. The order of the picked entries is random, and the selections
+ * are non-unique (repetitions are possible).
+ * The 'vals' arg can be NULL in which case we skip these. */
+void lpRandomPairs(unsigned char *lp, unsigned int count, listpackEntry *keys, listpackEntry *vals) {
+    unsigned char *p, *key, *value;
+    unsigned int klen = 0, vlen = 0;
+    long long klval = 0, vlval = 0;
+
+    /* Notice: the index member must be first due to the use in uintCompare */
+    typedef struct {
+        unsigned int index;
+        unsigned int order;
+    } rand_pick;
+    rand_pick *picks = lp_malloc(sizeof(rand_pick)*count);
+    unsigned int total_size = lpLength(lp)/2;
+
+    /* Avoid div by zero on corrupt listpack */
+    assert(total_size);
+
+    /* create a pool of random indexes (some may be duplicate). */
+    for (unsigned int i = 0; i < count; i++) {
+        picks[i].index = (rand() % total_size) * 2; /* Generate even indexes */
+        /* keep track of the order we picked them */
+        picks[i].order = i;
+    }
+
+    /* sort by indexes. */
+    qsort(picks, count, sizeof(rand_pick), uintCompare);
+
+    /* fetch the elements form the listpack into a output array respecting the original order. */
+    unsigned int lpindex = 0, pickindex = 0;
+    p = lpFirst(lp);
+    while (p && pickindex < count) {
+        key = lpGetValue(p, &klen, &klval);
+        assert((p = lpNext(lp, p)));
+        value = lpGetValue(p, &vlen, &vlval);
+        while (pickindex < count && lpindex == picks[pickindex].index) {
+            int storeorder = picks[pickindex].order;
+            keys[storeorder].sval = key;
+            keys[storeorder].slen = klen;
+            keys[storeorder].lval = klval;
+            if (vals) {
+                vals[storeorder].sval = value;
+                vals[storeorder].slen = vlen;
+                vals[storeorder].lval = vlval;
+            }
+            pickindex++;
+        }
+        lpindex += 2;
+        p = lpNext(lp, p);
+    }
+
+    lp_free(picks);
+}
+
+/* Randomly select count of key value pairs and store into 'keys' and
+ * 'vals' args. The selections are unique (no repetitions), and the order of
+ * the picked entries is NOT-random.
+ * The 'vals' arg can be NULL in which case we skip these.
+ * The return value is the number of items picked which can be lower than the
+ * requested count if the listpack doesn't hold enough pairs. */
+unsigned int lpRandomPairsUnique(unsigned char *lp, unsigned int count, listpackEntry *keys, listpackEntry *vals) {
+    unsigned char *p;
+    unsigned int total_size = lpLength(lp)/2;
+    unsigned int index = 0;
+    if (count > total_size)
+        count = total_size;
+
+    /* To only iterate once, every time we try to pick a member, the probability
+     * we pick it is the quotient of the count left we want to pick and the
+     * count still we haven't visited in the dict, this way, we could make every
+     * member be equally picked.*/
+    p = lpFirst(lp);
+    unsigned int picked = 0, remaining = count;
+    while (picked < count && p) {
+        double randomDouble = ((double)rand()) / RAND_MAX;
+        double threshold = ((double)remaining) / (total_size - index);
+        if (randomDouble <= threshold) {
+            lpSaveValue(p, &keys[picked]);
+            assert((p = lpNext(lp, p)));
+            if (vals) lpSaveValue(p, &vals[picked]);
+            remaining--;
+            picked++;
+        } else {
+            assert((p = lpNext(lp, p)));
+        }
+        p = lpNext(lp, p);
+        index++;
+    }
+    return picked;
+}
+
+/* Print info of listpack which is used in debugCommand. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    int64_t vlen;
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int index = 0;
+
+    printf("{total bytes %u} {num entries %u}\n", lpBytes(lp), lpLength(lp));
+
+    p = lpFirst(lp);
+    while(p) {
+        uint32_t encoded_size_bytes = lpCurrentEncodedSizeBytes(p);
+        uint32_t encoded_size = lpCurrentEncodedSizeUnsafe(p);
+        unsigned long back_len = lpEncodeBacklen(NULL, encoded_size);
+        printf(
+            "{\n"
+                "\taddr: 0x%08lx,\n"
+                "\tindex: %2d,\n"
+                "\toffset: %1lu,\n"
+                "\thdr+entrylen+backlen: %2lu,\n"
+                "\thdrlen: %3u,\n"
+                "\tbacklen: %2lu,\n"
+                "\tpayload: %1u\n",
+            (long unsigned)p,
+            index,
+            (unsigned long) (p-lp),
+            encoded_size + back_len,
+            encoded_size_bytes,
+            back_len,
+            encoded_size - encoded_size_bytes);
+        printf("\tbytes: ");
+        for (unsigned int i = 0; i < (encoded_size + back_len); i++) {
+            printf("%02x|",p[i]);
+        }
+        printf("\n");
+
+        vstr = lpGet(p, &vlen, intbuf);
+        printf("\t[str]");
+        if (vlen > 40) {
+            if (fwrite(vstr, 40, 1, stdout) == 0) perror("fwrite");
+            printf("...");
+        } else {
+            if (fwrite(vstr, vlen, 1, stdout) == 0) perror("fwrite");
+        }
+        printf("\n}\n");
+        index++;
+        p = lpNext(lp, p);
+    }
+    printf("{end}\n\n");
+}
+
 /* Same as lpFirst but without validation assert, to be used right before lpValidateNext. */
 unsigned char *lpValidateFirst(unsigned char *lp) {
     unsigned char *p = lp + LP_HDR_SIZE; /* Skip the header. */
@@ -1116,8 +1605,10 @@ static inline void lpAssertValidEntry(unsigned char* lp, size_t lpbytes, unsigne
 
 /* Validate the integrity of the data structure.
  * when `deep` is 0, only the integrity of the header is validated.
- * when `deep` is 1, we scan all the entries one by one. */
-int lpValidateIntegrity(unsigned char *lp, size_t size, int deep){
+ * when `deep` is 1, we scan all the entries one by one, calling the optional
+ * 'entry_cb' for each of them, that fails the validation by returning 0. */
+int lpValidateIntegrity(unsigned char *lp, size_t size, int deep,
+                        listpackValidateEntryCB entry_cb, void *cb_userdata) {
     /* Check that we can actually read the header. (and EOF) */
     if (size < LP_HDR_SIZE + 1)
         return 0;
@@ -1138,8 +1629,14 @@ int lpValidateIntegrity(unsigned char *lp, size_t size, int deep){
     uint32_t count = 0;
     unsigned char *p = lp + LP_HDR_SIZE;
     while(p && p[0] != LP_EOF) {
+        unsigned char *prev = p;
+
         if (!lpValidateNext(lp, &p, bytes))
             return 0;
+
+        /* Optionally let the caller validate the entry too. */
+        if (entry_cb && !entry_cb(prev, cb_userdata))
+            return 0;
         count++;
     }
 
@@ -1150,3 +1647,192 @@ int lpValidateIntegrity(unsigned char *lp, size_t size, int deep){
 
     return 1;
 }
+
+#ifdef REDIS_TEST
+#include <time.h>
+#include "zmalloc.h"
+
+#define UNUSED(x) (void)(x)
+#define LP_TEST_MAX 512
+
+/* The test keeps a copy of the listpack content as an array of strings, and
+ * checks after every operation that the listpack still matches it. */
+typedef struct {
+    char ele[LP_TEST_MAX][32];
+    int len;
+} lpTestModel;
+
+static void lpTestVerify(unsigned char *lp, lpTestModel *m) {
+    unsigned char buf[LP_INTBUF_SIZE], *p, *s;
+    int64_t slen;
+    int i = 0;
+
+    assert(lpValidateIntegrity(lp, lpBytes(lp), 1, NULL, NULL));
+    assert(lpLength(lp) == (uint32_t)m->len);
+    for (p = lpFirst(lp); p; p = lpNext(lp, p), i++) {
+        s = lpGet(p, &slen, buf);
+        assert(slen == (int64_t)strlen(m->ele[i]));
+        assert(memcmp(s, m->ele[i], slen) == 0);
+        assert(lpCompare(p, (unsigned char*)m->ele[i], slen));
+        assert(lpSeek(lp, i) == p && lpSeek(lp, i - m->len) == p);
+    }
+    assert(i == m->len);
+}
+
+/* Fill 'buf' with either a string or an integer element, and return 1 if
+ * the element is an integer, stored in '*lval'. */
+static int lpTestRandomElement(char *buf, long long *lval) {
+    if (rand() % 2) {
+        *lval = (rand() % 3) ? rand() % 1000 - 500 :
+                               ((long long)rand() << 32) ^ rand();
+        snprintf(buf, 32, "%lld", *lval);
+        return 1;
+    }
+    int len = rand() % 30;
+    for (int i = 0; i < len; i++) buf[i] = 'a' + rand() % 26;
+    buf[len] = '\0';
+    return 0;
+}
+
+static void lpTestModelInsert(lpTestModel *m, int idx, char *ele) {
+    memmove(m->ele[idx+1], m->ele[idx], sizeof(m->ele[0]) * (m->len - idx));
+    memcpy(m->ele[idx], ele, 32);
+    m->len++;
+}
+
+static void lpTestModelDelete(lpTestModel *m, int idx, int num) {
+    if (idx + num > m->len) num = m->len - idx;
+    memmove(m->ele[idx], m->ele[idx+num], sizeof(m->ele[0]) * (m->len - idx - num));
+    m->len -= num;
+}
+
+int listpackTest(int argc, char *argv[], int accurate) {
+    int iterations = accurate ? 200000 : 20000;
+    lpTestModel *m = zmalloc(sizeof(*m));
+    unsigned char *lp = lpNew(0), *p;
+    char ele[32];
+    long long lval;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(time(NULL));
+    m->len = 0;
+
+    printf("Random insert, replace and delete operations: "); {
+        for (int i = 0; i < iterations; i++) {
+            int op = rand() % 6, isint = lpTestRandomElement(ele, &lval);
+            int idx = m->len ? rand() % m->len : 0;
+
+            if (m->len >= LP_TEST_MAX - 1) op = 4;
+            switch(op) {
+            case 0: /* Append or prepend. */
+                if (rand() % 2) {
+                    lp = isint ? lpAppendInteger(lp, lval) :
+                                 lpAppend(lp, (unsigned char*)ele, strlen(ele));
+                    lpTestModelInsert(m, m->len, ele);
+                } else {
+                    lp = isint ? lpPrependInteger(lp, lval) :
+                                 lpPrepend(lp, (unsigned char*)ele, strlen(ele));
+                    lpTestModelInsert(m, 0, ele);
+                }
+                break;
+            case 1: /* Insert before or after an element. */
+                if (m->len == 0) break;
+                int after = rand() % 2;
+                unsigned char *newp;
+                p = lpSeek(lp, idx);
+                lp = isint ? lpInsertInteger(lp, lval, p, after, &newp) :
+                             lpInsert(lp, (unsigned char*)ele, strlen(ele), p, after, &newp);
+                lpTestModelInsert(m, idx + after, ele);
+                assert(newp == lpSeek(lp, idx + after));
+                break;
+            case 2: /* Replace. */
+                if (m->len == 0) break;
+                p = lpSeek(lp, idx);
+                lp = isint ? lpReplaceInteger(lp, &p, lval) :
+                             lpReplace(lp, &p, (unsigned char*)ele, strlen(ele));
+                memcpy(m->ele[idx], ele, 32);
+                assert(p == lpSeek(lp, idx));
+                break;
+            case 3: /* Delete a single element. */
+                if (m->len == 0) break;
+                p = lpSeek(lp, idx);
+                lp = lpDelete(lp, p, &p);
+                lpTestModelDelete(m, idx, 1);
+                assert(p == lpSeek(lp, idx));
+                break;
+            case 4: /* Delete a range by index. */
+                if (m->len == 0) break;
+                int num = rand() % 10;
+                if (rand() % 2) {
+                    lp = lpDeleteRange(lp, idx, num);
+                } else {
+                    lp = lpDeleteRange(lp, idx - m->len, num);
+                }
+                lpTestModelDelete(m, idx, num);
+                break;
+            case 5: /* Delete a range from an element. */
+                if (m->len == 0) break;
+                num = rand() % 10 + 1;
+                p = lpSeek(lp, idx);
+                lp = lpDeleteRangeWithEntry(lp, &p, num);
+                lpTestModelDelete(m, idx, num);
+                assert(p == lpSeek(lp, idx));
+                break;
+            }
+            lpTestVerify(lp, m);
+        }
+        lpFree(lp);
+        printf("OK\n");
+    }
+
+    printf("Merge listpacks: "); {
+        for (int i = 0; i < 1000; i++) {
+            unsigned char *first = lpNew(0), *second = lpNew(0), *merged;
+            int len1 = rand() % 100, len2 = rand() % 100;
+
+            m->len = 0;
+            for (int j = 0; j < len1 + len2; j++) {
+                unsigned char **target = j < len1 ? &first : &second;
+                if (lpTestRandomElement(ele, &lval))
+                    *target = lpAppendInteger(*target, lval);
+                else
+                    *target = lpAppend(*target, (unsigned char*)ele, strlen(ele));
+                lpTestModelInsert(m, m->len, ele);
+            }
+            merged = lpMerge(&first, &second);
+            assert(merged != NULL && (first == NULL) != (second == NULL));
+            assert(merged == (first ? first : second));
+            lpTestVerify(merged, m);
+            lpFree(merged);
+        }
+        printf("OK\n");
+    }
+
+    printf("Random pairs: "); {
+        listpackEntry keys[100], vals[64];
+        lp = lpNew(0);
+        for (int i = 0; i < 100; i++) {
+            lp = lpAppendInteger(lp, i);
+            lp = lpAppendInteger(lp, i * 2);
+        }
+        for (int i = 0; i < 1000; i++) {
+            lpRandomPair(lp, 100, keys, vals);
+            assert(keys[0].sval == NULL && vals[0].lval == keys[0].lval * 2);
+            lpRandomPairs(lp, 64, keys, vals);
+            for (int j = 0; j < 64; j++)
+                assert(vals[j].lval == keys[j].lval * 2);
+            unsigned int count = lpRandomPairsUnique(lp, 64, keys, vals);
+            assert(count == 64);
+            for (unsigned int j = 1; j < count; j++)
+                assert(keys[j].lval > keys[j-1].lval);
+        }
+        assert(lpRandomPairsUnique(lp, 200, keys, NULL) == 100);
+        lpFree(lp);
+        printf("OK\n");
+    }
+
+    zfree(m);
+    return 0;
+}
+#endif
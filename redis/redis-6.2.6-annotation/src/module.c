@@ -213,6 +213,8 @@ struct RedisModuleKey {
             uint32_t start;        /* Start pos for positional ranges. */
             uint32_t end;          /* End pos for positional ranges. */
             void *current;         /* Zset iterator current node. */
+            zbtreeIter btit;       /* Current entry of btree encoded zsets,
+                                      'current' points to it when valid. */
             int er;                /* Zset iterator end reached flag
                                        (true if end was reached). */
         } zset;
@@ -544,11 +546,11 @@ int moduleCreateEmptyKey(RedisModuleKey *key, int type) {
     switch(type) {
     case REDISMODULE_KEYTYPE_LIST:
         obj = createQuicklistObject();
-        quicklistSetOptions(obj->ptr, server.list_max_ziplist_size,
+        quicklistSetOptions(obj->ptr, server.list_max_listpack_size,
                             server.list_compress_depth);
         break;
     case REDISMODULE_KEYTYPE_ZSET:
-        obj = createZsetZiplistObject();
+        obj = createZsetListpackObject();
         break;
     case REDISMODULE_KEYTYPE_HASH:
         obj = createHashObject();
@@ -1417,6 +1419,9 @@ RedisModuleString *moduleAssertUnsharedString(RedisModuleString *str) {
          * used in order to store the embedded string in the object. */
         str->ptr = sdsnewlen(str->ptr,sdslen(str->ptr));
         str->encoding = OBJ_ENCODING_RAW;
+    } else if (str->encoding == OBJ_ENCODING_VIEW) {
+        /* Arguments sharing the client query buffer. */
+        unshareViewStringObject(str);
     } else if (str->encoding == OBJ_ENCODING_INT) {
         /* Convert the string from integer to raw encoding. */
         str->ptr = sdsfromlonglong((long)str->ptr);
@@ -1656,7 +1661,12 @@ int RM_ReplyWithCString(RedisModuleCtx *ctx, const char *buf) {
 int RM_ReplyWithString(RedisModuleCtx *ctx, RedisModuleString *str) {
     client *c = moduleGetReplyClient(ctx);
     if (c == NULL) return REDISMODULE_OK;
-    addReplyBulk(c,str);
+    /* Modules may modify their strings in place after replying with them
+     * (see RM_StringAppendBuffer()), so the reply can't reference them. */
+    if (sdsEncodedObject(str))
+        addReplyBulkCBuffer(c,str->ptr,sdslen(str->ptr));
+    else
+        addReplyBulk(c,str);
     return REDISMODULE_OK;
 }
 
@@ -2785,7 +2795,7 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
     zrs->minex = minex;
     zrs->maxex = maxex;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->u.zset.current = first ? zzlFirstInRange(key->value->ptr,zrs) :
                                       zzlLastInRange(key->value->ptr,zrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -2793,6 +2803,12 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
         zskiplist *zsl = zs->zsl;
         key->u.zset.current = first ? zslFirstInRange(zsl,zrs) :
                                       zslLastInRange(zsl,zrs);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = key->value->ptr;
+        zbtreeIter *it = &key->u.zset.btit;
+        int valid = first ? zbtFirstInRange(zs->zbt,zrs,it) :
+                            zbtLastInRange(zs->zbt,zrs,it);
+        key->u.zset.current = valid ? it : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2849,7 +2865,7 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
      * otherwise we don't want the zlexrangespec to be freed. */
     key->u.zset.type = REDISMODULE_ZSET_RANGE_LEX;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->u.zset.current = first ? zzlFirstInLexRange(key->value->ptr,zlrs) :
                                       zzlLastInLexRange(key->value->ptr,zlrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -2857,6 +2873,12 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
         zskiplist *zsl = zs->zsl;
         key->u.zset.current = first ? zslFirstInLexRange(zsl,zlrs) :
                                       zslLastInLexRange(zsl,zlrs);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = key->value->ptr;
+        zbtreeIter *it = &key->u.zset.btit;
+        int valid = first ? zbtFirstInLexRange(zs->zbt,zlrs,it) :
+                            zbtLastInLexRange(zs->zbt,zlrs,it);
+        key->u.zset.current = valid ? it : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2895,12 +2917,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
 
     if (!key->value || key->value->type != OBJ_ZSET) return NULL;
     if (key->u.zset.current == NULL) return NULL;
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr, *sptr;
         eptr = key->u.zset.current;
-        sds ele = ziplistGetObject(eptr);
+        sds ele = lpGetObject(eptr);
         if (score) {
-            sptr = ziplistNext(key->value->ptr,eptr);
+            sptr = lpNext(key->value->ptr,eptr);
             *score = zzlGetScore(sptr);
         }
         str = createObject(OBJ_STRING,ele);
@@ -2908,6 +2930,11 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
         zskiplistNode *ln = key->u.zset.current;
         if (score) *score = ln->score;
         str = createStringObject(ln->ele,sdslen(ln->ele));
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtreeIter *it = key->u.zset.current;
+        sds ele = zbtIterEle(it);
+        if (score) *score = zbtIterScore(it);
+        str = createStringObject(ele,sdslen(ele));
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2922,12 +2949,12 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
     if (!key->value || key->value->type != OBJ_ZSET) return 0;
     if (!key->u.zset.type || !key->u.zset.current) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->u.zset.current;
         unsigned char *next;
-        next = ziplistNext(zl,eptr); /* Skip element. */
-        if (next) next = ziplistNext(zl,next); /* Skip score. */
+        next = lpNext(zl,eptr); /* Skip element. */
+        if (next) next = lpNext(zl,next); /* Skip score. */
         if (next == NULL) {
             key->u.zset.er = 1;
             return 0;
@@ -2937,7 +2964,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 /* Fetch the next element score for the
                  * range check. */
                 unsigned char *saved_next = next;
-                next = ziplistNext(zl,next); /* Skip next element. */
+                next = lpNext(zl,next); /* Skip next element. */
                 double score = zzlGetScore(next); /* Obtain the next score. */
                 if (!zslValueLteMax(score,&key->u.zset.rs)) {
                     key->u.zset.er = 1;
@@ -2974,6 +3001,29 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
             key->u.zset.current = next;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        /* Move a copy, so that the iterator stays on the last element in
+         * range when the next one is not. */
+        zbtreeIter next = key->u.zset.btit;
+        if (!zbtNext(&next)) {
+            key->u.zset.er = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->u.zset.type == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueLteMax(zbtIterScore(&next),&key->u.zset.rs))
+            {
+                key->u.zset.er = 1;
+                return 0;
+            } else if (key->u.zset.type == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zslLexValueLteMax(zbtIterEle(&next),&key->u.zset.lrs)) {
+                    key->u.zset.er = 1;
+                    return 0;
+                }
+            }
+            key->u.zset.btit = next;
+            return 1;
+        }
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2986,12 +3036,12 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
     if (!key->value || key->value->type != OBJ_ZSET) return 0;
     if (!key->u.zset.type || !key->u.zset.current) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->u.zset.current;
         unsigned char *prev;
-        prev = ziplistPrev(zl,eptr); /* Go back to previous score. */
-        if (prev) prev = ziplistPrev(zl,prev); /* Back to previous ele. */
+        prev = lpPrev(zl,eptr); /* Go back to previous score. */
+        if (prev) prev = lpPrev(zl,prev); /* Back to previous ele. */
         if (prev == NULL) {
             key->u.zset.er = 1;
             return 0;
@@ -3001,7 +3051,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 /* Fetch the previous element score for the
                  * range check. */
                 unsigned char *saved_prev = prev;
-                prev = ziplistNext(zl,prev); /* Skip element to get the score.*/
+                prev = lpNext(zl,prev); /* Skip element to get the score.*/
                 double score = zzlGetScore(prev); /* Obtain the prev score. */
                 if (!zslValueGteMin(score,&key->u.zset.rs)) {
                     key->u.zset.er = 1;
@@ -3038,6 +3088,27 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
             key->u.zset.current = prev;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtreeIter prev = key->u.zset.btit;
+        if (!zbtPrev(&prev)) {
+            key->u.zset.er = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->u.zset.type == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueGteMin(zbtIterScore(&prev),&key->u.zset.rs))
+            {
+                key->u.zset.er = 1;
+                return 0;
+            } else if (key->u.zset.type == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zslLexValueGteMin(zbtIterEle(&prev),&key->u.zset.lrs)) {
+                    key->u.zset.er = 1;
+                    return 0;
+                }
+            }
+            key->u.zset.btit = prev;
+            return 1;
+        }
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -7450,6 +7521,11 @@ int RM_UnregisterCommandFilter(RedisModuleCtx *ctx, RedisModuleCommandFilter *fi
     return REDISMODULE_OK;
 }
 
+/* Return non-zero if at least one command filter is registered. */
+int moduleHasCommandFilters(void) {
+    return listLength(moduleCommandFilters) != 0;
+}
+
 void moduleCallCommandFilters(client *c) {
     if (listLength(moduleCommandFilters) == 0) return;
 
@@ -7584,7 +7660,7 @@ typedef struct {
 } ScanCBData;
 
 typedef struct RedisModuleScanCursor{
-    int cursor;
+    uint64_t cursor;
     int done;
 }RedisModuleScanCursor;
 
@@ -7714,8 +7790,7 @@ static void moduleScanKeyCallback(void *privdata, const dictEntry *de) {
         sds val = dictGetVal(de);
         value = createStringObject(val, sdslen(val));
     } else if (o->type == OBJ_ZSET) {
-        double *val = (double*)dictGetVal(de);
-        value = createStringObjectFromLongDouble(*val, 0);
+        value = createStringObjectFromLongDouble(dictGetDoubleVal(de), 0);
     }
 
     data->fn(data->key, field, value, data->user_data);
@@ -7779,13 +7854,17 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
     dict *ht = NULL;
     robj *o = key->value;
     if (o->type == OBJ_SET) {
-        if (o->encoding == OBJ_ENCODING_HT)
+        if (o->encoding == OBJ_ENCODING_HT) {
             ht = o->ptr;
+            /* Converted from a roaring bitmap during the scan. */
+            if (cursor->cursor & SCAN_ROARING_CURSOR) cursor->cursor = 0;
+        }
     } else if (o->type == OBJ_HASH) {
         if (o->encoding == OBJ_ENCODING_HT)
             ht = o->ptr;
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+            o->encoding == OBJ_ENCODING_BTREE)
             ht = ((zset *)o->ptr)->dict;
     } else {
         errno = EINVAL;
@@ -7814,23 +7893,66 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
         cursor->cursor = 1;
         cursor->done = 1;
         ret = 0;
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *p = lpFirst(o->ptr);
+        unsigned char *str;
+        int64_t len;
+        while(p) {
+            str = lpGet(p,&len,NULL);
+            robj *field = (str != NULL) ?
+                createStringObject((char*)str,len) :
+                createObject(OBJ_STRING,sdsfromlonglong(len));
+            p = lpNext(o->ptr,p);
+            fn(key, field, NULL, privdata);
+            decrRefCount(field);
+        }
+        cursor->cursor = 1;
+        cursor->done = 1;
+        ret = 0;
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Like SSCAN, see roaringScanCursor(). Elements are fetched before
+         * calling the callback, that may delete them. */
+        int64_t batch[16], next;
+        int count = 0, j;
+        roaringIter ri;
+
+        if (cursor->cursor & SCAN_ROARING_CURSOR)
+            roaringIterSeek(o->ptr,&ri,roaringScanStart(cursor->cursor));
+        else
+            roaringIterInit(o->ptr,&ri);
+        while(count < 16 && roaringNext(&ri,&batch[count])) count++;
+        if (count == 16 && roaringNext(&ri,&next)) {
+            /* Leave the last element to the next call if it would be
+             * returned again by it, see roaringScanCursor(). */
+            if ((next & 1) && batch[15] == next-1) next = batch[--count];
+            cursor->cursor = roaringScanCursor(next);
+        } else {
+            cursor->cursor = 1;
+            cursor->done = 1;
+            ret = 0;
+        }
+        for (j = 0; j < count; j++) {
+            robj *field = createObject(OBJ_STRING,sdsfromlonglong(batch[j]));
+            fn(key, field, NULL, privdata);
+            decrRefCount(field);
+        }
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpSeek(o->ptr,0);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             robj *field = (vstr != NULL) ?
                 createStringObject((char*)vstr,vlen) :
                 createObject(OBJ_STRING,sdsfromlonglong(vll));
-            p = ziplistNext(o->ptr,p);
-            ziplistGet(p,&vstr,&vlen,&vll);
+            p = lpNext(o->ptr,p);
+            vstr = lpGetValue(p,&vlen,&vll);
             robj *value = (vstr != NULL) ?
                 createStringObject((char*)vstr,vlen) :
                 createObject(OBJ_STRING,sdsfromlonglong(vll));
             fn(key, field, value, privdata);
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
             decrRefCount(field);
             decrRefCount(value);
         }
@@ -35,9 +35,25 @@
 #include <math.h>
 #include <ctype.h>
 
+#ifdef HAVE_FUTEX
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 static void setProtocolError(const char *errstr, client *c);
 int postponeClientRead(client *c);
+void trimReplyUnusedTailSpace(client *c);
 int ProcessingEventsWhileBlocked = 0; /* See processEventsWhileBlocked(). */
+static int io_threads_do_commands = 0; /* See processCommandInIOThread(). */
+/* Objects referenced by the reply blocks sent by the calling IO thread, that
+ * can't release them, see releaseSentReplyBlock(). */
+static __thread list *io_thread_released_objs = NULL;
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -65,6 +81,7 @@ size_t getStringObjectLen(robj *o) {
     switch(o->encoding) {
     case OBJ_ENCODING_RAW: return sdslen(o->ptr);
     case OBJ_ENCODING_EMBSTR: return sdslen(o->ptr);
+    case OBJ_ENCODING_VIEW: return sdslen(o->ptr);
     default: return 0; /* Just integer encoding for now. */
     }
 }
@@ -72,15 +89,25 @@ size_t getStringObjectLen(robj *o) {
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
-    memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    size_t bufsize = old->obj ? 0 : old->size;
+    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + bufsize);
+    memcpy(buf, o, sizeof(clientReplyBlock) + bufsize);
+    if (buf->obj) incrRefCount(buf->obj);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    clientReplyBlock *block = o;
+    /* Note that 'o' is NULL for the placeholders of addReplyDeferredLen(). */
+    if (block && block->obj) decrRefCount(block->obj);
     zfree(o);
 }
 
+/* Return the payload of a reply block. */
+static inline char *clientReplyBlockData(clientReplyBlock *o) {
+    return o->obj ? o->obj->ptr : o->buf;
+}
+
 int listMatchObjects(void *a, void *b) {
     return equalStringObjects(a,b);
 }
@@ -141,6 +168,7 @@ client *createClient(connection *conn) {
     c->name = NULL;
     c->bufpos = 0;
     c->qb_pos = 0;
+    c->qbuf_chunk = NULL;
     c->querybuf = sdsempty();
     c->pending_querybuf = sdsempty();
     c->querybuf_peak = 0;
@@ -164,11 +192,14 @@ client *createClient(connection *conn) {
     c->repl_ack_off = 0;
     c->repl_ack_time = 0;
     c->repl_last_partial_write = 0;
+    c->repl_stream = 0;
     c->slave_listening_port = 0;
     c->slave_addr = NULL;
     c->slave_capa = SLAVE_CAPA_NONE;
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
     c->obuf_soft_limit_reached_time = 0;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
@@ -181,6 +212,7 @@ client *createClient(connection *conn) {
     c->bpop.xread_group_noack = 0;
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
+    c->bpop.shard_gather = NULL;
     c->woff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
@@ -203,6 +235,12 @@ client *createClient(connection *conn) {
     return c;
 }
 
+/* Return true if the client is in durable mode, and its replies are held
+ * until the AOF fsync it waits for is done (see blockForAofFsync()). */
+static inline int clientWaitsAofFsync(client *c) {
+    return (c->flags & CLIENT_BLOCKED) && c->btype == BLOCKED_AOF;
+}
+
 /* This function puts the client in the queue of clients that should write
  * their output buffers to the socket. Note that it does not *yet* install
  * the write handler, to start clients are put in a queue of clients that need
@@ -215,6 +253,7 @@ void clientInstallWriteHandler(client *c) {
      * if not already done and, for slaves, if the slave can actually receive
      * writes at this stage. */
     if (!(c->flags & CLIENT_PENDING_WRITE) &&
+        !clientWaitsAofFsync(c) &&
         (c->replstate == REPL_STATE_NONE ||
          (c->replstate == SLAVE_STATE_ONLINE && !c->repl_put_online_on_ack)))
     {
@@ -338,6 +377,7 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable_size(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->obj = NULL;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -346,6 +386,42 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
     }
 }
 
+/* Return true if the string object 'obj' should be added to the output
+ * buffers of 'c' by reference, see _addReplyObjectToList(). */
+static int clientCanReferenceReply(client *c, robj *obj) {
+    return server.reply_zerocopy_threshold &&
+           sdslen(obj->ptr) >= server.reply_zerocopy_threshold &&
+           obj->refcount != OBJ_STATIC_REFCOUNT &&
+           /* Reference counting is not thread safe. */
+           io_thread_stats == NULL &&
+           /* The output buffers of replicas are copied and not counted as
+            * used memory, the ones of Lua and modules are read as plain
+            * buffers. */
+           !(c->flags & (CLIENT_SLAVE|CLIENT_LUA|CLIENT_MODULE));
+}
+
+/* Adds a block referencing the string object 'obj' to the reply list, so
+ * that large values are sent straight from the object memory, and never
+ * copied in the output buffers. The object can't change while we hold a
+ * reference: strings with more than one reference are never modified in
+ * place, see dbUnshareStringValue(). */
+void _addReplyObjectToList(client *c, robj *obj) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    /* Nothing is going to be appended to the current tail anymore. */
+    trimReplyUnusedTailSpace(c);
+
+    clientReplyBlock *block = zmalloc(sizeof(clientReplyBlock));
+    block->size = block->used = sdslen(obj->ptr);
+    block->obj = obj;
+    incrRefCount(obj);
+    listAddNodeTail(c->reply, block);
+    c->reply_bytes += block->size;
+    server.stat_reply_zerocopy_bytes += block->used;
+
+    closeClientOnOutputBufferLimitReached(c, 1);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -356,7 +432,9 @@ void addReply(client *c, robj *obj) {
     if (prepareClientToWrite(c) != C_OK) return;
 
     if (sdsEncodedObject(obj)) {
-        if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
+        if (clientCanReferenceReply(c,obj))
+            _addReplyObjectToList(c,obj);
+        else if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
             _addReplyProtoToList(c,obj->ptr,sdslen(obj->ptr));
     } else if (obj->encoding == OBJ_ENCODING_INT) {
         /* For integer encoded strings we just convert it into a string
@@ -417,24 +495,34 @@ void addReplyErrorLength(client *c, const char *s, size_t len) {
 
 /* Do some actions after an error reply was sent (Log if needed, updates stats, etc.) */
 void afterErrorReply(client *c, const char *s, size_t len) {
-    /* Increment the global error counter */
-    server.stat_total_error_replies++;
+    const char *code = "ERR";
+    size_t codelen = 3;
+
     /* Increment the error stats
      * If the string already starts with "-..." then the error prefix
      * is provided by the caller ( we limit the search to 32 chars). Otherwise we use "-ERR". */
-    if (s[0] != '-') {
-        incrementErrorCount("ERR", 3);
-    } else {
+    if (s[0] == '-') {
         char *spaceloc = memchr(s, ' ', len < 32 ? len : 32);
         if (spaceloc) {
-            const size_t errEndPos = (size_t)(spaceloc - s);
-            incrementErrorCount(s+1, errEndPos-1);
-        } else {
-            /* Fallback to ERR if we can't retrieve the error prefix */
-            incrementErrorCount("ERR", 3);
+            code = s+1;
+            codelen = (size_t)(spaceloc - s)-1;
         }
+        /* Otherwise fallback to ERR if we can't retrieve the error prefix */
+    }
+
+    /* The error stats are global: when the command is executed by an IO
+     * thread we just remember the error, the main thread will account for
+     * it later. Only normal clients are served this way, so there is
+     * nothing else to do. */
+    if (io_thread_stats) {
+        ioThreadStatsAddErrorReply(code,codelen);
+        return;
     }
 
+    /* Increment the global error counter */
+    server.stat_total_error_replies++;
+    incrementErrorCount(code,codelen);
+
     /* Sometimes it could be normal that a slave replies to a master with
      * an error and this function gets called. Actually the error will never
      * be sent because addReply*() against master clients has no effect...
@@ -621,6 +709,7 @@ void setDeferredReply(client *c, void *node, const char *s, size_t length) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable_size(buf) - sizeof(clientReplyBlock);
         buf->used = length;
+        buf->obj = NULL;
         memcpy(buf->buf, s, length);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -979,12 +1068,53 @@ void copyClientOutputBuffer(client *dst, client *src) {
     memcpy(dst->buf,src->buf,src->bufpos);
     dst->bufpos = src->bufpos;
     dst->reply_bytes = src->reply_bytes;
+
+    /* Replicas just share the replication buffer. */
+    releaseReplicaReplBuffer(dst);
+    if (src->ref_repl_buf_node) {
+        dst->ref_repl_buf_node = src->ref_repl_buf_node;
+        dst->ref_block_pos = src->ref_block_pos;
+        ((replBufBlock *)listNodeValue(dst->ref_repl_buf_node))->refcount++;
+    }
+}
+
+/* Give a private copy of the objects they reference to the reply blocks that
+ * share them with someone else, see _addReplyObjectToList(). Called before
+ * the data set is released by a background thread, that is going to
+ * decrement the reference count of the objects without locking. */
+void unshareClientsReplyObjects(void) {
+    listIter li, ri;
+    listNode *ln, *rn;
+
+    listRewind(server.clients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        listRewind(c->reply,&ri);
+        while((rn = listNext(&ri))) {
+            clientReplyBlock *o = listNodeValue(rn);
+            if (!o || !o->obj || o->obj->refcount == 1 ||
+                o->obj->refcount == OBJ_SHARED_REFCOUNT) continue;
+            robj *copy = createRawStringObject(o->obj->ptr,o->used);
+            decrRefCount(o->obj);
+            o->obj = copy;
+        }
+    }
 }
 
 /* Return true if the specified client has pending reply buffers to write to
  * the socket. */
 int clientHasPendingReplies(client *c) {
-    return c->bufpos || listLength(c->reply);
+    if (c->bufpos || listLength(c->reply)) return 1;
+
+    /* Replicas also send the replication buffer, from the block they
+     * reference to the last one. */
+    if (c->ref_repl_buf_node) {
+        replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+        return c->ref_block_pos < o->used ||
+               listNextNode(c->ref_repl_buf_node) != NULL;
+    }
+    return 0;
 }
 
 void clientAcceptHandler(connection *conn) {
@@ -1182,10 +1312,21 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+/* Called when the client is done with the arguments 'argv': the ones that are
+ * views into the query buffer, and are still referenced somewhere else, are
+ * converted into RAW objects, so that the query buffer can be released. */
+static void unshareArgvViews(robj **argv, int argc) {
+    for (int j = 0; j < argc; j++) {
+        if (argv[j] && argv[j]->refcount > 1)
+            unshareViewStringObject(argv[j]);
+    }
+}
+
 void freeClientOriginalArgv(client *c) {
     /* We didn't rewrite this client */
     if (!c->original_argv) return;
 
+    unshareArgvViews(c->original_argv,c->original_argc);
     for (int j = 0; j < c->original_argc; j++)
         decrRefCount(c->original_argv[j]);
     zfree(c->original_argv);
@@ -1254,21 +1395,10 @@ void unlinkClient(client *c) {
             c->client_list_node = NULL;
         }
 
-        /* Check if this is a replica waiting for diskless replication (rdb pipe),
-         * in which case it needs to be cleaned from that list */
-        if (c->flags & CLIENT_SLAVE &&
-            c->replstate == SLAVE_STATE_WAIT_BGSAVE_END &&
-            server.rdb_pipe_conns)
-        {
-            int i;
-            for (i=0; i < server.rdb_pipe_numconns; i++) {
-                if (server.rdb_pipe_conns[i] == c->conn) {
-                    rdbPipeWriteHandlerConnRemoved(c->conn);
-                    server.rdb_pipe_conns[i] = NULL;
-                    break;
-                }
-            }
-        }
+        /* Check if this is a replica (or one of its additional streams)
+         * waiting for diskless replication (rdb pipe), in which case it
+         * needs to be cleaned from that list */
+        rdbPipeClientRemoved(c);
         connClose(c->conn);
         c->conn = NULL;
     }
@@ -1353,9 +1483,13 @@ void freeClient(client *c) {
     }
 
     /* Free the query buffer */
-    sdsfree(c->querybuf);
+    if (c->qbuf_chunk)
+        releaseQueryBufChunk(c->qbuf_chunk);
+    else
+        sdsfree(c->querybuf);
     sdsfree(c->pending_querybuf);
     c->querybuf = NULL;
+    c->qbuf_chunk = NULL;
 
     /* Deallocate structures used to block on blocking ops. */
     if (c->flags & CLIENT_BLOCKED) unblockClient(c);
@@ -1373,6 +1507,7 @@ void freeClient(client *c) {
 
     /* Free data structures. */
     listRelease(c->reply);
+    unshareArgvViews(c->argv,c->argc);
     freeClientArgv(c);
     freeClientOriginalArgv(c);
 
@@ -1407,6 +1542,7 @@ void freeClient(client *c) {
         ln = listSearchKey(l,c);
         serverAssert(ln != NULL);
         listDelNode(l,ln);
+        releaseReplicaReplBuffer(c);
         /* We need to remember the time when we started to have zero
          * attached slaves, as after some time we'll free the replication
          * backlog. */
@@ -1494,6 +1630,169 @@ client *lookupClientByID(uint64_t id) {
     return (c == raxNotFound) ? NULL : c;
 }
 
+/* Release the block 'ln' of the reply list of 'c', after it was sent. */
+static void releaseSentReplyBlock(client *c, listNode *ln) {
+    clientReplyBlock *o = listNodeValue(ln);
+
+    c->reply_bytes -= o->size;
+    /* Other IO threads may be sending the same object right now, so its
+     * reference is released by the main thread once they are done. */
+    if (o->obj && io_thread_released_objs) {
+        listAddNodeTail(io_thread_released_objs,o->obj);
+        o->obj = NULL;
+    }
+    listDelNode(c->reply,ln);
+}
+
+/* Fill 'iov' with up to 'maxiov' buffers of the static buffer and the reply
+ * list that are still to send, stopping once NET_MAX_WRITES_PER_EVENT bytes
+ * are reached. Returns the number of buffers, and their total length in
+ * 'len'. */
+static int gatherClientReplies(client *c, struct iovec *iov, int maxiov, size_t *len) {
+    int iovcnt = 0;
+    size_t iov_bytes_len = 0;
+    clientReplyBlock *o;
+    listIter li;
+    listNode *ln;
+
+    if (c->bufpos > 0) {
+        iov[iovcnt].iov_base = c->buf + c->sentlen;
+        iov[iovcnt].iov_len = c->bufpos - c->sentlen;
+        iov_bytes_len += iov[iovcnt++].iov_len;
+    }
+
+    /* 'sentlen' refers to the first reply block only if the static
+     * buffer is empty. */
+    size_t offset = c->bufpos > 0 ? 0 : c->sentlen;
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li)) && iovcnt < maxiov &&
+          iov_bytes_len < NET_MAX_WRITES_PER_EVENT)
+    {
+        o = listNodeValue(ln);
+        if (o->used == 0) {
+            releaseSentReplyBlock(c,ln);
+            continue;
+        }
+        iov[iovcnt].iov_base = clientReplyBlockData(o) + offset;
+        iov[iovcnt].iov_len = o->used - offset;
+        iov_bytes_len += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+    *len = iov_bytes_len;
+    return iovcnt;
+}
+
+/* Release what was entirely sent of the buffers returned by
+ * gatherClientReplies(), after 'nwritten' bytes of them were written, and
+ * remember how much of the first remaining one was sent. */
+static void clientRepliesWritten(client *c, ssize_t nwritten) {
+    clientReplyBlock *o;
+    listNode *ln;
+
+    if (c->bufpos > 0) {
+        ssize_t buflen = c->bufpos - c->sentlen;
+        if (nwritten < buflen) {
+            c->sentlen += nwritten;
+            return;
+        }
+        nwritten -= buflen;
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+    while(nwritten > 0) {
+        ln = listFirst(c->reply);
+        o = listNodeValue(ln);
+        if (nwritten < (ssize_t)(o->used - c->sentlen)) {
+            c->sentlen += nwritten;
+            break;
+        }
+        nwritten -= o->used - c->sentlen;
+        releaseSentReplyBlock(c,ln);
+        c->sentlen = 0;
+    }
+
+    /* If there are no longer objects in the list, we expect
+     * the count of reply bytes to be exactly zero. */
+    if (listLength(c->reply) == 0)
+        serverAssert(c->reply_bytes == 0);
+}
+
+/* Send the static buffer and the reply list with a single writev() call:
+ * the replies of pipelined commands are sent together, and the blocks
+ * referencing objects are sent without copying them. Returns C_ERR if
+ * nothing could be written, with the writev() return value stored in
+ * 'nwritten' in any case. */
+static int _writevToClient(client *c, ssize_t *nwritten) {
+    struct iovec iov[IOV_MAX];
+    size_t len;
+    int iovcnt = gatherClientReplies(c,iov,IOV_MAX,&len);
+
+    if (iovcnt == 0) {
+        *nwritten = 0;
+        return C_OK;
+    }
+    *nwritten = connWritev(c->conn,iov,iovcnt);
+    if (*nwritten <= 0) return C_ERR;
+    clientRepliesWritten(c,*nwritten);
+    return C_OK;
+}
+
+/* Send the replication buffer to the replica 'c', from the block it
+ * references on, with a single writev() call. The reference moves past the
+ * blocks entirely sent, so that the ones nobody references anymore can be
+ * freed. Returns C_ERR if nothing could be written, with the writev()
+ * return value stored in 'nwritten' in any case.
+ *
+ * The replication buffer is shared, so this is only called by the main
+ * thread. */
+static int _writeReplBufToReplica(client *c, ssize_t *nwritten) {
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0, released = 0;
+    size_t iov_bytes_len = 0, offset = c->ref_block_pos;
+    listNode *ln = c->ref_repl_buf_node;
+    replBufBlock *o;
+
+    while(ln && iovcnt < IOV_MAX && iov_bytes_len < NET_MAX_WRITES_PER_EVENT) {
+        o = listNodeValue(ln);
+        if (o->used > offset) {
+            iov[iovcnt].iov_base = o->buf + offset;
+            iov[iovcnt].iov_len = o->used - offset;
+            iov_bytes_len += iov[iovcnt++].iov_len;
+        }
+        offset = 0;
+        ln = listNextNode(ln);
+    }
+    if (iovcnt == 0) {
+        *nwritten = 0;
+        return C_OK;
+    }
+    *nwritten = connWritev(c->conn,iov,iovcnt);
+    if (*nwritten <= 0) return C_ERR;
+
+    size_t sent = *nwritten;
+    while(1) {
+        o = listNodeValue(c->ref_repl_buf_node);
+        size_t avail = o->used - c->ref_block_pos;
+        listNode *next = listNextNode(c->ref_repl_buf_node);
+        if (sent < avail || next == NULL) {
+            c->ref_block_pos += sent;
+            break;
+        }
+        sent -= avail;
+        o->refcount--;
+        ((replBufBlock *)listNodeValue(next))->refcount++;
+        c->ref_repl_buf_node = next;
+        c->ref_block_pos = 0;
+        released = 1;
+    }
+    if (released)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+    return C_OK;
+}
+
+static int afterWriteToClient(client *c, ssize_t nwritten, ssize_t totwritten,
+                              int handler_installed);
+
 /* Write data in output buffers to client. Return C_OK if the client
  * is still valid after the call, C_ERR if it was freed because of some
  * error.  If handler_installed is set, it will attempt to clear the
@@ -1507,11 +1806,17 @@ int writeToClient(client *c, int handler_installed) {
     atomicIncr(server.stat_total_writes_processed, 1);
 
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    clientReplyBlock *o;
 
     while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
+        if (listLength(c->reply) > 0) {
+            if (_writevToClient(c,&nwritten) == C_ERR) break;
+            totwritten += nwritten;
+        } else if (c->bufpos == 0) {
+            /* Replicas send the replication buffer once their own replies,
+             * if any, were sent. */
+            if (_writeReplBufToReplica(c,&nwritten) == C_ERR) break;
+            totwritten += nwritten;
+        } else {
             nwritten = connWrite(c->conn,c->buf+c->sentlen,c->bufpos-c->sentlen);
             if (nwritten <= 0) break;
             c->sentlen += nwritten;
@@ -1523,31 +1828,6 @@ int writeToClient(client *c, int handler_installed) {
                 c->bufpos = 0;
                 c->sentlen = 0;
             }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = o->used;
-
-            if (objlen == 0) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
-
-            nwritten = connWrite(c->conn, o->buf + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
-            }
         }
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
@@ -1566,6 +1846,14 @@ int writeToClient(client *c, int handler_installed) {
              zmalloc_used_memory() < server.maxmemory) &&
             !(c->flags & CLIENT_SLAVE)) break;
     }
+    return afterWriteToClient(c,nwritten,totwritten,handler_installed);
+}
+
+/* The second half of writeToClient(), called after writing 'totwritten'
+ * bytes in total, where 'nwritten' is the return value of the last write. */
+static int afterWriteToClient(client *c, ssize_t nwritten, ssize_t totwritten,
+                              int handler_installed)
+{
     atomicIncr(server.stat_net_output_bytes, totwritten);
     if (nwritten == -1) {
         if (connGetState(c->conn) != CONN_STATE_CONNECTED) {
@@ -1602,9 +1890,95 @@ int writeToClient(client *c, int handler_installed) {
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(connection *conn) {
     client *c = connGetPrivateData(conn);
+    if (clientWaitsAofFsync(c)) {
+        /* The handler is installed again once the client is unblocked. */
+        connSetWriteHandler(c->conn,NULL);
+        return;
+    }
     writeToClient(c,1);
 }
 
+/* Install the write handler for a client that still has data to send after
+ * handleClientsWithPendingWrites() wrote what the socket could accept. */
+static void installClientWriteHandler(client *c) {
+    int ae_barrier = 0;
+    /* For the fsync=always policy, we want that a given FD is never
+     * served for reading and writing in the same event loop iteration,
+     * so that in the middle of receiving the query, and serving it
+     * to the client, we'll call beforeSleep() that will do the
+     * actual fsync of AOF to disk. the write barrier ensures that. */
+    if (server.aof_state == AOF_ON &&
+        server.aof_fsync == AOF_FSYNC_ALWAYS)
+    {
+        ae_barrier = 1;
+    }
+    if (connSetWriteHandlerWithBarrier(c->conn, sendReplyToClient, ae_barrier) == C_ERR) {
+        freeClientAsync(c);
+    }
+}
+
+#define NET_BATCH_MAX_CLIENTS 256   /* Max clients written by a batch. */
+#define NET_BATCH_IOV_PER_CLIENT 16 /* Max buffers of a client in a batch. */
+
+/* Start writing the replies of the clients with pending writes with batches
+ * of writes submitted together (see connWritevBatch()), instead of a system
+ * call per client. A single write is performed for every client: the ones
+ * whose socket accepted everything and that have more data to send are left
+ * in the pending list, to be served by writeToClient() as usual, while all
+ * the others are done, and removed from the list. */
+static void writeToClientsInBatch(void) {
+    static struct iovec iov[NET_BATCH_MAX_CLIENTS*NET_BATCH_IOV_PER_CLIENT];
+    static connWritevReq reqs[NET_BATCH_MAX_CLIENTS];
+    static listNode *nodes[NET_BATCH_MAX_CLIENTS];
+    static size_t lens[NET_BATCH_MAX_CLIENTS];
+    listIter li;
+    listNode *ln;
+    int count = 0;
+
+    listRewind(server.clients_pending_write,&li);
+    do {
+        ln = listNext(&li);
+        if (ln) {
+            client *c = listNodeValue(ln);
+            if (c->flags & (CLIENT_PROTECTED|CLIENT_CLOSE_ASAP)) continue;
+            if (clientWaitsAofFsync(c)) continue;
+            /* Replicas send the replication buffer, see writeToClient(). */
+            if (c->ref_repl_buf_node) continue;
+            struct iovec *client_iov = iov+count*NET_BATCH_IOV_PER_CLIENT;
+            int iovcnt = gatherClientReplies(c,client_iov,
+                NET_BATCH_IOV_PER_CLIENT,&lens[count]);
+            if (iovcnt == 0) continue;
+            reqs[count].conn = c->conn;
+            reqs[count].iov = client_iov;
+            reqs[count].iovcnt = iovcnt;
+            nodes[count++] = ln;
+            if (count < NET_BATCH_MAX_CLIENTS) continue;
+        }
+        if (count == 0) continue;
+
+        connWritevBatch(reqs,count);
+        for (int j = 0; j < count; j++) {
+            client *c = listNodeValue(nodes[j]);
+            ssize_t nwritten = reqs[j].ret;
+
+            atomicIncr(server.stat_total_writes_processed, 1);
+            if (nwritten > 0) clientRepliesWritten(c,nwritten);
+            if (nwritten == (ssize_t)lens[j] && clientHasPendingReplies(c)) {
+                /* writeToClient() only accounts for its own writes. */
+                atomicIncr(server.stat_net_output_bytes, nwritten);
+                continue;
+            }
+
+            c->flags &= ~CLIENT_PENDING_WRITE;
+            listDelNode(server.clients_pending_write,nodes[j]);
+            if (afterWriteToClient(c,nwritten,nwritten > 0 ? nwritten : 0,0) == C_ERR)
+                continue;
+            if (clientHasPendingReplies(c)) installClientWriteHandler(c);
+        }
+        count = 0;
+    } while(ln);
+}
+
 /* This function is called just before entering the event loop, in the hope
  * we can just write the replies to the client output buffer without any
  * need to use a syscall in order to install the writable event handler,
@@ -1614,6 +1988,8 @@ int handleClientsWithPendingWrites(void) {
     listNode *ln;
     int processed = listLength(server.clients_pending_write);
 
+    if (processed > 1 && connCanWritevBatch()) writeToClientsInBatch();
+
     listRewind(server.clients_pending_write,&li);
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
@@ -1627,27 +2003,15 @@ int handleClientsWithPendingWrites(void) {
         /* Don't write to clients that are going to be closed anyway. */
         if (c->flags & CLIENT_CLOSE_ASAP) continue;
 
+        /* Clients in durable mode are queued again once unblocked. */
+        if (clientWaitsAofFsync(c)) continue;
+
         /* Try to write buffers to the client socket. */
         if (writeToClient(c,0) == C_ERR) continue;
 
         /* If after the synchronous writes above we still have data to
          * output to the client, we need to install the writable handler. */
-        if (clientHasPendingReplies(c)) {
-            int ae_barrier = 0;
-            /* For the fsync=always policy, we want that a given FD is never
-             * served for reading and writing in the same event loop iteration,
-             * so that in the middle of receiving the query, and serving it
-             * to the client, we'll call beforeSleep() that will do the
-             * actual fsync of AOF to disk. the write barrier ensures that. */
-            if (server.aof_state == AOF_ON &&
-                server.aof_fsync == AOF_FSYNC_ALWAYS)
-            {
-                ae_barrier = 1;
-            }
-            if (connSetWriteHandlerWithBarrier(c->conn, sendReplyToClient, ae_barrier) == C_ERR) {
-                freeClientAsync(c);
-            }
-        }
+        if (clientHasPendingReplies(c)) installClientWriteHandler(c);
     }
     return processed;
 }
@@ -1656,6 +2020,7 @@ int handleClientsWithPendingWrites(void) {
 void resetClient(client *c) {
     redisCommandProc *prevcmd = c->cmd ? c->cmd->proc : NULL;
 
+    unshareArgvViews(c->argv,c->argc);
     freeClientArgv(c);
     c->reqtype = 0;
     c->multibulklen = 0;
@@ -1827,6 +2192,83 @@ static void setProtocolError(const char *errstr, client *c) {
     c->flags |= (CLIENT_CLOSE_AFTER_REPLY|CLIENT_PROTOCOL_ERROR);
 }
 
+/* Return a pointer to the first '\r' in the 'len' bytes at 'p', or NULL if
+ * there is none. The protocol lines we look for ("*3", "$5", ...) are very
+ * short, so comparing 16 bytes at a time inline finds most of them with a
+ * single load, without the call and setup cost of memchr(). */
+static inline char *protoFindCR(char *p, size_t len) {
+#if defined(__SSE2__)
+    const __m128i cr = _mm_set1_epi8('\r');
+    while (len >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk,cr));
+        if (mask) return p+__builtin_ctz(mask);
+        p += 16;
+        len -= 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    while (len >= 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*)p),cr);
+        /* Narrow the 16 bytes of the comparison to 4 bits each. */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(eq),4)),0);
+        if (mask) return p+(__builtin_ctzll(mask)>>2);
+        p += 16;
+        len -= 16;
+    }
+#endif
+    return memchr(p,'\r',len);
+}
+
+void releaseQueryBufChunk(queryBufChunk *chunk) {
+    if (--chunk->refcount == 0) {
+        sdsfree(chunk->buf);
+        zfree(chunk);
+    }
+}
+
+/* Must be called before the query buffer is moved or modified, except for
+ * appending data: if some arguments are still views into it, the buffer is
+ * left to them, and the client continues with a copy of the part not yet
+ * parsed. */
+void unshareQueryBuffer(client *c) {
+    queryBufChunk *chunk = c->qbuf_chunk;
+    if (!chunk) return;
+
+    c->qbuf_chunk = NULL;
+    if (chunk->refcount == 1) {
+        zfree(chunk);
+        return;
+    }
+    c->querybuf = sdsnewlen(c->querybuf+c->qb_pos,
+                            sdslen(c->querybuf)-c->qb_pos);
+    c->qb_pos = 0;
+    releaseQueryBufChunk(chunk);
+}
+
+/* Create the argument of 'len' bytes at 'data' in the query buffer. Large
+ * enough arguments are not copied, but created as views sharing the buffer:
+ * the 'room' bytes before the data, that are the already parsed "$<len>\r\n"
+ * line plus the '\n' ending the previous element, are overwritten with the
+ * sds header, and the '\r' after the data with the null term. Smaller
+ * arguments, and the ones whose line was trimmed away with the part of the
+ * buffer already parsed, are copied as usual. */
+static robj *createArgumentObject(client *c, char *data, size_t len,
+                                  size_t room)
+{
+    if (len < PROTO_MBULK_VIEW_ARG || room < sdsEmbedSize(len,0)-len-1)
+        return createStringObject(data,len);
+
+    if (!c->qbuf_chunk) {
+        c->qbuf_chunk = zmalloc(sizeof(queryBufChunk));
+        c->qbuf_chunk->refcount = 1;
+        c->qbuf_chunk->buf = c->querybuf;
+    }
+    sds s = sdsnewembed(data-(sdsEmbedSize(len,0)-len-1),data,len,0);
+    return createViewStringObject(s,c->qbuf_chunk);
+}
+
 /* Process the query buffer for client 'c', setting up the client argument
  * vector for command execution. Returns C_OK if after running the function
  * the client has a well-formed ready to be processed command, otherwise
@@ -1842,13 +2284,19 @@ int processMultibulkBuffer(client *c) {
     char *newline = NULL;
     int ok;
     long long ll;
+    /* Start of the bytes already parsed that we can overwrite to create the
+     * next argument as a view, see createArgumentObject(): the '\n' ending
+     * the previous element, if it is still in the buffer. */
+    size_t view_floor = c->qb_pos ? c->qb_pos-1 : 0;
+    long long view_bytes = 0;
 
     if (c->multibulklen == 0) {
         /* The client should have been reset */
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf+c->qb_pos,'\r');
+        newline = protoFindCR(c->querybuf+c->qb_pos,
+                              sdslen(c->querybuf)-c->qb_pos);
         if (newline == NULL) {
             if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                 addReplyError(c,"Protocol error: too big mbulk count string");
@@ -1876,6 +2324,7 @@ int processMultibulkBuffer(client *c) {
         }
 
         c->qb_pos = (newline-c->querybuf)+2;
+        view_floor = c->qb_pos-1;
 
         if (ll <= 0) return C_OK;
 
@@ -1891,7 +2340,8 @@ int processMultibulkBuffer(client *c) {
     while(c->multibulklen) {
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf+c->qb_pos,'\r');
+            newline = protoFindCR(c->querybuf+c->qb_pos,
+                                  sdslen(c->querybuf)-c->qb_pos);
             if (newline == NULL) {
                 if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(c,
@@ -1938,8 +2388,10 @@ int processMultibulkBuffer(client *c) {
                  * ll+2, trimming querybuf is just a waste of time, because
                  * at this time the querybuf contains not only our bulk. */
                 if (sdslen(c->querybuf)-c->qb_pos <= (size_t)ll+2) {
+                    unshareQueryBuffer(c);
                     sdsrange(c->querybuf,c->qb_pos,-1);
                     c->qb_pos = 0;
+                    view_floor = 0;
                     /* Hint the sds library about the amount of bytes this string is
                      * going to contain. */
                     c->querybuf = sdsMakeRoomFor(c->querybuf,ll+2-sdslen(c->querybuf));
@@ -1956,7 +2408,7 @@ int processMultibulkBuffer(client *c) {
             /* Optimization: if the buffer contains JUST our bulk element
              * instead of creating a new object by *copying* the sds we
              * just use the current sds string. */
-            if (c->qb_pos == 0 &&
+            if (c->qb_pos == 0 && !c->qbuf_chunk &&
                 c->bulklen >= PROTO_MBULK_BIG_ARG &&
                 sdslen(c->querybuf) == (size_t)(c->bulklen+2))
             {
@@ -1968,15 +2420,20 @@ int processMultibulkBuffer(client *c) {
                 c->querybuf = sdsnewlen(SDS_NOINIT,c->bulklen+2);
                 sdsclear(c->querybuf);
             } else {
-                c->argv[c->argc++] =
-                    createStringObject(c->querybuf+c->qb_pos,c->bulklen);
+                robj *o = createArgumentObject(c,c->querybuf+c->qb_pos,
+                    c->bulklen,c->qb_pos-view_floor);
+                if (o->encoding == OBJ_ENCODING_VIEW)
+                    view_bytes += c->bulklen;
+                c->argv[c->argc++] = o;
                 c->argv_len_sum += c->bulklen;
                 c->qb_pos += c->bulklen+2;
+                view_floor = c->qb_pos-1;
             }
             c->bulklen = -1;
             c->multibulklen--;
         }
     }
+    if (view_bytes) atomicIncr(server.stat_query_zerocopy_bytes,view_bytes);
 
     /* We're done when c->multibulk == 0 */
     if (c->multibulklen == 0) return C_OK;
@@ -2061,6 +2518,12 @@ int processCommandAndResetClient(client *c) {
 int processPendingCommandsAndResetClient(client *c) {
     if (c->flags & CLIENT_PENDING_COMMAND) {
         c->flags &= ~CLIENT_PENDING_COMMAND;
+        if (c->flags & CLIENT_IO_COMMAND_EXECUTED) {
+            /* Already executed by an IO thread: just finish the job. */
+            ioThreadCommandProcessed(c);
+            commandProcessed(c);
+            return C_OK;
+        }
         if (processCommandAndResetClient(c) == C_ERR) {
             return C_ERR;
         }
@@ -2133,6 +2596,9 @@ void processInputBuffer(client *c) {
              * as one that needs to process the command. */
             if (c->flags & CLIENT_PENDING_READ) {
                 c->flags |= CLIENT_PENDING_COMMAND;
+                /* Unless the command is simple enough that the IO thread
+                 * can execute it right away, see processCommandInIOThread(). */
+                if (io_threads_do_commands) processCommandInIOThread(c);
                 break;
             }
 
@@ -2148,6 +2614,7 @@ void processInputBuffer(client *c) {
 
     /* Trim to pos */
     if (c->qb_pos) {
+        unshareQueryBuffer(c);
         sdsrange(c->querybuf,c->qb_pos,-1);
         c->qb_pos = 0;
     }
@@ -2165,6 +2632,9 @@ void readQueryFromClient(connection *conn) {
     /* Update total number of reads on server */
     atomicIncr(server.stat_total_reads_processed, 1);
 
+    /* The buffer may be reallocated to make room for the new data. */
+    unshareQueryBuffer(c);
+
     readlen = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -2319,6 +2789,7 @@ sds catClientInfoString(sds s, client *client) {
     if (client->flags & CLIENT_CLOSE_ASAP) *p++ = 'A';
     if (client->flags & CLIENT_UNIX_SOCKET) *p++ = 'U';
     if (client->flags & CLIENT_READONLY) *p++ = 'r';
+    if (client->flags & CLIENT_DURABLE) *p++ = 'D';
     if (p == flags) *p++ = 'N';
     *p++ = '\0';
 
@@ -2461,7 +2932,7 @@ void resetCommand(client *c) {
 
     /* Selectively clear state flags not covered above */
     c->flags &= ~(CLIENT_ASKING|CLIENT_READONLY|CLIENT_PUBSUB|
-            CLIENT_REPLY_OFF|CLIENT_REPLY_SKIP_NEXT);
+            CLIENT_REPLY_OFF|CLIENT_REPLY_SKIP_NEXT|CLIENT_DURABLE);
 
     addReplyStatus(c,"RESET");
 }
@@ -2474,6 +2945,9 @@ void clientCommand(client *c) {
         const char *help[] = {
 "CACHING (YES|NO)",
 "    Enable/disable tracking of the keys for next command in OPTIN/OPTOUT modes.",
+"DURABLE (ON|OFF)",
+"    Send the replies to writes only once they are fsynced in the AOF, that",
+"    must be enabled. Has no effect while the AOF is turned off.",
 "GETREDIR",
 "    Return the client ID we are redirecting to when tracking is enabled.",
 "GETNAME",
@@ -2577,6 +3051,27 @@ NULL
             addReplyErrorObject(c,shared.syntaxerr);
             return;
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"durable") && c->argc == 3) {
+        /* CLIENT DURABLE ON|OFF */
+        if (c->flags & (CLIENT_MASTER|CLIENT_SLAVE)) {
+            addReplyError(c,"DURABLE is only supported by normal clients");
+            return;
+        }
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            /* Writes are acknowledged by the fsyncs of the AOF only once
+             * it is on, not while its first rewrite is in progress. */
+            if (server.aof_state != AOF_ON) {
+                addReplyError(c,"DURABLE requires the AOF to be enabled");
+                return;
+            }
+            c->flags |= CLIENT_DURABLE;
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            c->flags &= ~CLIENT_DURABLE;
+        } else {
+            addReplyErrorObject(c,shared.syntaxerr);
+            return;
+        }
+        addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"kill")) {
         /* CLIENT KILL <ip:port>
          * CLIENT KILL <option> [value] ... <option> [value] */
@@ -2648,6 +3143,8 @@ NULL
         listRewind(server.clients,&li);
         while ((ln = listNext(&li)) != NULL) {
             client *client = listNodeValue(ln);
+            /* The links with the other shards can't be killed. */
+            if (client->flags & CLIENT_SHARD) continue;
             if (addr && strcmp(getClientPeerId(client),addr) != 0) continue;
             if (laddr && strcmp(getClientSockname(client),laddr) != 0) continue;
             if (type != -1 && getClientType(client) != type) continue;
@@ -2698,7 +3195,11 @@ NULL
         if (getLongLongFromObjectOrReply(c,c->argv[2],&id,NULL)
             != C_OK) return;
         struct client *target = lookupClientByID(id);
-        if (target && target->flags & CLIENT_BLOCKED && moduleBlockedClientMayTimeout(target)) {
+        if (target && target->flags & CLIENT_BLOCKED &&
+            target->btype != BLOCKED_SHARD &&
+            target->btype != BLOCKED_AOF &&
+            moduleBlockedClientMayTimeout(target))
+        {
             if (unblock_error)
                 addReplyError(target,
                     "-UNBLOCKED client unblocked via CLIENT UNBLOCK");
@@ -3168,7 +3669,23 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
  * enforcing the client output length limits. */
 unsigned long getClientOutputBufferMemoryUsage(client *c) {
     unsigned long list_item_size = sizeof(listNode) + sizeof(clientReplyBlock);
-    return c->reply_bytes + (list_item_size*listLength(c->reply));
+    return c->reply_bytes + (list_item_size*listLength(c->reply)) +
+           getClientReplBufferMemoryUsage(c);
+}
+
+/* Return the memory of the replication buffer the replica 'c' still has to
+ * send, from the block it references to the last one. Since the buffer is
+ * shared, the same memory is accounted to the backlog and to the other
+ * replicas as well. */
+unsigned long getClientReplBufferMemoryUsage(client *c) {
+    if (c->ref_repl_buf_node == NULL) return 0;
+
+    /* All the blocks but the last one are full. */
+    replBufBlock *last = listNodeValue(listLast(server.repl_buffer_blocks));
+    replBufBlock *cur = listNodeValue(c->ref_repl_buf_node);
+    unsigned long blocks = last->id - cur->id + 1;
+    return last->repl_offset + last->size - cur->repl_offset +
+           blocks*(sizeof(listNode)+sizeof(replBufBlock));
 }
 
 /* Get the class of a client, used in order to enforce limits to different
@@ -3267,7 +3784,8 @@ int checkClientOutputBufferLimits(client *c) {
 int closeClientOnOutputBufferLimitReached(client *c, int async) {
     if (!c->conn) return 0; /* It is unsafe to free fake clients. */
     serverAssert(c->reply_bytes < SIZE_MAX-(1024*64));
-    if (c->reply_bytes == 0 || c->flags & CLIENT_CLOSE_ASAP) return 0;
+    if ((c->reply_bytes == 0 && c->ref_repl_buf_node == NULL) ||
+        c->flags & CLIENT_CLOSE_ASAP) return 0;
     if (checkClientOutputBufferLimits(c)) {
         sds client = catClientInfoString(sdsempty(),c);
 
@@ -3440,26 +3958,201 @@ void processEventsWhileBlocked(void) {
 #define IO_THREADS_OP_READ 0
 #define IO_THREADS_OP_WRITE 1
 
+/* When io-threads-adaptive is enabled the active threads are sized so that
+ * each one is busy at most this percentage of the time. */
+#define IO_THREADS_TARGET_UTILIZATION 70
+/* Fixed cost, in bytes, of serving a client with pending writes, that is the
+ * write(2) call itself, used when balancing the clients among the threads. */
+#define IO_THREADS_CLIENT_COST 1024
+/* Bounds of the number of iterations a thread spins waiting for the other
+ * side before going to sleep, see ioSpinWhile(). */
+#define IO_THREADS_SPIN_MIN 64
+#define IO_THREADS_SPIN_MAX 16384
+
 pthread_t io_threads[IO_THREADS_MAX_NUM];
 pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
-redisAtomic unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
+redisAtomic unsigned int io_threads_pending[IO_THREADS_MAX_NUM];
 int io_threads_op;      /* IO_THREADS_OP_WRITE or IO_THREADS_OP_READ. */
 
+/* A thread sleeping until a pending count changes. The IO threads sleep
+ * while their pending count is zero, and the main thread sleeps while it is
+ * not, so every thread has a sleeper for each side. */
+typedef struct ioSleeper {
+    redisAtomic int sleeping;   /* Set while the thread is (about to) sleep. */
+#ifndef HAVE_FUTEX
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} ioSleeper;
+
+static ioSleeper io_threads_sleeper[IO_THREADS_MAX_NUM];
+static ioSleeper io_main_sleeper[IO_THREADS_MAX_NUM];
+static int io_threads_spin[IO_THREADS_MAX_NUM];
+static int io_main_spin = IO_THREADS_SPIN_MAX;
+
+/* Objects to release after every thread sent its clients replies, see
+ * releaseSentReplyBlock(). */
+list *io_threads_released_objs[IO_THREADS_MAX_NUM];
+
+/* Stats of the commands executed by every thread, see ioThreadStats. */
+ioThreadStats io_threads_stats[IO_THREADS_MAX_NUM];
+__thread ioThreadStats *io_thread_stats = NULL;
+
 /* This is the list of clients each thread will serve when threaded I/O is
  * used. We spawn io_threads_num-1 threads, since one is the main thread
  * itself. */
 list *io_threads_list[IO_THREADS_MAX_NUM];
 
-static inline unsigned long getIOPendingCount(int i) {
-    unsigned long count = 0;
+/* Load of every IO thread (0 is the main thread), used to size the set of
+ * active threads and reported by INFO threads. Every thread only updates its
+ * own entry while serving its list, and the main thread reads them while the
+ * threads are idle. */
+typedef struct ioThreadLoad {
+    long long busy_us;          /* Time spent serving clients. */
+    long long clients;          /* Number of clients served. */
+    long long write_bytes;      /* Pending reply bytes assigned. */
+    long long last_busy_us;     /* busy_us at the start of the last period. */
+    int utilization;            /* Percentage of the last period spent busy. */
+    redisAtomic long long sleeps; /* Times the thread slept waiting work. */
+} ioThreadLoad;
+
+static ioThreadLoad io_threads_load[IO_THREADS_MAX_NUM];
+static monotime io_threads_last_cron = 0;
+
+/* Serve the clients in the list of thread 'id', accounting the time spent
+ * doing so to the thread load. */
+static void ioThreadServeList(int id, int op) {
+    ioThreadLoad *load = &io_threads_load[id];
+    monotime start = getMonotonicUs();
+    listIter li;
+    listNode *ln;
+
+    listRewind(io_threads_list[id],&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        if (op == IO_THREADS_OP_WRITE) {
+            writeToClient(c,0);
+        } else if (op == IO_THREADS_OP_READ) {
+            readQueryFromClient(c->conn);
+        } else {
+            serverPanic("io_threads_op value is unknown");
+        }
+    }
+    load->clients += listLength(io_threads_list[id]);
+    load->busy_us += getMonotonicUs() - start;
+    listEmpty(io_threads_list[id]);
+}
+
+/* Number of bytes the client still has to write to the socket. */
+static size_t clientPendingWriteBytes(client *c) {
+    size_t bytes = c->reply_bytes;
+    if ((size_t)c->bufpos > c->sentlen) bytes += c->bufpos - c->sentlen;
+    return bytes;
+}
+
+static inline unsigned int getIOPendingCount(int i) {
+    unsigned int count = 0;
     atomicGetWithSync(io_threads_pending[i], count);
     return count;
 }
 
-static inline void setIOPendingCount(int i, unsigned long count) {
+static inline void setIOPendingCount(int i, unsigned int count) {
     atomicSetWithSync(io_threads_pending[i], count);
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+#define ioCpuRelax() __asm__ __volatile__("pause")
+#elif defined(__aarch64__)
+#define ioCpuRelax() __asm__ __volatile__("yield")
+#else
+#define ioCpuRelax()
+#endif
+
+/* Spin while the pending count of thread 'id' is 'val', for at most '*spin'
+ * iterations. Returns 1 if the count changed, 0 if we should sleep instead.
+ * The spin budget adapts: it grows while the other side keeps answering
+ * in time (a busy server, where sleeping would add the wake up latency to
+ * every batch), and shrinks while it doesn't (an idle server, where
+ * spinning just burns CPU). */
+static int ioSpinWhile(int id, unsigned int val, int *spin) {
+    for (int j = 0; j < *spin; j++) {
+        if (getIOPendingCount(id) != val) {
+            if (*spin < IO_THREADS_SPIN_MAX) *spin *= 2;
+            return 1;
+        }
+        ioCpuRelax();
+    }
+    if (*spin > IO_THREADS_SPIN_MIN) *spin /= 2;
+    return getIOPendingCount(id) != val;
+}
+
+static void ioSleeperInit(ioSleeper *s) {
+    atomicSetWithSync(s->sleeping, 0);
+#ifndef HAVE_FUTEX
+    pthread_mutex_init(&s->lock,NULL);
+    pthread_cond_init(&s->cond,NULL);
+#endif
+}
+
+/* Sleep while the pending count of thread 'id' is 'val'. The 'sleeping' flag
+ * is set before checking the count for the last time, and ioWakeSleeper()
+ * checks it after changing the count, so either we see the new count or the
+ * other side sees the flag and wakes us up. */
+static void ioSleepWhile(ioSleeper *s, int id, unsigned int val) {
+#ifdef HAVE_FUTEX
+    atomicSetWithSync(s->sleeping, 1);
+    while (getIOPendingCount(id) == val) {
+        syscall(SYS_futex,(unsigned int *)&io_threads_pending[id],
+                FUTEX_WAIT_PRIVATE,val,NULL,NULL,0);
+    }
+    atomicSetWithSync(s->sleeping, 0);
+#else
+    pthread_mutex_lock(&s->lock);
+    atomicSetWithSync(s->sleeping, 1);
+    while (getIOPendingCount(id) == val)
+        pthread_cond_wait(&s->cond,&s->lock);
+    atomicSetWithSync(s->sleeping, 0);
+    pthread_mutex_unlock(&s->lock);
+#endif
+}
+
+/* Wake up the thread sleeping on the pending count of thread 'id', if any.
+ * Must be called after the count changed. */
+static void ioWakeSleeper(ioSleeper *s, int id) {
+    int sleeping;
+    atomicGetWithSync(s->sleeping, sleeping);
+    if (!sleeping) return;
+#ifdef HAVE_FUTEX
+    syscall(SYS_futex,(unsigned int *)&io_threads_pending[id],
+            FUTEX_WAKE_PRIVATE,INT_MAX,NULL,NULL,0);
+#else
+    UNUSED(id);
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+#endif
+}
+
+/* Give the clients in their lists to the IO threads 1 .. threads-1. */
+static void ioThreadsDispatch(int threads) {
+    for (int j = 1; j < threads; j++) {
+        unsigned int count = listLength(io_threads_list[j]);
+        if (count == 0) continue;
+        setIOPendingCount(j, count);
+        ioWakeSleeper(&io_threads_sleeper[j], j);
+    }
+}
+
+/* Wait for the IO threads 1 .. threads-1 to serve their clients. */
+static void ioThreadsWaitDone(int threads) {
+    for (int j = 1; j < threads; j++) {
+        unsigned int count = getIOPendingCount(j);
+        if (count == 0) continue;
+        if (!ioSpinWhile(j, count, &io_main_spin))
+            ioSleepWhile(&io_main_sleeper[j], j, count);
+    }
+}
+
 void *IOThreadMain(void *myid) {
     /* The ID is the thread number (from 0 to server.iothreads_num-1), and is
      * used by the thread to just manipulate a single sub-array of clients. */
@@ -3471,44 +4164,38 @@ void *IOThreadMain(void *myid) {
     redisSetCpuAffinity(server.server_cpulist);
     makeThreadKillable();
 
-    while(1) {
-        /* Wait for start */
-        for (int j = 0; j < 1000000; j++) {
-            if (getIOPendingCount(id) != 0) break;
-        }
+    /* Commands executed from this thread only access the data set for
+     * reading, see processCommandInIOThread(). */
+    io_thread_stats = &io_threads_stats[id];
+    io_thread_released_objs = io_threads_released_objs[id];
+    dictDisableRehashStep();
 
-        /* Give the main thread a chance to stop this thread. */
-        if (getIOPendingCount(id) == 0) {
+    while(1) {
+        /* Wait for start: spin for a while, then sleep until the main
+         * thread gives us some clients. */
+        if (!ioSpinWhile(id, 0, &io_threads_spin[id])) {
+            /* Give the main thread a chance to stop this thread. */
             pthread_mutex_lock(&io_threads_mutex[id]);
             pthread_mutex_unlock(&io_threads_mutex[id]);
-            continue;
+            atomicIncr(io_threads_load[id].sleeps, 1);
+            ioSleepWhile(&io_threads_sleeper[id], id, 0);
         }
 
         serverAssert(getIOPendingCount(id) != 0);
 
         /* Process: note that the main thread will never touch our list
          * before we drop the pending count to 0. */
-        listIter li;
-        listNode *ln;
-        listRewind(io_threads_list[id],&li);
-        while((ln = listNext(&li))) {
-            client *c = listNodeValue(ln);
-            if (io_threads_op == IO_THREADS_OP_WRITE) {
-                writeToClient(c,0);
-            } else if (io_threads_op == IO_THREADS_OP_READ) {
-                readQueryFromClient(c->conn);
-            } else {
-                serverPanic("io_threads_op value is unknown");
-            }
-        }
-        listEmpty(io_threads_list[id]);
+        ioThreadServeList(id,io_threads_op);
         setIOPendingCount(id, 0);
+        ioWakeSleeper(&io_main_sleeper[id], id);
     }
 }
 
 /* Initialize the data structures needed for threaded I/O. */
 void initThreadedIO(void) {
     server.io_threads_active = 0; /* We start with threads not active. */
+    server.io_threads_active_num = server.io_threads_num;
+    io_threads_last_cron = getMonotonicUs();
 
     /* Don't spawn any thread if the user selected a single thread:
      * we'll handle I/O directly from the main thread. */
@@ -3524,11 +4211,18 @@ void initThreadedIO(void) {
     for (int i = 0; i < server.io_threads_num; i++) {
         /* Things we do for all the threads including the main thread. */
         io_threads_list[i] = listCreate();
+        io_threads_stats[i].errors = listCreate();
+        listSetFreeMethod(io_threads_stats[i].errors,(void (*)(void*))sdsfree);
+        io_threads_released_objs[i] = listCreate();
+        listSetFreeMethod(io_threads_released_objs[i],decrRefCountVoid);
         if (i == 0) continue; /* Thread 0 is the main thread. */
 
         /* Things we do only for the additional threads. */
         pthread_t tid;
         pthread_mutex_init(&io_threads_mutex[i],NULL);
+        ioSleeperInit(&io_threads_sleeper[i]);
+        ioSleeperInit(&io_main_sleeper[i]);
+        io_threads_spin[i] = IO_THREADS_SPIN_MIN;
         setIOPendingCount(i, 0);
         pthread_mutex_lock(&io_threads_mutex[i]); /* Thread will be stopped. */
         if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
@@ -3556,9 +4250,11 @@ void killIOThreads(void) {
     }
 }
 
+/* Only the first io_threads_active_num threads are started, the others stay
+ * stopped until ioThreadsCron() decides they are needed. */
 void startThreadedIO(void) {
     serverAssert(server.io_threads_active == 0);
-    for (int j = 1; j < server.io_threads_num; j++)
+    for (int j = 1; j < server.io_threads_active_num; j++)
         pthread_mutex_unlock(&io_threads_mutex[j]);
     server.io_threads_active = 1;
 }
@@ -3568,11 +4264,93 @@ void stopThreadedIO(void) {
      * is called: handle them before stopping the threads. */
     handleClientsWithPendingReadsUsingThreads();
     serverAssert(server.io_threads_active == 1);
-    for (int j = 1; j < server.io_threads_num; j++)
+    for (int j = 1; j < server.io_threads_active_num; j++)
         pthread_mutex_lock(&io_threads_mutex[j]);
     server.io_threads_active = 0;
 }
 
+/* Change the number of threads used to serve the clients, starting or
+ * stopping the threads entering or leaving the set if threaded I/O is
+ * currently active. Must be called while the threads are idle. */
+static void setActiveIOThreads(int num) {
+    int old = server.io_threads_active_num;
+    if (num == old) return;
+    if (server.io_threads_active) {
+        for (int j = num; j < old; j++)
+            pthread_mutex_lock(&io_threads_mutex[j]);
+        for (int j = old; j < num; j++)
+            pthread_mutex_unlock(&io_threads_mutex[j]);
+    }
+    server.io_threads_active_num = num;
+    serverLog(LL_VERBOSE,"Using %d I/O threads (was %d)", num, old);
+}
+
+/* Called by serverCron() to update the load of every thread and, when
+ * io-threads-adaptive is enabled, size the set of active threads after the
+ * total time spent doing I/O in the last period: more threads are activated
+ * at once when the load grows, while they are released one by one when it
+ * drops, so that short pauses in the traffic don't stop them all. */
+void ioThreadsCron(void) {
+    if (server.io_threads_num == 1) return;
+
+    monotime now = getMonotonicUs();
+    long long elapsed = now - io_threads_last_cron;
+    long long busy = 0;
+    if (elapsed <= 0) return;
+    io_threads_last_cron = now;
+
+    for (int j = 0; j < server.io_threads_num; j++) {
+        ioThreadLoad *load = &io_threads_load[j];
+        long long delta = load->busy_us - load->last_busy_us;
+        load->last_busy_us = load->busy_us;
+        load->utilization = (int)(delta*100/elapsed);
+        if (load->utilization > 100) load->utilization = 100;
+        busy += delta;
+    }
+
+    if (!server.io_threads_adaptive) {
+        setActiveIOThreads(server.io_threads_num);
+        return;
+    }
+
+    long long period = elapsed*IO_THREADS_TARGET_UTILIZATION;
+    long long needed = (busy*100 + period - 1) / period;
+    if (needed < 1) needed = 1;
+    if (needed > server.io_threads_num) needed = server.io_threads_num;
+    if (needed > server.io_threads_active_num)
+        setActiveIOThreads(needed);
+    else if (needed < server.io_threads_active_num)
+        setActiveIOThreads(server.io_threads_active_num-1);
+}
+
+/* Reset the counters reported by INFO threads, see resetServerStats(). */
+void resetIOThreadsStats(void) {
+    for (int j = 0; j < IO_THREADS_MAX_NUM; j++) {
+        io_threads_load[j].busy_us = io_threads_load[j].last_busy_us = 0;
+        io_threads_load[j].clients = io_threads_load[j].write_bytes = 0;
+        atomicSet(io_threads_load[j].sleeps, 0);
+    }
+}
+
+sds genIOThreadsInfoString(sds info) {
+    info = sdscatprintf(info,
+        "io_threads:%d\r\n"
+        "io_threads_active_num:%d\r\n",
+        server.io_threads_num,
+        server.io_threads_active_num);
+    for (int j = 0; j < server.io_threads_num; j++) {
+        ioThreadLoad *load = &io_threads_load[j];
+        long long sleeps;
+        atomicGet(load->sleeps, sleeps);
+        info = sdscatprintf(info,
+            "io_thread_%d:active=%d,utilization=%d,busy_usec=%lld,"
+            "clients=%lld,write_bytes=%lld,sleeps=%lld\r\n",
+            j, j < server.io_threads_active_num, load->utilization,
+            load->busy_us, load->clients, load->write_bytes, sleeps);
+    }
+    return info;
+}
+
 /* This function checks if there are not enough pending clients to justify
  * taking the I/O threads active: in that case I/O threads are stopped if
  * currently active. We track the pending writes as a measure of clients
@@ -3588,7 +4366,9 @@ int stopThreadedIOIfNeeded(void) {
     /* Return ASAP if IO threads are disabled (single threaded mode). */
     if (server.io_threads_num == 1) return 1;
 
-    if (pending < (server.io_threads_num*2)) {
+    if (server.io_threads_active_num == 1 ||
+        pending < (server.io_threads_active_num*2))
+    {
         if (server.io_threads_active) stopThreadedIO();
         return 1;
     } else {
@@ -3601,58 +4381,75 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     if (processed == 0) return 0; /* Return ASAP if there are no clients. */
 
     /* If I/O threads are disabled or we have few clients to serve, don't
-     * use I/O threads, but the boring synchronous code. */
-    if (server.io_threads_num == 1 || stopThreadedIOIfNeeded()) {
-        return handleClientsWithPendingWrites();
+     * use I/O threads, but the boring synchronous code. The time spent is
+     * still accounted to the main thread, so that ioThreadsCron() can
+     * activate the threads when the load grows. */
+    if (server.io_threads_num == 1) return handleClientsWithPendingWrites();
+    if (stopThreadedIOIfNeeded()) {
+        monotime start = getMonotonicUs();
+        processed = handleClientsWithPendingWrites();
+        io_threads_load[0].busy_us += getMonotonicUs() - start;
+        io_threads_load[0].clients += processed;
+        return processed;
     }
 
     /* Start threads if needed. */
     if (!server.io_threads_active) startThreadedIO();
 
-    /* Distribute the clients across N different lists. */
+    /* Distribute the clients across N different lists: every client goes
+     * to the thread with the least pending bytes assigned so far, so that
+     * clients receiving big replies don't end in the same thread while the
+     * others are idle. */
+    unsigned long long assigned[IO_THREADS_MAX_NUM];
+    int threads = server.io_threads_active_num;
     listIter li;
     listNode *ln;
+    memset(assigned,0,sizeof(assigned[0])*threads);
     listRewind(server.clients_pending_write,&li);
-    int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
         c->flags &= ~CLIENT_PENDING_WRITE;
 
         /* Remove clients from the list of pending writes since
-         * they are going to be closed ASAP. */
-        if (c->flags & CLIENT_CLOSE_ASAP) {
+         * they are going to be closed ASAP, or are queued again once
+         * the AOF fsync they wait for is done. */
+        if (c->flags & CLIENT_CLOSE_ASAP || clientWaitsAofFsync(c)) {
             listDelNode(server.clients_pending_write, ln);
             continue;
         }
 
-        int target_id = item_id % server.io_threads_num;
+        /* The replicas send the replication buffer, that is shared, so
+         * they are served by the main thread. */
+        if (c->ref_repl_buf_node) {
+            listAddNodeTail(io_threads_list[0],c);
+            continue;
+        }
+
+        size_t bytes = clientPendingWriteBytes(c);
+        int target_id = 0;
+        for (int j = 1; j < threads; j++)
+            if (assigned[j] < assigned[target_id]) target_id = j;
+        assigned[target_id] += bytes + IO_THREADS_CLIENT_COST;
+        io_threads_load[target_id].write_bytes += bytes;
         listAddNodeTail(io_threads_list[target_id],c);
-        item_id++;
     }
 
     /* Give the start condition to the waiting threads, by setting the
      * start condition atomic var. */
     io_threads_op = IO_THREADS_OP_WRITE;
-    for (int j = 1; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        setIOPendingCount(j, count);
-    }
+    ioThreadsDispatch(threads);
 
     /* Also use the main thread to process a slice of clients. */
-    listRewind(io_threads_list[0],&li);
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
-        writeToClient(c,0);
-    }
-    listEmpty(io_threads_list[0]);
+    io_thread_released_objs = io_threads_released_objs[0];
+    ioThreadServeList(0,IO_THREADS_OP_WRITE);
+    io_thread_released_objs = NULL;
 
     /* Wait for all the other threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 1; j < server.io_threads_num; j++)
-            pending += getIOPendingCount(j);
-        if (pending == 0) break;
-    }
+    ioThreadsWaitDone(threads);
+
+    /* Release the objects the sent replies were referencing. */
+    for (int j = 0; j < threads; j++)
+        listEmpty(io_threads_released_objs[j]);
 
     /* Run the list of clients again to install the write handler where
      * needed. */
@@ -3676,6 +4473,38 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     return processed;
 }
 
+/* Called in the context of an IO thread executing a command that replied
+ * with the error 'code': remember it so that the main thread can update
+ * the error stats later, see ioThreadsMergeStats(). */
+void ioThreadStatsAddErrorReply(const char *code, size_t len) {
+    io_thread_stats->error_replies++;
+    listAddNodeTail(io_thread_stats->errors,sdsnewlen(code,len));
+}
+
+/* Merge the stats accumulated by the commands executed from the IO threads
+ * into the global ones. Must be called by the main thread while the IO
+ * threads are idle. */
+static void ioThreadsMergeStats(void) {
+    for (int j = 0; j < server.io_threads_num; j++) {
+        ioThreadStats *st = &io_threads_stats[j];
+        listIter li;
+        listNode *ln;
+
+        if (!st->keyspace_hits && !st->keyspace_misses && !st->error_replies)
+            continue;
+        server.stat_keyspace_hits += st->keyspace_hits;
+        server.stat_keyspace_misses += st->keyspace_misses;
+        listRewind(st->errors,&li);
+        while((ln = listNext(&li))) {
+            sds code = listNodeValue(ln);
+            server.stat_total_error_replies++;
+            incrementErrorCount(code,sdslen(code));
+        }
+        listEmpty(st->errors);
+        st->keyspace_hits = st->keyspace_misses = st->error_replies = 0;
+    }
+}
+
 /* Return 1 if we want to handle the client read later using threaded I/O.
  * This is called by the readable handler of the event loop.
  * As a side effect of calling this function the client is put in the
@@ -3705,42 +4534,57 @@ int handleClientsWithPendingReadsUsingThreads(void) {
     int processed = listLength(server.clients_pending_read);
     if (processed == 0) return 0;
 
-    /* Distribute the clients across N different lists. */
+    /* Distribute the clients across N different lists. The size of the
+     * query is not known before reading it, so here we just use the
+     * round robin. */
+    int threads = server.io_threads_active_num;
     listIter li;
     listNode *ln;
     listRewind(server.clients_pending_read,&li);
     int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
-        int target_id = item_id % server.io_threads_num;
+        int target_id = item_id % threads;
         listAddNodeTail(io_threads_list[target_id],c);
         item_id++;
     }
 
+    /* When the threads are allowed to execute commands, freeze the time
+     * used to evaluate keys expiration like call() does, so that all the
+     * threads see exactly the same data set. */
+    io_threads_do_commands = server.io_threads_do_commands &&
+                             ioThreadsCanExecuteCommands();
+    if (io_threads_do_commands && server.fixed_time_expire++ == 0)
+        updateCachedTime(0);
+
     /* Give the start condition to the waiting threads, by setting the
      * start condition atomic var. */
     io_threads_op = IO_THREADS_OP_READ;
-    for (int j = 1; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        setIOPendingCount(j, count);
-    }
+    ioThreadsDispatch(threads);
 
-    /* Also use the main thread to process a slice of clients. */
-    listRewind(io_threads_list[0],&li);
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
-        readQueryFromClient(c->conn);
+    /* Also use the main thread to process a slice of clients. While doing
+     * so it must behave exactly like the other threads. */
+    if (io_threads_do_commands) {
+        io_thread_stats = &io_threads_stats[0];
+        dictDisableRehashStep();
     }
-    listEmpty(io_threads_list[0]);
+    ioThreadServeList(0,IO_THREADS_OP_READ);
+    io_thread_stats = NULL;
+    dictEnableRehashStep();
 
     /* Wait for all the other threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 1; j < server.io_threads_num; j++)
-            pending += getIOPendingCount(j);
-        if (pending == 0) break;
+    ioThreadsWaitDone(threads);
+
+    if (io_threads_do_commands) {
+        server.fixed_time_expire--;
+        io_threads_do_commands = 0;
     }
 
+    /* Protocol errors replied while parsing the queries are collected in
+     * the thread stats as well, so merge them after every round, even when
+     * no command was executed. */
+    ioThreadsMergeStats();
+
     /* Run the list of clients again to process the new buffers. */
     while(listLength(server.clients_pending_read)) {
         ln = listFirst(server.clients_pending_read);
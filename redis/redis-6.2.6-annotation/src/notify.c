@@ -124,6 +124,7 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
         chan = sdscatsds(chan, key->ptr);
         chanobj = createObject(OBJ_STRING, chan);
         pubsubPublishMessage(chanobj, eventobj);
+        if (server.shards > 1) shardsPublish(chanobj, eventobj);
         decrRefCount(chanobj);
     }
 
@@ -136,6 +137,7 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
         chan = sdscatsds(chan, eventobj->ptr);
         chanobj = createObject(OBJ_STRING, chan);
         pubsubPublishMessage(chanobj, key);
+        if (server.shards > 1) shardsPublish(chanobj, key);
         decrRefCount(chanobj);
     }
     decrRefCount(eventobj);
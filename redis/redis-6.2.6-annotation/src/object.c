@@ -109,6 +109,45 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     return o;
 }
 
+#define viewObjectChunk(o) (*(queryBufChunk**)((o)+1))
+
+/* Create a string object with encoding OBJ_ENCODING_VIEW, that is an object
+ * where 's' is an sds string created in place inside the query buffer of a
+ * client, see processMultibulkBuffer(), so that the argument is not copied.
+ * The object holds a reference to the query buffer, and like EMBSTR strings
+ * its sds can't be modified in a way that reallocates it.
+ *
+ * Views only exist while the client executes the command: when the command
+ * vector is released, views still referenced somewhere else are converted
+ * into RAW objects, see unshareViewStringObject(). */
+robj *createViewStringObject(sds s, queryBufChunk *chunk) {
+    robj *o = zmalloc(sizeof(robj)+sizeof(queryBufChunk*));
+
+    o->type = OBJ_STRING;
+    o->encoding = OBJ_ENCODING_VIEW;
+    o->ptr = s;
+    o->refcount = 1;
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+        o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+    } else {
+        o->lru = LRU_CLOCK();
+    }
+    viewObjectChunk(o) = chunk;
+    chunk->refcount++;
+    return o;
+}
+
+/* Convert a VIEW object into a RAW one in place, copying the string, so that
+ * all the references to the object remain valid while the query buffer is
+ * released. Does nothing for other encodings. */
+void unshareViewStringObject(robj *o) {
+    if (o->encoding != OBJ_ENCODING_VIEW) return;
+    queryBufChunk *chunk = viewObjectChunk(o);
+    o->ptr = sdsnewlen(o->ptr,sdslen(o->ptr));
+    o->encoding = OBJ_ENCODING_RAW;
+    releaseQueryBufChunk(chunk);
+}
+
 /* Create a string object with EMBSTR encoding if it is smaller than
  * OBJ_ENCODING_EMBSTR_SIZE_LIMIT, otherwise the RAW encoding is
  * used.
@@ -215,6 +254,8 @@ robj *dupStringObject(const robj *o) {
         return createRawStringObject(o->ptr,sdslen(o->ptr));
     case OBJ_ENCODING_EMBSTR:
         return createEmbeddedStringObject(o->ptr,sdslen(o->ptr));
+    case OBJ_ENCODING_VIEW:
+        return createRawStringObject(o->ptr,sdslen(o->ptr));
     case OBJ_ENCODING_INT:
         d = createObject(OBJ_STRING, NULL);
         d->encoding = OBJ_ENCODING_INT;
@@ -233,13 +274,6 @@ robj *createQuicklistObject(void) {
     return o;
 }
 
-robj *createZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_LIST,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
-    return o;
-}
-
 robj *createSetObject(void) {
     dict *d = dictCreate(&setDictType,NULL);
     robj *o = createObject(OBJ_SET,d);
@@ -254,28 +288,54 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+robj *createRoaringObject(void) {
+    roaring *r = roaringNew();
+    robj *o = createObject(OBJ_SET,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    return o;
+}
+
+robj *createSetListpackObject(void) {
+    unsigned char *lp = lpNew(0);
+    robj *o = createObject(OBJ_SET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
+    return o;
+}
+
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
+    unsigned char *zl = lpNew(0);
     robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
 robj *createZsetObject(void) {
+    return createZsetObjectWithEncoding(server.zset_large_encoding);
+}
+
+/* Create an empty sorted set encoded as a skiplist or a btree. */
+robj *createZsetObjectWithEncoding(int encoding) {
     zset *zs = zmalloc(sizeof(*zs));
     robj *o;
 
     zs->dict = dictCreate(&zsetDictType,NULL);
-    zs->zsl = zslCreate();
     o = createObject(OBJ_ZSET,zs);
-    o->encoding = OBJ_ENCODING_SKIPLIST;
+    if (encoding == OBJ_ENCODING_BTREE) {
+        zs->zsl = NULL;
+        zs->zbt = zbtCreate();
+        o->encoding = OBJ_ENCODING_BTREE;
+    } else {
+        zs->zsl = zslCreate();
+        zs->zbt = NULL;
+        o->encoding = OBJ_ENCODING_SKIPLIST;
+    }
     return o;
 }
 
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+robj *createZsetListpackObject(void) {
+    unsigned char *lp = lpNew(0);
+    robj *o = createObject(OBJ_ZSET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -296,6 +356,8 @@ robj *createModuleObject(moduleType *mt, void *value) {
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_VIEW) {
+        releaseQueryBufChunk(viewObjectChunk(o));
     }
 }
 
@@ -315,6 +377,12 @@ void freeSetObject(robj *o) {
     case OBJ_ENCODING_INTSET:
         zfree(o->ptr);
         break;
+    case OBJ_ENCODING_ROARING:
+        roaringFree(o->ptr);
+        break;
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
+        break;
     default:
         serverPanic("Unknown set encoding type");
     }
@@ -329,8 +397,14 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_BTREE:
+        zs = o->ptr;
+        dictRelease(zs->dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
+        break;
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown sorted set encoding");
@@ -342,8 +416,8 @@ void freeHashObject(robj *o) {
     case OBJ_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown hash encoding type");
@@ -479,7 +553,7 @@ robj *tryObjectEncoding(robj *o) {
                 o->encoding = OBJ_ENCODING_INT;
                 o->ptr = (void*) value;
                 return o;
-            } else if (o->encoding == OBJ_ENCODING_EMBSTR) {
+            } else {
                 decrRefCount(o);
                 return createStringObjectFromLongLongForValue(value);
             }
@@ -767,9 +841,13 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_QUICKLIST: return "quicklist";
     case OBJ_ENCODING_ZIPLIST: return "ziplist";
     case OBJ_ENCODING_INTSET: return "intset";
+    case OBJ_ENCODING_ROARING: return "roaring";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
+    case OBJ_ENCODING_BTREE: return "btree";
     case OBJ_ENCODING_EMBSTR: return "embstr";
     case OBJ_ENCODING_STREAM: return "stream";
+    case OBJ_ENCODING_VIEW: return "view";
     default: return "unknown";
     }
 }
@@ -819,6 +897,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sdsZmallocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen(o->ptr)+2+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_VIEW) {
+            asize = sizeof(*o)+sizeof(queryBufChunk*);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -828,12 +908,10 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             quicklistNode *node = ql->head;
             asize = sizeof(*o)+sizeof(quicklist);
             do {
-                elesize += sizeof(quicklistNode)+ziplistBlobLen(node->zl);
+                elesize += sizeof(quicklistNode)+zmalloc_size(node->entry);
                 samples++;
             } while ((node = node->next) && samples < sample_size);
             asize += (double)elesize/samples*ql->len;
-        } else if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+ziplistBlobLen(o->ptr);
         } else {
             serverPanic("Unknown list encoding");
         }
@@ -852,12 +930,16 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             intset *is = o->ptr;
             asize = sizeof(*o)+sizeof(*is)+(size_t)is->encoding*is->length;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            asize = sizeof(*o)+roaringAllocSize(o->ptr);
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+lpBytes(o->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
@@ -872,12 +954,26 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 znode = znode->level[0].forward;
             }
             if (samples) asize += (double)elesize/samples*dictSize(d);
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            d = ((zset*)o->ptr)->dict;
+            zbtree *zbt = ((zset*)o->ptr)->zbt;
+            zbtreeIter it;
+            asize = sizeof(*o)+sizeof(zset)+sizeof(dict)+
+                    (sizeof(struct dictEntry*)*dictSlots(d))+
+                    zbtAllocSize(zbt)+dictSize(d)*sizeof(struct dictEntry);
+            if (zbtFirst(zbt,&it)) {
+                do {
+                    elesize += sdsZmallocSize(zbtIterEle(&it));
+                    samples++;
+                } while(samples < sample_size && zbtNext(&it));
+            }
+            if (samples) asize += (double)elesize/samples*dictSize(d);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -1007,16 +1103,25 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
 
     mem_total += server.initial_memory_usage;
 
-    mem = 0;
+    /* The replication buffer is shared by the backlog and the replicas: what
+     * exceeds the backlog size is only there for the replicas. */
+    if (listLength(server.slaves) &&
+        (long long)server.repl_buffer_mem > server.repl_backlog_size)
+    {
+        mh->repl_backlog = server.repl_backlog_size;
+        mh->clients_slaves = server.repl_buffer_mem - server.repl_backlog_size;
+    } else {
+        mh->repl_backlog = server.repl_buffer_mem;
+        mh->clients_slaves = 0;
+    }
     if (server.repl_backlog)
-        mem += zmalloc_size(server.repl_backlog);
-    mh->repl_backlog = mem;
-    mem_total += mem;
+        mh->repl_backlog += zmalloc_size(server.repl_backlog);
+    mem_total += mh->repl_backlog;
 
     /* Computing the memory used by the clients would be O(N) if done
      * here online. We use our values computed incrementally by
      * clientsCronTrackClientsMemUsage(). */
-    mh->clients_slaves = server.stat_clients_type_memory[CLIENT_TYPE_SLAVE];
+    mh->clients_slaves += server.stat_clients_type_memory[CLIENT_TYPE_SLAVE];
     mh->clients_normal = server.stat_clients_type_memory[CLIENT_TYPE_MASTER]+
                          server.stat_clients_type_memory[CLIENT_TYPE_PUBSUB]+
                          server.stat_clients_type_memory[CLIENT_TYPE_NORMAL];
@@ -1026,7 +1131,6 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mem = 0;
     if (server.aof_state != AOF_OFF) {
         mem += sdsZmallocSize(server.aof_buf);
-        mem += aofRewriteBufferSize();
     }
     mh->aof_buffer = mem;
     mem_total+=mem;
@@ -1351,8 +1455,8 @@ NULL
             return;
         }
         size_t usage = objectComputeSize(dictGetVal(de),samples);
-        usage += sdsZmallocSize(dictGetKey(de));
-        usage += sizeof(dictEntry);
+        /* The key (and the expire, if any) is embedded in the entry. */
+        usage += zmalloc_size(de);
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
@@ -1,4 +1,4 @@
-/* quicklist.c - A doubly linked list of ziplists
+/* quicklist.c - A doubly linked list of listpacks
  *
  * Copyright (c) 2014, Matt Stancliff <matt@genges.com>
  * All rights reserved.
@@ -32,9 +32,9 @@
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "config.h"
-#include "ziplist.h"
+#include "listpack.h"
 #include "util.h" /* for ll2string */
-#include "lzf.h"
+#include "compress.h"
 #include "redisassert.h"
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
@@ -56,14 +56,14 @@
  */
 static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
 
-/* Maximum size in bytes of any multi-element ziplist.
- * Larger values will live in their own isolated ziplists.
+/* Maximum size in bytes of any multi-element listpack.
+ * Larger values will live in their own isolated listpacks.
  * This is used only if we're limited by record count. when we're limited by
  * size, the maximum limit is bigger, but still safe.
  * 8k is a recommended / default size limit */
 #define SIZE_SAFETY_LIMIT 8192
 
-/* Minimum ziplist size in bytes for attempting compression. */
+/* Minimum listpack size in bytes for attempting compression. */
 #define MIN_COMPRESS_BYTES 48
 
 /* Minimum size reduction in bytes to store compressed quicklistNode data.
@@ -119,6 +119,16 @@ quicklist *quicklistCreate(void) {
     return quicklist;
 }
 
+/* Algorithm used to compress the nodes from now on, see
+ * quicklistSetCompressCodec(). Every node remembers its own algorithm, so
+ * changing it doesn't affect the nodes already compressed. */
+static int quicklist_compress_codec = COMPRESS_LZF;
+
+/* 设置之后压缩节点所用的压缩算法，已压缩的节点不受影响 */
+void quicklistSetCompressCodec(int codec) {
+    quicklist_compress_codec = codec;
+}
+
 #define COMPRESS_MAX ((1 << QL_COMP_BITS)-1)
 /* 设置quicklist参数compress */
 void quicklistSetCompressDepth(quicklist *quicklist, int compress) {
@@ -163,12 +173,13 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node = zmalloc(sizeof(*node));
 
     // 初始化结构体中的参数
-    node->zl = NULL;
+    node->entry = NULL;
     node->count = 0;
     node->sz = 0;
     node->next = node->prev = NULL;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
-    node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
+    node->codec = COMPRESS_LZF;
+    node->container = QUICKLIST_NODE_CONTAINER_PACKED;
     node->recompress = 0;
     return node;
 }
@@ -187,7 +198,7 @@ void quicklistRelease(quicklist *quicklist) {
     while (len--) {
         next = current->next;
 
-        zfree(current->zl);
+        zfree(current->entry);
         quicklist->count -= current->count;
 
         zfree(current);
@@ -199,14 +210,14 @@ void quicklistRelease(quicklist *quicklist) {
     zfree(quicklist);
 }
 
-/* Compress the ziplist in 'node' and update encoding details.
- * Returns 1 if ziplist compressed successfully.
- * Returns 0 if compression failed or if ziplist too small to compress. */
-/* 压缩node中的ziplist，并更新encoding
+/* Compress the listpack in 'node' and update encoding details.
+ * Returns 1 if listpack compressed successfully.
+ * Returns 0 if compression failed or if listpack too small to compress. */
+/* 压缩node中的listpack，并更新encoding
  *
  * 返回值：
- * 1 —— 成功压缩ziplist
- * 0 —— 压缩失败，或ziplist太小（不需要压缩）
+ * 1 —— 成功压缩listpack
+ * 0 —— 压缩失败，或listpack太小（不需要压缩）
  */
 REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
@@ -214,7 +225,7 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 #endif
 
     /* Don't bother compressing small values */
-    // ziplist太小（<48字节），不需要压缩
+    // listpack太小（<48字节），不需要压缩
     if (node->sz < MIN_COMPRESS_BYTES)
         return 0;
 
@@ -223,19 +234,20 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 
     /* Cancel if compression fails or doesn't compress small enough */
     // 如果压缩失败，或者压缩得不够，取消压缩，释放空间，返回0
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
+    if (((lzf->sz = compressData(quicklist_compress_codec, node->entry, node->sz,
+                                 lzf->compressed, node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+        /* compressData rejects compression if value not compressable. */
         zfree(lzf);
         return 0;
     }
-    // realloc，释放原来node的ziplist
+    // realloc，释放原来node的listpack
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
-    zfree(node->zl);
-    // node的ziplist变为压缩后的ziplist lzf，并更新encoding和recompress
-    node->zl = (unsigned char *)lzf;
-    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    zfree(node->entry);
+    // node的listpack变为压缩后的listpack lzf，并更新encoding和recompress
+    node->entry = (unsigned char *)lzf;
+    node->encoding = QUICKLIST_NODE_ENCODING_COMPRESSED;
+    node->codec = quicklist_compress_codec;
     node->recompress = 0;
     return 1;
 }
@@ -249,9 +261,9 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
         }                                                                      \
     } while (0)
 
-/* Uncompress the ziplist in 'node' and update encoding details.
+/* Uncompress the listpack in 'node' and update encoding details.
  * Returns 1 on successful decode, 0 on failure to decode. */
-/* 解压node中的ziplist，并更新encoding信息
+/* 解压node中的listpack，并更新encoding信息
  *
  * 返回值：
  * 1 —— 成功解压缩
@@ -265,36 +277,37 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
     // 分配空间
     void *decompressed = zmalloc(node->sz);
     // 取出quicklistNode指向的经过LZF压缩后的压缩列表
-    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    quicklistLZF *lzf = (quicklistLZF *)node->entry;
     // 尝试解压缩，如果失败，回收为了解压使用的空间
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (decompressData(node->codec, lzf->compressed, lzf->sz, decompressed,
+                       node->sz) == 0) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
     }
-    // 解压缩成功，将ziplistNode指向解压后的压缩列表，并更新encoding状态
+    // 解压缩成功，将quicklistNode指向解压后的压缩列表，并更新encoding状态
     zfree(lzf);
-    node->zl = decompressed;
+    node->entry = decompressed;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     return 1;
 }
 
 /* Decompress only compressed nodes. */
-/* 在节点被压缩的情况下，解压该节点中的ziplist */
+/* 在节点被压缩的情况下，解压该节点中的listpack */
 #define quicklistDecompressNode(_node)                                         \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
         }                                                                      \
     } while (0)
 
 /* Force node to not be immediately re-compresable */
-/* 在节点被压缩的情况下，解压该节点中的ziplist
+/* 在节点被压缩的情况下，解压该节点中的listpack
  * 设置recompress = 1，即要求节点不能马上被重新压缩
  */
 #define quicklistDecompressNodeForUse(_node)                                   \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
             (_node)->recompress = 1;                                           \
         }                                                                      \
@@ -308,7 +321,7 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
  * 返回值：lzf->sz，即LZF压缩后的数据占用的字节数
  */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
-    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    quicklistLZF *lzf = (quicklistLZF *)node->entry;
     *data = lzf->compressed;
     return lzf->sz;
 }
@@ -499,10 +512,10 @@ REDIS_STATIC void _quicklistInsertNodeAfter(quicklist *quicklist,
 /* 判断quicklist的装载因子fill的设置对于压缩列表内存大小的限制
  *
  * 只有在装载因子为负数的情况下才会对压缩列表内存大小进行限制
- * （为正数时限制的是每个ziplist最多包含的entry数量）
+ * （为正数时限制的是每个listpack最多包含的entry数量）
  *
  * 参数：
- * sz   —— quicklistNode中ziplist的字节数
+ * sz   —— quicklistNode中listpack的字节数
  * fill —— quicklist的属性fill，表示其每个节点允许的最大容量
  */
 REDIS_STATIC int
@@ -548,23 +561,25 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
     if (unlikely(!node))
         return 0;
 
-    int ziplist_overhead;
-    /* size of previous offset */
-    if (sz < 254)
-        ziplist_overhead = 1;
+    int listpack_overhead;
+    /* size of the encoding header */
+    if (sz < 64)
+        listpack_overhead = 1;
+    else if (likely(sz < 4096))
+        listpack_overhead = 2;
     else
-        ziplist_overhead = 5;
+        listpack_overhead = 5;
 
-    /* size of forward offset */
-    if (sz < 64)
-        ziplist_overhead += 1;
-    else if (likely(sz < 16384))
-        ziplist_overhead += 2;
+    /* size of the backlen, that covers the header and the string */
+    if (sz + listpack_overhead < 128)
+        listpack_overhead += 1;
+    else if (likely(sz + listpack_overhead < 16384))
+        listpack_overhead += 2;
     else
-        ziplist_overhead += 5;
+        listpack_overhead += 5;
 
     /* new_sz overestimates if 'sz' encodes to an integer type */
-    unsigned int new_sz = node->sz + sz + ziplist_overhead;
+    unsigned int new_sz = node->sz + sz + listpack_overhead;
     // 满足内存限制（fill为负数时）
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)))
         return 1;
@@ -573,7 +588,7 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
     // 不满足entry数量上限要求
     else if (!sizeMeetsSafetyLimit(new_sz))
         return 0;
-    // ziplistNode的entry数量满足要求
+    // quicklistNode的entry数量满足要求
     else if ((int)node->count < fill)
         return 1;
     else
@@ -592,10 +607,10 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
     if (!a || !b)
         return 0;
 
-    /* approximate merged ziplist size (- 11 to remove one ziplist
+    /* approximate merged listpack size (- 7 to remove one listpack
      * header/trailer) */
     // 合并后占用的字节数（去除重复计算的header）
-    unsigned int merge_sz = a->sz + b->sz - 11;
+    unsigned int merge_sz = a->sz + b->sz - 7;
     
     // 满足内存限制（fill<0时），允许合并
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)))
@@ -615,14 +630,14 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
 /* 更新quicklistNode中成员变量sz，即entry数量 */
 #define quicklistNodeUpdateSz(node)                                            \
     do {                                                                       \
-        (node)->sz = ziplistBlobLen((node)->zl);                               \
+        (node)->sz = lpBytes((node)->entry);                                  \
     } while (0)
 
 /* Add new entry to head node of quicklist.
  *
  * Returns 0 if used existing head.
  * Returns 1 if new head created. */
-/* 在quicklist的头节点插入一个新的ziplist entry
+/* 在quicklist的头节点插入一个新的listpack entry
  * 其数据为*value，长度为sz字节
  *
  * 返回值：
@@ -633,22 +648,21 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_head = quicklist->head;
     assert(sz < UINT32_MAX); /* TODO: add support for quicklist nodes that are sds encoded (not zipped) */
 
-    // quicklist头节点可以插入新的entry，直接用ziplist的结构插入
+    // quicklist头节点可以插入新的entry，直接用listpack的结构插入
     if (likely(
             _quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) {
         // 将值为*value，长度为sz的数据插入压缩列表的头
-        quicklist->head->zl =
-            ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
+        quicklist->head->entry = lpPrepend(quicklist->head->entry, value, sz);
 
         // 更新quicklistNode的成员变量sz
         quicklistNodeUpdateSz(quicklist->head);
-    // quicklist头节点不能继续插入新的entry，新建quicklistNode和ziplist
+    // quicklist头节点不能继续插入新的entry，新建quicklistNode和listpack
     } else {
         // 新建quicklistNode
         quicklistNode *node = quicklistCreateNode();
-        // 新建ziplist，将值为*value，长度为sz的数据插入压缩列表的头
+        // 新建listpack，将值为*value，长度为sz的数据插入压缩列表的头
         // 并将其赋给新建的quicklistNode node
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        node->entry = lpPrepend(lpNew(0), value, sz);
 
         // 更新quicklistNode的成员变量sz
         quicklistNodeUpdateSz(node);
@@ -664,7 +678,7 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
  *
  * Returns 0 if used existing tail.
  * Returns 1 if new tail created. */
-/* 在quicklist的尾节点插入一个新的ziplist entry
+/* 在quicklist的尾节点插入一个新的listpack entry
  * 其数据为*value，长度为sz字节
  *
  * 返回值：
@@ -676,12 +690,11 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     assert(sz < UINT32_MAX); /* TODO: add support for quicklist nodes that are sds encoded (not zipped) */
     if (likely(
             _quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
-        quicklist->tail->zl =
-            ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
+        quicklist->tail->entry = lpAppend(quicklist->tail->entry, value, sz);
         quicklistNodeUpdateSz(quicklist->tail);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->entry = lpAppend(lpNew(0), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
@@ -691,54 +704,55 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     return (orig_tail != quicklist->tail);
 }
 
-/* Create new node consisting of a pre-formed ziplist.
- * Used for loading RDBs where entire ziplists have been stored
+/* Create new node consisting of a pre-formed listpack.
+ * Used for loading RDBs where entire listpacks have been stored
  * to be retrieved later. */
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *zl) {
     quicklistNode *node = quicklistCreateNode();
 
-    node->zl = zl;
-    node->count = ziplistLen(node->zl);
-    node->sz = ziplistBlobLen(zl);
+    node->entry = zl;
+    node->count = lpLength(node->entry);
+    node->sz = lpBytes(zl);
 
     _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     quicklist->count += node->count;
 }
 
-/* Append all values of ziplist 'zl' individually into 'quicklist'.
+/* Append all values of listpack 'zl' individually into 'quicklist'.
  *
- * This allows us to restore old RDB ziplists into new quicklists
- * with smaller ziplist sizes than the saved RDB ziplist.
+ * This allows us to restore old RDB lists into new quicklists
+ * with smaller listpack sizes than the saved RDB list.
  *
- * Returns 'quicklist' argument. Frees passed-in ziplist 'zl' */
-quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
-                                            unsigned char *zl) {
+ * Returns 'quicklist' argument. Frees passed-in listpack 'zl' */
+quicklist *quicklistAppendValuesFromListpack(quicklist *quicklist,
+                                             unsigned char *zl) {
     unsigned char *value;
     unsigned int sz;
     long long longval;
     char longstr[32] = {0};
 
-    unsigned char *p = ziplistIndex(zl, 0);
-    while (ziplistGet(p, &value, &sz, &longval)) {
+    unsigned char *p = lpFirst(zl);
+    while (p) {
+        value = lpGetValue(p, &sz, &longval);
         if (!value) {
             /* Write the longval as a string so we can re-add it */
             sz = ll2string(longstr, sizeof(longstr), longval);
             value = (unsigned char *)longstr;
         }
         quicklistPushTail(quicklist, value, sz);
-        p = ziplistNext(zl, p);
+        p = lpNext(zl, p);
     }
-    zfree(zl);
+    lpFree(zl);
     return quicklist;
 }
 
-/* Create new (potentially multi-node) quicklist from a single existing ziplist.
+/* Create new (potentially multi-node) quicklist from a single existing listpack.
  *
- * Returns new quicklist.  Frees passed-in ziplist 'zl'. */
+ * Returns new quicklist.  Frees passed-in listpack 'zl'. */
 /* 根据参数fill、compress创造新的quicklist，并将zl添加到quicklist */
-quicklist *quicklistCreateFromZiplist(int fill, int compress,
-                                      unsigned char *zl) {
-    return quicklistAppendValuesFromZiplist(quicklistNew(fill, compress), zl);
+quicklist *quicklistCreateFromListpack(int fill, int compress,
+                                       unsigned char *zl) {
+    return quicklistAppendValuesFromListpack(quicklistNew(fill, compress), zl);
 }
 
 /* 如果quicklistNode中entry数量为0，删除该节点 */
@@ -790,8 +804,8 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
     // 删除节点后保证quicklist满足压缩深度要求
     __quicklistCompress(quicklist, NULL);
 
-    // 释放节点的ziplist和节点本身
-    zfree(node->zl);
+    // 释放节点的listpack和节点本身
+    zfree(node->entry);
     zfree(node);
 }
 
@@ -802,7 +816,8 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
  *       already had to get *p from an uncompressed node somewhere.
  *
  * Returns 1 if the entire node was deleted, 0 if node still exists.
- * Also updates in/out param 'p' with the next offset in the ziplist. */
+ * Also updates in/out param 'p' with the next offset in the listpack,
+ * or NULL if the deleted entry was the last one of the node. */
 
 /* 删除指定位置的元素
  * 
@@ -819,13 +834,13 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
     int gone = 0;
 
     // 删除元素p，p指向的位置随之更新
-    node->zl = ziplistDelete(node->zl, p);
+    node->entry = lpDelete(node->entry, *p, p);
     node->count--;
-    // 如果quicklistNode中的ziplist中保存的entry数为0，删除节点
+    // 如果quicklistNode中的listpack中保存的entry数为0，删除节点
     if (node->count == 0) {
         gone = 1;
         __quicklistDelNode(quicklist, node);
-    // 如果ziplist中还有entry，更新quicklistNode->sz
+    // 如果listpack中还有entry，更新quicklistNode->sz
     } else {
         quicklistNodeUpdateSz(node);
     }
@@ -837,11 +852,11 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
 /* Delete one element represented by 'entry'
  *
  * 'entry' stores enough metadata to delete the proper position in
- * the correct ziplist in the correct quicklist node. */
+ * the correct listpack in the correct quicklist node. */
 
 /* 删除一个由entry表示的元素
  *
- * entry中存有足够的信息用于在正确的quicklistNode中找到ziplist中删除的位置的元素
+ * entry中存有足够的信息用于在正确的quicklistNode中找到listpack中删除的位置的元素
  */
 void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
     // 记录entry所在quicklistNode前后quicklistNode
@@ -875,7 +890,7 @@ void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
      *   - [1, 2, 3] => delete offset 1 => [1, 3]: next element still offset 1
      *   - [1, 2, 3] => delete offset 0 => [2, 3]: next element still offset 0
      *  if we deleted the last element at offet N and now
-     *  length of this ziplist is N-1, the next call into
+     *  length of this listpack is N-1, the next call into
      *  quicklistNext() will jump to the next node. */
 }
 
@@ -896,7 +911,7 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     if (likely(quicklistIndex(quicklist, index, &entry))) {
         /* quicklistIndex provides an uncompressed node */
         // 用指定数据替换指定entry
-        entry.node->zl = ziplistReplace(entry.node->zl, entry.zi, data, sz);
+        entry.node->entry = lpReplace(entry.node->entry, &entry.zi, data, sz);
         // 更新quicklistNode的entry数量
         quicklistNodeUpdateSz(entry.node);
         // 重新压缩节点
@@ -907,9 +922,9 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     }
 }
 
-/* Given two nodes, try to merge their ziplists.
+/* Given two nodes, try to merge their listpacks.
  *
- * This helps us not have a quicklist with 3 element ziplists if
+ * This helps us not have a quicklist with 3 element listpacks if
  * our fill factor can handle much higher levels.
  *
  * Note: 'a' must be to the LEFT of 'b'.
@@ -925,7 +940,7 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
  *
  * 合并失败，返回NULL
  */
-REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
+REDIS_STATIC quicklistNode *_quicklistListpackMerge(quicklist *quicklist,
                                                    quicklistNode *a,
                                                    quicklistNode *b) {
     D("Requested merge (a,b) (%u, %u)", a->count, b->count);
@@ -935,21 +950,21 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
     quicklistDecompressNode(b);
 
     // 尝试合并压缩列表，如果合并成功
-    if ((ziplistMerge(&a->zl, &b->zl))) {
-        /* We merged ziplists! Now remove the unused quicklistNode. */
-        // 调用ziplistMerge(&a->zl, &b->zl)之后，如果合并成功，a->zl和b->zl有一个为合并后的压缩列表，另一个为NULL
+    if ((lpMerge(&a->entry, &b->entry))) {
+        /* We merged listpacks! Now remove the unused quicklistNode. */
+        // 调用lpMerge(&a->entry, &b->entry)之后，如果合并成功，a->entry和b->entry有一个为合并后的listpack，另一个为NULL
         quicklistNode *keep = NULL, *nokeep = NULL;
         // 获取合并后的压缩列表到keep
-        if (!a->zl) {
+        if (!a->entry) {
             nokeep = a;
             keep = b;
-        } else if (!b->zl) {
+        } else if (!b->entry) {
             nokeep = b;
             keep = a;
         }
         // 更新quicklistNode中entry数量
-        keep->count = ziplistLen(keep->zl);
-        // 更新quicklistNode中ziplist占用的字节数sz
+        keep->count = lpLength(keep->entry);
+        // 更新quicklistNode中listpack占用的字节数sz
         quicklistNodeUpdateSz(keep);
 
         // 更新压缩列表已被删除的quicklistNode的entry数量，并删除该节点
@@ -965,7 +980,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
     }
 }
 
-/* Attempt to merge ziplists within two nodes on either side of 'center'.
+/* Attempt to merge listpacks within two nodes on either side of 'center'.
  *
  * We attempt to merge:
  *   - (center->prev->prev, center->prev)
@@ -1005,21 +1020,21 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
     /* Try to merge prev_prev and prev */
     // 合并center->prev->prev和center->prev
     if (_quicklistNodeAllowMerge(prev, prev_prev, fill)) {
-        _quicklistZiplistMerge(quicklist, prev_prev, prev);
+        _quicklistListpackMerge(quicklist, prev_prev, prev);
         prev_prev = prev = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge next and next_next */
     // 合并center->next和center->next->next
     if (_quicklistNodeAllowMerge(next, next_next, fill)) {
-        _quicklistZiplistMerge(quicklist, next, next_next);
+        _quicklistListpackMerge(quicklist, next, next_next);
         next = next_next = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge center node and previous node */
     // 合并center->prev和center
     if (_quicklistNodeAllowMerge(center, center->prev, fill)) {
-        target = _quicklistZiplistMerge(quicklist, center->prev, center);
+        target = _quicklistListpackMerge(quicklist, center->prev, center);
         center = NULL; /* center could have been deleted, invalidate it. */
     } else {
         /* else, we didn't merge here, but target needs to be valid below. */
@@ -1029,7 +1044,7 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
     /* Use result of center merge (or original) to merge with next node. */
     // 合并center和center->next
     if (_quicklistNodeAllowMerge(target, target->next, fill)) {
-        _quicklistZiplistMerge(quicklist, target, target->next);
+        _quicklistListpackMerge(quicklist, target, target->next);
     }
 }
 
@@ -1065,14 +1080,14 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
 
     // 新建quicklistNode，并分配空间
     quicklistNode *new_node = quicklistCreateNode();
-    new_node->zl = zmalloc(zl_sz);
+    new_node->entry = zmalloc(zl_sz);
 
-    /* Copy original ziplist so we can split it */
-    // 将原节点的ziplist拷贝到新的quicklistNode
-    memcpy(new_node->zl, node->zl, zl_sz);
+    /* Copy original listpack so we can split it */
+    // 将原节点的listpack拷贝到新的quicklistNode
+    memcpy(new_node->entry, node->entry, zl_sz);
 
     /* Ranges to be trimmed: -1 here means "continue deleting until the list ends" */
-    // 根据after的参数计算两个ziplist（要删除）的范围
+    // 根据after的参数计算两个listpack（要删除）的范围
     // _extent表示长度，-1表示直至list结束
     int orig_start = after ? offset + 1 : 0;
     int orig_extent = after ? -1 : offset;
@@ -1082,15 +1097,15 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     D("After %d (%d); ranges: [%d, %d], [%d, %d]", after, offset, orig_start,
       orig_extent, new_start, new_extent);
 
-    // 旧节点ziplist处理（删除多余的部分，并更新参数）
+    // 旧节点listpack处理（删除多余的部分，并更新参数）
     // after == 1，start = offset + 1，extent = -1，即
-    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent);
-    node->count = ziplistLen(node->zl);
+    node->entry = lpDeleteRange(node->entry, orig_start, orig_extent);
+    node->count = lpLength(node->entry);
     quicklistNodeUpdateSz(node);
 
-    // 新节点ziplist处理（删除多余的部分，并更新参数）
-    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent);
-    new_node->count = ziplistLen(new_node->zl);
+    // 新节点listpack处理（删除多余的部分，并更新参数）
+    new_node->entry = lpDeleteRange(new_node->entry, new_start, new_extent);
+    new_node->count = lpLength(new_node->entry);
     quicklistNodeUpdateSz(new_node);
 
     D("After split lengths: orig (%d), new (%d)", node->count, new_node->count);
@@ -1122,9 +1137,9 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("No node given!");
         // 新建quicklistNode
         new_node = quicklistCreateNode();
-        // 创建新的ziplist，并向其头部插入一个新的entry（值为value，长度为sz）
-        // 新的quicklistNode指向这个新建的ziplist
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        // 创建新的listpack，并向其头部插入一个新的entry（值为value，长度为sz）
+        // 新的quicklistNode指向这个新建的listpack
+        new_node->entry = lpPrepend(lpNew(0), value, sz);
         // 向quicklist插入新的quicklistNode(old_node == NULL)
         __quicklistInsertNode(quicklist, NULL, new_node, after);
         // 更新quicklist以及quicklistNode的entry数量计数
@@ -1143,10 +1158,10 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         full = 1;
     }
 
-    // after = 1且entry为ziplist最后一个entry，at_tail = 1
+    // after = 1且entry为listpack最后一个entry，at_tail = 1
     // 判断node的后一个quicklistNode能不能插入。如果满了，full_next = 1
     if (after && (entry->offset == node->count)) {
-        D("At Tail of current ziplist");
+        D("At Tail of current listpack");
         at_tail = 1;
         if (!_quicklistNodeAllowInsert(node->next, fill, sz)) {
             D("Next node is full too.");
@@ -1154,7 +1169,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         }
     }
 
-    // after = 0且entry为ziplist第一个entry，at_head = 1
+    // after = 0且entry为listpack第一个entry，at_head = 1
     // 判断node的前一个quicklistNode能否插入。如果满了，full_prev = 1
     if (!after && (entry->offset == 0)) {
         D("At Head");
@@ -1171,25 +1186,25 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     // case1：当前node可插入，且在entry后插入
     if (!full && after) {
         D("Not full, inserting after current position.");
-        // 解压节点中的ziplist
+        // 解压节点中的listpack
         quicklistDecompressNodeForUse(node);
         // 查找插入位置
-        unsigned char *next = ziplistNext(node->zl, entry->zi);
-        // 将新的entry插入ziplist（区分插入尾节点/其他节点的情况）
+        unsigned char *next = lpNext(node->entry, entry->zi);
+        // 将新的entry插入listpack（区分插入尾节点/其他节点的情况）
         if (next == NULL) {
-            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
+            node->entry = lpAppend(node->entry, value, sz);
         } else {
-            node->zl = ziplistInsert(node->zl, next, value, sz);
+            node->entry = lpInsert(node->entry, value, sz, next, LP_BEFORE, NULL);
         }
         node->count++;
         quicklistNodeUpdateSz(node);
-        // 重新压缩节点中的ziplist
+        // 重新压缩节点中的listpack
         quicklistRecompressOnly(quicklist, node);
     // case2：当前node可插入，且在entry前插入
     } else if (!full && !after) {
         D("Not full, inserting before current position.");
         quicklistDecompressNodeForUse(node);
-        node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        node->entry = lpInsert(node->entry, value, sz, entry->zi, LP_BEFORE, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
@@ -1201,7 +1216,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and tail, but next isn't full; inserting next node head");
         new_node = node->next;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        new_node->entry = lpPrepend(new_node->entry, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -1213,7 +1228,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and head, but prev isn't full, inserting prev node tail");
         new_node = node->prev;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        new_node->entry = lpAppend(new_node->entry, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -1227,7 +1242,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
          *   - create new node and attach to quicklist */
         D("\tprovisioning new node...");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->entry = lpPrepend(lpNew(0), value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -1245,8 +1260,10 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         // 插入entry
         // after = 1，插入[offset+1, end]之前，即offset之后
         // after = 0，插入[0, offset - 1]之后，即offset之前
-        new_node->zl = ziplistPush(new_node->zl, value, sz,
-                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        if (after)
+            new_node->entry = lpPrepend(new_node->entry, value, sz);
+        else
+            new_node->entry = lpAppend(new_node->entry, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         // 把split后的新节点插入quicklist
@@ -1323,7 +1340,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
         // 需要删除整个节点
         if (entry.offset == 0 && extent >= node->count) {
             /* If we are deleting more than the count of this node, we
-             * can just delete the entire node without ziplist math. */
+             * can just delete the entire node without listpack math. */
             delete_entire_node = 1;
             del = node->count;
         // 要删除的offset+要删除的元素数量比当前节点的entry数量多
@@ -1367,7 +1384,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
             // 临时解压
             quicklistDecompressNodeForUse(node);
             // 从offset开始删除del个元素
-            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
+            node->entry = lpDeleteRange(node->entry, entry.offset, del);
             // 更新quicklistNode相关成员变量
             quicklistNodeUpdateSz(node);
             node->count -= del;
@@ -1385,15 +1402,15 @@ int quicklistDelRange(quicklist *quicklist, const long start,
         // 指向下一个节点
         node = next;
 
-        // 偏移量改为0，因为需要从下一个节点ziplist中的第一个entry开始删除
+        // 偏移量改为0，因为需要从下一个节点listpack中的第一个entry开始删除
         entry.offset = 0;
     }
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
+/* Passthrough to lpCompare() */
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
-    return ziplistCompare(p1, p2, p2_len);
+    return lpCompare(p1, p2, p2_len);
 }
 
 /* Returns a quicklist iterator 'iter'. After the initialization every
@@ -1536,20 +1553,20 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
         // 解压当前节点
         quicklistDecompressNodeForUse(iter->current);
         // 指向当前压缩列表偏移量
-        iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+        iter->zi = lpSeek(iter->current->entry, iter->offset);
     // 迭代器指向压缩列表位置存在（说明当前node是解压状态）
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
         // 根据方向，指定查找下一个元素的函数
         if (iter->direction == AL_START_HEAD) {
-            nextFn = ziplistNext;
+            nextFn = lpNext;
             offset_update = 1;
         } else if (iter->direction == AL_START_TAIL) {
-            nextFn = ziplistPrev;
+            nextFn = lpPrev;
             offset_update = -1;
         }
         // 获取下一个元素以及下一个元素对应的偏移量
-        iter->zi = nextFn(iter->current->zl, iter->zi);
+        iter->zi = nextFn(iter->current->entry, iter->zi);
         iter->offset += offset_update;
     }
 
@@ -1559,14 +1576,14 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
 
     // 找到位置，获取entry信息，并返回1
     if (iter->zi) {
-        /* Populate value from existing ziplist position */
-        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        /* Populate value from existing listpack position */
+        entry->value = lpGetValue(entry->zi, &entry->sz, &entry->longval);
         return 1;
-    // 当前ziplist已遍历完，获取下一个节点，更新偏移量，重新运行本函数
+    // 当前listpack已遍历完，获取下一个节点，更新偏移量，重新运行本函数
     } else {
-        /* We ran out of ziplist entries.
+        /* We ran out of listpack entries.
          * Pick next node, update offset, then re-run retrieval. */
-        // 当前ziplist已遍历完，因此可以压缩当前节点
+        // 当前listpack已遍历完，因此可以压缩当前节点
         quicklistCompress(iter->quicklist, iter->current);
         // 根据遍历方向寻找下一个quicklistNode
         if (iter->direction == AL_START_HEAD) {
@@ -1602,20 +1619,21 @@ quicklist *quicklistDup(quicklist *orig) {
          current = current->next) {
         quicklistNode *node = quicklistCreateNode();
 
-        if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
-            quicklistLZF *lzf = (quicklistLZF *)current->zl;
+        if (current->encoding == QUICKLIST_NODE_ENCODING_COMPRESSED) {
+            quicklistLZF *lzf = (quicklistLZF *)current->entry;
             size_t lzf_sz = sizeof(*lzf) + lzf->sz;
-            node->zl = zmalloc(lzf_sz);
-            memcpy(node->zl, current->zl, lzf_sz);
+            node->entry = zmalloc(lzf_sz);
+            memcpy(node->entry, current->entry, lzf_sz);
         } else if (current->encoding == QUICKLIST_NODE_ENCODING_RAW) {
-            node->zl = zmalloc(current->sz);
-            memcpy(node->zl, current->zl, current->sz);
+            node->entry = zmalloc(current->sz);
+            memcpy(node->entry, current->entry, current->sz);
         }
 
         node->count = current->count;
         copy->count += node->count;
         node->sz = current->sz;
         node->encoding = current->encoding;
+        node->codec = current->codec;
 
         _quicklistInsertNodeAfter(copy, copy->tail, node);
     }
@@ -1706,10 +1724,11 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     // 解压
     quicklistDecompressNodeForUse(entry->node);
     // 根据offset找压缩列表中对应的entry的地址
-    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
+    entry->zi = lpSeek(entry->node->entry, entry->offset);
     // 获取元素的值，到quicklistEntry的成员变量中
-    if (!ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval))
-        assert(0); /* This can happen on corrupt ziplist with fake entry count. */
+    if (!entry->zi)
+        assert(0); /* This can happen on corrupt listpack with fake entry count. */
+    entry->value = lpGetValue(entry->zi, &entry->sz, &entry->longval);
     /* The caller will use our result, so we don't re-compress here.
      * The caller can recompress or delete the node as needed. */
     // 此处没有压缩，因为调用者需要使用返回的结果
@@ -1723,21 +1742,21 @@ void quicklistRotate(quicklist *quicklist) {
         return;
 
     /* First, get the tail entry */
-    unsigned char *p = ziplistIndex(quicklist->tail->zl, -1);
+    unsigned char *p = lpSeek(quicklist->tail->entry, -1);
     unsigned char *value, *tmp;
     long long longval;
     unsigned int sz;
     char longstr[32] = {0};
-    ziplistGet(p, &tmp, &sz, &longval);
+    tmp = lpGetValue(p, &sz, &longval);
 
-    /* If value found is NULL, then ziplistGet populated longval instead */
+    /* If value found is NULL, then lpGetValue populated longval instead */
     if (!tmp) {
         /* Write the longval as a string so we can re-add it */
         sz = ll2string(longstr, sizeof(longstr), longval);
         value = (unsigned char *)longstr;
     } else if (quicklist->len == 1) {
         /* Copy buffer since there could be a memory overlap when move
-         * entity from tail to head in the same ziplist. */
+         * entity from tail to head in the same listpack. */
         value = zmalloc(sz);
         memcpy(value, tmp, sz);
     } else {
@@ -1747,11 +1766,11 @@ void quicklistRotate(quicklist *quicklist) {
     /* Add tail entry to head (must happen before tail is deleted). */
     quicklistPushHead(quicklist, value, sz);
 
-    /* If quicklist has only one node, the head ziplist is also the
-     * tail ziplist and PushHead() could have reallocated our single ziplist,
+    /* If quicklist has only one node, the head listpack is also the
+     * tail listpack and PushHead() could have reallocated our single listpack,
      * which would make our pre-existing 'p' unusable. */
     if (quicklist->len == 1) {
-        p = ziplistIndex(quicklist->tail->zl, -1);
+        p = lpSeek(quicklist->tail->entry, -1);
     }
 
     /* Remove tail entry. */
@@ -1812,10 +1831,11 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
         return 0;
     }
 
-    // 根据索引找到ziplist中对应的entry
-    p = ziplistIndex(node->zl, pos);
-    // 从ziplist取回entry的值
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+    // 根据索引找到listpack中对应的entry
+    p = lpSeek(node->entry, pos);
+    // 从listpack取回entry的值
+    if (p) {
+        vstr = lpGetValue(p, &vlen, &vlong);
         // string
         if (vstr) {
             if (data)
@@ -1854,7 +1874,7 @@ REDIS_STATIC void *_quicklistSaver(unsigned char *data, unsigned int sz) {
 
 /* 用于将头部或尾部元素弹出
  *
- * data和sz用于存储ziplist中的字符串数据，slong用于存储整型数据
+ * data和sz用于存储listpack中的字符串数据，slong用于存储整型数据
  *
  * 返回值：
  * 0 —— pop失败
@@ -2007,9 +2027,9 @@ static void ql_info(quicklist *ql) {
     printf("Container length: %lu\n", ql->len);
     printf("Container size: %lu\n", ql->count);
     if (ql->head)
-        printf("\t(zsize head: %d)\n", ziplistLen(ql->head->zl));
+        printf("\t(zsize head: %d)\n", lpLength(ql->head->entry));
     if (ql->tail)
-        printf("\t(zsize tail: %d)\n", ziplistLen(ql->tail->zl));
+        printf("\t(zsize tail: %d)\n", lpLength(ql->tail->entry));
     printf("\n");
 #else
     UNUSED(ql);
@@ -2106,18 +2126,18 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
     }
 
     if (ql->head && head_count != ql->head->count &&
-        head_count != ziplistLen(ql->head->zl)) {
+        head_count != lpLength(ql->head->entry)) {
         yell("quicklist head count wrong: expected %d, "
              "got cached %d vs. actual %d",
-             head_count, ql->head->count, ziplistLen(ql->head->zl));
+             head_count, ql->head->count, lpLength(ql->head->entry));
         errors++;
     }
 
     if (ql->tail && tail_count != ql->tail->count &&
-        tail_count != ziplistLen(ql->tail->zl)) {
+        tail_count != lpLength(ql->tail->entry)) {
         yell("quicklist tail count wrong: expected %d, "
              "got cached %u vs. actual %d",
-             tail_count, ql->tail->count, ziplistLen(ql->tail->zl));
+             tail_count, ql->tail->count, lpLength(ql->tail->entry));
         errors++;
     }
 
@@ -2137,7 +2157,7 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
                     errors++;
                 }
             } else {
-                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF &&
+                if (node->encoding != QUICKLIST_NODE_ENCODING_COMPRESSED &&
                     !node->attempted_compress) {
                     yell("Incorrect non-compression: node %d is NOT "
                          "compressed at depth %d ((%u, %u); total "
@@ -2269,7 +2289,7 @@ int quicklistTest(int argc, char *argv[], int accurate) {
                 quicklist *ql = quicklistNew(fills[f], options[_i]);
                 quicklistPushHead(ql, "hello", 6);
                 quicklistRotate(ql);
-                /* Ignore compression verify because ziplist is
+                /* Ignore compression verify because listpack is
                  * too small to compress. */
                 ql_verify(ql, 1, 1, 1, 1);
                 quicklistRelease(ql);
@@ -3081,22 +3101,20 @@ int quicklistTest(int argc, char *argv[], int accurate) {
             }
         }
 
-        TEST_DESC("create quicklist from ziplist at compress %d", options[_i]) {
+        TEST_DESC("create quicklist from listpack at compress %d", options[_i]) {
             for (int f = 0; f < fill_count; f++) {
-                unsigned char *zl = ziplistNew();
+                unsigned char *zl = lpNew(0);
                 long long nums[64];
                 char num[64];
                 for (int i = 0; i < 33; i++) {
                     nums[i] = -5157318210846258176 + i;
                     int sz = ll2string(num, sizeof(num), nums[i]);
-                    zl =
-                        ziplistPush(zl, (unsigned char *)num, sz, ZIPLIST_TAIL);
+                    zl = lpAppend(zl, (unsigned char *)num, sz);
                 }
                 for (int i = 0; i < 33; i++) {
-                    zl = ziplistPush(zl, (unsigned char *)genstr("hello", i),
-                                     32, ZIPLIST_TAIL);
+                    zl = lpAppend(zl, (unsigned char *)genstr("hello", i), 32);
                 }
-                quicklist *ql = quicklistCreateFromZiplist(fills[f], options[_i], zl);
+                quicklist *ql = quicklistCreateFromListpack(fills[f], options[_i], zl);
                 if (fills[f] == 1)
                     ql_verify(ql, 66, 66, 1, 1);
                 else if (fills[f] == 32)
@@ -3153,7 +3171,7 @@ int quicklistTest(int argc, char *argv[], int accurate) {
                                         node->sz);
                                 }
                             } else {
-                                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF) {
+                                if (node->encoding != QUICKLIST_NODE_ENCODING_COMPRESSED) {
                                     ERR("Incorrect non-compression: node %d is NOT "
                                         "compressed at depth %d ((%u, %u); total "
                                         "nodes: %lu; size: %u; attempted: %d)",
@@ -35,14 +35,15 @@
 
 /* Node, quicklist, and Iterator are the only data structures used currently. */
 
-/* quicklistNode is a 32 byte struct describing a ziplist for a quicklist.
+/* quicklistNode is a 32 byte struct describing a listpack for a quicklist.
  * We use bit fields keep the quicklistNode at 32 bytes.
- * count: 16 bits, max 65536 (max zl bytes is 65k, so max count actually < 32k).
- * encoding: 2 bits, RAW=1, LZF=2.
- * container: 2 bits, NONE=1, ZIPLIST=2.
+ * count: 16 bits, max 65536 (max lp bytes is 65k, so max count actually < 32k).
+ * encoding: 2 bits, RAW=1, COMPRESSED=2.
+ * container: 2 bits, NONE=1, PACKED=2.
  * recompress: 1 bit, bool, true if node is temporary decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
- * extra: 10 bits, free for future use; pads out the remainder of 32 bits */
+ * codec: 2 bits, compression algorithm of COMPRESSED nodes, see compress.h.
+ * extra: 8 bits, free for future use; pads out the remainder of 32 bits */
 /* quicklistNodeṹ
  * ռ32bytes3ָռ8bytesunsigned intռ4bytes*2
  *
@@ -52,35 +53,38 @@ typedef struct quicklistNode {
     // ָǰڵǰڵ
     struct quicklistNode *prev;
     struct quicklistNode *next;
-    // ָڵӦziplist
-    unsigned char *zl;
-    // ziplistռõֽ
-    unsigned int sz;             /* ziplist size in bytes */
-    // ziplistԪص
-    unsigned int count : 16;     /* count of items in ziplist */
+    // ָڵӦlistpack
+    unsigned char *entry;
+    // listpackռõֽ
+    unsigned int sz;             /* entry size in bytes */
+    // listpackԪص
+    unsigned int count : 16;     /* count of items in listpack */
     // encodingʾͣ1ʾԭģ2ʾʹLZFѹ
-    unsigned int encoding : 2;   /* RAW==1 or LZF==2 */
-    // zlָͣ1ʾNone2ʾziplist
-    unsigned int container : 2;  /* NONE==1 or ZIPLIST==2 */
+    unsigned int encoding : 2;   /* RAW==1 or COMPRESSED==2 */
+    // entryָͣ1ʾNone2ʾlistpack
+    unsigned int container : 2;  /* NONE==1 or PACKED==2 */
     // recompressʾڵ֮ǰǷΪѹڵ
     // ǣʹ֮ǰҪѹʹ֮Ҫѹ
     unsigned int recompress : 1; /* was this node previous compressed? */
 
     unsigned int attempted_compress : 1; /* node can't compress; too small */
-    unsigned int extra : 10; /* more bits to steal for future usage */
+    // ѹڵʹõѹ㷨
+    unsigned int codec : 2; /* LZF, LZ4 or ZSTD if compressed */
+    unsigned int extra : 8; /* more bits to steal for future usage */
 } quicklistNode;
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
  * 'sz' is byte length of 'compressed' field.
- * 'compressed' is LZF data with total (compressed) length 'sz'
+ * 'compressed' is data compressed with node->codec (LZF unless configured
+ * otherwise) with total (compressed) length 'sz'
  * NOTE: uncompressed length is stored in quicklistNode->sz.
- * When quicklistNode->zl is compressed, node->zl points to a quicklistLZF */
-/* ziplistLZF㷨ѹʱquicklistNodeڵָquicklistLSF
+ * When quicklistNode->entry is compressed, node->entry points to a quicklistLZF */
+/* listpackLZF㷨ѹʱquicklistNodeڵָquicklistLSF
  *
  * 4+NֽڵĽṹ
  *
  * ѹǰĳȴ洢quicklistNode->sz
- * quicklistNode->zlѹģnode->zlָһquicklistLZF
+ * quicklistNode->entryѹģnode->entryָһquicklistLZF
  */
 typedef struct quicklistLZF {
     // compressedռõֽ
@@ -133,12 +137,12 @@ typedef struct quicklist {
     // ָquicklistͷβڵ
     quicklistNode *head;
     quicklistNode *tail;
-    // ziplistentry
-    unsigned long count;        /* total count of all entries in all ziplists */
+    // listpackentry
+    unsigned long count;        /* total count of all entries in all listpacks */
     // quicklistquicklistNode
     unsigned long len;          /* number of quicklistNodes */
-    // ÿڵziplistziplistNodeڴ棩
-    // Ųlist-max-ziplist-sizeֵ
+    // ÿڵlistpackquicklistNodeڴ棩
+    // Ųlist-max-listpack-sizeֵ
     int fill : QL_FILL_BITS;              /* fill factor for individual nodes */
     // quicklistѹȣLZFأ0=off
     // Ųlist-compress-depthֵ
@@ -155,21 +159,21 @@ typedef struct quicklistIter {
     const quicklist *quicklist;
     // ָǰԪquicklistNode
     quicklistNode *current;
-    // ָԪziplist
+    // ָԪlistpack
     unsigned char *zi;
-    // ָziplistĵoffsetentry
-    long offset; /* offset in current ziplist */
+    // ָlistpackĵoffsetentry
+    long offset; /* offset in current listpack */
     // 
     int direction;
 } quicklistIter;
 
-/* quicklistNodeziplistziplistеEntry */
+/* quicklistNodelistpacklistpackеEntry */
 typedef struct quicklistEntry {
     // ָǰԪڵquicklist
     const quicklist *quicklist;
     // ָǰԪڵquicklistNode
     quicklistNode *node;
-    // ָǰԪڵziplistָ
+    // ָǰԪڵlistpackָ
     unsigned char *zi;
     // ͨ*valueǷΪNULLȷentrySTRINT
     // ǰڵַ
@@ -178,7 +182,7 @@ typedef struct quicklistEntry {
     long long longval;
     // ýڵռõֽvalueʹ
     unsigned int sz;
-    // ýڵziplistƫýڵΪziplistĵoffsetڵ㣩
+    // ýڵlistpackƫýڵΪlistpackĵoffsetڵ㣩
     int offset;
 } quicklistEntry;
 
@@ -187,22 +191,23 @@ typedef struct quicklistEntry {
 
 /* quicklist node encodings */
 #define QUICKLIST_NODE_ENCODING_RAW 1
-#define QUICKLIST_NODE_ENCODING_LZF 2
+#define QUICKLIST_NODE_ENCODING_COMPRESSED 2
 
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0
 
 /* quicklist container formats */
 #define QUICKLIST_NODE_CONTAINER_NONE 1
-#define QUICKLIST_NODE_CONTAINER_ZIPLIST 2
+#define QUICKLIST_NODE_CONTAINER_PACKED 2
 
 #define quicklistNodeIsCompressed(node)                                        \
-    ((node)->encoding == QUICKLIST_NODE_ENCODING_LZF)
+    ((node)->encoding == QUICKLIST_NODE_ENCODING_COMPRESSED)
 
 /* Prototypes */
 quicklist *quicklistCreate(void);
 quicklist *quicklistNew(int fill, int compress);
 void quicklistSetCompressDepth(quicklist *quicklist, int depth);
+void quicklistSetCompressCodec(int codec);
 void quicklistSetFill(quicklist *quicklist, int fill);
 void quicklistSetOptions(quicklist *quicklist, int fill, int depth);
 void quicklistRelease(quicklist *quicklist);
@@ -210,11 +215,11 @@ int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);
 int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);
 void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
                    int where);
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl);
-quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
-                                            unsigned char *zl);
-quicklist *quicklistCreateFromZiplist(int fill, int compress,
-                                      unsigned char *zl);
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *zl);
+quicklist *quicklistAppendValuesFromListpack(quicklist *quicklist,
+                                             unsigned char *zl);
+quicklist *quicklistCreateFromListpack(int fill, int compress,
+                                       unsigned char *zl);
 void quicklistInsertAfter(quicklist *quicklist, quicklistEntry *node,
                           void *value, const size_t sz);
 void quicklistInsertBefore(quicklist *quicklist, quicklistEntry *node,
@@ -28,7 +28,7 @@
  */
 
 #include "server.h"
-#include "lzf.h"    /* LZF compression library */
+#include "compress.h" /* LZF, LZ4 and zstd compression */
 #include "zipmap.h"
 #include "endianconv.h"
 #include "stream.h"
@@ -357,7 +357,32 @@ writeerr:
     return -1;
 }
 
-ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+/* Save data compressed with 'codec' (see compress.h). LZF data is saved
+ * with the RDB_ENC_LZF encoding, so that files saved using only LZF can
+ * still be loaded by older versions. */
+ssize_t rdbSaveCompressedBlob(rio *rdb, int codec, void *data,
+                              size_t compress_len, size_t original_len) {
+    unsigned char byte[2];
+    ssize_t n, nwritten = 0;
+
+    if (codec == COMPRESS_LZF)
+        return rdbSaveLzfBlob(rdb,data,compress_len,original_len);
+
+    byte[0] = (RDB_ENCVAL<<6)|RDB_ENC_COMPRESSED;
+    byte[1] = codec;
+    if ((n = rdbWriteRaw(rdb,byte,2)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbSaveLen(rdb,compress_len)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbSaveLen(rdb,original_len)) == -1) return -1;
+    nwritten += n;
+    if ((n = rdbWriteRaw(rdb,data,compress_len)) == -1) return -1;
+    nwritten += n;
+    return nwritten;
+}
+
+ssize_t rdbSaveCompressedStringObject(rio *rdb, int codec, unsigned char *s,
+                                      size_t len) {
     size_t comprlen, outlen;
     void *out;
 
@@ -365,30 +390,40 @@ ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     if (len <= 4) return 0;
     outlen = len-4;
     if ((out = zmalloc(outlen+1)) == NULL) return 0;
-    comprlen = lzf_compress(s, len, out, outlen);
+    comprlen = compressData(codec, s, len, out, outlen);
     if (comprlen == 0) {
         zfree(out);
         return 0;
     }
-    ssize_t nwritten = rdbSaveLzfBlob(rdb, out, comprlen, len);
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb, codec, out, comprlen, len);
     zfree(out);
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
- * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+/* Load a compressed string in RDB format, compressed with LZF if the
+ * encoding is RDB_ENC_LZF, otherwise with the algorithm stored before the
+ * lengths. The returned value changes according to 'flags'. For more info
+ * check the rdbGenericLoadStringObject() function. */
+void *rdbLoadCompressedStringObject(rio *rdb, int enc, int flags, size_t *lenptr) {
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
     unsigned char *c = NULL;
+    unsigned char codec = COMPRESS_LZF;
     char *val = NULL;
 
+    if (enc == RDB_ENC_COMPRESSED) {
+        if (rioRead(rdb,&codec,1) == 0) return NULL;
+        if (!compressCodecAvailable(codec)) {
+            rdbReportCorruptRDB("Unsupported compression algorithm %s (%d)",
+                compressCodecName(codec), codec);
+            return NULL;
+        }
+    }
     if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((c = ztrymalloc(clen)) == NULL) {
-        serverLog(server.loading? LL_WARNING: LL_VERBOSE, "rdbLoadLzfStringObject failed allocating %llu bytes", (unsigned long long)clen);
+        serverLog(server.loading? LL_WARNING: LL_VERBOSE, "rdbLoadCompressedStringObject failed allocating %llu bytes", (unsigned long long)clen);
         goto err;
     }
 
@@ -399,7 +434,7 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
         val = sdstrynewlen(SDS_NOINIT,len);
     }
     if (!val) {
-        serverLog(server.loading? LL_WARNING: LL_VERBOSE, "rdbLoadLzfStringObject failed allocating %llu bytes", (unsigned long long)len);
+        serverLog(server.loading? LL_WARNING: LL_VERBOSE, "rdbLoadCompressedStringObject failed allocating %llu bytes", (unsigned long long)len);
         goto err;
     }
 
@@ -407,8 +442,9 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) != len) {
-        rdbReportCorruptRDB("Invalid LZF compressed string");
+    if (decompressData(codec,c,clen,val,len) != len) {
+        rdbReportCorruptRDB("Invalid %s compressed string",
+            compressCodecName(codec));
         goto err;
     }
     zfree(c);
@@ -442,10 +478,11 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
+    /* Try compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
     if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+        n = rdbSaveCompressedStringObject(rdb,server.rdb_compression_algorithm,
+                                          s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -522,7 +559,8 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+        case RDB_ENC_COMPRESSED:
+            return rdbLoadCompressedStringObject(rdb,len,flags,lenptr);
         default:
             rdbReportCorruptRDB("Unknown RDB string encoding type %llu",len);
             return NULL;
@@ -665,26 +703,31 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
         return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
         if (o->encoding == OBJ_ENCODING_QUICKLIST)
-            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
+            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST_2);
         else
             serverPanic("Unknown list encoding");
     case OBJ_SET:
         if (o->encoding == OBJ_ENCODING_INTSET)
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_ROARING)
+            return rdbSaveType(rdb,RDB_TYPE_SET_ROARING);
+        else if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_SET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
+        else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                 o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
@@ -820,13 +863,19 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             nwritten += n;
 
             while(node) {
+                /* Our nodes are always listpacks: the container is saved
+                 * for compatibility with the format of Redis 7. */
+                if ((n = rdbSaveLen(rdb,QUICKLIST_NODE_CONTAINER_PACKED)) == -1)
+                    return -1;
+                nwritten += n;
                 if (quicklistNodeIsCompressed(node)) {
                     void *data;
                     size_t compress_len = quicklistGetLzf(node, &data);
-                    if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
+                    if ((n = rdbSaveCompressedBlob(rdb,node->codec,data,
+                                 compress_len,node->sz)) == -1) return -1;
                     nwritten += n;
                 } else {
-                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
+                    if ((n = rdbSaveRawString(rdb,node->entry,node->sz)) == -1) return -1;
                     nwritten += n;
                 }
                 node = node->next;
@@ -861,6 +910,20 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             size_t l = intsetBlobLen((intset*)o->ptr);
 
+            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            size_t l = roaringSerializedSize(o->ptr);
+            unsigned char *buf = zmalloc(l);
+
+            roaringSerialize(o->ptr,buf);
+            n = rdbSaveRawString(rdb,buf,l);
+            zfree(buf);
+            if (n == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
+
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
         } else {
@@ -868,8 +931,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -899,13 +962,36 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 nwritten += n;
                 zn = zn->backward;
             }
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = o->ptr;
+            zbtreeIter it;
+
+            if ((n = rdbSaveLen(rdb,zbtLength(zs->zbt))) == -1) return -1;
+            nwritten += n;
+
+            /* Same format and order of the skiplist, so that either
+             * encoding can load it as fast. */
+            if (zbtLast(zs->zbt,&it)) {
+                do {
+                    sds ele = zbtIterEle(&it);
+                    if ((n = rdbSaveRawString(rdb,
+                        (unsigned char*)ele,sdslen(ele))) == -1)
+                    {
+                        return -1;
+                    }
+                    nwritten += n;
+                    if ((n = rdbSaveBinaryDoubleValue(rdb,zbtIterScore(&it))) == -1)
+                        return -1;
+                    nwritten += n;
+                } while(zbtPrev(&it));
+            }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -1145,6 +1231,32 @@ ssize_t rdbSaveAuxFieldStrInt(rio *rdb, char *key, long long val) {
     return rdbSaveAuxField(rdb,key,strlen(key),buf,vlen);
 }
 
+/* Save the replication backlog as the "repl-backlog" AUX field. The value is
+ * written block by block as a plain string, to avoid copying the backlog
+ * into a contiguous buffer: the last byte is the one at the replication
+ * offset saved in the "repl-offset" field. */
+ssize_t rdbSaveReplBacklogAuxField(rio *rdb) {
+    ssize_t ret, len = 0;
+    char *key = "repl-backlog";
+
+    if ((ret = rdbSaveType(rdb,RDB_OPCODE_AUX)) == -1) return -1;
+    len += ret;
+    if ((ret = rdbSaveRawString(rdb,(unsigned char*)key,strlen(key))) == -1)
+        return -1;
+    len += ret;
+    if ((ret = rdbSaveLen(rdb,server.repl_backlog_histlen)) == -1) return -1;
+    len += ret;
+
+    listNode *ln = server.repl_backlog->ref_repl_buf_node;
+    while (ln) {
+        replBufBlock *o = listNodeValue(ln);
+        if (o->used && rdbWriteRaw(rdb,o->buf,o->used) == -1) return -1;
+        len += o->used;
+        ln = listNextNode(ln);
+    }
+    return len;
+}
+
 /* Save a few default AUX fields with information about the RDB generated. */
 int rdbSaveInfoAuxFields(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     int redis_bits = (sizeof(void*) == 8) ? 64 : 32;
@@ -1164,8 +1276,21 @@ int rdbSaveInfoAuxFields(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             == -1) return -1;
         if (rdbSaveAuxFieldStrInt(rdb,"repl-offset",server.master_repl_offset)
             == -1) return -1;
+        /* The backlog is only useful to the server restarting from this
+         * file: not to a replica loading it, nor inside the AOF. */
+        if (server.repl_backlog_persist && server.repl_backlog &&
+            !(rdbflags & (RDBFLAGS_AOF_PREAMBLE|RDBFLAGS_REPLICATION)))
+        {
+            if (rdbSaveReplBacklogAuxField(rdb) == -1) return -1;
+        }
     }
     if (rdbSaveAuxFieldStrInt(rdb,"aof-preamble",aof_preamble) == -1) return -1;
+    /* The keys of a shard are only the ones of its hash slots, see
+     * rdbLoadRio(). */
+    if (server.shards > 1) {
+        if (rdbSaveAuxFieldStrInt(rdb,"shards",server.shards) == -1) return -1;
+        if (rdbSaveAuxFieldStrInt(rdb,"shard-id",server.shard_id) == -1) return -1;
+    }
     return 1;
 }
 
@@ -1210,6 +1335,303 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
     return io.bytes;
 }
 
+/* -----------------------------------------------------------------------------
+ * Parallel saving
+ *
+ * When rdb-save-threads is greater than zero, the child process serializes
+ * every database with the given number of threads: the dictionary is split
+ * in parts (see dictGetPartIterator()) that the saving threads serialize in
+ * memory, in chunks of whole key-value pairs, while the main thread of the
+ * child writes the chunks to the target, as soon as they are ready. The
+ * order of the keys inside a database does not matter, so the result is a
+ * normal RDB file, and there is no need to buffer more than a few chunks
+ * per thread.
+ * -------------------------------------------------------------------------- */
+
+#define RDB_SAVE_CHUNK_BYTES (1024*1024)    /* Max serialized bytes. */
+#define RDB_SAVE_CHUNK_MS 100               /* Max time to fill a chunk. */
+#define RDB_SAVE_CHUNKS_PER_THREAD 2        /* Max chunks ready per thread. */
+#define RDB_SAVE_PARTS_PER_THREAD 16        /* Parts the dict is split in. */
+#define RDB_SAVE_MIN_PARALLEL_KEYS 4096     /* Smaller DBs are saved inline. */
+
+typedef struct rdbSaveChunk {
+    sds buf;
+    long keys;
+    struct rdbSaveChunk *next;
+} rdbSaveChunk;
+
+typedef struct rdbSaveWorkers {
+    pthread_t *threads;
+    int numthreads;
+    int started;                    /* Used to name the threads. */
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;       /* Signaled on new parts or free room. */
+    pthread_cond_t ready_cond;      /* Signaled on chunks or parts done. */
+    dict *d;                        /* Dictionary being saved, or NULL. */
+    int numparts, nextpart, partsdone;
+    rdbSaveChunk *head, *tail;      /* Chunks ready to be written. */
+    int ready;                      /* Number of chunks in the list above. */
+    int error;                      /* A thread failed serializing a key. */
+    int stop;                       /* Tell the threads to exit. */
+} rdbSaveWorkers;
+
+/* Module types may not expect concurrent calls of their rdb_save method. */
+static pthread_mutex_t rdbSaveModuleLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Queue a serialized chunk for the main thread, waiting for the main thread
+ * to write the older ones if too many are ready. Returns 0 if the saving is
+ * being aborted, in which case the chunk is released. */
+static int rdbSaveWorkersPush(rdbSaveWorkers *w, sds buf, long keys) {
+    rdbSaveChunk *chunk = zmalloc(sizeof(*chunk));
+
+    chunk->buf = buf;
+    chunk->keys = keys;
+    chunk->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop && w->ready >= w->numthreads*RDB_SAVE_CHUNKS_PER_THREAD)
+        pthread_cond_wait(&w->work_cond,&w->lock);
+    if (w->stop) {
+        pthread_mutex_unlock(&w->lock);
+        sdsfree(buf);
+        zfree(chunk);
+        return 0;
+    }
+    if (w->tail) w->tail->next = chunk; else w->head = chunk;
+    w->tail = chunk;
+    w->ready++;
+    pthread_cond_signal(&w->ready_cond);
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+}
+
+/* Serialize the part 'part' of the dictionary 'd'. */
+static void rdbSaveWorkersSavePart(rdbSaveWorkers *w, dict *d, int part) {
+    dictIterator *di = dictGetPartIterator(d,part,w->numparts);
+    dictEntry *de;
+    long keys = 0;
+    long long chunk_start = mstime();
+    int err = 0;
+    rio r;
+
+    rioInitWithBuffer(&r,sdsempty());
+    while((de = dictNext(di)) != NULL) {
+        sds keystr = dictGetKey(de);
+        robj key, *o = dictGetVal(de);
+        int retval;
+
+        initStaticStringObject(key,keystr);
+        if (o->type == OBJ_MODULE) pthread_mutex_lock(&rdbSaveModuleLock);
+        retval = rdbSaveKeyValuePair(&r,&key,o,dbEntryGetExpire(de));
+        if (o->type == OBJ_MODULE) pthread_mutex_unlock(&rdbSaveModuleLock);
+        if (retval == -1) {
+            err = 1;
+            break;
+        }
+        keys++;
+
+        /* Also hand over chunks filled slowly, so that the target (maybe
+         * a replica) keeps receiving data. */
+        if (sdslen(r.io.buffer.ptr) >= RDB_SAVE_CHUNK_BYTES ||
+            mstime() - chunk_start >= RDB_SAVE_CHUNK_MS)
+        {
+            if (!rdbSaveWorkersPush(w,r.io.buffer.ptr,keys)) break;
+            rioInitWithBuffer(&r,sdsempty());
+            keys = 0;
+            chunk_start = mstime();
+        }
+    }
+    dictReleaseIterator(di);
+
+    if (err) {
+        sdsfree(r.io.buffer.ptr);
+        pthread_mutex_lock(&w->lock);
+        w->error = 1;
+        pthread_mutex_unlock(&w->lock);
+    } else if (de == NULL && keys) {
+        rdbSaveWorkersPush(w,r.io.buffer.ptr,keys);
+    } else if (de == NULL) {
+        sdsfree(r.io.buffer.ptr);
+    }
+}
+
+static void *rdbSaveThreadMain(void *arg) {
+    rdbSaveWorkers *w = arg;
+    char thdname[16];
+    sigset_t sigset;
+
+    pthread_mutex_lock(&w->lock);
+    snprintf(thdname,sizeof(thdname),"rdb_save_%d",w->started++);
+    pthread_mutex_unlock(&w->lock);
+    redis_set_thread_title(thdname);
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    pthread_mutex_lock(&w->lock);
+    while(1) {
+        while (!w->stop && (w->d == NULL || w->nextpart == w->numparts))
+            pthread_cond_wait(&w->work_cond,&w->lock);
+        if (w->stop) break;
+
+        dict *d = w->d;
+        int part = w->nextpart++;
+        pthread_mutex_unlock(&w->lock);
+
+        rdbSaveWorkersSavePart(w,d,part);
+
+        pthread_mutex_lock(&w->lock);
+        w->partsdone++;
+        pthread_cond_signal(&w->ready_cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void rdbSaveWorkersRelease(rdbSaveWorkers *w);
+
+/* Start the saving threads. Returns NULL if no thread could be started. */
+static rdbSaveWorkers *rdbSaveWorkersCreate(int numthreads) {
+    rdbSaveWorkers *w = zcalloc(sizeof(*w));
+
+    pthread_mutex_init(&w->lock,NULL);
+    pthread_cond_init(&w->work_cond,NULL);
+    pthread_cond_init(&w->ready_cond,NULL);
+    w->threads = zmalloc(sizeof(pthread_t)*numthreads);
+    w->numparts = numthreads*RDB_SAVE_PARTS_PER_THREAD;
+    for (int j = 0; j < numthreads; j++) {
+        if (pthread_create(&w->threads[j],NULL,rdbSaveThreadMain,w) != 0) {
+            serverLog(LL_WARNING,"Can't create the RDB saving threads.");
+            break;
+        }
+        w->numthreads++;
+    }
+    if (w->numthreads == 0) {
+        rdbSaveWorkersRelease(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* Stop the saving threads and release the chunks not yet written. */
+static void rdbSaveWorkersRelease(rdbSaveWorkers *w) {
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->work_cond);
+    pthread_mutex_unlock(&w->lock);
+    for (int j = 0; j < w->numthreads; j++)
+        pthread_join(w->threads[j],NULL);
+
+    while (w->head) {
+        rdbSaveChunk *next = w->head->next;
+        sdsfree(w->head->buf);
+        zfree(w->head);
+        w->head = next;
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work_cond);
+    pthread_cond_destroy(&w->ready_cond);
+    zfree(w->threads);
+    zfree(w);
+}
+
+/* Serialize the dictionary 'd' with the saving threads, writing the chunks
+ * to 'rdb' as they are ready. 'key_count' is updated with the number of
+ * keys written, and the callback 'progress' is called after every chunk
+ * with 'privdata'. Returns -1 on error. */
+static int rdbSaveWorkersSaveDict(rdbSaveWorkers *w, rio *rdb, dict *d,
+                                  long *key_count,
+                                  void (*progress)(rio*,long,void*),
+                                  void *privdata)
+{
+    int retval = 0;
+
+    pthread_mutex_lock(&w->lock);
+    w->d = d;
+    w->nextpart = 0;
+    w->partsdone = 0;
+    pthread_cond_broadcast(&w->work_cond);
+    while(1) {
+        while (w->head == NULL && w->partsdone < w->numparts)
+            pthread_cond_wait(&w->ready_cond,&w->lock);
+        if (w->head == NULL) break;
+
+        rdbSaveChunk *chunk = w->head;
+        w->head = chunk->next;
+        if (w->head == NULL) w->tail = NULL;
+        w->ready--;
+        pthread_cond_signal(&w->work_cond);
+        pthread_mutex_unlock(&w->lock);
+
+        int written = rioWrite(rdb,chunk->buf,sdslen(chunk->buf)) != 0;
+        *key_count += chunk->keys;
+        sdsfree(chunk->buf);
+        zfree(chunk);
+        if (written) progress(rdb,*key_count,privdata);
+
+        pthread_mutex_lock(&w->lock);
+        if (!written) {
+            retval = -1;
+            break;
+        }
+    }
+    w->d = NULL;
+    if (w->error) retval = -1;
+    pthread_mutex_unlock(&w->lock);
+    return retval;
+}
+
+/* State of the progress reporting of rdbSaveRio(). */
+typedef struct rdbSaveProgressState {
+    long long info_updated_time;
+    char *pname;
+} rdbSaveProgressState;
+
+/* Called by the parallel saving after writing every chunk of keys. */
+static void rdbSaveChunkProgress(rio *rdb, long key_count, void *privdata) {
+    rdbSaveProgressState *ps = privdata;
+    UNUSED(rdb);
+
+    long long now = mstime();
+    if (now - ps->info_updated_time >= 1000) {
+        sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO, key_count, ps->pname);
+        ps->info_updated_time = now;
+    }
+}
+
+/* Save a key of the database being iterated by rdbSaveRioPart(), updating
+ * the child info as needed. Returns -1 on error. */
+static int rdbSaveDictEntry(rio *rdb, dictEntry *de, rdbSaveProgressState *ps,
+                            long *key_count)
+{
+    sds keystr = dictGetKey(de);
+    robj key, *o = dictGetVal(de);
+    long long expire;
+
+    initStaticStringObject(key,keystr);
+    expire = dbEntryGetExpire(de);
+    if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) return -1;
+
+    /* Update child info every 1 second (approximately).
+     * in order to avoid calling mstime() on each iteration, we will
+     * check the diff every 1024 keys */
+    if ((*key_count)++ & 1023) return 0;
+    if (ps->pname == NULL) return 0;
+    long long now = mstime();
+    if (now - ps->info_updated_time >= 1000) {
+        sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO, *key_count, ps->pname);
+        ps->info_updated_time = now;
+    }
+    return 0;
+}
+
+/* Return true if the value 'o' can be saved concurrently with the other
+ * parts of the keyspace (see rdbSaveRioPart()). */
+static int rdbIsPartSafeValue(robj *o) {
+    return o->type != OBJ_MODULE && o->type != OBJ_STREAM;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1219,28 +1641,54 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
  * integer pointed by 'error' is set to the value of errno just after the I/O
  * error. */
 int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
+    return rdbSaveRioPart(rdb,error,rdbflags,rsi,0,1);
+}
+
+/* Like rdbSaveRio(), but only dumps the part 'part' of 'numparts' disjoint
+ * parts of the keys of every database, as a standalone RDB payload, so that
+ * the different parts can be saved concurrently by different threads of the
+ * child process. Only the first part includes the auxiliary fields, the
+ * scripts and the module data, together with all the module and stream
+ * values, as module types may not expect concurrent calls of their
+ * rdb_save method, and streams are not loaded by the loading threads. */
+int rdbSaveRioPart(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi,
+                   int part, int numparts)
+{
     dictIterator *di = NULL;
     dictEntry *de;
     char magic[10];
     uint64_t cksum;
-    size_t processed = 0;
-    int j;
+    int j, p;
     long key_count = 0;
-    long long info_updated_time = 0;
-    char *pname = (rdbflags & RDBFLAGS_AOF_PREAMBLE) ? "AOF rewrite" :  "RDB";
+    rdbSaveProgressState ps = {0,
+        (rdbflags & RDBFLAGS_AOF_PREAMBLE) ? "AOF rewrite" :  "RDB"};
+    rdbSaveWorkers *workers = NULL;
+
+    /* Only the child process can serialize the dataset with multiple
+     * threads, as nobody is modifying it in the meantime. When saving
+     * multiple parts, the parts are already saved by different threads. */
+    if (server.rdb_save_threads > 0 && server.in_fork_child && numparts == 1)
+        workers = rdbSaveWorkersCreate(server.rdb_save_threads);
+    /* Only the first part reports the progress. */
+    if (part != 0) ps.pname = NULL;
 
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
     snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
     if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
-    if (rdbSaveInfoAuxFields(rdb,rdbflags,rsi) == -1) goto werr;
-    if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_BEFORE_RDB) == -1) goto werr;
+    if (part == 0) {
+        if (rdbSaveInfoAuxFields(rdb,rdbflags,rsi) == -1) goto werr;
+        if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_BEFORE_RDB) == -1) goto werr;
+    }
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         dict *d = db->dict;
         if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
+        if (numparts == 1)
+            di = dictGetSafeIterator(d);
+        else
+            di = dictGetPartIterator(d,part,numparts);
 
         /* Write the SELECT DB opcode */
         if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
@@ -1254,46 +1702,46 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
 
+        /* Serialize large DBs with the saving threads. */
+        if (workers && db_size >= RDB_SAVE_MIN_PARALLEL_KEYS) {
+            dictReleaseIterator(di);
+            di = NULL;
+            if (rdbSaveWorkersSaveDict(workers,rdb,d,&key_count,
+                                       rdbSaveChunkProgress,&ps) == -1)
+                goto werr;
+            continue;
+        }
+
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
-            sds keystr = dictGetKey(de);
-            robj key, *o = dictGetVal(de);
-            long long expire;
-
-            initStaticStringObject(key,keystr);
-            expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
-
-            /* When this RDB is produced as part of an AOF rewrite, move
-             * accumulated diff from parent to child while rewriting in
-             * order to have a smaller final write. */
-            if (rdbflags & RDBFLAGS_AOF_PREAMBLE &&
-                rdb->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES)
-            {
-                processed = rdb->processed_bytes;
-                aofReadDiffFromParent();
-            }
-
-            /* Update child info every 1 second (approximately).
-             * in order to avoid calling mstime() on each iteration, we will
-             * check the diff every 1024 keys */
-            if ((key_count++ & 1023) == 0) {
-                long long now = mstime();
-                if (now - info_updated_time >= 1000) {
-                    sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO, key_count, pname);
-                    info_updated_time = now;
-                }
-            }
+            if (part != 0 && !rdbIsPartSafeValue(dictGetVal(de))) continue;
+            if (rdbSaveDictEntry(rdb,de,&ps,&key_count) == -1) goto werr;
         }
         dictReleaseIterator(di);
         di = NULL; /* So that we don't release it again on error. */
+
+        /* The first part also saves the values of the other parts that
+         * can't be saved concurrently. */
+        for (p = 1; part == 0 && p < numparts; p++) {
+            di = dictGetPartIterator(d,p,numparts);
+            while((de = dictNext(di)) != NULL) {
+                if (rdbIsPartSafeValue(dictGetVal(de))) continue;
+                if (rdbSaveDictEntry(rdb,de,&ps,&key_count) == -1) goto werr;
+            }
+            dictReleaseIterator(di);
+            di = NULL;
+        }
+    }
+    if (workers) {
+        rdbSaveWorkersRelease(workers);
+        workers = NULL;
     }
 
     /* If we are storing the replication information on disk, persist
      * the script cache as well: on successful PSYNC after a restart, we need
      * to be able to process any EVALSHA inside the replication backlog the
      * master will send us. */
-    if (rsi && dictSize(server.lua_scripts)) {
+    if (part == 0 && rsi && dictSize(server.lua_scripts)) {
         di = dictGetIterator(server.lua_scripts);
         while((de = dictNext(di)) != NULL) {
             robj *body = dictGetVal(de);
@@ -1304,7 +1752,8 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         di = NULL; /* So that we don't release it again on error. */
     }
 
-    if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_AFTER_RDB) == -1) goto werr;
+    if (part == 0 &&
+        rdbSaveModulesAux(rdb, REDISMODULE_AUX_AFTER_RDB) == -1) goto werr;
 
     /* EOF opcode */
     if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) goto werr;
@@ -1319,6 +1768,29 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
 werr:
     if (error) *error = errno;
     if (di) dictReleaseIterator(di);
+    if (workers) rdbSaveWorkersRelease(workers);
+    return C_ERR;
+}
+
+/* Dump the part 'part' of the keyspace (see rdbSaveRioPart()) with the
+ * EOF mark 'eofmark' as prefix and suffix, see rdbSaveRioWithEOFMark().
+ * The caller takes care of startSaving() / stopSaving(). */
+static int rdbSaveRioPartWithEOFMark(rio *rdb, int *error, rdbSaveInfo *rsi,
+                                     int part, int numparts,
+                                     const char *eofmark)
+{
+    if (error) *error = 0;
+    if (rioWrite(rdb,"$EOF:",5) == 0) goto werr;
+    if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
+    if (rioWrite(rdb,"\r\n",2) == 0) goto werr;
+    if (rdbSaveRioPart(rdb,error,RDBFLAGS_REPLICATION,rsi,part,numparts) == C_ERR)
+        goto werr;
+    if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
+    return C_OK;
+
+werr: /* Write error. */
+    /* Set 'error' only if not already set by rdbSaveRio() call. */
+    if (error && *error == 0) *error = errno;
     return C_ERR;
 }
 
@@ -1332,23 +1804,13 @@ werr:
  * without doing any processing of the content. */
 int rdbSaveRioWithEOFMark(rio *rdb, int *error, rdbSaveInfo *rsi) {
     char eofmark[RDB_EOF_MARK_SIZE];
+    int retval;
 
     startSaving(RDBFLAGS_REPLICATION);
     getRandomHexChars(eofmark,RDB_EOF_MARK_SIZE);
-    if (error) *error = 0;
-    if (rioWrite(rdb,"$EOF:",5) == 0) goto werr;
-    if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
-    if (rioWrite(rdb,"\r\n",2) == 0) goto werr;
-    if (rdbSaveRio(rdb,error,RDBFLAGS_NONE,rsi) == C_ERR) goto werr;
-    if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
-    stopSaving(1);
-    return C_OK;
-
-werr: /* Write error. */
-    /* Set 'error' only if not already set by rdbSaveRio() call. */
-    if (error && *error == 0) *error = errno;
-    stopSaving(0);
-    return C_ERR;
+    retval = rdbSaveRioPartWithEOFMark(rdb,error,rsi,0,1,eofmark);
+    stopSaving(retval == C_OK);
+    return retval;
 }
 
 /* Save the DB on disk. Return C_ERR on error, C_OK on success. */
@@ -1455,6 +1917,13 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     return C_OK; /* unreached */
 }
 
+/* Start a BGSAVE, without forking if bgsave-forkless is enabled. Full syncs
+ * with replicas still use rdbSaveBackground(). */
+int rdbSaveBackgroundSnapshot(char *filename, rdbSaveInfo *rsi) {
+    if (server.bgsave_forkless) return snapshotStart(filename,rsi);
+    return rdbSaveBackground(filename,rsi);
+}
+
 /* Note that we may call this function in signal handle 'sigShutdownHandler',
  * so we need guarantee all functions we call are async-signal-safe.
  * If  we call this function from signal handle, we won't call bg_unlink that
@@ -1519,6 +1988,27 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Return a new listpack holding the same entries of the ziplist 'zl'.
+ * Hashes, sorted sets and list nodes used to be ziplists, so this is used
+ * to load them from older RDB files and RESTORE payloads. The ziplist must
+ * be already deeply validated by the caller, and is not freed. */
+static unsigned char *rdbListpackFromZiplist(unsigned char *zl) {
+    unsigned char *lp = lpNew(0);
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+
+    while (ziplistGet(p,&vstr,&vlen,&vll)) {
+        if (vstr)
+            lp = lpAppend(lp,vstr,vlen);
+        else
+            lp = lpAppendInteger(lp,vll);
+        p = ziplistNext(zl,p);
+    }
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL.
  * When the function returns NULL and if 'error' is not NULL, the
@@ -1552,7 +2042,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
         if (len == 0) goto emptykey;
 
         o = createQuicklistObject();
-        quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
+        quicklistSetOptions(o->ptr, server.list_max_listpack_size,
                             server.list_compress_depth);
 
         /* Load every single element of the list */
@@ -1572,10 +2062,17 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         if (len == 0) goto emptykey;
 
-        /* Use a regular set when there are too many entries. */
+        /* Use a regular set when there are too many entries, or a roaring
+         * bitmap as long as the elements are integers, if enabled. Small
+         * sets start as intsets, and are converted to listpacks if they
+         * turn out to contain short strings. */
         size_t max_entries = server.set_max_intset_entries;
         if (max_entries >= 1<<30) max_entries = 1<<30;
-        if (len > max_entries) {
+        if (len > max_entries &&
+            server.set_large_int_encoding == OBJ_ENCODING_ROARING)
+        {
+            o = createRoaringObject();
+        } else if (len > max_entries) {
             o = createSetObject();
             /* It's faster to expand the dict to the right size asap in order
              * to avoid rehashing */
@@ -1609,6 +2106,44 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                         sdsfree(sdsele);
                         return NULL;
                     }
+                } else if (len <= server.set_max_listpack_entries &&
+                           sdslen(sdsele) <= server.set_max_listpack_value &&
+                           lpSafeToAdd(NULL,intsetBlobLen(o->ptr)+
+                                            sdslen(sdsele)))
+                {
+                    setTypeConvert(o,OBJ_ENCODING_LISTPACK);
+                } else {
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                    if (dictTryExpand(o->ptr,len) != DICT_OK) {
+                        rdbReportCorruptRDB("OOM in dictTryExpand %llu", (unsigned long long)len);
+                        sdsfree(sdsele);
+                        decrRefCount(o);
+                        return NULL;
+                    }
+                }
+            } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+                /* Elements that are too long, like integers that don't fit
+                 * the listpack limit, need a regular set, as well as the
+                 * listpacks that would get too large. */
+                if (sdslen(sdsele) > server.set_max_listpack_value ||
+                    !lpSafeToAdd(o->ptr,sdslen(sdsele)))
+                {
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                    if (dictTryExpand(o->ptr,len) != DICT_OK) {
+                        rdbReportCorruptRDB("OOM in dictTryExpand %llu", (unsigned long long)len);
+                        sdsfree(sdsele);
+                        decrRefCount(o);
+                        return NULL;
+                    }
+                }
+            } else if (o->encoding == OBJ_ENCODING_ROARING) {
+                if (isSdsRepresentableAsLongLong(sdsele,&llval) == C_OK) {
+                    if (!roaringAdd(o->ptr,llval)) {
+                        rdbReportCorruptRDB("Duplicate set members detected");
+                        decrRefCount(o);
+                        sdsfree(sdsele);
+                        return NULL;
+                    }
                 } else {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                     if (dictTryExpand(o->ptr,len) != DICT_OK) {
@@ -1620,6 +2155,21 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                 }
             }
 
+            /* Listpack sets are only used for small sets, so the linear
+             * search for duplicates is fine. */
+            if (o->encoding == OBJ_ENCODING_LISTPACK) {
+                unsigned char *lp = o->ptr;
+                if (lpFind(lp,lpFirst(lp),(unsigned char*)sdsele,
+                           sdslen(sdsele),0))
+                {
+                    rdbReportCorruptRDB("Duplicate set members detected");
+                    decrRefCount(o);
+                    sdsfree(sdsele);
+                    return NULL;
+                }
+                o->ptr = lpAppend(lp,(unsigned char*)sdsele,sdslen(sdsele));
+            }
+
             /* This will also be called when the set was just converted
              * to a regular hash table encoded set. */
             if (o->encoding == OBJ_ENCODING_HT) {
@@ -1633,6 +2183,29 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                 sdsfree(sdsele);
             }
         }
+        if (o->encoding == OBJ_ENCODING_ROARING &&
+            setTypeRoaringIsSparse(o->ptr))
+            setTypeConvert(o,OBJ_ENCODING_HT);
+    } else if (rdbtype == RDB_TYPE_SET_ROARING) {
+        size_t encoded_len;
+        unsigned char *encoded;
+        roaring *r;
+
+        encoded = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
+        if (encoded == NULL) return NULL;
+        /* The serialized containers are always fully validated, as the
+         * bitmap would not be usable otherwise. */
+        r = roaringDeserialize(encoded,encoded_len);
+        zfree(encoded);
+        if (r == NULL) {
+            rdbReportCorruptRDB("Roaring bitmap integrity check failed.");
+            return NULL;
+        }
+        if (roaringCard(r) == 0) {
+            roaringFree(r);
+            goto emptykey;
+        }
+        o = setTypeFromRoaring(r);
     } else if (rdbtype == RDB_TYPE_ZSET_2 || rdbtype == RDB_TYPE_ZSET) {
         /* Read list/set value. */
         uint64_t zsetlen;
@@ -1655,7 +2228,6 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
                 decrRefCount(o);
@@ -1680,21 +2252,20 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
             totelelen += sdslen(sdsele);
 
-            znode = zslInsert(zs->zsl,score,sdsele);
-            if (dictAdd(zs->dict,sdsele,&znode->score) != DICT_OK) {
+            if (zsetInsertNew(zs,score,sdsele) != C_OK) {
                 rdbReportCorruptRDB("Duplicate zset fields detected");
                 decrRefCount(o);
-                /* no need to free 'sdsele', will be released by zslFree together with 'o' */
+                sdsfree(sdsele);
                 return NULL;
             }
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
-        if (zsetLength(o) <= server.zset_max_ziplist_entries &&
-            maxelelen <= server.zset_max_ziplist_value &&
-            ziplistSafeToAdd(NULL, totelelen))
+        if (zsetLength(o) <= server.zset_max_listpack_entries &&
+            maxelelen <= server.zset_max_listpack_value &&
+            lpSafeToAdd(NULL, totelelen))
         {
-            zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+            zsetConvert(o,OBJ_ENCODING_LISTPACK);
         }
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
@@ -1709,19 +2280,19 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
         o = createHashObject();
 
         /* Too many entries? Use a hash table right from the start. */
-        if (len > server.hash_max_ziplist_entries)
+        if (len > server.hash_max_listpack_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
         else if (deep_integrity_validation) {
             /* In this mode, we need to guarantee that the server won't crash
-             * later when the ziplist is converted to a dict.
+             * later when the listpack is converted to a dict.
              * Create a set (dict with no values) to for a dup search.
-             * We can dismiss it as soon as we convert the ziplist to a hash. */
+             * We can dismiss it as soon as we convert the listpack to a hash. */
             dupSearchDict = dictCreate(&hashDictType, NULL);
         }
 
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
@@ -1750,9 +2321,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
             }
 
             /* Convert to hash table if size threshold is exceeded */
-            if (sdslen(field) > server.hash_max_ziplist_value ||
-                sdslen(value) > server.hash_max_ziplist_value ||
-                !ziplistSafeToAdd(o->ptr, sdslen(field)+sdslen(value)))
+            if (sdslen(field) > server.hash_max_listpack_value ||
+                sdslen(value) > server.hash_max_listpack_value ||
+                !lpSafeToAdd(o->ptr, sdslen(field)+sdslen(value)))
             {
                 hashTypeConvert(o, OBJ_ENCODING_HT);
                 ret = dictAdd((dict*)o->ptr, field, value);
@@ -1767,11 +2338,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                 break;
             }
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             sdsfree(field);
             sdsfree(value);
@@ -1819,36 +2388,76 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
-    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST_2) {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         if (len == 0) goto emptykey;
 
         o = createQuicklistObject();
-        quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
+        quicklistSetOptions(o->ptr, server.list_max_listpack_size,
                             server.list_compress_depth);
 
         while (len--) {
             size_t encoded_len;
+            uint64_t container = QUICKLIST_NODE_CONTAINER_PACKED;
+
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST_2) {
+                if ((container = rdbLoadLen(rdb,NULL)) == RDB_LENERR) {
+                    decrRefCount(o);
+                    return NULL;
+                }
+                if (container != QUICKLIST_NODE_CONTAINER_NONE &&
+                    container != QUICKLIST_NODE_CONTAINER_PACKED) {
+                    rdbReportCorruptRDB("Quicklist integrity check failed.");
+                    decrRefCount(o);
+                    return NULL;
+                }
+            }
             unsigned char *zl =
                 rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
             if (zl == NULL) {
                 decrRefCount(o);
                 return NULL;
             }
-            if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
-            if (!ziplistValidateIntegrity(zl, encoded_len, deep_integrity_validation, NULL, NULL)) {
-                rdbReportCorruptRDB("Ziplist integrity check failed.");
-                decrRefCount(o);
+            if (container == QUICKLIST_NODE_CONTAINER_NONE) {
+                /* A plain node of Redis 7, holding a single large element:
+                 * we store it in a listpack of its own. */
+                unsigned char *lp = lpNew(encoded_len);
+                lp = lpAppend(lp,zl,encoded_len);
                 zfree(zl);
-                return NULL;
+                quicklistAppendListpack(o->ptr,lp);
+                continue;
             }
-
-            /* Silently skip empty ziplists, if we'll end up with empty quicklist we'll fail later. */
-            if (ziplistLen(zl) == 0) {
+            if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST_2) {
+                if (!lpValidateIntegrity(zl, encoded_len, deep_integrity_validation, NULL, NULL)) {
+                    rdbReportCorruptRDB("Listpack integrity check failed.");
+                    decrRefCount(o);
+                    zfree(zl);
+                    return NULL;
+                }
+            } else {
+                /* Nodes of older RDB files are ziplists, convert them. The
+                 * conversion visits every entry anyway, so the ziplist is
+                 * always validated deeply: a corrupt one would otherwise
+                 * crash us before we get a chance to report it. */
+                if (!ziplistValidateIntegrity(zl, encoded_len, 1, NULL, NULL)) {
+                    rdbReportCorruptRDB("Ziplist integrity check failed.");
+                    decrRefCount(o);
+                    zfree(zl);
+                    return NULL;
+                }
+                unsigned char *lp = rdbListpackFromZiplist(zl);
                 zfree(zl);
+                zl = lp;
+            }
+
+            /* Silently skip empty listpacks, if we'll end up with empty quicklist we'll fail later. */
+            if (lpLength(zl) == 0) {
+                lpFree(zl);
                 continue;
             } else {
-                quicklistAppendZiplist(o->ptr, zl);
+                quicklistAppendListpack(o->ptr, zl);
             }
         }
 
@@ -1859,8 +2468,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
+               rdbtype == RDB_TYPE_SET_LISTPACK ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
         size_t encoded_len;
         unsigned char *encoded =
@@ -1886,10 +2498,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                     decrRefCount(o);
                     return NULL;
                 }
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew(0);
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1903,36 +2515,38 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                         /* search for duplicate records */
                         sds field = sdstrynewlen(fstr, flen);
                         if (!field || dictAdd(dupSearchDict, field, NULL) != DICT_OK ||
-                            !ziplistSafeToAdd(zl, (size_t)flen + vlen)) {
+                            !lpSafeToAdd(lp, (size_t)flen + vlen)) {
                             rdbReportCorruptRDB("Hash zipmap with dup elements, or big length (%u)", flen);
                             dictRelease(dupSearchDict);
                             sdsfree(field);
+                            lpFree(lp);
                             zfree(encoded);
                             o->ptr = NULL;
                             decrRefCount(o);
                             return NULL;
                         }
 
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     dictRelease(dupSearchDict);
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
-                    if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
-                        maxlen > server.hash_max_ziplist_value)
+                    if (hashTypeLength(o) > server.hash_max_listpack_entries ||
+                        maxlen > server.hash_max_listpack_value)
                     {
                         hashTypeConvert(o, OBJ_ENCODING_HT);
                     }
                 }
                 break;
             case RDB_TYPE_LIST_ZIPLIST:
-                if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
-                if (!ziplistValidateIntegrity(encoded, encoded_len, deep_integrity_validation, NULL, NULL)) {
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
+                /* Always validated deeply since we convert it, see above. */
+                if (!ziplistValidateIntegrity(encoded, encoded_len, 1, NULL, NULL)) {
                     rdbReportCorruptRDB("List ziplist integrity check failed.");
                     zfree(encoded);
                     o->ptr = NULL;
@@ -1947,12 +2561,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                     goto emptykey;
                 }
 
+                o->ptr = rdbListpackFromZiplist(encoded);
+                zfree(encoded);
                 o->type = OBJ_LIST;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 listTypeConvert(o,OBJ_ENCODING_QUICKLIST);
                 break;
             case RDB_TYPE_SET_INTSET:
-                if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
                 if (!intsetValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
                     rdbReportCorruptRDB("Intset integrity check failed.");
                     zfree(encoded);
@@ -1965,17 +2581,62 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
+            case RDB_TYPE_SET_LISTPACK:
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
+                if (!setTypeListpackValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
+                    rdbReportCorruptRDB("Set listpack integrity check failed.");
+                    zfree(encoded);
+                    o->ptr = NULL;
+                    decrRefCount(o);
+                    return NULL;
+                }
+
+                if (lpLength(encoded) == 0) {
+                    zfree(encoded);
+                    o->ptr = NULL;
+                    decrRefCount(o);
+                    goto emptykey;
+                }
+
+                o->type = OBJ_SET;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (setTypeSize(o) > server.set_max_listpack_entries)
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                break;
             case RDB_TYPE_ZSET_ZIPLIST:
-                if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
-                if (!zsetZiplistValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
+                if (!zsetZiplistValidateIntegrity(encoded, encoded_len, 1)) {
                     rdbReportCorruptRDB("Zset ziplist integrity check failed.");
                     zfree(encoded);
                     o->ptr = NULL;
                     decrRefCount(o);
                     return NULL;
                 }
+                if (ziplistLen(encoded) == 0) {
+                    zfree(encoded);
+                    o->ptr = NULL;
+                    decrRefCount(o);
+                    goto emptykey;
+                }
+
+                o->ptr = rdbListpackFromZiplist(encoded);
+                zfree(encoded);
+                o->type = OBJ_ZSET;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (zsetLength(o) > server.zset_max_listpack_entries)
+                    zsetConvert(o,server.zset_large_encoding);
+                break;
+            case RDB_TYPE_ZSET_LISTPACK:
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
+                if (!zsetListpackValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
+                    rdbReportCorruptRDB("Zset listpack integrity check failed.");
+                    zfree(encoded);
+                    o->ptr = NULL;
+                    decrRefCount(o);
+                    return NULL;
+                }
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (zsetLength(o) == 0) {
                     zfree(encoded);
                     o->ptr = NULL;
@@ -1983,20 +2644,43 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                     goto emptykey;
                 }
 
-                if (zsetLength(o) > server.zset_max_ziplist_entries)
-                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                if (zsetLength(o) > server.zset_max_listpack_entries)
+                    zsetConvert(o,server.zset_large_encoding);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
-                if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
-                if (!hashZiplistValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
+                if (!hashZiplistValidateIntegrity(encoded, encoded_len, 1)) {
                     rdbReportCorruptRDB("Hash ziplist integrity check failed.");
                     zfree(encoded);
                     o->ptr = NULL;
                     decrRefCount(o);
                     return NULL;
                 }
+                if (ziplistLen(encoded) == 0) {
+                    zfree(encoded);
+                    o->ptr = NULL;
+                    decrRefCount(o);
+                    goto emptykey;
+                }
+
+                o->ptr = rdbListpackFromZiplist(encoded);
+                zfree(encoded);
+                o->type = OBJ_HASH;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (hashTypeLength(o) > server.hash_max_listpack_entries)
+                    hashTypeConvert(o, OBJ_ENCODING_HT);
+                break;
+            case RDB_TYPE_HASH_LISTPACK:
+                if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
+                if (!hashListpackValidateIntegrity(encoded, encoded_len, deep_integrity_validation)) {
+                    rdbReportCorruptRDB("Hash listpack integrity check failed.");
+                    zfree(encoded);
+                    o->ptr = NULL;
+                    decrRefCount(o);
+                    return NULL;
+                }
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (hashTypeLength(o) == 0) {
                     zfree(encoded);
                     o->ptr = NULL;
@@ -2004,7 +2688,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                     goto emptykey;
                 }
 
-                if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+                if (hashTypeLength(o) > server.hash_max_listpack_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
             default:
@@ -2050,7 +2734,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                 decrRefCount(o);
                 return NULL;
             }
-            if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
+            if (deep_integrity_validation) atomicIncr(server.stat_dump_payload_sanitizations,1);
             if (!streamValidateListpackIntegrity(lp, lp_size, deep_integrity_validation)) {
                 rdbReportCorruptRDB("Stream listpack integrity check failed.");
                 sdsfree(nodekey);
@@ -2333,6 +3017,7 @@ void startLoading(size_t size, int rdbflags) {
     server.loading = 1;
     server.loading_start_time = time(NULL);
     server.loading_loaded_bytes = 0;
+    server.loading_loaded_keys = 0;
     server.loading_total_bytes = size;
     server.loading_rdb_used_mem = 0;
     blockingOperationStarts();
@@ -2417,6 +3102,810 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     }
 }
 
+/* -----------------------------------------------------------------------------
+ * Parallel loading
+ *
+ * When rdb-load-threads is greater than zero, the main thread only reads the
+ * RDB stream (so the checksum, the loading progress and the events processed
+ * while loading are handled as usual), copying the serialized value of every
+ * key as it is. Batches of serialized values are then decoded by the loading
+ * threads, that do the LZF decompression, the payload validation and the
+ * construction of the objects, while the main thread keeps reading. Finally
+ * the main thread adds the decoded keys to the keyspace, in the same order
+ * they were read.
+ *
+ * Only the types that can be decoded without touching any global state are
+ * decoded by the threads: streams and module values are still loaded by the
+ * main thread, after adding all the pending keys.
+ * -------------------------------------------------------------------------- */
+
+#define RDB_LOAD_BATCH_KEYS 128             /* Max keys of a batch. */
+#define RDB_LOAD_BATCH_BYTES (1024*1024)    /* Max serialized bytes. */
+#define RDB_LOAD_BATCHES_PER_THREAD 2       /* Max batches in flight. */
+
+/* State of the loading shared by rdbLoadRio() and the keys added by the
+ * parallel loading. */
+typedef struct rdbLoadState {
+    int rdbflags;
+    long long lru_clock;
+    long long keys_loaded;
+    long long empty_keys_skipped;
+    long long expired_keys_skipped;
+} rdbLoadState;
+
+typedef struct rdbLoadJob {
+    redisDb *db;
+    sds key;
+    int type;
+    long long expiretime, lfu_freq, lru_idle;
+    sds raw;        /* Serialized value, released by the loading thread. */
+    robj *val;      /* Decoded value, or NULL on error. */
+    int error;      /* rdbLoadObject() error if 'val' is NULL. */
+} rdbLoadJob;
+
+typedef struct rdbLoadBatch {
+    rdbLoadJob jobs[RDB_LOAD_BATCH_KEYS];
+    int count;
+    size_t bytes;
+    int done;                           /* Decoded by a loading thread. */
+    struct rdbLoadBatch *next_pending;  /* Next batch to decode. */
+    struct rdbLoadBatch *next;          /* Next batch in reading order. */
+} rdbLoadBatch;
+
+typedef struct rdbLoadPipeline {
+    pthread_t *threads;
+    int numthreads;
+    int started;                    /* Used to name the threads. */
+    pthread_mutex_t lock;
+    pthread_cond_t pending_cond;    /* Signaled when a batch is queued. */
+    pthread_cond_t done_cond;       /* Signaled when a batch is decoded. */
+    rdbLoadBatch *pending_head, *pending_tail; /* Batches to decode. */
+    rdbLoadBatch *head, *tail;      /* Batches not yet added, in order. */
+    int inflight;                   /* Number of batches in the list above. */
+    int stop;                       /* Tell the threads to exit. */
+    rdbLoadBatch *current;          /* Batch being filled. */
+} rdbLoadPipeline;
+
+/* Add a loaded key to the keyspace, handling the expire and the LRU/LFU
+ * information read before it, or skip it if its value is empty. Returns
+ * C_ERR if the value could not be loaded. Takes care of freeing 'key'. */
+static int rdbLoadAddKey(rdbLoadState *state, redisDb *db, sds key, robj *val,
+                         int error, long long expiretime, long long lfu_freq,
+                         long long lru_idle)
+{
+    if (val == NULL) {
+        /* Since we used to have bug that could lead to empty keys
+         * (See #8453), we rather not fail when empty key is encountered
+         * in an RDB file, instead we will silently discard it and
+         * continue loading. */
+        if (error == RDB_LOAD_ERR_EMPTY_KEY) {
+            if(state->empty_keys_skipped++ < 10)
+                serverLog(LL_WARNING, "rdbLoadObject skipping empty key: %s", key);
+            sdsfree(key);
+            return C_OK;
+        } else {
+            sdsfree(key);
+            return C_ERR;
+        }
+    }
+
+    robj keyobj;
+    initStaticStringObject(keyobj,key);
+
+    /* Add the new object in the hash table */
+    int added = dbAddRDBLoad(db,key,val);
+    state->keys_loaded++;
+    server.loading_loaded_keys++;
+    if (!added) {
+        if (state->rdbflags & RDBFLAGS_ALLOW_DUP) {
+            /* This flag is useful for DEBUG RELOAD special modes.
+             * When it's set we allow new keys to replace the current
+             * keys with the same name. */
+            dbSyncDelete(db,&keyobj);
+            dbAddRDBLoad(db,key,val);
+        } else {
+            serverLog(LL_WARNING,
+                "RDB has duplicated key '%s' in DB %d",key,db->id);
+            serverPanic("Duplicated key found in RDB file");
+        }
+    }
+
+    /* Set the expire time if needed */
+    if (expiretime != -1) {
+        setExpire(NULL,db,&keyobj,expiretime);
+    }
+
+    /* Set usage information (for eviction). */
+    objectSetLRUOrLFU(val,lfu_freq,lru_idle,state->lru_clock,1000);
+
+    /* call key space notification on key loaded for modules only */
+    moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+
+    /* The key was copied inside the keyspace entry. */
+    sdsfree(key);
+    return C_OK;
+}
+
+/* Return true if values of the RDB type 'rdbtype' can be copied with
+ * rdbCopyObject() and decoded by the loading threads. */
+static int rdbIsParallelLoadType(int rdbtype) {
+    return rdbtype != RDB_TYPE_STREAM_LISTPACKS &&
+           rdbtype != RDB_TYPE_MODULE &&
+           rdbtype != RDB_TYPE_MODULE_2 &&
+           rdbIsObjectType(rdbtype);
+}
+
+/* Read 'len' bytes from the RDB stream appending them to '*raw'. */
+static int rdbCopyRaw(rio *rdb, sds *raw, size_t len) {
+    size_t oldlen = sdslen(*raw);
+    *raw = sdsMakeRoomFor(*raw,len);
+    if (rioRead(rdb,*raw+oldlen,len) == 0) return -1;
+    sdsIncrLen(*raw,len);
+    return 0;
+}
+
+/* Like rdbLoadLenByRef(), but the length is also appended to '*raw'. */
+static int rdbCopyLen(rio *rdb, sds *raw, int *isencoded, uint64_t *lenptr) {
+    unsigned char *p;
+    size_t start = sdslen(*raw);
+    int type;
+
+    if (isencoded) *isencoded = 0;
+    if (rdbCopyRaw(rdb,raw,1) == -1) return -1;
+    p = (unsigned char*)*raw+start;
+    type = (p[0]&0xC0)>>6;
+    if (type == RDB_ENCVAL) {
+        if (isencoded) *isencoded = 1;
+        *lenptr = p[0]&0x3F;
+    } else if (type == RDB_6BITLEN) {
+        *lenptr = p[0]&0x3F;
+    } else if (type == RDB_14BITLEN) {
+        if (rdbCopyRaw(rdb,raw,1) == -1) return -1;
+        p = (unsigned char*)*raw+start;
+        *lenptr = ((p[0]&0x3F)<<8)|p[1];
+    } else if (p[0] == RDB_32BITLEN) {
+        uint32_t len;
+        if (rdbCopyRaw(rdb,raw,4) == -1) return -1;
+        memcpy(&len,*raw+start+1,4);
+        *lenptr = ntohl(len);
+    } else if (p[0] == RDB_64BITLEN) {
+        uint64_t len;
+        if (rdbCopyRaw(rdb,raw,8) == -1) return -1;
+        memcpy(&len,*raw+start+1,8);
+        *lenptr = ntohu64(len);
+    } else {
+        rdbReportCorruptRDB(
+            "Unknown length encoding %d in rdbCopyLen()",type);
+        return -1; /* Never reached. */
+    }
+    return 0;
+}
+
+/* Copy a string as serialized by rdbSaveRawString(), without decoding it. */
+static int rdbCopyString(rio *rdb, sds *raw) {
+    uint64_t len, clen;
+    int isencoded;
+
+    if (rdbCopyLen(rdb,raw,&isencoded,&len) == -1) return -1;
+    if (isencoded) {
+        switch(len) {
+        case RDB_ENC_INT8: return rdbCopyRaw(rdb,raw,1);
+        case RDB_ENC_INT16: return rdbCopyRaw(rdb,raw,2);
+        case RDB_ENC_INT32: return rdbCopyRaw(rdb,raw,4);
+        case RDB_ENC_COMPRESSED:
+            if (rdbCopyRaw(rdb,raw,1) == -1) return -1;
+            /* Fall through. */
+        case RDB_ENC_LZF:
+            if (rdbCopyLen(rdb,raw,NULL,&clen) == -1) return -1;
+            if (rdbCopyLen(rdb,raw,NULL,&len) == -1) return -1;
+            return rdbCopyRaw(rdb,raw,clen);
+        default:
+            rdbReportCorruptRDB("Unknown RDB string encoding type %llu",
+                (unsigned long long)len);
+            return -1;
+        }
+    }
+    return rdbCopyRaw(rdb,raw,len);
+}
+
+/* Copy a double as serialized by rdbSaveDoubleValue(). */
+static int rdbCopyDouble(rio *rdb, sds *raw) {
+    size_t start = sdslen(*raw);
+    if (rdbCopyRaw(rdb,raw,1) == -1) return -1;
+    unsigned char len = (*raw)[start];
+    /* 253, 254 and 255 are NaN, +inf and -inf, without payload. */
+    if (len >= 253) return 0;
+    return rdbCopyRaw(rdb,raw,len);
+}
+
+/* Copy the serialized value of type 'rdbtype' appending it to '*raw', so
+ * that it can be later decoded with rdbLoadObject() from a buffer. */
+static int rdbCopyObject(rio *rdb, int rdbtype, sds *raw) {
+    uint64_t len;
+
+    switch(rdbtype) {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_SET_ROARING:
+    case RDB_TYPE_SET_LISTPACK:
+    case RDB_TYPE_ZSET_LISTPACK:
+    case RDB_TYPE_HASH_LISTPACK:
+        return rdbCopyString(rdb,raw);
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_SET:
+    case RDB_TYPE_LIST_QUICKLIST:
+        if (rdbCopyLen(rdb,raw,NULL,&len) == -1) return -1;
+        while(len--) if (rdbCopyString(rdb,raw) == -1) return -1;
+        return 0;
+    case RDB_TYPE_LIST_QUICKLIST_2: {
+        /* Every node is preceded by its container. */
+        uint64_t container;
+        if (rdbCopyLen(rdb,raw,NULL,&len) == -1) return -1;
+        while(len--) {
+            if (rdbCopyLen(rdb,raw,NULL,&container) == -1) return -1;
+            if (rdbCopyString(rdb,raw) == -1) return -1;
+        }
+        return 0;
+    }
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+        if (rdbCopyLen(rdb,raw,NULL,&len) == -1) return -1;
+        while(len--) {
+            if (rdbCopyString(rdb,raw) == -1) return -1;
+            if (rdbtype == RDB_TYPE_ZSET_2) {
+                if (rdbCopyRaw(rdb,raw,sizeof(double)) == -1) return -1;
+            } else {
+                if (rdbCopyDouble(rdb,raw) == -1) return -1;
+            }
+        }
+        return 0;
+    case RDB_TYPE_HASH:
+        if (rdbCopyLen(rdb,raw,NULL,&len) == -1) return -1;
+        while(len--) {
+            if (rdbCopyString(rdb,raw) == -1) return -1;
+            if (rdbCopyString(rdb,raw) == -1) return -1;
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* Decode the serialized values of a batch. Called by the loading threads. */
+static void rdbLoadDecodeBatch(rdbLoadBatch *batch) {
+    for (int j = 0; j < batch->count; j++) {
+        rdbLoadJob *job = batch->jobs+j;
+        rio r;
+
+        rioInitWithBuffer(&r,job->raw);
+        job->val = rdbLoadObject(job->type,&r,job->key,&job->error);
+        sdsfree(job->raw);
+        job->raw = NULL;
+    }
+}
+
+static void *rdbLoadThreadMain(void *arg) {
+    rdbLoadPipeline *p = arg;
+    char thdname[16];
+    sigset_t sigset;
+
+    pthread_mutex_lock(&p->lock);
+    snprintf(thdname,sizeof(thdname),"rdb_load_%d",p->started++);
+    pthread_mutex_unlock(&p->lock);
+    redis_set_thread_title(thdname);
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    pthread_mutex_lock(&p->lock);
+    while(1) {
+        while (p->pending_head == NULL && !p->stop)
+            pthread_cond_wait(&p->pending_cond,&p->lock);
+        if (p->pending_head == NULL) break; /* Stopping. */
+
+        rdbLoadBatch *batch = p->pending_head;
+        p->pending_head = batch->next_pending;
+        if (p->pending_head == NULL) p->pending_tail = NULL;
+        pthread_mutex_unlock(&p->lock);
+
+        rdbLoadDecodeBatch(batch);
+
+        pthread_mutex_lock(&p->lock);
+        batch->done = 1;
+        pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static rdbLoadPipeline *rdbLoadPipelineCreate(int numthreads) {
+    rdbLoadPipeline *p = zcalloc(sizeof(*p));
+
+    pthread_mutex_init(&p->lock,NULL);
+    pthread_cond_init(&p->pending_cond,NULL);
+    pthread_cond_init(&p->done_cond,NULL);
+    p->threads = zmalloc(sizeof(pthread_t)*numthreads);
+    for (int j = 0; j < numthreads; j++) {
+        if (pthread_create(&p->threads[j],NULL,rdbLoadThreadMain,p) != 0) {
+            serverLog(LL_WARNING,
+                "Fatal: Can't initialize the RDB loading threads.");
+            exit(1);
+        }
+        p->numthreads++;
+    }
+    return p;
+}
+
+/* Queue the batch being filled, if any, for the loading threads. */
+static void rdbLoadPipelineSubmit(rdbLoadPipeline *p) {
+    rdbLoadBatch *batch = p->current;
+
+    if (batch == NULL) return;
+    p->current = NULL;
+    pthread_mutex_lock(&p->lock);
+    if (p->pending_tail)
+        p->pending_tail->next_pending = batch;
+    else
+        p->pending_head = batch;
+    p->pending_tail = batch;
+    if (p->tail)
+        p->tail->next = batch;
+    else
+        p->head = batch;
+    p->tail = batch;
+    p->inflight++;
+    pthread_cond_signal(&p->pending_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Wait for the oldest batch in flight to be decoded, and unlink it. */
+static rdbLoadBatch *rdbLoadPipelineWaitOldest(rdbLoadPipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    rdbLoadBatch *batch = p->head;
+    while (!batch->done) pthread_cond_wait(&p->done_cond,&p->lock);
+    p->head = batch->next;
+    if (p->head == NULL) p->tail = NULL;
+    p->inflight--;
+    pthread_mutex_unlock(&p->lock);
+    return batch;
+}
+
+/* Add to the keyspace the keys of the oldest batch in flight. On error the
+ * keys of the batch not yet added are released, and C_ERR is returned. */
+static int rdbLoadPipelineAddOldest(rdbLoadPipeline *p, rdbLoadState *state) {
+    rdbLoadBatch *batch = rdbLoadPipelineWaitOldest(p);
+    int retval = C_OK;
+
+    for (int j = 0; j < batch->count; j++) {
+        rdbLoadJob *job = batch->jobs+j;
+        if (retval == C_ERR) {
+            sdsfree(job->key);
+            if (job->val) decrRefCount(job->val);
+            continue;
+        }
+        retval = rdbLoadAddKey(state,job->db,job->key,job->val,job->error,
+                               job->expiretime,job->lfu_freq,job->lru_idle);
+    }
+    zfree(batch);
+    return retval;
+}
+
+/* Add all the pending keys to the keyspace. */
+static int rdbLoadPipelineFlush(rdbLoadPipeline *p, rdbLoadState *state) {
+    int retval = C_OK;
+
+    rdbLoadPipelineSubmit(p);
+    while (p->inflight) {
+        if (rdbLoadPipelineAddOldest(p,state) == C_ERR) retval = C_ERR;
+    }
+    return retval;
+}
+
+/* Queue a key with its serialized value for decoding. If too many batches
+ * are in flight, add the oldest one to the keyspace first. */
+static int rdbLoadPipelineAdd(rdbLoadPipeline *p, rdbLoadState *state,
+                              rdbLoadJob *job)
+{
+    if (p->current == NULL) p->current = zcalloc(sizeof(rdbLoadBatch));
+    p->current->jobs[p->current->count++] = *job;
+    p->current->bytes += sdslen(job->raw);
+    if (p->current->count == RDB_LOAD_BATCH_KEYS ||
+        p->current->bytes >= RDB_LOAD_BATCH_BYTES)
+    {
+        rdbLoadPipelineSubmit(p);
+        if (p->inflight > p->numthreads*RDB_LOAD_BATCHES_PER_THREAD)
+            return rdbLoadPipelineAddOldest(p,state);
+    }
+    return C_OK;
+}
+
+/* Stop the loading threads and release the pipeline. The keys still pending
+ * are discarded, so the pipeline should be flushed first on success. */
+static void rdbLoadPipelineRelease(rdbLoadPipeline *p) {
+    rdbLoadPipelineSubmit(p);
+    while (p->inflight) {
+        rdbLoadBatch *batch = rdbLoadPipelineWaitOldest(p);
+        for (int j = 0; j < batch->count; j++) {
+            sdsfree(batch->jobs[j].key);
+            if (batch->jobs[j].val) decrRefCount(batch->jobs[j].val);
+        }
+        zfree(batch);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->pending_cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int j = 0; j < p->numthreads; j++)
+        pthread_join(p->threads[j],NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->pending_cond);
+    pthread_cond_destroy(&p->done_cond);
+    zfree(p->threads);
+    zfree(p);
+}
+
+/* -----------------------------------------------------------------------------
+ * Multi-stream loading
+ *
+ * When the master transfers the RDB over multiple streams (see
+ * repl-diskless-sync-streams), the additional streams carry disjoint parts
+ * of the keyspace, each one as a standalone RDB payload with its own EOF
+ * mark and checksum, and only containing values of the types that can be
+ * decoded without touching any global state. Every additional stream is read
+ * and decoded by its own thread, while the main thread loads the main stream
+ * with rdbLoadRio() as usual, adding to the keyspace the keys decoded by the
+ * threads as they are ready.
+ * -------------------------------------------------------------------------- */
+
+#define RDB_LOAD_STREAM_WAIT_MS 100     /* Max wait before serving events. */
+
+typedef struct rdbLoadStreams {
+    pthread_t *threads;
+    connection **conns;
+    int numconns;
+    int started;                    /* Used to name the threads. */
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;      /* Signaled on batches or threads done. */
+    pthread_cond_t room_cond;       /* Signaled when batches are consumed. */
+    rdbLoadBatch *head, *tail;      /* Decoded batches to add, in order. */
+    int ready;                      /* Number of batches in the list above. */
+    int running;                    /* Threads still reading. */
+    int error;                      /* A stream could not be loaded. */
+    int stop;                       /* Tell the threads to exit. */
+} rdbLoadStreams;
+
+/* The additional streams of the RDB being loaded, if any. */
+static rdbLoadStreams *rdbLoadingStreams = NULL;
+
+/* Queue a batch of decoded keys for the main thread, waiting for the main
+ * thread to add the older ones if too many are ready. Returns 0 if the
+ * loading is being aborted: the batch is queued anyway, so that it is
+ * released by the main thread. */
+static int rdbLoadStreamsPush(rdbLoadStreams *p, rdbLoadBatch *batch) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && p->ready >= p->numconns*RDB_LOAD_BATCHES_PER_THREAD)
+        pthread_cond_wait(&p->room_cond,&p->lock);
+    batch->done = 1;
+    if (p->tail) p->tail->next = batch; else p->head = batch;
+    p->tail = batch;
+    p->ready++;
+    pthread_cond_signal(&p->ready_cond);
+    int stop = p->stop;
+    pthread_mutex_unlock(&p->lock);
+    return !stop;
+}
+
+/* Read and decode an additional stream of the RDB from 'conn'. */
+static int rdbLoadStream(rdbLoadStreams *p, connection *conn, int index) {
+    char buf[1024], eofmark[RDB_EOF_MARK_SIZE];
+    redisDb *db = server.db+0;
+    long long lru_idle = -1, lfu_freq = -1, expiretime = -1;
+    rdbLoadBatch *batch = NULL;
+    int type, rdbver, error;
+    uint64_t dbid;
+    rio rdb;
+
+    /* The stream starts like the main one, see rdbSaveRioWithEOFMark(),
+     * unless the master refused to attach it. */
+    do {
+        if (connSyncReadLine(conn,buf,sizeof(buf),
+                             server.repl_timeout*1000) == -1)
+        {
+            serverLog(LL_WARNING,"I/O error reading RDB stream %d from MASTER: %s",
+                index, strerror(errno));
+            return C_ERR;
+        }
+    } while (buf[0] == '\0');
+    if (buf[0] == '-') {
+        serverLog(LL_WARNING,"MASTER refused RDB stream %d: %s",index,buf+1);
+        return C_ERR;
+    }
+    if (strncmp(buf,"$EOF:",5) != 0 || strlen(buf+5) < RDB_EOF_MARK_SIZE) {
+        serverLog(LL_WARNING,"Bad protocol from MASTER in RDB stream %d",index);
+        return C_ERR;
+    }
+    memcpy(eofmark,buf+5,RDB_EOF_MARK_SIZE);
+
+    rioInitWithConn(&rdb,conn,0);
+    if (server.rdb_checksum)
+        rdb.update_cksum = rioGenericUpdateChecksum;
+    if (rioRead(&rdb,buf,9) == 0) goto eoferr;
+    buf[9] = '\0';
+    rdbver = atoi(buf+5);
+    if (memcmp(buf,"REDIS",5) != 0 || rdbver < 1 || rdbver > RDB_VERSION) {
+        serverLog(LL_WARNING,"Wrong signature of RDB stream %d",index);
+        goto err;
+    }
+
+    while(1) {
+        if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
+
+        if (type == RDB_OPCODE_EXPIRETIME) {
+            expiretime = rdbLoadTime(&rdb);
+            expiretime *= 1000;
+            if (rioGetReadError(&rdb)) goto eoferr;
+            continue;
+        } else if (type == RDB_OPCODE_EXPIRETIME_MS) {
+            expiretime = rdbLoadMillisecondTime(&rdb,rdbver);
+            if (rioGetReadError(&rdb)) goto eoferr;
+            continue;
+        } else if (type == RDB_OPCODE_FREQ) {
+            uint8_t byte;
+            if (rioRead(&rdb,&byte,1) == 0) goto eoferr;
+            lfu_freq = byte;
+            continue;
+        } else if (type == RDB_OPCODE_IDLE) {
+            uint64_t qword;
+            if ((qword = rdbLoadLen(&rdb,NULL)) == RDB_LENERR) goto eoferr;
+            lru_idle = qword;
+            continue;
+        } else if (type == RDB_OPCODE_EOF) {
+            break;
+        } else if (type == RDB_OPCODE_SELECTDB) {
+            if ((dbid = rdbLoadLen(&rdb,NULL)) == RDB_LENERR) goto eoferr;
+            if (dbid >= (unsigned)server.dbnum) {
+                serverLog(LL_WARNING,"RDB stream %d selects DB %llu, but "
+                    "only %d databases are configured",
+                    index, (unsigned long long)dbid, server.dbnum);
+                goto err;
+            }
+            db = server.db+dbid;
+            continue;
+        } else if (type == RDB_OPCODE_RESIZEDB) {
+            /* Already handled by the main stream. */
+            if (rdbLoadLen(&rdb,NULL) == RDB_LENERR) goto eoferr;
+            if (rdbLoadLen(&rdb,NULL) == RDB_LENERR) goto eoferr;
+            continue;
+        } else if (!rdbIsParallelLoadType(type)) {
+            serverLog(LL_WARNING,"Unexpected type %d in RDB stream %d",
+                type, index);
+            goto err;
+        }
+
+        /* The keys are never expired here: a replica loads the keys as
+         * they are, since the master is responsible for key expiry. */
+        sds key = rdbGenericLoadStringObject(&rdb,RDB_LOAD_SDS,NULL);
+        if (key == NULL) goto eoferr;
+        if (batch == NULL) batch = zcalloc(sizeof(rdbLoadBatch));
+        rdbLoadJob *job = batch->jobs+batch->count++;
+        job->db = db;
+        job->key = key;
+        job->type = type;
+        job->expiretime = expiretime;
+        job->lfu_freq = lfu_freq;
+        job->lru_idle = lru_idle;
+        job->val = rdbLoadObject(type,&rdb,key,&error);
+        job->error = error;
+        if (job->val == NULL && error != RDB_LOAD_ERR_EMPTY_KEY) goto eoferr;
+        if (batch->count == RDB_LOAD_BATCH_KEYS) {
+            rdbLoadBatch *full = batch;
+            batch = NULL;
+            if (!rdbLoadStreamsPush(p,full)) goto err;
+        }
+
+        if (server.key_load_delay)
+            debugDelay(server.key_load_delay);
+
+        expiretime = -1;
+        lfu_freq = -1;
+        lru_idle = -1;
+    }
+    if (batch) {
+        rdbLoadBatch *last = batch;
+        batch = NULL;
+        if (!rdbLoadStreamsPush(p,last)) goto err;
+    }
+
+    /* Verify the checksum if RDB version is >= 5 */
+    if (rdbver >= 5) {
+        uint64_t cksum, expected = rdb.cksum;
+
+        if (rioRead(&rdb,&cksum,8) == 0) goto eoferr;
+        memrev64ifbe(&cksum);
+        if (server.rdb_checksum && !server.skip_checksum_validation &&
+            cksum != 0 && cksum != expected)
+        {
+            serverLog(LL_WARNING,"Wrong RDB checksum in RDB stream %d",index);
+            goto err;
+        }
+    }
+
+    /* Verify the end mark is correct. */
+    if (rioRead(&rdb,buf,RDB_EOF_MARK_SIZE) == 0 ||
+        memcmp(buf,eofmark,RDB_EOF_MARK_SIZE) != 0)
+    {
+        serverLog(LL_WARNING,"RDB stream %d EOF marker is broken",index);
+        goto err;
+    }
+    rioFreeConn(&rdb,NULL);
+    return C_OK;
+
+eoferr:
+    serverLog(LL_WARNING,"Short read or corrupted data in RDB stream %d",index);
+err:
+    if (batch) rdbLoadStreamsPush(p,batch);
+    rioFreeConn(&rdb,NULL);
+    return C_ERR;
+}
+
+static void *rdbLoadStreamThreadMain(void *arg) {
+    rdbLoadStreams *p = arg;
+    char thdname[32];
+    sigset_t sigset;
+    int index;
+
+    pthread_mutex_lock(&p->lock);
+    index = p->started++;
+    pthread_mutex_unlock(&p->lock);
+    snprintf(thdname,sizeof(thdname),"rdb_stream_%d",index+1);
+    redis_set_thread_title(thdname);
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    int retval = rdbLoadStream(p,p->conns[index],index+1);
+
+    pthread_mutex_lock(&p->lock);
+    if (retval == C_ERR) p->error = 1;
+    p->running--;
+    pthread_cond_signal(&p->ready_cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Start reading the additional streams of the RDB the next rdbLoadRio()
+ * call loads, from the connections 'conns', that must be in blocking mode.
+ * The caller still owns the connections, and must call rdbLoadStreamsStop()
+ * once rdbLoadRio() returned, before closing them. */
+void rdbLoadStreamsStart(connection **conns, int numconns) {
+    rdbLoadStreams *p = zcalloc(sizeof(*p));
+
+    serverAssert(rdbLoadingStreams == NULL);
+    pthread_mutex_init(&p->lock,NULL);
+    pthread_cond_init(&p->ready_cond,NULL);
+    pthread_cond_init(&p->room_cond,NULL);
+    p->conns = conns;
+    p->numconns = numconns;
+    p->threads = zmalloc(sizeof(pthread_t)*numconns);
+    p->running = numconns;
+    for (int j = 0; j < numconns; j++) {
+        if (pthread_create(&p->threads[j],NULL,rdbLoadStreamThreadMain,p) != 0) {
+            serverLog(LL_WARNING,
+                "Fatal: Can't initialize the RDB stream threads.");
+            exit(1);
+        }
+    }
+    rdbLoadingStreams = p;
+}
+
+/* Add to the keyspace the keys decoded by the stream threads so far.
+ * Returns C_ERR if a key or a stream could not be loaded. */
+static int rdbLoadStreamsAddReady(rdbLoadStreams *p, rdbLoadState *state) {
+    rdbLoadBatch *batch;
+    int retval = C_OK;
+
+    pthread_mutex_lock(&p->lock);
+    batch = p->head;
+    p->head = p->tail = NULL;
+    p->ready = 0;
+    if (p->error) retval = C_ERR;
+    pthread_cond_broadcast(&p->room_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    while (batch) {
+        rdbLoadBatch *next = batch->next;
+        for (int j = 0; j < batch->count; j++) {
+            rdbLoadJob *job = batch->jobs+j;
+            if (retval == C_ERR) {
+                sdsfree(job->key);
+                if (job->val) decrRefCount(job->val);
+                continue;
+            }
+            retval = rdbLoadAddKey(state,job->db,job->key,job->val,
+                                   job->error,job->expiretime,
+                                   job->lfu_freq,job->lru_idle);
+        }
+        zfree(batch);
+        batch = next;
+    }
+    return retval;
+}
+
+/* Called by rdbLoadRio() once the main stream was loaded: add the keys of
+ * the additional streams until all of them are loaded, serving the events
+ * from time to time like rdbLoadProgressCallback() does. */
+static int rdbLoadStreamsFinish(rdbLoadStreams *p, rio *rdb,
+                                rdbLoadState *state)
+{
+    long long last_events = mstime();
+
+    while(1) {
+        if (rdbLoadStreamsAddReady(p,state) == C_ERR) return C_ERR;
+
+        pthread_mutex_lock(&p->lock);
+        if (p->head == NULL && p->running) {
+            struct timespec deadline;
+            long long when = ustime()+RDB_LOAD_STREAM_WAIT_MS*1000;
+            deadline.tv_sec = when/1000000;
+            deadline.tv_nsec = (when%1000000)*1000;
+            pthread_cond_timedwait(&p->ready_cond,&p->lock,&deadline);
+        }
+        int done = p->head == NULL && p->running == 0;
+        pthread_mutex_unlock(&p->lock);
+        if (done) break;
+
+        if (mstime() - last_events >= RDB_LOAD_STREAM_WAIT_MS) {
+            if (server.masterhost && server.repl_state == REPL_STATE_TRANSFER)
+                replicationSendNewlineToMaster();
+            loadingProgress(rdb->processed_bytes);
+            processEventsWhileBlocked();
+            processModuleLoadingProgressEvent(0);
+            last_events = mstime();
+        }
+    }
+    return p->error ? C_ERR : C_OK;
+}
+
+/* Stop reading the additional streams, releasing the keys not yet added. */
+void rdbLoadStreamsStop(void) {
+    rdbLoadStreams *p = rdbLoadingStreams;
+
+    if (p == NULL) return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->room_cond);
+    pthread_mutex_unlock(&p->lock);
+    /* Wake up the threads blocked reading from the master. */
+    for (int j = 0; j < p->numconns; j++) connShutdown(p->conns[j]);
+    for (int j = 0; j < p->numconns; j++)
+        pthread_join(p->threads[j],NULL);
+
+    while (p->head) {
+        rdbLoadBatch *next = p->head->next;
+        for (int j = 0; j < p->head->count; j++) {
+            sdsfree(p->head->jobs[j].key);
+            if (p->head->jobs[j].val) decrRefCount(p->head->jobs[j].val);
+        }
+        zfree(p->head);
+        p->head = next;
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->ready_cond);
+    pthread_cond_destroy(&p->room_cond);
+    zfree(p->threads);
+    zfree(p);
+    rdbLoadingStreams = NULL;
+}
+
 /* Load an RDB file from the rio stream 'rdb'. On success C_OK is returned,
  * otherwise C_ERR is returned and 'errno' is set accordingly. */
 int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
@@ -2425,7 +3914,9 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     redisDb *db = server.db+0;
     char buf[1024];
     int error;
-    long long empty_keys_skipped = 0, expired_keys_skipped = 0, keys_loaded = 0;
+    rdbLoadState state = {rdbflags, 0, 0, 0, 0};
+    rdbLoadPipeline *pipeline = NULL;
+    long long shards = 1, shard_id = 0; /* Layout of the server saving it. */
 
     rdb->update_cksum = rdbLoadProgressCallback;
     rdb->max_processing_chunk = server.loading_process_events_interval_bytes;
@@ -2445,12 +3936,21 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
 
     /* Key-specific attributes, set by opcodes before the key type. */
     long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
-    long long lru_clock = LRU_CLOCK();
+    state.lru_clock = LRU_CLOCK();
+
+    /* The RDB check mode always loads the values in the main thread. */
+    if (server.rdb_load_threads > 0 && !rdbCheckMode)
+        pipeline = rdbLoadPipelineCreate(server.rdb_load_threads);
 
     while(1) {
         sds key;
         robj *val;
 
+        /* Add the keys loaded by the additional streams, if any. */
+        if (rdbLoadingStreams &&
+            rdbLoadStreamsAddReady(rdbLoadingStreams,&state) == C_ERR)
+            goto eoferr;
+
         /* Read type. */
         if ((type = rdbLoadType(rdb)) == -1) goto eoferr;
 
@@ -2483,6 +3983,15 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
+            if (pipeline) {
+                if (rdbLoadPipelineFlush(pipeline,&state) == C_ERR)
+                    goto eoferr;
+                rdbLoadPipelineRelease(pipeline);
+                pipeline = NULL;
+            }
+            if (rdbLoadingStreams &&
+                rdbLoadStreamsFinish(rdbLoadingStreams,rdb,&state) == C_ERR)
+                goto eoferr;
             break;
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
@@ -2494,6 +4003,20 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                     "databases. Exiting\n", server.dbnum);
                 exit(1);
             }
+            /* The keys are those of the hash slots of the shard that saved
+             * them: with another layout they would be served by the wrong
+             * shard. The info AUX fields are all before the first DB. */
+            if (!rdbCheckMode && !(rdbflags & RDBFLAGS_REPLICATION) &&
+                (shards != server.shards || shard_id != server.shard_id))
+            {
+                serverLog(LL_WARNING,
+                    "FATAL: Data file was created by shard %lld of a Redis "
+                    "server with %lld shards, but this is shard %d of %d. "
+                    "Changing the number of shards is not supported. "
+                    "Exiting\n", shard_id, shards, server.shard_id,
+                    server.shards);
+                exit(1);
+            }
             db = server.db+dbid;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_RESIZEDB) {
@@ -2533,6 +4056,14 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                 }
             } else if (!strcasecmp(auxkey->ptr,"repl-offset")) {
                 if (rsi) rsi->repl_offset = strtoll(auxval->ptr,NULL,10);
+            } else if (!strcasecmp(auxkey->ptr,"repl-backlog")) {
+                /* Only kept when restarting from our own RDB file, the
+                 * caller decides whether to restore it. */
+                if (rsi && !(rdbflags & RDBFLAGS_REPLICATION)) {
+                    if (rsi->repl_backlog) decrRefCount(rsi->repl_backlog);
+                    rsi->repl_backlog = auxval;
+                    incrRefCount(auxval);
+                }
             } else if (!strcasecmp(auxkey->ptr,"lua")) {
                 /* Load the script back in memory. */
                 if (luaCreateFunction(NULL,server.lua,auxval) == NULL) {
@@ -2558,6 +4089,10 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                 if (haspreamble) serverLog(LL_NOTICE,"RDB has an AOF tail");
             } else if (!strcasecmp(auxkey->ptr,"redis-bits")) {
                 /* Just ignored. */
+            } else if (!strcasecmp(auxkey->ptr,"shards")) {
+                shards = strtoll(auxval->ptr,NULL,10);
+            } else if (!strcasecmp(auxkey->ptr,"shard-id")) {
+                shard_id = strtoll(auxval->ptr,NULL,10);
             } else {
                 /* We ignore fields we don't understand, as by AUX field
                  * contract. */
@@ -2572,6 +4107,8 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             /* Load module data that is not related to the Redis key space.
              * Such data can be potentially be stored both before and after the
              * RDB keys-values section. */
+            if (pipeline && rdbLoadPipelineFlush(pipeline,&state) == C_ERR)
+                goto eoferr;
             uint64_t moduleid = rdbLoadLen(rdb,NULL);
             int when_opcode = rdbLoadLen(rdb,NULL);
             int when = rdbLoadLen(rdb,NULL);
@@ -2626,8 +4163,6 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         /* Read key */
         if ((key = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL)
             goto eoferr;
-        /* Read value */
-        val = rdbLoadObject(type,rdb,key,&error);
 
         /* Check if the key already expired. This function is used when loading
          * an RDB file from disk, either at startup, or when an RDB was
@@ -2637,57 +4172,46 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
          * Similarly if the RDB is the preamble of an AOF file, we want to
          * load all the keys as they are, since the log of operations later
          * assume to work in an exact keyspace state. */
-        if (val == NULL) {
-            /* Since we used to have bug that could lead to empty keys
-             * (See #8453), we rather not fail when empty key is encountered
-             * in an RDB file, instead we will silently discard it and
-             * continue loading. */
-            if (error == RDB_LOAD_ERR_EMPTY_KEY) {
-                if(empty_keys_skipped++ < 10)
-                    serverLog(LL_WARNING, "rdbLoadObject skipping empty key: %s", key);
-                sdsfree(key);
-            } else {
+        int expired = iAmMaster() &&
+            !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
+            expiretime != -1 && expiretime < now;
+
+        if (pipeline && rdbIsParallelLoadType(type)) {
+            /* Just copy the value: it is decoded by the loading threads. */
+            sds raw = sdsempty();
+            if (rdbCopyObject(rdb,type,&raw) == -1) {
+                sdsfree(raw);
                 sdsfree(key);
                 goto eoferr;
             }
-        } else if (iAmMaster() &&
-            !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
-            expiretime != -1 && expiretime < now)
-        {
-            sdsfree(key);
-            decrRefCount(val);
-            expired_keys_skipped++;
+            if (expired) {
+                sdsfree(raw);
+                sdsfree(key);
+                state.expired_keys_skipped++;
+            } else {
+                rdbLoadJob job = {db, key, type, expiretime, lfu_freq,
+                                  lru_idle, raw, NULL, 0};
+                if (rdbLoadPipelineAdd(pipeline,&state,&job) == C_ERR)
+                    goto eoferr;
+            }
         } else {
-            robj keyobj;
-            initStaticStringObject(keyobj,key);
-
-            /* Add the new object in the hash table */
-            int added = dbAddRDBLoad(db,key,val);
-            keys_loaded++;
-            if (!added) {
-                if (rdbflags & RDBFLAGS_ALLOW_DUP) {
-                    /* This flag is useful for DEBUG RELOAD special modes.
-                     * When it's set we allow new keys to replace the current
-                     * keys with the same name. */
-                    dbSyncDelete(db,&keyobj);
-                    dbAddRDBLoad(db,key,val);
-                } else {
-                    serverLog(LL_WARNING,
-                        "RDB has duplicated key '%s' in DB %d",key,db->id);
-                    serverPanic("Duplicated key found in RDB file");
-                }
+            /* Keys are added in order, so add the pending ones first. */
+            if (pipeline && rdbLoadPipelineFlush(pipeline,&state) == C_ERR) {
+                sdsfree(key);
+                goto eoferr;
             }
 
-            /* Set the expire time if needed */
-            if (expiretime != -1) {
-                setExpire(NULL,db,&keyobj,expiretime);
+            /* Read value */
+            val = rdbLoadObject(type,rdb,key,&error);
+            if (val != NULL && expired) {
+                sdsfree(key);
+                decrRefCount(val);
+                state.expired_keys_skipped++;
+            } else if (rdbLoadAddKey(&state,db,key,val,error,expiretime,
+                                     lfu_freq,lru_idle) == C_ERR)
+            {
+                goto eoferr;
             }
-
-            /* Set usage information (for eviction). */
-            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
-
-            /* call key space notification on key loaded for modules only */
-            moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
         }
 
         /* Loading the database more slowly is useful in order to test
@@ -2721,14 +4245,15 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         }
     }
 
-    if (empty_keys_skipped) {
+    if (state.empty_keys_skipped) {
         serverLog(LL_WARNING,
             "Done loading RDB, keys loaded: %lld, keys expired: %lld, empty keys skipped: %lld.",
-                keys_loaded, expired_keys_skipped, empty_keys_skipped);
+                state.keys_loaded, state.expired_keys_skipped,
+                state.empty_keys_skipped);
     } else {
         serverLog(LL_WARNING,
             "Done loading RDB, keys loaded: %lld, keys expired: %lld.",
-                keys_loaded, expired_keys_skipped);
+                state.keys_loaded, state.expired_keys_skipped);
     }
     return C_OK;
 
@@ -2737,6 +4262,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
      * the RDB file from a socket during initial SYNC (diskless replica mode),
      * we'll report the error to the caller, so that we can retry. */
 eoferr:
+    if (pipeline) rdbLoadPipelineRelease(pipeline);
     serverLog(LL_WARNING,
         "Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbReportReadError("Unexpected EOF reading RDB file");
@@ -2792,6 +4318,8 @@ static void backgroundSaveDoneHandlerDisk(int exitcode, int bysignal) {
     }
 }
 
+static void rdbPipeStreamsRelease(void);
+
 /* A background saving child (BGSAVE) terminated its work. Handle this.
  * This function covers the case of RDB -> Slaves socket transfers for
  * diskless replication. */
@@ -2807,17 +4335,8 @@ static void backgroundSaveDoneHandlerSocket(int exitcode, int bysignal) {
     }
     if (server.rdb_child_exit_pipe!=-1)
         close(server.rdb_child_exit_pipe);
-    aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
-    close(server.rdb_pipe_read);
     server.rdb_child_exit_pipe = -1;
-    server.rdb_pipe_read = -1;
-    zfree(server.rdb_pipe_conns);
-    server.rdb_pipe_conns = NULL;
-    server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
-    zfree(server.rdb_pipe_buff);
-    server.rdb_pipe_buff = NULL;
-    server.rdb_pipe_bufflen = 0;
+    rdbPipeStreamsRelease();
 }
 
 /* When a background RDB saving/transfer terminates, call the right handler. */
@@ -2856,49 +4375,188 @@ void killRDBChild(void) {
      * - rdbRemoveTempFile */
 }
 
+/* Release the RDB pipes of the diskless transfer to the replicas. */
+static void rdbPipeStreamsRelease(void) {
+    for (int j = 0; j < server.rdb_pipe_numstreams; j++) {
+        rdbPipeStream *s = server.rdb_pipe_streams+j;
+        if (s->fd != -1) {
+            aeDeleteFileEvent(server.el, s->fd, AE_READABLE);
+            close(s->fd);
+        }
+        zfree(s->conns);
+        zfree(s->waiting);
+        zfree(s->buff);
+    }
+    zfree(server.rdb_pipe_streams);
+    server.rdb_pipe_streams = NULL;
+    server.rdb_pipe_numstreams = 0;
+    server.rdb_pipe_numconns = 0;
+}
+
+/* A stream of a diskless transfer, saved by a thread of the RDB child. */
+typedef struct rdbSaveStream {
+    pthread_t thread;
+    int fd;                 /* Write end of the pipe. */
+    int part, numparts;
+    rdbSaveInfo *rsi;
+    char eofmark[RDB_EOF_MARK_SIZE];
+    int retval;
+} rdbSaveStream;
+
+/* Write the part of the RDB of the stream 's' to its pipe, closing the
+ * pipe when done, so that the parent detects the end of the stream. */
+static int rdbSaveStreamToPipe(rdbSaveStream *s) {
+    int retval;
+    rio rdb;
+
+    rioInitWithFd(&rdb,s->fd);
+    retval = rdbSaveRioPartWithEOFMark(&rdb,NULL,s->rsi,s->part,s->numparts,
+                                       s->eofmark);
+    if (retval == C_OK && rioFlush(&rdb) == 0)
+        retval = C_ERR;
+    rioFreeFd(&rdb);
+    /* wake up the reader, tell it we're done. */
+    close(s->fd);
+    return retval;
+}
+
+static void *rdbSaveStreamThreadMain(void *arg) {
+    rdbSaveStream *s = arg;
+    char thdname[16];
+    sigset_t sigset;
+
+    snprintf(thdname,sizeof(thdname),"rdb_stream_%d",s->part);
+    redis_set_thread_title(thdname);
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    s->retval = rdbSaveStreamToPipe(s);
+    return NULL;
+}
+
+/* Called in the RDB child: save the streams of a diskless transfer to
+ * their pipes. The first stream is saved by the main thread, the other
+ * ones by one thread each. Returns C_ERR if any stream failed. */
+static int rdbSaveStreamsToPipes(int *fds, int numstreams, rdbSaveInfo *rsi) {
+    rdbSaveStream *streams = zcalloc(sizeof(rdbSaveStream)*numstreams);
+    int retval, j, started;
+
+    for (j = 0; j < numstreams; j++) {
+        streams[j].fd = fds[j];
+        streams[j].part = j;
+        streams[j].numparts = numstreams;
+        streams[j].rsi = rsi;
+        getRandomHexChars(streams[j].eofmark,RDB_EOF_MARK_SIZE);
+    }
+
+    startSaving(RDBFLAGS_REPLICATION);
+    retval = C_OK;
+    for (started = 1; started < numstreams; started++) {
+        if (pthread_create(&streams[started].thread,NULL,
+                           rdbSaveStreamThreadMain,streams+started) != 0)
+        {
+            serverLog(LL_WARNING,"Can't create the RDB stream threads.");
+            retval = C_ERR;
+            break;
+        }
+    }
+    /* The parent waits for every stream to end. */
+    for (j = started; j < numstreams; j++) close(fds[j]);
+
+    if (retval == C_OK) {
+        retval = rdbSaveStreamToPipe(streams);
+    } else {
+        close(fds[0]);
+    }
+    for (j = 1; j < started; j++) {
+        pthread_join(streams[j].thread,NULL);
+        if (streams[j].retval != C_OK) retval = C_ERR;
+    }
+    stopSaving(retval == C_OK);
+    zfree(streams);
+    return retval;
+}
+
 /* Spawn an RDB child that writes the RDB to the sockets of the slaves
- * that are currently in SLAVE_STATE_WAIT_BGSAVE_START state. */
+ * that are currently in SLAVE_STATE_WAIT_BGSAVE_START state.
+ *
+ * If repl-diskless-sync-streams is greater than one, and all the slaves
+ * support it, the RDB is split in multiple streams, each one sent over a
+ * different connection of the slaves. The child saves the streams with
+ * multiple threads, writing every stream to its own pipe, and the slaves
+ * attach the additional connections with REPLCONF rdb-stream-of. */
 int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     listNode *ln;
     listIter li;
     pid_t childpid;
-    int pipefds[2], rdb_pipe_write, safe_to_exit_pipe;
+    int pipefds[2], rdb_pipe_write[CONFIG_REPL_MAX_STREAMS], safe_to_exit_pipe;
+    int numstreams = server.repl_diskless_sync_streams, j;
 
     if (hasActiveChildProcess()) return C_ERR;
 
     /* Even if the previous fork child exited, don't start a new one until we
      * drained the pipe. */
-    if (server.rdb_pipe_conns) return C_ERR;
+    if (server.rdb_pipe_streams) return C_ERR;
+
+    /* Use a single stream unless every replica can load multiple ones. */
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START &&
+            (!(slave->slave_capa & SLAVE_CAPA_MULTISTREAM) ||
+             slave->flags & CLIENT_PRE_PSYNC))
+            numstreams = 1;
+    }
 
     /* Before to fork, create a pipe that is used to transfer the rdb bytes to
      * the parent, we can't let it write directly to the sockets, since in case
      * of TLS we must let the parent handle a continuous TLS state when the
-     * child terminates and parent takes over. */
-    if (pipe(pipefds) == -1) return C_ERR;
-    server.rdb_pipe_read = pipefds[0]; /* read end */
-    rdb_pipe_write = pipefds[1]; /* write end */
-    anetNonBlock(NULL, server.rdb_pipe_read);
+     * child terminates and parent takes over. One pipe per stream. */
+    server.rdb_pipe_streams = zcalloc(sizeof(rdbPipeStream)*numstreams);
+    server.rdb_pipe_numstreams = numstreams;
+    for (j = 0; j < numstreams; j++) server.rdb_pipe_streams[j].fd = -1;
+    for (j = 0; j < numstreams; j++) {
+        if (pipe(pipefds) == -1) {
+            while (j--) close(rdb_pipe_write[j]);
+            rdbPipeStreamsRelease();
+            return C_ERR;
+        }
+        server.rdb_pipe_streams[j].fd = pipefds[0]; /* read end */
+        rdb_pipe_write[j] = pipefds[1]; /* write end */
+        anetNonBlock(NULL, server.rdb_pipe_streams[j].fd);
+    }
 
     /* create another pipe that is used by the parent to signal to the child
      * that it can exit. */
     if (pipe(pipefds) == -1) {
-        close(rdb_pipe_write);
-        close(server.rdb_pipe_read);
+        for (j = 0; j < numstreams; j++) close(rdb_pipe_write[j]);
+        rdbPipeStreamsRelease();
         return C_ERR;
     }
     safe_to_exit_pipe = pipefds[0]; /* read end */
     server.rdb_child_exit_pipe = pipefds[1]; /* write end */
 
     /* Collect the connections of the replicas we want to transfer
-     * the RDB to, which are i WAIT_BGSAVE_START state. */
-    server.rdb_pipe_conns = zmalloc(sizeof(connection *)*listLength(server.slaves));
+     * the RDB to, which are i WAIT_BGSAVE_START state. The additional
+     * streams wait for the replicas to attach their connections. */
+    for (j = 0; j < numstreams; j++) {
+        rdbPipeStream *s = server.rdb_pipe_streams+j;
+        s->conns = zcalloc(sizeof(connection *)*listLength(server.slaves));
+        s->waiting = zcalloc(listLength(server.slaves));
+    }
     server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
     listRewind(server.slaves,&li);
     while((ln = listNext(&li))) {
         client *slave = ln->value;
         if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) {
-            server.rdb_pipe_conns[server.rdb_pipe_numconns++] = slave->conn;
+            for (j = 1; j < numstreams; j++) {
+                server.rdb_pipe_streams[j].waiting[server.rdb_pipe_numconns] = 1;
+                server.rdb_pipe_streams[j].numconns_waiting++;
+            }
+            server.rdb_pipe_streams[0].conns[server.rdb_pipe_numconns++] = slave->conn;
             replicationSetupSlaveForFullResync(slave,getPsyncInitialOffset());
         }
     }
@@ -2907,24 +4565,16 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     if ((childpid = redisFork(CHILD_TYPE_RDB)) == 0) {
         /* Child */
         int retval, dummy;
-        rio rdb;
-
-        rioInitWithFd(&rdb,rdb_pipe_write);
 
         redisSetProcTitle("redis-rdb-to-slaves");
         redisSetCpuAffinity(server.bgsave_cpulist);
 
-        retval = rdbSaveRioWithEOFMark(&rdb,NULL,rsi);
-        if (retval == C_OK && rioFlush(&rdb) == 0)
-            retval = C_ERR;
+        retval = rdbSaveStreamsToPipes(rdb_pipe_write,numstreams,rsi);
 
         if (retval == C_OK) {
             sendChildCowInfo(CHILD_INFO_TYPE_RDB_COW_SIZE, "RDB");
         }
 
-        rioFreeFd(&rdb);
-        /* wake up the reader, tell it we're done. */
-        close(rdb_pipe_write);
         close(server.rdb_child_exit_pipe); /* close write end so that we can detect the close on the parent. */
         /* hold exit until the parent tells us it's safe. we're not expecting
          * to read anything, just get the error when the pipe is closed. */
@@ -2948,20 +4598,27 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
                     slave->replstate = SLAVE_STATE_WAIT_BGSAVE_START;
                 }
             }
-            close(rdb_pipe_write);
-            close(server.rdb_pipe_read);
-            zfree(server.rdb_pipe_conns);
-            server.rdb_pipe_conns = NULL;
-            server.rdb_pipe_numconns = 0;
-            server.rdb_pipe_numconns_writing = 0;
+            for (j = 0; j < numstreams; j++) close(rdb_pipe_write[j]);
+            close(server.rdb_child_exit_pipe);
+            server.rdb_child_exit_pipe = -1;
+            rdbPipeStreamsRelease();
         } else {
-            serverLog(LL_NOTICE,"Background RDB transfer started by pid %ld",
-                (long) childpid);
+            if (numstreams > 1) {
+                serverLog(LL_NOTICE,"Background RDB transfer started by pid %ld with %d streams",
+                    (long) childpid, numstreams);
+            } else {
+                serverLog(LL_NOTICE,"Background RDB transfer started by pid %ld",
+                    (long) childpid);
+            }
             server.rdb_save_time_start = time(NULL);
             server.rdb_child_type = RDB_CHILD_TYPE_SOCKET;
-            close(rdb_pipe_write); /* close write in parent so that it can detect the close on the child. */
-            if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeReadHandler,NULL) == AE_ERR) {
-                serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
+            /* close write in parent so that it can detect the close on the child. */
+            for (j = 0; j < numstreams; j++) {
+                close(rdb_pipe_write[j]);
+                if (server.rdb_pipe_streams[j].numconns_waiting) continue;
+                if (aeCreateFileEvent(server.el, server.rdb_pipe_streams[j].fd, AE_READABLE, rdbPipeReadHandler,server.rdb_pipe_streams+j) == AE_ERR) {
+                    serverPanic("Unrecoverable error creating server.rdb_pipe_streams file event.");
+                }
             }
         }
         return (childpid == -1) ? C_ERR : C_OK;
@@ -2970,7 +4627,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 }
 
 void saveCommand(client *c) {
-    if (server.child_type == CHILD_TYPE_RDB) {
+    if (server.child_type == CHILD_TYPE_RDB || server.snapshot_in_progress) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -3001,7 +4658,7 @@ void bgsaveCommand(client *c) {
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
 
-    if (server.child_type == CHILD_TYPE_RDB) {
+    if (server.child_type == CHILD_TYPE_RDB || server.snapshot_in_progress) {
         addReplyError(c,"Background save already in progress");
     } else if (hasActiveChildProcess()) {
         if (schedule) {
@@ -3013,7 +4670,7 @@ void bgsaveCommand(client *c) {
             "Use BGSAVE SCHEDULE in order to schedule a BGSAVE whenever "
             "possible.");
         }
-    } else if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK) {
+    } else if (rdbSaveBackgroundSnapshot(server.rdb_filename,rsiptr) == C_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
         addReplyErrorObject(c,shared.err);
@@ -90,7 +90,12 @@ char *rdb_type_string[] = {
     "zset-ziplist",
     "hash-ziplist",
     "quicklist",
-    "stream"
+    "stream",
+    "hash-listpack",
+    "zset-listpack",
+    "quicklist-v2",
+    "",
+    "set-listpack"
 };
 
 /* Show a few stats collected into 'rdbstate' */
@@ -124,7 +129,9 @@ void rdbCheckError(const char *fmt, ...) {
             rdbstate.key_type,
             ((unsigned)rdbstate.key_type <
              sizeof(rdb_type_string)/sizeof(char*)) ?
-                rdb_type_string[rdbstate.key_type] : "unknown");
+                rdb_type_string[rdbstate.key_type] :
+            (rdbstate.key_type == RDB_TYPE_SET_ROARING) ?
+                "set-roaring" : "unknown");
     rdbShowGenericInfo();
 }
 
@@ -273,8 +280,14 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             if ((auxkey = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
             if ((auxval = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
 
-            rdbCheckInfo("AUX FIELD %s = '%s'",
-                (char*)auxkey->ptr, (char*)auxval->ptr);
+            if (!strcasecmp(auxkey->ptr,"repl-backlog")) {
+                /* Binary replication stream, just report its size. */
+                rdbCheckInfo("AUX FIELD %s = %zu bytes",
+                    (char*)auxkey->ptr, sdslen(auxval->ptr));
+            } else {
+                rdbCheckInfo("AUX FIELD %s = '%s'",
+                    (char*)auxkey->ptr, (char*)auxval->ptr);
+            }
             decrRefCount(auxkey);
             decrRefCount(auxval);
             continue; /* Read type again. */
@@ -44,6 +44,10 @@ void replicationResurrectCachedMaster(connection *conn);
 void replicationSendAck(void);
 void putSlaveOnline(client *slave);
 int cancelReplicationHandshake(int reconnect);
+static int rdbPipeAttachStream(client *c, uint64_t id, long stream);
+char *sendCommand(connection *conn, ...);
+char *sendCommandArgv(connection *conn, int argc, char **argv, size_t *argv_lens);
+char *receiveSynchronousResponse(connection *conn);
 
 /* We take a global flag to remember if this instance generated an RDB
  * because of replication, so that we can remove the RDB file in case
@@ -107,11 +111,21 @@ int bg_unlink(const char *filename) {
 
 /* ---------------------------------- MASTER -------------------------------- */
 
+int canFeedReplicaReplBuffer(client *replica) {
+    /* Don't feed replicas that only want the RDB. */
+    if (replica->flags & CLIENT_REPL_RDBONLY) return 0;
+
+    /* Don't feed replicas that are still waiting for BGSAVE to start. */
+    if (replica->replstate == SLAVE_STATE_WAIT_BGSAVE_START) return 0;
+
+    return 1;
+}
+
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
-    server.repl_backlog = zmalloc(server.repl_backlog_size);
+    server.repl_backlog = zmalloc(sizeof(replBacklog));
+    server.repl_backlog->ref_repl_buf_node = NULL;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
 
     /* We don't have any data inside our buffer, but virtually the first
      * byte we have is the next byte that will be generated for the
@@ -120,70 +134,175 @@ void createReplicationBacklog(void) {
 }
 
 /* This function is called when the user modifies the replication backlog
- * size at runtime. It is up to the function to both update the
- * server.repl_backlog_size and to resize the buffer and setup it so that
- * it contains the same data as the previous one (possibly less data, but
- * the most recent bytes, or the same data and more free space in case the
- * buffer is enlarged). */
+ * size at runtime. The backlog is made of blocks of the replication buffer
+ * and is not a preallocated buffer, so there is nothing to reallocate: it
+ * just grows up to the new size as new data is fed, or the blocks exceeding
+ * the new size are freed, incrementally, if it was shrunk. */
 void resizeReplicationBacklog(long long newsize) {
     if (newsize < CONFIG_REPL_BACKLOG_MIN_SIZE)
         newsize = CONFIG_REPL_BACKLOG_MIN_SIZE;
     if (server.repl_backlog_size == newsize) return;
 
     server.repl_backlog_size = newsize;
-    if (server.repl_backlog != NULL) {
-        /* What we actually do is to flush the old buffer and realloc a new
-         * empty one. It will refill with new data incrementally.
-         * The reason is that copying a few gigabytes adds latency and even
-         * worse often we need to alloc additional space before freeing the
-         * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = zmalloc(server.repl_backlog_size);
-        server.repl_backlog_histlen = 0;
-        server.repl_backlog_idx = 0;
-        /* Next byte we have is... the next since the buffer is empty. */
-        server.repl_backlog_off = server.master_repl_offset+1;
-    }
+    if (server.repl_backlog != NULL)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
 }
 
 void freeReplicationBacklog(void) {
     serverAssert(listLength(server.slaves) == 0);
+    if (server.repl_backlog == NULL) return;
+
+    /* Without replicas all the blocks belong to the backlog. */
+    listEmpty(server.repl_buffer_blocks);
+    server.repl_buffer_mem = 0;
     zfree(server.repl_backlog);
     server.repl_backlog = NULL;
 }
 
-/* Add data to the replication backlog.
+/* Recreate the replication backlog saved in the RDB file, when the server
+ * restarts with repl-backlog-persist enabled: 'buf' holds the last 'len'
+ * bytes of the replication stream, ending at the replication offset
+ * 'offset'. Replicas of the previous run can then PSYNC from any offset
+ * still in the backlog, instead of doing a full resynchronization. */
+void loadReplicationBacklog(char *buf, size_t len, long long offset) {
+    if (server.repl_backlog) freeReplicationBacklog();
+    server.master_repl_offset = offset - len;
+    createReplicationBacklog();
+    feedReplicationBuffer(buf,len);
+    serverAssert(server.master_repl_offset == offset);
+}
+
+/* Free the blocks at the head of the replication buffer that are only
+ * referenced by the backlog, as long as the backlog is still larger than
+ * repl-backlog-size without them. At most 'max_blocks' blocks are freed, so
+ * that shrinking a large backlog or releasing a slow replica doesn't block
+ * the server: what is left is freed by the next calls, that happen every
+ * time a new block is added. */
+void incrementalTrimReplicationBacklog(size_t max_blocks) {
+    serverAssert(server.repl_backlog != NULL);
+
+    size_t trimmed_blocks = 0;
+    while (server.repl_backlog_histlen > server.repl_backlog_size &&
+           trimmed_blocks < max_blocks)
+    {
+        /* The last block is never freed, it is still being filled. */
+        if (listLength(server.repl_buffer_blocks) <= 1) break;
+
+        /* The backlog always starts from the first block, replicas may
+         * only reference it or the following ones. */
+        listNode *first = listFirst(server.repl_buffer_blocks);
+        serverAssert(first == server.repl_backlog->ref_repl_buf_node);
+        replBufBlock *fo = listNodeValue(first);
+
+        /* Some replica still has to send this block. */
+        if (fo->refcount != 1) break;
+
+        /* Don't make the backlog smaller than its configured size. */
+        if (server.repl_backlog_histlen - (long long)fo->used <
+            server.repl_backlog_size) break;
+
+        listNode *next = listNextNode(first);
+        ((replBufBlock *)listNodeValue(next))->refcount++;
+        server.repl_backlog->ref_repl_buf_node = next;
+        server.repl_backlog_histlen -= fo->used;
+        server.repl_buffer_mem -= fo->size+sizeof(replBufBlock)+sizeof(listNode);
+        listDelNode(server.repl_buffer_blocks,first);
+        trimmed_blocks++;
+    }
+
+    /* Set the offset of the first byte we have in the backlog. */
+    server.repl_backlog_off = server.master_repl_offset -
+                              server.repl_backlog_histlen + 1;
+}
+
+/* Drop the reference of the replica 'c' to the replication buffer, when
+ * it is freed. */
+void releaseReplicaReplBuffer(client *c) {
+    if (c->ref_repl_buf_node == NULL) return;
+    ((replBufBlock *)listNodeValue(c->ref_repl_buf_node))->refcount--;
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
+    if (server.repl_backlog)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+}
+
+/* Add data to the replication buffer, that is to the replication backlog
+ * and to the output of all the replicas at once: the last block is filled
+ * and a new one is created for what doesn't fit. The backlog, and the
+ * replicas that don't reference any block yet since they just started to
+ * be fed, start referencing the first byte added.
+ *
  * This function also increments the global replication offset stored at
  * server.master_repl_offset, because there is no case where we want to feed
  * the backlog without incrementing the offset. */
-void feedReplicationBacklog(void *ptr, size_t len) {
-    unsigned char *p = ptr;
+void feedReplicationBuffer(char *s, size_t len) {
+    listNode *start_node = NULL, *ln;
+    size_t start_pos = 0;
+    int add_new_block = 0;
+    listIter li;
 
+    if (server.repl_backlog == NULL || len == 0) return;
     server.master_repl_offset += len;
+    server.repl_backlog_histlen += len;
+
+    ln = listLast(server.repl_buffer_blocks);
+    replBufBlock *tail = ln ? listNodeValue(ln) : NULL;
+    if (tail && tail->size > tail->used) {
+        size_t avail = tail->size - tail->used;
+        size_t copy = (avail >= len) ? len : avail;
+        memcpy(tail->buf+tail->used,s,copy);
+        start_node = ln;
+        start_pos = tail->used;
+        tail->used += copy;
+        s += copy;
+        len -= copy;
+    }
+    if (len) {
+        /* Create a new block for the rest, at least PROTO_REPLY_CHUNK_BYTES
+         * bytes: small writes keep filling it. */
+        size_t usable_size;
+        size_t size = (len < PROTO_REPLY_CHUNK_BYTES) ? PROTO_REPLY_CHUNK_BYTES : len;
+        replBufBlock *block = zmalloc_usable(size+sizeof(replBufBlock),&usable_size);
+        block->size = usable_size-sizeof(replBufBlock);
+        block->used = len;
+        block->refcount = 0;
+        block->id = tail ? tail->id+1 : 0;
+        block->repl_offset = server.master_repl_offset-len+1;
+        memcpy(block->buf,s,len);
+        listAddNodeTail(server.repl_buffer_blocks,block);
+        server.repl_buffer_mem += usable_size+sizeof(listNode);
+        if (start_node == NULL) start_node = listLast(server.repl_buffer_blocks);
+        add_new_block = 1;
+    }
+
+    /* A new backlog starts with an empty replication buffer. */
+    if (server.repl_backlog->ref_repl_buf_node == NULL) {
+        serverAssert(add_new_block && start_pos == 0);
+        server.repl_backlog->ref_repl_buf_node = start_node;
+        ((replBufBlock *)listNodeValue(start_node))->refcount++;
+    }
 
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
-    while(len) {
-        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
-        if (thislen > len) thislen = len;
-        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
-        server.repl_backlog_idx += thislen;
-        if (server.repl_backlog_idx == server.repl_backlog_size)
-            server.repl_backlog_idx = 0;
-        len -= thislen;
-        p += thislen;
-        server.repl_backlog_histlen += thislen;
-    }
-    if (server.repl_backlog_histlen > server.repl_backlog_size)
-        server.repl_backlog_histlen = server.repl_backlog_size;
-    /* Set the offset of the first byte we have in the backlog. */
-    server.repl_backlog_off = server.master_repl_offset -
-                              server.repl_backlog_histlen + 1;
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+        if (slave->ref_repl_buf_node == NULL) {
+            slave->ref_repl_buf_node = start_node;
+            slave->ref_block_pos = start_pos;
+            ((replBufBlock *)listNodeValue(start_node))->refcount++;
+        }
+        /* The memory used by the replicas changes only when a block is
+         * added, so that is the only time we check the limits. */
+        if (add_new_block) closeClientOnOutputBufferLimitReached(slave,1);
+    }
+    if (add_new_block)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Wrapper for feedReplicationBuffer() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+void feedReplicationBufferWithObject(robj *o) {
     char llstr[LONG_STR_SIZE];
     void *p;
     size_t len;
@@ -195,17 +314,26 @@ void feedReplicationBacklogWithObject(robj *o) {
         len = sdslen(o->ptr);
         p = o->ptr;
     }
-    feedReplicationBacklog(p,len);
+    feedReplicationBuffer(p,len);
 }
 
-int canFeedReplicaReplBuffer(client *replica) {
-    /* Don't feed replicas that only want the RDB. */
-    if (replica->flags & CLIENT_REPL_RDBONLY) return 0;
-
-    /* Don't feed replicas that are still waiting for BGSAVE to start. */
-    if (replica->replstate == SLAVE_STATE_WAIT_BGSAVE_START) return 0;
+/* Install the write handler of the replicas that are going to be fed, that
+ * must be done before the replication buffer is fed: prepareClientToWrite()
+ * only does it for clients without pending replies. Returns the number of
+ * such replicas. */
+int prepareReplicasToWrite(void) {
+    listIter li;
+    listNode *ln;
+    int prepared = 0;
 
-    return 1;
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+        if (prepareClientToWrite(slave) == C_ERR) continue;
+        prepared++;
+    }
+    return prepared;
 }
 
 /* Propagate write commands to slaves, and populate the replication backlog
@@ -214,8 +342,6 @@ int canFeedReplicaReplBuffer(client *replica) {
  * stream. Instead if the instance is a slave and has sub-slaves attached,
  * we use replicationFeedSlavesFromMasterStream() */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    listIter li;
     int j, len;
     char llstr[LONG_STR_SIZE];
 
@@ -233,6 +359,10 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     /* We can't have slaves attached and no backlog. */
     serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
+    /* The slaves are fed by the replication buffer, together with the
+     * backlog, but their write handler must be installed first. */
+    prepareReplicasToWrite();
+
     /* Send SELECT command to every slave if needed. */
     if (server.slaveseldb != dictid) {
         robj *selectcmd;
@@ -250,68 +380,37 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
                 dictid_len, llstr));
         }
 
-        /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listRewind(slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = ln->value;
-
-            if (!canFeedReplicaReplBuffer(slave)) continue;
-            addReply(slave,selectcmd);
-        }
+        /* Add the SELECT command into the replication buffer. */
+        feedReplicationBufferWithObject(selectcmd);
 
         if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
             decrRefCount(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
-    if (server.repl_backlog) {
-        char aux[LONG_STR_SIZE+3];
-
-        /* Add the multi bulk reply length. */
-        aux[0] = '*';
-        len = ll2string(aux+1,sizeof(aux)-1,argc);
-        aux[len+1] = '\r';
-        aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
-
-        for (j = 0; j < argc; j++) {
-            long objlen = stringObjectLen(argv[j]);
-
-            /* We need to feed the buffer with the object as a bulk reply
-             * not just as a plain string, so create the $..CRLF payload len
-             * and add the final CRLF */
-            aux[0] = '$';
-            len = ll2string(aux+1,sizeof(aux)-1,objlen);
-            aux[len+1] = '\r';
-            aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
-        }
-    }
-
-    /* Write the command to every slave. */
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        if (!canFeedReplicaReplBuffer(slave)) continue;
+    /* Write the command to the replication buffer. */
+    char aux[LONG_STR_SIZE+3];
 
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
+    /* Add the multi bulk reply length. */
+    aux[0] = '*';
+    len = ll2string(aux+1,sizeof(aux)-1,argc);
+    aux[len+1] = '\r';
+    aux[len+2] = '\n';
+    feedReplicationBuffer(aux,len+3);
 
-        /* Add the multi bulk length. */
-        addReplyArrayLen(slave,argc);
+    for (j = 0; j < argc; j++) {
+        long objlen = stringObjectLen(argv[j]);
 
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulk(slave,argv[j]);
+        /* We need to feed the buffer with the object as a bulk reply
+         * not just as a plain string, so create the $..CRLF payload len
+         * and add the final CRLF */
+        aux[0] = '$';
+        len = ll2string(aux+1,sizeof(aux)-1,objlen);
+        aux[len+1] = '\r';
+        aux[len+2] = '\n';
+        feedReplicationBuffer(aux,len+3);
+        feedReplicationBufferWithObject(argv[j]);
+        feedReplicationBuffer(aux+len+1,2);
     }
 }
 
@@ -321,26 +420,30 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
  * guess what kind of bug it could be. */
 void showLatestBacklog(void) {
     if (server.repl_backlog == NULL) return;
+    if (listLength(server.repl_buffer_blocks) == 0) return;
 
-    long long dumplen = 256;
-    if (server.repl_backlog_histlen < dumplen)
+    size_t dumplen = 256;
+    if (server.repl_backlog_histlen < (long long)dumplen)
         dumplen = server.repl_backlog_histlen;
 
-    /* Identify the first byte to dump. */
-    long long idx =
-      (server.repl_backlog_idx + (server.repl_backlog_size - dumplen)) %
-       server.repl_backlog_size;
+    /* Identify the block of the first byte to dump. */
+    listNode *ln = listLast(server.repl_buffer_blocks);
+    replBufBlock *o = listNodeValue(ln);
+    size_t len = o->used;
+    while (len < dumplen && listPrevNode(ln)) {
+        ln = listPrevNode(ln);
+        o = listNodeValue(ln);
+        len += o->used;
+    }
 
-    /* Scan the circular buffer to collect 'dumplen' bytes. */
+    /* Collect 'dumplen' bytes from there. */
+    size_t skip = (len > dumplen) ? len - dumplen : 0;
     sds dump = sdsempty();
-    while(dumplen) {
-        long long thislen =
-            ((server.repl_backlog_size - idx) < dumplen) ?
-            (server.repl_backlog_size - idx) : dumplen;
-
-        dump = sdscatrepr(dump,server.repl_backlog+idx,thislen);
-        dumplen -= thislen;
-        idx = 0;
+    while(ln) {
+        o = listNodeValue(ln);
+        dump = sdscatrepr(dump,o->buf+skip,o->used-skip);
+        skip = 0;
+        ln = listNextNode(ln);
     }
 
     /* Finally log such bytes: this is vital debugging info to
@@ -353,9 +456,6 @@ void showLatestBacklog(void) {
  * to our sub-slaves. */
 #include <ctype.h>
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen) {
-    listNode *ln;
-    listIter li;
-
     /* Debugging: this is handy to see the stream sent from master
      * to slaves. Disabled with if(0). */
     if (0) {
@@ -366,13 +466,12 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
         printf("\n");
     }
 
-    if (server.repl_backlog) feedReplicationBacklog(buf,buflen);
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
+    /* We can't have slaves attached and no backlog. */
+    serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
-        if (!canFeedReplicaReplBuffer(slave)) continue;
-        addReplyProto(slave,buf,buflen);
+    if (server.repl_backlog) {
+        prepareReplicasToWrite();
+        feedReplicationBuffer(buf,buflen);
     }
 }
 
@@ -417,9 +516,11 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
 }
 
 /* Feed the slave 'c' with the replication backlog starting from the
- * specified 'offset' up to the end of the backlog. */
+ * specified 'offset' up to the end of the backlog. Nothing is copied: the
+ * slave just starts referencing the block of the replication buffer
+ * where 'offset' is. */
 long long addReplyReplicationBacklog(client *c, long long offset) {
-    long long j, skip, len;
+    long long skip;
 
     serverLog(LL_DEBUG, "[PSYNC] Replica request offset: %lld", offset);
 
@@ -434,37 +535,29 @@ long long addReplyReplicationBacklog(client *c, long long offset) {
              server.repl_backlog_off);
     serverLog(LL_DEBUG, "[PSYNC] History len: %lld",
              server.repl_backlog_histlen);
-    serverLog(LL_DEBUG, "[PSYNC] Current index: %lld",
-             server.repl_backlog_idx);
 
     /* Compute the amount of bytes we need to discard. */
     skip = offset - server.repl_backlog_off;
     serverLog(LL_DEBUG, "[PSYNC] Skipping: %lld", skip);
 
-    /* Point j to the oldest byte, that is actually our
-     * server.repl_backlog_off byte. */
-    j = (server.repl_backlog_idx +
-        (server.repl_backlog_size-server.repl_backlog_histlen)) %
-        server.repl_backlog_size;
-    serverLog(LL_DEBUG, "[PSYNC] Index of first byte: %lld", j);
-
-    /* Discard the amount of data to seek to the specified 'offset'. */
-    j = (j + skip) % server.repl_backlog_size;
-
-    /* Feed slave with data. Since it is a circular buffer we have to
-     * split the reply in two parts if we are cross-boundary. */
-    len = server.repl_backlog_histlen - skip;
-    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld", len);
-    while(len) {
-        long long thislen =
-            ((server.repl_backlog_size - j) < len) ?
-            (server.repl_backlog_size - j) : len;
-
-        serverLog(LL_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        addReplySds(c,sdsnewlen(server.repl_backlog + j, thislen));
-        len -= thislen;
-        j = 0;
+    /* Find the block where 'offset' is, or the last one if the slave
+     * already has all the data. */
+    listNode *ln = server.repl_backlog->ref_repl_buf_node;
+    replBufBlock *o = listNodeValue(ln);
+    while (offset >= o->repl_offset+(long long)o->used && listNextNode(ln)) {
+        ln = listNextNode(ln);
+        o = listNodeValue(ln);
     }
+    serverLog(LL_DEBUG, "[PSYNC] Starting from block: %lld", o->id);
+
+    /* Install the write handler while the slave has nothing to send. */
+    prepareClientToWrite(c);
+    c->ref_repl_buf_node = ln;
+    c->ref_block_pos = offset - o->repl_offset;
+    o->refcount++;
+
+    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld",
+             server.repl_backlog_histlen - skip);
     return server.repl_backlog_histlen - skip;
 }
 
@@ -504,10 +597,21 @@ int replicationSetupSlaveForFullResync(client *slave, long long offset) {
     server.slaveseldb = -1;
 
     /* Don't send this reply to slaves that approached us with
-     * the old SYNC command. */
+     * the old SYNC command. When the RDB is transferred over multiple
+     * streams the reply also includes the number of streams and the
+     * client ID the replica attaches the additional streams to. */
     if (!(slave->flags & CLIENT_PRE_PSYNC)) {
-        buflen = snprintf(buf,sizeof(buf),"+FULLRESYNC %s %lld\r\n",
-                          server.replid,offset);
+        if (server.rdb_pipe_numstreams > 1 &&
+            slave->slave_capa & SLAVE_CAPA_MULTISTREAM)
+        {
+            buflen = snprintf(buf,sizeof(buf),
+                              "+FULLRESYNC %s %lld %d %llu\r\n",
+                              server.replid,offset,server.rdb_pipe_numstreams,
+                              (unsigned long long)slave->id);
+        } else {
+            buflen = snprintf(buf,sizeof(buf),"+FULLRESYNC %s %lld\r\n",
+                              server.replid,offset);
+        }
         if (connWrite(slave->conn,buf,buflen) != buflen) {
             freeClientAsync(slave);
             return C_ERR;
@@ -720,6 +824,13 @@ void syncCommand(client *c) {
     /* ignore SYNC if already slave or in monitor mode */
     if (c->flags & CLIENT_SLAVE) return;
 
+    /* The replica would only get the keys of the shard serving the
+     * connection. */
+    if (server.shards > 1) {
+        addReplyError(c,"Replication is not supported when sharding is enabled.");
+        return;
+    }
+
     /* Check if this is a failover request to a replica with the same replid and
      * become a master if so. */
     if (c->argc > 3 && !strcasecmp(c->argv[0]->ptr,"psync") && 
@@ -906,10 +1017,11 @@ void syncCommand(client *c) {
  * the master can accurately lists replicas and their listening ports in the
  * INFO output.
  *
- * - capa <eof|psync2>
+ * - capa <eof|psync2|multistream>
  * What is the capabilities of this instance.
  * eof: supports EOF-style RDB transfer for diskless replication.
  * psync2: supports PSYNC v2, so understands +CONTINUE <new repl ID>.
+ * multistream: can load an RDB transferred over multiple connections.
  *
  * - ack <offset>
  * Replica informs the master the amount of replication stream that it
@@ -920,9 +1032,16 @@ void syncCommand(client *c) {
  * offset from a replica.
  *
  * - rdb-only
- * Only wants RDB snapshot without replication buffer. */
+ * Only wants RDB snapshot without replication buffer.
+ *
+ * - rdb-stream-of <client-id> rdb-stream <index>
+ * Used by a replica to attach this connection as an additional stream of
+ * its multi-stream full sync. Nothing is replied on success: the connection
+ * then only receives its part of the RDB. */
 void replconfCommand(client *c) {
     int j;
+    long long stream_of = -1;
+    long stream = 0;
 
     if ((c->argc % 2) == 0) {
         /* Number of arguments must be odd to make sure that every
@@ -956,6 +1075,8 @@ void replconfCommand(client *c) {
                 c->slave_capa |= SLAVE_CAPA_EOF;
             else if (!strcasecmp(c->argv[j+1]->ptr,"psync2"))
                 c->slave_capa |= SLAVE_CAPA_PSYNC2;
+            else if (!strcasecmp(c->argv[j+1]->ptr,"multistream"))
+                c->slave_capa |= SLAVE_CAPA_MULTISTREAM;
         } else if (!strcasecmp(c->argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -996,12 +1117,27 @@ void replconfCommand(client *c) {
                 return;
             if (rdb_only == 1) c->flags |= CLIENT_REPL_RDBONLY;
             else c->flags &= ~CLIENT_REPL_RDBONLY;
+        } else if (!strcasecmp(c->argv[j]->ptr,"rdb-stream-of")) {
+            if (getLongLongFromObjectOrReply(c,c->argv[j+1],
+                    &stream_of,NULL) != C_OK)
+                return;
+        } else if (!strcasecmp(c->argv[j]->ptr,"rdb-stream")) {
+            if (getRangeLongFromObjectOrReply(c,c->argv[j+1],
+                    1,CONFIG_REPL_MAX_STREAMS-1,&stream,NULL) != C_OK)
+                return;
         } else {
             addReplyErrorFormat(c,"Unrecognized REPLCONF option: %s",
                 (char*)c->argv[j]->ptr);
             return;
         }
     }
+    if (stream_of != -1) {
+        if (rdbPipeAttachStream(c,stream_of,stream) == C_ERR) {
+            addReplyError(c,"No diskless transfer waiting for this stream");
+            c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+        }
+        return;
+    }
     addReply(c,shared.ok);
 }
 
@@ -1148,6 +1284,22 @@ void sendBulkToSlave(connection *conn) {
     }
 }
 
+/* Return the RDB pipe stream the connection of the client 'c' is a target
+ * of: the replicas receive the first stream over their own connection. */
+static rdbPipeStream *rdbPipeStreamOfClient(client *c) {
+    int stream = (c->flags & CLIENT_REPL_STREAM) ? c->repl_stream : 0;
+    return server.rdb_pipe_streams+stream;
+}
+
+/* Install the read handler of an RDB pipe stream, unless it reached EOF,
+ * or some of its connections are not attached yet or have pending writes. */
+static void rdbPipeStreamInstallReadHandler(rdbPipeStream *s) {
+    if (s->fd == -1 || s->numconns_waiting || s->numconns_writing) return;
+    if (aeCreateFileEvent(server.el, s->fd, AE_READABLE, rdbPipeReadHandler, s) == AE_ERR) {
+        serverPanic("Unrecoverable error creating server.rdb_pipe_streams file event.");
+    }
+}
+
 /* Remove one write handler from the list of connections waiting to be writable
  * during rdb pipe transfer. */
 void rdbPipeWriteHandlerConnRemoved(struct connection *conn) {
@@ -1155,24 +1307,22 @@ void rdbPipeWriteHandlerConnRemoved(struct connection *conn) {
         return;
     connSetWriteHandler(conn, NULL);
     client *slave = connGetPrivateData(conn);
+    rdbPipeStream *s = rdbPipeStreamOfClient(slave);
     slave->repl_last_partial_write = 0;
-    server.rdb_pipe_numconns_writing--;
+    s->numconns_writing--;
     /* if there are no more writes for now for this conn, or write error: */
-    if (server.rdb_pipe_numconns_writing == 0) {
-        if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeReadHandler,NULL) == AE_ERR) {
-            serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
-        }
-    }
+    rdbPipeStreamInstallReadHandler(s);
 }
 
 /* Called in diskless master during transfer of data from the rdb pipe, when
  * the replica becomes writable again. */
 void rdbPipeWriteHandler(struct connection *conn) {
-    serverAssert(server.rdb_pipe_bufflen>0);
     client *slave = connGetPrivateData(conn);
+    rdbPipeStream *s = rdbPipeStreamOfClient(slave);
+    serverAssert(s->bufflen>0);
     int nwritten;
-    if ((nwritten = connWrite(conn, server.rdb_pipe_buff + slave->repldboff,
-                              server.rdb_pipe_bufflen - slave->repldboff)) == -1)
+    if ((nwritten = connWrite(conn, s->buff + slave->repldboff,
+                              s->bufflen - slave->repldboff)) == -1)
     {
         if (connGetState(conn) == CONN_STATE_CONNECTED)
             return; /* equivalent to EAGAIN */
@@ -1183,7 +1333,7 @@ void rdbPipeWriteHandler(struct connection *conn) {
     } else {
         slave->repldboff += nwritten;
         atomicIncr(server.stat_net_output_bytes, nwritten);
-        if (slave->repldboff < server.rdb_pipe_bufflen) {
+        if (slave->repldboff < s->bufflen) {
             slave->repl_last_partial_write = server.unixtime;
             return; /* more data to write.. */
         }
@@ -1191,41 +1341,59 @@ void rdbPipeWriteHandler(struct connection *conn) {
     rdbPipeWriteHandlerConnRemoved(conn);
 }
 
-/* Called in diskless master, when there's data to read from the child's rdb pipe */
+/* Called in diskless master, when there's data to read from one of the
+ * child's rdb pipes. 'clientData' is the rdbPipeStream. */
 void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask) {
     UNUSED(mask);
-    UNUSED(clientData);
     UNUSED(eventLoop);
+    rdbPipeStream *s = clientData;
     int i;
-    if (!server.rdb_pipe_buff)
-        server.rdb_pipe_buff = zmalloc(PROTO_IOBUF_LEN);
-    serverAssert(server.rdb_pipe_numconns_writing==0);
+    if (!s->buff)
+        s->buff = zmalloc(PROTO_IOBUF_LEN);
+    serverAssert(s->numconns_writing==0 && s->numconns_waiting==0);
 
     while (1) {
-        server.rdb_pipe_bufflen = read(fd, server.rdb_pipe_buff, PROTO_IOBUF_LEN);
-        if (server.rdb_pipe_bufflen < 0) {
+        s->bufflen = read(fd, s->buff, PROTO_IOBUF_LEN);
+        if (s->bufflen < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
                 return;
             serverLog(LL_WARNING,"Diskless rdb transfer, read error sending DB to replicas: %s", strerror(errno));
+            /* Freeing the replicas also frees their other streams. */
             for (i=0; i < server.rdb_pipe_numconns; i++) {
-                connection *conn = server.rdb_pipe_conns[i];
+                connection *conn = server.rdb_pipe_streams[0].conns[i];
                 if (!conn)
                     continue;
                 client *slave = connGetPrivateData(conn);
                 freeClient(slave);
-                server.rdb_pipe_conns[i] = NULL;
+                server.rdb_pipe_streams[0].conns[i] = NULL;
             }
             killRDBChild();
             return;
         }
 
-        if (server.rdb_pipe_bufflen == 0) {
+        if (s->bufflen == 0) {
             /* EOF - write end was closed. */
             int stillUp = 0;
-            aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
+            aeDeleteFileEvent(server.el, s->fd, AE_READABLE);
+            close(s->fd);
+            s->fd = -1;
+            /* The additional connections carried just this part of the RDB,
+             * and everything read so far was already written to them. */
+            if (s != server.rdb_pipe_streams) {
+                for (i=0; i < server.rdb_pipe_numconns; i++) {
+                    connection *conn = s->conns[i];
+                    if (!conn)
+                        continue;
+                    s->conns[i] = NULL;
+                    freeClientAsync(connGetPrivateData(conn));
+                }
+            }
+            for (i=0; i < server.rdb_pipe_numstreams; i++) {
+                if (server.rdb_pipe_streams[i].fd != -1) return;
+            }
             for (i=0; i < server.rdb_pipe_numconns; i++)
             {
-                connection *conn = server.rdb_pipe_conns[i];
+                connection *conn = server.rdb_pipe_streams[0].conns[i];
                 if (!conn)
                     continue;
                 stillUp++;
@@ -1243,32 +1411,32 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
         for (i=0; i < server.rdb_pipe_numconns; i++)
         {
             int nwritten;
-            connection *conn = server.rdb_pipe_conns[i];
+            connection *conn = s->conns[i];
             if (!conn)
                 continue;
 
             client *slave = connGetPrivateData(conn);
-            if ((nwritten = connWrite(conn, server.rdb_pipe_buff, server.rdb_pipe_bufflen)) == -1) {
+            if ((nwritten = connWrite(conn, s->buff, s->bufflen)) == -1) {
                 if (connGetState(conn) != CONN_STATE_CONNECTED) {
                     serverLog(LL_WARNING,"Diskless rdb transfer, write error sending DB to replica: %s",
                         connGetLastError(conn));
                     freeClient(slave);
-                    server.rdb_pipe_conns[i] = NULL;
+                    s->conns[i] = NULL;
                     continue;
                 }
                 /* An error and still in connected state, is equivalent to EAGAIN */
                 slave->repldboff = 0;
             } else {
                 /* Note: when use diskless replication, 'repldboff' is the offset
-                 * of 'rdb_pipe_buff' sent rather than the offset of entire RDB. */
+                 * of 'buff' sent rather than the offset of entire RDB. */
                 slave->repldboff = nwritten;
                 atomicIncr(server.stat_net_output_bytes, nwritten);
             }
             /* If we were unable to write all the data to one of the replicas,
              * setup write handler (and disable pipe read handler, below) */
-            if (nwritten != server.rdb_pipe_bufflen) {
+            if (nwritten != s->bufflen) {
                 slave->repl_last_partial_write = server.unixtime;
-                server.rdb_pipe_numconns_writing++;
+                s->numconns_writing++;
                 connSetWriteHandler(conn, rdbPipeWriteHandler);
             }
             stillAlive++;
@@ -1279,13 +1447,109 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
             killRDBChild();
         }
         /*  Remove the pipe read handler if at least one write handler was set. */
-        if (server.rdb_pipe_numconns_writing || stillAlive == 0) {
-            aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
+        if (s->numconns_writing || stillAlive == 0) {
+            aeDeleteFileEvent(server.el, s->fd, AE_READABLE);
+            break;
+        }
+    }
+}
+
+/* Attach the client 'c' as the stream 'stream' of the diskless transfer to
+ * the replica with the client ID 'id', see REPLCONF rdb-stream-of. */
+static int rdbPipeAttachStream(client *c, uint64_t id, long stream) {
+    client *slave = lookupClientByID(id);
+    rdbPipeStream *s;
+    int i;
+
+    if (!server.rdb_pipe_streams || stream < 1 ||
+        stream >= server.rdb_pipe_numstreams ||
+        !slave || !(slave->flags & CLIENT_SLAVE) ||
+        c->flags & (CLIENT_SLAVE|CLIENT_MASTER|CLIENT_REPL_STREAM))
+        return C_ERR;
+
+    s = server.rdb_pipe_streams+stream;
+    for (i=0; i < server.rdb_pipe_numconns; i++) {
+        if (server.rdb_pipe_streams[0].conns[i] == slave->conn) break;
+    }
+    if (i == server.rdb_pipe_numconns || !s->waiting[i]) return C_ERR;
+
+    s->waiting[i] = 0;
+    s->numconns_waiting--;
+    s->conns[i] = c->conn;
+    c->flags |= CLIENT_REPL_STREAM;
+    c->repl_stream = stream;
+    rdbPipeStreamInstallReadHandler(s);
+    return C_OK;
+}
+
+/* Called when freeing a client, to remove its connection from the targets
+ * of the diskless transfer in progress. A replica can't load just a part of
+ * the RDB, so the additional streams of a replica are freed together with
+ * the replica, and the other way around. */
+void rdbPipeClientRemoved(client *c) {
+    int i, j;
+
+    if (!server.rdb_pipe_streams) return;
+
+    if (c->flags & CLIENT_REPL_STREAM) {
+        rdbPipeStream *s = rdbPipeStreamOfClient(c);
+        for (i=0; i < server.rdb_pipe_numconns; i++) {
+            if (s->conns[i] != c->conn) continue;
+            rdbPipeWriteHandlerConnRemoved(c->conn);
+            s->conns[i] = NULL;
+            connection *conn = server.rdb_pipe_streams[0].conns[i];
+            if (conn) freeClientAsync(connGetPrivateData(conn));
+            break;
+        }
+    } else if (c->flags & CLIENT_SLAVE &&
+               c->replstate == SLAVE_STATE_WAIT_BGSAVE_END)
+    {
+        for (i=0; i < server.rdb_pipe_numconns; i++) {
+            if (server.rdb_pipe_streams[0].conns[i] != c->conn) continue;
+            for (j=0; j < server.rdb_pipe_numstreams; j++) {
+                rdbPipeStream *s = server.rdb_pipe_streams+j;
+                connection *conn = s->conns[i];
+                if (s->waiting && s->waiting[i]) {
+                    s->waiting[i] = 0;
+                    s->numconns_waiting--;
+                    rdbPipeStreamInstallReadHandler(s);
+                }
+                if (!conn) continue;
+                rdbPipeWriteHandlerConnRemoved(conn);
+                s->conns[i] = NULL;
+                if (j) freeClientAsync(connGetPrivateData(conn));
+            }
             break;
         }
     }
 }
 
+/* Disconnect the replicas that didn't attach their additional streams in
+ * time, or whose additional streams are not writable since too long. */
+static void rdbPipeStreamsCron(void) {
+    int i, j;
+
+    for (i=0; i < server.rdb_pipe_numconns; i++) {
+        connection *owner = server.rdb_pipe_streams[0].conns[i];
+        if (!owner) continue;
+        for (j=1; j < server.rdb_pipe_numstreams; j++) {
+            rdbPipeStream *s = server.rdb_pipe_streams+j;
+            client *c = s->conns[i] ? connGetPrivateData(s->conns[i]) : NULL;
+            if ((s->waiting[i] &&
+                 server.unixtime - server.rdb_save_time_start > server.repl_timeout) ||
+                (c && c->repl_last_partial_write != 0 &&
+                 server.unixtime - c->repl_last_partial_write > server.repl_timeout))
+            {
+                client *slave = connGetPrivateData(owner);
+                serverLog(LL_WARNING, "Disconnecting timedout replica (full sync stream %d): %s",
+                          j, replicationGetSlaveName(slave));
+                freeClient(slave);
+                break;
+            }
+        }
+    }
+}
+
 /* This function is called at the end of every background saving,
  * or when the replication RDB transfer strategy is modified from
  * disk to socket or the other way around.
@@ -1516,6 +1780,97 @@ static int useDisklessLoad() {
     return enabled;
 }
 
+/* Return true if we can load the RDB transferred over multiple streams, so
+ * that we can announce the multistream capability to the master. The
+ * additional streams are read by threads, that are not used with TLS. */
+static int replicationCanLoadStreams(void) {
+    return !server.tls_replication && useDisklessLoad();
+}
+
+/* Helper function for readSyncBulkPayload(): open the additional connections
+ * of a multi-stream transfer, attaching every one of them to our replication
+ * link as one of the streams of the RDB. Returns the array of the
+ * server.repl_transfer_streams-1 connections, or NULL on error. */
+static connection **replicationConnectRdbStreams(void) {
+    int numconns = server.repl_transfer_streams-1;
+    connection **conns = zcalloc(sizeof(connection*)*numconns);
+    char id[LONG_STR_SIZE], stream[LONG_STR_SIZE];
+    char *err;
+    int j;
+
+    serverLog(LL_NOTICE,
+        "MASTER <-> REPLICA sync: receiving the RDB over %d streams",
+        server.repl_transfer_streams);
+    snprintf(id,sizeof(id),"%llu",
+        (unsigned long long)server.repl_transfer_client_id);
+    for (j = 0; j < numconns; j++) {
+        connection *conn = server.tls_replication ? connCreateTLS() : connCreateSocket();
+        conns[j] = conn;
+        if (connBlockingConnect(conn,server.masterhost,server.masterport,
+                                server.repl_syncio_timeout*1000) == C_ERR)
+        {
+            serverLog(LL_WARNING,"Unable to connect to MASTER for RDB stream %d: %s",
+                j+1, connGetLastError(conn));
+            goto error;
+        }
+        connBlock(conn);
+        connRecvTimeout(conn,server.repl_timeout*1000);
+
+        /* AUTH with the master if required. */
+        if (server.masterauth) {
+            char *args[3] = {"AUTH",NULL,NULL};
+            size_t lens[3] = {4,0,0};
+            int argc = 1;
+            if (server.masteruser) {
+                args[argc] = server.masteruser;
+                lens[argc] = strlen(server.masteruser);
+                argc++;
+            }
+            args[argc] = server.masterauth;
+            lens[argc] = sdslen(server.masterauth);
+            argc++;
+            err = sendCommandArgv(conn, argc, args, lens);
+            if (!err) err = receiveSynchronousResponse(conn);
+            if (err[0] == '-') {
+                serverLog(LL_WARNING,"Unable to AUTH to MASTER for RDB stream %d: %s",
+                    j+1, err);
+                sdsfree(err);
+                goto error;
+            }
+            sdsfree(err);
+        }
+
+        /* Nothing is replied on success: the stream starts right away, so
+         * errors are detected by the thread reading it. */
+        ll2string(stream,sizeof(stream),j+1);
+        err = sendCommand(conn,"REPLCONF","rdb-stream-of",id,
+                          "rdb-stream",stream,NULL);
+        if (err) {
+            serverLog(LL_WARNING,"Unable to attach RDB stream %d: %s",
+                j+1, err);
+            sdsfree(err);
+            goto error;
+        }
+    }
+    return conns;
+
+error:
+    for (j = 0; j < numconns; j++)
+        if (conns[j]) connClose(conns[j]);
+    zfree(conns);
+    return NULL;
+}
+
+/* Helper function for readSyncBulkPayload(): stop reading the additional
+ * streams of the transfer and close their connections. */
+static void replicationReleaseRdbStreams(connection **conns) {
+    if (!conns) return;
+    rdbLoadStreamsStop();
+    for (int j = 0; j < server.repl_transfer_streams-1; j++)
+        connClose(conns[j]);
+    zfree(conns);
+}
+
 /* Helper function for readSyncBulkPayload() to make backups of the current
  * databases before socket-loading the new ones. The backups may be restored
  * by disklessLoadRestoreBackup or freed by disklessLoadDiscardBackup later. */
@@ -1544,8 +1899,11 @@ void disklessLoadDiscardBackup(dbBackup *buckup, int flag) {
 void readSyncBulkPayload(connection *conn) {
     char buf[PROTO_IOBUF_LEN];
     ssize_t nread, readlen, nwritten;
-    int use_diskless_load = useDisklessLoad();
+    /* A multi-stream transfer can only be loaded from the sockets. */
+    int use_diskless_load = server.repl_transfer_streams > 1 ||
+                            useDisklessLoad();
     dbBackup *diskless_load_backup = NULL;
+    connection **stream_conns = NULL;
     int empty_db_flags = server.repl_slave_lazy_flush ? EMPTYDB_ASYNC :
                                                         EMPTYDB_NO_FLAGS;
     off_t left;
@@ -1713,6 +2071,14 @@ void readSyncBulkPayload(connection *conn) {
      *
      * 2. Or when we are done reading from the socket to the RDB file, in
      *    such case we want just to read the RDB file in memory. */
+
+    /* In a multi-stream transfer, the other parts of the RDB are received
+     * over additional connections, opened before flushing the old data. */
+    if (server.repl_transfer_streams > 1) {
+        stream_conns = replicationConnectRdbStreams();
+        if (stream_conns == NULL) goto error;
+    }
+
     serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Flushing old data");
 
     /* We need to stop any AOF rewriting child before flusing and parsing
@@ -1751,8 +2117,12 @@ void readSyncBulkPayload(connection *conn) {
         connBlock(conn);
         connRecvTimeout(conn, server.repl_timeout*1000);
         startLoading(server.repl_transfer_size, RDBFLAGS_REPLICATION);
+        if (stream_conns)
+            rdbLoadStreamsStart(stream_conns,server.repl_transfer_streams-1);
 
-        if (rdbLoadRio(&rdb,RDBFLAGS_REPLICATION,&rsi) != C_OK) {
+        int loaded = rdbLoadRio(&rdb,RDBFLAGS_REPLICATION,&rsi);
+        replicationReleaseRdbStreams(stream_conns);
+        if (loaded != C_OK) {
             /* RDB loading failed. */
             stopLoading(0);
             serverLog(LL_WARNING,
@@ -2071,6 +2441,7 @@ int slaveTryPartialResynchronization(connection *conn, int read_reply) {
          * right value, so that this information will be propagated to the
          * client structure representing the master into server.master. */
         server.master_initial_offset = -1;
+        server.repl_transfer_streams = 1;
 
         if (server.cached_master) {
             psync_replid = server.cached_master->replid;
@@ -2131,12 +2502,25 @@ int slaveTryPartialResynchronization(connection *conn, int read_reply) {
              * replid to make sure next PSYNCs will fail. */
             memset(server.master_replid,0,CONFIG_RUN_ID_SIZE+1);
         } else {
+            char *streams = strchr(offset,' ');
             memcpy(server.master_replid, replid, offset-replid-1);
             server.master_replid[CONFIG_RUN_ID_SIZE] = '\0';
             server.master_initial_offset = strtoll(offset,NULL,10);
             serverLog(LL_NOTICE,"Full resync from master: %s:%lld",
                 server.master_replid,
                 server.master_initial_offset);
+
+            /* +FULLRESYNC <replid> <offset> <streams> <client-id>: the RDB
+             * is transferred over multiple streams. */
+            char *id = streams ? strchr(streams+1,' ') : NULL;
+            if (id) {
+                int numstreams = atoi(streams+1);
+                if (numstreams > 1 && numstreams <= CONFIG_REPL_MAX_STREAMS) {
+                    server.repl_transfer_streams = numstreams;
+                    server.repl_transfer_client_id =
+                        strtoull(id+1,NULL,10);
+                }
+            }
         }
         /* We are going to full resync, discard the cached master structure. */
         replicationDiscardCachedMaster();
@@ -2334,10 +2718,16 @@ void syncWithMaster(connection *conn) {
          *
          * EOF: supports EOF-style RDB transfer for diskless replication.
          * PSYNC2: supports PSYNC v2, so understands +CONTINUE <new repl ID>.
+         * MULTISTREAM: can load the RDB from multiple connections.
          *
          * The master will ignore capabilities it does not understand. */
-        err = sendCommand(conn,"REPLCONF",
-                "capa","eof","capa","psync2",NULL);
+        if (replicationCanLoadStreams()) {
+            err = sendCommand(conn,"REPLCONF",
+                    "capa","eof","capa","psync2","capa","multistream",NULL);
+        } else {
+            err = sendCommand(conn,"REPLCONF",
+                    "capa","eof","capa","psync2",NULL);
+        }
         if (err) goto write_error;
 
         server.repl_state = REPL_STATE_RECEIVE_AUTH_REPLY;
@@ -2481,7 +2871,7 @@ void syncWithMaster(connection *conn) {
     }
 
     /* Prepare a suitable temp file for bulk transfer */
-    if (!useDisklessLoad()) {
+    if (server.repl_transfer_streams == 1 && !useDisklessLoad()) {
         while(maxtries--) {
             snprintf(tmpfile,256,
                 "temp-%d.%ld.rdb",(int)server.unixtime,(long int)getpid());
@@ -2756,6 +3146,12 @@ void replicaofCommand(client *c) {
         return;
     }
 
+    /* Each shard only has a part of the keyspace, see shardsStart(). */
+    if (server.shards > 1) {
+        addReplyError(c,"REPLICAOF not allowed when sharding is enabled.");
+        return;
+    }
+
     /* The special host/port combination "NO" "ONE" turns the instance
      * into a master. Otherwise the new master address is set. */
     if (!strcasecmp(c->argv[1]->ptr,"no") &&
@@ -2906,6 +3302,7 @@ void replicationCacheMaster(client *c) {
      * we want to discard te non processed query buffers and non processed
      * offsets, including pending transactions, already populated arguments,
      * pending outputs to the master. */
+    unshareQueryBuffer(server.master);
     sdsclear(server.master->querybuf);
     sdsclear(server.master->pending_querybuf);
     server.master->read_reploff = server.master->reploff;
@@ -3425,6 +3822,15 @@ void replicationCron(void) {
         }
     }
 
+    /* Same for the additional streams of a multi-stream diskless sync. */
+    if (server.rdb_pipe_streams && server.rdb_pipe_numstreams > 1)
+        rdbPipeStreamsCron();
+
+    /* Free what the slaves no longer need of the replication buffer, that
+     * otherwise is only trimmed when new data is fed. */
+    if (server.repl_backlog)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+
     /* If this is a master without attached slaves and there is a replication
      * backlog active, in order to reclaim memory we can free it after some
      * (configured) time. Note that this cannot be done for slaves: slaves
@@ -0,0 +1,1077 @@
+/* Roaring bitmaps of 64 bit signed integers, used by the sets with the
+ * OBJ_ENCODING_ROARING encoding (see t_set.c).
+ *
+ * The integers are split in chunks of 65536 consecutive values, and the
+ * ones of every chunk are kept in a container: a sorted array of their low
+ * 16 bits when there are up to ROARING_ARRAY_MAX of them, or a bitmap of
+ * 65536 bits when there are more. So dense sets take about a bit per
+ * element, sparse ones two bytes per element, plus a few bytes for every
+ * container. Intersections, unions and differences are computed container
+ * by container, with word operations between bitmaps.
+ *
+ * Integers are mapped to unsigned ones flipping the sign bit, so that the
+ * order of the containers and of the values inside them is the order of
+ * the signed integers.
+ *
+ * Copyright (c) 2009-2021, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "roaring.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+#include "redisassert.h"
+
+#define ROARING_SIGN (1ULL<<63)
+#define ROARING_ARRAY_INIT 4
+
+#define isBitmap(c) ((c)->card > ROARING_ARRAY_MAX)
+#define arrayOf(c) ((uint16_t*)(c)->data)
+
+static inline uint64_t roaringKey(int64_t value) {
+    return ((uint64_t)value ^ ROARING_SIGN) >> 16;
+}
+
+static inline uint16_t roaringLow(int64_t value) {
+    return (uint64_t)value & 0xffff;
+}
+
+static inline int64_t roaringValue(uint64_t key, uint16_t low) {
+    return (int64_t)(((key << 16) | low) ^ ROARING_SIGN);
+}
+
+/* -----------------------------------------------------------------------------
+ * Containers
+ * -------------------------------------------------------------------------- */
+
+static roaringContainer *arrayNew(uint32_t alloc) {
+    roaringContainer *c = zmalloc(sizeof(*c)+sizeof(uint16_t)*alloc);
+    c->card = 0;
+    c->alloc = alloc;
+    return c;
+}
+
+/* Note that the container is not a bitmap according to isBitmap() until
+ * its cardinality is set. */
+static roaringContainer *bitmapNew(void) {
+    return zcalloc(sizeof(roaringContainer)+
+                   sizeof(uint64_t)*ROARING_BITMAP_WORDS);
+}
+
+static size_t containerSize(const roaringContainer *c) {
+    return sizeof(*c) + (isBitmap(c) ?
+        sizeof(uint64_t)*ROARING_BITMAP_WORDS : sizeof(uint16_t)*c->alloc);
+}
+
+static roaringContainer *containerDup(const roaringContainer *c) {
+    size_t size = containerSize(c);
+    roaringContainer *dup = zmalloc(size);
+    memcpy(dup,c,size);
+    return dup;
+}
+
+static inline int bitmapGet(const roaringContainer *c, uint16_t low) {
+    return (c->data[low>>6] >> (low&63)) & 1;
+}
+
+static inline void bitmapSet(roaringContainer *c, uint16_t low) {
+    c->data[low>>6] |= 1ULL << (low&63);
+}
+
+static uint32_t bitmapCount(const roaringContainer *c) {
+    uint32_t card = 0;
+    for (int w = 0; w < ROARING_BITMAP_WORDS; w++)
+        card += __builtin_popcountll(c->data[w]);
+    return card;
+}
+
+/* Return the position of the first element >= low of an array container,
+ * starting from "lo". */
+static uint32_t arrayLowerBound(const roaringContainer *c, uint32_t lo,
+                                uint16_t low)
+{
+    const uint16_t *a = arrayOf(c);
+    uint32_t hi = c->card;
+
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (a[mid] < low)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static roaringContainer *arrayToBitmap(roaringContainer *c) {
+    roaringContainer *b = bitmapNew();
+    const uint16_t *a = arrayOf(c);
+
+    for (uint32_t i = 0; i < c->card; i++) bitmapSet(b,a[i]);
+    b->card = c->card;
+    zfree(c);
+    return b;
+}
+
+static roaringContainer *bitmapToArray(roaringContainer *b) {
+    roaringContainer *c = arrayNew(b->card);
+    uint16_t *a = arrayOf(c);
+
+    for (int w = 0; w < ROARING_BITMAP_WORDS; w++) {
+        uint64_t word = b->data[w];
+        while (word) {
+            a[c->card++] = w*64+__builtin_ctzll(word);
+            word &= word-1;
+        }
+    }
+    zfree(b);
+    return c;
+}
+
+/* Finish a container computed by an operation: an empty one is freed and
+ * NULL returned, a bitmap with few elements becomes an array, and an array
+ * gives back the space it doesn't use. */
+static roaringContainer *bitmapFinish(roaringContainer *b) {
+    b->card = bitmapCount(b);
+    if (b->card == 0) {
+        zfree(b);
+        return NULL;
+    }
+    return isBitmap(b) ? b : bitmapToArray(b);
+}
+
+static roaringContainer *arrayFinish(roaringContainer *c) {
+    if (c->card == 0) {
+        zfree(c);
+        return NULL;
+    }
+    if (c->alloc > c->card) {
+        c = zrealloc(c,sizeof(*c)+sizeof(uint16_t)*c->card);
+        c->alloc = c->card;
+    }
+    return c;
+}
+
+/* Return the element of the given rank, that must be < c->card. */
+static uint16_t containerSelect(const roaringContainer *c, uint32_t rank) {
+    if (!isBitmap(c)) return arrayOf(c)[rank];
+
+    for (int w = 0; w < ROARING_BITMAP_WORDS; w++) {
+        uint64_t word = c->data[w];
+        uint32_t count = __builtin_popcountll(word);
+        if (rank < count) {
+            while (rank--) word &= word-1;
+            return w*64+__builtin_ctzll(word);
+        }
+        rank -= count;
+    }
+    assert(0);
+    return 0;
+}
+
+static roaringContainer *containerAnd(const roaringContainer *a,
+                                      const roaringContainer *b)
+{
+    roaringContainer *c;
+
+    if (isBitmap(a) && isBitmap(b)) {
+        c = bitmapNew();
+        for (int w = 0; w < ROARING_BITMAP_WORDS; w++)
+            c->data[w] = a->data[w] & b->data[w];
+        return bitmapFinish(c);
+    }
+
+    if (isBitmap(a)) {
+        const roaringContainer *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    const uint16_t *x = arrayOf(a);
+    c = arrayNew(a->card);
+    uint16_t *out = arrayOf(c);
+    if (isBitmap(b)) {
+        for (uint32_t i = 0; i < a->card; i++)
+            if (bitmapGet(b,x[i])) out[c->card++] = x[i];
+    } else {
+        const uint16_t *y = arrayOf(b);
+        uint32_t i = 0, j = 0;
+        while (i < a->card && j < b->card) {
+            if (x[i] < y[j]) {
+                i++;
+            } else if (x[i] > y[j]) {
+                j++;
+            } else {
+                out[c->card++] = x[i];
+                i++;
+                j++;
+            }
+        }
+    }
+    return arrayFinish(c);
+}
+
+static roaringContainer *containerOr(const roaringContainer *a,
+                                     const roaringContainer *b)
+{
+    roaringContainer *c;
+
+    if (!isBitmap(a) && !isBitmap(b)) {
+        const uint16_t *x = arrayOf(a), *y = arrayOf(b);
+        uint32_t i, j;
+
+        if (a->card+b->card > ROARING_ARRAY_MAX) {
+            c = bitmapNew();
+            for (i = 0; i < a->card; i++) bitmapSet(c,x[i]);
+            for (j = 0; j < b->card; j++) bitmapSet(c,y[j]);
+            return bitmapFinish(c);
+        }
+
+        c = arrayNew(a->card+b->card);
+        uint16_t *out = arrayOf(c);
+        i = j = 0;
+        while (i < a->card || j < b->card) {
+            if (j == b->card || (i < a->card && x[i] < y[j])) {
+                out[c->card++] = x[i++];
+            } else if (i == a->card || x[i] > y[j]) {
+                out[c->card++] = y[j++];
+            } else {
+                out[c->card++] = x[i];
+                i++;
+                j++;
+            }
+        }
+        return arrayFinish(c);
+    }
+
+    if (!isBitmap(a)) {
+        const roaringContainer *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    c = containerDup(a);
+    if (isBitmap(b)) {
+        for (int w = 0; w < ROARING_BITMAP_WORDS; w++)
+            c->data[w] |= b->data[w];
+    } else {
+        const uint16_t *y = arrayOf(b);
+        for (uint32_t j = 0; j < b->card; j++) bitmapSet(c,y[j]);
+    }
+    return bitmapFinish(c);
+}
+
+/* Elements of "a" not in "b". */
+static roaringContainer *containerAndNot(const roaringContainer *a,
+                                         const roaringContainer *b)
+{
+    roaringContainer *c;
+
+    if (isBitmap(a)) {
+        c = containerDup(a);
+        if (isBitmap(b)) {
+            for (int w = 0; w < ROARING_BITMAP_WORDS; w++)
+                c->data[w] &= ~b->data[w];
+        } else {
+            const uint16_t *y = arrayOf(b);
+            for (uint32_t j = 0; j < b->card; j++)
+                c->data[y[j]>>6] &= ~(1ULL << (y[j]&63));
+        }
+        return bitmapFinish(c);
+    }
+
+    const uint16_t *x = arrayOf(a);
+    c = arrayNew(a->card);
+    uint16_t *out = arrayOf(c);
+    if (isBitmap(b)) {
+        for (uint32_t i = 0; i < a->card; i++)
+            if (!bitmapGet(b,x[i])) out[c->card++] = x[i];
+    } else {
+        const uint16_t *y = arrayOf(b);
+        uint32_t i = 0, j = 0;
+        while (i < a->card) {
+            if (j == b->card || x[i] < y[j]) {
+                out[c->card++] = x[i++];
+            } else if (x[i] > y[j]) {
+                j++;
+            } else {
+                i++;
+                j++;
+            }
+        }
+    }
+    return arrayFinish(c);
+}
+
+/* -----------------------------------------------------------------------------
+ * Bitmaps
+ * -------------------------------------------------------------------------- */
+
+roaring *roaringNew(void) {
+    roaring *r = zmalloc(sizeof(*r));
+    r->card = 0;
+    r->count = 0;
+    r->alloc = 0;
+    r->keys = NULL;
+    r->containers = NULL;
+    r->ranks = NULL;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    for (uint32_t i = 0; i < r->count; i++) zfree(r->containers[i]);
+    zfree(r->keys);
+    zfree(r->containers);
+    zfree(r->ranks);
+    zfree(r);
+}
+
+/* The ranks are a Fenwick tree of the cardinalities of the containers: the
+ * entry i (from 1) is the sum of the ones of the containers from
+ * i-(i&-i)+1 to i. They are built on demand, updated when an element is
+ * added or removed, and dropped when a container is added or removed. */
+static void roaringRanksBuild(roaring *r) {
+    r->ranks = zmalloc(sizeof(uint64_t)*r->count);
+    for (uint32_t i = 0; i < r->count; i++) r->ranks[i] = r->containers[i]->card;
+    for (uint32_t i = 1; i <= r->count; i++) {
+        uint32_t parent = i+(i&-i);
+        if (parent <= r->count) r->ranks[parent-1] += r->ranks[i-1];
+    }
+}
+
+static void roaringRanksDrop(roaring *r) {
+    zfree(r->ranks);
+    r->ranks = NULL;
+}
+
+/* Add "delta" to the cardinality of the container "idx". */
+static void roaringRanksUpdate(roaring *r, uint32_t idx, int delta) {
+    for (uint32_t i = idx+1; i <= r->count; i += i&-i)
+        r->ranks[i-1] += delta;
+}
+
+/* Search the container of the chunk "key". Return 1 and set "idx" to its
+ * position if there is one, otherwise return 0 and set "idx" to the
+ * position where it should be inserted. */
+static int roaringFindKey(const roaring *r, uint64_t key, uint32_t *idx) {
+    uint32_t lo = 0, hi = r->count;
+
+    /* Elements are often added in order: try the last container first. */
+    if (hi && r->keys[hi-1] <= key) {
+        *idx = r->keys[hi-1] == key ? hi-1 : hi;
+        return r->keys[hi-1] == key;
+    }
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (r->keys[mid] < key)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    *idx = lo;
+    return lo < r->count && r->keys[lo] == key;
+}
+
+static void roaringResize(roaring *r, uint32_t alloc) {
+    r->keys = zrealloc(r->keys,sizeof(uint64_t)*alloc);
+    r->containers = zrealloc(r->containers,sizeof(roaringContainer*)*alloc);
+    r->alloc = alloc;
+}
+
+static void roaringInsertContainer(roaring *r, uint32_t idx, uint64_t key,
+                                   roaringContainer *c)
+{
+    if (r->count == r->alloc) roaringResize(r,r->alloc ? r->alloc*2 : 1);
+    roaringRanksDrop(r);
+    memmove(r->keys+idx+1,r->keys+idx,sizeof(uint64_t)*(r->count-idx));
+    memmove(r->containers+idx+1,r->containers+idx,
+            sizeof(roaringContainer*)*(r->count-idx));
+    r->keys[idx] = key;
+    r->containers[idx] = c;
+    r->count++;
+}
+
+static void roaringRemoveContainer(roaring *r, uint32_t idx) {
+    zfree(r->containers[idx]);
+    roaringRanksDrop(r);
+    r->count--;
+    memmove(r->keys+idx,r->keys+idx+1,sizeof(uint64_t)*(r->count-idx));
+    memmove(r->containers+idx,r->containers+idx+1,
+            sizeof(roaringContainer*)*(r->count-idx));
+    if (r->alloc > 4 && r->count < r->alloc/4) roaringResize(r,r->alloc/2);
+}
+
+/* Append the result of an operation, if not empty, to a bitmap built in
+ * order. */
+static void roaringAppend(roaring *r, uint64_t key, roaringContainer *c) {
+    if (c == NULL) return;
+    roaringInsertContainer(r,r->count,key,c);
+    r->card += c->card;
+}
+
+roaring *roaringDup(const roaring *r) {
+    roaring *dup = roaringNew();
+
+    if (r->count) roaringResize(dup,r->count);
+    for (uint32_t i = 0; i < r->count; i++)
+        roaringAppend(dup,r->keys[i],containerDup(r->containers[i]));
+    return dup;
+}
+
+/* Add an element. Return 1 if it was added, 0 if it was already there. */
+int roaringAdd(roaring *r, int64_t value) {
+    uint64_t key = roaringKey(value);
+    uint16_t low = roaringLow(value);
+    roaringContainer *c;
+    uint32_t idx;
+
+    if (!roaringFindKey(r,key,&idx))
+        roaringInsertContainer(r,idx,key,arrayNew(ROARING_ARRAY_INIT));
+    c = r->containers[idx];
+
+    if (isBitmap(c)) {
+        if (bitmapGet(c,low)) return 0;
+        bitmapSet(c,low);
+    } else {
+        uint16_t *a = arrayOf(c);
+        uint32_t pos = (c->card == 0 || a[c->card-1] < low) ? c->card :
+                       arrayLowerBound(c,0,low);
+
+        if (pos < c->card && a[pos] == low) return 0;
+        if (c->card == ROARING_ARRAY_MAX) {
+            c = r->containers[idx] = arrayToBitmap(c);
+            bitmapSet(c,low);
+        } else {
+            if (c->card == c->alloc) {
+                uint32_t alloc = c->alloc*2;
+                if (alloc > ROARING_ARRAY_MAX) alloc = ROARING_ARRAY_MAX;
+                c = r->containers[idx] =
+                    zrealloc(c,sizeof(*c)+sizeof(uint16_t)*alloc);
+                c->alloc = alloc;
+                a = arrayOf(c);
+            }
+            memmove(a+pos+1,a+pos,sizeof(uint16_t)*(c->card-pos));
+            a[pos] = low;
+        }
+    }
+    c->card++;
+    r->card++;
+    if (r->ranks) roaringRanksUpdate(r,idx,1);
+    return 1;
+}
+
+/* Remove an element. Return 1 if it was removed, 0 if it was not there. */
+int roaringRemove(roaring *r, int64_t value) {
+    uint16_t low = roaringLow(value);
+    roaringContainer *c;
+    uint32_t idx;
+
+    if (!roaringFindKey(r,roaringKey(value),&idx)) return 0;
+    c = r->containers[idx];
+
+    if (isBitmap(c)) {
+        if (!bitmapGet(c,low)) return 0;
+        c->data[low>>6] &= ~(1ULL << (low&63));
+        if (--c->card == ROARING_ARRAY_MAX)
+            r->containers[idx] = bitmapToArray(c);
+    } else {
+        uint16_t *a = arrayOf(c);
+        uint32_t pos = arrayLowerBound(c,0,low);
+
+        if (pos == c->card || a[pos] != low) return 0;
+        memmove(a+pos,a+pos+1,sizeof(uint16_t)*(c->card-pos-1));
+        if (--c->card == 0) {
+            roaringRemoveContainer(r,idx);
+        } else if (c->alloc > ROARING_ARRAY_INIT && c->card < c->alloc/4) {
+            c->alloc /= 2;
+            r->containers[idx] = zrealloc(c,sizeof(*c)+sizeof(uint16_t)*c->alloc);
+        }
+    }
+    r->card--;
+    if (r->ranks) roaringRanksUpdate(r,idx,-1);
+    return 1;
+}
+
+int roaringContains(const roaring *r, int64_t value) {
+    uint16_t low = roaringLow(value);
+    const roaringContainer *c;
+    uint32_t idx, pos;
+
+    if (!roaringFindKey(r,roaringKey(value),&idx)) return 0;
+    c = r->containers[idx];
+    if (isBitmap(c)) return bitmapGet(c,low);
+    pos = arrayLowerBound(c,0,low);
+    return pos < c->card && arrayOf(c)[pos] == low;
+}
+
+/* Return the element of the given rank, that must be < the cardinality.
+ * The container holding it is found descending the ranks tree. */
+int64_t roaringSelect(roaring *r, uint64_t rank) {
+    uint32_t pos = 0, step = 1;
+
+    assert(rank < r->card);
+    if (r->ranks == NULL) roaringRanksBuild(r);
+    while (step*2 <= r->count) step *= 2;
+    for (; step; step /= 2) {
+        if (pos+step <= r->count && r->ranks[pos+step-1] <= rank) {
+            pos += step;
+            rank -= r->ranks[pos-1];
+        }
+    }
+    return roaringValue(r->keys[pos],containerSelect(r->containers[pos],rank));
+}
+
+/* Return a random element of a non empty bitmap. */
+int64_t roaringRandom(roaring *r) {
+    assert(r->card);
+    return roaringSelect(r,(((uint64_t)random() << 31) ^ random()) % r->card);
+}
+
+void roaringIterInit(const roaring *r, roaringIter *it) {
+    it->r = r;
+    it->ci = 0;
+    it->pos = 0;
+}
+
+/* Position the iterator on the first element >= value. */
+void roaringIterSeek(const roaring *r, roaringIter *it, int64_t value) {
+    uint16_t low = roaringLow(value);
+
+    it->r = r;
+    if (roaringFindKey(r,roaringKey(value),&it->ci)) {
+        const roaringContainer *c = r->containers[it->ci];
+        it->pos = isBitmap(c) ? low : arrayLowerBound(c,0,low);
+    } else {
+        it->pos = 0;
+    }
+}
+
+/* Store the next element in "value" and return 1, or return 0 when there
+ * are no more elements. */
+int roaringNext(roaringIter *it, int64_t *value) {
+    const roaring *r = it->r;
+
+    while (it->ci < r->count) {
+        const roaringContainer *c = r->containers[it->ci];
+
+        if (isBitmap(c)) {
+            uint32_t w = it->pos >> 6;
+            if (w < ROARING_BITMAP_WORDS) {
+                uint64_t word = c->data[w] & (~0ULL << (it->pos&63));
+                while (!word && ++w < ROARING_BITMAP_WORDS) word = c->data[w];
+                if (word) {
+                    uint32_t low = w*64+__builtin_ctzll(word);
+                    it->pos = low+1;
+                    *value = roaringValue(r->keys[it->ci],low);
+                    return 1;
+                }
+            }
+        } else if (it->pos < c->card) {
+            *value = roaringValue(r->keys[it->ci],arrayOf(c)[it->pos++]);
+            return 1;
+        }
+        it->ci++;
+        it->pos = 0;
+    }
+    return 0;
+}
+
+/* Return a new bitmap with the elements both in "a" and "b". */
+roaring *roaringAnd(const roaring *a, const roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+
+    while (i < a->count && j < b->count) {
+        if (a->keys[i] < b->keys[j]) {
+            i++;
+        } else if (a->keys[i] > b->keys[j]) {
+            j++;
+        } else {
+            roaringAppend(r,a->keys[i],
+                containerAnd(a->containers[i],b->containers[j]));
+            i++;
+            j++;
+        }
+    }
+    return r;
+}
+
+/* Return a new bitmap with the elements in "a" or in "b". */
+roaring *roaringOr(const roaring *a, const roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+
+    while (i < a->count || j < b->count) {
+        if (j == b->count || (i < a->count && a->keys[i] < b->keys[j])) {
+            roaringAppend(r,a->keys[i],containerDup(a->containers[i]));
+            i++;
+        } else if (i == a->count || a->keys[i] > b->keys[j]) {
+            roaringAppend(r,b->keys[j],containerDup(b->containers[j]));
+            j++;
+        } else {
+            roaringAppend(r,a->keys[i],
+                containerOr(a->containers[i],b->containers[j]));
+            i++;
+            j++;
+        }
+    }
+    return r;
+}
+
+/* Return a new bitmap with the elements in "a" that are not in "b". */
+roaring *roaringAndNot(const roaring *a, const roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i, j = 0;
+
+    for (i = 0; i < a->count; i++) {
+        while (j < b->count && b->keys[j] < a->keys[i]) j++;
+        if (j < b->count && b->keys[j] == a->keys[i]) {
+            roaringAppend(r,a->keys[i],
+                containerAndNot(a->containers[i],b->containers[j]));
+        } else {
+            roaringAppend(r,a->keys[i],containerDup(a->containers[i]));
+        }
+    }
+    return r;
+}
+
+size_t roaringAllocSize(const roaring *r) {
+    size_t size = sizeof(*r)+
+                  (sizeof(uint64_t)+sizeof(roaringContainer*))*r->alloc;
+    if (r->ranks) size += sizeof(uint64_t)*r->count;
+    for (uint32_t i = 0; i < r->count; i++)
+        size += containerSize(r->containers[i]);
+    return size;
+}
+
+/* -----------------------------------------------------------------------------
+ * Serialization
+ *
+ * The serialized format is the number of containers, as a 32 bit integer,
+ * followed by every container: its chunk as a 64 bit integer, its number of
+ * elements as a 32 bit integer, and its elements as 16 bit integers, or the
+ * 1024 words of its bitmap as 64 bit integers. Integers are little endian.
+ * -------------------------------------------------------------------------- */
+
+static size_t containerDataLen(uint32_t card) {
+    return card > ROARING_ARRAY_MAX ?
+        sizeof(uint64_t)*ROARING_BITMAP_WORDS : sizeof(uint16_t)*card;
+}
+
+size_t roaringSerializedSize(const roaring *r) {
+    size_t size = sizeof(uint32_t);
+    for (uint32_t i = 0; i < r->count; i++) {
+        size += sizeof(uint64_t)+sizeof(uint32_t)+
+                containerDataLen(r->containers[i]->card);
+    }
+    return size;
+}
+
+/* Serialize the bitmap in "buf", of roaringSerializedSize() bytes. */
+void roaringSerialize(const roaring *r, unsigned char *buf) {
+    uint32_t count = r->count;
+
+    memrev32ifbe(&count);
+    memcpy(buf,&count,sizeof(count));
+    buf += sizeof(count);
+    for (uint32_t i = 0; i < r->count; i++) {
+        const roaringContainer *c = r->containers[i];
+        uint64_t key = r->keys[i];
+        uint32_t card = c->card;
+        size_t len = containerDataLen(card);
+
+        memrev64ifbe(&key);
+        memrev32ifbe(&card);
+        memcpy(buf,&key,sizeof(key));
+        memcpy(buf+sizeof(key),&card,sizeof(card));
+        buf += sizeof(key)+sizeof(card);
+        memcpy(buf,c->data,len);
+#if (BYTE_ORDER == BIG_ENDIAN)
+        if (isBitmap(c)) {
+            for (int w = 0; w < ROARING_BITMAP_WORDS; w++)
+                memrev64(buf+w*sizeof(uint64_t));
+        } else {
+            for (uint32_t j = 0; j < c->card; j++)
+                memrev16(buf+j*sizeof(uint16_t));
+        }
+#endif
+        buf += len;
+    }
+}
+
+/* Load a bitmap serialized with roaringSerialize(). The data is validated,
+ * and NULL is returned if it is not a valid bitmap. */
+roaring *roaringDeserialize(const unsigned char *buf, size_t len) {
+    const unsigned char *end = buf+len;
+    roaring *r;
+    uint32_t count;
+
+    if (len < sizeof(count)) return NULL;
+    memcpy(&count,buf,sizeof(count));
+    memrev32ifbe(&count);
+    buf += sizeof(count);
+
+    r = roaringNew();
+    for (uint32_t i = 0; i < count; i++) {
+        roaringContainer *c;
+        uint64_t key;
+        uint32_t card;
+        size_t datalen;
+
+        if ((size_t)(end-buf) < sizeof(key)+sizeof(card)) goto err;
+        memcpy(&key,buf,sizeof(key));
+        memcpy(&card,buf+sizeof(key),sizeof(card));
+        memrev64ifbe(&key);
+        memrev32ifbe(&card);
+        buf += sizeof(key)+sizeof(card);
+
+        /* Chunks must be ascending, and fit in 48 bits. */
+        if (key >> 48 || (r->count && key <= r->keys[r->count-1])) goto err;
+        if (card == 0 || card > 65536) goto err;
+        datalen = containerDataLen(card);
+        if ((size_t)(end-buf) < datalen) goto err;
+
+        if (card > ROARING_ARRAY_MAX) {
+            c = bitmapNew();
+            memcpy(c->data,buf,datalen);
+#if (BYTE_ORDER == BIG_ENDIAN)
+            for (int w = 0; w < ROARING_BITMAP_WORDS; w++)
+                memrev64(c->data+w);
+#endif
+            if (bitmapCount(c) != card) {
+                zfree(c);
+                goto err;
+            }
+        } else {
+            c = arrayNew(card);
+            uint16_t *a = arrayOf(c);
+            memcpy(a,buf,datalen);
+            for (uint32_t j = 0; j < card; j++) {
+                memrev16ifbe(a+j);
+                if (j && a[j] <= a[j-1]) {
+                    zfree(c);
+                    goto err;
+                }
+            }
+        }
+        c->card = card;
+        buf += datalen;
+        roaringAppend(r,key,c);
+    }
+    if (buf != end) goto err;
+    return r;
+
+err:
+    roaringFree(r);
+    return NULL;
+}
+
+/* Defrag the arrays and the containers of the bitmap (but not the bitmap
+ * struct itself) with "defragfn", that returns the new pointer when the
+ * allocation was moved, or NULL. Returns the number of moved allocations. */
+unsigned long roaringDefragContainers(roaring *r, void *(*defragfn)(void *ptr)) {
+    unsigned long defragged = 0;
+    void *newptr;
+
+    if (r->alloc == 0) return 0;
+    if ((newptr = defragfn(r->keys))) defragged++, r->keys = newptr;
+    if ((newptr = defragfn(r->containers))) defragged++, r->containers = newptr;
+    if (r->ranks && (newptr = defragfn(r->ranks))) defragged++, r->ranks = newptr;
+    for (uint32_t i = 0; i < r->count; i++) {
+        if ((newptr = defragfn(r->containers[i])))
+            defragged++, r->containers[i] = newptr;
+    }
+    return defragged;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define UNUSED(x) (void)(x)
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static int compareInt64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Random values spread over "range" integers around "base", sorted and
+ * without duplicates, stored in "values". Returns how many there are. */
+static size_t randomValues(int64_t *values, size_t n, int64_t base,
+                           uint64_t range)
+{
+    size_t i, j;
+
+    for (i = 0; i < n; i++)
+        values[i] = (int64_t)((uint64_t)base+
+                              ((((uint64_t)rand() << 31) ^ rand()) % range));
+    qsort(values,n,sizeof(*values),compareInt64);
+    for (i = 0, j = 0; i < n; i++)
+        if (j == 0 || values[i] != values[j-1]) values[j++] = values[i];
+    return j;
+}
+
+/* Check that the bitmap contains exactly the "n" sorted values. */
+static void checkValues(roaring *r, int64_t *values, size_t n) {
+    roaringIter it;
+    int64_t value;
+    size_t i = 0;
+
+    assert(roaringCard(r) == n);
+    roaringIterInit(r,&it);
+    while (roaringNext(&it,&value)) {
+        assert(i < n && value == values[i]);
+        i++;
+    }
+    assert(i == n);
+    for (uint32_t j = 0; j < r->count; j++) {
+        roaringContainer *c = r->containers[j];
+        assert(c->card > 0);
+        if (!isBitmap(c)) assert(c->card <= c->alloc);
+        else assert(bitmapCount(c) == c->card);
+    }
+}
+
+/* Add the values at even positions in order, then the other ones in
+ * reverse order, to insert both at the end and in the middle. */
+static roaring *createBitmap(int64_t *values, size_t n) {
+    roaring *r = roaringNew();
+    size_t i;
+
+    for (i = 0; i < n; i += 2) assert(roaringAdd(r,values[i]));
+    for (i = n; i > 0; i--)
+        if ((i-1) % 2) assert(roaringAdd(r,values[i-1]));
+    return r;
+}
+
+int roaringTest(int argc, char *argv[], int accurate) {
+    size_t n = accurate ? 1000000 : 200000, len, len2, i;
+    int64_t *values = zmalloc(sizeof(int64_t)*n);
+    int64_t *values2 = zmalloc(sizeof(int64_t)*n);
+    int64_t *expected = zmalloc(sizeof(int64_t)*n*2);
+    uint64_t ranges[] = {100, 50000, 1000000, 100000000, UINT64_MAX};
+    roaring *r, *r2, *res;
+    int64_t value;
+    long long start;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(time(NULL));
+
+    printf("Add, remove, contains and iterate, for different densities: ");
+    for (int k = 0; k < 5; k++) {
+        int64_t base = k == 4 ? INT64_MIN : -(int64_t)(ranges[k]/2);
+        len = randomValues(values,k == 4 ? n/20 : n,base,ranges[k]);
+        r = createBitmap(values,len);
+        checkValues(r,values,len);
+        for (i = 0; i < len; i++) {
+            assert(roaringContains(r,values[i]));
+            assert(!roaringAdd(r,values[i]));
+            if (values[i] != INT64_MAX && (i == len-1 || values[i+1] != values[i]+1))
+                assert(!roaringContains(r,values[i]+1));
+        }
+
+        /* Remove every other element, then everything. */
+        for (i = 0, len2 = 0; i < len; i++) {
+            if (i % 2) assert(roaringRemove(r,values[i]));
+            else values2[len2++] = values[i];
+        }
+        checkValues(r,values2,len2);
+        for (i = 0; i < len2; i++) assert(roaringRemove(r,values2[i]));
+        assert(!roaringRemove(r,values2[0]));
+        assert(roaringCard(r) == 0 && r->count == 0);
+        roaringFree(r);
+    }
+    printf("OK\n");
+
+    printf("Extreme values: "); {
+        r = roaringNew();
+        assert(roaringAdd(r,INT64_MIN));
+        assert(roaringAdd(r,INT64_MAX));
+        assert(roaringAdd(r,-1));
+        assert(roaringAdd(r,0));
+        int64_t sorted[] = {INT64_MIN, -1, 0, INT64_MAX};
+        checkValues(r,sorted,4);
+        roaringFree(r);
+        printf("OK\n");
+    }
+
+    printf("Seek, select and random elements: "); {
+        roaringIter it;
+
+        len = randomValues(values,n,0,n*8);
+        r = createBitmap(values,len);
+        for (i = 0; i < 10000; i++) {
+            size_t idx = rand()%len;
+            assert(roaringSelect(r,idx) == values[idx]);
+            roaringIterSeek(r,&it,values[idx]);
+            assert(roaringNext(&it,&value) && value == values[idx]);
+            roaringIterSeek(r,&it,values[idx]-1);
+            assert(roaringNext(&it,&value) && value == values[idx-(idx && values[idx-1] == values[idx]-1)]);
+            assert(roaringContains(r,roaringRandom(r)));
+        }
+        roaringIterSeek(r,&it,values[len-1]+1);
+        assert(!roaringNext(&it,&value));
+
+        /* The ranks follow the removals and additions of elements. */
+        for (i = 0, len2 = 0; i < len; i++) {
+            if (i % 3 == 0) assert(roaringRemove(r,values[i]));
+            else values2[len2++] = values[i];
+        }
+        for (i = 0; i < 10000; i++) {
+            size_t idx = rand()%len2;
+            assert(roaringSelect(r,idx) == values2[idx]);
+        }
+        for (i = 0; i < len; i += 3) assert(roaringAdd(r,values[i]));
+        for (i = 0; i < 10000; i++) {
+            size_t idx = rand()%len;
+            assert(roaringSelect(r,idx) == values[idx]);
+        }
+        roaringFree(r);
+        printf("OK\n");
+    }
+
+    printf("Intersection, union and difference: ");
+    for (int k = 0; k < 4; k++) {
+        size_t m, x, y;
+
+        /* From dense bitmaps, to one element per container. */
+        uint64_t range[] = {n*4, n*64, 100000000, 1ULL<<40};
+        size_t count = k == 3 ? n/20 : n;
+
+        len = randomValues(values,count,0,range[k]);
+        len2 = randomValues(values2,k%2 ? count/100 : count,0,range[k]);
+        r = createBitmap(values,len);
+        r2 = createBitmap(values2,len2);
+
+        for (x = 0, y = 0, m = 0; x < len && y < len2;) {
+            if (values[x] < values2[y]) x++;
+            else if (values[x] > values2[y]) y++;
+            else expected[m++] = values[x++], y++;
+        }
+        res = roaringAnd(r,r2);
+        checkValues(res,expected,m);
+        roaringFree(res);
+        res = roaringAnd(r2,r);
+        checkValues(res,expected,m);
+        roaringFree(res);
+
+        for (x = 0, y = 0, m = 0; x < len || y < len2;) {
+            if (y == len2 || (x < len && values[x] < values2[y])) expected[m++] = values[x++];
+            else if (x == len || values[x] > values2[y]) expected[m++] = values2[y++];
+            else expected[m++] = values[x++], y++;
+        }
+        res = roaringOr(r,r2);
+        checkValues(res,expected,m);
+        roaringFree(res);
+
+        for (x = 0, y = 0, m = 0; x < len; x++) {
+            while (y < len2 && values2[y] < values[x]) y++;
+            if (y == len2 || values2[y] != values[x]) expected[m++] = values[x];
+        }
+        res = roaringAndNot(r,r2);
+        checkValues(res,expected,m);
+        roaringFree(res);
+
+        res = roaringAndNot(r,r);
+        assert(roaringCard(res) == 0 && res->count == 0);
+        roaringFree(res);
+        res = roaringDup(r);
+        checkValues(res,values,len);
+        roaringFree(res);
+        roaringFree(r);
+        roaringFree(r2);
+    }
+    printf("OK\n");
+
+    printf("Serialization: "); {
+        for (int k = 0; k < 5; k++) {
+            len = randomValues(values,n/10,k == 4 ? INT64_MIN : 0,ranges[k]);
+            r = createBitmap(values,len);
+            size_t size = roaringSerializedSize(r);
+            unsigned char *buf = zmalloc(size);
+            roaringSerialize(r,buf);
+            res = roaringDeserialize(buf,size);
+            assert(res != NULL);
+            checkValues(res,values,len);
+            roaringFree(res);
+
+            /* Truncated or altered payloads are rejected. */
+            assert(roaringDeserialize(buf,size-1) == NULL);
+            if (r->count > 1) {
+                /* Swap the chunks of the first two containers. */
+                size_t second = 4+12+containerDataLen(r->containers[0]->card);
+                unsigned char tmp[8];
+                memcpy(tmp,buf+4,8);
+                memcpy(buf+4,buf+second,8);
+                memcpy(buf+second,tmp,8);
+                assert(roaringDeserialize(buf,size) == NULL);
+            }
+            zfree(buf);
+            roaringFree(r);
+        }
+        printf("OK\n");
+    }
+
+    printf("Memory usage and speed of dense IDs:\n"); {
+        len = randomValues(values,n,1000000,n*2);
+        start = usec();
+        r = roaringNew();
+        for (i = 0; i < len; i++) roaringAdd(r,values[i]);
+        printf("  %zu elements added in %lld usec, %.2f bytes per element\n",
+               len,usec()-start,(double)roaringAllocSize(r)/len);
+        len2 = randomValues(values2,n,1000000,n*2);
+        r2 = createBitmap(values2,len2);
+        start = usec();
+        res = roaringAnd(r,r2);
+        printf("  intersection of %zu elements in %lld usec\n",
+               (size_t)roaringCard(res),usec()-start);
+        roaringFree(res);
+        start = usec();
+        res = roaringOr(r,r2);
+        printf("  union of %zu elements in %lld usec\n",
+               (size_t)roaringCard(res),usec()-start);
+        roaringFree(res);
+        roaringFree(r);
+        roaringFree(r2);
+    }
+
+    zfree(values);
+    zfree(values2);
+    zfree(expected);
+    return 0;
+}
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2009-2021, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ROARING_ARRAY_MAX 4096      /* Max elements of an array container. */
+#define ROARING_BITMAP_WORDS 1024   /* 64 bit words of a bitmap container. */
+
+/* The elements of a chunk of 65536 consecutive integers, as an array of
+ * their low 16 bits, sorted, or as a bitmap when there are more than
+ * ROARING_ARRAY_MAX of them. */
+typedef struct roaringContainer {
+    uint32_t card;      /* Number of elements, from 1 to 65536. */
+    uint32_t alloc;     /* Elements allocated, for array containers. */
+    uint64_t data[];    /* uint16_t elements, or the bitmap words. */
+} roaringContainer;
+
+typedef struct roaring {
+    uint64_t card;      /* Number of elements. */
+    uint32_t count;     /* Number of containers. */
+    uint32_t alloc;     /* Containers allocated. */
+    uint64_t *keys;     /* The chunk of every container, ascending. */
+    roaringContainer **containers;
+    uint64_t *ranks;    /* Cardinalities of the containers as a Fenwick tree,
+                           built by roaringSelect(), or NULL. */
+} roaring;
+
+/* Position of the next element to return, valid until the bitmap is
+ * modified. */
+typedef struct roaringIter {
+    const roaring *r;
+    uint32_t ci;        /* Container. */
+    uint32_t pos;       /* Array index, or bit, in the container. */
+} roaringIter;
+
+#define roaringCard(r) ((r)->card)
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+roaring *roaringDup(const roaring *r);
+int roaringAdd(roaring *r, int64_t value);
+int roaringRemove(roaring *r, int64_t value);
+int roaringContains(const roaring *r, int64_t value);
+int64_t roaringSelect(roaring *r, uint64_t rank);
+int64_t roaringRandom(roaring *r);
+void roaringIterInit(const roaring *r, roaringIter *it);
+void roaringIterSeek(const roaring *r, roaringIter *it, int64_t value);
+int roaringNext(roaringIter *it, int64_t *value);
+roaring *roaringAnd(const roaring *a, const roaring *b);
+roaring *roaringOr(const roaring *a, const roaring *b);
+roaring *roaringAndNot(const roaring *a, const roaring *b);
+size_t roaringAllocSize(const roaring *r);
+size_t roaringSerializedSize(const roaring *r);
+void roaringSerialize(const roaring *r, unsigned char *buf);
+roaring *roaringDeserialize(const unsigned char *buf, size_t len);
+unsigned long roaringDefragContainers(roaring *r, void *(*defragfn)(void *ptr));
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[], int accurate);
+#endif
+
+#endif
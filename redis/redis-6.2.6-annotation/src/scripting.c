@@ -738,6 +738,16 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         }
     }
 
+    /* Likewise scripts can only access the keys of their shard. */
+    if (server.shards > 1 && !server.loading) {
+        int shard = getShardByQuery(cmd,c->argv,c->argc);
+        if (shard != -1 && shard != server.shard_id) {
+            luaPushError(lua,
+                "Lua script attempted to access a key of another shard");
+            goto cleanup;
+        }
+    }
+
     /* If we are using single commands replication, we need to wrap what
      * we propagate into a MULTI/EXEC block, so that it will be atomic like
      * a Lua script in the context of AOF and slaves. */
@@ -234,6 +234,76 @@ sds sdsdup(const sds s) {
     return sdsnewlen(s, sdslen(s));
 }
 
+/* Type of the embedded strings: SDS_TYPE_5 strings store the length in the
+ * flags byte, so they have no room for user bits. */
+static inline char sdsEmbedType(size_t initlen, int userbits) {
+    char type = sdsReqType(initlen);
+    return (userbits && type == SDS_TYPE_5) ? SDS_TYPE_8 : type;
+}
+
+/* Return the number of bytes needed to store an sds string of 'initlen'
+ * bytes with sdsnewembed(), that is, header, string and null term. */
+/* sdsnewembed()ⲿڴдųΪinitlensdsֽ */
+size_t sdsEmbedSize(size_t initlen, int userbits) {
+    return sdsHdrSize(sdsEmbedType(initlen,userbits))+initlen+1;
+}
+
+/* Create an sds string inside the memory pointed by 'buf', that must be at
+ * least sdsEmbedSize(initlen) bytes, instead of allocating it. This is used
+ * in order to embed a string in a bigger allocation: such a string has no
+ * free space at the end, must never be modified in a way that reallocates
+ * it, and is released together with the allocation that holds it, never
+ * with sdsfree().
+ *
+ * If 'userbits' is true the string has room for SDS_USER_BITS bits of user
+ * information, initially zero, see sdsuserbits() and sdssetuserbits().
+ *
+ * 'init' may also point to the end of the header itself, that is where the
+ * string is going to be, in order to turn bytes that are already in place
+ * into an sds string without copying them. */
+/* bufָڴдsdsǵڴ
+ * ڽַǶڸڴУsdsܱݣҲsdsfree()ͷ
+ * userbits0ʱʹsdshdr5Աflagsбûλ */
+sds sdsnewembed(void *buf, const void *init, size_t initlen, int userbits) {
+    char type = sdsEmbedType(initlen,userbits);
+    sds s = (char*)buf+sdsHdrSize(type);
+    unsigned char *fp = ((unsigned char*)s)-1;
+
+    switch(type) {
+        case SDS_TYPE_5: {
+            *fp = type | (initlen << SDS_TYPE_BITS);
+            break;
+        }
+        case SDS_TYPE_8: {
+            SDS_HDR_VAR(8,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_16: {
+            SDS_HDR_VAR(16,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+    }
+    if (initlen && init != s) memcpy(s, init, initlen);
+    s[initlen] = '\0';
+    return s;
+}
+
 /* Free an sds string. No operation is performed if 's' is NULL. */
 /* ͷsds */
 void sdsfree(sds s) {
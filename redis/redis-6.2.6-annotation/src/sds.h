@@ -224,6 +224,19 @@ static inline size_t sdsalloc(const sds s) {
     return 0;
 }
 
+/* Embedded strings created asking for user bits (see sdsnewembed()) have
+ * SDS_USER_BITS bits in the flags byte that the caller can use to store
+ * its own information. */
+// ǶsdsflagsֽδʹõĸλԱ÷ԼϢ
+#define SDS_USER_BITS (8-SDS_TYPE_BITS)
+static inline unsigned char sdsuserbits(const sds s) {
+    return ((unsigned char)s[-1]) >> SDS_TYPE_BITS;
+}
+
+static inline void sdssetuserbits(sds s, unsigned char bits) {
+    s[-1] = (s[-1] & SDS_TYPE_MASK) | (bits << SDS_TYPE_BITS);
+}
+
 /* sdsѷĴС */
 static inline void sdssetalloc(sds s, size_t newlen) {
     unsigned char flags = s[-1];
@@ -251,6 +264,8 @@ sds sdstrynewlen(const void *init, size_t initlen);
 sds sdsnew(const char *init);
 sds sdsempty(void);
 sds sdsdup(const sds s);
+size_t sdsEmbedSize(size_t initlen, int userbits);
+sds sdsnewembed(void *buf, const void *init, size_t initlen, int userbits);
 void sdsfree(sds s);
 sds sdsgrowzero(sds s, size_t len);
 sds sdscatlen(sds s, const void *t, size_t len);
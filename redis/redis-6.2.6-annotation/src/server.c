@@ -35,6 +35,7 @@
 #include "latency.h"
 #include "atomicvar.h"
 #include "mt19937-64.h"
+#include "compress.h"
 
 #include <time.h>
 #include <signal.h>
@@ -1399,7 +1400,7 @@ dictType zsetDictType = {
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
-    NULL,                      /* Note: SDS string shared & freed by skiplist */
+    NULL,                      /* Note: SDS string shared & freed by skiplist or btree */
     NULL,                      /* val destructor */
     NULL                       /* allow to expand */
 };
@@ -1410,9 +1411,12 @@ dictType dbDictType = {
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
+    NULL,                       /* key destructor: embedded in the entry */
     dictObjectDestructor,       /* val destructor */
-    dictExpandAllowed           /* allow to expand */
+    dictExpandAllowed,          /* allow to expand */
+    1,                          /* segmented */
+    0,                          /* open addressing, see keyspace-open-addressing */
+    dbEntryCreate               /* entry create, embeds the key */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -1434,7 +1438,8 @@ dictType dbExpiresDictType = {
     dictSdsKeyCompare,          /* key compare */
     NULL,                       /* key destructor */
     NULL,                       /* val destructor */
-    dictExpandAllowed           /* allow to expand */
+    dictExpandAllowed,          /* allow to expand */
+    1                           /* segmented */
 };
 
 /* Command table. sds string -> command struct pointer. */
@@ -1448,7 +1453,7 @@ dictType commandTableDictType = {
     NULL                        /* allow to expand */
 };
 
-/* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Hash type hash table (note that small hashes are represented with listpacks) */
 dictType hashDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
@@ -1607,9 +1612,10 @@ const char *strChildType(int type) {
 }
 
 /* Return true if there are active children processes doing RDB saving,
- * AOF rewriting, or some side process spawned by a loaded module. */
+ * AOF rewriting, or some side process spawned by a loaded module. A forkless
+ * BGSAVE in progress counts as well, as it excludes the same operations. */
 int hasActiveChildProcess() {
-    return server.child_pid != -1;
+    return server.child_pid != -1 || server.snapshot_in_progress;
 }
 
 void resetChildState() {
@@ -1678,8 +1684,9 @@ int clientsCronResizeQueryBuffer(client *c) {
 
     /* There are two conditions to resize the query buffer:
      * 1) Query buffer is > BIG_ARG and too big for latest peak.
-     * 2) Query buffer is > BIG_ARG and client is idle. */
-    if (querybuf_size > PROTO_MBULK_BIG_ARG &&
+     * 2) Query buffer is > BIG_ARG and client is idle.
+     * The buffer can't be moved while arguments are views into it. */
+    if (!c->qbuf_chunk && querybuf_size > PROTO_MBULK_BIG_ARG &&
          ((querybuf_size/(c->querybuf_peak+1)) > 2 ||
           idletime > 2))
     {
@@ -1748,7 +1755,9 @@ int clientsCronTrackExpansiveClients(client *c, int time_idx) {
 int clientsCronTrackClientsMemUsage(client *c) {
     size_t mem = 0;
     int type = getClientType(c);
-    mem += getClientOutputBufferMemoryUsage(c);
+    /* The replication buffer shared by the replicas is accounted only once,
+     * see getMemoryOverheadData(). */
+    mem += getClientOutputBufferMemoryUsage(c)-getClientReplBufferMemoryUsage(c);
     mem += sdsZmallocSize(c->querybuf);
     mem += zmalloc_size(c);
     mem += c->argv_len_sum;
@@ -1971,7 +1980,7 @@ void checkChildrenDone(void) {
             if (!bysignal && exitcode == 0) receiveChildInfo();
             resetChildState();
         } else {
-            if (!ldbRemoveChild(pid)) {
+            if (!shardReapChild(pid,exitcode,bysignal) && !ldbRemoveChild(pid)) {
                 serverLog(LL_WARNING,
                           "Warning, detected child with unmatched pid: %ld",
                           (long) pid);
@@ -2134,6 +2143,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+    /* Check if some of the other shards exited. */
+    if (server.shards > 1) shardsCron();
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (!hasActiveChildProcess() &&
@@ -2146,7 +2158,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     if (hasActiveChildProcess() || ldbPendingChildren())
     {
         run_with_period(1000) receiveChildInfo();
-        checkChildrenDone();
+        /* A forkless BGSAVE has no child to wait for. */
+        if (server.child_pid != -1 || ldbPendingChildren())
+            checkChildrenDone();
     } else {
         /* If there is not a background saving/rewrite in progress check if
          * we have to save/rewrite now. */
@@ -2167,7 +2181,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                     sp->changes, (int)sp->seconds);
                 rdbSaveInfo rsi, *rsiptr;
                 rsiptr = rdbPopulateSaveInfo(&rsi);
-                rdbSaveBackground(server.rdb_filename,rsiptr);
+                rdbSaveBackgroundSnapshot(server.rdb_filename,rsiptr);
                 break;
             }
         }
@@ -2194,16 +2208,22 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
     /* AOF postponed flush: Try at every cron cycle if the slow fsync
      * completed. */
-    if (server.aof_state == AOF_ON && server.aof_flush_postponed_start)
+    if ((server.aof_state == AOF_ON || server.aof_state == AOF_WAIT_REWRITE) &&
+        server.aof_flush_postponed_start)
+    {
         flushAppendOnlyFile(0);
+    }
 
     /* AOF write errors: in this case we have a buffer to flush as well and
      * clear the AOF error in case of success to make the DB writable again,
      * however to try every second is enough in case of 'hz' is set to
      * a higher frequency. */
     run_with_period(1000) {
-        if (server.aof_state == AOF_ON && server.aof_last_write_status == C_ERR)
+        if ((server.aof_state == AOF_ON || server.aof_state == AOF_WAIT_REWRITE) &&
+            server.aof_last_write_status == C_ERR)
+        {
             flushAppendOnlyFile(0);
+        }
     }
 
     /* Clear the paused clients state if needed. */
@@ -2233,7 +2253,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         migrateCloseTimedoutSockets();
     }
 
-    /* Stop the I/O threads if we don't have enough pending work. */
+    /* Update the load of the I/O threads, resizing the set of active ones
+     * if needed, and stop them if we don't have enough pending work. */
+    run_with_period(100) ioThreadsCron();
     stopThreadedIOIfNeeded();
 
     /* Resize tracking keys table if needed. This is also done at every
@@ -2256,7 +2278,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     {
         rdbSaveInfo rsi, *rsiptr;
         rsiptr = rdbPopulateSaveInfo(&rsi);
-        if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK)
+        if (rdbSaveBackgroundSnapshot(server.rdb_filename,rsiptr) == C_OK)
             server.rdb_bgsave_scheduled = 0;
     }
 
@@ -2399,6 +2421,10 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (listLength(server.clients_waiting_acks))
         processClientsWaitingReplicas();
 
+    /* Unblock the clients in durable mode whose writes were fsynced. */
+    if (listLength(server.clients_waiting_aof))
+        processClientsWaitingAofFsync();
+
     /* Check if there are clients unblocked by modules that implement
      * blocking commands. */
     if (moduleCount()) moduleHandleBlockedClients();
@@ -2435,10 +2461,14 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * client side caching protocol in broadcasting (BCAST) mode. */
     trackingBroadcastInvalidationMessages();
 
-    /* Write the AOF buffer on disk */
-    if (server.aof_state == AOF_ON)
+    /* Write the AOF buffer on disk, which while waiting for the first
+     * rewrite goes to the temporary incr file. */
+    if (server.aof_state == AOF_ON || server.aof_state == AOF_WAIT_REWRITE)
         flushAppendOnlyFile(0);
 
+    /* Send the commands forwarded to the other shards. */
+    if (server.shards > 1) shardsBeforeSleep();
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWritesUsingThreads();
 
@@ -2658,6 +2688,11 @@ void initServerConfig(void) {
     server.logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
     server.aof_state = AOF_OFF;
     server.aof_rewrite_base_size = 0;
+    server.aof_last_incr_size = 0;
+    server.aof_written_offset = 0;
+    server.aof_fsync_queued_offset = 0;
+    atomicSet(server.aof_fsynced_offset,0);
+    server.aof_manifest = NULL;
     server.aof_rewrite_scheduled = 0;
     server.aof_flush_sleep = 0;
     server.aof_last_fsync = time(NULL);
@@ -2679,6 +2714,9 @@ void initServerConfig(void) {
     server.cluster_configfile = zstrdup(CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     server.cluster_module_flags = CLUSTER_MODULE_FLAG_NONE;
     server.migrate_cached_sockets = dictCreate(&migrateCacheDictType,NULL);
+    server.shard_id = 0;
+    server.shard_pids = NULL;
+    server.shard_links = NULL;
     server.next_client_id = 1; /* Client IDs, start from 1 .*/
     server.loading_process_events_interval_bytes = (1024*1024*2);
 
@@ -2701,6 +2739,8 @@ void initServerConfig(void) {
     server.repl_transfer_tmpfile = NULL;
     server.repl_transfer_fd = -1;
     server.repl_transfer_s = NULL;
+    server.repl_transfer_streams = 1;
+    server.repl_transfer_client_id = 0;
     server.repl_syncio_timeout = CONFIG_REPL_SYNCIO_TIMEOUT;
     server.repl_down_since = 0; /* Never connected, repl is down since EVER. */
     server.master_repl_offset = 0;
@@ -2708,8 +2748,8 @@ void initServerConfig(void) {
     /* Replication partial resync backlog */
     server.repl_backlog = NULL;
     server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
     server.repl_backlog_off = 0;
+    server.repl_buffer_mem = 0;
     server.repl_no_slaves_since = time(NULL);
 
     /* Failover related */
@@ -3056,10 +3096,16 @@ int listenToPort(int port, socketFds *sfd) {
         if (optional) addr++;
         if (strchr(addr,':')) {
             /* Bind IPv6 address. */
-            sfd->fd[sfd->count] = anetTcp6Server(server.neterr,port,addr,server.tcp_backlog);
+            if (server.shards > 1)
+                sfd->fd[sfd->count] = anetTcp6ReusePortServer(server.neterr,port,addr,server.tcp_backlog);
+            else
+                sfd->fd[sfd->count] = anetTcp6Server(server.neterr,port,addr,server.tcp_backlog);
         } else {
             /* Bind IPv4 address. */
-            sfd->fd[sfd->count] = anetTcpServer(server.neterr,port,addr,server.tcp_backlog);
+            if (server.shards > 1)
+                sfd->fd[sfd->count] = anetTcpReusePortServer(server.neterr,port,addr,server.tcp_backlog);
+            else
+                sfd->fd[sfd->count] = anetTcpServer(server.neterr,port,addr,server.tcp_backlog);
         }
         if (sfd->fd[sfd->count] == ANET_ERR) {
             int net_errno = errno;
@@ -3096,6 +3142,8 @@ void resetServerStats(void) {
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_expire_cycle_time_used = 0;
+    server.stat_expire_reclaim_lag_sum = 0;
+    server.stat_expire_reclaim_lag_max = 0;
     server.stat_evictedkeys = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
@@ -3114,7 +3162,12 @@ void resetServerStats(void) {
     server.stat_io_reads_processed = 0;
     atomicSet(server.stat_total_reads_processed, 0);
     server.stat_io_writes_processed = 0;
+    server.stat_io_commands_processed = 0;
+    server.stat_shard_forwarded_commands = 0;
+    server.stat_reply_zerocopy_bytes = 0;
+    atomicSet(server.stat_query_zerocopy_bytes, 0);
     atomicSet(server.stat_total_writes_processed, 0);
+    resetIOThreadsStats();
     for (j = 0; j < STATS_METRIC_COUNT; j++) {
         server.inst_metric[j].idx = 0;
         server.inst_metric[j].last_sample_time = mstime();
@@ -3126,7 +3179,7 @@ void resetServerStats(void) {
     atomicSet(server.stat_net_output_bytes, 0);
     server.stat_unexpected_error_replies = 0;
     server.stat_total_error_replies = 0;
-    server.stat_dump_payload_sanitizations = 0;
+    atomicSet(server.stat_dump_payload_sanitizations, 0);
     server.aof_delayed_fsync = 0;
 }
 
@@ -3151,6 +3204,18 @@ void initServer(void) {
             server.syslog_facility);
     }
 
+    if (server.rdb_compression_dictionary) {
+        char err[256];
+        if (compressLoadDictionary(server.rdb_compression_dictionary,
+                                   err,sizeof(err)) == -1)
+        {
+            serverLog(LL_WARNING,
+                "Failed loading the compression dictionary: %s", err);
+            exit(1);
+        }
+    }
+    quicklistSetCompressCodec(server.list_compress_algorithm);
+
     /* Initialization after setting defaults from the config system. */
     server.aof_state = server.aof_enabled ? AOF_ON : AOF_OFF;
     server.hz = server.config_hz;
@@ -3164,6 +3229,8 @@ void initServer(void) {
     server.clients_index = raxNew();
     server.clients_to_close = listCreate();
     server.slaves = listCreate();
+    server.repl_buffer_blocks = listCreate();
+    listSetFreeMethod(server.repl_buffer_blocks,zfree);
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
     server.clients_pending_read = listCreate();
@@ -3173,6 +3240,7 @@ void initServer(void) {
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
+    server.clients_waiting_aof = listCreate();
     server.get_ack_from_slaves = 0;
     server.client_pause_type = 0;
     server.paused_clients = listCreate();
@@ -3231,10 +3299,15 @@ void initServer(void) {
         exit(1);
     }
 
-    /* Create the Redis databases, and initialize other internal state. */
+    /* Create the Redis databases, and initialize other internal state.
+     * The layout of the keyspace tables is selected once for all the dbs
+     * created from now on (including the temporary ones). */
+    dbDictType.openAddressing = server.keyspace_open_addressing;
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType,NULL);
         server.db[j].expires = dictCreate(&dbExpiresDictType,NULL);
+        server.db[j].expires_index =
+            server.active_expire_index ? raxNew() : NULL;
         server.db[j].expires_cursor = 0;
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
@@ -3255,16 +3328,13 @@ void initServer(void) {
     server.child_pid = -1;
     server.child_type = CHILD_TYPE_NONE;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
-    server.rdb_pipe_conns = NULL;
+    server.rdb_pipe_streams = NULL;
+    server.rdb_pipe_numstreams = 0;
     server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
-    server.rdb_pipe_buff = NULL;
-    server.rdb_pipe_bufflen = 0;
     server.rdb_bgsave_scheduled = 0;
     server.child_info_pipe[0] = -1;
     server.child_info_pipe[1] = -1;
     server.child_info_nread = 0;
-    aofRewriteBufferReset();
     server.aof_buf = sdsempty();
     server.lastsave = time(NULL); /* At startup we consider the DB saved. */
     server.lastbgsave_try = 0;    /* At startup we never tried to BGSAVE. */
@@ -3314,6 +3384,9 @@ void initServer(void) {
     if (server.sofd > 0 && aeCreateFileEvent(server.el,server.sofd,AE_READABLE,
         acceptUnixHandler,NULL) == AE_ERR) serverPanic("Unrecoverable error creating server.sofd file event.");
 
+    /* Create the links to the other shards. */
+    if (server.shards > 1) shardsInitLinks();
+
 
     /* Register a readable event for the pipe used to awake the event loop
      * when a blocked client in a module needs attention. */
@@ -3324,22 +3397,29 @@ void initServer(void) {
                 "blocked clients subsystem.");
     }
 
+    /* Create the pipe used by the AOF fsync thread to awake the event loop
+     * when clients in durable mode may be served. As the modules one, it is
+     * a best effort mechanism that should never block. */
+    if (pipe(server.aof_fsync_pipe) == -1) {
+        serverLog(LL_WARNING,"Can't create the pipe for AOF fsync: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,server.aof_fsync_pipe[0]);
+    anetNonBlock(NULL,server.aof_fsync_pipe[1]);
+    anetCloexec(server.aof_fsync_pipe[0]);
+    anetCloexec(server.aof_fsync_pipe[1]);
+    if (aeCreateFileEvent(server.el, server.aof_fsync_pipe[0], AE_READABLE,
+        aofFsyncPipeReadable,NULL) == AE_ERR) {
+            serverPanic("Error registering the readable event for the AOF "
+                        "fsync pipe.");
+    }
+
     /* Register before and after sleep handlers (note this needs to be done
      * before loading persistence since it is used by processEventsWhileBlocked. */
     aeSetBeforeSleepProc(server.el,beforeSleep);
     aeSetAfterSleepProc(server.el,afterSleep);
 
-    /* Open the AOF file if needed. */
-    if (server.aof_state == AOF_ON) {
-        server.aof_fd = open(server.aof_filename,
-                               O_WRONLY|O_APPEND|O_CREAT,0644);
-        if (server.aof_fd == -1) {
-            serverLog(LL_WARNING, "Can't open the append-only file: %s",
-                strerror(errno));
-            exit(1);
-        }
-    }
-
     /* 32 bit instances are limited to 4GB of address space, so if there is
      * no explicit limit in the user provided configuration we set a limit
      * at 3 GB using maxmemory with 'noeviction' policy'. This avoids
@@ -3707,6 +3787,11 @@ void call(client *c, int flags) {
     redisOpArray prev_also_propagate = server.also_propagate;
     redisOpArrayInit(&server.also_propagate);
 
+    /* A forkless BGSAVE must save the keys the command is going to modify
+     * before the change, if it did not reach them yet. */
+    if (server.snapshot_in_progress && (c->cmd->flags & CMD_WRITE))
+        snapshotSaveKeysOfCommand(c);
+
     /* Call the command. */
     dirty = server.dirty;
     prev_err_count = server.stat_total_error_replies;
@@ -4229,6 +4314,14 @@ int processCommand(client *c) {
         return C_OK;       
     }
 
+    /* When the server is sharded, the commands using keys of another shard
+     * are forwarded to it, and the ones about the whole keyspace are sent to
+     * all the shards. This is done once all the checks above passed, since
+     * this shard executes the latter itself. */
+    if (server.shards > 1 &&
+        !(c->flags & CLIENT_MASTER) &&
+        shardRouteCommand(c)) return C_OK;
+
     /* Exec the command */
     if (c->flags & CLIENT_MULTI &&
         c->cmd->proc != execCommand && c->cmd->proc != discardCommand &&
@@ -4238,15 +4331,131 @@ int processCommand(client *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
+        long long aof_offset = server.aof_written_offset;
         call(c,CMD_CALL_FULL);
         c->woff = server.master_repl_offset;
         if (listLength(server.ready_keys))
             handleClientsBlockedOnKeys();
+        /* In durable mode the reply is held until the fsync of what the
+         * command wrote to the AOF. */
+        if (c->flags & CLIENT_DURABLE && !(c->flags & CLIENT_BLOCKED) &&
+            server.aof_written_offset != aof_offset)
+            blockForAofFsync(c);
     }
 
     return C_OK;
 }
 
+/* Return 1 if the IO threads are allowed to execute commands during the
+ * next threaded read, see processCommandInIOThread(). Here we check the
+ * global conditions under which processCommand() may do anything else
+ * than just calling the command implementation of a read only command. */
+int ioThreadsCanExecuteCommands(void) {
+    return !server.cluster_enabled &&
+           !server.loading &&
+           !server.lua_timedout &&
+           server.client_pause_type != CLIENT_PAUSE_ALL &&
+           !(server.masterhost && server.repl_state != REPL_STATE_CONNECTED &&
+             server.repl_serve_stale_data == 0) &&
+           !moduleHasCommandFilters() &&
+           !dictIsRehashing(server.commands);
+}
+
+/* When io-threads-do-commands is enabled, this function is called by the IO
+ * thread that just parsed a command for the client 'c', in order to try to
+ * execute it right away. While the IO threads run, the main thread just waits
+ * for them, so the data set can't change: this way read only commands are
+ * served in parallel, all observing the same read-consistent view of the
+ * keyspace, while writes are still serialized by the main thread.
+ *
+ * Only fast read only commands are executed this way, and only when all the
+ * checks processCommand() performs are known to pass and the command can't
+ * modify the global state as a side effect: all its keys must exist and not
+ * be logically expired, and the database must not be rehashing. In all the
+ * other cases the command is left to the main thread as usual.
+ *
+ * The part of call() updating the global state (stats, slowlog, MONITOR,
+ * client side caching) is performed later by the main thread, see
+ * ioThreadCommandProcessed().
+ *
+ * Returns C_OK if the command was executed, otherwise C_ERR. */
+int processCommandInIOThread(client *c) {
+    struct redisCommand *cmd;
+    redisDb *db = c->db;
+    int acl_errpos, j, numkeys;
+
+    if (c->flags & (CLIENT_MULTI|CLIENT_PUBSUB|CLIENT_MASTER|CLIENT_SLAVE) ||
+        authRequired(c)) return C_ERR;
+
+    cmd = lookupCommand(c->argv[0]->ptr);
+    if (!cmd ||
+        (cmd->flags & (CMD_READONLY|CMD_FAST)) != (CMD_READONLY|CMD_FAST) ||
+        cmd->flags & (CMD_MODULE|CMD_MAY_REPLICATE) ||
+        cmdHasMovableKeys(cmd) ||
+        (cmd->arity > 0 && cmd->arity != c->argc) ||
+        (c->argc < -cmd->arity)) return C_ERR;
+
+    /* Lookups must not expire keys, rehash the tables, nor fire keyspace
+     * notifications for missing keys. */
+    if (dictIsRehashing(db->dict) || dictIsRehashing(db->expires)) return C_ERR;
+    getKeysResult result = GETKEYS_RESULT_INIT;
+    numkeys = getKeysFromCommand(cmd,c->argv,c->argc,&result);
+    for (j = 0; j < numkeys; j++) {
+        robj *key = c->argv[result.keys[j]];
+        if (dictFind(db->dict,key->ptr) == NULL || keyIsExpired(db,key)) break;
+        if (server.shards > 1 && getShardByKey(key->ptr) != server.shard_id) break;
+    }
+    getKeysFreeResult(&result);
+    if (j != numkeys) return C_ERR;
+
+    /* ACL failures are logged, so they are handled by the main thread. */
+    c->cmd = cmd;
+    if (ACLCheckAllPerm(c,&acl_errpos) != ACL_OK) return C_ERR;
+
+    long long errors = io_thread_stats->error_replies;
+    monotime call_timer;
+    c->lastcmd = cmd;
+    elapsedStart(&call_timer);
+    c->cmd->proc(c);
+    c->duration = elapsedUs(call_timer);
+    c->flags |= CLIENT_IO_COMMAND_EXECUTED;
+    if (io_thread_stats->error_replies != errors)
+        c->flags |= CLIENT_IO_COMMAND_FAILED;
+    return C_OK;
+}
+
+/* Called by the main thread for a client whose pending command was already
+ * executed by an IO thread (see processCommandInIOThread()), to perform
+ * what call() would have done after calling the command implementation.
+ * The latency monitor is not fed since the command did not run in the
+ * main thread. */
+void ioThreadCommandProcessed(client *c) {
+    struct redisCommand *real_cmd = c->cmd;
+    client *old_client = server.current_client;
+    server.current_client = c;
+
+    if (c->flags & CLIENT_IO_COMMAND_FAILED) real_cmd->failed_calls++;
+    c->flags &= ~(CLIENT_IO_COMMAND_EXECUTED|CLIENT_IO_COMMAND_FAILED);
+
+    slowlogPushCurrentCommand(c, real_cmd, c->duration);
+    if (!(real_cmd->flags & (CMD_SKIP_MONITOR|CMD_ADMIN)))
+        replicationFeedMonitors(c,server.monitors,c->db->id,c->argv,c->argc);
+    real_cmd->microseconds += c->duration;
+    real_cmd->calls++;
+
+    if (c->flags & CLIENT_TRACKING && !(c->flags & CLIENT_TRACKING_BCAST))
+        trackingRememberKeys(c);
+
+    server.stat_numcommands++;
+    server.stat_io_commands_processed++;
+    c->woff = server.master_repl_offset;
+
+    size_t zmalloc_used = zmalloc_used_memory();
+    if (zmalloc_used > server.stat_peak_memory)
+        server.stat_peak_memory = zmalloc_used;
+    server.current_client = old_client;
+}
+
 /* ====================== Error lookup and execution ===================== */
 
 void incrementErrorCount(const char *fullerr, size_t namelen) {
@@ -4261,16 +4470,28 @@ void incrementErrorCount(const char *fullerr, size_t namelen) {
 
 /*================================== Shutdown =============================== */
 
+/* Close a listening socket. The file event is removed first: with the
+ * io_uring event loop the poll request holds a reference to the socket,
+ * that would keep accepting connections until the ring is destroyed. Not in
+ * fork children, that share the epoll instance of the parent: removing the
+ * socket from it would stop the parent from accepting connections. */
+static void closeListeningSocket(int fd) {
+    if (fd == -1) return;
+    if (server.in_fork_child == CHILD_TYPE_NONE)
+        aeDeleteFileEvent(server.el,fd,AE_READABLE);
+    close(fd);
+}
+
 /* Close listening sockets. Also unlink the unix domain socket if
  * unlink_unix_socket is non-zero. */
 void closeListeningSockets(int unlink_unix_socket) {
     int j;
 
-    for (j = 0; j < server.ipfd.count; j++) close(server.ipfd.fd[j]);
-    for (j = 0; j < server.tlsfd.count; j++) close(server.tlsfd.fd[j]);
-    if (server.sofd != -1) close(server.sofd);
+    for (j = 0; j < server.ipfd.count; j++) closeListeningSocket(server.ipfd.fd[j]);
+    for (j = 0; j < server.tlsfd.count; j++) closeListeningSocket(server.tlsfd.fd[j]);
+    closeListeningSocket(server.sofd);
     if (server.cluster_enabled)
-        for (j = 0; j < server.cfd.count; j++) close(server.cfd.fd[j]);
+        for (j = 0; j < server.cfd.count; j++) closeListeningSocket(server.cfd.fd[j]);
     if (unlink_unix_socket && server.unixsocket) {
         serverLog(LL_NOTICE,"Removing the unix socket file.");
         unlink(server.unixsocket); /* don't care if this fails */
@@ -4312,6 +4533,9 @@ int prepareForShutdown(int flags) {
         rdbRemoveTempFile(server.child_pid, 0);
     }
 
+    /* Same for a forkless BGSAVE. */
+    snapshotAbort("shutting down");
+
     /* Kill module child if there is one. */
     if (server.child_type == CHILD_TYPE_MODULE) {
         serverLog(LL_WARNING,"There is a module fork child. Killing it!");
@@ -4365,8 +4589,11 @@ int prepareForShutdown(int flags) {
     /* Fire the shutdown modules event. */
     moduleFireServerEvent(REDISMODULE_EVENT_SHUTDOWN,0,NULL);
 
+    /* Stop the other shards as well. */
+    shardsShutdown();
+
     /* Remove the pid file if possible and needed. */
-    if (server.daemonize || server.pidfile) {
+    if ((server.daemonize || server.pidfile) && server.shard_id == 0) {
         serverLog(LL_NOTICE,"Removing the pid file.");
         unlink(server.pidfile);
     }
@@ -4689,7 +4916,9 @@ sds genRedisInfoString(const char *section) {
             "lru_clock:%u\r\n"
             "executable:%s\r\n"
             "config_file:%s\r\n"
-            "io_threads_active:%i\r\n",
+            "io_threads_active:%i\r\n"
+            "shards:%i\r\n"
+            "shard_id:%i\r\n",
             REDIS_VERSION,
             redisGitSHA1(),
             strtol(redisGitDirty(),NULL,10) > 0,
@@ -4716,7 +4945,9 @@ sds genRedisInfoString(const char *section) {
             lruclock,
             server.executable ? server.executable : "",
             server.configfile ? server.configfile : "",
-            server.io_threads_active);
+            server.io_threads_active,
+            server.shards,
+            server.shard_id);
     }
 
     /* Clients */
@@ -4812,6 +5043,7 @@ sds genRedisInfoString(const char *section) {
             "mem_replication_backlog:%zu\r\n"
             "mem_clients_slaves:%zu\r\n"
             "mem_clients_normal:%zu\r\n"
+            "mem_total_replication_buffers:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
@@ -4856,6 +5088,7 @@ sds genRedisInfoString(const char *section) {
             mh->repl_backlog,
             mh->clients_slaves,
             mh->clients_normal,
+            server.repl_buffer_mem,
             mh->aof_buffer,
             ZMALLOC_LIB,
             server.active_defrag_running,
@@ -4909,11 +5142,12 @@ sds genRedisInfoString(const char *section) {
             server.stat_current_save_keys_processed,
             server.stat_current_save_keys_total,
             server.dirty,
-            server.child_type == CHILD_TYPE_RDB,
+            server.child_type == CHILD_TYPE_RDB || server.snapshot_in_progress,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.child_type != CHILD_TYPE_RDB) ?
+            (intmax_t)((server.child_type != CHILD_TYPE_RDB &&
+                        !server.snapshot_in_progress) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.stat_rdb_cow_bytes,
             server.aof_state != AOF_OFF,
@@ -4935,14 +5169,12 @@ sds genRedisInfoString(const char *section) {
                 "aof_base_size:%lld\r\n"
                 "aof_pending_rewrite:%d\r\n"
                 "aof_buffer_length:%zu\r\n"
-                "aof_rewrite_buffer_length:%lu\r\n"
                 "aof_pending_bio_fsync:%llu\r\n"
                 "aof_delayed_fsync:%lu\r\n",
                 (long long) server.aof_current_size,
                 (long long) server.aof_rewrite_base_size,
                 server.aof_rewrite_scheduled,
                 sdslen(server.aof_buf),
-                aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
                 server.aof_delayed_fsync);
         }
@@ -4970,6 +5202,8 @@ sds genRedisInfoString(const char *section) {
             } else {
                 eta = (elapsed*remaining_bytes)/(server.loading_loaded_bytes+1);
             }
+            /* Loading rates, averaged since the loading started. */
+            time_t rate_elapsed = elapsed > 0 ? elapsed : 1;
 
             info = sdscatprintf(info,
                 "loading_start_time:%jd\r\n"
@@ -4977,13 +5211,19 @@ sds genRedisInfoString(const char *section) {
                 "loading_rdb_used_mem:%llu\r\n"
                 "loading_loaded_bytes:%llu\r\n"
                 "loading_loaded_perc:%.2f\r\n"
-                "loading_eta_seconds:%jd\r\n",
+                "loading_eta_seconds:%jd\r\n"
+                "loading_loaded_keys:%lld\r\n"
+                "loading_keys_per_sec:%lld\r\n"
+                "loading_bytes_per_sec:%lld\r\n",
                 (intmax_t) server.loading_start_time,
                 (unsigned long long) server.loading_total_bytes,
                 (unsigned long long) server.loading_rdb_used_mem,
                 (unsigned long long) server.loading_loaded_bytes,
                 perc,
-                (intmax_t)eta
+                (intmax_t)eta,
+                server.loading_loaded_keys,
+                server.loading_loaded_keys/(long long)rate_elapsed,
+                (long long)server.loading_loaded_bytes/(long long)rate_elapsed
             );
         }
     }
@@ -4992,10 +5232,23 @@ sds genRedisInfoString(const char *section) {
     if (allsections || defsections || !strcasecmp(section,"stats")) {
         long long stat_total_reads_processed, stat_total_writes_processed;
         long long stat_net_input_bytes, stat_net_output_bytes;
+        long long stat_query_zerocopy_bytes, stat_dump_payload_sanitizations;
         atomicGet(server.stat_total_reads_processed, stat_total_reads_processed);
+        atomicGet(server.stat_query_zerocopy_bytes, stat_query_zerocopy_bytes);
         atomicGet(server.stat_total_writes_processed, stat_total_writes_processed);
         atomicGet(server.stat_net_input_bytes, stat_net_input_bytes);
         atomicGet(server.stat_net_output_bytes, stat_net_output_bytes);
+        atomicGet(server.stat_dump_payload_sanitizations,
+                  stat_dump_payload_sanitizations);
+
+        /* With the expires index we also know how late the oldest expired
+         * key not yet reclaimed is. */
+        long long now = mstime(), expire_pending = 0;
+        for (j = 0; j < server.dbnum; j++) {
+            long long first = expiresIndexFirst(server.db+j);
+            if (first != -1 && now-first > expire_pending)
+                expire_pending = now-first;
+        }
 
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
@@ -5015,6 +5268,9 @@ sds genRedisInfoString(const char *section) {
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
             "expire_cycle_cpu_milliseconds:%lld\r\n"
+            "expire_reclaim_lag_avg_ms:%lld\r\n"
+            "expire_reclaim_lag_max_ms:%lld\r\n"
+            "expire_reclaim_pending_ms:%lld\r\n"
             "evicted_keys:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
@@ -5037,7 +5293,11 @@ sds genRedisInfoString(const char *section) {
             "total_reads_processed:%lld\r\n"
             "total_writes_processed:%lld\r\n"
             "io_threaded_reads_processed:%lld\r\n"
-            "io_threaded_writes_processed:%lld\r\n",
+            "io_threaded_writes_processed:%lld\r\n"
+            "io_threaded_commands_processed:%lld\r\n"
+            "reply_zerocopy_bytes:%lld\r\n"
+            "query_zerocopy_bytes:%lld\r\n"
+            "shard_forwarded_commands:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -5053,6 +5313,10 @@ sds genRedisInfoString(const char *section) {
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_expire_cycle_time_used/1000,
+            server.stat_expiredkeys ?
+                server.stat_expire_reclaim_lag_sum/server.stat_expiredkeys : 0,
+            server.stat_expire_reclaim_lag_max,
+            expire_pending,
             server.stat_evictedkeys,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
@@ -5071,11 +5335,15 @@ sds genRedisInfoString(const char *section) {
             (unsigned long long) trackingGetTotalPrefixes(),
             server.stat_unexpected_error_replies,
             server.stat_total_error_replies,
-            server.stat_dump_payload_sanitizations,
+            stat_dump_payload_sanitizations,
             stat_total_reads_processed,
             stat_total_writes_processed,
             server.stat_io_reads_processed,
-            server.stat_io_writes_processed);
+            server.stat_io_writes_processed,
+            server.stat_io_commands_processed,
+            server.stat_reply_zerocopy_bytes,
+            stat_query_zerocopy_bytes,
+            server.stat_shard_forwarded_commands);
     }
 
     /* Replication */
@@ -5254,6 +5522,13 @@ sds genRedisInfoString(const char *section) {
 #endif  /* RUSAGE_THREAD */
     }
 
+    /* Threads */
+    if (allsections || defsections || !strcasecmp(section,"threads")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,"# Threads\r\n");
+        info = genIOThreadsInfoString(info);
+    }
+
     /* Modules */
     if (allsections || defsections || !strcasecmp(section,"modules")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -5926,7 +6201,7 @@ int checkForSentinelMode(int argc, char **argv) {
 void loadDataFromDisk(void) {
     long long start = ustime();
     if (server.aof_state == AOF_ON) {
-        if (loadAppendOnlyFile(server.aof_filename) == C_OK)
+        if (loadAppendOnlyFiles(server.aof_manifest) == C_OK)
             serverLog(LL_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
     } else {
         rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
@@ -5935,25 +6210,49 @@ void loadDataFromDisk(void) {
             serverLog(LL_NOTICE,"DB loaded from disk: %.3f seconds",
                 (float)(ustime()-start)/1000000);
 
-            /* Restore the replication ID / offset from the RDB file. */
-            if ((server.masterhost ||
+            int is_slave = server.masterhost ||
                 (server.cluster_enabled &&
-                nodeIsSlave(server.cluster->myself))) &&
-                rsi.repl_id_is_set &&
+                nodeIsSlave(server.cluster->myself));
+            int has_repl_info = rsi.repl_id_is_set &&
                 rsi.repl_offset != -1 &&
                 /* Note that older implementations may save a repl_stream_db
                  * of -1 inside the RDB file in a wrong way, see more
                  * information in function rdbPopulateSaveInfo. */
-                rsi.repl_stream_db != -1)
-            {
+                rsi.repl_stream_db != -1;
+
+            /* Restore the replication ID / offset from the RDB file. */
+            if (is_slave && has_repl_info) {
                 memcpy(server.replid,rsi.repl_id,sizeof(server.replid));
                 server.master_repl_offset = rsi.repl_offset;
+                /* Our own replicas may continue from the saved backlog. */
+                if (server.repl_backlog_persist && rsi.repl_backlog)
+                    loadReplicationBacklog(rsi.repl_backlog->ptr,
+                        sdslen(rsi.repl_backlog->ptr),rsi.repl_offset);
                 /* If we are a slave, create a cached master from this
                  * information, in order to allow partial resynchronizations
                  * with masters. */
                 replicationCacheMasterUsingMyself();
                 selectDb(server.cached_master,rsi.repl_stream_db);
+            } else if (!is_slave && has_repl_info &&
+                       server.repl_backlog_persist && rsi.repl_backlog)
+            {
+                /* A master restarting with the backlog it saved lets its
+                 * replicas PSYNC with it after the restart. The RDB file may
+                 * be older than the last writes of the master, that some
+                 * replicas may have received: the offsets after the saved
+                 * one are going to be assigned to different data, so like
+                 * after a failover the saved ID becomes the secondary one,
+                 * valid up to the saved offset, and a new one is created. */
+                memcpy(server.replid2,rsi.repl_id,sizeof(server.replid));
+                server.second_replid_offset = rsi.repl_offset+1;
+                loadReplicationBacklog(rsi.repl_backlog->ptr,
+                    sdslen(rsi.repl_backlog->ptr),rsi.repl_offset);
+                changeReplicationId();
+                serverLog(LL_NOTICE,
+                    "Replication backlog restored: %lld bytes up to offset %lld",
+                    server.repl_backlog_histlen, server.master_repl_offset);
             }
+            if (rsi.repl_backlog) decrRefCount(rsi.repl_backlog);
         } else if (errno != ENOENT) {
             serverLog(LL_WARNING,"Fatal error loading the DB: %s. Exiting.",strerror(errno));
             exit(1);
@@ -6140,7 +6439,11 @@ struct redisTest {
     {"crc64", crc64Test},
     {"zmalloc", zmalloc_test},
     {"sds", sdsTest},
-    {"dict", dictTest}
+    {"dict", dictTest},
+    {"compress", compressTest},
+    {"zbtree", zbtreeTest},
+    {"roaring", roaringTest},
+    {"listpack", listpackTest}
 };
 redisTestProc *getTestProcByName(const char *name) {
     int numtests = sizeof(redisTests)/sizeof(struct redisTest);
@@ -6327,10 +6630,11 @@ int main(int argc, char **argv) {
     }
 
     readOOMScoreAdj();
+    shardsStart();
     initServer();
-    if (background || server.pidfile) createPidFile();
+    if ((background || server.pidfile) && server.shard_id == 0) createPidFile();
     if (server.set_proc_title) redisSetProcTitle(NULL);
-    redisAsciiArt();
+    if (server.shard_id == 0) redisAsciiArt();
     checkTcpBacklogSettings();
 
     if (!server.sentinel_mode) {
@@ -6359,7 +6663,10 @@ int main(int argc, char **argv) {
         moduleLoadFromQueue();
         ACLLoadUsersAtStartup();
         InitServerLast();
+        aofLoadManifestFromDisk();
         loadDataFromDisk();
+        aofOpenIfNeededOnServerStart();
+        aofDelHistoryFiles();
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
                 serverLog(LL_WARNING,
@@ -73,6 +73,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "quicklist.h"  /* Lists are encoded as linked lists of
                            N-elements flat arrays */
 #include "rax.h"     /* Radix tree */
+#include "zbtree.h"  /* B+tree of sorted set entries */
+#include "roaring.h" /* Roaring bitmaps of integers */
 #include "connection.h" /* Connection abstraction */
 
 #define REDISMODULE_CORE 1
@@ -101,11 +103,11 @@ typedef long long ustime_t; /* microsecond time type. */
 #define OBJ_SHARED_BULKHDR_LEN 32
 #define LOG_MAX_LEN    1024 /* Default maximum length of syslog messages.*/
 #define AOF_REWRITE_ITEMS_PER_CMD 64
-#define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
 #define CONFIG_AUTHPASS_MAX_LEN 512
 #define CONFIG_RUN_ID_SIZE 40
 #define RDB_EOF_MARK_SIZE 40
 #define CONFIG_REPL_BACKLOG_MIN_SIZE (1024*16)          /* 16k */
+#define REPL_BACKLOG_TRIM_BLOCKS_PER_CALL 64 /* Blocks freed per trimming. */
 #define CONFIG_BGSAVE_RETRY_DELAY 5 /* Wait a few secs before trying again. */
 #define CONFIG_DEFAULT_PID_FILE "/var/run/redis.pid"
 #define CONFIG_DEFAULT_CLUSTER_CONFIG_FILE "nodes.conf"
@@ -147,6 +149,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_MBULK_VIEW_ARG    45 /* Smaller args are embedded strings. */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -222,6 +225,11 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define AOF_ON 1              /* AOF is on */
 #define AOF_WAIT_REWRITE 2    /* AOF waits rewrite to start appending */
 
+/* AOF file types, as stored in the manifest. */
+#define AOF_FILE_TYPE_BASE 'b' /* Produced by a rewrite. */
+#define AOF_FILE_TYPE_HIST 'h' /* Replaced by a rewrite, to be deleted. */
+#define AOF_FILE_TYPE_INCR 'i' /* Commands appended after the base. */
+
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a replica */
 #define CLIENT_MASTER (1<<1)  /* This client is a master */
@@ -279,6 +287,17 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
                                            and AOF client */
 #define CLIENT_REPL_RDBONLY (1ULL<<42) /* This client is a replica that only wants
                                           RDB without replication buffer. */
+#define CLIENT_IO_COMMAND_EXECUTED (1ULL<<43) /* The pending command was already
+                                                 executed by an IO thread. */
+#define CLIENT_IO_COMMAND_FAILED (1ULL<<44) /* The command executed by the IO
+                                               thread replied with an error. */
+#define CLIENT_SHARD (1ULL<<45) /* Link receiving the commands forwarded by
+                                   another shard of the server. */
+#define CLIENT_REPL_STREAM (1ULL<<46) /* Additional connection of a replica
+                                         receiving a part of the RDB in a
+                                         multi-stream diskless sync. */
+#define CLIENT_DURABLE (1ULL<<47) /* CLIENT DURABLE ON: the replies to writes
+                                     wait for the AOF fsync. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -289,7 +308,9 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
 #define BLOCKED_PAUSE 6   /* Blocked by CLIENT PAUSE */
-#define BLOCKED_NUM 7     /* Number of blocked states. */
+#define BLOCKED_SHARD 7   /* Waiting for the reply of another shard. */
+#define BLOCKED_AOF 8     /* Waiting for the AOF fsync (CLIENT DURABLE). */
+#define BLOCKED_NUM 9     /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -347,6 +368,10 @@ typedef enum {
 #define SLAVE_CAPA_NONE 0
 #define SLAVE_CAPA_EOF (1<<0)    /* Can parse the RDB EOF streaming format. */
 #define SLAVE_CAPA_PSYNC2 (1<<1) /* Supports PSYNC2 protocol. */
+#define SLAVE_CAPA_MULTISTREAM (1<<2) /* Can load the RDB from multiple streams. */
+
+/* Max number of streams of a diskless full sync. */
+#define CONFIG_REPL_MAX_STREAMS 16
 
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
@@ -659,12 +684,16 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_HT 2      /* Encoded as hash table */
 #define OBJ_ENCODING_ZIPMAP 3  /* Encoded as zipmap */
 #define OBJ_ENCODING_LINKEDLIST 4 /* No longer used: old list encoding. */
-#define OBJ_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
+#define OBJ_ENCODING_ZIPLIST 5 /* No longer used: old hash/zset/list encoding. */
 #define OBJ_ENCODING_INTSET 6  /* Encoded as intset */
 #define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
-#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of listpacks */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_VIEW 11   /* View into a client query buffer */
+#define OBJ_ENCODING_BTREE 12  /* Encoded as B+tree */
+#define OBJ_ENCODING_ROARING 13 /* Encoded as roaring bitmap */
+#define OBJ_ENCODING_LISTPACK 14 /* Encoded as listpack */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -711,15 +740,39 @@ struct evictionPoolEntry; /* Defined in evict.c */
  * which is actually a linked list of blocks like that, that is: client->reply. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *obj;      /* If not NULL the block has no buffer, the payload is the
+                     * string object 'obj' that the block references, see
+                     * _addReplyObjectToList(). */
     char buf[];
 } clientReplyBlock;
 
+/* The replication stream is stored once, in a list of blocks like that
+ * (server.repl_buffer_blocks), shared by the replication backlog and by the
+ * output of all the replicas: every one of them references the first block
+ * it still needs, and the blocks no longer referenced by anybody are freed
+ * from the head of the list, see incrementalTrimReplicationBacklog(). */
+typedef struct replBufBlock {
+    int refcount;           /* Number of backlog and replicas referencing it. */
+    long long id;           /* Sequential block number. */
+    long long repl_offset;  /* Replication offset of the first byte. */
+    size_t size, used;
+    char buf[];
+} replBufBlock;
+
+/* The replication backlog: the tail of the replication stream kept for
+ * partial resynchronizations, repl-backlog-size bytes or a bit more. */
+typedef struct replBacklog {
+    listNode *ref_repl_buf_node; /* First block of the backlog. */
+} replBacklog;
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
+    rax *expires_index;         /* Keys with a timeout ordered by time, or NULL
+                                   if active-expire-index is disabled. */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
@@ -781,6 +834,13 @@ typedef struct blockingState {
     int numreplicas;        /* Number of replicas we are waiting for ACK. */
     long long reploffset;   /* Replication offset to reach. */
 
+    /* BLOCKED_AOF */
+    long long aofoffset;    /* aof_written_offset that must be fsynced. */
+
+    /* BLOCKED_SHARD */
+    struct shardGather *shard_gather; /* Replies of all the shards to combine,
+                                         NULL when relaying a single one. */
+
     /* BLOCKED_MODULE */
     void *module_blocked_handle; /* RedisModuleBlockedClient structure.
                                     which is opaque for the Redis core, only
@@ -857,6 +917,14 @@ typedef struct {
                         ALLCHANNELS is set in the user. */
 } user;
 
+/* A client query buffer referenced by the arguments created as views into
+ * it, see createViewStringObject(). The client holds a reference as well
+ * while the buffer is its current query buffer. */
+typedef struct queryBufChunk {
+    int refcount;
+    sds buf;
+} queryBufChunk;
+
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a linked list. */
 
@@ -872,6 +940,7 @@ typedef struct client {
     robj *name;             /* As set by CLIENT SETNAME. */
     sds querybuf;           /* Buffer we use to accumulate client queries. */
     size_t qb_pos;          /* The position we have read in querybuf. */
+    queryBufChunk *qbuf_chunk; /* Shared querybuf, if some argv are views. */
     sds pending_querybuf;   /* If this client is flagged as master, this buffer
                                represents the yet not applied portion of the
                                replication stream that we are receiving from
@@ -913,6 +982,10 @@ typedef struct client {
     long long psync_initial_offset; /* FULLRESYNC reply offset other slaves
                                        copying this slave output buffer
                                        should use. */
+    int repl_stream;        /* RDB stream index if CLIENT_REPL_STREAM. */
+    listNode *ref_repl_buf_node; /* Replicas: the block of the replication
+                                    buffer being sent, see replBufBlock. */
+    size_t ref_block_pos;   /* Replicas: bytes of that block already sent. */
     char replid[CONFIG_RUN_ID_SIZE+1]; /* Master replication ID (if master). */
     int slave_listening_port; /* As configured with: REPLCONF listening-port */
     char *slave_addr;       /* Optionally given by REPLCONF ip-address */
@@ -1033,9 +1106,13 @@ typedef struct zskiplist {
     int level;
 } zskiplist;
 
+/* Sorted sets not encoded as listpacks map elements to scores with 'dict',
+ * and keep them in order with either a skiplist or a B+tree, according to
+ * the encoding: the other pointer is NULL. */
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
+    zbtree *zbt;
 } zset;
 
 typedef struct clientBufferLimitsConfig {
@@ -1103,6 +1180,26 @@ struct redisMemOverhead {
     } *db;
 };
 
+/* The AOF is made of multiple files in server.aof_dirname: a base file
+ * written by the last rewrite (either RDB or AOF format), followed by the
+ * incremental files the commands were appended to since. The manifest file
+ * lists them, so that a rewrite only has to create a new base and start a
+ * new incremental file, with no need to merge the commands received while
+ * it was in progress. */
+typedef struct {
+    sds file_name;              /* File name, relative to aof_dirname. */
+    long long file_seq;         /* Sequence number of the file. */
+    char file_type;             /* One of the AOF_FILE_TYPE_* types. */
+} aofInfo;
+
+typedef struct {
+    aofInfo *base_aof_info;     /* Base file, or NULL if none. */
+    list *incr_aof_list;        /* Incremental files, in append order. */
+    list *history_aof_list;     /* Files waiting to be deleted. */
+    long long curr_base_file_seq;   /* Sequence of the last base file. */
+    long long curr_incr_file_seq;   /* Sequence of the last incr file. */
+} aofManifest;
+
 /* This structure can be optionally passed to RDB save/load functions in
  * order to implement additional functionalities, by storing and loading
  * metadata to the RDB file.
@@ -1119,9 +1216,24 @@ typedef struct rdbSaveInfo {
     int repl_id_is_set;  /* True if repl_id field is set. */
     char repl_id[CONFIG_RUN_ID_SIZE+1];     /* Replication ID. */
     long long repl_offset;                  /* Replication offset. */
+    robj *repl_backlog;     /* Replication backlog ending at repl_offset. */
 } rdbSaveInfo;
 
-#define RDB_SAVE_INFO_INIT {-1,0,"0000000000000000000000000000000000000000",-1}
+#define RDB_SAVE_INFO_INIT {-1,0,"0000000000000000000000000000000000000000",-1,NULL}
+
+/* In diskless replication, one of the pipes the RDB child writes to, with
+ * the connections of the replicas its content is relayed to. Every replica
+ * has the same slot in the 'conns' array of every stream, and the stream 0
+ * is sent over the replica connection itself. */
+typedef struct rdbPipeStream {
+    int fd;                 /* Read end of the pipe, -1 after EOF. */
+    connection **conns;     /* Target connection of every replica slot. */
+    char *waiting;          /* Slots whose connection is not attached yet. */
+    int numconns_waiting;   /* Number of slots flagged in 'waiting'. */
+    int numconns_writing;   /* Number of conns with pending writes. */
+    char *buff;             /* Holds the data read from the pipe. */
+    int bufflen;
+} rdbPipeStream;
 
 struct malloc_stats {
     size_t zmalloc_used;
@@ -1206,6 +1318,7 @@ struct redisServer {
     redisAtomic unsigned int lruclock; /* Clock for LRU eviction */
     volatile sig_atomic_t shutdown_asap; /* SHUTDOWN needed ASAP */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    int keyspace_open_addressing; /* Open addressing tables for db->dict? */
     int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *pidfile;              /* PID file path */
     int arch_bits;              /* 32 or 64 depending on sizeof(long) */
@@ -1262,7 +1375,10 @@ struct redisServer {
                                    queries. Will still serve RESP2 queries. */
     int io_threads_num;         /* Number of IO threads to use. */
     int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int io_threads_do_commands; /* Execute read only commands from IO threads? */
     int io_threads_active;      /* Is IO threads currently active? */
+    int io_threads_active_num;  /* Number of IO threads serving clients. */
+    int io_threads_adaptive;    /* Size io_threads_active_num after the load? */
     long long events_processed_while_blocked; /* processEventsWhileBlocked() */
 
     /* RDB / AOF loading information */
@@ -1270,6 +1386,7 @@ struct redisServer {
     off_t loading_total_bytes;
     off_t loading_rdb_used_mem;
     off_t loading_loaded_bytes;
+    long long loading_loaded_keys;
     time_t loading_start_time;
     off_t loading_process_events_interval_bytes;
     /* Fast pointers to often looked up command */
@@ -1286,6 +1403,9 @@ struct redisServer {
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
+    long long stat_expire_reclaim_lag_sum; /* Sum of the ms expired keys were
+                                              reclaimed after their expire. */
+    long long stat_expire_reclaim_lag_max; /* Max reclaim lag in ms. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
@@ -1320,9 +1440,13 @@ struct redisServer {
     uint64_t stat_clients_type_memory[CLIENT_TYPE_COUNT];/* Mem usage by type */
     long long stat_unexpected_error_replies; /* Number of unexpected (aof-loading, replica to master, etc.) error replies */
     long long stat_total_error_replies; /* Total number of issued error replies ( command + rejected errors ) */
-    long long stat_dump_payload_sanitizations; /* Number deep dump payloads integrity validations. */
+    redisAtomic long long stat_dump_payload_sanitizations; /* Number deep dump payloads integrity validations. */
     long long stat_io_reads_processed; /* Number of read events processed by IO / Main threads */
     long long stat_io_writes_processed; /* Number of write events processed by IO / Main threads */
+    long long stat_io_commands_processed; /* Number of commands executed by IO / Main threads */
+    long long stat_reply_zerocopy_bytes; /* Bytes of replies sent by reference to the objects */
+    redisAtomic long long stat_query_zerocopy_bytes; /* Bytes of arguments used from the query buffer */
+    long long stat_shard_forwarded_commands; /* Commands forwarded to other shards */
     redisAtomic long long stat_total_reads_processed; /* Total number of read events processed */
     redisAtomic long long stat_total_writes_processed; /* Total number of write events processed */
     /* The following two are used to track instantaneous metrics, like
@@ -1339,6 +1463,7 @@ struct redisServer {
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
     int active_expire_effort;       /* From 1 (default) to 10, active effort. */
+    int active_expire_index;        /* Reclaim expired keys in time order? */
     int active_defrag_enabled;
     int sanitize_dump_payload;      /* Enables deep sanitization for ziplist and listpack in RDB and RESTORE. */
     int skip_checksum_validation;   /* Disables checksum validateion for RDB and RESTORE payload. */
@@ -1350,6 +1475,7 @@ struct redisServer {
     int active_defrag_cycle_max;       /* maximal effort for defrag in CPU percentage */
     unsigned long active_defrag_max_scan_fields; /* maximum number of fields of set/hash/zset/list to process from within the main dict scan */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
+    size_t reply_zerocopy_threshold; /* Min size of values replied by reference */
     int dbnum;                      /* Total number of configured DBs */
     int supervised;                 /* 1 if supervised, 0 otherwise. */
     int supervised_mode;            /* See SUPERVISED_* */
@@ -1361,16 +1487,25 @@ struct redisServer {
     int aof_enabled;                /* AOF configuration */
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */
     int aof_fsync;                  /* Kind of fsync() policy */
-    char *aof_filename;             /* Name of the AOF file */
+    char *aof_filename;             /* Base name of the AOF files */
+    char *aof_dirname;              /* Name of the AOF directory */
+    aofManifest *aof_manifest;      /* Files the AOF is made of */
     int aof_no_fsync_on_rewrite;    /* Don't fsync if a rewrite is in prog. */
     int aof_rewrite_perc;           /* Rewrite AOF if % growth is > M and... */
     off_t aof_rewrite_min_size;     /* the AOF file is at least N bytes. */
     off_t aof_rewrite_base_size;    /* AOF size on latest startup or rewrite. */
-    off_t aof_current_size;         /* AOF current size. */
+    off_t aof_current_size;         /* AOF current size (base + incr files). */
+    off_t aof_last_incr_size;       /* Size of the incr file being written. */
     off_t aof_fsync_offset;         /* AOF offset which is already synced to disk. */
+    long long aof_written_offset;   /* Bytes ever appended to the AOF buffer. */
+    long long aof_fsync_queued_offset; /* aof_written_offset covered by the
+                                          last fsync started. */
+    redisAtomic long long aof_fsynced_offset; /* aof_written_offset covered
+                                                 by the last fsync done. */
+    int aof_fsync_pipe[2];          /* Pipe used by the fsync thread to awake
+                                       the event loop. */
     int aof_flush_sleep;            /* Micros to sleep before flush. (used by tests) */
     int aof_rewrite_scheduled;      /* Rewrite once BGSAVE terminates. */
-    list *aof_rewrite_buf_blocks;   /* Hold changes during an AOF rewrite. */
     sds aof_buf;      /* AOF buffer, written before entering the event loop */
     int aof_fd;       /* File descriptor of currently selected AOF file */
     int aof_selected_db; /* Currently selected DB in AOF */
@@ -1388,16 +1523,6 @@ struct redisServer {
     int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
     redisAtomic int aof_bio_fsync_status; /* Status of AOF fsync in bio job. */
     redisAtomic int aof_bio_fsync_errno;  /* Errno of AOF fsync in bio job. */
-    /* AOF pipes used to communicate between parent and child during rewrite. */
-    int aof_pipe_write_data_to_child;
-    int aof_pipe_read_data_from_parent;
-    int aof_pipe_write_ack_to_parent;
-    int aof_pipe_read_ack_from_child;
-    int aof_pipe_write_ack_to_child;
-    int aof_pipe_read_ack_from_parent;
-    int aof_stop_sending_diff;     /* If true stop sending accumulated diffs
-                                      to child process. */
-    sds aof_child_diff;             /* AOF diff accumulator child side. */
     /* RDB persistence */
     long long dirty;                /* Changes to DB from the last save */
     long long dirty_before_bgsave;  /* Used to restore dirty on failed BGSAVE */
@@ -1406,6 +1531,15 @@ struct redisServer {
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
     int rdb_checksum;               /* Use RDB checksum? */
+    int rdb_compression_algorithm;  /* COMPRESS_* algorithm of RDB strings. */
+    char *rdb_compression_dictionary; /* zstd dictionary file, or NULL. */
+    int rdb_load_threads;           /* Threads decoding values while loading
+                                       an RDB, 0 to load them inline. */
+    int rdb_save_threads;           /* Threads serializing the keys in the
+                                       saving child, 0 to save them inline. */
+    int bgsave_forkless;            /* BGSAVE without forking, see snapshot.c */
+    int snapshot_in_progress;       /* A forkless snapshot is running. */
+    int snapshot_epoch;             /* Epoch of the current/last snapshot. */
     int rdb_del_sync_files;         /* Remove RDB files used only for SYNC if
                                        the instance does not use persistence. */
     time_t lastsave;                /* Unix time of last successful save */
@@ -1416,14 +1550,10 @@ struct redisServer {
     int rdb_child_type;             /* Type of save by active child. */
     int lastbgsave_status;          /* C_OK or C_ERR */
     int stop_writes_on_bgsave_err;  /* Don't allow writes if can't BGSAVE */
-    int rdb_pipe_read;              /* RDB pipe used to transfer the rdb data */
-                                    /* to the parent process in diskless repl. */
+    rdbPipeStream *rdb_pipe_streams; /* RDB pipes used to transfer the rdb data */
+    int rdb_pipe_numstreams;        /* to the parent process in diskless repl. */
+    int rdb_pipe_numconns;          /* Replicas target of diskless rdb fork child. */
     int rdb_child_exit_pipe;        /* Used by the diskless parent allow child exit. */
-    connection **rdb_pipe_conns;    /* Connections which are currently the */
-    int rdb_pipe_numconns;          /* target of diskless rdb fork child. */
-    int rdb_pipe_numconns_writing;  /* Number of rdb conns with pending writes. */
-    char *rdb_pipe_buff;            /* In diskless replication, this buffer holds data */
-    int rdb_pipe_bufflen;           /* that was read from the the rdb pipe. */
     int rdb_key_save_delay;         /* Delay in microseconds between keys while
                                      * writing the RDB. (for testings). negative
                                      * value means fractions of microsecons (on average). */
@@ -1453,15 +1583,18 @@ struct redisServer {
     long long second_replid_offset; /* Accept offsets up to this for replid2. */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
-    char *repl_backlog;             /* Replication backlog for partial syncs */
-    long long repl_backlog_size;    /* Backlog circular buffer size */
+    replBacklog *repl_backlog;      /* Replication backlog for partial syncs */
+    long long repl_backlog_size;    /* Backlog size */
     long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset,
-                                       that is the next byte will'll write to.*/
     long long repl_backlog_off;     /* Replication "master offset" of first
                                        byte in the replication backlog buffer.*/
+    list *repl_buffer_blocks;       /* Replication buffer blocks shared by
+                                       the backlog and the replicas. */
+    size_t repl_buffer_mem;         /* Memory used by repl_buffer_blocks. */
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
                                        gets released. */
+    int repl_backlog_persist;       /* Save the backlog in the RDB file and
+                                       restore it at startup. */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
                                        Only valid if server.slaves len is 0. */
     int repl_min_slaves_to_write;   /* Min number of slaves to write. */
@@ -1471,6 +1604,7 @@ struct redisServer {
     int repl_diskless_load;         /* Slave parse RDB directly from the socket.
                                      * see REPL_DISKLESS_LOAD_* enum */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    int repl_diskless_sync_streams; /* Streams of a diskless full sync. */
     /* Replication (slave) */
     char *masteruser;               /* AUTH with this user and masterauth with master */
     sds masterauth;                 /* AUTH with this password with master */
@@ -1482,6 +1616,9 @@ struct redisServer {
     int repl_syncio_timeout; /* Timeout for synchronous I/O calls */
     int repl_state;          /* Replication status if the instance is a slave */
     off_t repl_transfer_size; /* Size of RDB to read from master during sync. */
+    int repl_transfer_streams; /* Number of streams the RDB is sent over. */
+    uint64_t repl_transfer_client_id; /* Our client ID in the master, used to
+                                         attach the additional streams. */
     off_t repl_transfer_read; /* Amount of RDB read from master during sync. */
     off_t repl_transfer_last_fsync_off; /* Offset when we fsync-ed last time. */
     connection *repl_transfer_s;     /* Slave -> Master SYNC connection */
@@ -1509,6 +1646,8 @@ struct redisServer {
     unsigned int repl_scriptcache_size; /* Max number of elements. */
     /* Synchronous replication. */
     list *clients_waiting_acks;         /* Clients waiting in WAIT command. */
+    list *clients_waiting_aof;          /* CLIENT DURABLE clients waiting for
+                                           the AOF fsync. */
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
@@ -1538,17 +1677,22 @@ struct redisServer {
     int sort_bypattern;
     int sort_store;
     /* Zip structure config, see redis.conf for more information  */
-    size_t hash_max_ziplist_entries;
-    size_t hash_max_ziplist_value;
+    size_t hash_max_listpack_entries;
+    size_t hash_max_listpack_value;
     size_t set_max_intset_entries;
-    size_t zset_max_ziplist_entries;
-    size_t zset_max_ziplist_value;
+    int set_large_int_encoding; /* OBJ_ENCODING_HT or OBJ_ENCODING_ROARING */
+    size_t set_max_listpack_entries;
+    size_t set_max_listpack_value;
+    size_t zset_max_listpack_entries;
+    size_t zset_max_listpack_value;
+    int zset_large_encoding;    /* OBJ_ENCODING_SKIPLIST or OBJ_ENCODING_BTREE */
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     long long stream_node_max_entries;
     /* List parameters */
-    int list_max_ziplist_size;
+    int list_max_listpack_size;
     int list_compress_depth;
+    int list_compress_algorithm;    /* COMPRESS_* algorithm of list nodes. */
     /* time cache */
     redisAtomic time_t unixtime; /* Unix time sampled every cron cycle. */
     time_t timezone;            /* Cached timezone. As set by tzset(). */
@@ -1585,6 +1729,14 @@ struct redisServer {
     int cluster_allow_reads_when_down; /* Are reads allowed when the cluster
                                         is down? */
     int cluster_config_file_lock_fd;   /* cluster config fd, will be flock */
+    /* Shards */
+    int shards;                 /* Number of shards the server runs, 1 if it
+                                   is not sharded. */
+    int shard_id;               /* Shard served by this process. */
+    pid_t *shard_pids;          /* Processes of the other shards, -1 once
+                                   they exited. Only used by shard 0. */
+    struct shardLink **shard_links; /* Links to forward commands to the other
+                                       shards, NULL for ourself. */
     /* Scripting */
     lua_State *lua; /* The Lua interpreter. We use just one for all clients */
     client *lua_client;   /* The "fake client" to query Redis from Lua */
@@ -1727,6 +1879,9 @@ typedef struct {
     int encoding;
     int ii; /* intset iterator */
     dictIterator *di;
+    roaringIter ri;
+    unsigned char *lpi; /* listpack iterator */
+    sds lpele; /* Copy of the current listpack string element */
 } setTypeIterator;
 
 /* Structure to hold hash iteration abstraction. Note that iteration over
@@ -1793,6 +1948,7 @@ int moduleTryAcquireGIL(void);
 void moduleReleaseGIL(void);
 void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
 void moduleCallCommandFilters(client *c);
+int moduleHasCommandFilters(void);
 void ModuleForkDoneHandler(int exitcode, int bysignal);
 int TerminateModuleForkChild(int child_pid, int wait);
 ssize_t rdbSaveModulesAux(rio *rdb, int when);
@@ -1825,6 +1981,21 @@ int redisCommunicateSystemd(const char *sd_notify_msg);
 void redisSetCpuAffinity(const char *cpulist);
 
 /* networking.c -- Networking and Client related operations */
+
+/* Counters updated by the commands executed from the IO threads, see
+ * processCommandInIOThread(). Every thread has its own instance, that the
+ * main thread merges into the global stats once the threads are idle. */
+typedef struct ioThreadStats {
+    long long keyspace_hits;
+    long long keyspace_misses;
+    long long error_replies;
+    list *errors;               /* Codes (sds) of the error replies emitted. */
+} ioThreadStats;
+
+/* Stats of the calling IO thread, NULL when the main thread is not serving
+ * a slice of the threaded reads. They are merged after every read round. */
+extern __thread ioThreadStats *io_thread_stats;
+
 client *createClient(connection *conn);
 void closeTimedoutClients(void);
 void freeClient(client *c);
@@ -1876,6 +2047,7 @@ void addReplyHelp(client *c, const char **help);
 void addReplySubcommandSyntaxError(client *c);
 void addReplyLoadedModules(client *c);
 void copyClientOutputBuffer(client *dst, client *src);
+int prepareClientToWrite(client *c);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
@@ -1891,6 +2063,7 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval);
 void replaceClientCommandVector(client *c, int argc, robj **argv);
 void redactClientCommandArgument(client *c, int argc);
 unsigned long getClientOutputBufferMemoryUsage(client *c);
+unsigned long getClientReplBufferMemoryUsage(client *c);
 int freeClientsInAsyncFreeQueue(void);
 int closeClientOnOutputBufferLimitReached(client *c, int async);
 int getClientType(client *c);
@@ -1912,13 +2085,21 @@ int handleClientsWithPendingWrites(void);
 int handleClientsWithPendingWritesUsingThreads(void);
 int handleClientsWithPendingReadsUsingThreads(void);
 int stopThreadedIOIfNeeded(void);
+void ioThreadsCron(void);
+void resetIOThreadsStats(void);
+sds genIOThreadsInfoString(sds info);
 int clientHasPendingReplies(client *c);
+void clientInstallWriteHandler(client *c);
 void unlinkClient(client *c);
 int writeToClient(client *c, int handler_installed);
 void linkClient(client *c);
 void protectClient(client *c);
 void unprotectClient(client *c);
 void initThreadedIO(void);
+void ioThreadStatsAddErrorReply(const char *code, size_t len);
+void unshareClientsReplyObjects(void);
+void releaseQueryBufChunk(queryBufChunk *chunk);
+void unshareQueryBuffer(client *c);
 client *lookupClientByID(uint64_t id);
 int authRequired(client *c);
 
@@ -1996,6 +2177,8 @@ robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
+robj *createViewStringObject(sds s, queryBufChunk *chunk);
+void unshareViewStringObject(robj *o);
 robj *tryCreateRawStringObject(const char *ptr, size_t len);
 robj *tryCreateStringObject(const char *ptr, size_t len);
 robj *dupStringObject(const robj *o);
@@ -2008,12 +2191,14 @@ robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongLongForValue(long long value);
 robj *createStringObjectFromLongDouble(long double value, int humanfriendly);
 robj *createQuicklistObject(void);
-robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createRoaringObject(void);
+robj *createSetListpackObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetObjectWithEncoding(int encoding);
+robj *createZsetListpackObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -2033,7 +2218,7 @@ int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
 void trimStringObjectIfNeeded(robj *o);
-#define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR)
+#define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR || objptr->encoding == OBJ_ENCODING_VIEW)
 
 /* Synchronous I/O with timeout */
 ssize_t syncWrite(int fd, char *ptr, ssize_t size, long long timeout);
@@ -2050,6 +2235,7 @@ void replicationStartPendingFork(void);
 void replicationHandleMasterDisconnection(void);
 void replicationCacheMaster(client *c);
 void resizeReplicationBacklog(long long newsize);
+void loadReplicationBacklog(char *buf, size_t len, long long offset);
 void replicationSetMaster(char *ip, int port);
 void replicationUnsetMaster(void);
 void refreshGoodSlavesCount(void);
@@ -2069,10 +2255,14 @@ void changeReplicationId(void);
 void clearReplicationId2(void);
 void chopReplicationBacklog(void);
 void replicationCacheMasterUsingMyself(void);
-void feedReplicationBacklog(void *ptr, size_t len);
+void feedReplicationBuffer(char *buf, size_t len);
+void incrementalTrimReplicationBacklog(size_t max_blocks);
+void releaseReplicaReplBuffer(client *c);
+int prepareReplicasToWrite(void);
 void showLatestBacklog(void);
 void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 void rdbPipeWriteHandlerConnRemoved(struct connection *conn);
+void rdbPipeClientRemoved(client *c);
 void clearFailoverState(void);
 void updateFailoverStatus(void);
 void abortFailover(const char *err);
@@ -2102,14 +2292,18 @@ void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
-int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFiles(aofManifest *am);
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
-void aofRewriteBufferReset(void);
-unsigned long aofRewriteBufferSize(void);
-ssize_t aofReadDiffFromParent(void);
 void killAppendOnlyChild(void);
+void aofLoadManifestFromDisk(void);
+void aofOpenIfNeededOnServerStart(void);
+int aofDelHistoryFiles(void);
+void blockForAofFsync(client *c);
+void unblockClientWaitingAofFsync(client *c);
+void processClientsWaitingAofFsync(void);
+void aofFsyncPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask);
 void restartAOFAfterSYNC();
 
 /* Child info */
@@ -2201,9 +2395,14 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
 unsigned long zsetLength(const robj *zobj);
+int zsetInsertNew(zset *zs, double score, sds ele);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen, size_t totelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen, size_t totelelen);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, double *newscore);
@@ -2211,8 +2410,9 @@ long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 robj *zsetDup(robj *o);
 int zsetZiplistValidateIntegrity(unsigned char *zl, size_t size, int deep);
+int zsetListpackValidateIntegrity(unsigned char *lp, size_t size, int deep);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -2231,6 +2431,9 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
 size_t freeMemoryGetNotCountedMemory();
 int overMaxmemoryAfterAlloc(size_t moremem);
 int processCommand(client *c);
+int processCommandInIOThread(client *c);
+int ioThreadsCanExecuteCommands(void);
+void ioThreadCommandProcessed(client *c);
 int processPendingCommandsAndResetClient(client *c);
 void setupSignalHandlers(void);
 void removeSignalHandlers(void);
@@ -2288,7 +2491,7 @@ robj *activeDefragStringOb(robj* ob, long *defragged);
 int restartServer(int flags, mstime_t delay);
 
 /* Set data type */
-robj *setTypeCreate(sds value);
+robj *setTypeCreate(sds value, size_t size_hint);
 int setTypeAdd(robj *subject, sds value);
 int setTypeRemove(robj *subject, sds value);
 int setTypeIsMember(robj *subject, sds value);
@@ -2296,11 +2499,14 @@ setTypeIterator *setTypeInitIterator(robj *subject);
 void setTypeReleaseIterator(setTypeIterator *si);
 int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele);
 sds setTypeNextObject(setTypeIterator *si);
-int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele);
+int setTypeRandomElement(robj *setobj, char **str, size_t *len, int64_t *llele);
 unsigned long setTypeRandomElements(robj *set, unsigned long count, robj *aux_set);
 unsigned long setTypeSize(const robj *subject);
 void setTypeConvert(robj *subject, int enc);
 robj *setTypeDup(robj *o);
+int setTypeRoaringIsSparse(const roaring *r);
+robj *setTypeFromRoaring(roaring *r);
+int setTypeListpackValidateIntegrity(unsigned char *lp, size_t size, int deep);
 
 /* Hash data type */
 #define HASH_SET_TAKE_FIELD (1<<0)
@@ -2315,10 +2521,10 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll);
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll);
 sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what);
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
 sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
@@ -2327,6 +2533,7 @@ robj *hashTypeGetValueObject(robj *o, sds field);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
 robj *hashTypeDup(robj *o);
 int hashZiplistValidateIntegrity(unsigned char *zl, size_t size, int deep);
+int hashListpackValidateIntegrity(unsigned char *lp, size_t size, int deep);
 
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
@@ -2357,6 +2564,13 @@ int keyIsExpired(redisDb *db, robj *key);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
+dictEntry *dbEntryCreate(void *privdata, const void *key);
+long long dbEntryGetExpire(dictEntry *de);
+int dbEntryGetSnapshotEpoch(dictEntry *de);
+void dbEntrySetSnapshotEpoch(dictEntry *de, int epoch);
+void expiresIndexAdd(redisDb *db, sds key, long long when);
+void expiresIndexDel(redisDb *db, sds key, long long when);
+long long expiresIndexFirst(redisDb *db);
 int checkAlreadyExpired(long long when);
 robj *lookupKey(redisDb *db, robj *key, int flags);
 robj *lookupKeyRead(redisDb *db, robj *key);
@@ -2403,6 +2617,9 @@ unsigned int delKeysInSlot(unsigned int hashslot);
 int verifyClusterConfigWithData(void);
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
+#define SCAN_ROARING_CURSOR (1ULL<<63) /* See roaringScanCursor(). */
+uint64_t roaringScanCursor(int64_t next);
+int64_t roaringScanStart(uint64_t cursor);
 void slotToKeyAdd(sds key);
 void slotToKeyDel(sds key);
 int dbAsyncDelete(redisDb *db, robj *key);
@@ -2439,6 +2656,19 @@ void migrateCloseTimedoutSockets(void);
 void clusterBeforeSleep(void);
 int clusterSendModuleMessageToTarget(const char *target, uint64_t module_id, uint8_t type, unsigned char *payload, uint32_t len);
 
+/* Shards */
+void shardsStart(void);
+void shardsInitLinks(void);
+int getShardByKey(sds key);
+int getShardByQuery(struct redisCommand *cmd, robj **argv, int argc);
+int shardRouteCommand(client *c);
+void shardUnblockClient(client *c);
+void shardsPublish(robj *channel, robj *message);
+void shardsBeforeSleep(void);
+void shardsCron(void);
+int shardReapChild(pid_t pid, int exitcode, int bysignal);
+void shardsShutdown(void);
+
 /* Sentinel */
 void initSentinelConfig(void);
 void initSentinel(void);
@@ -2481,6 +2711,12 @@ void removeClientFromTimeoutTable(client *c);
 void handleBlockedClientsTimeout(void);
 int clientsCronHandleTimeout(client *c, mstime_t now_ms);
 
+/* snapshot.c -- Forkless background saving. */
+int snapshotStart(char *filename, rdbSaveInfo *rsi);
+void snapshotAbort(const char *reason);
+void snapshotSaveKey(redisDb *db, robj *key);
+void snapshotSaveKeysOfCommand(client *c);
+
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
 void expireSlaveKeys(void);
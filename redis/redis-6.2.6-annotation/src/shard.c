@@ -0,0 +1,851 @@
+/* Shared-nothing sharding of a single server.
+ *
+ * When "shards" is greater than one the server runs as N processes, forked
+ * at startup before anything else is initialized, each with its own event
+ * loop, keyspace, persistence files and memory. All of them listen on the
+ * same TCP port using SO_REUSEPORT, so the kernel spreads the connections
+ * among them, and each one owns a contiguous range of the 16384 hash slots
+ * used by Redis Cluster (hash tags work the same way).
+ *
+ * A command about keys owned by another shard is forwarded to it as it is,
+ * and its reply relayed to the client verbatim. While waiting, the client is
+ * blocked (BLOCKED_SHARD), so that the replies of pipelined commands are
+ * still delivered in order. Every shard has a link to every other one,
+ * created with socketpair() before forking: the forwarding side writes
+ * commands to it and parses the replies, the other side serves it as a
+ * normal client flagged with CLIENT_SHARD.
+ *
+ * The commands about the whole keyspace (DBSIZE, KEYS, FLUSHALL, FLUSHDB),
+ * PUBLISH and CONFIG SET are sent to all the shards, and their replies
+ * combined (see shardGatherReply()). Keyspace notifications are published in
+ * every shard as well, so that the Pub/Sub channels span the whole server.
+ * The commands that can't be served this way (SCAN, RANDOMKEY) are rejected
+ * with -CROSSSHARD, like the commands using keys of different shards, while
+ * the other commands without keys (INFO, SAVE, ...) operate on the shard
+ * serving the connection.
+ *
+ * Shard 0 uses the persistence files of a server that is not sharded, and
+ * the other ones add their ID to the file names. Changing the number of
+ * shards is not supported: the server refuses to start when the files found
+ * were written with another layout (see shardsCheckFiles() and the "shards"
+ * AUX field of the RDB files).
+ *
+ * Copyright (c) 2009-2021, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "cluster.h"
+#include "hiredis.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+/* The sending side of the link to another shard. */
+typedef struct shardLink {
+    int shard;              /* Shard at the other end of the link. */
+    int fd;                 /* Socket, -1 once the link is down. */
+    int write_installed;    /* Is the writable handler installed? */
+    int db;                 /* DB selected by the commands sent so far. */
+    int resp;               /* Protocol selected by the commands sent so far. */
+    sds obuf;               /* Commands not yet written. */
+    sds ibuf;               /* Replies not yet relayed. */
+    redisReader *reader;    /* Only used to find where the replies end. */
+    /* Ring of the IDs of the clients waiting for the replies, in the order
+     * of the commands sent, 0 for the replies to discard. */
+    uint64_t *pending;
+    unsigned long pending_first, pending_count, pending_size;
+} shardLink;
+
+/* Replies of all the shards to a command sent to each one of them, see
+ * shardBroadcastCommand(). */
+#define SHARD_GATHER_NONE 0
+#define SHARD_GATHER_SUM 1      /* Sum of the integer replies. */
+#define SHARD_GATHER_OK 2       /* +OK if all the shards replied so. */
+#define SHARD_GATHER_ARRAY 3    /* Concatenation of the arrays replied. */
+
+typedef struct shardGather {
+    int type;               /* SHARD_GATHER_* */
+    int pending;            /* Number of replies still to receive. */
+    long long sum;          /* SHARD_GATHER_SUM: sum so far. */
+    long long count;        /* SHARD_GATHER_ARRAY: elements so far, */
+    sds elements;           /* and their protocol. */
+    sds err;                /* First error replied, NULL if none. */
+} shardGather;
+
+/* Sockets created by shardsStart(): fds[(i*shards+j)*2] is used by shard i
+ * to send commands to shard j, fds[(i*shards+j)*2+1] by shard j to serve
+ * them. */
+static int *shard_fds = NULL;
+
+/* -----------------------------------------------------------------------------
+ * Startup and shutdown
+ * -------------------------------------------------------------------------- */
+
+/* Return the name of the file used by this shard for 'filename', adding the
+ * shard ID before the file name, e.g. dump.rdb -> shard1-dump.rdb. Not used
+ * by shard 0, that keeps the names of a server that is not sharded. */
+static char *shardFilename(const char *filename) {
+    const char *base = strrchr(filename,'/');
+    base = base ? base+1 : filename;
+    sds s = sdsnewlen(filename,base-filename);
+    s = sdscatprintf(s,"shard%d-%s",server.shard_id,base);
+    char *name = zstrdup(s);
+    sdsfree(s);
+    return name;
+}
+
+/* Return the ID of the shard whose persistence files include 'name', or -1
+ * if it is not the file of a shard other than shard 0. */
+static int shardOfFilename(const char *name) {
+    char *end;
+    long id;
+
+    if (strncmp(name,"shard",5) || !isdigit((unsigned char)name[5])) return -1;
+    id = strtol(name+5,&end,10);
+    if (*end != '-' || id <= 0 || id > INT_MAX) return -1;
+    end++;
+    if (strcmp(end,server.rdb_filename) &&
+        strncmp(end,server.aof_filename,strlen(server.aof_filename)))
+        return -1;
+    return id;
+}
+
+/* Exit if the persistence files of a shard that doesn't exist with the
+ * configured number of shards are found: its keys would be lost. The files
+ * of shard 0 written with another number of shards, or without sharding,
+ * are detected when loading them, see rdbLoadRio(). */
+static void shardsCheckFiles(void) {
+    const char *dirs[2] = {".", server.aof_dirname};
+
+    for (int j = 0; j < 2; j++) {
+        DIR *dir = opendir(dirs[j]);
+        struct dirent *de;
+
+        if (dir == NULL) continue;
+        while ((de = readdir(dir)) != NULL) {
+            int id = shardOfFilename(de->d_name);
+            if (id < server.shards) continue;
+            serverLog(LL_WARNING,"Found %s/%s, written by shard %d, but the "
+                "server has %d shards. Changing the number of shards is not "
+                "supported. Exiting.", dirs[j], de->d_name, id, server.shards);
+            exit(1);
+        }
+        closedir(dir);
+    }
+}
+
+/* Called at startup, before initServer(), to fork the processes of the other
+ * shards. The process calling it becomes shard 0. */
+void shardsStart(void) {
+    int n = server.shards, i, j;
+    pid_t parent = getpid();
+
+    shardsCheckFiles();
+    if (n == 1) return;
+#ifndef SO_REUSEPORT
+    serverLog(LL_WARNING,"Sharding requires SO_REUSEPORT, not available on "
+                         "this system. Exiting.");
+    exit(1);
+#endif
+    if (server.cluster_enabled || server.sentinel_mode || server.masterhost) {
+        serverLog(LL_WARNING,"Sharding can't be used with cluster mode, "
+                             "Sentinel, nor replication. Exiting.");
+        exit(1);
+    }
+    if (server.port == 0 && server.tls_port == 0) {
+        serverLog(LL_WARNING,"Sharding requires a TCP port. Exiting.");
+        exit(1);
+    }
+
+    shard_fds = zmalloc(sizeof(int)*n*n*2);
+    for (i = 0; i < n*n*2; i++) shard_fds[i] = -1;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            if (i == j) continue;
+            if (socketpair(AF_UNIX,SOCK_STREAM,0,shard_fds+(i*n+j)*2) == -1) {
+                serverLog(LL_WARNING,"Can't create the links between the "
+                                     "shards: %s. Exiting.", strerror(errno));
+                exit(1);
+            }
+        }
+    }
+
+    server.shard_pids = zmalloc(sizeof(pid_t)*n);
+    server.shard_pids[0] = -1;
+    for (i = 1; i < n; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            serverLog(LL_WARNING,"Can't fork shard %d: %s. Exiting.",
+                i, strerror(errno));
+            exit(1);
+        } else if (pid == 0) {
+            server.shard_id = i;
+            break;
+        }
+        server.shard_pids[i] = pid;
+    }
+
+    if (server.shard_id != 0) {
+#ifdef __linux__
+        /* Don't outlive shard 0 if it crashes. */
+        prctl(PR_SET_PDEATHSIG,SIGTERM);
+#endif
+        if (getppid() != parent) exit(1);
+        zfree(server.shard_pids);
+        server.shard_pids = NULL;
+        /* The unix socket and the pid file belong to shard 0. */
+        zfree(server.unixsocket);
+        server.unixsocket = NULL;
+    }
+
+    /* Close the ends of the links used by the other shards. */
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            int *fds = shard_fds+(i*n+j)*2;
+            if (i == j) continue;
+            if (i != server.shard_id) {
+                close(fds[0]);
+                fds[0] = -1;
+            }
+            if (j != server.shard_id) {
+                close(fds[1]);
+                fds[1] = -1;
+            }
+        }
+    }
+
+    if (server.shard_id != 0) {
+        char *rdb_filename = server.rdb_filename;
+        char *aof_filename = server.aof_filename;
+        server.rdb_filename = shardFilename(rdb_filename);
+        server.aof_filename = shardFilename(aof_filename);
+        zfree(rdb_filename);
+        zfree(aof_filename);
+    }
+
+    serverLog(LL_NOTICE,"Shard %d of %d started, serving slots %d-%d",
+        server.shard_id, n, (CLUSTER_SLOTS*server.shard_id+n-1)/n,
+        (CLUSTER_SLOTS*(server.shard_id+1)+n-1)/n-1);
+}
+
+/* Called by shard 0 when waitpid() returns the 'pid' of a child process.
+ * Returns 1 if it was one of the other shards. */
+int shardReapChild(pid_t pid, int exitcode, int bysignal) {
+    int j;
+
+    if (!server.shard_pids) return 0;
+    for (j = 1; j < server.shards; j++) {
+        if (server.shard_pids[j] != pid) continue;
+        serverLog(LL_WARNING,"Shard %d exited (exit code %d, signal %d)",
+            j, exitcode, bysignal);
+        server.shard_pids[j] = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Called by serverCron() to notice the shards that exited, see
+ * shardReapChild(). The links to a shard that exited are closed as well, so
+ * the forwarded commands that are waiting fail. */
+void shardsCron(void) {
+    int j, statloc;
+
+    if (!server.shard_pids) return;
+    for (j = 1; j < server.shards; j++) {
+        pid_t pid = server.shard_pids[j];
+        if (pid != -1 && waitpid(pid,&statloc,WNOHANG) == pid) {
+            shardReapChild(pid,
+                WIFEXITED(statloc) ? WEXITSTATUS(statloc) : -1,
+                WIFSIGNALED(statloc) ? WTERMSIG(statloc) : 0);
+        }
+    }
+}
+
+/* Called by prepareForShutdown() when the server is about to exit: the
+ * shards are stopped together. Shard 0 asks the other ones to shut down, and
+ * waits for them to save their data, while the other shards just ask shard 0
+ * to shut down, that will then stop the remaining ones. */
+void shardsShutdown(void) {
+    int j;
+
+    if (server.shards == 1) return;
+    if (server.shard_id != 0) {
+        kill(getppid(),SIGTERM);
+        return;
+    }
+    for (j = 1; j < server.shards; j++)
+        if (server.shard_pids[j] != -1) kill(server.shard_pids[j],SIGTERM);
+    for (j = 1; j < server.shards; j++) {
+        if (server.shard_pids[j] == -1) continue;
+        serverLog(LL_NOTICE,"Waiting for shard %d to exit...", j);
+        while (waitpid(server.shard_pids[j],NULL,0) == -1 && errno == EINTR);
+        server.shard_pids[j] = -1;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Links between the shards
+ * -------------------------------------------------------------------------- */
+
+static void shardLinkPushPending(shardLink *link, uint64_t id) {
+    if (link->pending_count == link->pending_size) {
+        unsigned long size = link->pending_size ? link->pending_size*2 : 16;
+        uint64_t *pending = zmalloc(sizeof(uint64_t)*size);
+        for (unsigned long j = 0; j < link->pending_count; j++)
+            pending[j] = link->pending[(link->pending_first+j) %
+                                       link->pending_size];
+        zfree(link->pending);
+        link->pending = pending;
+        link->pending_first = 0;
+        link->pending_size = size;
+    }
+    link->pending[(link->pending_first+link->pending_count) %
+                  link->pending_size] = id;
+    link->pending_count++;
+}
+
+static uint64_t shardLinkPopPending(shardLink *link) {
+    serverAssert(link->pending_count > 0);
+    uint64_t id = link->pending[link->pending_first];
+    link->pending_first = (link->pending_first+1) % link->pending_size;
+    link->pending_count--;
+    return id;
+}
+
+/* Return the client 'id' if it is still waiting for a forwarded command. */
+static client *shardLookupWaitingClient(uint64_t id) {
+    client *c = id ? lookupClientByID(id) : NULL;
+    if (c && c->flags & CLIENT_BLOCKED && c->btype == BLOCKED_SHARD) return c;
+    return NULL;
+}
+
+/* Add the reply 'proto' of one of the shards to the replies gathered for
+ * the client, and send the combined reply once they are all received. */
+static void shardGatherReply(client *c, const char *proto, size_t len) {
+    shardGather *g = c->bpop.shard_gather;
+
+    if (proto[0] == '-') {
+        /* Without the final CRLF. */
+        if (!g->err) g->err = sdsnewlen(proto,len-2);
+    } else if (g->type == SHARD_GATHER_SUM && proto[0] == ':') {
+        g->sum += strtoll(proto+1,NULL,10);
+    } else if (g->type == SHARD_GATHER_ARRAY && proto[0] == '*') {
+        const char *p = strchr(proto,'\r')+2;
+        g->count += strtoll(proto+1,NULL,10);
+        g->elements = sdscatlen(g->elements,p,len-(p-proto));
+    } else if (g->type != SHARD_GATHER_OK || proto[0] != '+') {
+        if (!g->err) g->err = sdsnew("-ERR Unexpected reply of another shard");
+    }
+    if (--g->pending) return;
+
+    if (g->err) {
+        addReplyError(c,g->err);
+    } else if (g->type == SHARD_GATHER_SUM) {
+        addReplyLongLong(c,g->sum);
+    } else if (g->type == SHARD_GATHER_ARRAY) {
+        addReplyArrayLen(c,g->count);
+        addReplyProto(c,g->elements,sdslen(g->elements));
+    } else {
+        addReply(c,shared.ok);
+    }
+    unblockClient(c);
+}
+
+/* Relay the reply 'proto' of another shard to a client waiting for it. */
+static void shardReplyToClient(client *c, const char *proto, size_t len) {
+    if (c->bpop.shard_gather) {
+        shardGatherReply(c,proto,len);
+    } else {
+        addReplyProto(c,proto,len);
+        unblockClient(c);
+    }
+}
+
+/* Called by unblockClient() to free the replies gathered so far, if any. */
+void shardUnblockClient(client *c) {
+    shardGather *g = c->bpop.shard_gather;
+
+    if (!g) return;
+    sdsfree(g->elements);
+    sdsfree(g->err);
+    zfree(g);
+    c->bpop.shard_gather = NULL;
+}
+
+/* Close a link after an I/O error or because the other shard exited: the
+ * clients waiting for its replies get an error, as well as the clients
+ * trying to use it later. */
+static void shardLinkDown(shardLink *link, const char *reason) {
+    serverLog(LL_WARNING,"Link to shard %d is down: %s", link->shard, reason);
+    aeDeleteFileEvent(server.el,link->fd,AE_READABLE|AE_WRITABLE);
+    close(link->fd);
+    link->fd = -1;
+    link->write_installed = 0;
+    sdsclear(link->obuf);
+    sdsclear(link->ibuf);
+    while (link->pending_count) {
+        client *c = shardLookupWaitingClient(shardLinkPopPending(link));
+        if (c) {
+            sds err = sdscatfmt(sdsempty(),"-SHARDDOWN Shard %i is down\r\n",
+                                link->shard);
+            shardReplyToClient(c,err,sdslen(err));
+            sdsfree(err);
+        }
+    }
+}
+
+static void shardLinkWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* Write the buffered commands of a link, installing the writable handler if
+ * the socket can't accept all of them. */
+static void shardLinkWrite(shardLink *link) {
+    ssize_t nwritten = write(link->fd,link->obuf,sdslen(link->obuf));
+
+    if (nwritten == -1) {
+        if (errno != EAGAIN) {
+            shardLinkDown(link,strerror(errno));
+            return;
+        }
+        nwritten = 0;
+    }
+    sdsrange(link->obuf,nwritten,-1);
+    if (sdslen(link->obuf) && !link->write_installed) {
+        aeCreateFileEvent(server.el,link->fd,AE_WRITABLE,
+                          shardLinkWriteHandler,link);
+        link->write_installed = 1;
+    } else if (!sdslen(link->obuf) && link->write_installed) {
+        aeDeleteFileEvent(server.el,link->fd,AE_WRITABLE);
+        link->write_installed = 0;
+    }
+}
+
+static void shardLinkWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+    shardLinkWrite(privdata);
+}
+
+/* Relay the replies received from the other shard to the clients that sent
+ * the commands, and process the rest of their query buffer. The replies are
+ * copied as they are: the link uses the same protocol version of the client
+ * (see shardForwardCommand()). */
+static void shardLinkReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    shardLink *link = privdata;
+    char buf[PROTO_IOBUF_LEN];
+    size_t pos = 0;
+    void *reply;
+    UNUSED(el);
+    UNUSED(mask);
+
+    ssize_t nread = read(fd,buf,sizeof(buf));
+    if (nread <= 0) {
+        if (nread == -1 && errno == EAGAIN) return;
+        shardLinkDown(link,nread ? strerror(errno) : "connection closed");
+        return;
+    }
+    link->ibuf = sdscatlen(link->ibuf,buf,nread);
+    redisReaderFeed(link->reader,buf,nread);
+
+    while (1) {
+        if (redisReaderGetReply(link->reader,&reply) != REDIS_OK) {
+            shardLinkDown(link,link->reader->errstr);
+            return;
+        }
+        if (reply == NULL) break;
+
+        /* The reader has no reply objects to build, so it just tells us
+         * how much of the input is still to be parsed. */
+        size_t end = sdslen(link->ibuf) -
+                     (link->reader->len - link->reader->pos);
+        client *c = shardLookupWaitingClient(shardLinkPopPending(link));
+        if (c) shardReplyToClient(c,link->ibuf+pos,end-pos);
+        pos = end;
+    }
+    sdsrange(link->ibuf,pos,-1);
+}
+
+void shardsInitLinks(void) {
+    int n = server.shards, j;
+
+    server.shard_links = zcalloc(sizeof(shardLink*)*n);
+    for (j = 0; j < n; j++) {
+        if (j == server.shard_id) continue;
+
+        /* The link used to send commands to shard j. */
+        shardLink *link = zcalloc(sizeof(*link));
+        link->shard = j;
+        link->fd = shard_fds[(server.shard_id*n+j)*2];
+        link->resp = 2;
+        link->obuf = sdsempty();
+        link->ibuf = sdsempty();
+        link->reader = redisReaderCreateWithFunctions(NULL);
+        anetNonBlock(NULL,link->fd);
+        anetCloexec(link->fd);
+        if (aeCreateFileEvent(server.el,link->fd,AE_READABLE,
+                              shardLinkReadHandler,link) == AE_ERR)
+        {
+            serverPanic("Unrecoverable error creating a shard link.");
+        }
+        server.shard_links[j] = link;
+
+        /* The client serving the commands of shard j. It never blocks, so
+         * that it serves the commands in order, and it is not subject to
+         * ACLs, since the commands were checked by the shard forwarding
+         * them. */
+        int fd = shard_fds[(j*n+server.shard_id)*2+1];
+        anetCloexec(fd);
+        connection *conn = connCreateAcceptedSocket(fd);
+        client *c = createClient(conn);
+        if (c == NULL || connAccept(conn,NULL) == C_ERR)
+            serverPanic("Unrecoverable error creating a shard link client.");
+        c->flags |= CLIENT_SHARD|CLIENT_DENY_BLOCKING;
+        c->user = NULL;
+        c->authenticated = 1;
+    }
+    zfree(shard_fds);
+    shard_fds = NULL;
+}
+
+/* Called before sleeping to write the commands forwarded in this event loop
+ * iteration, so that pipelined commands are sent together. */
+void shardsBeforeSleep(void) {
+    for (int j = 0; j < server.shards; j++) {
+        shardLink *link = server.shard_links[j];
+        if (link && link->fd != -1 && !link->write_installed &&
+            sdslen(link->obuf)) shardLinkWrite(link);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Commands routing
+ * -------------------------------------------------------------------------- */
+
+int getShardByKey(sds key) {
+    return keyHashSlot(key,sdslen(key)) * server.shards / CLUSTER_SLOTS;
+}
+
+/* Return the shard owning the keys of the command, -1 if the command has no
+ * keys, or -2 if its keys belong to different shards. */
+int getShardByQuery(struct redisCommand *cmd, robj **argv, int argc) {
+    getKeysResult result = GETKEYS_RESULT_INIT;
+    int numkeys = getKeysFromCommand(cmd,argv,argc,&result), shard = -1;
+
+    for (int j = 0; j < numkeys; j++) {
+        int s = getShardByKey(argv[result.keys[j]]->ptr);
+        if (shard == -1) {
+            shard = s;
+        } else if (s != shard) {
+            shard = -2;
+            break;
+        }
+    }
+    getKeysFreeResult(&result);
+    return shard;
+}
+
+/* Return 1 if the command may block the client: the link to the other shard
+ * is shared by all the clients, so it can't wait for them. */
+static int shardCommandMayBlock(client *c) {
+    struct redisCommand *cmd = c->cmd;
+
+    if (cmd->proc == blpopCommand || cmd->proc == brpopCommand ||
+        cmd->proc == brpoplpushCommand || cmd->proc == blmoveCommand ||
+        cmd->proc == bzpopminCommand || cmd->proc == bzpopmaxCommand)
+        return 1;
+    if (cmd->proc == xreadCommand) {
+        for (int j = 1; j < c->argc; j++) {
+            if (!strcasecmp(c->argv[j]->ptr,"streams")) break;
+            if (!strcasecmp(c->argv[j]->ptr,"block")) return 1;
+        }
+    }
+    return 0;
+}
+
+/* Return 1 if the commands executed by scripts and modules on behalf of the
+ * client don't need ACL checks: the shard serving the forwarded command
+ * doesn't know the user of the client. */
+static int shardUserHasFullAccess(user *u) {
+    uint64_t all = USER_FLAG_ALLKEYS|USER_FLAG_ALLCOMMANDS|USER_FLAG_ALLCHANNELS;
+    return u == NULL || (u->flags & all) == all;
+}
+
+static void shardLinkAppendArg(shardLink *link, const char *ptr, size_t len) {
+    link->obuf = sdscatfmt(link->obuf,"$%U\r\n",(unsigned long long)len);
+    link->obuf = sdscatlen(link->obuf,ptr,len);
+    link->obuf = sdscatlen(link->obuf,"\r\n",2);
+}
+
+/* Queue a command with a single integer argument, whose reply is discarded,
+ * to set the state of the link. */
+static void shardLinkAppendSetup(shardLink *link, const char *cmd, long long val) {
+    char buf[LONG_STR_SIZE];
+    int len = ll2string(buf,sizeof(buf),val);
+
+    link->obuf = sdscat(link->obuf,"*2\r\n");
+    shardLinkAppendArg(link,cmd,strlen(cmd));
+    shardLinkAppendArg(link,buf,len);
+    shardLinkPushPending(link,0);
+}
+
+/* Queue the command of 'c' in the output buffer of the link, the reply being
+ * relayed to the client. */
+static void shardLinkAppendCommand(shardLink *link, client *c) {
+    if (link->resp != c->resp) {
+        shardLinkAppendSetup(link,"HELLO",c->resp);
+        link->resp = c->resp;
+    }
+    if (link->db != c->db->id) {
+        shardLinkAppendSetup(link,"SELECT",c->db->id);
+        link->db = c->db->id;
+    }
+
+    link->obuf = sdscatfmt(link->obuf,"*%i\r\n",c->argc);
+    for (int j = 0; j < c->argc; j++) {
+        robj *arg = c->argv[j];
+        if (sdsEncodedObject(arg)) {
+            shardLinkAppendArg(link,arg->ptr,sdslen(arg->ptr));
+        } else {
+            char buf[LONG_STR_SIZE];
+            int len = ll2string(buf,sizeof(buf),(long)arg->ptr);
+            shardLinkAppendArg(link,buf,len);
+        }
+    }
+    shardLinkPushPending(link,c->id);
+    server.stat_shard_forwarded_commands++;
+}
+
+/* Send the command of 'c' to another shard, and block the client until its
+ * reply is received. */
+static void shardForwardCommand(client *c, shardLink *link) {
+    shardLinkAppendCommand(link,c);
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_SHARD);
+}
+
+/* Return how the replies of the shards are combined if the command must be
+ * sent to all of them, or SHARD_GATHER_NONE. */
+static int shardGatherType(client *c) {
+    struct redisCommand *cmd = c->cmd;
+
+    if (cmd->proc == dbsizeCommand || cmd->proc == publishCommand)
+        return SHARD_GATHER_SUM;
+    if (cmd->proc == keysCommand)
+        return SHARD_GATHER_ARRAY;
+    if (cmd->proc == flushallCommand || cmd->proc == flushdbCommand)
+        return SHARD_GATHER_OK;
+    if (cmd->proc == configCommand && c->argc > 2 &&
+        !strcasecmp(c->argv[1]->ptr,"set"))
+        return SHARD_GATHER_OK;
+    return SHARD_GATHER_NONE;
+}
+
+/* Execute the command of 'c' in this shard, returning the protocol of the
+ * reply. The client itself can't be used since it is blocked afterwards. */
+static sds shardCallLocally(client *c) {
+    static client *fake = NULL;
+    sds proto;
+
+    if (fake == NULL) {
+        fake = createClient(NULL);
+        fake->flags |= CLIENT_MODULE|CLIENT_DENY_BLOCKING;
+        fake->user = NULL; /* The ACLs were already checked for 'c'. */
+    }
+    fake->db = c->db;
+    fake->resp = c->resp;
+    fake->argc = c->argc;
+    fake->argv = zmalloc(sizeof(robj*)*c->argc);
+    for (int j = 0; j < c->argc; j++) {
+        fake->argv[j] = c->argv[j];
+        incrRefCount(c->argv[j]);
+    }
+    fake->cmd = fake->lastcmd = c->cmd;
+    call(fake,CMD_CALL_FULL);
+
+    proto = sdsnewlen(fake->buf,fake->bufpos);
+    fake->bufpos = 0;
+    while (listLength(fake->reply)) {
+        clientReplyBlock *o = listNodeValue(listFirst(fake->reply));
+        proto = sdscatlen(proto,o->buf,o->used);
+        listDelNode(fake->reply,listFirst(fake->reply));
+    }
+    for (int j = 0; j < fake->argc; j++) decrRefCount(fake->argv[j]);
+    zfree(fake->argv);
+    fake->argv = NULL;
+    fake->argc = 0;
+    fake->cmd = NULL;
+    return proto;
+}
+
+/* Execute the command of 'c' in all the shards, blocking the client until
+ * the replies of the other shards are received and combined. */
+static void shardBroadcastCommand(client *c, int type) {
+    shardGather *g;
+    sds reply;
+    int j;
+
+    for (j = 0; j < server.shards; j++) {
+        shardLink *link = server.shard_links[j];
+        if (link && link->fd == -1) {
+            rejectCommandFormat(c,"-SHARDDOWN Shard %d is down", j);
+            return;
+        }
+    }
+
+    /* A command failing here, because of its arguments, would fail in the
+     * other shards as well. The error was already counted by call(). */
+    reply = shardCallLocally(c);
+    if (reply[0] == '-') {
+        addReplyProto(c,reply,sdslen(reply));
+        sdsfree(reply);
+        return;
+    }
+
+    g = zcalloc(sizeof(*g));
+    g->type = type;
+    g->pending = server.shards;
+    g->elements = sdsempty();
+    c->bpop.shard_gather = g;
+    for (j = 0; j < server.shards; j++) {
+        shardLink *link = server.shard_links[j];
+        if (link) shardLinkAppendCommand(link,c);
+    }
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_SHARD);
+    shardGatherReply(c,reply,sdslen(reply));
+    sdsfree(reply);
+}
+
+/* Queue a PUBLISH of the message on the other shards, to reach their
+ * subscribers. Called for the keyspace notifications, the messages of the
+ * clients being sent by the PUBLISH command itself. */
+void shardsPublish(robj *channel, robj *message) {
+    robj *argv[2] = {channel, message};
+
+    if (server.shard_links == NULL) return;
+    for (int j = 0; j < server.shards; j++) {
+        shardLink *link = server.shard_links[j];
+        if (link == NULL || link->fd == -1) continue;
+
+        link->obuf = sdscat(link->obuf,"*3\r\n");
+        shardLinkAppendArg(link,"PUBLISH",7);
+        for (int i = 0; i < 2; i++) {
+            robj *o = getDecodedObject(argv[i]);
+            shardLinkAppendArg(link,o->ptr,sdslen(o->ptr));
+            decrRefCount(o);
+        }
+        shardLinkPushPending(link,0);
+    }
+}
+
+/* Called by processCommand(). If the keys of the command belong to another
+ * shard, the command is forwarded to it, and the commands about all the
+ * shards are sent to each one of them, or rejected if that's not possible.
+ * Returns 1 if the command was handled this way, or 0 if it must be executed
+ * by this shard only. */
+int shardRouteCommand(client *c) {
+    struct redisCommand *cmd = c->cmd;
+    int gather;
+
+    /* Commands forwarded by the other shards are always executed. */
+    if (c->flags & CLIENT_SHARD) return 0;
+
+    if (cmd->proc == scanCommand || cmd->proc == randomkeyCommand) {
+        rejectCommandFormat(c,
+            "-CROSSSHARD %s can only be used without sharding", cmd->name);
+        return 1;
+    }
+    if (cmd->proc == clientCommand && c->argc > 2 &&
+        !strcasecmp(c->argv[1]->ptr,"tracking"))
+    {
+        for (int j = 3; j < c->argc; j++) {
+            if (strcasecmp(c->argv[j]->ptr,"bcast")) continue;
+            rejectCommandFormat(c,
+                "-CROSSSHARD Broadcasting mode of client side caching can "
+                "only be used without sharding");
+            return 1;
+        }
+    }
+
+    if ((gather = shardGatherType(c)) != SHARD_GATHER_NONE) {
+        if (c->flags & CLIENT_MULTI) {
+            rejectCommandFormat(c,
+                "-CROSSSHARD Transactions can't use the commands sent to all "
+                "the shards");
+        } else {
+            shardBroadcastCommand(c,gather);
+        }
+        return 1;
+    }
+
+    /* The configuration file is shared, and rewritten by shard 0. */
+    int shard;
+    if (cmd->proc == configCommand && c->argc == 2 &&
+        !strcasecmp(c->argv[1]->ptr,"rewrite"))
+    {
+        shard = 0;
+    } else {
+        shard = getShardByQuery(cmd,c->argv,c->argc);
+    }
+    if (shard == -1 || shard == server.shard_id) return 0;
+
+    if (shard == -2) {
+        rejectCommandFormat(c,
+            "-CROSSSHARD Keys in request don't hash to the same shard");
+    } else if (c->flags & CLIENT_MULTI || cmd->proc == watchCommand) {
+        rejectCommandFormat(c,
+            "-CROSSSHARD Transactions can only use the keys of the shard "
+            "serving the connection (shard %d)", server.shard_id);
+    } else if (c->flags & CLIENT_TRACKING) {
+        rejectCommandFormat(c,
+            "-CROSSSHARD Clients using client side caching can only use the "
+            "keys of the shard serving the connection (shard %d)",
+            server.shard_id);
+    } else if (shardCommandMayBlock(c)) {
+        rejectCommandFormat(c,
+            "-CROSSSHARD Blocking commands can only wait for the keys of "
+            "the shard serving the connection (shard %d)", server.shard_id);
+    } else if ((cmd->proc == evalCommand || cmd->proc == evalShaCommand ||
+                cmd->flags & CMD_MODULE) && !shardUserHasFullAccess(c->user))
+    {
+        rejectCommandFormat(c,
+            "-CROSSSHARD Scripts and module commands of restricted users can "
+            "only use the keys of the shard serving the connection (shard %d)",
+            server.shard_id);
+    } else if (server.shard_links[shard]->fd == -1) {
+        rejectCommandFormat(c,"-SHARDDOWN Shard %d is down", shard);
+    } else {
+        shardForwardCommand(c,server.shard_links[shard]);
+    }
+    return 1;
+}
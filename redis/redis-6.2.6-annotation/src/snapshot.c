@@ -0,0 +1,470 @@
+/* Forkless background saving.
+ *
+ * When bgsave-forkless is enabled BGSAVE (and the automatic saves triggered
+ * by the "save" points) do not fork a child process to write the RDB file:
+ * the dataset is serialized by the main thread itself, incrementally, in
+ * small time slices run from a time event, while the BIO_SNAPSHOT thread
+ * computes the checksum and writes the produced buffers to disk.
+ *
+ * The file must contain the dataset as it was when BGSAVE started, so every
+ * key that is about to be modified or deleted is saved before the change if
+ * the scan did not reach it yet. To know which keys were already saved every
+ * key stores the epoch of the last snapshot that handled it in the spare bits
+ * of its embedded sds header (see dbEntryCreate()): the epoch is incremented
+ * every time a snapshot starts, so a key was saved by the current snapshot if
+ * its epoch is server.snapshot_epoch. Keys created while the snapshot is in
+ * progress get the current epoch as well, so that they are never saved.
+ *
+ * The databases are walked with dictScan(), that guarantees that every key
+ * existing when the scan started is returned at least once even if the
+ * table is resized in the meantime: duplicates are skipped thanks to the
+ * epoch as well.
+ *
+ * Copyright (c) 2009-2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "bio.h"
+
+#include <sys/param.h>
+
+#define SNAPSHOT_STEP_US 1000                   /* Scan time per time event. */
+#define SNAPSHOT_BUFFER_BYTES (64*1024)         /* Hand buffers to the writer
+                                                   once they reach this size. */
+#define SNAPSHOT_MAX_PENDING_BYTES (64*1024*1024) /* Pause the scan when the
+                                                     writer is behind. */
+#define SNAPSHOT_EPOCH_MASK ((1<<SDS_USER_BITS)-1)
+
+typedef struct snapshotState {
+    char tmpfile[256];
+    sds filename;               /* Final name of the file. */
+    rdbSaveInfo rsi;
+    int has_rsi;
+    long long timer_id;
+    rio buf;                    /* Main thread serialization buffer. */
+    int dbid;                   /* DB being scanned. */
+    int db_started;             /* SELECTDB/RESIZEDB of 'dbid' were written. */
+    int selected_db;            /* Last SELECTDB written, -1 if none. */
+    unsigned long cursor;       /* dictScan() cursor of 'dbid'. */
+    int finishing;              /* Scan done, waiting for the writer. */
+    int error;                  /* Serialization error (modules). */
+    long long keys;             /* Keys saved. */
+    long long keys_before_write;/* Keys saved because about to change. */
+    /* Owned by the writer thread. */
+    FILE *fp;
+    rio file;
+    /* Shared with the writer thread. */
+    redisAtomic size_t pending_bytes;
+    redisAtomic int write_errno;
+    redisAtomic int aborted;
+    redisAtomic int done;
+} snapshotState;
+
+static snapshotState *snapshot = NULL;
+
+/* Number of snapshots aborted since the last completed one, see
+ * snapshotStart(). */
+static int snapshot_aborts = 0;
+
+/* ----------------------------------------------------------------------------
+ * Writer thread
+ * ------------------------------------------------------------------------- */
+
+/* Write a buffer produced by the main thread and free it. */
+static void snapshotWriteJob(void *args[]) {
+    snapshotState *s = args[0];
+    sds buf = args[1];
+    int err, aborted;
+
+    atomicGet(s->write_errno,err);
+    atomicGet(s->aborted,aborted);
+    if (!err && !aborted && rioWrite(&s->file,buf,sdslen(buf)) == 0)
+        atomicSet(s->write_errno,errno ? errno : EIO);
+    atomicDecr(s->pending_bytes,sdslen(buf));
+    sdsfree(buf);
+}
+
+/* Append the checksum, make sure the file reached the disk and close it.
+ * After 'done' is set the main thread owns the state again. */
+static void snapshotFinishJob(void *args[]) {
+    snapshotState *s = args[0];
+    int err, aborted;
+
+    atomicGet(s->write_errno,err);
+    atomicGet(s->aborted,aborted);
+    if (!err && !aborted) {
+        /* CRC64 checksum, zero if checksum computation is disabled. */
+        uint64_t cksum = s->file.cksum;
+        memrev64ifbe(&cksum);
+        if (rioWrite(&s->file,&cksum,8) == 0 ||
+            fflush(s->fp) ||
+            fsync(fileno(s->fp)))
+        {
+            atomicSet(s->write_errno,errno ? errno : EIO);
+        }
+    }
+    if (fclose(s->fp) && !err && !aborted)
+        atomicSet(s->write_errno,errno);
+    s->fp = NULL;
+    atomicSet(s->done,1);
+}
+
+/* ----------------------------------------------------------------------------
+ * Serialization
+ * ------------------------------------------------------------------------- */
+
+/* Hand the buffer to the writer thread. */
+static void snapshotFlushBuffer(snapshotState *s) {
+    sds buf = s->buf.io.buffer.ptr;
+
+    if (sdslen(buf) == 0) return;
+    atomicIncr(s->pending_bytes,sdslen(buf));
+    bioCreateSnapshotJob(snapshotWriteJob,2,s,buf);
+    rioInitWithBuffer(&s->buf,sdsempty());
+}
+
+static int snapshotSelectDb(snapshotState *s, int dbid) {
+    if (s->selected_db == dbid) return 0;
+    if (rdbSaveType(&s->buf,RDB_OPCODE_SELECTDB) == -1) return -1;
+    if (rdbSaveLen(&s->buf,dbid) == -1) return -1;
+    s->selected_db = dbid;
+    return 0;
+}
+
+/* Serialize the key of the entry if the snapshot did not save it yet. */
+static void snapshotSaveEntry(snapshotState *s, redisDb *db, dictEntry *de) {
+    robj key;
+
+    if (dbEntryGetSnapshotEpoch(de) == server.snapshot_epoch) return;
+    initStaticStringObject(key,dictGetKey(de));
+    if (snapshotSelectDb(s,db->id) == -1 ||
+        rdbSaveKeyValuePair(&s->buf,&key,dictGetVal(de),
+                            dbEntryGetExpire(de)) == -1)
+    {
+        s->error = 1;
+        return;
+    }
+    dbEntrySetSnapshotEpoch(de,server.snapshot_epoch);
+    s->keys++;
+}
+
+static void snapshotScanCallback(void *privdata, const dictEntry *de) {
+    snapshotSaveEntry(snapshot,privdata,(dictEntry*)de);
+}
+
+/* Write everything that follows the keys. */
+static int snapshotSaveTrailer(snapshotState *s) {
+    /* Like rdbSaveRio(), persist the scripts together with the replication
+     * information. */
+    if (s->has_rsi && dictSize(server.lua_scripts)) {
+        dictIterator *di = dictGetIterator(server.lua_scripts);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(&s->buf,"lua",3,body->ptr,
+                                sdslen(body->ptr)) == -1)
+            {
+                dictReleaseIterator(di);
+                return -1;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+    if (rdbSaveModulesAux(&s->buf,REDISMODULE_AUX_AFTER_RDB) == -1) return -1;
+    if (rdbSaveType(&s->buf,RDB_OPCODE_EOF) == -1) return -1;
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Snapshot life cycle
+ * ------------------------------------------------------------------------- */
+
+/* Wait for the writer to close the file and release the snapshot. */
+static void snapshotRelease(snapshotState *s, int abort) {
+    int done;
+
+    if (abort) atomicSet(s->aborted,1);
+    if (!s->finishing) {
+        snapshotFlushBuffer(s);
+        bioCreateSnapshotJob(snapshotFinishJob,1,s);
+        s->finishing = 1;
+    }
+    while (1) {
+        atomicGet(s->done,done);
+        if (done) break;
+        bioWaitStepOfType(BIO_SNAPSHOT);
+    }
+    if (s->timer_id != -1) aeDeleteTimeEvent(server.el,s->timer_id);
+    sdsfree(s->buf.io.buffer.ptr);
+    sdsfree(s->filename);
+    zfree(s);
+    snapshot = NULL;
+    server.snapshot_in_progress = 0;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+    updateDictResizePolicy();
+}
+
+/* Stop the snapshot in progress, if any, removing its temp file. */
+void snapshotAbort(const char *reason) {
+    snapshotState *s = snapshot;
+    char tmpfile[sizeof(s->tmpfile)];
+
+    if (!s) return;
+    serverLog(LL_WARNING,"Background saving aborted: %s",reason);
+    memcpy(tmpfile,s->tmpfile,sizeof(tmpfile));
+    snapshotRelease(s,1);
+    bg_unlink(tmpfile);
+    snapshot_aborts++;
+}
+
+/* Like snapshotAbort() but flags the save as failed. */
+static void snapshotFail(snapshotState *s, const char *reason) {
+    serverLog(LL_WARNING,"Background saving error: %s",reason);
+    s->timer_id = -1;
+    snapshotAbort("can't complete the save");
+    server.lastbgsave_status = C_ERR;
+    replicationStartPendingFork();
+}
+
+static void snapshotDone(snapshotState *s) {
+    char cwd[MAXPATHLEN];
+    int err;
+
+    atomicGet(s->write_errno,err);
+    if (err) {
+        snapshotFail(s,strerror(err));
+        return;
+    }
+    if (rename(s->tmpfile,s->filename) == -1) {
+        char *cwdp = getcwd(cwd,MAXPATHLEN);
+        serverLog(LL_WARNING,
+            "Error moving temp DB file %s on the final "
+            "destination %s (in server root dir %s): %s",
+            s->tmpfile, s->filename, cwdp ? cwdp : "unknown",
+            strerror(errno));
+        snapshotFail(s,"rename failed");
+        return;
+    }
+    serverLog(LL_NOTICE,
+        "Background saving terminated with success "
+        "(%lld keys, %lld saved before being modified)",
+        s->keys, s->keys_before_write);
+    snapshotRelease(s,0);
+    server.dirty = server.dirty - server.dirty_before_bgsave;
+    server.lastsave = time(NULL);
+    server.lastbgsave_status = C_OK;
+    snapshot_aborts = 0;
+    replicationStartPendingFork();
+}
+
+/* Scan the keyspace for about SNAPSHOT_STEP_US microseconds. */
+static int snapshotTimeProc(struct aeEventLoop *el, long long id, void *clientData) {
+    snapshotState *s = snapshot;
+    long long start = ustime();
+    size_t pending;
+    int err;
+    UNUSED(el);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    if (s->finishing) {
+        int done;
+        atomicGet(s->done,done);
+        if (!done) return 10;
+        s->timer_id = -1;
+        snapshotDone(s);
+        return AE_NOMORE;
+    }
+
+    atomicGet(s->write_errno,err);
+    if (err || s->error) {
+        snapshotFail(s,err ? strerror(err) : "error serializing the dataset");
+        return AE_NOMORE;
+    }
+    /* Let the writer catch up if we are producing faster than the disk. */
+    atomicGet(s->pending_bytes,pending);
+    if (pending > SNAPSHOT_MAX_PENDING_BYTES) return 1;
+
+    while (s->dbid < server.dbnum) {
+        redisDb *db = server.db+s->dbid;
+
+        if (!s->db_started) {
+            if (dictSize(db->dict) == 0) {
+                s->dbid++;
+                continue;
+            }
+            if (snapshotSelectDb(s,s->dbid) == -1 ||
+                rdbSaveType(&s->buf,RDB_OPCODE_RESIZEDB) == -1 ||
+                rdbSaveLen(&s->buf,dictSize(db->dict)) == -1 ||
+                rdbSaveLen(&s->buf,dictSize(db->expires)) == -1)
+            {
+                s->error = 1;
+                break;
+            }
+            s->db_started = 1;
+            s->cursor = 0;
+        }
+        s->cursor = dictScan(db->dict,s->cursor,snapshotScanCallback,NULL,db);
+        if (s->error) break;
+        if (s->cursor == 0) {
+            s->dbid++;
+            s->db_started = 0;
+        }
+        if (sdslen(s->buf.io.buffer.ptr) >= SNAPSHOT_BUFFER_BYTES)
+            snapshotFlushBuffer(s);
+        if (ustime()-start > SNAPSHOT_STEP_US) break;
+    }
+
+    if (!s->error && s->dbid == server.dbnum && snapshotSaveTrailer(s) == -1)
+        s->error = 1;
+    if (s->error) {
+        snapshotFail(s,"error serializing the dataset");
+        return AE_NOMORE;
+    }
+    snapshotFlushBuffer(s);
+    if (s->dbid == server.dbnum) {
+        bioCreateSnapshotJob(snapshotFinishJob,1,s);
+        s->finishing = 1;
+        return 10;
+    }
+    return 0;
+}
+
+/* Epochs are stored in SDS_USER_BITS bits, so they wrap around. A completed
+ * snapshot leaves all the keys with its epoch, but after many aborted ones
+ * a key never reached could have an epoch looking like the new one: in that
+ * case reset all the epochs first. */
+static void snapshotResetEpochs(void) {
+    for (int j = 0; j < server.dbnum; j++) {
+        dictIterator *di = dictGetIterator(server.db[j].dict);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL)
+            dbEntrySetSnapshotEpoch(de,server.snapshot_epoch);
+        dictReleaseIterator(di);
+    }
+    snapshot_aborts = 0;
+}
+
+/* Start saving the dataset in 'filename' without forking. Returns C_ERR if
+ * another background save or child process is active or on errors. */
+int snapshotStart(char *filename, rdbSaveInfo *rsi) {
+    char cwd[MAXPATHLEN];
+    char magic[10];
+    snapshotState *s;
+    FILE *fp;
+
+    if (hasActiveChildProcess()) return C_ERR;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+
+    s = zcalloc(sizeof(*s));
+    snprintf(s->tmpfile,sizeof(s->tmpfile),"temp-forkless-%d.rdb",
+        (int) getpid());
+    fp = fopen(s->tmpfile,"w");
+    if (!fp) {
+        char *cwdp = getcwd(cwd,MAXPATHLEN);
+        serverLog(LL_WARNING,
+            "Failed opening the RDB file %s (in server root dir %s) "
+            "for saving: %s",
+            filename, cwdp ? cwdp : "unknown", strerror(errno));
+        zfree(s);
+        server.lastbgsave_status = C_ERR;
+        return C_ERR;
+    }
+    s->fp = fp;
+    rioInitWithFile(&s->file,fp);
+    if (server.rdb_checksum)
+        s->file.update_cksum = rioGenericUpdateChecksum;
+    if (server.rdb_save_incremental_fsync)
+        rioSetAutoSync(&s->file,REDIS_AUTOSYNC_BYTES);
+    rioInitWithBuffer(&s->buf,sdsempty());
+    s->filename = sdsnew(filename);
+    if (rsi) {
+        s->rsi = *rsi;
+        s->has_rsi = 1;
+    }
+    s->selected_db = -1;
+
+    if (snapshot_aborts >= SNAPSHOT_EPOCH_MASK) snapshotResetEpochs();
+    server.snapshot_epoch = (server.snapshot_epoch+1) & SNAPSHOT_EPOCH_MASK;
+    snapshot = s;
+    server.snapshot_in_progress = 1;
+    server.rdb_save_time_start = time(NULL);
+    updateDictResizePolicy();
+
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    if (rioWrite(&s->buf,magic,9) == 0 ||
+        rdbSaveInfoAuxFields(&s->buf,RDBFLAGS_NONE,rsi) == -1 ||
+        rdbSaveModulesAux(&s->buf,REDISMODULE_AUX_BEFORE_RDB) == -1)
+    {
+        snapshotFail(s,"error serializing the dataset");
+        return C_ERR;
+    }
+    s->timer_id = aeCreateTimeEvent(server.el,0,snapshotTimeProc,NULL,NULL);
+    serverLog(LL_NOTICE,"Background saving started without forking");
+    return C_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Write hooks
+ * ------------------------------------------------------------------------- */
+
+/* Called before 'key' is modified or deleted: if the snapshot in progress
+ * did not reach the key yet, save its current value now. */
+void snapshotSaveKey(redisDb *db, robj *key) {
+    snapshotState *s = snapshot;
+    dictEntry *de;
+    long long keys;
+
+    if (!s || s->finishing) return;
+    if ((de = dictFind(db->dict,key->ptr)) == NULL) return;
+    keys = s->keys;
+    snapshotSaveEntry(s,db,de);
+    if (s->error) {
+        /* Don't release the state under the caller, let the time event
+         * report the failure. */
+        return;
+    }
+    s->keys_before_write += s->keys-keys;
+}
+
+/* Save the keys a write command is going to touch. Commands touching keys
+ * not declared in the command table are covered by the hooks in the db.c
+ * write API. */
+void snapshotSaveKeysOfCommand(client *c) {
+    getKeysResult result = GETKEYS_RESULT_INIT;
+    int numkeys = getKeysFromCommand(c->cmd,c->argv,c->argc,&result);
+
+    for (int j = 0; j < numkeys; j++)
+        snapshotSaveKey(c->db,c->argv[result.keys[j]]);
+    getKeysFreeResult(&result);
+}
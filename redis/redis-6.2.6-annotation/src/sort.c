@@ -309,8 +309,8 @@ void sortCommand(client *c) {
     }
 
     /* Destructively convert encoded sorted sets for SORT. */
-    if (sortval->type == OBJ_ZSET)
-        zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
+    if (sortval->type == OBJ_ZSET && sortval->encoding == OBJ_ENCODING_LISTPACK)
+        zsetConvert(sortval, server.zset_large_encoding);
 
     /* Objtain the length of the object to sort. */
     switch(sortval->type) {
@@ -404,32 +404,51 @@ void sortCommand(client *c) {
          * way, just getting the required range, as an optimization. */
 
         zset *zs = sortval->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
         sds sdsele;
         int rangelen = vectorlen;
 
-        /* Check if starting point is trivial, before doing log(N) lookup. */
-        if (desc) {
-            long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
-
-            ln = zsl->tail;
-            if (start > 0)
-                ln = zslGetElementByRank(zsl,zsetlen-start);
+        if (zs->zbt) {
+            zbtreeIter it;
+            long zsetlen = zbtLength(zs->zbt);
+            int valid;
+
+            /* Seek the starting point by rank in a single descent. */
+            valid = zbtSeekByIndex(zs->zbt,desc ? zsetlen-start-1 : start,&it);
+            while(rangelen--) {
+                serverAssertWithInfo(c,sortval,valid);
+                sdsele = zbtIterEle(&it);
+                vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
+                vector[j].u.score = 0;
+                vector[j].u.cmpobj = NULL;
+                j++;
+                valid = desc ? zbtPrev(&it) : zbtNext(&it);
+            }
         } else {
-            ln = zsl->header->level[0].forward;
-            if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
-        }
+            zskiplist *zsl = zs->zsl;
+            zskiplistNode *ln;
 
-        while(rangelen--) {
-            serverAssertWithInfo(c,sortval,ln != NULL);
-            sdsele = ln->ele;
-            vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
-            vector[j].u.score = 0;
-            vector[j].u.cmpobj = NULL;
-            j++;
-            ln = desc ? ln->backward : ln->level[0].forward;
+            /* Check if starting point is trivial, before doing log(N) lookup. */
+            if (desc) {
+                long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
+
+                ln = zsl->tail;
+                if (start > 0)
+                    ln = zslGetElementByRank(zsl,zsetlen-start);
+            } else {
+                ln = zsl->header->level[0].forward;
+                if (start > 0)
+                    ln = zslGetElementByRank(zsl,start+1);
+            }
+
+            while(rangelen--) {
+                serverAssertWithInfo(c,sortval,ln != NULL);
+                sdsele = ln->ele;
+                vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
+                vector[j].u.score = 0;
+                vector[j].u.cmpobj = NULL;
+                j++;
+                ln = desc ? ln->backward : ln->level[0].forward;
+            }
         }
         /* Fix start/end: output code is not aware of this optimization. */
         end -= start;
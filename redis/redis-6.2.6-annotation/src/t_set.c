@@ -36,15 +36,47 @@
 void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
                               robj *dstkey, int op);
 
+/* Roaring bitmaps only save memory when their integers are dense enough: a
+ * set with less than SET_ROARING_MIN_DENSITY elements per container, on
+ * average, uses a hash table instead. Sets with a few containers are not
+ * checked, as they are small anyway. */
+#define SET_ROARING_MIN_DENSITY 16
+#define SET_ROARING_MIN_CONTAINERS 64
+
+int setTypeRoaringIsSparse(const roaring *r) {
+    return r->count > SET_ROARING_MIN_CONTAINERS &&
+           roaringCard(r) < (uint64_t)r->count*SET_ROARING_MIN_DENSITY;
+}
+
 /* Factory method to return a set that *can* hold "value". When the object has
- * an integer-encodable value, an intset will be returned. Otherwise a regular
- * hash table. */
-robj *setTypeCreate(sds value) {
+ * an integer-encodable value, an intset will be returned. Otherwise a listpack
+ * if "size_hint", the expected number of elements, is small enough, or a
+ * regular hash table. */
+robj *setTypeCreate(sds value, size_t size_hint) {
     if (isSdsRepresentableAsLongLong(value,NULL) == C_OK)
         return createIntsetObject();
+    if (size_hint <= server.set_max_listpack_entries &&
+        sdslen(value) <= server.set_max_listpack_value)
+        return createSetListpackObject();
     return createSetObject();
 }
 
+/* Return 1 if the intset, with a new string element of "len" bytes, is
+ * small enough to be converted to a listpack. */
+static int setTypeIntsetFitsListpack(intset *is, size_t len) {
+    uint32_t count = intsetLen(is);
+    int64_t min, max;
+
+    if (count >= server.set_max_listpack_entries ||
+        len > server.set_max_listpack_value ||
+        !lpSafeToAdd(NULL,intsetBlobLen(is)+len)) return 0;
+    if (count == 0) return 1;
+    intsetGet(is,0,&min);
+    intsetGet(is,count-1,&max);
+    return sdigits10(min) <= server.set_max_listpack_value &&
+           sdigits10(max) <= server.set_max_listpack_value;
+}
+
 /* Add the specified value into a set.
  *
  * If the value was already member of the set, nothing is done and 0 is
@@ -69,10 +101,22 @@ int setTypeAdd(robj *subject, sds value) {
                 size_t max_entries = server.set_max_intset_entries;
                 /* limit to 1G entries due to intset internals. */
                 if (max_entries >= 1<<30) max_entries = 1<<30;
-                if (intsetLen(subject->ptr) > max_entries)
-                    setTypeConvert(subject,OBJ_ENCODING_HT);
+                if (intsetLen(subject->ptr) > max_entries) {
+                    setTypeConvert(subject,server.set_large_int_encoding);
+                    if (subject->encoding == OBJ_ENCODING_ROARING &&
+                        setTypeRoaringIsSparse(subject->ptr))
+                        setTypeConvert(subject,OBJ_ENCODING_HT);
+                }
                 return 1;
             }
+        } else if (setTypeIntsetFitsListpack(subject->ptr,sdslen(value))) {
+            /* Failed to get integer from object, but the set is still
+             * small: convert to a listpack. The value is not integer
+             * encodable, so it can't be a member already. */
+            setTypeConvert(subject,OBJ_ENCODING_LISTPACK);
+            subject->ptr = lpAppend(subject->ptr,(unsigned char*)value,
+                                    sdslen(value));
+            return 1;
         } else {
             /* Failed to get integer from object, convert to regular set. */
             setTypeConvert(subject,OBJ_ENCODING_HT);
@@ -82,6 +126,37 @@ int setTypeAdd(robj *subject, sds value) {
             serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
             return 1;
         }
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = subject->ptr;
+
+        if (lpFind(lp,lpFirst(lp),(unsigned char*)value,sdslen(value),0))
+            return 0;
+        if (lpLength(lp) < server.set_max_listpack_entries &&
+            sdslen(value) <= server.set_max_listpack_value &&
+            lpSafeToAdd(lp,sdslen(value)))
+        {
+            subject->ptr = lpAppend(lp,(unsigned char*)value,sdslen(value));
+        } else {
+            /* Size limit is reached. Convert to a regular set and add. */
+            setTypeConvert(subject,OBJ_ENCODING_HT);
+            serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+        }
+        return 1;
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
+            roaring *r = subject->ptr;
+            uint32_t count = r->count;
+            if (roaringAdd(r,llval)) {
+                /* Use a hash table when the integers get too sparse. */
+                if (r->count > count && setTypeRoaringIsSparse(r))
+                    setTypeConvert(subject,OBJ_ENCODING_HT);
+                return 1;
+            }
+        } else {
+            setTypeConvert(subject,OBJ_ENCODING_HT);
+            serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+            return 1;
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -101,6 +176,17 @@ int setTypeRemove(robj *setobj, sds value) {
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
             if (success) return 1;
         }
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK)
+            return roaringRemove(setobj->ptr,llval);
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr;
+        unsigned char *p = lpFind(lp,lpFirst(lp),(unsigned char*)value,
+                                  sdslen(value),0);
+        if (p != NULL) {
+            setobj->ptr = lpDelete(lp,p,NULL);
+            return 1;
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -115,6 +201,14 @@ int setTypeIsMember(robj *subject, sds value) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             return intsetFind((intset*)subject->ptr,llval);
         }
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
+            return roaringContains(subject->ptr,llval);
+        }
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = subject->ptr;
+        return lpFind(lp,lpFirst(lp),(unsigned char*)value,sdslen(value),0)
+               != NULL;
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -129,6 +223,11 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
         si->di = dictGetIterator(subject->ptr);
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         si->ii = 0;
+    } else if (si->encoding == OBJ_ENCODING_ROARING) {
+        roaringIterInit(subject->ptr,&si->ri);
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        si->lpi = lpFirst(subject->ptr);
+        si->lpele = NULL;
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -138,6 +237,8 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
 void setTypeReleaseIterator(setTypeIterator *si) {
     if (si->encoding == OBJ_ENCODING_HT)
         dictReleaseIterator(si->di);
+    else if (si->encoding == OBJ_ENCODING_LISTPACK)
+        sdsfree(si->lpele);
     zfree(si);
 }
 
@@ -147,7 +248,11 @@ void setTypeReleaseIterator(setTypeIterator *si) {
  * Since set elements can be internally be stored as SDS strings or
  * simple arrays of integers, setTypeNext returns the encoding of the
  * set object you are iterating, and will populate the appropriate pointer
- * (sdsele) or (llele) accordingly.
+ * (sdsele) or (llele) accordingly. Roaring bitmaps hold integers as well:
+ * OBJ_ENCODING_INTSET is returned for them, so that callers only need to
+ * tell integers from strings. Listpacks hold both: OBJ_ENCODING_INTSET is
+ * returned for integers, and OBJ_ENCODING_HT for strings, that are copied
+ * into an SDS string owned by the iterator, valid until the next call.
  *
  * Note that both the sdsele and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
@@ -164,6 +269,28 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (si->encoding == OBJ_ENCODING_ROARING) {
+        if (!roaringNext(&si->ri,llele))
+            return -1;
+        *sdsele = NULL; /* Not needed. Defensive. */
+        return OBJ_ENCODING_INTSET;
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *str;
+        int64_t len;
+
+        if (si->lpi == NULL) return -1;
+        str = lpGet(si->lpi,&len,NULL);
+        si->lpi = lpNext(si->subject->ptr,si->lpi);
+        if (str == NULL) {
+            *llele = len;
+            *sdsele = NULL; /* Not needed. Defensive. */
+            return OBJ_ENCODING_INTSET;
+        }
+        si->lpele = si->lpele ? sdscpylen(si->lpele,(char*)str,len) :
+                                sdsnewlen(str,len);
+        *sdsele = si->lpele;
+        *llele = -123456789; /* Not needed. Defensive. */
+        return OBJ_ENCODING_HT;
     } else {
         serverPanic("Wrong set encoding in setTypeNext");
     }
@@ -197,36 +324,78 @@ sds setTypeNextObject(setTypeIterator *si) {
 
 /* Return random element from a non empty set.
  * The returned element can be an int64_t value if the set is encoded
- * as an "intset" blob of integers, or an SDS string if the set
- * is a regular set.
+ * as an "intset" blob of integers, or a string if the set is a regular
+ * set or a listpack. Strings are returned as a pointer and a length,
+ * valid until the set is modified.
  *
  * The caller provides both pointers to be populated with the right
  * object. The return value of the function is the object->encoding
  * field of the object and is used by the caller to check if the
- * int64_t pointer or the redis object pointer was populated.
+ * int64_t pointer or the string pointer was populated. As in
+ * setTypeNext(), it is OBJ_ENCODING_INTSET for the integers of roaring
+ * bitmaps and listpacks, and OBJ_ENCODING_HT for listpack strings.
  *
- * Note that both the sdsele and llele pointers should be passed and cannot
+ * Note that the str, len and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
  * used field with values which are easy to trap if misused. */
-int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
+int setTypeRandomElement(robj *setobj, char **str, size_t *len, int64_t *llele) {
     if (setobj->encoding == OBJ_ENCODING_HT) {
         dictEntry *de = dictGetFairRandomKey(setobj->ptr);
-        *sdsele = dictGetKey(de);
+        sds s = dictGetKey(de);
+        *str = s;
+        *len = sdslen(s);
         *llele = -123456789; /* Not needed. Defensive. */
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
-        *sdsele = NULL; /* Not needed. Defensive. */
+        *str = NULL; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        *llele = roaringRandom(setobj->ptr);
+        *str = NULL; /* Not needed. Defensive. */
+        return OBJ_ENCODING_INTSET;
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr;
+        unsigned char *p = lpSeek(lp,rand() % lpLength(lp));
+        int64_t vlen;
+        unsigned char *s = lpGet(p,&vlen,NULL);
+
+        if (s == NULL) {
+            *llele = vlen;
+            *str = NULL; /* Not needed. Defensive. */
+            return OBJ_ENCODING_INTSET;
+        }
+        *str = (char*)s;
+        *len = vlen;
+        *llele = -123456789; /* Not needed. Defensive. */
+        return OBJ_ENCODING_HT;
     } else {
         serverPanic("Unknown set encoding");
     }
     return setobj->encoding;
 }
 
+/* Remove an integer returned by setTypeNext() or setTypeRandomElement()
+ * with OBJ_ENCODING_INTSET. */
+static void setTypeRemoveInteger(robj *setobj, int64_t llele) {
+    if (setobj->encoding == OBJ_ENCODING_INTSET) {
+        setobj->ptr = intsetRemove(setobj->ptr,llele,NULL);
+    } else if (setobj->encoding == OBJ_ENCODING_ROARING) {
+        roaringRemove(setobj->ptr,llele);
+    } else {
+        sds ele = sdsfromlonglong(llele);
+        setTypeRemove(setobj,ele);
+        sdsfree(ele);
+    }
+}
+
 unsigned long setTypeSize(const robj *subject) {
     if (subject->encoding == OBJ_ENCODING_HT) {
         return dictSize((const dict*)subject->ptr);
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return intsetLen((const intset*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_ROARING) {
+        return roaringCard((const roaring*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        return lpLength((unsigned char*)subject->ptr);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -234,11 +403,14 @@ unsigned long setTypeSize(const robj *subject) {
 
 /* Convert the set to specified encoding. The resulting dict (when converting
  * to a hash table) is presized to hold the number of elements in the original
- * set. */
+ * set. Intsets can be converted to hash tables, roaring bitmaps or listpacks,
+ * and roaring bitmaps and listpacks to hash tables. */
 void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
+                             (setobj->encoding == OBJ_ENCODING_INTSET ||
+                              setobj->encoding == OBJ_ENCODING_ROARING ||
+                              setobj->encoding == OBJ_ENCODING_LISTPACK));
 
     if (enc == OBJ_ENCODING_HT) {
         int64_t intele;
@@ -246,24 +418,81 @@ void setTypeConvert(robj *setobj, int enc) {
         sds element;
 
         /* Presize the dict to avoid rehashing */
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,setTypeSize(setobj));
 
-        /* To add the elements we extract integers and create redis objects */
+        /* To add the elements we extract integers and strings, and create
+         * SDS strings out of them. */
         si = setTypeInitIterator(setobj);
         while (setTypeNext(si,&element,&intele) != -1) {
-            element = sdsfromlonglong(intele);
+            element = element ? sdsdup(element) : sdsfromlonglong(intele);
             serverAssert(dictAdd(d,element,NULL) == DICT_OK);
         }
         setTypeReleaseIterator(si);
 
+        if (setobj->encoding == OBJ_ENCODING_INTSET)
+            zfree(setobj->ptr);
+        else if (setobj->encoding == OBJ_ENCODING_ROARING)
+            roaringFree(setobj->ptr);
+        else
+            lpFree(setobj->ptr);
         setobj->encoding = OBJ_ENCODING_HT;
-        zfree(setobj->ptr);
         setobj->ptr = d;
+    } else if (enc == OBJ_ENCODING_LISTPACK &&
+               setobj->encoding == OBJ_ENCODING_INTSET)
+    {
+        unsigned char *lp = lpNew(0);
+        char buf[LONG_STR_SIZE];
+        int64_t intele;
+        uint32_t ii = 0;
+
+        while (intsetGet(setobj->ptr,ii++,&intele)) {
+            int len = ll2string(buf,sizeof(buf),intele);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+        zfree(setobj->ptr);
+        setobj->encoding = OBJ_ENCODING_LISTPACK;
+        setobj->ptr = lp;
+    } else if (enc == OBJ_ENCODING_ROARING &&
+               setobj->encoding == OBJ_ENCODING_INTSET)
+    {
+        roaring *r = roaringNew();
+        int64_t intele;
+        uint32_t ii = 0;
+
+        while (intsetGet(setobj->ptr,ii++,&intele)) roaringAdd(r,intele);
+        zfree(setobj->ptr);
+        setobj->encoding = OBJ_ENCODING_ROARING;
+        setobj->ptr = r;
     } else {
         serverPanic("Unsupported set conversion");
     }
 }
 
+/* Return a set object with the elements of "r", that is released: an
+ * intset if there are few of them, like for sets built element by element,
+ * otherwise a roaring bitmap, or a hash table if they are too sparse or
+ * roaring bitmaps are disabled. */
+robj *setTypeFromRoaring(roaring *r) {
+    robj *o;
+
+    if (roaringCard(r) <= server.set_max_intset_entries) {
+        roaringIter it;
+        int64_t intele;
+
+        o = createIntsetObject();
+        roaringIterInit(r,&it);
+        while (roaringNext(&it,&intele))
+            o->ptr = intsetAdd(o->ptr,intele,NULL);
+        roaringFree(r);
+    } else {
+        o = createObject(OBJ_SET,r);
+        o->encoding = OBJ_ENCODING_ROARING;
+        if (server.set_large_int_encoding != OBJ_ENCODING_ROARING ||
+            setTypeRoaringIsSparse(r)) setTypeConvert(o,OBJ_ENCODING_HT);
+    }
+    return o;
+}
+
 /* This is a helper function for the COPY command.
  * Duplicate a set object, with the guarantee that the returned object
  * has the same encoding as the original one.
@@ -285,6 +514,16 @@ robj *setTypeDup(robj *o) {
         memcpy(newis,is,size);
         set = createObject(OBJ_SET, newis);
         set->encoding = OBJ_ENCODING_INTSET;
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        set = createObject(OBJ_SET, roaringDup(o->ptr));
+        set->encoding = OBJ_ENCODING_ROARING;
+    } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = o->ptr;
+        size_t sz = lpBytes(lp);
+        unsigned char *new_lp = zmalloc(sz);
+        memcpy(new_lp,lp,sz);
+        set = createObject(OBJ_SET, new_lp);
+        set->encoding = OBJ_ENCODING_LISTPACK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         set = createSetObject();
         dict *d = o->ptr;
@@ -300,6 +539,38 @@ robj *setTypeDup(robj *o) {
     return set;
 }
 
+/* callback for to check the listpack doesn't have duplicate records */
+static int _setTypeListpackValidateIntegrity(unsigned char *p, void *userdata) {
+    dict *fields = userdata;
+    unsigned char *str;
+    int64_t vlen;
+
+    str = lpGet(p, &vlen, NULL);
+    sds field = str ? sdsnewlen(str, vlen) : sdsfromlonglong(vlen);
+    if (dictAdd(fields, field, NULL) != DICT_OK) {
+        /* Duplicate, return an error */
+        sdsfree(field);
+        return 0;
+    }
+    return 1;
+}
+
+/* Validate the integrity of the data structure.
+ * when `deep` is 0, only the integrity of the header is validated.
+ * when `deep` is 1, we scan all the entries one by one, and check that
+ * there are no duplicates. */
+int setTypeListpackValidateIntegrity(unsigned char *lp, size_t size, int deep) {
+    if (!deep)
+        return lpValidateIntegrity(lp, size, 0, NULL, NULL);
+
+    /* Keep track of the elements to locate duplicate ones */
+    dict *fields = dictCreate(&hashDictType, NULL);
+    int ret = lpValidateIntegrity(lp, size, 1,
+                                  _setTypeListpackValidateIntegrity, fields);
+    dictRelease(fields);
+    return ret;
+}
+
 void saddCommand(client *c) {
     robj *set;
     int j, added = 0;
@@ -308,7 +579,7 @@ void saddCommand(client *c) {
     if (checkType(c,set,OBJ_SET)) return;
     
     if (set == NULL) {
-        set = setTypeCreate(c->argv[2]->ptr);
+        set = setTypeCreate(c->argv[2]->ptr,c->argc-2);
         dbAdd(c->db,c->argv[1],set);
     }
 
@@ -390,7 +661,7 @@ void smoveCommand(client *c) {
 
     /* Create the destination set when it doesn't exist */
     if (!dstset) {
-        dstset = setTypeCreate(ele->ptr);
+        dstset = setTypeCreate(ele->ptr,1);
         dbAdd(c->db,c->argv[2],dstset);
     }
 
@@ -508,6 +779,8 @@ void spopWithCountCommand(client *c) {
 
     /* Common iteration vars. */
     sds sdsele;
+    char *str;
+    size_t len;
     robj *objele;
     int encoding;
     int64_t llele;
@@ -523,15 +796,15 @@ void spopWithCountCommand(client *c) {
     if (remaining*SPOP_MOVE_STRATEGY_MUL > count) {
         while(count--) {
             /* Emit and remove. */
-            encoding = setTypeRandomElement(set,&sdsele,&llele);
+            encoding = setTypeRandomElement(set,&str,&len,&llele);
             if (encoding == OBJ_ENCODING_INTSET) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
-                set->ptr = intsetRemove(set->ptr,llele,NULL);
+                setTypeRemoveInteger(set,llele);
             } else {
-                addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
-                objele = createStringObject(sdsele,sdslen(sdsele));
-                setTypeRemove(set,sdsele);
+                addReplyBulkCBuffer(c,str,len);
+                objele = createStringObject(str,len);
+                setTypeRemove(set,objele->ptr);
             }
 
             /* Replicate/AOF this command as an SREM operation */
@@ -553,13 +826,13 @@ void spopWithCountCommand(client *c) {
 
         /* Create a new set with just the remaining elements. */
         while(remaining--) {
-            encoding = setTypeRandomElement(set,&sdsele,&llele);
+            encoding = setTypeRandomElement(set,&str,&len,&llele);
             if (encoding == OBJ_ENCODING_INTSET) {
                 sdsele = sdsfromlonglong(llele);
             } else {
-                sdsele = sdsdup(sdsele);
+                sdsele = sdsnewlen(str,len);
             }
-            if (!newset) newset = setTypeCreate(sdsele);
+            if (!newset) newset = setTypeCreate(sdsele,size-count);
             setTypeAdd(newset,sdsele);
             setTypeRemove(set,sdsele);
             sdsfree(sdsele);
@@ -599,7 +872,8 @@ void spopWithCountCommand(client *c) {
 
 void spopCommand(client *c) {
     robj *set, *ele;
-    sds sdsele;
+    char *str;
+    size_t len;
     int64_t llele;
     int encoding;
 
@@ -617,14 +891,14 @@ void spopCommand(client *c) {
          == NULL || checkType(c,set,OBJ_SET)) return;
 
     /* Get a random element from the set */
-    encoding = setTypeRandomElement(set,&sdsele,&llele);
+    encoding = setTypeRandomElement(set,&str,&len,&llele);
 
     /* Remove the element from the set */
     if (encoding == OBJ_ENCODING_INTSET) {
         ele = createStringObjectFromLongLong(llele);
-        set->ptr = intsetRemove(set->ptr,llele,NULL);
+        setTypeRemoveInteger(set,llele);
     } else {
-        ele = createStringObject(sdsele,sdslen(sdsele));
+        ele = createStringObject(str,len);
         setTypeRemove(set,ele->ptr);
     }
 
@@ -662,6 +936,8 @@ void srandmemberWithCountCommand(client *c) {
     int uniq = 1;
     robj *set;
     sds ele;
+    char *str;
+    size_t len;
     int64_t llele;
     int encoding;
 
@@ -695,11 +971,11 @@ void srandmemberWithCountCommand(client *c) {
     if (!uniq || count == 1) {
         addReplyArrayLen(c,count);
         while(count--) {
-            encoding = setTypeRandomElement(set,&ele,&llele);
+            encoding = setTypeRandomElement(set,&str,&len,&llele);
             if (encoding == OBJ_ENCODING_INTSET) {
                 addReplyBulkLongLong(c,llele);
             } else {
-                addReplyBulkCBuffer(c,ele,sdslen(ele));
+                addReplyBulkCBuffer(c,str,len);
             }
         }
         return;
@@ -777,11 +1053,11 @@ void srandmemberWithCountCommand(client *c) {
 
         dictExpand(d, count);
         while (added < count) {
-            encoding = setTypeRandomElement(set,&ele,&llele);
+            encoding = setTypeRandomElement(set,&str,&len,&llele);
             if (encoding == OBJ_ENCODING_INTSET) {
                 sdsele = sdsfromlonglong(llele);
             } else {
-                sdsele = sdsdup(ele);
+                sdsele = sdsnewlen(str,len);
             }
             /* Try to add the object to the dictionary. If it already exists
              * free it, otherwise increment the number of objects we have
@@ -810,7 +1086,8 @@ void srandmemberWithCountCommand(client *c) {
 /* SRANDMEMBER [<count>] */
 void srandmemberCommand(client *c) {
     robj *set;
-    sds ele;
+    char *str;
+    size_t len;
     int64_t llele;
     int encoding;
 
@@ -826,11 +1103,11 @@ void srandmemberCommand(client *c) {
     if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.null[c->resp]))
         == NULL || checkType(c,set,OBJ_SET)) return;
 
-    encoding = setTypeRandomElement(set,&ele,&llele);
+    encoding = setTypeRandomElement(set,&str,&len,&llele);
     if (encoding == OBJ_ENCODING_INTSET) {
         addReplyBulkLongLong(c,llele);
     } else {
-        addReplyBulkCBuffer(c,ele,sdslen(ele));
+        addReplyBulkCBuffer(c,str,len);
     }
 }
 
@@ -914,57 +1191,115 @@ void sinterGenericCommand(client *c, robj **setkeys,
         dstset = createIntsetObject();
     }
 
-    /* Iterate all the elements of the first (smallest) set, and test
-     * the element against all the other sets, if at least one set does
-     * not include the element it is discarded */
-    si = setTypeInitIterator(sets[0]);
-    while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
-        for (j = 1; j < setnum; j++) {
-            if (sets[j] == sets[0]) continue;
-            if (encoding == OBJ_ENCODING_INTSET) {
-                /* intset with intset is simple... and fast */
-                if (sets[j]->encoding == OBJ_ENCODING_INTSET &&
-                    !intsetFind((intset*)sets[j]->ptr,intobj))
-                {
-                    break;
-                /* in order to compare an integer with an object we
-                 * have to use the generic function, creating an object
-                 * for this */
-                } else if (sets[j]->encoding == OBJ_ENCODING_HT) {
-                    elesds = sdsfromlonglong(intobj);
-                    if (!setTypeIsMember(sets[j],elesds)) {
+    int all_intset = 1, all_roaring = 1;
+    for (j = 0; j < setnum; j++) {
+        if (sets[j]->encoding != OBJ_ENCODING_INTSET) all_intset = 0;
+        if (sets[j]->encoding != OBJ_ENCODING_ROARING) all_roaring = 0;
+    }
+
+    if (setnum > 1 && all_roaring) {
+        /* Roaring bitmaps are intersected container by container. */
+        roaring *r = roaringAnd(sets[0]->ptr,sets[1]->ptr);
+        for (j = 2; j < setnum && roaringCard(r); j++) {
+            roaring *next = roaringAnd(r,sets[j]->ptr);
+            roaringFree(r);
+            r = next;
+        }
+
+        if (dstkey) {
+            decrRefCount(dstset);
+            dstset = setTypeFromRoaring(r);
+        } else {
+            roaringIter it;
+
+            cardinality = roaringCard(r);
+            roaringIterInit(r,&it);
+            while (roaringNext(&it,&intobj))
+                addReplyBulkLongLong(c,intobj);
+            roaringFree(r);
+        }
+    } else if (setnum > 1 && all_intset) {
+        /* When all the sets are intsets, intersect their sorted arrays
+         * directly, instead of looking up every element of the smallest
+         * set in the others. */
+        intset *is = intsetIntersect(sets[0]->ptr,sets[1]->ptr);
+        for (j = 2; j < setnum && intsetLen(is); j++) {
+            intset *next = intsetIntersect(is,sets[j]->ptr);
+            zfree(is);
+            is = next;
+        }
+
+        if (dstkey) {
+            zfree(dstset->ptr);
+            dstset->ptr = is;
+            if (intsetLen(is) > server.set_max_intset_entries)
+                setTypeConvert(dstset,OBJ_ENCODING_HT);
+        } else {
+            cardinality = intsetLen(is);
+            for (j = 0; j < cardinality; j++) {
+                intsetGet(is,j,&intobj);
+                addReplyBulkLongLong(c,intobj);
+            }
+            zfree(is);
+        }
+    } else {
+        /* Iterate all the elements of the first (smallest) set, and test
+         * the element against all the other sets, if at least one set does
+         * not include the element it is discarded */
+        si = setTypeInitIterator(sets[0]);
+        while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
+            for (j = 1; j < setnum; j++) {
+                if (sets[j] == sets[0]) continue;
+                if (encoding == OBJ_ENCODING_INTSET) {
+                    /* intset with intset is simple... and fast */
+                    if (sets[j]->encoding == OBJ_ENCODING_INTSET &&
+                        !intsetFind((intset*)sets[j]->ptr,intobj))
+                    {
+                        break;
+                    } else if (sets[j]->encoding == OBJ_ENCODING_ROARING &&
+                               !roaringContains(sets[j]->ptr,intobj))
+                    {
+                        break;
+                    /* in order to compare an integer with an object we
+                     * have to use the generic function, creating an object
+                     * for this */
+                    } else if (sets[j]->encoding == OBJ_ENCODING_HT ||
+                               sets[j]->encoding == OBJ_ENCODING_LISTPACK) {
+                        elesds = sdsfromlonglong(intobj);
+                        if (!setTypeIsMember(sets[j],elesds)) {
+                            sdsfree(elesds);
+                            break;
+                        }
                         sdsfree(elesds);
+                    }
+                } else if (encoding == OBJ_ENCODING_HT) {
+                    if (!setTypeIsMember(sets[j],elesds)) {
                         break;
                     }
-                    sdsfree(elesds);
-                }
-            } else if (encoding == OBJ_ENCODING_HT) {
-                if (!setTypeIsMember(sets[j],elesds)) {
-                    break;
                 }
             }
-        }
 
-        /* Only take action when all sets contain the member */
-        if (j == setnum) {
-            if (!dstkey) {
-                if (encoding == OBJ_ENCODING_HT)
-                    addReplyBulkCBuffer(c,elesds,sdslen(elesds));
-                else
-                    addReplyBulkLongLong(c,intobj);
-                cardinality++;
-            } else {
-                if (encoding == OBJ_ENCODING_INTSET) {
-                    elesds = sdsfromlonglong(intobj);
-                    setTypeAdd(dstset,elesds);
-                    sdsfree(elesds);
+            /* Only take action when all sets contain the member */
+            if (j == setnum) {
+                if (!dstkey) {
+                    if (encoding == OBJ_ENCODING_HT)
+                        addReplyBulkCBuffer(c,elesds,sdslen(elesds));
+                    else
+                        addReplyBulkLongLong(c,intobj);
+                    cardinality++;
                 } else {
-                    setTypeAdd(dstset,elesds);
+                    if (encoding == OBJ_ENCODING_INTSET) {
+                        elesds = sdsfromlonglong(intobj);
+                        setTypeAdd(dstset,elesds);
+                        sdsfree(elesds);
+                    } else {
+                        setTypeAdd(dstset,elesds);
+                    }
                 }
             }
         }
+        setTypeReleaseIterator(si);
     }
-    setTypeReleaseIterator(si);
 
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
@@ -1061,12 +1396,59 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         }
     }
 
+    /* When all the sets hold integers and some are roaring bitmaps, merge
+     * them container by container. For SDIFF the first set must be a
+     * roaring bitmap, otherwise it is small and the generic algorithms are
+     * fast enough. */
+    int roaring_algo = op == SET_OP_UNION || (sets[0] &&
+                       sets[0]->encoding == OBJ_ENCODING_ROARING);
+    int some_roaring = 0;
+    for (j = 0; j < setnum && roaring_algo; j++) {
+        if (!sets[j]) continue;
+        if (sets[j]->encoding == OBJ_ENCODING_ROARING) some_roaring = 1;
+        else if (sets[j]->encoding != OBJ_ENCODING_INTSET) roaring_algo = 0;
+    }
+    if (!some_roaring) roaring_algo = 0;
+
     /* We need a temp set object to store our union. If the dstkey
      * is not NULL (that is, we are inside an SUNIONSTORE operation) then
      * this set object will be the resulting object to set into the target key*/
     dstset = createIntsetObject();
 
-    if (op == SET_OP_UNION) {
+    if (roaring_algo) {
+        roaring *r = NULL;
+
+        for (j = 0; j < setnum; j++) {
+            roaring *next, *tmp = NULL, *cur;
+
+            if (!sets[j]) continue;
+            if (sets[j]->encoding == OBJ_ENCODING_INTSET) {
+                int64_t intele;
+                uint32_t ii = 0;
+
+                tmp = roaringNew();
+                while (intsetGet(sets[j]->ptr,ii++,&intele))
+                    roaringAdd(tmp,intele);
+                cur = tmp;
+            } else {
+                cur = sets[j]->ptr;
+            }
+
+            if (r == NULL)
+                next = roaringDup(cur);
+            else if (op == SET_OP_UNION)
+                next = roaringOr(r,cur);
+            else
+                next = roaringAndNot(r,cur);
+            if (r) roaringFree(r);
+            if (tmp) roaringFree(tmp);
+            r = next;
+            if (op == SET_OP_DIFF && roaringCard(r) == 0) break;
+        }
+        decrRefCount(dstset);
+        dstset = setTypeFromRoaring(r);
+        cardinality = setTypeSize(dstset);
+    } else if (op == SET_OP_UNION) {
         /* Union is trivial, just add every element of every set to the
          * temporary set. */
         for (j = 0; j < setnum; j++) {
@@ -61,6 +61,8 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms) {
         !(c->flags & CLIENT_MASTER) &&  /* No timeout for masters */
         !(c->flags & CLIENT_BLOCKED) && /* No timeout for BLPOP */
         !(c->flags & CLIENT_PUBSUB) &&  /* No timeout for Pub/Sub clients */
+        !(c->flags & CLIENT_SHARD) &&   /* No timeout for shard links */
+        !(c->flags & CLIENT_REPL_STREAM) && /* No timeout for RDB streams */
         (now - c->lastinteraction > server.maxidletime))
     {
         serverLog(LL_VERBOSE,"Closing idle client");
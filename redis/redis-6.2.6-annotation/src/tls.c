@@ -773,6 +773,40 @@ static int connTLSWrite(connection *conn_, const void *data, size_t data_len) {
     return ret;
 }
 
+/* TLS can't write scattered buffers with a single call, so small replies are
+ * concatenated and written at once, that saves records and system calls,
+ * while large ones are written one buffer after the other to avoid copying
+ * them. */
+static int connTLSWritev(connection *conn_, const struct iovec *iov, int iovcnt) {
+    size_t iov_bytes_len = 0;
+
+    if (iovcnt == 1) return connTLSWrite(conn_, iov[0].iov_base, iov[0].iov_len);
+
+    for (int i = 0; i < iovcnt; i++) {
+        iov_bytes_len += iov[i].iov_len;
+        if (iov_bytes_len > NET_MAX_WRITES_PER_EVENT) break;
+    }
+
+    if (iov_bytes_len > NET_MAX_WRITES_PER_EVENT) {
+        int tot_sent = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            int sent = connTLSWrite(conn_, iov[i].iov_base, iov[i].iov_len);
+            if (sent <= 0) return tot_sent > 0 ? tot_sent : sent;
+            tot_sent += sent;
+            if ((size_t)sent != iov[i].iov_len) break;
+        }
+        return tot_sent;
+    }
+
+    char buf[iov_bytes_len];
+    size_t offset = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(buf + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    return connTLSWrite(conn_, buf, iov_bytes_len);
+}
+
 static int connTLSRead(connection *conn_, void *buf, size_t buf_len) {
     tls_connection *conn = (tls_connection *) conn_;
     int ret;
@@ -928,6 +962,7 @@ ConnectionType CT_TLS = {
     .blocking_connect = connTLSBlockingConnect,
     .read = connTLSRead,
     .write = connTLSWrite,
+    .writev = connTLSWritev,
     .close = connTLSClose,
     .set_write_handler = connTLSSetWriteHandler,
     .set_read_handler = connTLSSetReadHandler,
@@ -40,6 +40,7 @@
 #include <stdint.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "util.h"
 #include "sha256.h"
@@ -539,7 +540,7 @@ int string2d(const char *s, size_t slen, double *dp) {
  * required. The representation should always be parsable by strtod(3).
  * This function does not support human-friendly formatting like ld2string
  * does. It is intended mainly to be used inside t_zset.c when writing scores
- * into a ziplist representing a sorted set. */
+ * into a listpack representing a sorted set. */
 int d2string(char *buf, size_t len, double value) {
     if (isnan(value)) {
         len = snprintf(buf,len,"nan");
@@ -797,6 +798,36 @@ int pathIsBaseName(char *path) {
     return strchr(path,'/') == NULL && strchr(path,'\\') == NULL;
 }
 
+/* Return 1 if 'filename' exists and is a regular file. */
+int fileExist(char *filename) {
+    struct stat statbuf;
+    return stat(filename,&statbuf) == 0 && S_ISREG(statbuf.st_mode);
+}
+
+/* Return 1 if 'dname' exists and is a directory. */
+int dirExists(char *dname) {
+    struct stat statbuf;
+    return stat(dname,&statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+}
+
+/* Create the directory 'dname' if it doesn't exist. Returns 0 on success,
+ * -1 on error with errno set. */
+int dirCreateIfMissing(char *dname) {
+    if (mkdir(dname,0755) != 0) {
+        if (errno != EEXIST) return -1;
+        if (!dirExists(dname)) {
+            errno = ENOTDIR;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Return the sds string "path/filename". */
+sds makePath(char *path, char *filename) {
+    return sdscatfmt(sdsempty(),"%s/%s",path,filename);
+}
+
 #ifdef REDIS_TEST
 #include <assert.h>
 
@@ -64,6 +64,10 @@ int ld2string(char *buf, size_t len, long double value, ld2string_mode mode);
 sds getAbsolutePath(char *filename);
 long getTimeZone(void);
 int pathIsBaseName(char *path);
+int fileExist(char *filename);
+int dirExists(char *dname);
+int dirCreateIfMissing(char *dname);
+sds makePath(char *path, char *filename);
 
 #ifdef REDIS_TEST
 int utilTest(int argc, char **argv, int accurate);
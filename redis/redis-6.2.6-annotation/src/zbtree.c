@@ -0,0 +1,810 @@
+/* Order statistic B+tree of (score, element) entries, used by the sorted
+ * sets with the OBJ_ENCODING_BTREE encoding (see t_zset.c).
+ *
+ * The entries are ordered by score, then by element, as in the skiplist.
+ * They are packed in arrays in the leaves, that are linked together, so
+ * that walking a range touches a few contiguous nodes instead of chasing a
+ * pointer per element. Inner nodes keep the smallest entry of each child
+ * to descend the tree, and the number of entries below each child, so that
+ * the rank of an entry, or the entry at a given rank, is found in a single
+ * descent.
+ *
+ * The tree owns the element strings: they are freed with the tree, or by
+ * zbtDelete() if asked to. Sorted sets share them with their dictionary.
+ *
+ * Copyright (c) 2009-2021, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "zbtree.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+/* A node with less entries (or children) than this is merged with, or
+ * takes entries from, one of its siblings. It is low enough that the two
+ * halves of a split node are far from it, so that inserting and deleting
+ * around the same entry doesn't split and merge nodes over and over. */
+#define ZBTREE_LEAF_MIN (ZBTREE_LEAF_ENTRIES/3)
+#define ZBTREE_INNER_MIN (ZBTREE_INNER_CHILDREN/3)
+
+/* -----------------------------------------------------------------------------
+ * Nodes
+ * -------------------------------------------------------------------------- */
+
+static inline int zbtCompare(double s1, sds e1, double s2, sds e2) {
+    if (s1 < s2) return -1;
+    if (s1 > s2) return 1;
+    return sdscmp(e1,e2);
+}
+
+static zbtreeLeaf *zbtLeafCreate(zbtree *zbt) {
+    zbtreeLeaf *leaf = zmalloc(sizeof(*leaf));
+    leaf->prev = leaf->next = NULL;
+    leaf->count = 0;
+    zbt->leaves++;
+    return leaf;
+}
+
+static void zbtLeafFree(zbtree *zbt, zbtreeLeaf *leaf) {
+    zfree(leaf);
+    zbt->leaves--;
+}
+
+static zbtreeInner *zbtInnerCreate(zbtree *zbt) {
+    zbtreeInner *in = zmalloc(sizeof(*in));
+    in->count = 0;
+    zbt->inners++;
+    return in;
+}
+
+static void zbtInnerFree(zbtree *zbt, zbtreeInner *in) {
+    zfree(in);
+    zbt->inners--;
+}
+
+/* Number of entries of a leaf, or of children of an inner node. */
+static inline unsigned int zbtNodeCount(void *node, int height) {
+    if (height == 0) return ((zbtreeLeaf*)node)->count;
+    return ((zbtreeInner*)node)->count;
+}
+
+/* Number of entries below a node. */
+static unsigned long zbtNodeSize(void *node, int height) {
+    if (height == 0) return ((zbtreeLeaf*)node)->count;
+    zbtreeInner *in = node;
+    unsigned long size = 0;
+    for (unsigned int j = 0; j < in->count; j++) size += in->sizes[j];
+    return size;
+}
+
+/* Set the key of the child 'i' of 'in', at 'height', to its smallest
+ * entry. */
+static void zbtInnerUpdateKey(zbtreeInner *in, unsigned int i, int height) {
+    if (height == 0) {
+        zbtreeLeaf *child = in->children[i];
+        in->scores[i] = child->scores[0];
+        in->eles[i] = child->eles[0];
+    } else {
+        zbtreeInner *child = in->children[i];
+        in->scores[i] = child->scores[0];
+        in->eles[i] = child->eles[0];
+    }
+}
+
+/* Index of the first entry of the leaf that is not smaller than
+ * (score, ele). */
+static unsigned int zbtLeafLowerBound(zbtreeLeaf *leaf, double score, sds ele) {
+    unsigned int lo = 0, hi = leaf->count;
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (zbtCompare(leaf->scores[mid],leaf->eles[mid],score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Index of the child of 'in' where (score, ele) is, or should be: the last
+ * one whose smallest entry is not greater. */
+static unsigned int zbtInnerFindChild(zbtreeInner *in, double score, sds ele) {
+    unsigned int lo = 1, hi = in->count;
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (zbtCompare(in->scores[mid],in->eles[mid],score,ele) <= 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo-1;
+}
+
+static void zbtLeafInsertAt(zbtreeLeaf *leaf, unsigned int pos, double score, sds ele) {
+    unsigned int tail = leaf->count-pos;
+    memmove(leaf->scores+pos+1,leaf->scores+pos,sizeof(double)*tail);
+    memmove(leaf->eles+pos+1,leaf->eles+pos,sizeof(sds)*tail);
+    leaf->scores[pos] = score;
+    leaf->eles[pos] = ele;
+    leaf->count++;
+}
+
+static void zbtLeafRemoveAt(zbtreeLeaf *leaf, unsigned int pos) {
+    unsigned int tail = leaf->count-pos-1;
+    memmove(leaf->scores+pos,leaf->scores+pos+1,sizeof(double)*tail);
+    memmove(leaf->eles+pos,leaf->eles+pos+1,sizeof(sds)*tail);
+    leaf->count--;
+}
+
+/* Move the first 'n' entries of 'right' at the end of 'left'. */
+static void zbtLeafMoveLeft(zbtreeLeaf *left, zbtreeLeaf *right, unsigned int n) {
+    memcpy(left->scores+left->count,right->scores,sizeof(double)*n);
+    memcpy(left->eles+left->count,right->eles,sizeof(sds)*n);
+    left->count += n;
+    right->count -= n;
+    memmove(right->scores,right->scores+n,sizeof(double)*right->count);
+    memmove(right->eles,right->eles+n,sizeof(sds)*right->count);
+}
+
+/* Move the last 'n' entries of 'left' at the start of 'right'. */
+static void zbtLeafMoveRight(zbtreeLeaf *left, zbtreeLeaf *right, unsigned int n) {
+    memmove(right->scores+n,right->scores,sizeof(double)*right->count);
+    memmove(right->eles+n,right->eles,sizeof(sds)*right->count);
+    left->count -= n;
+    memcpy(right->scores,left->scores+left->count,sizeof(double)*n);
+    memcpy(right->eles,left->eles+left->count,sizeof(sds)*n);
+    right->count += n;
+}
+
+static void zbtInnerInsertAt(zbtreeInner *in, unsigned int pos, void *child,
+                             unsigned long size, int height)
+{
+    unsigned int tail = in->count-pos;
+    memmove(in->scores+pos+1,in->scores+pos,sizeof(double)*tail);
+    memmove(in->eles+pos+1,in->eles+pos,sizeof(sds)*tail);
+    memmove(in->sizes+pos+1,in->sizes+pos,sizeof(unsigned long)*tail);
+    memmove(in->children+pos+1,in->children+pos,sizeof(void*)*tail);
+    in->children[pos] = child;
+    in->sizes[pos] = size;
+    in->count++;
+    zbtInnerUpdateKey(in,pos,height);
+}
+
+static void zbtInnerRemoveAt(zbtreeInner *in, unsigned int pos) {
+    unsigned int tail = in->count-pos-1;
+    memmove(in->scores+pos,in->scores+pos+1,sizeof(double)*tail);
+    memmove(in->eles+pos,in->eles+pos+1,sizeof(sds)*tail);
+    memmove(in->sizes+pos,in->sizes+pos+1,sizeof(unsigned long)*tail);
+    memmove(in->children+pos,in->children+pos+1,sizeof(void*)*tail);
+    in->count--;
+}
+
+/* Move the first 'n' children of 'right' at the end of 'left'. */
+static void zbtInnerMoveLeft(zbtreeInner *left, zbtreeInner *right, unsigned int n) {
+    memcpy(left->scores+left->count,right->scores,sizeof(double)*n);
+    memcpy(left->eles+left->count,right->eles,sizeof(sds)*n);
+    memcpy(left->sizes+left->count,right->sizes,sizeof(unsigned long)*n);
+    memcpy(left->children+left->count,right->children,sizeof(void*)*n);
+    left->count += n;
+    right->count -= n;
+    memmove(right->scores,right->scores+n,sizeof(double)*right->count);
+    memmove(right->eles,right->eles+n,sizeof(sds)*right->count);
+    memmove(right->sizes,right->sizes+n,sizeof(unsigned long)*right->count);
+    memmove(right->children,right->children+n,sizeof(void*)*right->count);
+}
+
+/* Move the last 'n' children of 'left' at the start of 'right'. */
+static void zbtInnerMoveRight(zbtreeInner *left, zbtreeInner *right, unsigned int n) {
+    memmove(right->scores+n,right->scores,sizeof(double)*right->count);
+    memmove(right->eles+n,right->eles,sizeof(sds)*right->count);
+    memmove(right->sizes+n,right->sizes,sizeof(unsigned long)*right->count);
+    memmove(right->children+n,right->children,sizeof(void*)*right->count);
+    left->count -= n;
+    memcpy(right->scores,left->scores+left->count,sizeof(double)*n);
+    memcpy(right->eles,left->eles+left->count,sizeof(sds)*n);
+    memcpy(right->sizes,left->sizes+left->count,sizeof(unsigned long)*n);
+    memcpy(right->children,left->children+left->count,sizeof(void*)*n);
+    right->count += n;
+}
+
+/* -----------------------------------------------------------------------------
+ * Insertion and deletion
+ * -------------------------------------------------------------------------- */
+
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbt->leaves = zbt->inners = 0;
+    zbt->root = zbt->head = zbt->tail = zbtLeafCreate(zbt);
+    zbt->length = 0;
+    zbt->height = 0;
+    return zbt;
+}
+
+static void zbtFreeNode(void *node, int height) {
+    if (height == 0) {
+        zbtreeLeaf *leaf = node;
+        for (unsigned int j = 0; j < leaf->count; j++) sdsfree(leaf->eles[j]);
+    } else {
+        zbtreeInner *in = node;
+        for (unsigned int j = 0; j < in->count; j++)
+            zbtFreeNode(in->children[j],height-1);
+    }
+    zfree(node);
+}
+
+/* Free the tree, with the elements. */
+void zbtFree(zbtree *zbt) {
+    zbtFreeNode(zbt->root,zbt->height);
+    zfree(zbt);
+}
+
+/* Insert the entry in the subtree 'node'. If the node is full it is split,
+ * and the new node, holding its upper half, is returned to be added to the
+ * parent. Otherwise NULL is returned. */
+static void *zbtInsertNode(zbtree *zbt, void *node, int height, double score, sds ele) {
+    if (height == 0) {
+        zbtreeLeaf *leaf = node, *right = NULL;
+        unsigned int pos = zbtLeafLowerBound(leaf,score,ele);
+
+        if (leaf->count == ZBTREE_LEAF_ENTRIES) {
+            /* Split the leaf in half, unless the entry goes past the end of
+             * the last leaf, or before the start of the first one: when
+             * the entries are added in order, like when loading the sorted
+             * set, this fills the leaves instead of leaving them half
+             * empty. */
+            unsigned int moved = leaf->count/2;
+            if (pos == leaf->count && leaf == zbt->tail) moved = 0;
+            else if (pos == 0 && leaf == zbt->head) moved = leaf->count;
+
+            right = zbtLeafCreate(zbt);
+            zbtLeafMoveRight(leaf,right,moved);
+            right->prev = leaf;
+            right->next = leaf->next;
+            if (leaf->next) leaf->next->prev = right;
+            else zbt->tail = right;
+            leaf->next = right;
+            if (pos > leaf->count || leaf->count == ZBTREE_LEAF_ENTRIES) {
+                zbtLeafInsertAt(right,pos-leaf->count,score,ele);
+                return right;
+            }
+        }
+        zbtLeafInsertAt(leaf,pos,score,ele);
+        return right;
+    }
+
+    zbtreeInner *in = node, *right = NULL;
+    unsigned int i = zbtInnerFindChild(in,score,ele);
+    void *newchild = zbtInsertNode(zbt,in->children[i],height-1,score,ele);
+    zbtInnerUpdateKey(in,i,height-1);
+    if (newchild == NULL) {
+        in->sizes[i]++;
+        return NULL;
+    }
+
+    /* The child was split: add the new one after it. */
+    in->sizes[i] = zbtNodeSize(in->children[i],height-1);
+    unsigned long newsize = zbtNodeSize(newchild,height-1);
+    i++;
+    if (in->count == ZBTREE_INNER_CHILDREN) {
+        right = zbtInnerCreate(zbt);
+        zbtInnerMoveRight(in,right,in->count/2);
+        if (i > in->count) {
+            zbtInnerInsertAt(right,i-in->count,newchild,newsize,height-1);
+            return right;
+        }
+    }
+    zbtInnerInsertAt(in,i,newchild,newsize,height-1);
+    return right;
+}
+
+/* Insert a new entry. The element must not be already in the tree, and
+ * is now owned by the tree. */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    void *right = zbtInsertNode(zbt,zbt->root,zbt->height,score,ele);
+    if (right) {
+        /* The root was split: grow the tree. */
+        zbtreeInner *root = zbtInnerCreate(zbt);
+        zbtInnerInsertAt(root,0,zbt->root,
+            zbtNodeSize(zbt->root,zbt->height),zbt->height);
+        zbtInnerInsertAt(root,1,right,
+            zbtNodeSize(right,zbt->height),zbt->height);
+        zbt->root = root;
+        zbt->height++;
+    }
+    zbt->length++;
+}
+
+/* Fix the child 'i' of 'in', that has too few entries, by merging it with
+ * one of its siblings, or moving some entries of the sibling to it if they
+ * don't fit a single node. */
+static void zbtRebalance(zbtree *zbt, zbtreeInner *in, unsigned int i, int height) {
+    unsigned int li = (i+1 < in->count) ? i : i-1;
+    void *left = in->children[li], *right = in->children[li+1];
+    unsigned int lcount = zbtNodeCount(left,height);
+    unsigned int rcount = zbtNodeCount(right,height);
+    unsigned int max = height == 0 ? ZBTREE_LEAF_ENTRIES : ZBTREE_INNER_CHILDREN;
+
+    if (lcount+rcount <= max) {
+        if (height == 0) {
+            zbtreeLeaf *l = left, *r = right;
+            zbtLeafMoveLeft(l,r,rcount);
+            l->next = r->next;
+            if (r->next) r->next->prev = l;
+            else zbt->tail = l;
+            zbtLeafFree(zbt,r);
+        } else {
+            zbtInnerMoveLeft(left,right,rcount);
+            zbtInnerFree(zbt,right);
+        }
+        in->sizes[li] += in->sizes[li+1];
+        zbtInnerRemoveAt(in,li+1);
+    } else {
+        unsigned int target = (lcount+rcount)/2;
+        if (height == 0) {
+            if (lcount < target) zbtLeafMoveLeft(left,right,target-lcount);
+            else zbtLeafMoveRight(left,right,lcount-target);
+        } else {
+            if (lcount < target) zbtInnerMoveLeft(left,right,target-lcount);
+            else zbtInnerMoveRight(left,right,lcount-target);
+        }
+        in->sizes[li] = zbtNodeSize(left,height);
+        in->sizes[li+1] = zbtNodeSize(right,height);
+        zbtInnerUpdateKey(in,li+1,height);
+    }
+    zbtInnerUpdateKey(in,li,height);
+}
+
+static int zbtDeleteNode(zbtree *zbt, void *node, int height, double score,
+                         sds ele, int free_ele)
+{
+    if (height == 0) {
+        zbtreeLeaf *leaf = node;
+        unsigned int pos = zbtLeafLowerBound(leaf,score,ele);
+        if (pos == leaf->count ||
+            zbtCompare(leaf->scores[pos],leaf->eles[pos],score,ele) != 0)
+            return 0;
+        if (free_ele) sdsfree(leaf->eles[pos]);
+        zbtLeafRemoveAt(leaf,pos);
+        return 1;
+    }
+
+    /* Note that when the smallest entry of a child is deleted the keys of
+     * its ancestors reference a freed element, until they are updated here
+     * while returning. */
+    zbtreeInner *in = node;
+    unsigned int i = zbtInnerFindChild(in,score,ele);
+    if (!zbtDeleteNode(zbt,in->children[i],height-1,score,ele,free_ele))
+        return 0;
+    in->sizes[i]--;
+    unsigned int min = height-1 == 0 ? ZBTREE_LEAF_MIN : ZBTREE_INNER_MIN;
+    if (zbtNodeCount(in->children[i],height-1) < min)
+        zbtRebalance(zbt,in,i,height-1);
+    else
+        zbtInnerUpdateKey(in,i,height-1);
+    return 1;
+}
+
+/* Delete an entry, freeing its element if 'free_ele' is true. Returns 1 if
+ * the entry was found and deleted, 0 otherwise. */
+int zbtDelete(zbtree *zbt, double score, sds ele, int free_ele) {
+    if (!zbtDeleteNode(zbt,zbt->root,zbt->height,score,ele,free_ele))
+        return 0;
+    zbt->length--;
+
+    /* Shrink the tree while the root has a single child. */
+    while (zbt->height > 0 && ((zbtreeInner*)zbt->root)->count == 1) {
+        zbtreeInner *root = zbt->root;
+        zbt->root = root->children[0];
+        zbt->height--;
+        zbtInnerFree(zbt,root);
+    }
+    return 1;
+}
+
+struct zbtEntry {
+    double score;
+    sds ele;
+};
+
+static int zbtBeforeEntry(double score, sds ele, void *privdata) {
+    struct zbtEntry *entry = privdata;
+    return zbtCompare(score,ele,entry->score,entry->ele) < 0;
+}
+
+/* Update the score of an entry, that must exist. The entry is updated in
+ * place when it keeps its position and it is not the first of its leaf,
+ * that is the only case where the keys of the inner nodes reference it. */
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore) {
+    struct zbtEntry entry = {curscore, ele};
+    zbtreeIter it;
+
+    int found = zbtSeek(zbt,zbtBeforeEntry,&entry,&it,NULL);
+    assert(found && zbtIterEle(&it) == ele);
+    zbtreeLeaf *leaf = it.leaf;
+    unsigned int pos = it.pos;
+    if (pos > 0 && pos+1 < leaf->count &&
+        zbtCompare(leaf->scores[pos-1],leaf->eles[pos-1],newscore,ele) < 0 &&
+        zbtCompare(newscore,ele,leaf->scores[pos+1],leaf->eles[pos+1]) < 0)
+    {
+        leaf->scores[pos] = newscore;
+        return;
+    }
+    zbtDelete(zbt,curscore,ele,0);
+    zbtInsert(zbt,newscore,ele);
+}
+
+/* -----------------------------------------------------------------------------
+ * Lookups and iteration
+ * -------------------------------------------------------------------------- */
+
+/* Find the first entry for which the 'before' predicate is false. Returns
+ * 1 and sets 'it' to its position if there is one, 0 otherwise. If 'index'
+ * is not NULL it is set to the 0-based rank of the entry, or to the length
+ * of the tree if there is none. */
+int zbtSeek(zbtree *zbt, zbtreeBeforeFn *before, void *privdata,
+            zbtreeIter *it, unsigned long *index)
+{
+    void *node = zbt->root;
+    unsigned long idx = 0;
+    unsigned int lo, hi;
+
+    for (int height = zbt->height; height > 0; height--) {
+        zbtreeInner *in = node;
+        /* Descend into the last child whose smallest entry is before: the
+         * ones after it only hold entries that are not. */
+        lo = 1;
+        hi = in->count;
+        while (lo < hi) {
+            unsigned int mid = (lo+hi)/2;
+            if (before(in->scores[mid],in->eles[mid],privdata)) lo = mid+1;
+            else hi = mid;
+        }
+        for (unsigned int j = 0; j < lo-1; j++) idx += in->sizes[j];
+        node = in->children[lo-1];
+    }
+
+    zbtreeLeaf *leaf = node;
+    lo = 0;
+    hi = leaf->count;
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (before(leaf->scores[mid],leaf->eles[mid],privdata)) lo = mid+1;
+        else hi = mid;
+    }
+    idx += lo;
+    if (index) *index = idx;
+
+    /* All the entries of the leaf are before: the one we look for is the
+     * first of the next leaf, if any. */
+    if (lo == leaf->count) {
+        leaf = leaf->next;
+        lo = 0;
+        if (leaf == NULL) return 0;
+    }
+    it->leaf = leaf;
+    it->pos = lo;
+    return 1;
+}
+
+/* Set 'it' to the entry with the given 0-based rank. Returns 0 if the rank
+ * is out of range. */
+int zbtSeekByIndex(zbtree *zbt, unsigned long index, zbtreeIter *it) {
+    void *node = zbt->root;
+
+    if (index >= zbt->length) return 0;
+    for (int height = zbt->height; height > 0; height--) {
+        zbtreeInner *in = node;
+        unsigned int j = 0;
+        while (index >= in->sizes[j]) index -= in->sizes[j++];
+        node = in->children[j];
+    }
+    it->leaf = node;
+    it->pos = index;
+    return 1;
+}
+
+/* Find the rank of an entry. Returns 0 when the entry is not found, or the
+ * 1-based rank otherwise, like zslGetRank(). */
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele) {
+    struct zbtEntry entry = {score, ele};
+    zbtreeIter it;
+    unsigned long index;
+
+    if (!zbtSeek(zbt,zbtBeforeEntry,&entry,&it,&index)) return 0;
+    if (zbtCompare(zbtIterScore(&it),zbtIterEle(&it),score,ele) != 0)
+        return 0;
+    return index+1;
+}
+
+int zbtFirst(zbtree *zbt, zbtreeIter *it) {
+    if (zbt->length == 0) return 0;
+    it->leaf = zbt->head;
+    it->pos = 0;
+    return 1;
+}
+
+int zbtLast(zbtree *zbt, zbtreeIter *it) {
+    if (zbt->length == 0) return 0;
+    it->leaf = zbt->tail;
+    it->pos = zbt->tail->count-1;
+    return 1;
+}
+
+/* Move to the next entry. Returns 0 when the end is reached. */
+int zbtNext(zbtreeIter *it) {
+    if (++it->pos < it->leaf->count) return 1;
+    it->leaf = it->leaf->next;
+    it->pos = 0;
+    return it->leaf != NULL;
+}
+
+/* Move to the previous entry. Returns 0 when the start is reached. */
+int zbtPrev(zbtreeIter *it) {
+    if (it->pos > 0) {
+        it->pos--;
+        return 1;
+    }
+    it->leaf = it->leaf->prev;
+    if (it->leaf == NULL) return 0;
+    it->pos = it->leaf->count-1;
+    return 1;
+}
+
+/* Replace the element of an entry with 'newele', an equal string at a new
+ * address, like after the element was reallocated. 'oldele' is only compared
+ * by address, so it can be already freed. */
+void zbtReplaceEle(zbtree *zbt, double score, sds oldele, sds newele) {
+    void *node = zbt->root;
+    unsigned int lo, hi;
+
+    for (int height = zbt->height; height > 0; height--) {
+        zbtreeInner *in = node;
+        lo = 1;
+        hi = in->count;
+        while (lo < hi) {
+            unsigned int mid = (lo+hi)/2;
+            if (in->eles[mid] == oldele ||
+                zbtCompare(in->scores[mid],in->eles[mid],score,newele) <= 0)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        /* The entry is the smallest of the child: its key references it. */
+        if (in->eles[lo-1] == oldele) in->eles[lo-1] = newele;
+        node = in->children[lo-1];
+    }
+
+    zbtreeLeaf *leaf = node;
+    lo = 0;
+    hi = leaf->count;
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (leaf->eles[mid] != oldele &&
+            zbtCompare(leaf->scores[mid],leaf->eles[mid],score,newele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    assert(lo < leaf->count && leaf->eles[lo] == oldele);
+    leaf->eles[lo] = newele;
+}
+
+/* Memory used by the tree, not counting the elements. */
+size_t zbtAllocSize(zbtree *zbt) {
+    return sizeof(*zbt) + zbt->leaves*sizeof(zbtreeLeaf) +
+           zbt->inners*sizeof(zbtreeInner);
+}
+
+static void *zbtDefragNode(zbtree *zbt, void *node, int height,
+                           void *(*defragfn)(void *ptr), unsigned long *moved)
+{
+    if (height > 0) {
+        zbtreeInner *in = node;
+        for (unsigned int j = 0; j < in->count; j++)
+            in->children[j] = zbtDefragNode(zbt,in->children[j],height-1,
+                                            defragfn,moved);
+    }
+    void *newnode = defragfn(node);
+    if (newnode == NULL) return node;
+    (*moved)++;
+    if (height == 0) {
+        zbtreeLeaf *leaf = newnode;
+        if (leaf->prev) leaf->prev->next = leaf;
+        else zbt->head = leaf;
+        if (leaf->next) leaf->next->prev = leaf;
+        else zbt->tail = leaf;
+    }
+    return newnode;
+}
+
+/* Relocate the nodes of the tree with 'defragfn', that returns the new
+ * pointer of the allocation if it was moved, or NULL. Returns the number of
+ * relocated nodes. */
+unsigned long zbtDefragNodes(zbtree *zbt, void *(*defragfn)(void *ptr)) {
+    unsigned long moved = 0;
+    zbt->root = zbtDefragNode(zbt,zbt->root,zbt->height,defragfn,&moved);
+    return moved;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static long long zbtUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Check the invariants of the subtree, returning its number of entries. */
+static unsigned long zbtVerifyNode(zbtree *zbt, void *node, int height, int isroot) {
+    if (height == 0) {
+        zbtreeLeaf *leaf = node;
+        assert(isroot || leaf->count > 0);
+        for (unsigned int j = 1; j < leaf->count; j++)
+            assert(zbtCompare(leaf->scores[j-1],leaf->eles[j-1],
+                              leaf->scores[j],leaf->eles[j]) < 0);
+        return leaf->count;
+    }
+    zbtreeInner *in = node;
+    unsigned long size = 0;
+    assert(in->count >= (isroot ? 2 : ZBTREE_INNER_MIN));
+    for (unsigned int j = 0; j < in->count; j++) {
+        unsigned long childsize = zbtVerifyNode(zbt,in->children[j],height-1,0);
+        double score;
+        sds ele;
+        if (height == 1) {
+            score = ((zbtreeLeaf*)in->children[j])->scores[0];
+            ele = ((zbtreeLeaf*)in->children[j])->eles[0];
+        } else {
+            score = ((zbtreeInner*)in->children[j])->scores[0];
+            ele = ((zbtreeInner*)in->children[j])->eles[0];
+        }
+        assert(in->sizes[j] == childsize);
+        assert(in->scores[j] == score && in->eles[j] == ele);
+        size += childsize;
+    }
+    return size;
+}
+
+static int zbtTestCompareEntries(const void *a, const void *b) {
+    const struct zbtEntry *ea = a, *eb = b;
+    return zbtCompare(ea->score,ea->ele,eb->score,eb->ele);
+}
+
+static int zbtBeforeScore(double score, sds ele, void *privdata) {
+    (void)ele;
+    return score < *(double*)privdata;
+}
+
+int zbtreeTest(int argc, char *argv[], int accurate) {
+    int count = accurate ? 1000000 : 100000;
+    struct zbtEntry *entries = zmalloc(sizeof(*entries)*count);
+    zbtree *zbt = zbtCreate();
+    zbtreeIter it;
+    long long start;
+    int j;
+    (void)argc;
+    (void)argv;
+
+    printf("Insert %d entries: ", count);
+    srand(1234);
+    start = zbtUstime();
+    for (j = 0; j < count; j++) {
+        entries[j].score = rand() % (count/4);
+        entries[j].ele = sdsfromlonglong(j);
+        zbtInsert(zbt,entries[j].score,entries[j].ele);
+    }
+    printf("%lld usec\n", zbtUstime()-start);
+    assert(zbtVerifyNode(zbt,zbt->root,zbt->height,1) == (unsigned long)count);
+    assert(zbtLength(zbt) == (unsigned long)count);
+
+    printf("Entries are in order, with the right ranks: ");
+    qsort(entries,count,sizeof(*entries),zbtTestCompareEntries);
+    start = zbtUstime();
+    j = 0;
+    if (zbtFirst(zbt,&it)) {
+        do {
+            assert(zbtIterEle(&it) == entries[j].ele);
+            j++;
+        } while(zbtNext(&it));
+    }
+    assert(j == count);
+    for (j = 0; j < count; j++) {
+        assert(zbtGetRank(zbt,entries[j].score,entries[j].ele) ==
+               (unsigned long)j+1);
+        assert(zbtSeekByIndex(zbt,j,&it) && zbtIterEle(&it) == entries[j].ele);
+    }
+    printf("%lld usec\n", zbtUstime()-start);
+
+    printf("Seek by score: ");
+    for (j = 0; j < 1000; j++) {
+        double score = rand() % (count/4+1);
+        unsigned long index;
+        int found = zbtSeek(zbt,zbtBeforeScore,&score,&it,&index);
+        unsigned long expected = 0;
+        while (expected < (unsigned long)count && entries[expected].score < score)
+            expected++;
+        assert(index == expected);
+        assert(found == (expected < (unsigned long)count));
+        if (found) assert(zbtIterEle(&it) == entries[expected].ele);
+    }
+    printf("OK\n");
+
+    printf("Update scores: ");
+    for (j = 0; j < count; j += 3) {
+        double newscore = entries[j].score + (rand() % 5) - 2;
+        if (zbtGetRank(zbt,newscore,entries[j].ele)) continue;
+        zbtUpdateScore(zbt,entries[j].score,entries[j].ele,newscore);
+        entries[j].score = newscore;
+    }
+    qsort(entries,count,sizeof(*entries),zbtTestCompareEntries);
+    assert(zbtVerifyNode(zbt,zbt->root,zbt->height,1) == (unsigned long)count);
+    j = 0;
+    zbtLast(zbt,&it);
+    do {
+        assert(zbtIterEle(&it) == entries[count-1-j].ele);
+        j++;
+    } while(zbtPrev(&it));
+    assert(j == count);
+    printf("OK\n");
+
+    printf("Delete all the entries: ");
+    start = zbtUstime();
+    for (j = 0; j < count; j++) {
+        int k = j + rand() % (count-j);
+        struct zbtEntry tmp = entries[j];
+        entries[j] = entries[k];
+        entries[k] = tmp;
+        assert(zbtDelete(zbt,entries[j].score,entries[j].ele,1) == 1);
+        if (j % 10000 == 0)
+            assert(zbtVerifyNode(zbt,zbt->root,zbt->height,1) ==
+                   (unsigned long)(count-j-1));
+    }
+    printf("%lld usec\n", zbtUstime()-start);
+    assert(zbtLength(zbt) == 0 && zbt->height == 0 && zbt->leaves == 1);
+    assert(!zbtFirst(zbt,&it) && !zbtLast(zbt,&it));
+    zbtFree(zbt);
+
+    printf("Entries added in order fill the leaves: ");
+    for (int desc = 0; desc <= 1; desc++) {
+        zbt = zbtCreate();
+        for (j = 0; j < count; j++)
+            zbtInsert(zbt,desc ? count-j : j,sdsfromlonglong(j));
+        assert(zbtVerifyNode(zbt,zbt->root,zbt->height,1) == (unsigned long)count);
+        assert(zbt->leaves == (unsigned long)(count+ZBTREE_LEAF_ENTRIES-1)/ZBTREE_LEAF_ENTRIES);
+        zbtFree(zbt);
+    }
+    printf("OK\n");
+
+    zfree(entries);
+    printf("Done testing zbtree.\n");
+    return 0;
+}
+#endif
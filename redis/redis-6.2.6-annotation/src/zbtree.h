@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2009-2021, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ZBTREE_H
+#define __ZBTREE_H
+
+#include "sds.h"
+
+/* Both kinds of nodes are sized to fit a 1024 bytes allocation. */
+#define ZBTREE_LEAF_ENTRIES 62    /* Max entries of a leaf. */
+#define ZBTREE_INNER_CHILDREN 31  /* Max children of an inner node. */
+
+/* Leaves hold the (score, element) entries in order, packed in two arrays,
+ * and are linked together so that ranges are walked without going up in
+ * the tree. */
+typedef struct zbtreeLeaf {
+    struct zbtreeLeaf *prev, *next;
+    unsigned int count;
+    double scores[ZBTREE_LEAF_ENTRIES];
+    sds eles[ZBTREE_LEAF_ENTRIES];
+} zbtreeLeaf;
+
+/* Inner nodes remember the smallest entry of every child, used to find
+ * the child to descend into, and the number of entries below it, used to
+ * compute ranks and to seek by rank. */
+typedef struct zbtreeInner {
+    unsigned int count;
+    double scores[ZBTREE_INNER_CHILDREN];
+    sds eles[ZBTREE_INNER_CHILDREN];
+    unsigned long sizes[ZBTREE_INNER_CHILDREN];
+    void *children[ZBTREE_INNER_CHILDREN];
+} zbtreeInner;
+
+typedef struct zbtree {
+    void *root;             /* A leaf when height is 0. */
+    zbtreeLeaf *head, *tail;
+    unsigned long length;   /* Number of entries. */
+    int height;             /* Levels of inner nodes above the leaves. */
+    unsigned long leaves;   /* Number of leaves, for memory usage. */
+    unsigned long inners;   /* Number of inner nodes, for memory usage. */
+} zbtree;
+
+/* Position of an entry, valid until the tree is modified. */
+typedef struct zbtreeIter {
+    zbtreeLeaf *leaf;
+    unsigned int pos;
+} zbtreeIter;
+
+/* Predicate used by zbtSeek(): true for the entries before the one to
+ * find. It must be true for a prefix of the entries and false after. */
+typedef int zbtreeBeforeFn(double score, sds ele, void *privdata);
+
+#define zbtLength(zbt) ((zbt)->length)
+#define zbtIterScore(it) ((it)->leaf->scores[(it)->pos])
+#define zbtIterEle(it) ((it)->leaf->eles[(it)->pos])
+
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+void zbtInsert(zbtree *zbt, double score, sds ele);
+int zbtDelete(zbtree *zbt, double score, sds ele, int free_ele);
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore);
+int zbtSeek(zbtree *zbt, zbtreeBeforeFn *before, void *privdata,
+            zbtreeIter *it, unsigned long *index);
+int zbtSeekByIndex(zbtree *zbt, unsigned long index, zbtreeIter *it);
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele);
+int zbtFirst(zbtree *zbt, zbtreeIter *it);
+int zbtLast(zbtree *zbt, zbtreeIter *it);
+int zbtNext(zbtreeIter *it);
+int zbtPrev(zbtreeIter *it);
+void zbtReplaceEle(zbtree *zbt, double score, sds oldele, sds newele);
+size_t zbtAllocSize(zbtree *zbt);
+unsigned long zbtDefragNodes(zbtree *zbt, void *(*defragfn)(void *ptr));
+
+#ifdef REDIS_TEST
+int zbtreeTest(int argc, char *argv[], int accurate);
+#endif
+
+#endif
@@ -1,19 +1,53 @@
 set defaults { appendonly {yes} appendfilename {appendonly.aof} }
 set server_path [tmpdir server.aof]
-set aof_path "$server_path/appendonly.aof"
+set aof_dirpath "$server_path/appendonlydir"
+set aof_path "$aof_dirpath/appendonly.aof.1.incr.aof"
+set aof_manifest_path "$aof_dirpath/appendonly.aof.manifest"
 
 proc append_to_aof {str} {
     upvar fp fp
     puts -nonewline $fp $str
 }
 
+# Create an AOF directory where the AOF is a single incr file.
 proc create_aof {code} {
-    upvar fp fp aof_path aof_path
+    upvar fp fp aof_path aof_path aof_dirpath aof_dirpath
+    upvar aof_manifest_path aof_manifest_path
+    file delete -force $aof_dirpath
+    file mkdir $aof_dirpath
+    set fp [open $aof_manifest_path w+]
+    puts -nonewline $fp "file appendonly.aof.1.incr.aof seq 1 type i\n"
+    close $fp
     set fp [open $aof_path w+]
     uplevel 1 $code
     close $fp
 }
 
+# Write 'content' to the file 'name' of the AOF directory.
+proc create_aof_file {name content} {
+    upvar aof_dirpath aof_dirpath
+    set fp [open "$aof_dirpath/$name" w+]
+    puts -nonewline $fp $content
+    close $fp
+}
+
+# Return the manifest lines of the files of type 'type'.
+proc aof_manifest_files {dir type} {
+    set fp [open "$dir/appendonlydir/appendonly.aof.manifest" r]
+    set lines {}
+    foreach line [split [read $fp] "\n"] {
+        if {[lindex $line 5] eq $type} {lappend lines $line}
+    }
+    close $fp
+    return $lines
+}
+
+# Return the path of the incr file the server appends to.
+proc last_incr_aof {dir} {
+    set name [lindex [lindex [aof_manifest_files $dir i] end] 1]
+    return [file join $dir appendonlydir $name]
+}
+
 proc start_server_aof {overrides code} {
     upvar defaults defaults srv srv server_path server_path
     set config [concat $defaults $overrides]
@@ -272,7 +306,7 @@ tags {"aof"} {
                 r del x
                 r setrange x [expr {int(rand()*5000000)+10000000}] x
                 r debug aof-flush-sleep 500000
-                set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+                set aof [last_incr_aof [lindex [r config get dir] 1]]
                 set size1 [file size $aof]
                 $rd get x
                 after [expr {int(rand()*30)}]
@@ -287,7 +321,7 @@ tags {"aof"} {
 
     start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
         test {GETEX should not append to AOF} {
-            set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+            set aof [last_incr_aof [lindex [r config get dir] 1]]
             r set foo bar
             set before [file size $aof]
             r getex foo
@@ -295,4 +329,252 @@ tags {"aof"} {
             assert_equal $before $after
         }
     }
+
+    ## Test that the base and incr files are loaded in order
+    create_aof {
+        append_to_aof [formatCommand incr foo]
+    }
+    create_aof_file appendonly.aof.1.base.aof [formatCommand set foo 10]
+    create_aof_file appendonly.aof.2.incr.aof [formatCommand incr foo]
+    create_aof_file appendonly.aof.manifest [join {
+        "file appendonly.aof.1.base.aof seq 1 type b"
+        "file appendonly.aof.1.incr.aof seq 1 type i"
+        "file appendonly.aof.2.incr.aof seq 2 type i" ""} "\n"]
+
+    start_server_aof [list dir $server_path] {
+        test "Multi-part AOF: base and incr files are loaded in order" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal 12 [$client get foo]
+        }
+
+        test "Multi-part AOF: new commands are appended to the last incr file" {
+            $client incr foo
+            set fp [open "$aof_dirpath/appendonly.aof.2.incr.aof" r]
+            set content [read $fp]
+            close $fp
+            assert_equal 2 [regexp -all {incr} $content]
+        }
+    }
+
+    ## Test that only the last incr file can be truncated
+    create_aof {
+        append_to_aof [formatCommand set foo hello]
+        append_to_aof [string range [formatCommand set bar world] 0 end-1]
+    }
+    create_aof_file appendonly.aof.2.incr.aof [formatCommand set foo bar]
+    create_aof_file appendonly.aof.manifest [join {
+        "file appendonly.aof.1.incr.aof seq 1 type i"
+        "file appendonly.aof.2.incr.aof seq 2 type i" ""} "\n"]
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test "Multi-part AOF: Server should have logged an error for a truncated file that is not the last" {
+            set pattern "*not the last file of the AOF*"
+            set retry 10
+            while {$retry} {
+                set result [exec tail -1 < [dict get $srv stdout]]
+                if {[string match $pattern $result]} {
+                    break
+                }
+                incr retry -1
+                after 1000
+            }
+            if {$retry == 0} {
+                error "assertion:expected error not found on config file"
+            }
+        }
+    }
+
+    ## Test that an old style AOF file is moved to the AOF directory
+    file delete -force $aof_dirpath
+    set fp [open "$server_path/appendonly.aof" w+]
+    puts -nonewline $fp [formatCommand set foo old]
+    close $fp
+
+    start_server_aof [list dir $server_path] {
+        test "AOF upgrade: the old style file is loaded as the base file" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal old [$client get foo]
+            assert {![file exists "$server_path/appendonly.aof"]}
+            assert {[file exists "$aof_dirpath/appendonly.aof"]}
+            assert_equal {{file appendonly.aof seq 1 type b}} [aof_manifest_files $server_path b]
+        }
+
+        test "AOF upgrade: new commands are appended to an incr file" {
+            $client set foo new
+            assert_equal 1 [llength [aof_manifest_files $server_path i]]
+            $client debug loadaof
+            assert_equal new [$client get foo]
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
+        test {BGREWRITEAOF replaces the AOF files with a new base and incr file} {
+            set dir [lindex [r config get dir] 1]
+            r set foo bar
+            r incr counter
+            assert_equal {} [aof_manifest_files $dir b]
+            r bgrewriteaof
+            waitForBgrewriteaof r
+            assert_match {*appendonly.aof.1.base.rdb*} [aof_manifest_files $dir b]
+            assert_match {*appendonly.aof.2.incr.aof*} [aof_manifest_files $dir i]
+            assert_equal 1 [llength [aof_manifest_files $dir i]]
+            assert_equal {} [aof_manifest_files $dir h]
+            wait_for_condition 50 100 {
+                ![file exists "$dir/appendonlydir/appendonly.aof.1.incr.aof"]
+            } else {
+                fail "The history file was not deleted"
+            }
+            r incr counter
+            r debug loadaof
+            assert_equal bar [r get foo]
+            assert_equal 2 [r get counter]
+        }
+
+        test {Commands received during BGREWRITEAOF go to the new incr file} {
+            r debug populate 100
+            r config set rdb-key-save-delay 10000
+            r bgrewriteaof
+            r incr counter
+            r set foo baz
+            waitForBgrewriteaof r
+            r config set rdb-key-save-delay 0
+            assert_match {*appendonly.aof.2.base.rdb*} [aof_manifest_files $dir b]
+            assert_match {*appendonly.aof.3.incr.aof*} [aof_manifest_files $dir i]
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+            assert_equal 3 [r get counter]
+        }
+    }
+
+    start_server {overrides {appendonly {no} appendfilename {appendonly.aof}}} {
+        test {Commands received while enabling the AOF go to the first incr file} {
+            set dir [lindex [r config get dir] 1]
+            r debug populate 100
+            r config set rdb-key-save-delay 10000
+            r config set appendonly yes
+            r incr counter
+            r set foo bar
+            waitForBgrewriteaof r
+            r config set rdb-key-save-delay 0
+            assert_equal 1 [llength [aof_manifest_files $dir b]]
+            assert_equal 1 [llength [aof_manifest_files $dir i]]
+            assert {![file exists "$dir/appendonlydir/temp-appendonly.aof.incr"]}
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfsync {no}}} {
+        test {CLIENT DURABLE replies to writes once they are fsynced} {
+            set rd [redis_deferring_client]
+            $rd client durable on
+            assert_equal OK [$rd read]
+            assert_match {*flags=D*} [$rd client info; $rd read]
+            $rd incr counter
+            assert_equal 1 [$rd read]
+            $rd get counter
+            assert_equal 1 [$rd read]
+        }
+
+        test {CLIENT DURABLE holds the replies while the fsync is not done} {
+            r config set appendfsync everysec
+            r config set no-appendfsync-on-rewrite yes
+            r debug populate 100
+            r config set rdb-key-save-delay 1000000
+            r bgrewriteaof
+            wait_for_condition 50 100 {
+                [s aof_rewrite_in_progress] == 1
+            } else {
+                fail "The AOF rewrite didn't start"
+            }
+
+            # Pipelined commands are executed once the client is unblocked.
+            $rd incr counter
+            $rd get counter
+            wait_for_condition 50 100 {
+                [s blocked_clients] == 1
+            } else {
+                fail "The durable client was not blocked"
+            }
+            assert_equal 2 [r get counter]
+            after 1100
+            assert_equal 1 [s blocked_clients]
+
+            # Allowing the fsync releases the client.
+            r config set no-appendfsync-on-rewrite no
+            assert_equal 2 [$rd read]
+            assert_equal 2 [$rd read]
+        }
+
+        test {Turning off the AOF releases the durable clients} {
+            r config set no-appendfsync-on-rewrite yes
+            $rd set foo bar
+            wait_for_condition 50 100 {
+                [s blocked_clients] == 1
+            } else {
+                fail "The durable client was not blocked"
+            }
+            r config set appendonly no
+            assert_equal OK [$rd read]
+            r config set rdb-key-save-delay 0
+
+            # Without the AOF there is nothing to wait for.
+            $rd set foo baz
+            assert_equal OK [$rd read]
+        }
+
+        test {RESET turns off CLIENT DURABLE} {
+            $rd reset
+            assert_equal RESET [$rd read]
+            $rd client info
+            assert_no_match {*flags=D*} [$rd read]
+            $rd close
+        }
+
+        test {CLIENT DURABLE ON fails without the AOF} {
+            assert_error {*requires the AOF*} {r client durable on}
+            r client durable off
+        } {OK}
+    }
+
+    start_server {overrides {appendonly {yes} appendfsync {no}}} {
+        test {CLIENT DURABLE holds the replies of blocked clients served later} {
+            set rd [redis_deferring_client]
+            $rd client durable on
+            assert_equal OK [$rd read]
+            $rd blpop mylist 0
+            wait_for_condition 50 100 {
+                [s blocked_clients] == 1
+            } else {
+                fail "The client didn't block"
+            }
+
+            # Postpone the fsyncs with an AOF rewrite in progress.
+            r config set no-appendfsync-on-rewrite yes
+            r debug populate 100
+            r config set rdb-key-save-delay 1000000
+            r bgrewriteaof
+            wait_for_condition 50 100 {
+                [s aof_rewrite_in_progress] == 1
+            } else {
+                fail "The AOF rewrite didn't start"
+            }
+
+            # The pop is done, but its reply waits for the fsync.
+            r rpush mylist a
+            assert_equal 0 [r llen mylist]
+            after 200
+            assert_equal 1 [s blocked_clients]
+
+            r config set no-appendfsync-on-rewrite no
+            assert_equal {mylist a} [$rd read]
+            r config set rdb-key-save-delay 0
+            r config set appendonly no
+            $rd close
+        }
+    }
 }
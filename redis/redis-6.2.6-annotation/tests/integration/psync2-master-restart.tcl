@@ -0,0 +1,103 @@
+start_server {tags {"psync2"}} {
+start_server {} {
+    set master [srv -1 client]
+    set master_host [srv -1 host]
+    set master_port [srv -1 port]
+    set replica [srv 0 client]
+
+    $master config set repl-backlog-persist yes
+    $master config rewrite
+    $replica replicaof $master_host $master_port
+    wait_for_condition 50 100 {
+        [status $replica master_link_status] eq {up}
+    } else {
+        fail "Replica didn't sync in time"
+    }
+
+    test {A restarted master restores its backlog with repl-backlog-persist} {
+        for {set j 0} {$j < 100} {incr j} {
+            $master set key:$j $j
+        }
+        wait_for_ofs_sync $master $replica
+
+        # The replica misses the writes done just before the restart, they
+        # can only be found in the backlog saved in the RDB file.
+        exec kill -SIGSTOP [srv 0 pid]
+        for {set j 0} {$j < 100} {incr j} {
+            $master set key:$j [string repeat x $j]
+        }
+        set replid [status $master master_replid]
+        set offset [status $master master_repl_offset]
+        restart_server -1 true false
+        set master [srv -1 client]
+        exec kill -SIGCONT [srv 0 pid]
+
+        # The saved ID is only valid up to the saved offset.
+        assert {$replid ne [status $master master_replid]}
+        assert_equal $replid [status $master master_replid2]
+        assert_equal [expr {$offset+1}] [status $master second_repl_offset]
+        assert_equal $offset [status $master master_repl_offset]
+        wait_for_condition 50 100 {
+            [status $master sync_partial_ok] == 1 &&
+            [status $replica master_link_status] eq {up}
+        } else {
+            fail "The replica didn't partially resync"
+        }
+        assert_equal 0 [status $master sync_full]
+        wait_for_ofs_sync $master $replica
+        assert_equal [$master debug digest] [$replica debug digest]
+    }
+
+    test {A replica ahead of the saved backlog does a full sync} {
+        for {set j 0} {$j < 10} {incr j} {
+            $master set key:$j $j
+        }
+        wait_for_ofs_sync $master $replica
+        $master save
+
+        # The replica gets writes that are not in the RDB file, lost by the
+        # master since it restarts without saving, like after a crash.
+        $master config set save ""
+        $master config rewrite
+        # Its length is the one of the SELECT and SET sent after the
+        # restart, so that a partial resync would silently diverge.
+        $master set key:0 [string repeat x 27]
+        wait_for_ofs_sync $master $replica
+        exec kill -SIGSTOP [srv 0 pid]
+        restart_server -1 true false
+        set master [srv -1 client]
+        $master set key:0 other
+        exec kill -SIGCONT [srv 0 pid]
+
+        wait_for_condition 50 100 {
+            [status $master sync_full] == 1 &&
+            [status $replica master_link_status] eq {up}
+        } else {
+            fail "The replica didn't do a full sync"
+        }
+        wait_for_ofs_sync $master $replica
+        assert_equal other [$replica get key:0]
+        $master config set save "900 1"
+    }
+
+    test {Without repl-backlog-persist the replica does a full sync} {
+        $master config set repl-backlog-persist no
+        $master config rewrite
+        $master set foo bar
+        wait_for_ofs_sync $master $replica
+        set replid [status $master master_replid]
+        restart_server -1 true false
+        set master [srv -1 client]
+
+        assert {$replid ne [status $master master_replid]}
+        wait_for_condition 50 100 {
+            [status $master sync_full] == 1 &&
+            [status $replica master_link_status] eq {up}
+        } else {
+            fail "The replica didn't resync"
+        }
+        wait_for_ofs_sync $master $replica
+        assert_equal [$master debug digest] [$replica debug digest]
+    }
+}
+}
@@ -23,6 +23,13 @@ start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rd
 "0","zset","zset","a","1","b","2","c","3","aa","10","bb","20","cc","30","aaa","100","bbb","200","ccc","300","aaaa","1000","cccc","123456789","bbbb","5000000000",
 "0","zset_zipped","zset","a","1","b","2","c","3",
 }
+
+  test "RDB load ziplist zset and hash: converts to listpack" {
+    r select 0
+    assert_encoding listpack hash_zipped
+    assert_encoding listpack zset_zipped
+    assert_encoding quicklist list_zipped
+  }
 }
 
 set server_path [tmpdir "server.rdb-startup-test"]
@@ -202,6 +209,162 @@ test {client freed during loading} {
     }
 }
 
+start_server {overrides {save ""}} {
+    test {Parallel RDB loading produces the same dataset} {
+        createComplexDataset r 10000
+        # Large values are LZF compressed, streams are loaded inline.
+        for {set j 0} {$j < 100} {incr j} {
+            r set bigkey:$j [string repeat "abcd$j" 1000]
+            r xadd stream:$j * field $j
+            r pexpire bigkey:$j 1000000
+        }
+        set digest [r debug digest]
+        set keys [r dbsize]
+        set expires [scan [regexp -inline {expires\=([\d]*)} [r info keyspace]] expires=%d]
+        foreach threads {1 4} {
+            r config set rdb-load-threads $threads
+            r debug reload
+            assert_equal $digest [r debug digest]
+            assert_equal $keys [r dbsize]
+            assert_equal $expires [scan [regexp -inline {expires\=([\d]*)} [r info keyspace]] expires=%d]
+        }
+        r config set rdb-load-threads 0
+    }
+
+    test {Parallel RDB loading skips already expired keys} {
+        r flushall
+        r config set rdb-load-threads 2
+        r debug set-active-expire 0
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j $j px 50
+            r set persistent:$j $j
+        }
+        after 100
+        r debug reload
+        r debug set-active-expire 1
+        r config set rdb-load-threads 0
+        assert_equal 1000 [r dbsize]
+    }
+
+    test {Parallel RDB saving produces the same dataset} {
+        r flushall
+        createComplexDataset r 10000
+        r select 10
+        for {set j 0} {$j < 100} {incr j} {
+            r set bigkey:$j [string repeat "abcd$j" 1000]
+            r xadd stream:$j * field $j
+            r pexpire bigkey:$j 1000000
+        }
+        r select 9
+        # Smaller DBs are saved by the main thread of the child.
+        r debug populate 20000
+        set digest [r debug digest]
+        r config set rdb-save-threads 4
+        r bgsave
+        waitForBgsave r
+        r config set rdb-save-threads 0
+        r debug reload nosave
+        assert_equal $digest [r debug digest]
+    }
+}
+
+start_server {} {
+    test {RDB compression algorithms produce loadable files} {
+        createComplexDataset r 1000
+        r debug populate 1000 key 200
+        set digest [r debug digest]
+        foreach algo {lz4 zstd lzf} {
+            if {[catch {r config set rdb-compression-algorithm $algo}]} {
+                # Not supported by this build.
+                continue
+            }
+            # The file saved with the previous algorithm is loaded, then
+            # saved again with the new one.
+            r debug reload
+            assert_equal $digest [r debug digest]
+        }
+    }
+
+    test {RDB compression algorithm must be supported by the build} {
+        foreach algo {lz4 zstd} {
+            catch {r config set rdb-compression-algorithm $algo} e
+            assert {$e eq {OK} || [string match {*not supported*} $e]}
+        }
+        r config set rdb-compression-algorithm lzf
+        catch {r config set rdb-compression-algorithm brotli} e
+        assert_match {*argument must be one of*} $e
+    }
+}
+
+start_server {overrides {bgsave-forkless yes}} {
+    test {Forkless BGSAVE saves the dataset as it was when it started} {
+        r select 9
+        r debug populate 2000 a 100
+        r select 10
+        r debug populate 2000 b 100
+        for {set j 0} {$j < 100} {incr j} {
+            r rpush list:$j a b c
+            r pexpire b:$j 1000000
+        }
+        set digest [r debug digest]
+
+        r config set rdb-key-save-delay 1000
+        r bgsave
+        assert_equal 1 [s rdb_bgsave_in_progress]
+        verify_log_message 0 "*Background saving started without forking*" 0
+        # Modify keys the snapshot may not have reached yet, in both DBs.
+        for {set j 0} {$j < 50} {incr j} {
+            r set b:$j changed
+            r rpush list:$j d
+            r del b:[expr {$j+1000}]
+            r set new:$j foo
+            r select 9
+            r append a:$j x
+            r expire a:[expr {$j+1000}] 100000
+            r select 10
+        }
+        r config set rdb-key-save-delay 0
+        waitForBgsave r
+        assert_equal ok [s rdb_last_bgsave_status]
+        r debug reload nosave
+        assert_equal $digest [r debug digest]
+    }
+
+    test {Forkless BGSAVE is aborted by FLUSHALL} {
+        r config set rdb-key-save-delay 1000
+        r bgsave
+        assert_equal 1 [s rdb_bgsave_in_progress]
+        catch {r bgsave} e
+        assert_match {*already in progress*} $e
+        r flushall
+        assert_equal 0 [s rdb_bgsave_in_progress]
+        r config set rdb-key-save-delay 0
+        verify_log_message 0 "*Background saving aborted*" 0
+        r set foo bar
+        r bgsave
+        waitForBgsave r
+        r debug reload nosave
+        assert_equal bar [r get foo]
+    }
+}
+
+test {Loading progress reports keys and rates} {
+    start_server [list overrides [list key-load-delay 10 rdbcompression no rdb-load-threads 2]] {
+        # The server processes events only once in 2mb, see the test above.
+        r debug populate 100000 key 1000
+        restart_server 0 false false
+        wait_for_condition 50 100 {
+            [s loading_loaded_keys] > 0
+        } else {
+            fail "loading progress not reported"
+        }
+        assert_equal [s loading] 1
+        assert {[s loading_keys_per_sec] >= 0}
+        assert {[s loading_bytes_per_sec] >= 0}
+        exec kill [srv 0 pid]
+    }
+}
+
 # Our COW metrics (Private_Dirty) work only on Linux
 set system_name [string tolower [exec uname -s]]
 if {$system_name eq {linux}} {
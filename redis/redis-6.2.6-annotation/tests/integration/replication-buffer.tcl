@@ -0,0 +1,105 @@
+start_server {tags {"repl"}} {
+start_server {} {
+start_server {} {
+start_server {} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    $master config set repl-backlog-size 16384
+    $master config set client-output-buffer-limit "replica 0 0 0"
+
+    # Make the BGSAVE slow, so that the replicas wait for it, all together,
+    # while the stream is accumulated for them.
+    $master debug populate 20
+    $master config set rdb-key-save-delay 500000
+    foreach j {-1 -2 -3} {
+        [srv $j client] replicaof $master_host $master_port
+    }
+    wait_for_condition 50 100 {
+        [string match {*state=wait_bgsave*state=wait_bgsave*state=wait_bgsave*} [$master info replication]]
+    } else {
+        fail "Replicas didn't start to sync in time"
+    }
+    $master config set rdb-key-save-delay 0
+
+    test {All replicas share one replication buffer} {
+        set rd [redis_deferring_client]
+        set val [string repeat x 10000]
+        for {set j 0} {$j < 1000} {incr j} {
+            $rd set key:$j $val
+        }
+        for {set j 0} {$j < 1000} {incr j} {
+            $rd read
+        }
+        $rd close
+        assert_match {*state=wait_bgsave*} [$master info replication]
+        set repl_buf [s mem_total_replication_buffers]
+        set slaves [s mem_clients_slaves]
+        set backlog [s mem_replication_backlog]
+
+        # The stream is stored only once for the three replicas.
+        assert {$repl_buf > 10000000 && $repl_buf < 11000000}
+        assert {$slaves + $backlog < $repl_buf + 1024*1024}
+    }
+
+    test {The replication buffer is freed once sent to all the replicas} {
+        wait_for_condition 100 100 {
+            [string match {*state=online*state=online*state=online*} [$master info replication]]
+        } else {
+            fail "Replicas didn't sync in time"
+        }
+        foreach j {-1 -2 -3} {
+            wait_for_ofs_sync $master [srv $j client]
+        }
+        wait_for_condition 50 100 {
+            [s mem_total_replication_buffers] < 128*1024
+        } else {
+            fail "The replication buffer was not freed"
+        }
+        foreach j {-1 -2 -3} {
+            assert_equal [$master debug digest] [[srv $j client] debug digest]
+        }
+    }
+
+    test {Shrinking repl-backlog-size frees the exceeding blocks} {
+        $master config set repl-backlog-size 1mb
+        set val [string repeat y 1000]
+        for {set j 0} {$j < 2000} {incr j} {
+            $master set key:$j $val
+        }
+        assert {[s repl_backlog_histlen] >= 1024*1024}
+        $master config set repl-backlog-size 16384
+        wait_for_condition 50 100 {
+            [s repl_backlog_histlen] < 64*1024 &&
+            [s mem_total_replication_buffers] < 128*1024
+        } else {
+            fail "The backlog was not trimmed"
+        }
+    }
+
+    test {Partial resync from a replica far behind the master} {
+        $master config set repl-backlog-size 10mb
+        set replica [srv -1 client]
+        set partial_ok [s sync_partial_ok]
+        exec kill -SIGSTOP [srv -1 pid]
+        set val [string repeat z 1000]
+        for {set j 0} {$j < 2000} {incr j} {
+            $master set key:$j $val
+        }
+        $master client kill type replica
+        exec kill -SIGCONT [srv -1 pid]
+        wait_for_condition 50 100 {
+            [s sync_partial_ok] > $partial_ok &&
+            [status $replica master_link_status] eq {up}
+        } else {
+            fail "The replica didn't partially resync"
+        }
+        foreach j {-1 -2 -3} {
+            wait_for_ofs_sync $master [srv $j client]
+            assert_equal [$master debug digest] [[srv $j client] debug digest]
+        }
+    }
+}
+}
+}
+}
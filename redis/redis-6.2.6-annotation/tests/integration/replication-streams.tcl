@@ -0,0 +1,108 @@
+proc populate_streams_dataset {r} {
+    $r select 9
+    $r debug populate 20000 key 100
+    $r select 0
+    $r debug populate 10000 other 10
+    for {set j 0} {$j < 500} {incr j} {
+        $r hset hash:$j f1 v1 f2 v2
+        $r rpush list:$j a b c
+        $r sadd set:$j 1 2 3
+        $r zadd zset:$j 1 a 2 b
+        $r set volatile:$j $j px 1000000
+    }
+    $r xadd stream * field value
+    $r xadd stream * field value2
+    $r select 9
+}
+
+start_server {tags {"repl"}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    $master config set repl-diskless-sync yes
+    $master config set repl-diskless-sync-delay 0
+    $master config set repl-diskless-sync-streams 4
+    populate_streams_dataset $master
+
+    start_server {} {
+        set replica [srv 0 client]
+        $replica config set repl-diskless-load swapdb
+        $replica config set rdb-load-threads 2
+
+        test {Full sync over multiple streams} {
+            $replica replicaof $master_host $master_port
+            wait_for_condition 100 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Replica didn't sync in time"
+            }
+            wait_for_ofs_sync $master $replica
+            verify_log_message -1 "*Background RDB transfer started by pid * with 4 streams*" 0
+            verify_log_message 0 "*receiving the RDB over 4 streams*" 0
+            assert_equal [$master debug digest] [$replica debug digest]
+            assert_equal 20000 [$replica dbsize]
+            $replica select 0
+            assert_equal 12501 [$replica dbsize]
+            assert_equal 2 [$replica xlen stream]
+            $replica select 9
+        }
+
+        test {The replica keeps replicating after a multi-stream sync} {
+            $master set foo bar
+            $master select 0
+            $master xadd stream * field value3
+            $master select 9
+            wait_for_ofs_sync $master $replica
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+
+        test {A failed stream restarts the sync} {
+            $replica replicaof no one
+            $master config set rdb-key-save-delay 200
+            set loglines [count_log_lines 0]
+            $replica replicaof $master_host $master_port
+            wait_for_condition 50 100 {
+                [llength [regexp -all -inline {cmd=replconf} [$master client list type normal]]] == 3
+            } else {
+                fail "Replica didn't attach its streams in time"
+            }
+            # Killing the additional streams drops the replica.
+            $master client kill type normal
+            wait_for_log_messages 0 {"*Failed trying to load the MASTER synchronization DB from socket*"} $loglines 100 100
+            $master config set rdb-key-save-delay 0
+            wait_for_condition 100 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Replica didn't sync in time"
+            }
+            wait_for_ofs_sync $master $replica
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+    }
+
+    start_server {} {
+        set replica [srv 0 client]
+        $replica config set repl-diskless-load disabled
+
+        test {Replicas loading from disk sync over a single stream} {
+            set loglines [count_log_lines -1]
+            $replica replicaof $master_host $master_port
+            wait_for_condition 100 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Replica didn't sync in time"
+            }
+            wait_for_ofs_sync $master $replica
+            set line [wait_for_log_messages -1 {"*Background RDB transfer started by pid*"} $loglines 1 10]
+            assert {![string match "*streams*" $line]}
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+    }
+
+    test {REPLCONF rdb-stream-of is refused without a transfer waiting} {
+        set rd [redis_client]
+        catch {$rd replconf rdb-stream-of 12345 rdb-stream 1} e
+        assert_match {*No diskless transfer*} $e
+        $rd close
+    }
+}
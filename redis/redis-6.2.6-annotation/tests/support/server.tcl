@@ -24,9 +24,14 @@ proc clean_persistence config {
     # files right away, since they can accumulate and take up a lot of space
     set config [dict get $config "config"]
     set rdb [format "%s/%s" [dict get $config "dir"] "dump.rdb"]
-    set aof [format "%s/%s" [dict get $config "dir"] "appendonly.aof"]
+    if {[dict exists $config "appenddirname"]} {
+        set aofdir [dict get $config "appenddirname"]
+    } else {
+        set aofdir "appendonlydir"
+    }
+    set aof_dirpath [format "%s/%s" [dict get $config "dir"] $aofdir]
     catch {exec rm -rf $rdb}
-    catch {exec rm -rf $aof}
+    catch {exec rm -rf $aof_dirpath}
 }
 
 proc kill_server config {
@@ -43,6 +43,8 @@ set ::all_tests {
     integration/replication-3
     integration/replication-4
     integration/replication-psync
+    integration/replication-buffer
+    integration/replication-streams
     integration/aof
     integration/rdb
     integration/corrupt-dump
@@ -52,6 +54,7 @@ set ::all_tests {
     integration/psync2
     integration/psync2-reg
     integration/psync2-pingoff
+    integration/psync2-master-restart
     integration/failover
     integration/redis-cli
     integration/redis-benchmark
@@ -76,6 +79,7 @@ set ::all_tests {
     unit/oom-score-adj
     unit/shutdown
     unit/networking
+    unit/shards
 }
 # Index to the next test to run in the ::all_tests list.
 set ::next_test 0
@@ -61,15 +61,20 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
     test {Turning off AOF kills the background writing child if any} {
         r config set appendonly yes
         waitForBgrewriteaof r
-        r multi
+
+        # Start a slow AOF rewrite. Inside MULTI the rewrite is only
+        # scheduled, since opening a new incr file is not allowed there.
+        r set k v
+        r config set rdb-key-save-delay 10000000
         r bgrewriteaof
+
         r config set appendonly no
-        r exec
         wait_for_condition 50 100 {
             [string match {*Killing*AOF*child*} [exec tail -5 < [srv 0 stdout]]]
         } else {
             fail "Can't find 'Killing AOF child' into recent logs"
         }
+        r config set rdb-key-save-delay 0
     }
 
     foreach d {string int} {
@@ -126,11 +131,27 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
         }
     }
 
+    test "AOF rewrite of set with listpack encoding, string data" {
+        r flushall
+        for {set j 0} {$j < 100} {incr j} {
+            r sadd key [randstring 0 16 alpha]
+        }
+        assert_equal [r object encoding key] listpack
+        set d1 [r debug digest]
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        set d2 [r debug digest]
+        if {$d1 ne $d2} {
+            error "assertion:$d1 is not equal to $d2"
+        }
+    }
+
     foreach d {string int} {
-        foreach e {ziplist hashtable} {
+        foreach e {listpack hashtable} {
             test "AOF rewrite of hash with $e encoding, $d data" {
                 r flushall
-                if {$e eq {ziplist}} {set len 10} else {set len 1000}
+                if {$e eq {listpack}} {set len 10} else {set len 1000}
                 for {set j 0} {$j < $len} {incr j} {
                     if {$d eq {string}} {
                         set data [randstring 0 16 alpha]
@@ -153,10 +174,10 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
     }
 
     foreach d {string int} {
-        foreach e {ziplist skiplist} {
+        foreach e {listpack skiplist} {
             test "AOF rewrite of zset with $e encoding, $d data" {
                 r flushall
-                if {$e eq {ziplist}} {set len 10} else {set len 1000}
+                if {$e eq {listpack}} {set len 10} else {set len 1000}
                 for {set j 0} {$j < $len} {incr j} {
                     if {$d eq {string}} {
                         set data [randstring 0 16 alpha]
@@ -6,6 +6,20 @@ start_server {tags {"dump"}} {
         list [r exists foo] [r restore foo 0 $encoded] [r ttl foo] [r get foo]
     } {0 OK -1 bar}
 
+    test {DUMP payloads have RDB version 11 and roaring sets their own type} {
+        r config set set-large-int-encoding roaring
+        r del myset
+        for {set i 0} {$i < 1000} {incr i} { r sadd myset $i }
+        assert_encoding roaring myset
+        set encoded [r dump myset]
+        binary scan $encoded cu type
+        binary scan [string range $encoded end-9 end-8] su version
+        r del myset
+        r restore myset 0 $encoded
+        r config set set-large-int-encoding hashtable
+        list $type $version [r scard myset] [r object encoding myset]
+    } {64 11 1000 roaring}
+
     test {RESTORE can set an arbitrary expire to the materialized key} {
         r set foo bar
         set encoded [r dump foo]
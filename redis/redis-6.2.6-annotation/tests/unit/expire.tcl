@@ -411,4 +411,80 @@ start_server {tags {"expire"}} {
            {del foo}
         }
     }
+
+    test {Setting, removing and setting again the TTL of many keys} {
+        r flushall
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j $j
+            if {$j % 2} {r pexpire key:$j 100000}
+        }
+        for {set j 0} {$j < 1000} {incr j 3} {r persist key:$j}
+        for {set j 0} {$j < 1000} {incr j 5} {r expire key:$j 200}
+        r debug reload
+        assert_equal 1000 [r dbsize]
+        for {set j 0} {$j < 1000} {incr j} {
+            assert_equal $j [r get key:$j]
+            if {$j % 5 == 0} {
+                assert_range [r ttl key:$j] 100 200
+            } elseif {$j % 3 == 0 || $j % 2 == 0} {
+                assert_equal -1 [r ttl key:$j]
+            } else {
+                assert_range [r pttl key:$j] 50000 100000
+            }
+        }
+    }
+}
+
+start_server {tags {"expire"} overrides {active-expire-index yes}} {
+    test {Expires index: few short TTL keys among many long TTL keys are reclaimed} {
+        r flushall
+        r config resetstat
+        for {set j 0} {$j < 10000} {incr j} {
+            r set long:$j x ex 10000
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            r set short:$j x px [expr {100+$j}]
+        }
+        # Keys that get a new TTL, lose it or are deleted before expiring
+        # must be reclaimed according to their last TTL only.
+        r pexpire short:0 100000
+        r persist short:1
+        r set short:2 y
+        r del short:3
+        r rename short:4 renamed
+        wait_for_condition 50 100 {
+            [r dbsize] == 10003
+        } else {
+            fail "Short TTL keys not reclaimed: dbsize [r dbsize]"
+        }
+        assert_equal 96 [s expired_keys]
+        assert_equal 0 [s expire_reclaim_pending_ms]
+        assert {[s expire_reclaim_lag_max_ms] < 1000}
+        assert {[s expire_reclaim_lag_avg_ms] <= [s expire_reclaim_lag_max_ms]}
+        assert_equal {} [r get renamed]
+    }
+
+    test {Expires index: TTLs are preserved by DEBUG RELOAD, SWAPDB and FLUSHALL} {
+        r flushall
+        r set a x px 200
+        r set b x ex 10000
+        r debug reload
+        r select 9
+        r swapdb 9 10
+        r select 10
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "Key not reclaimed after DEBUG RELOAD and SWAPDB"
+        }
+        assert_range [r ttl b] 9000 10000
+        r flushall async
+        r set c x px 100
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "Key not reclaimed after FLUSHALL ASYNC"
+        }
+        r select 9
+    }
 }
@@ -166,6 +166,22 @@ start_server {tags {"info"}} {
     }
 
     start_server {} {
+        test {total_net_output_bytes counts large replies written together} {
+            r rpush biglist {*}[lrepeat 2000 [string repeat x 1000]]
+            set rd1 [redis_deferring_client]
+            set rd2 [redis_deferring_client]
+            set before [s total_net_output_bytes]
+            # Both replies are pending in the same event loop iteration.
+            r client pause 200
+            $rd1 lrange biglist 0 -1
+            $rd2 lrange biglist 0 -1
+            assert_equal 2000 [llength [$rd1 read]]
+            assert_equal 2000 [llength [$rd2 read]]
+            assert {[s total_net_output_bytes] - $before > 2*2000*1000}
+            $rd1 close
+            $rd2 close
+        }
+
         test {Unsafe command names are sanitized in INFO output} {
             catch {r host:} e
             set info [r info commandstats]
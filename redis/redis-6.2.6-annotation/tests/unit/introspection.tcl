@@ -143,10 +143,12 @@ start_server {tags {"introspection"}} {
             pidfile
             syslog-ident
             appendfilename
+            appenddirname
             supervised
             syslog-facility
             databases
             io-threads
+            shards
             logfile
             unixsocketperm
             slaveof
@@ -156,6 +158,10 @@ start_server {tags {"introspection"}} {
             aof_rewrite_cpulist
             bgsave_cpulist
             set-proc-title
+            keyspace-open-addressing
+            active-expire-index
+            bgsave-forkless
+            rdb-compression-dictionary
         }
 
         if {!$::tls} {
@@ -259,9 +259,25 @@ start_server {tags {"keyspace"}} {
         assert_equal $digest [r debug digest-value newset1]
     }
 
+    test {COPY basic usage for listpack set} {
+        r del set2 newset2
+        r sadd set2 1 2 3 a
+        assert_encoding listpack set2
+        r copy set2 newset2
+        set digest [r debug digest-value set2]
+        assert_equal $digest [r debug digest-value newset2]
+        assert_equal 1 [r object refcount set2]
+        assert_equal 1 [r object refcount newset2]
+        r del set2
+        assert_equal $digest [r debug digest-value newset2]
+    }
+
     test {COPY basic usage for hashtable set} {
         r del set2 newset2
         r sadd set2 1 2 3 a
+        for {set i 0} {$i < 200} {incr i} {
+            r sadd set2 ele:$i
+        }
         assert_encoding hashtable set2
         r copy set2 newset2
         set digest [r debug digest-value set2]
@@ -272,10 +288,10 @@ start_server {tags {"keyspace"}} {
         assert_equal $digest [r debug digest-value newset2]
     }
 
-    test {COPY basic usage for ziplist sorted set} {
+    test {COPY basic usage for listpack sorted set} {
         r del zset1 newzset1
         r zadd zset1 123 foobar
-        assert_encoding ziplist zset1
+        assert_encoding listpack zset1
         r copy zset1 newzset1
         set digest [r debug digest-value zset1]
         assert_equal $digest [r debug digest-value newzset1]
@@ -303,10 +319,10 @@ start_server {tags {"keyspace"}} {
         r config set zset-max-ziplist-entries $original_max
     }
 
-    test {COPY basic usage for ziplist hash} {
+    test {COPY basic usage for listpack hash} {
         r del hash1 newhash1
         r hset hash1 tmp 17179869184
-        assert_encoding ziplist hash1
+        assert_encoding listpack hash1
         r copy hash1 newhash1
         set digest [r debug digest-value hash1]
         assert_equal $digest [r debug digest-value newhash1]
@@ -34,3 +34,255 @@ test {CONFIG SET bind address} {
         $rd close
     }
 }
+
+start_server {overrides {io-threads 2 io-threads-do-reads yes io-threads-do-commands yes}} {
+    test {Read only commands can be executed by IO threads} {
+        r set foo bar
+        r hset myhash field value
+        r zadd myzset 1.5 member
+        r sadd myset a b c
+
+        set clients {}
+        for {set j 0} {$j < 8} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set i 0} {$i < 200} {incr i} {
+            foreach rd $clients {
+                $rd get foo
+                $rd hget myhash field
+                $rd zscore myzset member
+                $rd sismember myset b
+                $rd get nokey
+                $rd incr counter
+                $rd hget foo field
+            }
+            foreach rd $clients {
+                assert_equal bar [$rd read]
+                assert_equal value [$rd read]
+                assert_equal 1.5 [$rd read]
+                assert_equal 1 [$rd read]
+                assert_equal {} [$rd read]
+                $rd read
+                assert_error {WRONGTYPE*} {$rd read}
+            }
+        }
+        foreach rd $clients {$rd close}
+
+        # Stats are the same no matter which thread executed the commands.
+        assert_equal 1600 [r get counter]
+        assert_match {count=1600} [errorrstat WRONGTYPE r]
+        assert_match {calls=3200,*,failed_calls=1600} [cmdrstat hget r]
+        assert_equal 1600 [s total_error_replies]
+        assert {[s io_threaded_commands_processed] > 0}
+    }
+
+    test {IO threads leave commands on expired keys to the main thread} {
+        r debug set-active-expire 0
+        r psetex expiring 1 value
+        after 10
+        set rd [redis_deferring_client]
+        $rd get expiring
+        assert_equal {} [$rd read]
+        $rd close
+        assert_equal 0 [r exists expiring]
+        r debug set-active-expire 1
+    } {OK} {needs:debug}
+}
+
+start_server {} {
+    test {Large values are replied by reference} {
+        set val [string repeat x 100000]
+        r set foo $val
+        r config resetstat
+
+        # Pipeline enough replies to fill the socket buffers, so that the
+        # blocks referencing the value are still pending while it changes.
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 100} {incr j} {
+            $rd get foo
+        }
+        $rd append foo y
+        $rd get foo
+        $rd flushall async
+        $rd get foo
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal $val [$rd read]
+        }
+        assert_equal 100001 [$rd read]
+        assert_equal "${val}y" [$rd read]
+        assert_equal OK [$rd read]
+        assert_equal {} [$rd read]
+        $rd close
+        assert {[s reply_zerocopy_bytes] >= 10000000}
+    }
+
+    test {Values smaller than reply-zerocopy-threshold are copied} {
+        r set foo [string repeat x 100000]
+        r config set reply-zerocopy-threshold 200000
+        r config resetstat
+        assert_equal 100000 [string length [r get foo]]
+        assert_equal 0 [s reply_zerocopy_bytes]
+        r config set reply-zerocopy-threshold 0
+        assert_equal 100000 [string length [r get foo]]
+        assert_equal 0 [s reply_zerocopy_bytes]
+    }
+}
+
+start_server {overrides {io-threads 2}} {
+    test {Replies referencing values are sent by IO threads} {
+        set val [string repeat x 50000]
+        r set foo $val
+        set clients {}
+        for {set j 0} {$j < 8} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set i 0} {$i < 20} {incr i} {
+            foreach rd $clients {
+                $rd get foo
+                $rd ping
+            }
+            foreach rd $clients {
+                assert_equal $val [$rd read]
+                assert_equal PONG [$rd read]
+            }
+        }
+        foreach rd $clients {$rd close}
+        assert {[s reply_zerocopy_bytes] > 0}
+        assert_equal 1 [r dbsize]
+    }
+}
+
+start_server {overrides {io-threads 4}} {
+    proc io_thread_field {id field} {
+        regexp "$field=(\[0-9\]+)" [s io_thread_$id] -> value
+        return $value
+    }
+
+    test {Pending replies are spread among the IO threads} {
+        set val [string repeat x 20000]
+        r set foo $val
+        set clients {}
+        for {set j 0} {$j < 16} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set i 0} {$i < 20} {incr i} {
+            foreach rd $clients {
+                $rd get foo
+            }
+            foreach rd $clients {
+                assert_equal $val [$rd read]
+            }
+        }
+        foreach rd $clients {$rd close}
+        assert_equal 4 [s io_threads_active_num]
+        for {set j 1} {$j < 4} {incr j} {
+            assert {[io_thread_field $j active] == 1}
+            assert {[io_thread_field $j clients] > 0}
+            assert {[io_thread_field $j write_bytes] > 0}
+        }
+    }
+
+    test {Adaptive IO threads are released when idle} {
+        r config set io-threads-adaptive yes
+        wait_for_condition 100 50 {
+            [s io_threads_active_num] == 1
+        } else {
+            fail "IO threads not released"
+        }
+        assert {[io_thread_field 3 active] == 0}
+        r config set io-threads-adaptive no
+        wait_for_condition 100 50 {
+            [s io_threads_active_num] == 4
+        } else {
+            fail "IO threads not restored"
+        }
+    }
+
+    test {CONFIG RESETSTAT resets the IO threads load} {
+        r config resetstat
+        assert_equal 0 [io_thread_field 1 clients]
+        assert_equal 0 [io_thread_field 1 write_bytes]
+        assert_equal 0 [io_thread_field 1 sleeps]
+    }
+
+    # CPU time used by the IO threads, in clock ticks, on Linux.
+    proc io_threads_cpu_ticks {} {
+        set ticks 0
+        foreach task [glob -nocomplain /proc/[srv 0 pid]/task/*] {
+            if {[catch {
+                set fd [open $task/stat]
+                set stat [read $fd]
+                close $fd
+            }]} continue
+            # The fields after the thread name, from the state (3rd field).
+            set name_end [string last ")" $stat]
+            if {![string match "*(io_thd_*" [string range $stat 0 $name_end]]} continue
+            set fields [string range $stat [expr {$name_end+2}] end]
+            incr ticks [expr {[lindex $fields 11] + [lindex $fields 12]}]
+        }
+        return $ticks
+    }
+
+    test {Idle IO threads sleep instead of spinning} {
+        set clients {}
+        for {set j 0} {$j < 16} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set i 0} {$i < 10} {incr i} {
+            foreach rd $clients {$rd get foo}
+            foreach rd $clients {$rd read}
+            after 10
+        }
+        foreach rd $clients {$rd close}
+
+        # The threads are still active, but idle: no command is sent while
+        # measuring, since a small write would stop them. Spinning threads
+        # would use a CPU each.
+        if {[file exists /proc/[srv 0 pid]/task]} {
+            after 100
+            set ticks [io_threads_cpu_ticks]
+            after 1000
+            assert {[io_threads_cpu_ticks] - $ticks < 10}
+        }
+        assert {[io_thread_field 1 clients] > 0}
+        assert {[io_thread_field 1 sleeps] > 0}
+        # An idle thread isn't using the CPU.
+        after 200
+        assert_equal 0 [io_thread_field 1 utilization]
+    }
+}
+
+start_server {overrides {io-threads 2 io-threads-do-reads yes io-threads-do-commands no}} {
+    test {Errors replied by IO threads are counted without threaded commands} {
+        r set foo bar
+        set sleeper1 [redis_deferring_client]
+        set sleeper2 [redis_deferring_client]
+        set getters {}
+        set senders {}
+        for {set j 0} {$j < 16} {incr j} {
+            lappend getters [redis_deferring_client]
+            lappend senders [redis_deferring_client]
+        }
+
+        # Queue the GETs while the server sleeps, so that they are all
+        # replied in the same iteration, which activates the IO threads.
+        # The second sleep gives us the time to queue the protocol errors,
+        # that are then read and replied by the IO threads.
+        $sleeper1 debug sleep 0.5
+        foreach rd $getters {$rd get foo}
+        $sleeper2 debug sleep 0.5
+        assert_equal OK [$sleeper1 read]
+        foreach rd $senders {
+            $rd write "*1\r\n\$-5\r\n"
+            $rd flush
+        }
+        assert_equal OK [$sleeper2 read]
+        foreach rd $getters {assert_equal bar [$rd read]}
+        foreach rd $senders {assert_error {*Protocol error*} {$rd read}}
+        foreach rd [concat $getters $senders $sleeper1 $sleeper2] {$rd close}
+
+        assert {[s io_threaded_reads_processed] > 0}
+        assert_match {count=16} [errorrstat ERR r]
+        assert_equal 16 [s total_error_replies]
+    } {} {needs:debug}
+}
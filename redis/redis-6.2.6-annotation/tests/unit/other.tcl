@@ -325,6 +325,47 @@ start_server {tags {"other"}} {
     }
 }
 
+start_server {tags {"other"} overrides {keyspace-open-addressing yes}} {
+    test {Open addressing keyspace: lookups, SCAN and RANDOMKEY} {
+        r debug populate 10000
+        assert_equal 10000 [r dbsize]
+        assert_match "*open addressing*" [r debug HTSTATS 9]
+
+        # A full SCAN returns every key exactly once.
+        set keys {}
+        set cur 0
+        while 1 {
+            set res [r scan $cur count 100]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            if {$cur == 0} break
+        }
+        assert_equal 10000 [llength $keys]
+        assert_equal 10000 [llength [lsort -unique $keys]]
+
+        for {set j 0} {$j < 10000} {incr j 2} {
+            r del key:$j
+        }
+        assert_equal 5000 [r dbsize]
+        assert_equal 0 [r exists key:0]
+        assert_equal 1 [r exists key:1]
+        assert_match {key:*[13579]} [r randomkey]
+        r set foo bar
+        r get foo
+    } {bar} {needs:debug}
+
+    test {Open addressing keyspace: eviction samples keys} {
+        r flushall
+        r config set maxmemory-policy allkeys-random
+        r debug populate 20000
+        r config set maxmemory [expr {[s used_memory] - 100000}]
+        r set foo bar
+        r config set maxmemory 0
+        assert_morethan [s evicted_keys] 0
+        assert_lessthan [r dbsize] 20001
+    } {} {needs:debug}
+}
+
 proc read_proc_title {pid} {
     set fd [open "/proc/$pid/cmdline" "r"]
     set cmdline [read $fd 1024]
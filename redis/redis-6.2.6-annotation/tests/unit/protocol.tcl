@@ -207,3 +207,73 @@ start_server {tags {"regression"}} {
         $rd read
     }
 }
+
+start_server {tags {"protocol"}} {
+    test {Pipelined arguments are used from the query buffer} {
+        r config resetstat
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 100} {incr j} {
+            $rd hset myhash field:$j [string repeat v$j 30]
+            $rd mset key:$j [string repeat k$j 30] other:$j small
+        }
+        for {set j 0} {$j < 200} {incr j} {$rd read}
+        $rd close
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal [string repeat v$j 30] [r hget myhash field:$j]
+            assert_equal [string repeat k$j 30] [r get key:$j]
+            assert_equal small [r get other:$j]
+        }
+        assert {[s query_zerocopy_bytes] > 0}
+        assert_encoding raw key:0
+    }
+
+    test {Arguments still referenced after the command are copied} {
+        set name [string repeat n 60]
+        r client setname $name
+        set rd [redis_deferring_client]
+        set channel [string repeat c 100]
+        $rd subscribe $channel
+        $rd read
+        for {set j 0} {$j < 100} {incr j} {
+            r set foo [string repeat x 100]
+            $rd ping [string repeat y 100]
+        }
+        assert_equal $name [r client getname]
+        assert_equal 1 [r publish $channel hello]
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal [list pong [string repeat y 100]] [$rd read]
+        }
+        assert_equal [list message $channel hello] [$rd read]
+        $rd close
+    }
+
+    test {Queued arguments survive the reuse of the query buffer} {
+        r multi
+        for {set j 0} {$j < 10} {incr j} {
+            r set queued:$j [string repeat q$j 50]
+        }
+        r exec
+        for {set j 0} {$j < 10} {incr j} {
+            assert_equal [string repeat q$j 50] [r get queued:$j]
+        }
+    }
+
+    test {Arguments split across multiple reads} {
+        set small [string repeat s 100]
+        set big [string repeat b 100000]
+        set proto "*5\r\n\$4\r\nMSET\r\n\$2\r\nk1\r\n\$100\r\n$small\r\n"
+        append proto "\$2\r\nk2\r\n\$100000\r\n$big\r\n"
+        reconnect
+        set fd [r channel]
+        for {set j 0} {$j < 400} {incr j 37} {
+            puts -nonewline $fd [string range $proto $j [expr {$j+36}]]
+            flush $fd
+            after 1
+        }
+        puts -nonewline $fd [string range $proto $j end]
+        flush $fd
+        assert_equal OK [r read]
+        assert_equal $small [r get k1]
+        assert_equal $big [r get k2]
+    }
+}
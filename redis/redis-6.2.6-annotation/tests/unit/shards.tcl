@@ -0,0 +1,260 @@
+start_server {tags {"shards"} overrides {shards 3}} {
+    test {Connections are spread among the shards} {
+        assert_equal 3 [s shards]
+        set ids {}
+        for {set j 0} {$j < 50} {incr j} {
+            set rd [redis_client]
+            dict set ids [status $rd shard_id] 1
+            $rd close
+        }
+        assert {[dict size $ids] > 1}
+    }
+
+    test {Keys of the other shards are served from any connection} {
+        for {set j 0} {$j < 100} {incr j} {
+            r set key:$j $j
+        }
+        for {set j 0} {$j < 5} {incr j} {
+            set rd [redis_client]
+            for {set k 0} {$k < 100} {incr k} {
+                assert_equal $k [$rd get key:$k]
+            }
+            $rd close
+        }
+        assert {[s shard_forwarded_commands] > 0}
+    }
+
+    test {Pipelined forwarded commands are replied in order} {
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 100} {incr j} {
+            $rd incr counter:$j
+            $rd select 10
+            $rd incr counter:$j
+            $rd select 9
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal 1 [$rd read]
+            assert_equal OK [$rd read]
+            assert_equal 1 [$rd read]
+            assert_equal OK [$rd read]
+        }
+        $rd close
+    }
+
+    test {Forwarded replies use the protocol of the client} {
+        r hset myhash f v
+        for {set j 0} {$j < 5} {incr j} {
+            set rd [redis_client]
+            $rd hello 3
+            assert_equal {f v} [$rd hgetall myhash]
+            assert_equal {} [$rd get nokey]
+            $rd close
+        }
+    }
+
+    test {Commands using keys of different shards are rejected} {
+        assert_error {*CROSSSHARD*} {r mget key:0 key:1 key:2 key:3 key:4 key:5}
+        r mset "{tag}a" 1 "{tag}b" 2
+        r mget "{tag}a" "{tag}b"
+    } {1 2}
+
+    test {Transactions can only use keys of the shard serving the connection} {
+        r multi
+        set rejected 0
+        for {set j 0} {$j < 10} {incr j} {
+            if {[catch {r set key:$j x} e]} {
+                assert_match {*CROSSSHARD*} $e
+                incr rejected
+            }
+        }
+        assert {$rejected > 0}
+        assert_error {*EXECABORT*} {r exec}
+    }
+
+    test {Blocking commands can't wait for keys of other shards} {
+        set rejected 0
+        for {set j 0} {$j < 10} {incr j} {
+            if {[catch {r blpop list:$j 0.01} e]} {
+                assert_match {*CROSSSHARD*} $e
+                incr rejected
+            }
+        }
+        assert {$rejected > 0}
+    }
+
+    test {Scripts can't access keys of other shards} {
+        set rejected 0
+        for {set j 0} {$j < 10} {incr j} {
+            if {[catch {r eval {return redis.call('get',ARGV[1])} 0 key:$j} e]} {
+                assert_match {*another shard*} $e
+                incr rejected
+            }
+        }
+        assert {$rejected > 0}
+    }
+
+    test {The port of a sharded server can't be changed} {
+        assert_error {*sharded server*} {r config set port 0}
+    }
+
+    test {Commands about the whole keyspace are sent to all the shards} {
+        r flushall
+        set expected {}
+        for {set j 0} {$j < 100} {incr j} {
+            r set key:$j $j
+            lappend expected key:$j
+        }
+        for {set j 0} {$j < 5} {incr j} {
+            set rd [redis_client]
+            assert_equal 100 [$rd dbsize]
+            assert_equal [lsort $expected] [lsort [$rd keys key:*]]
+            $rd close
+        }
+        r flushdb
+        for {set j 0} {$j < 5} {incr j} {
+            set rd [redis_client]
+            assert_equal 0 [$rd dbsize]
+            $rd close
+        }
+    }
+
+    test {PUBLISH reaches the subscribers of all the shards} {
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            $rd subscribe chan
+            assert_equal {subscribe chan 1} [$rd read]
+            lappend clients $rd
+        }
+        assert_equal 10 [r publish chan hello]
+        foreach rd $clients {
+            assert_equal {message chan hello} [$rd read]
+            $rd close
+        }
+    }
+
+    test {CONFIG SET is applied by all the shards} {
+        r config set notify-keyspace-events KA
+        for {set j 0} {$j < 5} {incr j} {
+            set rd [redis_client]
+            assert_equal {notify-keyspace-events AK} \
+                [$rd config get notify-keyspace-events]
+            $rd close
+        }
+    }
+
+    test {Keyspace notifications reach the subscribers of all the shards} {
+        set clients {}
+        for {set j 0} {$j < 5} {incr j} {
+            set rd [redis_deferring_client]
+            $rd psubscribe __keyspace@9__:key:*
+            $rd read
+            lappend clients $rd
+        }
+        set expected {}
+        for {set j 0} {$j < 10} {incr j} {
+            r set key:$j $j
+            lappend expected __keyspace@9__:key:$j
+        }
+        foreach rd $clients {
+            set channels {}
+            for {set j 0} {$j < 10} {incr j} {
+                lappend channels [lindex [$rd read] 2]
+            }
+            assert_equal [lsort $expected] [lsort $channels]
+            $rd close
+        }
+        r config set notify-keyspace-events ""
+    }
+
+    test {Commands that can't be sent to all the shards are rejected} {
+        assert_error {*CROSSSHARD*} {r scan 0}
+        assert_error {*CROSSSHARD*} {r randomkey}
+        assert_error {*sharding*} {r config set dbfilename other.rdb}
+        r multi
+        assert_error {*CROSSSHARD*} {r dbsize}
+        r discard
+    }
+
+    test {Clients using tracking can only use the keys of their shard} {
+        assert_error {*CROSSSHARD*} {r client tracking on bcast}
+        r client tracking on
+        set rejected 0
+        for {set j 0} {$j < 10} {incr j} {
+            if {[catch {r get key:$j} e]} {
+                assert_match {*CROSSSHARD*} $e
+                incr rejected
+            }
+        }
+        r client tracking off
+        assert {$rejected > 0}
+    }
+
+    test {A sharded server can't be replicated} {
+        assert_error {*sharding*} {r replicaof 127.0.0.1 [srv 0 port]}
+        assert_error {*sharding*} {r sync}
+        assert_error {*sharding*} {r psync ? -1}
+        assert_equal master [s role]
+    }
+
+    test {Commands sent to all the shards wait for CLIENT PAUSE WRITE} {
+        r set key:0 x
+        set shard [status r shard_id]
+        while 1 {
+            set rd [redis_deferring_client]
+            $rd info server
+            if {[getInfoProperty [$rd read] shard_id] == $shard} break
+            $rd close
+        }
+        r client pause 100000 write
+        $rd flushall
+        after 200
+        assert {[r dbsize] > 0}
+        r client unpause
+        assert_equal OK [$rd read]
+        assert_equal 0 [r dbsize]
+        $rd close
+    }
+}
+
+start_server {tags {"shards"} overrides {shards 3 key-load-delay 1000 rdbcompression no}} {
+    test {Commands sent to all the shards are refused while loading} {
+        # Big values, since the events are processed every 2MB loaded.
+        set rd [redis_deferring_client]
+        set val [string repeat x 10000]
+        for {set j 0} {$j < 3000} {incr j} {
+            $rd set key:$j $val
+        }
+        for {set j 0} {$j < 3000} {incr j} {
+            $rd read
+        }
+        $rd close
+
+        restart_server 0 false false
+        assert_equal 1 [s loading]
+        assert_error {*LOADING*} {r flushall}
+        wait_for_condition 100 100 {
+            ![catch {r dbsize} e]
+        } else {
+            fail "Server didn't finish loading"
+        }
+        assert_equal 3000 [r dbsize]
+    }
+}
+
+test {A server refuses to start with the files of a missing shard} {
+    set dir [tmpdir shards]
+    close [open [file join $dir shard2-dump.rdb] w]
+    catch {exec src/redis-server --port [find_available_port $::baseport $::portcount] --dir $dir --shards 2} out
+    assert_match {*shard2-dump.rdb*Changing the number of shards*} $out
+}
+
+start_server {tags {"shards"}} {
+    test {A sharded server refuses the data of a server that is not sharded} {
+        r set foo bar
+        r save
+        set dir [lindex [r config get dir] 1]
+        catch {exec src/redis-server --port [find_available_port $::baseport $::portcount] --dir $dir --shards 2} out
+        assert_match {*Changing the number of shards*} $out
+    }
+}
@@ -120,3 +120,48 @@ start_server {
         }
     }
 }
+
+start_server {
+    tags {list ziplist}
+    overrides {
+        "list-max-ziplist-size" 16
+        "list-compress-depth" 1
+    }
+} {
+    foreach algo {lzf lz4 zstd} {
+        if {[catch {r config set list-compress-algorithm $algo}]} {
+            # Not supported by this build.
+            continue
+        }
+        test "Compressed list nodes with $algo" {
+            r del mylist
+            set mylist {}
+            for {set j 0} {$j < 1000} {incr j} {
+                set ele [string repeat "element:$j:" [randomInt 20]]
+                r rpush mylist $ele
+                lappend mylist $ele
+            }
+            assert_equal $mylist [r lrange mylist 0 -1]
+            assert_equal [lindex $mylist 500] [r lindex mylist 500]
+            set digest [r debug digest-value mylist]
+            r debug reload
+            assert_equal $digest [r debug digest-value mylist]
+        }
+    }
+
+    test {Compressed lists survive changing the algorithm} {
+        r config set list-compress-algorithm lzf
+        r del mylist
+        for {set j 0} {$j < 500} {incr j} {r rpush mylist [string repeat "a:$j:" 10]}
+        # Nodes compressed before and after the change coexist.
+        catch {r config set list-compress-algorithm lz4}
+        for {set j 0} {$j < 500} {incr j} {r rpush mylist [string repeat "b:$j:" 10]}
+        assert_equal 1000 [r llen mylist]
+        assert_equal [string repeat "a:10:" 10] [r lindex mylist 10]
+        assert_equal [string repeat "b:10:" 10] [r lindex mylist 510]
+        set digest [r debug digest-value mylist]
+        r debug reload
+        assert_equal $digest [r debug digest-value mylist]
+        r config set list-compress-algorithm lzf
+    }
+}
@@ -9,21 +9,29 @@ start_server {
         foreach entry $entries { r sadd $key $entry }
     }
 
-    test {SADD, SCARD, SISMEMBER, SMISMEMBER, SMEMBERS basics - regular set} {
-        create_set myset {foo}
-        assert_encoding hashtable myset
-        assert_equal 1 [r sadd myset bar]
-        assert_equal 0 [r sadd myset bar]
-        assert_equal 2 [r scard myset]
-        assert_equal 1 [r sismember myset foo]
-        assert_equal 1 [r sismember myset bar]
-        assert_equal 0 [r sismember myset bla]
-        assert_equal {1} [r smismember myset foo]
-        assert_equal {1 1} [r smismember myset foo bar]
-        assert_equal {1 0} [r smismember myset foo bla]
-        assert_equal {0 1} [r smismember myset bla foo]
-        assert_equal {0} [r smismember myset bla]
-        assert_equal {bar foo} [lsort [r smembers myset]]
+    foreach type {listpack hashtable} {
+        if {$type eq "hashtable"} {
+            r config set set-max-listpack-entries 0
+        }
+
+        test "SADD, SCARD, SISMEMBER, SMISMEMBER, SMEMBERS basics - $type" {
+            create_set myset {foo}
+            assert_encoding $type myset
+            assert_equal 1 [r sadd myset bar]
+            assert_equal 0 [r sadd myset bar]
+            assert_equal 2 [r scard myset]
+            assert_equal 1 [r sismember myset foo]
+            assert_equal 1 [r sismember myset bar]
+            assert_equal 0 [r sismember myset bla]
+            assert_equal {1} [r smismember myset foo]
+            assert_equal {1 1} [r smismember myset foo bar]
+            assert_equal {1 0} [r smismember myset foo bla]
+            assert_equal {0 1} [r smismember myset bla foo]
+            assert_equal {0} [r smismember myset bla]
+            assert_equal {bar foo} [lsort [r smembers myset]]
+        }
+
+        r config set set-max-listpack-entries 128
     }
 
     test {SADD, SCARD, SISMEMBER, SMISMEMBER, SMEMBERS basics - intset} {
@@ -71,12 +79,21 @@ start_server {
         create_set myset {1 2 3}
         assert_encoding intset myset
         assert_equal 1 [r sadd myset a]
+        assert_encoding listpack myset
+    }
+
+    test "SADD a non-integer against a large intset" {
+        r del myset
+        for {set i 0} {$i < 200} {incr i} { r sadd myset $i }
+        assert_encoding intset myset
+        assert_equal 1 [r sadd myset a]
         assert_encoding hashtable myset
+        assert_equal 201 [r scard myset]
     }
 
     test "SADD an integer larger than 64 bits" {
         create_set myset {213244124402402314402033402}
-        assert_encoding hashtable myset
+        assert_encoding listpack myset
         assert_equal 1 [r sismember myset 213244124402402314402033402]
         assert_equal {1} [r smismember myset 213244124402402314402033402]
     }
@@ -89,6 +106,50 @@ start_server {
         assert_encoding hashtable myset
     }
 
+    test "Set listpack is converted to hashtable when it has too many entries" {
+        r del myset
+        for {set i 0} {$i < 128} {incr i} { r sadd myset "e$i" }
+        assert_encoding listpack myset
+        assert_equal 0 [r sadd myset e0]
+        assert_equal 1 [r sadd myset e128]
+        assert_encoding hashtable myset
+        assert_equal 129 [r scard myset]
+        assert_equal 1 [r sismember myset e0]
+    }
+
+    test "Set listpack is converted to hashtable when a member is too long" {
+        create_set myset {a b c}
+        assert_encoding listpack myset
+        set long [string repeat x 65]
+        assert_equal 1 [r sadd myset $long]
+        assert_encoding hashtable myset
+        assert_equal {1 1} [r smismember myset a $long]
+    }
+
+    test "Set listpack holding both integers and strings" {
+        create_set myset {1 2 3 a}
+        assert_encoding listpack myset
+        assert_equal 0 [r sadd myset 1]
+        assert_equal {1 1 0 1} [r smismember myset 1 a 4 3]
+        assert_equal 1 [r srem myset 2]
+        assert_equal 0 [r srem myset 2]
+        assert_equal {1 3 a} [lsort [r smembers myset]]
+    }
+
+    test "Set listpack takes less memory than a hashtable" {
+        set members {}
+        for {set i 0} {$i < 64} {incr i} { lappend members "member:$i" }
+        r del mylistpackset myhashset
+        r sadd mylistpackset {*}$members
+        r config set set-max-listpack-entries 0
+        r sadd myhashset {*}$members
+        r config set set-max-listpack-entries 128
+        assert_encoding listpack mylistpackset
+        assert_encoding hashtable myhashset
+        assert_equal [lsort [r smembers mylistpackset]] [lsort [r smembers myhashset]]
+        assert {[r memory usage mylistpackset] * 2 < [r memory usage myhashset]}
+    }
+
     test {Variadic SADD} {
         r del myset
         assert_equal 3 [r sadd myset a b c]
@@ -97,26 +158,50 @@ start_server {
     }
 
     test "Set encoding after DEBUG RELOAD" {
-        r del myintset myhashset mylargeintset
+        r del myintset myhashset mylargeintset mylistpackset
         for {set i 0} {$i <  100} {incr i} { r sadd myintset $i }
         for {set i 0} {$i < 1280} {incr i} { r sadd mylargeintset $i }
         for {set i 0} {$i <  256} {incr i} { r sadd myhashset [format "i%03d" $i] }
+        for {set i 0} {$i <  100} {incr i} { r sadd mylistpackset [format "i%03d" $i] }
         assert_encoding intset myintset
         assert_encoding hashtable mylargeintset
         assert_encoding hashtable myhashset
+        assert_encoding listpack mylistpackset
 
         r debug reload
         assert_encoding intset myintset
         assert_encoding hashtable mylargeintset
         assert_encoding hashtable myhashset
+        assert_encoding listpack mylistpackset
+        assert_equal 100 [r scard mylistpackset]
+        assert_equal 1 [r sismember mylistpackset i042]
     }
 
-    test {SREM basics - regular set} {
-        create_set myset {foo bar ciao}
-        assert_encoding hashtable myset
-        assert_equal 0 [r srem myset qux]
-        assert_equal 1 [r srem myset foo]
-        assert_equal {bar ciao} [lsort [r smembers myset]]
+    test "Set listpack is converted to hashtable on load when it has too many entries" {
+        r del mylistpackset
+        for {set i 0} {$i <  100} {incr i} { r sadd mylistpackset [format "i%03d" $i] }
+        assert_encoding listpack mylistpackset
+        r config set set-max-listpack-entries 64
+        r debug reload
+        assert_encoding hashtable mylistpackset
+        assert_equal 100 [r scard mylistpackset]
+        r config set set-max-listpack-entries 128
+    }
+
+    foreach type {listpack hashtable} {
+        if {$type eq "hashtable"} {
+            r config set set-max-listpack-entries 0
+        }
+
+        test "SREM basics - $type" {
+            create_set myset {foo bar ciao}
+            assert_encoding $type myset
+            assert_equal 0 [r srem myset qux]
+            assert_equal 1 [r srem myset foo]
+            assert_equal {bar ciao} [lsort [r smembers myset]]
+        }
+
+        r config set set-max-listpack-entries 128
     }
 
     test {SREM basics - intset} {
@@ -141,7 +226,15 @@ start_server {
         r srem myset 1 2 3 4 5 6 7 8
     } {3}
 
-    foreach {type} {hashtable intset} {
+    foreach {type} {listpack hashtable intset} {
+        # Sets are built with about 200 elements, so the listpack limit is
+        # raised or dropped to get the encoding under test.
+        if {$type eq "listpack"} {
+            r config set set-max-listpack-entries 512
+        } elseif {$type eq "hashtable"} {
+            r config set set-max-listpack-entries 0
+        }
+
         for {set i 1} {$i <= 5} {incr i} {
             r del [format "set%d" $i]
         }
@@ -162,7 +255,7 @@ start_server {
         # while the tests are running -- an extra element is added to every
         # set that determines its encoding.
         set large 200
-        if {$type eq "hashtable"} {
+        if {$type ne "intset"} {
             set large foo
         }
 
@@ -235,6 +328,8 @@ start_server {
             }
             assert_equal {1 2 3 4} [lsort [r smembers setres]]
         }
+
+        r config set set-max-listpack-entries 128
     }
 
     test "SDIFF with first set empty" {
@@ -371,10 +466,237 @@ start_server {
         r sadd set2 1 2 3 a
         r srem set2 a
         assert_encoding intset set1
-        assert_encoding hashtable set2
+        assert_encoding listpack set2
         lsort [r sinter set1 set2]
     } {1 2 3}
 
+    test "SINTER and SINTERSTORE between intsets of different sizes and encodings" {
+        foreach {size1 size2 size3 mul} {10 10 10 1 5 500 500 1 20 500 100 70000 300 500 500 5000000000} {
+            r del set1{t} set2{t} set3{t} setres{t}
+            set elements {}
+            for {set i 0} {$i < $size1+$size2+$size3} {incr i} {
+                lappend elements [expr {([randomInt 2000]-1000)*$mul}]
+            }
+            r sadd set1{t} 1 {*}[lrange $elements 0 [expr {$size1-1}]]
+            r sadd set2{t} 1 5000000000 {*}[lrange $elements $size1 [expr {$size1+$size2-1}]]
+            r sadd set3{t} 1 {*}[lrange $elements [expr {$size1+$size2}] end]
+            assert_encoding intset set1{t}
+            assert_encoding intset set2{t}
+            assert_encoding intset set3{t}
+
+            set expected {}
+            foreach e [r smembers set1{t}] {
+                if {[r sismember set2{t} $e] && [r sismember set3{t} $e]} {
+                    lappend expected $e
+                }
+            }
+            set expected [lsort -integer $expected]
+            assert_equal $expected [lsort -integer [r sinter set1{t} set2{t} set3{t}]]
+            assert_equal $expected [lsort -integer [r sinter set3{t} set1{t} set2{t} set1{t}]]
+            assert_equal [llength $expected] [r sinterstore setres{t} set2{t} set3{t} set1{t}]
+            assert_encoding intset setres{t}
+            assert_equal $expected [lsort -integer [r smembers setres{t}]]
+        }
+    }
+
+    test "SINTERSTORE between intsets converts a result too large for an intset" {
+        r del set1{t} set2{t} setres{t}
+        r sadd set1{t} 1 2 3 4 5
+        r sadd set2{t} 1 2 3 4 5 6
+        r config set set-max-intset-entries 4
+        assert_equal 5 [r sinterstore setres{t} set1{t} set2{t}]
+        assert_encoding hashtable setres{t}
+        r config set set-max-intset-entries 512
+        assert_equal {1 2 3 4 5} [lsort -integer [r smembers setres{t}]]
+    }
+
+    test "Large integer sets are converted to roaring bitmaps when enabled" {
+        r config set set-large-int-encoding roaring
+        r del myset
+        for {set i 0} {$i < 512} {incr i} { r sadd myset $i }
+        assert_encoding intset myset
+        r sadd myset 512
+        assert_encoding roaring myset
+        assert_equal 513 [r scard myset]
+        assert_equal 1 [r sismember myset 100]
+        assert_equal 0 [r sismember myset 1000]
+        assert_equal 1 [r srem myset 100]
+        assert_equal 0 [r sismember myset 100]
+        r sadd myset -5 foo
+        assert_encoding hashtable myset
+        assert_equal 514 [r scard myset]
+        r config set set-large-int-encoding hashtable
+    }
+
+    test "Sparse roaring bitmaps are converted to hash tables" {
+        r config set set-large-int-encoding roaring
+        r del myset
+        for {set i 0} {$i < 2000} {incr i} { r sadd myset [expr {$i*2}] }
+        assert_encoding roaring myset
+        for {set i 1} {$i <= 300} {incr i} { r sadd myset [expr {$i*1000000}] }
+        assert_encoding hashtable myset
+        assert_equal 2300 [r scard myset]
+        r config set set-large-int-encoding hashtable
+    }
+
+    foreach {type} {intset roaring} {
+        test "SINTER, SUNION and SDIFF with roaring bitmaps and $type sets" {
+            r config set set-large-int-encoding roaring
+            r del set1{t} set2{t} set3{t} setres{t}
+            set s1 {}
+            set s2 {}
+            set s3 {}
+            for {set i 0} {$i < 3000} {incr i} {
+                set e [expr {$i*3 - 4000}]
+                r sadd set1{t} $e
+                dict set s1 $e 1
+                set e [expr {$i*5 - 4000}]
+                r sadd set2{t} $e
+                dict set s2 $e 1
+            }
+            set len [expr {$type eq {intset} ? 200 : 3000}]
+            for {set i 0} {$i < $len} {incr i} {
+                set e [expr {$i*7 - 4000}]
+                r sadd set3{t} $e
+                dict set s3 $e 1
+            }
+            assert_encoding roaring set1{t}
+            assert_encoding roaring set2{t}
+            assert_encoding $type set3{t}
+
+            set inter {}
+            set diff {}
+            foreach e [dict keys $s1] {
+                if {[dict exists $s2 $e] && [dict exists $s3 $e]} {
+                    lappend inter $e
+                }
+                if {![dict exists $s2 $e] && ![dict exists $s3 $e]} {
+                    lappend diff $e
+                }
+            }
+            set union [dict keys [dict merge $s1 $s2 $s3]]
+            set inter [lsort -integer $inter]
+            set diff [lsort -integer $diff]
+            set union [lsort -integer $union]
+
+            assert_equal $inter [lsort -integer [r sinter set1{t} set2{t} set3{t}]]
+            assert_equal $union [lsort -integer [r sunion set1{t} set2{t} set3{t}]]
+            assert_equal $diff [lsort -integer [r sdiff set1{t} set2{t} set3{t}]]
+            assert_equal [llength $inter] [r sinterstore setres{t} set3{t} set2{t} set1{t}]
+            assert_equal $inter [lsort -integer [r smembers setres{t}]]
+            assert_equal [llength $union] [r sunionstore setres{t} set1{t} set2{t} set3{t}]
+            assert_encoding roaring setres{t}
+            assert_equal $union [lsort -integer [r smembers setres{t}]]
+            assert_equal [llength $diff] [r sdiffstore setres{t} set1{t} set2{t} set3{t}]
+            assert_equal $diff [lsort -integer [r smembers setres{t}]]
+            r config set set-large-int-encoding hashtable
+        }
+    }
+
+    test "Roaring bitmaps survive DEBUG RELOAD, SSCAN, SPOP and SRANDMEMBER" {
+        r config set set-large-int-encoding roaring
+        r del myset
+        set expected {}
+        for {set i 0} {$i < 5000} {incr i} {
+            set e [expr {$i*3 - 7000}]
+            r sadd myset $e
+            lappend expected $e
+        }
+        r sadd myset -9223372036854775808 9223372036854775807
+        lappend expected -9223372036854775808 9223372036854775807
+        set expected [lsort -integer $expected]
+        r debug reload
+        assert_encoding roaring myset
+        assert_equal $expected [lsort -integer [r smembers myset]]
+
+        set cursor 0
+        set found {}
+        while 1 {
+            set res [r sscan myset $cursor count 100]
+            set cursor [lindex $res 0]
+            lappend found {*}[lindex $res 1]
+            if {$cursor == 0} break
+        }
+        assert_equal $expected [lsort -integer $found]
+
+        assert {[lsearch -exact $expected [r srandmember myset]] != -1}
+        assert_equal 10 [llength [lsort -unique [r srandmember myset 10]]]
+        set popped [r spop myset 10]
+        foreach e $popped {
+            assert_equal 0 [r sismember myset $e]
+        }
+        assert_equal [expr {5002-10}] [r scard myset]
+        r config set set-large-int-encoding hashtable
+        r debug reload
+        assert_encoding hashtable myset
+        assert_equal [expr {5002-10}] [r scard myset]
+    }
+
+    test "SSCAN of a roaring bitmap" {
+        r config set set-large-int-encoding roaring
+        r del myset
+        set expected {}
+        foreach i {-9223372036854775808 -100000 -1 0 1 65535 65536 100000
+                   9223372036854775806 9223372036854775807} {
+            r sadd myset $i
+            lappend expected $i
+        }
+        for {set i 1000} {$i < 2000} {incr i} {
+            r sadd myset $i
+            lappend expected $i
+        }
+        assert_encoding roaring myset
+        foreach count {1 7 100} {
+            set cursor 0
+            set found {}
+            while 1 {
+                set res [r sscan myset $cursor count $count]
+                set cursor [lindex $res 0]
+                # A single element may be followed by the next one.
+                assert {[llength [lindex $res 1]] <= max($count,2)}
+                lappend found {*}[lindex $res 1]
+                if {$cursor == 0} break
+            }
+            assert_equal [lsort -integer $expected] [lsort -integer $found]
+        }
+        r config set set-large-int-encoding hashtable
+    }
+
+    test "SSCAN of a roaring bitmap converted to a hash table during the scan" {
+        r config set set-large-int-encoding roaring
+        r del myset
+        set expected {}
+        for {set i -500} {$i < 500} {incr i} {
+            r sadd myset $i
+            lappend expected $i
+        }
+        assert_encoding roaring myset
+
+        # The bitmap is scanned COUNT elements at a time.
+        set cursor 0
+        set found {}
+        for {set j 0} {$j < 10} {incr j} {
+            set res [r sscan myset $cursor count 10]
+            set cursor [lindex $res 0]
+            assert {$cursor != 0}
+            assert {[llength [lindex $res 1]] <= 10}
+            lappend found {*}[lindex $res 1]
+        }
+
+        # The scan restarts once the set is a hash table, so no element is
+        # missed.
+        r sadd myset foo
+        assert_encoding hashtable myset
+        while 1 {
+            set res [r sscan myset $cursor count 10]
+            set cursor [lindex $res 0]
+            lappend found {*}[lindex $res 1]
+            if {$cursor == 0} break
+        }
+        assert_equal [lsort [concat $expected foo]] [lsort -unique $found]
+        r config set set-large-int-encoding hashtable
+    }
+
     test "SINTERSTORE against non-set should throw error" {
         r del set1{t} set2{t} set3{t} key1{t}
         r set key1{t} x
@@ -492,7 +814,11 @@ start_server {
         assert_equal 0 [r exists setres]
     }
 
-    foreach {type contents} {hashtable {a b c} intset {1 2 3}} {
+    foreach {type contents} {listpack {a b c} hashtable {a b c} intset {1 2 3}} {
+        if {$type eq "hashtable"} {
+            r config set set-max-listpack-entries 0
+        }
+
         test "SPOP basics - $type" {
             create_set myset $contents
             assert_encoding $type myset
@@ -516,18 +842,27 @@ start_server {
             }
             assert_equal $contents [lsort [array names myset]]
         }
+
+        r config set set-max-listpack-entries 128
     }
 
     foreach {type contents} {
+        listpack {a b c d e f g h i j k l m n o p q r s t u v w x y z}
         hashtable {a b c d e f g h i j k l m n o p q r s t u v w x y z} 
         intset {1 10 11 12 13 14 15 16 17 18 19 2 20 21 22 23 24 25 26 3 4 5 6 7 8 9}
     } {
+        if {$type eq "hashtable"} {
+            r config set set-max-listpack-entries 0
+        }
+
         test "SPOP with <count>" {
             create_set myset $contents
             assert_encoding $type myset
             assert_equal $contents [lsort [concat [r spop myset 11] [r spop myset 9] [r spop myset 0] [r spop myset 4] [r spop myset 1] [r spop myset 0] [r spop myset 1] [r spop myset 0]]]
             assert_equal 0 [r scard myset]
         }
+
+        r config set set-max-listpack-entries 128
     }
 
     # As seen in intsetRandomMembers
@@ -602,6 +937,15 @@ start_server {
     r readraw 0
 
     foreach {type contents} {
+        listpack {
+            1 5 10 50 125 50000 33959417 4775547 65434162
+            12098459 427716 483706 2726473884 72615637475
+            MARY PATRICIA LINDA BARBARA ELIZABETH JENNIFER MARIA
+            SUSAN MARGARET DOROTHY LISA NANCY KAREN BETTY HELEN
+            SANDRA DONNA CAROL RUTH SHARON MICHELLE LAURA SARAH
+            KIMBERLY DEBORAH JESSICA SHIRLEY CYNTHIA ANGELA MELISSA
+            BRENDA AMY ANNA REBECCA VIRGINIA KATHLEEN
+        }
         hashtable {
             1 5 10 50 125 50000 33959417 4775547 65434162
             12098459 427716 483706 2726473884 72615637475
@@ -618,8 +962,13 @@ start_server {
             40 41 42 43 44 45 46 47 48 49
         }
     } {
+        if {$type eq "hashtable"} {
+            r config set set-max-listpack-entries 0
+        }
+
         test "SRANDMEMBER with <count> - $type" {
             create_set myset $contents
+            assert_encoding $type myset
             unset -nocomplain myset
             array set myset {}
             foreach ele [r smembers myset] {
@@ -707,9 +1056,15 @@ start_server {
                 assert {$iterations != 0}
             }
         }
+
+        r config set set-max-listpack-entries 128
     }
 
     foreach {type contents} {
+        listpack {
+            1 5 10 50 125
+            MARY PATRICIA LINDA BARBARA ELIZABETH
+        }
         hashtable {
             1 5 10 50 125
             MARY PATRICIA LINDA BARBARA ELIZABETH
@@ -718,8 +1073,13 @@ start_server {
             0 1 2 3 4 5 6 7 8 9
         }
     } {
+        if {$type eq "hashtable"} {
+            r config set set-max-listpack-entries 0
+        }
+
         test "SRANDMEMBER histogram distribution - $type" {
             create_set myset $contents
+            assert_encoding $type myset
             unset -nocomplain myset
             array set myset {}
             foreach ele [r smembers myset] {
@@ -746,13 +1106,15 @@ start_server {
                 assert_lessthan [chi_square_value $allkey] 40
             }
         }
+
+        r config set set-max-listpack-entries 128
     }
 
     proc setup_move {} {
         r del myset3 myset4
         create_set myset1 {1 a b}
         create_set myset2 {2 3 4}
-        assert_encoding hashtable myset1
+        assert_encoding listpack myset1
         assert_encoding intset myset2
     }
 
@@ -762,7 +1124,7 @@ start_server {
         assert_equal 1 [r smove myset1 myset2 a]
         assert_equal {1 b} [lsort [r smembers myset1]]
         assert_equal {2 3 4 a} [lsort [r smembers myset2]]
-        assert_encoding hashtable myset2
+        assert_encoding listpack myset2
 
         # move an integer element should not convert the encoding
         setup_move
@@ -798,7 +1160,7 @@ start_server {
         assert_equal 1 [r smove myset1 myset3 a]
         assert_equal {1 b} [lsort [r smembers myset1]]
         assert_equal {a} [lsort [r smembers myset3]]
-        assert_encoding hashtable myset3
+        assert_encoding listpack myset3
     }
 
     test "SMOVE from intset to non existing destination set" {
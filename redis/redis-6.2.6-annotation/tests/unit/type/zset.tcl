@@ -9,12 +9,16 @@ start_server {tags {"zset"}} {
     proc basics {encoding} {
         set original_max_entries [lindex [r config get zset-max-ziplist-entries] 1]
         set original_max_value [lindex [r config get zset-max-ziplist-value] 1]
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             r config set zset-max-ziplist-entries 128
             r config set zset-max-ziplist-value 64
         } elseif {$encoding == "skiplist"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
+        } elseif {$encoding == "btree"} {
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+            r config set zset-large-encoding btree
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -995,10 +999,12 @@ start_server {tags {"zset"}} {
 
         r config set zset-max-ziplist-entries $original_max_entries
         r config set zset-max-ziplist-value $original_max_value
+        r config set zset-large-encoding skiplist
     }
 
-    basics ziplist
+    basics listpack
     basics skiplist
+    basics btree
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
@@ -1013,7 +1019,7 @@ start_server {tags {"zset"}} {
         r zrange out 0 -1 withscores
     } {neginf 0}
 
-    test {ZINTERSTORE #516 regression, mixed sets and ziplist zsets} {
+    test {ZINTERSTORE #516 regression, mixed sets and listpack zsets} {
         r sadd one 100 101 102 103
         r sadd two 100 200 201 202
         r zadd three 1 500 1 501 1 502 1 503 1 100
@@ -1094,7 +1100,7 @@ start_server {tags {"zset"}} {
     proc stressers {encoding} {
         set original_max_entries [lindex [r config get zset-max-ziplist-entries] 1]
         set original_max_value [lindex [r config get zset-max-ziplist-value] 1]
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             # Little extra to allow proper fuzzing in the sorting stresser
             r config set zset-max-ziplist-entries 256
             r config set zset-max-ziplist-value 64
@@ -1103,6 +1109,12 @@ start_server {tags {"zset"}} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
             if {$::accurate} {set elements 1000} else {set elements 100}
+        } elseif {$encoding == "btree"} {
+            r config set zset-max-ziplist-entries 0
+            r config set zset-max-ziplist-value 0
+            r config set zset-large-encoding btree
+            # Enough elements to have a few levels of nodes
+            if {$::accurate} {set elements 5000} else {set elements 1000}
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -1520,11 +1532,13 @@ start_server {tags {"zset"}} {
         }
         r config set zset-max-ziplist-entries $original_max_entries
         r config set zset-max-ziplist-value $original_max_value
+        r config set zset-large-encoding skiplist
     }
 
     tags {"slow"} {
-        stressers ziplist
+        stressers listpack
         stressers skiplist
+        stressers btree
     }
 
     test {ZSET skiplist order consistency when elements are moved} {
@@ -1553,6 +1567,52 @@ start_server {tags {"zset"}} {
         r config set zset-max-ziplist-entries $original_max
     }
 
+    test {ZSET btree and skiplist encodings stay in sync under random updates} {
+        set original_max [lindex [r config get zset-max-ziplist-entries] 1]
+        r config set zset-max-ziplist-entries 0
+        r del zsl zbt
+        r zadd zsl 0 x
+        r config set zset-large-encoding btree
+        r zadd zbt 0 x
+        r config set zset-large-encoding skiplist
+        assert_encoding skiplist zsl
+        assert_encoding btree zbt
+
+        # Enough operations to split and merge nodes at every level.
+        for {set j 0} {$j < 20000} {incr j} {
+            set ele ele-[randomInt 3000]
+            set score [randomInt 200]
+            if {[randomInt 3] == 0} {
+                set cmd [list zrem $ele]
+            } else {
+                set cmd [list zadd $score $ele]
+            }
+            assert_equal [r {*}[linsert $cmd 1 zsl]] [r {*}[linsert $cmd 1 zbt]]
+        }
+        assert_equal [r zrange zsl 0 -1 withscores] [r zrange zbt 0 -1 withscores]
+        assert_equal [r debug digest-value zsl] [r debug digest-value zbt]
+        for {set j 0} {$j < 100} {incr j} {
+            set ele ele-[randomInt 3000]
+            set min [randomInt 200]
+            set max [expr {$min+[randomInt 50]}]
+            assert_equal [r zrank zsl $ele] [r zrank zbt $ele]
+            assert_equal [r zrevrank zsl $ele] [r zrevrank zbt $ele]
+            assert_equal [r zcount zsl $min ($max] [r zcount zbt $min ($max]
+            assert_equal [r zrangebyscore zsl ($min $max limit 5 20] \
+                         [r zrangebyscore zbt ($min $max limit 5 20]
+            assert_equal [r zrevrange zsl $min $max] [r zrevrange zbt $min $max]
+        }
+
+        # Turning back into a listpack keeps the same content.
+        r zremrangebyrank zsl 10 -1
+        r zremrangebyrank zbt 10 -1
+        r config set zset-max-ziplist-entries $original_max
+        r zunionstore zsl 1 zsl
+        r zunionstore zbt 1 zbt
+        assert_encoding listpack zbt
+        assert_equal [r zrange zsl 0 -1 withscores] [r zrange zbt 0 -1 withscores]
+    }
+
     test {ZRANGESTORE basic} {
         r flushall
         r zadd z1 1 a 2 b 3 c 4 d
@@ -1676,7 +1736,7 @@ start_server {tags {"zset"}} {
         }
     }
 
-    foreach {type contents} "ziplist {1 a 2 b 3 c} skiplist {1 a 2 b 3 [randstring 70 90 alpha]}" {
+    foreach {type contents} "listpack {1 a 2 b 3 c} skiplist {1 a 2 b 3 [randstring 70 90 alpha]}" {
         set original_max_value [lindex [r config get zset-max-ziplist-value] 1]
         r config set zset-max-ziplist-value 10
         create_zset myzset $contents
@@ -1729,7 +1789,7 @@ start_server {tags {"zset"}} {
 
     foreach {type contents} "
         skiplist {1 a 2 b 3 c 4 d 5 e 6 f 7 g 7 h 9 i 10 [randstring 70 90 alpha]}
-        ziplist {1 a 2 b 3 c 4 d 5 e 6 f 7 g 7 h 9 i 10 j} " {
+        listpack {1 a 2 b 3 c 4 d 5 e 6 f 7 g 7 h 9 i 10 j} " {
         test "ZRANDMEMBER with <count> - $type" {
             set original_max_value [lindex [r config get zset-max-ziplist-value] 1]
             r config set zset-max-ziplist-value 10